@@ -26,9 +26,16 @@
 
 #include <future>
 #include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <folly/Function.h>
+#include <folly/Try.h>
 
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/fstypes.h"
+#include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
@@ -37,24 +44,117 @@ struct block_cache_options;
 class block_range;
 class fs_section;
 class logger;
+class compression_dictionary;
 class mmif;
 
+// Called exactly once with either the requested range or an error,
+// possibly from a block cache worker thread, so it must not block
+using block_range_callback = folly::Function<void(folly::Try<block_range>&&)>;
+
+struct block_cache_request {
+  size_t block_no;
+  size_t offset;
+  size_t size;
+  block_range_callback done;
+};
+
+// A snapshot of the block cache counters, can be taken at any time
+struct block_cache_stats {
+  size_t cached_blocks{0};
+  size_t cached_bytes{0};
+  size_t max_bytes{0};
+  size_t tier2_bytes{0};
+  size_t queue_size{0};
+  size_t range_requests{0};
+  size_t active_hits_fast{0};
+  size_t active_hits_slow{0};
+  size_t cache_hits_fast{0};
+  size_t cache_hits_slow{0};
+  size_t tier2_hits{0};
+  size_t disk_cache_hits{0};
+  size_t blocks_created{0};
+  size_t direct_reads{0};
+  size_t blocks_evicted{0};
+  size_t blocks_prefetched{0};
+  size_t sets_merged{0};
+  size_t inline_jobs{0};
+  size_t bytes_decompressed{0};
+  double decompress_seconds{0.0};
+};
+
 class block_cache {
  public:
   block_cache(logger& lgr, std::shared_ptr<mmif> mm,
               const block_cache_options& options);
 
+  // Creates a view of a cache that is shared by several images, so all
+  // of them are served from a single memory budget and worker pool.
+  // The shared cache itself is created without an image. Blocks are
+  // numbered per image; all images must be added before the first read,
+  // adding an image to a cache that is already in use throws.
+  block_cache(std::shared_ptr<block_cache> shared, std::shared_ptr<mmif> mm);
+
   size_t block_count() const { return impl_->block_count(); }
 
   void insert(fs_section const& section) { impl_->insert(section); }
 
+  // insert a block section that is stored in a different image and/or
+  // has been compressed using a dictionary
+  void insert(fs_section const& section, std::shared_ptr<mmif> mm,
+              std::shared_ptr<compression_dictionary const> dict = nullptr) {
+    impl_->insert(section, std::move(mm), std::move(dict));
+  }
+
   void set_block_size(size_t size) { impl_->set_block_size(size); }
 
   void set_num_workers(size_t num) { impl_->set_num_workers(num); }
 
+  // Changes the memory budget at runtime; when shrinking, blocks are
+  // evicted until the cache fits and the freed memory is returned to
+  // the OS
+  void set_max_bytes(size_t max_bytes) { impl_->set_max_bytes(max_bytes); }
+
   std::future<block_range>
-  get(size_t block_no, size_t offset, size_t size) const {
-    return impl_->get(block_no, offset, size);
+  get(size_t block_no, size_t offset, size_t size,
+      job_priority prio = job_priority::DEMAND) const {
+    return impl_->get(block_no, offset, size, prio);
+  }
+
+  // Never blocks; if the range is readily available, the callback is
+  // called before this returns
+  void get(size_t block_no, size_t offset, size_t size,
+           block_range_callback done,
+           job_priority prio = job_priority::DEMAND) const {
+    impl_->get(block_no, offset, size, std::move(done), prio);
+  }
+
+  // Like the above, but all requests for the same block are handled
+  // together and share a single decompression job
+  void get(std::vector<block_cache_request>&& requests,
+           job_priority prio = job_priority::DEMAND) const {
+    impl_->get(std::move(requests), prio);
+  }
+
+  void prefetch(std::vector<size_t> const& blocks) const {
+    impl_->prefetch(blocks);
+  }
+
+  std::vector<uint32_t> access_counts() const {
+    return impl_->access_counts();
+  }
+
+  block_cache_stats stats() const { return impl_->stats(); }
+
+  // Offset of the block data in the image if the block is stored
+  // uncompressed, so it can be read without going through the cache
+  std::optional<size_t> uncompressed_offset(size_t block_no) const {
+    return impl_->uncompressed_offset(block_no);
+  }
+
+  // Same as above, but for a block stored in `image`
+  std::optional<size_t>
+  uncompressed_offset(size_t block_no, mmif const& image) const {
+    return impl_->uncompressed_offset(block_no, image);
   }
 
   class impl {
@@ -63,10 +163,26 @@ class block_cache {
 
     virtual size_t block_count() const = 0;
     virtual void insert(fs_section const& section) = 0;
+    virtual void
+    insert(fs_section const& section, std::shared_ptr<mmif> mm,
+           std::shared_ptr<compression_dictionary const> dict) = 0;
     virtual void set_block_size(size_t size) = 0;
     virtual void set_num_workers(size_t num) = 0;
+    virtual void set_max_bytes(size_t max_bytes) = 0;
     virtual std::future<block_range>
-    get(size_t block_no, size_t offset, size_t length) const = 0;
+    get(size_t block_no, size_t offset, size_t length,
+        job_priority prio) const = 0;
+    virtual void get(size_t block_no, size_t offset, size_t length,
+                     block_range_callback done, job_priority prio) const = 0;
+    virtual void get(std::vector<block_cache_request>&& requests,
+                     job_priority prio) const = 0;
+    virtual void prefetch(std::vector<size_t> const& blocks) const = 0;
+    virtual std::vector<uint32_t> access_counts() const = 0;
+    virtual block_cache_stats stats() const = 0;
+    virtual std::optional<size_t>
+    uncompressed_offset(size_t block_no) const = 0;
+    virtual std::optional<size_t>
+    uncompressed_offset(size_t block_no, mmif const& image) const = 0;
   };
 
  private:
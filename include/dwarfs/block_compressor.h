@@ -45,6 +45,36 @@ class bad_compression_ratio_error : public std::runtime_error {
       : std::runtime_error{"bad compression ratio"} {}
 };
 
+/**
+ * A dictionary shared by all blocks of a filesystem image
+ *
+ * Currently only supported by zstd. Small blocks compress a lot better
+ * with a dictionary trained from samples of the input data.
+ */
+class compression_dictionary {
+ public:
+  explicit compression_dictionary(std::vector<uint8_t> data);
+  ~compression_dictionary();
+
+  std::vector<uint8_t> const& data() const { return data_; }
+
+  /**
+   * Train a dictionary of at most `max_size` bytes from a buffer of
+   * concatenated samples.
+   */
+  static std::vector<uint8_t> train(std::vector<uint8_t> const& samples,
+                                    std::vector<size_t> const& sample_sizes,
+                                    size_t max_size);
+
+  class impl;
+
+  impl const& get_impl() const { return *impl_; }
+
+ private:
+  std::vector<uint8_t> data_;
+  std::unique_ptr<impl> impl_;
+};
+
 class block_compressor {
  public:
   block_compressor(const std::string& spec);
@@ -63,30 +93,69 @@ class block_compressor {
     return impl_->compress(std::move(data));
   }
 
+  /**
+   * Compress into a caller-provided buffer. The buffer is resized as
+   * needed, but its capacity is never reduced, so it can be reused
+   * across calls without allocating.
+   */
+  void compress(std::vector<uint8_t> const& data,
+                std::vector<uint8_t>& out) const {
+    impl_->compress_into(data, out);
+  }
+
+  /**
+   * Same as above, but the compressor may use up to `num_threads`
+   * threads for compressing this block. The output never depends on
+   * the number of threads.
+   */
+  void compress(std::vector<uint8_t> const& data, std::vector<uint8_t>& out,
+                size_t num_threads) const {
+    impl_->compress_parallel_into(data, out, num_threads);
+  }
+
   compression_type type() const { return impl_->type(); }
 
+  /**
+   * Returns a copy of this compressor that uses `dict`. Throws if the
+   * compression algorithm doesn't support dictionaries.
+   */
+  block_compressor
+  with_dictionary(std::shared_ptr<compression_dictionary const> dict) const {
+    return block_compressor(impl_->with_dictionary(std::move(dict)));
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
 
     virtual std::unique_ptr<impl> clone() const = 0;
+    virtual std::unique_ptr<impl>
+    with_dictionary(std::shared_ptr<compression_dictionary const> dict) const;
 
     virtual std::vector<uint8_t>
-    compress(const std::vector<uint8_t>& data) const = 0;
-    virtual std::vector<uint8_t>
-    compress(std::vector<uint8_t>&& data) const = 0;
+    compress(const std::vector<uint8_t>& data) const;
+    virtual std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const;
+    virtual void compress_into(const std::vector<uint8_t>& data,
+                               std::vector<uint8_t>& out) const = 0;
+    virtual void compress_parallel_into(const std::vector<uint8_t>& data,
+                                        std::vector<uint8_t>& out,
+                                        size_t num_threads) const;
 
     virtual compression_type type() const = 0;
   };
 
  private:
+  explicit block_compressor(std::unique_ptr<impl> impl)
+      : impl_(std::move(impl)) {}
+
   std::unique_ptr<impl> impl_;
 };
 
 class block_decompressor {
  public:
   block_decompressor(compression_type type, const uint8_t* data, size_t size,
-                     std::vector<uint8_t>& target);
+                     std::vector<uint8_t>& target,
+                     compression_dictionary const* dict = nullptr);
 
   bool decompress_frame(size_t frame_size = BUFSIZ) {
     return impl_->decompress_frame(frame_size);
@@ -96,14 +165,44 @@ class block_decompressor {
 
   compression_type type() const { return impl_->type(); }
 
+  /**
+   * End offsets of the independently decompressible frames of a
+   * seekable block, or an empty vector if the block is not seekable.
+   */
+  std::vector<size_t> seekable_frames() const {
+    return impl_->seekable_frames();
+  }
+
+  void decompress_seekable_frame(size_t index) {
+    impl_->decompress_seekable_frame(index);
+  }
+
+  /**
+   * Decompress the whole block, using up to `num_threads` threads to
+   * decompress the frames of a seekable block.
+   */
+  void decompress_all(size_t num_threads) {
+    impl_->decompress_all(num_threads);
+  }
+
   static std::vector<uint8_t>
-  decompress(compression_type type, const uint8_t* data, size_t size) {
+  decompress(compression_type type, const uint8_t* data, size_t size,
+             compression_dictionary const* dict = nullptr) {
     std::vector<uint8_t> target;
-    block_decompressor bd(type, data, size, target);
+    block_decompressor bd(type, data, size, target, dict);
     bd.decompress_frame(bd.uncompressed_size());
     return target;
   }
 
+  static std::vector<uint8_t>
+  decompress_parallel(compression_type type, const uint8_t* data, size_t size,
+                      size_t num_threads) {
+    std::vector<uint8_t> target;
+    block_decompressor bd(type, data, size, target);
+    bd.decompress_all(num_threads);
+    return target;
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
@@ -112,6 +211,14 @@ class block_decompressor {
     virtual size_t uncompressed_size() const = 0;
 
     virtual compression_type type() const = 0;
+
+    virtual std::vector<size_t> seekable_frames() const { return {}; }
+    virtual void decompress_seekable_frame(size_t /*index*/) {
+      throw std::logic_error("block is not seekable");
+    }
+    virtual void decompress_all(size_t /*num_threads*/) {
+      decompress_frame(uncompressed_size());
+    }
   };
 
  private:
@@ -22,11 +22,13 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <memory>
 #include <vector>
 
 namespace dwarfs {
 
+class block_data;
 class filesystem_writer;
 class inode;
 class logger;
@@ -42,11 +44,22 @@ class block_manager {
     size_t memory_limit{256 << 20};
     unsigned block_size_bits{22};
     unsigned bloom_filter_size{4};
+    size_t first_block{0};
+    unsigned cdc_chunk_bits{0};
+    bool detect_holes{false};
   };
 
+  // Called for each finished block along with the block number that
+  // has been used for the chunks referencing this block
+  using block_writer =
+      std::function<void(size_t num, std::shared_ptr<block_data>&& data)>;
+
   block_manager(logger& lgr, progress& prog, const config& cfg,
                 std::shared_ptr<os_access> os, filesystem_writer& fsw);
 
+  block_manager(logger& lgr, progress& prog, const config& cfg,
+                std::shared_ptr<os_access> os, block_writer writer);
+
   void add_inode(std::shared_ptr<inode> ino) { impl_->add_inode(ino); }
 
   void finish_blocks() { impl_->finish_blocks(); }
@@ -0,0 +1,272 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/align.hpp>
+
+#include "dwarfs/compiler.h"
+#include "dwarfs/error.h"
+
+namespace dwarfs {
+
+/**
+ * Building blocks of the segmenter in block_manager.cpp. These live in a
+ * header of their own so they can be benchmarked individually.
+ */
+
+constexpr unsigned bitcount(unsigned n) {
+  return n > 0 ? (n & 1) + bitcount(n >> 1) : 0;
+}
+
+constexpr uint64_t pow2ceil(uint64_t n) {
+  n--;
+  n |= n >> 1;
+  n |= n >> 2;
+  n |= n >> 4;
+  n |= n >> 8;
+  n |= n >> 16;
+  n |= n >> 32;
+  n++;
+  return n;
+}
+
+/**
+ * A flat multimap from hash values to block offsets using open addressing
+ * with linear probing. As the maximum number of entries per block is known
+ * up front, the table never needs to grow and is kept at most half full.
+ * Lookups usually touch only a single cache line.
+ */
+template <typename KeyT, typename ValT>
+class offset_table {
+ public:
+  static constexpr ValT empty_value = std::numeric_limits<ValT>::max();
+
+  explicit offset_table(size_t max_entries)
+      : bits_{max_entries > 0 ? bitcount(pow2ceil(2 * max_entries) - 1) : 0}
+      , mask_{(static_cast<size_t>(1) << bits_) - 1}
+      , slots_(max_entries > 0 ? mask_ + 1 : 0) {}
+
+  void insert(KeyT key, ValT val) {
+    DWARFS_CHECK(size_ <= mask_ / 2, "offset table capacity exceeded");
+
+    auto i = home(key);
+    size_t probes = 1;
+
+    while (slots_[i].value != empty_value) {
+      if (slots_[i].key == key) {
+        ++duplicates_;
+      }
+      i = (i + 1) & mask_;
+      ++probes;
+    }
+
+    slots_[i] = slot{key, val};
+    ++size_;
+    total_probes_ += probes;
+    max_probes_ = std::max(max_probes_, probes);
+  }
+
+  template <typename F>
+  void for_each_value(KeyT key, F&& func) const {
+    if (DWARFS_UNLIKELY(slots_.empty())) {
+      return;
+    }
+
+    for (auto i = home(key); slots_[i].value != empty_value;
+         i = (i + 1) & mask_) {
+      if (slots_[i].key == key) {
+        func(slots_[i].value);
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+  size_t duplicates() const { return duplicates_; }
+  size_t total_probes() const { return total_probes_; }
+  size_t max_probes() const { return max_probes_; }
+  size_t memory_usage() const { return slots_.size() * sizeof(slot); }
+
+ private:
+  struct slot {
+    KeyT key{0};
+    ValT value{empty_value};
+  };
+
+  size_t home(KeyT key) const {
+    return (static_cast<uint64_t>(key) * UINT64_C(0x9e3779b97f4a7c15)) >>
+           (64 - bits_);
+  }
+
+  size_t const bits_;
+  size_t const mask_;
+  std::vector<slot> slots_;
+  size_t size_{0};
+  size_t duplicates_{0};
+  size_t total_probes_{0};
+  size_t max_probes_{0};
+};
+
+/**
+ * A very simple bloom filter. This is not generalized at all and highly
+ * optimized for the cyclic hash use case.
+ *
+ * - Since we're already using a hash value, there's no need to hash the
+ *   value before accessing the bloom filter bit field.
+ *
+ * - We can accept a high false positive rate as the secondary lookup
+ *   is not very expensive. However, the bloom filter lookup must be
+ *   extremely cheap, so we can't afford e.g. using two hashes instead
+ *   of one.
+ *
+ * - The filter is blocked: all bits for a single value are located in the
+ *   same 64-bit word, so each lookup is a single memory access. The bit
+ *   positions and the word index are derived from a single multiplicative
+ *   remix of the value.
+ */
+class bloom_filter {
+ public:
+  using bits_type = uint64_t;
+
+  static constexpr size_t value_mask = 8 * sizeof(bits_type) - 1;
+  static constexpr size_t index_shift = bitcount(value_mask);
+  static constexpr size_t alignment = 64;
+
+  bloom_filter(size_t size)
+      : index_mask_{(std::max(size, value_mask + 1) >> index_shift) - 1}
+      , size_{std::max(size, value_mask + 1)} {
+    if (size & (size - 1)) {
+      throw std::runtime_error("size must be a power of two");
+    }
+    bits_ = reinterpret_cast<bits_type*>(
+        boost::alignment::aligned_alloc(alignment, size_ / 8));
+    if (!bits_) {
+      throw std::runtime_error("failed to allocate aligned memory");
+    }
+    clear();
+  }
+
+  ~bloom_filter() { boost::alignment::aligned_free(bits_); }
+
+  static constexpr size_t bits_per_value = 3;
+
+  void add(size_t ix) {
+    auto bits = bits_;
+    BOOST_ALIGN_ASSUME_ALIGNED(bits, sizeof(bits_type));
+    auto h = remix(ix);
+    bits[word_index(h)] |= word_mask(h);
+  }
+
+  bool test(size_t ix) const {
+    auto bits = bits_;
+    BOOST_ALIGN_ASSUME_ALIGNED(bits, sizeof(bits_type));
+    auto h = remix(ix);
+    auto mask = word_mask(h);
+    return (bits[word_index(h)] & mask) == mask;
+  }
+
+  void prefetch(size_t ix) const {
+    __builtin_prefetch(&bits_[word_index(remix(ix))]);
+  }
+
+  // size in bits
+  size_t size() const { return size_; }
+
+  void clear() { std::fill(begin(), end(), 0); }
+
+  void merge(bloom_filter const& other) {
+    if (size() != other.size()) {
+      throw std::runtime_error("size mismatch");
+    }
+    std::transform(cbegin(), cend(), other.cbegin(), begin(), std::bit_or<>{});
+  }
+
+ private:
+  static uint64_t remix(size_t ix) {
+    return static_cast<uint64_t>(ix) * UINT64_C(0x9e3779b97f4a7c15);
+  }
+
+  size_t word_index(uint64_t h) const { return (h >> 32) & index_mask_; }
+
+  static bits_type word_mask(uint64_t h) {
+    bits_type mask = 0;
+    for (size_t i = 0; i < bits_per_value; ++i) {
+      mask |= static_cast<bits_type>(1) << ((h >> (8 + 6 * i)) & value_mask);
+    }
+    return mask;
+  }
+
+  bits_type const* cbegin() const { return bits_; }
+  bits_type const* cend() const { return bits_ + (size_ >> index_shift); }
+  bits_type const* begin() const { return bits_; }
+  bits_type const* end() const { return bits_ + (size_ >> index_shift); }
+  bits_type* begin() { return bits_; }
+  bits_type* end() { return bits_ + (size_ >> index_shift); }
+
+  bits_type* bits_;
+  size_t const index_mask_;
+  size_t const size_;
+} __attribute__((aligned(64)));
+
+/**
+ * Checks if the `len` bytes at `pos` match the `block` data at `offset`
+ * and, if so, extends the match backwards (not beyond `begin`) and
+ * forwards (not beyond `end`). On a match, `offset` and `pos` are updated
+ * to point to the start of the match and the size of the match is
+ * returned. Returns 0 if there is no match.
+ */
+inline size_t extend_match(uint8_t const* block, size_t block_size,
+                           size_t& offset, uint8_t const*& pos, size_t len,
+                           uint8_t const* begin, uint8_t const* end) {
+  if (::memcmp(block + offset, pos, len) != 0) {
+    return 0;
+  }
+
+  // scan backward
+  auto tmp = offset;
+  while (tmp > 0 && pos > begin && block[tmp - 1] == pos[-1]) {
+    --tmp;
+    --pos;
+  }
+  len += offset - tmp;
+  offset = tmp;
+
+  // scan forward
+  auto p = pos + len;
+  tmp = offset + len;
+  while (tmp < block_size && p < end && block[tmp] == *p) {
+    ++tmp;
+    ++p;
+  }
+
+  return tmp - offset;
+}
+
+} // namespace dwarfs
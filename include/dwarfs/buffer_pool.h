@@ -0,0 +1,77 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace dwarfs {
+
+/**
+ * A pool of reusable byte buffers
+ *
+ * Blocks are typically all of the same size, so instead of allocating
+ * (and page-faulting) a fresh buffer for every block, buffers that are no
+ * longer needed can be handed back to the pool and reused. Fresh buffers
+ * are advised to be backed by huge pages where the OS supports it.
+ *
+ * The pool is thread-safe and holds on to at most `max_bytes` worth of
+ * buffer capacity.
+ */
+class buffer_pool {
+ public:
+  explicit buffer_pool(size_t max_bytes);
+
+  buffer_pool(buffer_pool const&) = delete;
+  buffer_pool& operator=(buffer_pool const&) = delete;
+
+  /**
+   * Returns an empty buffer, reusing a pooled one if possible. The buffer
+   * will have at least `min_capacity` bytes of capacity, or the capacity
+   * of the largest buffer seen so far if `min_capacity` is zero.
+   */
+  std::vector<uint8_t> acquire(size_t min_capacity = 0);
+
+  /**
+   * Hands a buffer back to the pool. The buffer is dropped if the pool
+   * is already full.
+   */
+  void release(std::vector<uint8_t> buf);
+
+  /**
+   * Changes the maximum pooled capacity, dropping buffers if necessary.
+   */
+  void set_max_bytes(size_t max_bytes);
+
+  size_t size() const;
+
+ private:
+  size_t max_bytes_;
+  mutable std::mutex mx_;
+  std::vector<std::vector<uint8_t>> buffers_;
+  size_t pooled_bytes_{0};
+  size_t max_capacity_{0};
+};
+
+} // namespace dwarfs
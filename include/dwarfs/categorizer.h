@@ -0,0 +1,63 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <folly/Range.h>
+
+namespace dwarfs {
+
+class file;
+class script;
+
+/**
+ * Assigns files to categories based on their contents
+ *
+ * The built-in rules look at the first few bytes of a file to identify
+ * already compressed data, executables and text. If a script is given
+ * that implements categorize(), it takes precedence over the built-in
+ * rules unless it returns an empty string.
+ */
+class categorizer {
+ public:
+  static constexpr char const* DEFAULT = "default";
+  static constexpr char const* COMPRESSED = "compressed";
+  static constexpr char const* EXECUTABLE = "executable";
+  static constexpr char const* TEXT = "text";
+
+  // number of bytes from the start of a file used for categorization
+  static constexpr size_t head_size = 4096;
+
+  explicit categorizer(std::shared_ptr<script> scr = nullptr);
+
+  std::string categorize(file const& f, folly::ByteRange head) const;
+
+ private:
+  std::shared_ptr<script> script_;
+  mutable std::mutex script_mx_;
+};
+
+} // namespace dwarfs
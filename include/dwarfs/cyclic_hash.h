@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <stdexcept>
 
@@ -44,6 +45,32 @@ class rsync_hash {
     b_ += a_;
   }
 
+  /**
+   * Compute hashes for the next `n` window positions
+   *
+   * This is equivalent to storing `operator()()` and then calling
+   * `update(p[i - window_size], p[i])` for each `i` in `[0, n)`, but
+   * allows the caller to look at multiple hash values in advance, e.g.
+   * to prefetch the memory needed to look them up. `p` must point just
+   * past the current window.
+   */
+  void update(uint8_t const* p, size_t n, uint32_t* out) {
+    auto a = a_;
+    auto b = b_;
+    auto const len = static_cast<uint16_t>(len_);
+    auto const q = p - len_;
+
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = a | (uint32_t(b) << 16);
+      auto const outbyte = static_cast<int8_t>(q[i]);
+      a = a - outbyte + static_cast<int8_t>(p[i]);
+      b = b - len * outbyte + a;
+    }
+
+    a_ = a;
+    b_ = b;
+  }
+
   void clear() {
     a_ = 0;
     b_ = 0;
@@ -0,0 +1,85 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include <folly/Range.h>
+
+namespace dwarfs {
+
+class logger;
+class mmif;
+
+/**
+ * Persistent cache of decompressed blocks
+ *
+ * Each entry is stored as a separate file in the cache directory, so
+ * the cache can be shared between multiple processes. New entries are
+ * written to a temporary file first, synced and then renamed, so readers
+ * will never see partially written entries. Each entry ends with the
+ * size and checksum of its data, which are verified whenever the entry
+ * is used. If the total size of all known entries exceeds the limit,
+ * the least recently used entries are removed.
+ *
+ * Entries are written by a background thread; if it can't keep up,
+ * new entries are dropped rather than blocking the caller.
+ */
+class disk_cache {
+ public:
+  struct entry {
+    folly::ByteRange data;
+    // keeps `data` alive
+    std::shared_ptr<mmif> mm;
+  };
+
+  disk_cache(logger& lgr, std::string const& dir, size_t max_bytes);
+
+  // Returns std::nullopt if there's no entry or it is corrupt
+  std::optional<entry> find(std::string const& key) const {
+    return impl_->find(key);
+  }
+
+  // `data` must remain valid for as long as `owner` is alive
+  void store(std::string const& key, folly::ByteRange data,
+             std::shared_ptr<void const> owner) const {
+    impl_->store(key, data, std::move(owner));
+  }
+
+  class impl {
+   public:
+    virtual ~impl() = default;
+
+    virtual std::optional<entry> find(std::string const& key) const = 0;
+    virtual void store(std::string const& key, folly::ByteRange data,
+                       std::shared_ptr<void const> owner) const = 0;
+  };
+
+ private:
+  std::unique_ptr<impl> impl_;
+};
+
+} // namespace dwarfs
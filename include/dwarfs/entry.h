@@ -63,19 +63,38 @@ class entry_visitor {
   virtual void visit(dir* p) = 0;
 };
 
+/**
+ * The subset of `struct ::stat` that is actually needed for building
+ * the metadata, at less than half the size.
+ */
+struct entry_stat {
+  entry_stat() = default;
+  explicit entry_stat(struct ::stat const& st);
+
+  uint64_t ino{0};
+  uint64_t size{0};
+  uint64_t rdev{0};
+  uint64_t atime{0};
+  uint64_t mtime{0};
+  uint64_t ctime{0};
+  uint32_t mode{0};
+  uint32_t nlink{0};
+  uint32_t uid{0};
+  uint32_t gid{0};
+};
+
 class entry : public entry_interface {
  public:
   enum type_t { E_FILE, E_DIR, E_LINK, E_DEVICE, E_OTHER };
 
-  entry(const std::string& name, std::shared_ptr<entry> parent,
-        const struct ::stat& st);
+  entry(const std::string& name, entry* parent, const struct ::stat& st);
 
-  bool has_parent() const;
-  std::shared_ptr<entry> parent() const;
+  bool has_parent() const { return parent_ != nullptr; }
+  entry* parent() const { return parent_; }
   void set_name(const std::string& name);
   std::string path() const override;
   const std::string& name() const override { return name_; }
-  size_t size() const override { return stat_.st_size; }
+  size_t size() const override { return stat_.size; }
   virtual type_t type() const = 0;
   std::string type_string() const override;
   virtual void walk(std::function<void(entry*)> const& f);
@@ -85,11 +104,11 @@ class entry : public entry_interface {
   void update(global_entry_data& data) const;
   virtual void accept(entry_visitor& v, bool preorder = false) = 0;
   virtual void scan(os_access& os, progress& prog) = 0;
-  const struct ::stat& status() const { return stat_; }
+  entry_stat const& status() const { return stat_; }
   void set_entry_index(uint32_t index) { entry_index_ = index; }
   std::optional<uint32_t> const& entry_index() const { return entry_index_; }
-  uint64_t raw_inode_num() const { return stat_.st_ino; }
-  uint64_t num_hard_links() const { return stat_.st_nlink; }
+  uint64_t raw_inode_num() const { return stat_.ino; }
+  uint64_t num_hard_links() const { return stat_.nlink; }
   virtual void set_inode_num(uint32_t ino) = 0;
   virtual std::optional<uint32_t> const& inode_num() const = 0;
 
@@ -109,16 +128,16 @@ class entry : public entry_interface {
 
  private:
   std::string name_;
-  std::weak_ptr<entry> parent_;
-  struct ::stat stat_;
+  // non-owning, a directory always outlives its entries
+  entry* parent_;
+  entry_stat stat_;
   std::optional<uint32_t> entry_index_;
 };
 
 class file : public entry {
  public:
-  file(const std::string& name, std::shared_ptr<entry> parent,
-       const struct ::stat& st)
-      : entry(name, std::move(parent), st) {}
+  file(const std::string& name, entry* parent, const struct ::stat& st)
+      : entry(name, parent, st) {}
 
   type_t type() const override;
   std::string_view hash() const;
@@ -126,7 +145,10 @@ class file : public entry {
   std::shared_ptr<inode> get_inode() const;
   void accept(entry_visitor& v, bool preorder) override;
   void scan(os_access& os, progress& prog) override;
-  void scan(std::shared_ptr<mmif> const& mm, progress& prog);
+  void scan(std::shared_ptr<mmif> const& mm, progress& prog,
+            std::function<void(uint8_t const*, size_t)> const& on_data = {});
+  // use a digest from os_access::content_digest() instead of scanning
+  void set_hash(std::string_view digest, progress& prog);
   void create_data();
   void hardlink(file* other, progress& prog);
   uint32_t unique_file_id() const;
@@ -0,0 +1,133 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace dwarfs {
+
+/**
+ * Low-overhead event tracing in the Chrome trace event format
+ *
+ * The resulting JSON file can be loaded into chrome://tracing or
+ * https://ui.perfetto.dev. Events are recorded into per-thread buffers
+ * and are only written to disk by stop().
+ *
+ * Instrumentation is compiled in only if DWARFS_EVENT_TRACING is defined
+ * (cmake -DWITH_EVENT_TRACING=ON); otherwise the DWARFS_TRACE_* macros
+ * expand to nothing and start() does nothing but return false. Even when
+ * compiled in, events are only recorded after start() has been called.
+ *
+ * Category and event names must be string literals or interned strings.
+ */
+class event_tracer {
+ public:
+  static constexpr bool available() {
+#ifdef DWARFS_EVENT_TRACING
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static bool start(std::string const& path);
+  static void stop();
+
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Returns a pointer to a copy of the string that stays valid until
+  // the program exits
+  static char const* intern(std::string const& str);
+
+  static uint64_t now();
+  static uint64_t next_id();
+
+  static void
+  complete(char const* cat, char const* name, uint64_t start, uint64_t end);
+  static void instant(char const* cat, char const* name);
+  static void async_begin(char const* cat, char const* name, uint64_t id);
+  static void async_end(char const* cat, char const* name, uint64_t id);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+class trace_scope {
+ public:
+  trace_scope(char const* cat, char const* name)
+      : cat_{cat}
+      , name_{name}
+      , start_{event_tracer::enabled() ? event_tracer::now() : 0} {}
+
+  ~trace_scope() {
+    if (start_ > 0 && event_tracer::enabled()) {
+      event_tracer::complete(cat_, name_, start_, event_tracer::now());
+    }
+  }
+
+ private:
+  char const* const cat_;
+  char const* const name_;
+  uint64_t const start_;
+};
+
+} // namespace dwarfs
+
+#ifdef DWARFS_EVENT_TRACING
+
+#define DWARFS_TRACE_CONCAT_(a, b) a##b
+#define DWARFS_TRACE_CONCAT(a, b) DWARFS_TRACE_CONCAT_(a, b)
+
+#define DWARFS_TRACE_SCOPE(cat, name)                                          \
+  ::dwarfs::trace_scope DWARFS_TRACE_CONCAT(trace_scope_, __LINE__)(cat, name)
+
+#define DWARFS_TRACE_INSTANT(cat, name)                                        \
+  do {                                                                         \
+    if (::dwarfs::event_tracer::enabled()) {                                   \
+      ::dwarfs::event_tracer::instant(cat, name);                              \
+    }                                                                          \
+  } while (0)
+
+#define DWARFS_TRACE_ASYNC_BEGIN(cat, name, id)                                \
+  do {                                                                         \
+    if (::dwarfs::event_tracer::enabled()) {                                   \
+      ::dwarfs::event_tracer::async_begin(cat, name, id);                      \
+    }                                                                          \
+  } while (0)
+
+#define DWARFS_TRACE_ASYNC_END(cat, name, id)                                  \
+  do {                                                                         \
+    if (::dwarfs::event_tracer::enabled()) {                                   \
+      ::dwarfs::event_tracer::async_end(cat, name, id);                        \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define DWARFS_TRACE_SCOPE(cat, name) static_cast<void>(0)
+#define DWARFS_TRACE_INSTANT(cat, name) static_cast<void>(0)
+#define DWARFS_TRACE_ASYNC_BEGIN(cat, name, id) static_cast<void>(0)
+#define DWARFS_TRACE_ASYNC_END(cat, name, id) static_cast<void>(0)
+
+#endif
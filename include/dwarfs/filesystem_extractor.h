@@ -21,9 +21,11 @@
 
 #pragma once
 
+#include <cstddef>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 namespace dwarfs {
 
@@ -42,10 +44,34 @@ class filesystem_extractor {
     return impl_->open_stream(os, format);
   }
 
-  void open_disk(std::string const& output) { return impl_->open_disk(output); }
+  /**
+   * Extract to a directory on disk
+   *
+   * \param output       Output directory, current directory if empty.
+   * \param num_writers  If non-zero, bypass libarchive and write file
+   *                     contents from this many threads.
+   */
+  void open_disk(std::string const& output, size_t num_writers = 0) {
+    return impl_->open_disk(output, num_writers);
+  }
 
   void close() { return impl_->close(); }
 
+  /**
+   * Only extract part of the file system
+   *
+   * Patterns are shell wildcard patterns matched against the path of
+   * each entry relative to the root, where `*` doesn't match `/`. An
+   * entry is extracted if it or one of its parents matches an include
+   * pattern (or no include patterns are given), and neither it nor
+   * one of its parents matches an exclude pattern. Parent directories
+   * of extracted entries are always created.
+   */
+  void set_filter(std::vector<std::string> const& include,
+                  std::vector<std::string> const& exclude) {
+    return impl_->set_filter(include, exclude);
+  }
+
   void extract(filesystem_v2 const& fs, size_t max_queued_bytes) {
     return impl_->extract(fs, max_queued_bytes);
   }
@@ -57,8 +83,10 @@ class filesystem_extractor {
     virtual void
     open_archive(std::string const& output, std::string const& format) = 0;
     virtual void open_stream(std::ostream& os, std::string const& format) = 0;
-    virtual void open_disk(std::string const& output) = 0;
+    virtual void open_disk(std::string const& output, size_t num_writers) = 0;
     virtual void close() = 0;
+    virtual void set_filter(std::vector<std::string> const& include,
+                            std::vector<std::string> const& exclude) = 0;
     virtual void extract(filesystem_v2 const& fs, size_t max_queued_bytes) = 0;
   };
 
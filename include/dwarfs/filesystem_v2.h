@@ -29,13 +29,16 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include <sys/types.h>
 
 #include <folly/Expected.h>
 #include <folly/dynamic.h>
 
+#include "dwarfs/block_cache.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/metadata_types.h"
 
@@ -52,6 +55,7 @@ class filesystem_writer;
 class logger;
 class mmif;
 class progress;
+class worker_group;
 
 class filesystem_v2 {
  public:
@@ -69,6 +73,11 @@ class filesystem_v2 {
                       int detail_level = 0, size_t num_readers = 1,
                       bool check_integrity = false, off_t image_offset = 0);
 
+  // Verifies the XXH3 and SHA-512/256 checksums of all sections while
+  // streaming through the image, returns the number of bad sections
+  static int verify_integrity(logger& lgr, std::shared_ptr<mmif> mm,
+                              integrity_check_options const& opts);
+
   static std::optional<folly::ByteRange> header(std::shared_ptr<mmif> mm);
 
   static std::optional<folly::ByteRange>
@@ -78,10 +87,20 @@ class filesystem_v2 {
     impl_->dump(os, detail_level);
   }
 
+  // Lists all blocks along with their compression ratio and the time it
+  // takes to decompress them, followed by all file ranges they contain
+  void dump_block_map(std::ostream& os) const { impl_->dump_block_map(os); }
+
   folly::dynamic metadata_as_dynamic() const {
     return impl_->metadata_as_dynamic();
   }
 
+  // Writes the same JSON as metadata_as_dynamic() without building the
+  // whole document in memory
+  void write_metadata_as_json(std::ostream& os) const {
+    impl_->write_metadata_as_json(os);
+  }
+
   std::string serialize_metadata_as_json(bool simple) const {
     return impl_->serialize_metadata_as_json(simple);
   }
@@ -90,10 +109,46 @@ class filesystem_v2 {
     impl_->walk(func);
   }
 
+  // Same as above, but without a std::function call per entry
+  template <typename T>
+  void walk(T&& func) const {
+    walk_batched([&func](std::vector<dir_entry_view> const& batch) {
+      for (auto const& entry : batch) {
+        func(entry);
+      }
+    });
+  }
+
   void walk_data_order(std::function<void(dir_entry_view)> const& func) const {
     impl_->walk_data_order(func);
   }
 
+  template <typename T>
+  void walk_data_order(T&& func) const {
+    walk_data_order_batched(
+        [&func](std::vector<dir_entry_view> const& batch) {
+          for (auto const& entry : batch) {
+            func(entry);
+          }
+        });
+  }
+
+  // See metadata_v2 for the batched and parallel walks
+  void walk_batched(dir_entry_batch_func const& func,
+                    size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_batched(func, batch_size);
+  }
+
+  void walk_data_order_batched(dir_entry_batch_func const& func,
+                               size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_data_order_batched(func, batch_size);
+  }
+
+  void walk_parallel(worker_group& wg, dir_entry_batch_func const& func,
+                     size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_parallel(wg, func, batch_size);
+  }
+
   std::optional<inode_view> find(const char* path) const {
     return impl_->find(path);
   }
@@ -121,6 +176,12 @@ class filesystem_v2 {
     return impl_->readdir(dir, offset);
   }
 
+  void readdir(directory_view dir, size_t offset,
+               std::function<bool(size_t, inode_view, std::string_view)> const&
+                   func) const {
+    impl_->readdir(dir, offset, func);
+  }
+
   size_t dirsize(directory_view dir) const { return impl_->dirsize(dir); }
 
   int readlink(inode_view entry, std::string* buf) const {
@@ -149,21 +210,117 @@ class filesystem_v2 {
     return impl_->readv(inode, size, offset);
   }
 
+  // Reads without ever blocking the calling thread. The callback is
+  // called exactly once, with the data or an error, usually from a block
+  // cache worker thread, so it must not block. If all data is readily
+  // available, or on errors detected up front, it's called before this
+  // returns.
+  read_handle read_async(uint32_t inode, size_t size, off_t offset,
+                         read_callback done) const {
+    return impl_->read_async(inode, size, offset, std::move(done));
+  }
+
+  // Performs a batch of reads, typically of many small files, with all
+  // requests for the same block sharing a single block cache lookup and
+  // decompression job. Otherwise works just like read_async(); cancelling
+  // the batch cancels all reads that haven't completed yet.
+  read_handle read_batch(std::vector<file_read_request> const& reads,
+                         batch_read_callback done) const {
+    return impl_->read_batch(reads, std::move(done));
+  }
+
+  // Blocking version of the above
+  std::vector<read_result>
+  read_batch(std::vector<file_read_request> const& reads) const {
+    std::promise<std::vector<read_result>> promise;
+    auto future = promise.get_future();
+    impl_->read_batch(reads, [&promise](std::vector<read_result>&& res) {
+      promise.set_value(std::move(res));
+    });
+    return future.get();
+  }
+
+  // Like lseek() with SEEK_DATA or SEEK_HOLE, returns the offset of the
+  // next data or hole at or after `offset`, or -errno
+  off_t seek(uint32_t inode, off_t offset, int whence) const {
+    return impl_->seek(inode, offset, whence);
+  }
+
+  // Returns the ranges of the image file holding the requested data if
+  // all of it is stored uncompressed, std::nullopt otherwise
+  std::optional<std::vector<image_range>>
+  image_ranges(uint32_t inode, size_t size, off_t offset = 0) const {
+    return impl_->image_ranges(inode, size, offset);
+  }
+
   std::optional<folly::ByteRange> header() const { return impl_->header(); }
 
+  std::optional<chunk_range> get_chunks(uint32_t inode) const {
+    return impl_->get_chunks(inode);
+  }
+
+  size_t block_size() const { return impl_->block_size(); }
+
+  size_t num_blocks() const { return impl_->num_blocks(); }
+
+  // Digest over the checksums of all blocks; identifies a reference image
+  uint64_t block_digest() const { return impl_->block_digest(); }
+
+  // Compressed size divided by uncompressed size of a block referenced
+  // by the chunk table, if the block is stored in this image
+  std::optional<double> block_compression_ratio(size_t block_no) const {
+    return impl_->block_compression_ratio(block_no);
+  }
+
+  // Writes the given compressed blocks of this filesystem verbatim, in
+  // the order they are listed, to the given writer
+  void copy_blocks(filesystem_writer& writer,
+                   std::vector<size_t> const& blocks) const {
+    impl_->copy_blocks(writer, blocks);
+  }
+
   void set_num_workers(size_t num) { return impl_->set_num_workers(num); }
 
+  // Changes the block cache budget while the file system is in use
+  void set_cache_size(size_t max_bytes) { impl_->set_cache_size(max_bytes); }
+
+  void prefetch_blocks(std::vector<size_t> const& blocks) const {
+    impl_->prefetch_blocks(blocks);
+  }
+
+  std::vector<uint32_t> block_access_counts() const {
+    return impl_->block_access_counts();
+  }
+
+  block_cache_stats cache_stats() const { return impl_->cache_stats(); }
+
+  // Reads a range of a single block, bypassing the chunk table; this
+  // is meant for consumers that schedule their reads by block
+  std::future<block_range>
+  read_block(size_t block_no, size_t offset, size_t size) const {
+    return impl_->read_block(block_no, offset, size);
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
 
     virtual void dump(std::ostream& os, int detail_level) const = 0;
+    virtual void dump_block_map(std::ostream& os) const = 0;
     virtual folly::dynamic metadata_as_dynamic() const = 0;
+    virtual void write_metadata_as_json(std::ostream& os) const = 0;
     virtual std::string serialize_metadata_as_json(bool simple) const = 0;
     virtual void
     walk(std::function<void(dir_entry_view)> const& func) const = 0;
     virtual void
     walk_data_order(std::function<void(dir_entry_view)> const& func) const = 0;
+    virtual void walk_batched(dir_entry_batch_func const& func,
+                              size_t batch_size) const = 0;
+    virtual void walk_data_order_batched(dir_entry_batch_func const& func,
+                                         size_t batch_size) const = 0;
+    virtual void walk_parallel(worker_group& wg,
+                               dir_entry_batch_func const& func,
+                               size_t batch_size) const = 0;
     virtual std::optional<inode_view> find(const char* path) const = 0;
     virtual std::optional<inode_view> find(int inode) const = 0;
     virtual std::optional<inode_view>
@@ -174,6 +331,10 @@ class filesystem_v2 {
     virtual std::optional<directory_view> opendir(inode_view entry) const = 0;
     virtual std::optional<std::pair<inode_view, std::string>>
     readdir(directory_view dir, size_t offset) const = 0;
+    virtual void
+    readdir(directory_view dir, size_t offset,
+            std::function<bool(size_t, inode_view, std::string_view)> const&
+                func) const = 0;
     virtual size_t dirsize(directory_view dir) const = 0;
     virtual int readlink(inode_view entry, std::string* buf) const = 0;
     virtual folly::Expected<std::string, int>
@@ -186,8 +347,29 @@ class filesystem_v2 {
                           off_t offset) const = 0;
     virtual folly::Expected<std::vector<std::future<block_range>>, int>
     readv(uint32_t inode, size_t size, off_t offset) const = 0;
+    virtual read_handle read_async(uint32_t inode, size_t size, off_t offset,
+                                   read_callback done) const = 0;
+    virtual read_handle read_batch(std::vector<file_read_request> const& reads,
+                                   batch_read_callback done) const = 0;
+    virtual off_t seek(uint32_t inode, off_t offset, int whence) const = 0;
+    virtual std::optional<std::vector<image_range>>
+    image_ranges(uint32_t inode, size_t size, off_t offset) const = 0;
     virtual std::optional<folly::ByteRange> header() const = 0;
+    virtual std::optional<chunk_range> get_chunks(uint32_t inode) const = 0;
+    virtual size_t block_size() const = 0;
+    virtual size_t num_blocks() const = 0;
+    virtual uint64_t block_digest() const = 0;
+    virtual std::optional<double>
+    block_compression_ratio(size_t block_no) const = 0;
+    virtual void copy_blocks(filesystem_writer& writer,
+                             std::vector<size_t> const& blocks) const = 0;
     virtual void set_num_workers(size_t num) = 0;
+    virtual void set_cache_size(size_t max_bytes) = 0;
+    virtual void prefetch_blocks(std::vector<size_t> const& blocks) const = 0;
+    virtual std::vector<uint32_t> block_access_counts() const = 0;
+    virtual block_cache_stats cache_stats() const = 0;
+    virtual std::future<block_range>
+    read_block(size_t block_no, size_t offset, size_t size) const = 0;
   };
 
  private:
@@ -25,6 +25,7 @@
 #include <cstdint>
 #include <memory>
 #include <ostream>
+#include <string>
 #include <utility>
 
 #include <folly/Range.h>
@@ -37,6 +38,7 @@ namespace dwarfs {
 
 class block_compressor;
 class block_data;
+class compression_dictionary;
 class logger;
 class progress;
 class worker_group;
@@ -58,8 +60,29 @@ class filesystem_writer {
 
   void copy_header(folly::ByteRange header) { impl_->copy_header(header); }
 
-  void write_block(std::shared_ptr<block_data>&& data) {
-    impl_->write_block(std::move(data));
+  // Marks the image as possibly using the given feature, so versions
+  // that don't support it refuse to read the image; must be called
+  // before the first section is written
+  void enable_feature(image_feature feature) {
+    impl_->enable_feature(feature);
+  }
+
+  // the category is only used for reporting
+  void write_block(std::shared_ptr<block_data>&& data,
+                   std::string const& category = {}) {
+    impl_->write_block(std::move(data), category);
+  }
+
+  // write a block using a compressor other than the default one
+  void write_block(std::shared_ptr<block_data>&& data,
+                   block_compressor const& bc,
+                   std::string const& category = {}) {
+    impl_->write_block(std::move(data), bc, category);
+  }
+
+  // write the dictionary section and use it for all subsequent blocks
+  void write_dictionary(std::shared_ptr<compression_dictionary const> dict) {
+    impl_->write_dictionary(std::move(dict));
   }
 
   void write_metadata_v2_schema(std::shared_ptr<block_data>&& data) {
@@ -70,6 +93,13 @@ class filesystem_writer {
     impl_->write_metadata_v2(std::move(data));
   }
 
+  // write a METADATA_V2_NAMES or METADATA_V2_SYMLINKS section, which is
+  // compressed like the metadata
+  void write_string_table(section_type type,
+                          std::shared_ptr<block_data>&& data) {
+    impl_->write_string_table(type, std::move(data));
+  }
+
   void write_compressed_section(section_type type, compression_type compression,
                                 folly::ByteRange data) {
     impl_->write_compressed_section(type, compression, data);
@@ -86,10 +116,19 @@ class filesystem_writer {
     virtual ~impl() = default;
 
     virtual void copy_header(folly::ByteRange header) = 0;
-    virtual void write_block(std::shared_ptr<block_data>&& data) = 0;
+    virtual void enable_feature(image_feature feature) = 0;
+    virtual void write_block(std::shared_ptr<block_data>&& data,
+                             std::string const& category) = 0;
+    virtual void write_block(std::shared_ptr<block_data>&& data,
+                             block_compressor const& bc,
+                             std::string const& category) = 0;
+    virtual void
+    write_dictionary(std::shared_ptr<compression_dictionary const> dict) = 0;
     virtual void
     write_metadata_v2_schema(std::shared_ptr<block_data>&& data) = 0;
     virtual void write_metadata_v2(std::shared_ptr<block_data>&& data) = 0;
+    virtual void write_string_table(section_type type,
+                                    std::shared_ptr<block_data>&& data) = 0;
     virtual void
     write_compressed_section(section_type type, compression_type compression,
                              folly::ByteRange data) = 0;
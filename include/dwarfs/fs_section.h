@@ -21,7 +21,9 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
 
 #include <folly/Range.h>
@@ -36,6 +38,13 @@ class fs_section {
  public:
   fs_section(mmif& mm, size_t offset, int version);
 
+  /**
+   * Create a section from a section index entry without touching its
+   * header. The header is only read once it's actually needed.
+   */
+  fs_section(std::shared_ptr<mmif> mm, section_type type, size_t offset,
+             size_t size, int version);
+
   size_t start() const { return impl_->start(); }
   size_t length() const { return impl_->length(); }
   compression_type compression() const { return impl_->compression(); }
@@ -43,8 +52,13 @@ class fs_section {
   std::string name() const { return impl_->name(); }
   std::string description() const { return impl_->description(); }
   bool check_fast(mmif& mm) const { return impl_->check_fast(mm); }
+  // Same as above, but for a copy of the section data
+  bool check_fast(folly::ByteRange data) const {
+    return impl_->check_fast(data);
+  }
   bool verify(mmif& mm) const { return impl_->verify(mm); }
   folly::ByteRange data(mmif& mm) const { return impl_->data(mm); }
+  std::optional<uint64_t> xxh3_64() const { return impl_->xxh3_64(); }
 
   size_t end() const { return start() + length(); }
 
@@ -59,8 +73,10 @@ class fs_section {
     virtual std::string name() const = 0;
     virtual std::string description() const = 0;
     virtual bool check_fast(mmif& mm) const = 0;
+    virtual bool check_fast(folly::ByteRange data) const = 0;
     virtual bool verify(mmif& mm) const = 0;
     virtual folly::ByteRange data(mmif& mm) const = 0;
+    virtual std::optional<uint64_t> xxh3_64() const = 0;
   };
 
  private:
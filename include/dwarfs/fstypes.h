@@ -26,9 +26,13 @@
 #include <iosfwd>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <bits/types/struct_iovec.h>
 
+#include <folly/Expected.h>
+#include <folly/Function.h>
 #include <folly/small_vector.h>
 
 #include "dwarfs/block_compressor.h" // TODO: or the other way round?
@@ -44,12 +48,23 @@ class block_range {
   block_range(std::shared_ptr<cached_block const> block, size_t offset,
               size_t size);
 
+  // Largest range that can be returned by zeros()
+  static constexpr size_t max_zeros_size = 1 << 20;
+
+  // A range of zero bytes that isn't backed by any block, e.g. for
+  // reading holes in sparse files
+  static block_range zeros(size_t size);
+
   uint8_t const* data() const { return begin_; }
   uint8_t const* begin() const { return begin_; }
   uint8_t const* end() const { return end_; }
   size_t size() const { return end_ - begin_; }
 
  private:
+  block_range(uint8_t const* data, size_t size)
+      : begin_(data)
+      , end_(data + size) {}
+
   uint8_t const* const begin_;
   uint8_t const* const end_;
   std::shared_ptr<cached_block const> block_;
@@ -64,8 +79,76 @@ struct iovec_read_buf {
   folly::small_vector<block_range, inline_storage> ranges;
 };
 
+// Result of an asynchronous read, either all ranges making up the data
+// in order, or a negative error number
+using read_result = folly::Expected<std::vector<block_range>, int>;
+
+// Called exactly once when an asynchronous read completes
+using read_callback = folly::Function<void(read_result&&)>;
+
+// A single read of a batch of reads
+struct file_read_request {
+  uint32_t inode;
+  size_t size;
+  off_t offset{0};
+};
+
+// Called exactly once with the results of all reads of a batch,
+// in the same order as the requests
+using batch_read_callback = folly::Function<void(std::vector<read_result>&&)>;
+
+// Handle to an asynchronous read
+class read_handle {
+ public:
+  class impl {
+   public:
+    virtual ~impl() = default;
+
+    virtual bool cancel() = 0;
+    virtual bool done() const = 0;
+  };
+
+  read_handle() = default;
+  explicit read_handle(std::shared_ptr<impl> impl)
+      : impl_{std::move(impl)} {}
+
+  // Completes the read with -ECANCELED, unless it has already completed.
+  // Returns true if the read has been cancelled.
+  bool cancel() const { return impl_ && impl_->cancel(); }
+
+  bool done() const { return !impl_ || impl_->done(); }
+
+ private:
+  std::shared_ptr<impl> impl_;
+};
+
+// A range of file data that is stored uncompressed in the image and
+// can be read directly from the image file
+struct image_range {
+  size_t offset; // absolute offset in the image file
+  size_t size;
+};
+
 constexpr uint8_t MAJOR_VERSION = 2;
-constexpr uint8_t MINOR_VERSION = 3;
+constexpr uint8_t MINOR_VERSION = 4;
+
+// Images are written using this minor version unless they need a newer
+// one, so older versions can still read them. Images that use any of
+// the features below are written using MINOR_VERSION.
+constexpr uint8_t COMPAT_MINOR_VERSION = 3;
+
+// Features that versions reading only COMPAT_MINOR_VERSION images would
+// silently get wrong
+enum class image_feature : uint8_t {
+  // chunks may reference HOLE_BLOCK
+  SPARSE_FILES,
+  // chunks may reference blocks of a reference image
+  REFERENCE_IMAGE,
+};
+
+// Block number used by chunks that represent a hole in a sparse file.
+// These chunks don't reference any block data and read back as zeros.
+constexpr uint32_t HOLE_BLOCK = 0xFFFFFFFF;
 
 enum class section_type : uint16_t {
   BLOCK = 0,
@@ -76,6 +159,27 @@ enum class section_type : uint16_t {
 
   METADATA_V2 = 8,
   // Frozen metadata.
+
+  BLOCK_DICTIONARY = 9,
+  // Compression dictionary used by all blocks.
+
+  SECTION_INDEX = 10,
+  // Index of all sections, always the last section. Each entry is a
+  // 64-bit value with the section type in the upper 16 bits and the
+  // offset of the section header relative to the image in the lower
+  // 48 bits. The last entry refers to the index itself.
+
+  PADDING = 11,
+  // Padding so that the data of the following block section is aligned.
+  // Starts with the alignment as a 32-bit value, followed by zeroes.
+
+  METADATA_V2_NAMES = 12,
+  // Frozen string table of directory entry names, stored outside of the
+  // metadata. Starts with the size of the frozen schema as a 32-bit
+  // value, followed by the schema and the frozen data.
+
+  METADATA_V2_SYMLINKS = 13,
+  // Frozen string table of symlink targets, same format as above.
 };
 
 struct file_header {
@@ -120,6 +224,7 @@ struct filesystem_info {
   uint64_t uncompressed_block_size{0};
   uint64_t compressed_metadata_size{0};
   uint64_t uncompressed_metadata_size{0};
+  uint32_t block_alignment{0};
 };
 
 bool is_valid_compression_type(compression_type type);
@@ -0,0 +1,100 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dwarfs/mmif.h"
+#include "dwarfs/options.h"
+
+namespace dwarfs {
+
+/**
+ * An mmif implementation for images stored on an HTTP server
+ *
+ * Only the size and the first few bytes of the image are fetched up
+ * front. Everything else is fetched using range requests when it is
+ * first populated, in multiples of `fetch_size`, and then stays in
+ * anonymous memory until it is released, after which it will be
+ * fetched again when it is populated. Concurrent requests for the same
+ * data share a single fetch, and large ranges are fetched over several
+ * connections in parallel.
+ *
+ * No threads are kept around between fetches, so it is safe to fork
+ * (e.g. when daemonizing) after the image has been opened.
+ */
+class http_file : public mmif {
+ public:
+  http_file(std::string const& url, http_file_options const& opts);
+
+  ~http_file() noexcept override;
+
+  static bool is_url(std::string_view path);
+
+  void const* addr() const override;
+  size_t size() const override;
+
+  boost::system::error_code lock(off_t offset, size_t size) override;
+  boost::system::error_code release(off_t offset, size_t size) override;
+  boost::system::error_code release_until(off_t offset) override;
+  boost::system::error_code
+  advise_sequential(off_t offset, size_t size) override;
+  boost::system::error_code
+  advise_willneed(off_t offset, size_t size) override;
+
+  void populate(off_t offset, size_t size) override;
+
+ private:
+  enum chunk_state : uint8_t { MISSING, FETCHING, PRESENT };
+
+  struct response;
+
+  int connect() const;
+  int get_connection();
+  void put_connection(int fd);
+  response request(int fd, size_t begin, size_t end,
+                   std::vector<uint8_t>* body);
+  void fetch(size_t begin, size_t end, std::vector<uint8_t>* body);
+  void fetch_chunks(size_t first, size_t last);
+  bool is_present(size_t first, size_t last) const;
+
+  std::string host_;
+  std::string port_;
+  std::string path_;
+  http_file_options const opts_;
+  size_t size_{0};
+  void* addr_{nullptr};
+  std::unique_ptr<std::atomic<uint8_t>[]> chunks_;
+  size_t num_chunks_{0};
+  std::mutex mx_;
+  std::condition_variable cv_;
+  std::vector<int> idle_;
+};
+} // namespace dwarfs
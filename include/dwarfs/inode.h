@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <vector>
@@ -38,6 +40,7 @@ class chunk;
 
 class file;
 class mmif;
+class similarity;
 
 struct inode_options;
 
@@ -48,6 +51,8 @@ class inode : public object {
   virtual void set_files(files_vector&& fv) = 0;
   virtual void
   scan(std::shared_ptr<mmif> const& mm, inode_options const& options) = 0;
+  virtual void set_similarity_hashes(uint32_t sim,
+                                     nilsimsa::hash_type const& nh) = 0;
   virtual void set_num(uint32_t num) = 0;
   virtual uint32_t num() const = 0;
   virtual uint32_t similarity_hash() const = 0;
@@ -58,6 +63,56 @@ class inode : public object {
   virtual void add_chunk(size_t block, size_t offset, size_t size) = 0;
   virtual void
   append_chunks_to(std::vector<thrift::metadata::chunk>& vec) const = 0;
+  // drops all chunks, including those of the fragments, so the inode
+  // can be segmented again for another image
+  virtual void clear_chunks() = 0;
+
+  // Fragments are parts of a large file that are ordered and segmented
+  // on their own. They share everything but their similarity hashes and
+  // chunks with the inode they belong to, so a fragment's num(), any()
+  // and files() are those of its inode. Fragments must be added in file
+  // order. If an inode with fragments hasn't been given any chunks
+  // itself, append_chunks_to() appends the chunks of all fragments.
+  virtual void add_fragment(size_t offset, size_t size, uint32_t sim,
+                            nilsimsa::hash_type const& nh) = 0;
+  virtual std::vector<std::shared_ptr<inode>> const& fragments() const = 0;
+  virtual bool is_fragment() const = 0;
+  // offset of the data covered by this inode in the file, which is
+  // always 0 unless this is a fragment
+  virtual size_t fragment_offset() const = 0;
+};
+
+/**
+ * Incrementally computes the similarity hashes for an inode
+ *
+ * This allows the similarity hashes to be computed in the same pass
+ * over the file data as the checksum used for de-duplication. If
+ * `inode_options::fragment_size` is set, files larger than that get
+ * separate hashes for each fragment.
+ */
+class inode_hasher {
+ public:
+  explicit inode_hasher(inode_options const& opts);
+  ~inode_hasher();
+
+  void update(uint8_t const* data, size_t size);
+  void finalize(inode& ino);
+
+ private:
+  struct hashes {
+    uint32_t sim{0};
+    nilsimsa::hash_type nh;
+  };
+
+  hashes finish_fragment();
+
+  bool const with_similarity_;
+  bool const with_nilsimsa_;
+  size_t const fragment_size_;
+  size_t fill_{0};
+  std::unique_ptr<similarity> sc_;
+  std::unique_ptr<nilsimsa> nc_;
+  std::vector<hashes> fragments_;
 };
 
 } // namespace dwarfs
@@ -22,42 +22,73 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <sys/types.h>
 
 #include <folly/Expected.h>
 
+#include "dwarfs/block_cache.h"
+#include "dwarfs/fstypes.h"
 #include "dwarfs/metadata_types.h"
 
 namespace dwarfs {
 
-class block_cache;
 class logger;
+struct inode_reader_options;
 struct iovec_read_buf;
 
+struct inode_read_request {
+  uint32_t inode;
+  size_t size;
+  off_t offset;
+  // the read fails with -EBADF if this is unset
+  std::optional<chunk_range> chunks;
+};
+
 class inode_reader_v2 {
  public:
   inode_reader_v2() = default;
 
-  inode_reader_v2(logger& lgr, block_cache&& bc);
+  inode_reader_v2(logger& lgr, block_cache&& bc,
+                  inode_reader_options const& opts);
 
   inode_reader_v2& operator=(inode_reader_v2&&) = default;
 
-  ssize_t read(char* buf, size_t size, off_t offset, chunk_range chunks) const {
-    return impl_->read(buf, size, offset, chunks);
+  ssize_t read(uint32_t inode, char* buf, size_t size, off_t offset,
+               chunk_range chunks) const {
+    return impl_->read(inode, buf, size, offset, chunks);
   }
 
-  ssize_t readv(iovec_read_buf& buf, size_t size, off_t offset,
+  ssize_t readv(uint32_t inode, iovec_read_buf& buf, size_t size, off_t offset,
                 chunk_range chunks) const {
-    return impl_->readv(buf, size, offset, chunks);
+    return impl_->readv(inode, buf, size, offset, chunks);
   }
 
   folly::Expected<std::vector<std::future<block_range>>, int>
-  readv(size_t size, off_t offset, chunk_range chunks) const {
-    return impl_->readv(size, offset, chunks);
+  readv(uint32_t inode, size_t size, off_t offset, chunk_range chunks) const {
+    return impl_->readv(inode, size, offset, chunks);
+  }
+
+  read_handle read_async(uint32_t inode, size_t size, off_t offset,
+                         chunk_range chunks, read_callback done) const {
+    return impl_->read_async(inode, size, offset, chunks, std::move(done));
+  }
+
+  read_handle read_batch(std::vector<inode_read_request> const& reads,
+                         batch_read_callback done) const {
+    return impl_->read_batch(reads, std::move(done));
+  }
+
+  std::optional<std::vector<image_range>>
+  image_ranges(size_t size, off_t offset, chunk_range chunks) const {
+    return impl_->image_ranges(size, offset, chunks);
   }
 
   void
@@ -67,19 +98,50 @@ class inode_reader_v2 {
 
   void set_num_workers(size_t num) { impl_->set_num_workers(num); }
 
+  void set_cache_size(size_t max_bytes) { impl_->set_cache_size(max_bytes); }
+
+  void prefetch_blocks(std::vector<size_t> const& blocks) const {
+    impl_->prefetch_blocks(blocks);
+  }
+
+  std::vector<uint32_t> block_access_counts() const {
+    return impl_->block_access_counts();
+  }
+
+  block_cache_stats cache_stats() const { return impl_->cache_stats(); }
+
+  std::future<block_range>
+  read_block(size_t block_no, size_t offset, size_t size) const {
+    return impl_->read_block(block_no, offset, size);
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
 
-    virtual ssize_t
-    read(char* buf, size_t size, off_t offset, chunk_range chunks) const = 0;
-    virtual ssize_t readv(iovec_read_buf& buf, size_t size, off_t offset,
-                          chunk_range chunks) const = 0;
+    virtual ssize_t read(uint32_t inode, char* buf, size_t size, off_t offset,
+                         chunk_range chunks) const = 0;
+    virtual ssize_t readv(uint32_t inode, iovec_read_buf& buf, size_t size,
+                          off_t offset, chunk_range chunks) const = 0;
     virtual folly::Expected<std::vector<std::future<block_range>>, int>
-    readv(size_t size, off_t offset, chunk_range chunks) const = 0;
+    readv(uint32_t inode, size_t size, off_t offset,
+          chunk_range chunks) const = 0;
+    virtual read_handle
+    read_async(uint32_t inode, size_t size, off_t offset, chunk_range chunks,
+               read_callback done) const = 0;
+    virtual read_handle read_batch(std::vector<inode_read_request> const& reads,
+                                   batch_read_callback done) const = 0;
+    virtual std::optional<std::vector<image_range>>
+    image_ranges(size_t size, off_t offset, chunk_range chunks) const = 0;
     virtual void dump(std::ostream& os, const std::string& indent,
                       chunk_range chunks) const = 0;
     virtual void set_num_workers(size_t num) = 0;
+    virtual void set_cache_size(size_t max_bytes) = 0;
+    virtual void prefetch_blocks(std::vector<size_t> const& blocks) const = 0;
+    virtual std::vector<uint32_t> block_access_counts() const = 0;
+    virtual block_cache_stats cache_stats() const = 0;
+    virtual std::future<block_range>
+    read_block(size_t block_no, size_t offset, size_t size) const = 0;
   };
 
  private:
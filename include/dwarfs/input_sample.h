@@ -0,0 +1,78 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+#include "dwarfs/script.h"
+
+namespace dwarfs {
+
+class os_access;
+
+// A sample of the input files for `mkdwarfs --analyze`. Files are
+// grouped into strata by top-level directory and size class and picked
+// from all strata in turn, so every part of the input is represented.
+struct input_sample {
+  std::unordered_set<std::string> files;
+  size_t total_files{0};
+  size_t total_bytes{0};
+  size_t sample_bytes{0};
+};
+
+input_sample
+sample_input(os_access const& os, std::string const& root, size_t max_bytes);
+
+// Restricts a scan to the files of an input_sample. Everything else is
+// left to the user's script, if there is one.
+class sample_script : public script {
+ public:
+  sample_script(std::shared_ptr<script> base,
+                std::unordered_set<std::string> const& files);
+
+  bool has_configure() const override { return false; }
+  bool has_filter() const override { return true; }
+  bool has_transform() const override {
+    return base_ && base_->has_transform();
+  }
+  bool has_order() const override { return base_ && base_->has_order(); }
+  bool has_categorize() const override {
+    return base_ && base_->has_categorize();
+  }
+
+  void configure(options_interface const&) override {}
+  bool filter(entry_interface const& ei) override;
+  void transform(entry_interface& ei) override { base_->transform(ei); }
+  void order(inode_vector& iv) override { base_->order(iv); }
+  std::string categorize(entry_interface const& ei) override {
+    return base_->categorize(ei);
+  }
+
+ private:
+  std::shared_ptr<script> base_;
+  std::unordered_set<std::string> const& files_;
+};
+
+} // namespace dwarfs
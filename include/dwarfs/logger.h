@@ -24,6 +24,7 @@
 #include <array>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <ctime>
 #include <iostream>
@@ -33,9 +34,11 @@
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "dwarfs/error.h"
 #include "dwarfs/util.h"
@@ -83,10 +86,21 @@ class stream_logger : public logger {
   void write(level_type level, const std::string& output, char const* file,
              int line) override;
 
+  // write a message that was logged at an earlier time `t`, possibly
+  // by another thread; no stack trace is printed for these messages
+  void write_at(level_type level, const std::string& output, char const* file,
+                int line, std::chrono::system_clock::time_point t);
+
   void set_threshold(level_type threshold);
   void set_with_context(bool with_context) { with_context_ = with_context; }
 
+  level_type threshold() const { return threshold_; }
+
  private:
+  void do_write(level_type level, const std::string& output, char const* file,
+                int line, std::chrono::system_clock::time_point t,
+                bool with_stack);
+
   std::ostream& os_;
   std::mutex mx_;
   std::atomic<level_type> threshold_;
@@ -94,6 +108,54 @@ class stream_logger : public logger {
   bool with_context_;
 };
 
+/**
+ * A logger that passes messages to a `stream_logger` from a background
+ * thread, so logging threads never wait for the output stream.
+ *
+ * Each logging thread gets its own lock-free single-producer ring
+ * buffer. If a ring is full, the message is dropped and counted; the
+ * number of dropped messages is reported by the background thread.
+ *
+ * Until `start()` is called, messages are written synchronously. This
+ * allows the logger to be used before forking into the background.
+ */
+class async_logger : public logger {
+ public:
+  explicit async_logger(stream_logger& backend, size_t ring_size = 1024);
+  ~async_logger() override;
+
+  void write(level_type level, const std::string& output, char const* file,
+             int line) override;
+
+  void start();
+  void stop();
+
+  void set_threshold(level_type threshold);
+  void set_with_context(bool with_context) {
+    backend_.set_with_context(with_context);
+  }
+
+  size_t dropped() const;
+
+ private:
+  class ring;
+
+  ring& thread_ring();
+  void run();
+  void drain();
+
+  stream_logger& backend_;
+  size_t const ring_size_;
+  uint64_t const id_;
+  std::mutex mx_;
+  std::condition_variable cond_;
+  std::vector<std::shared_ptr<ring>> rings_;
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+  bool stop_{false};
+  std::atomic<size_t> dropped_{0};
+};
+
 class level_logger {
  public:
   level_logger(logger& lgr, logger::level_type level,
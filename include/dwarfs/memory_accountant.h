@@ -0,0 +1,98 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string_view>
+
+namespace dwarfs {
+
+enum class memory_stage { SCANNER, SEGMENTER, COMPRESSOR, WRITER };
+
+/**
+ * Keeps track of the memory used by the different stages of building
+ * a filesystem image and enforces a common budget across all of them
+ *
+ * Memory can either be reserved, in which case the caller is blocked
+ * until the budget permits, or charged, which never blocks and is meant
+ * for memory that is needed no matter what. Blocking only makes sense as
+ * long as memory is held by the writer, which is bound to be released
+ * eventually; otherwise a reservation is granted right away to avoid
+ * deadlocks, even if this exceeds the budget.
+ */
+class memory_accountant {
+ public:
+  static constexpr size_t kNumStages{4};
+
+  class scoped_charge {
+   public:
+    scoped_charge(memory_accountant& ma, memory_stage stage, size_t bytes)
+        : ma_{ma}
+        , stage_{stage}
+        , bytes_{bytes} {
+      ma_.charge(stage_, bytes_);
+    }
+
+    ~scoped_charge() { ma_.release(stage_, bytes_); }
+
+    scoped_charge(scoped_charge const&) = delete;
+    scoped_charge& operator=(scoped_charge const&) = delete;
+
+   private:
+    memory_accountant& ma_;
+    memory_stage const stage_;
+    size_t const bytes_;
+  };
+
+  // 0 means unlimited
+  void set_limit(size_t limit);
+  size_t limit() const;
+
+  void reserve(memory_stage stage, size_t bytes);
+  void charge(memory_stage stage, size_t bytes);
+  void release(memory_stage stage, size_t bytes);
+
+  bool over_limit() const;
+
+  size_t used() const;
+  size_t used(memory_stage stage) const;
+  size_t peak() const;
+  size_t peak(memory_stage stage) const;
+
+  static std::string_view stage_name(memory_stage stage);
+
+ private:
+  void add(memory_stage stage, size_t bytes);
+
+  mutable std::mutex mx_;
+  std::condition_variable cond_;
+  size_t limit_{0};
+  size_t used_{0};
+  size_t peak_{0};
+  std::array<size_t, kNumStages> stage_used_{};
+  std::array<size_t, kNumStages> stage_peak_{};
+};
+
+} // namespace dwarfs
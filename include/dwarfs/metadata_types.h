@@ -23,8 +23,10 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <optional>
 #include <variant>
+#include <vector>
 
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/range/irange.hpp>
@@ -37,7 +39,7 @@
 
 namespace dwarfs {
 
-template <typename T>
+template <typename LoggerPolicy, typename Layout>
 class metadata_;
 
 class dir_entry_view;
@@ -48,7 +50,21 @@ class global_metadata {
   using Meta =
       ::apache::thrift::frozen::MappedFrozen<thrift::metadata::metadata>;
 
-  global_metadata(logger& lgr, Meta const* meta, bool check_consistency);
+  // `names` is used to load the names if they are stored in a separate
+  // section instead of the metadata
+  global_metadata(logger& lgr, Meta const* meta, bool check_consistency,
+                  string_table::table_loader names = {});
+
+  // true if names and symlinks are stored in separate sections
+  static bool has_separate_string_tables(Meta const* meta);
+
+  // Consistency checks for string tables stored in separate sections,
+  // which can only be done once the tables have been loaded; these
+  // throw if a table doesn't match the metadata
+  static void
+  check_separate_names(Meta const* meta, string_table::PackedTableView names);
+  static void check_separate_symlinks(Meta const* meta,
+                                      string_table::PackedTableView symlinks);
 
   Meta const* meta() const { return meta_; }
 
@@ -75,7 +91,7 @@ class inode_view
   using Meta =
       ::apache::thrift::frozen::MappedFrozen<thrift::metadata::metadata>;
 
-  template <typename T>
+  template <typename LoggerPolicy, typename Layout>
   friend class metadata_;
 
   friend class dir_entry_view;
@@ -101,7 +117,7 @@ class directory_view {
   using Meta =
       ::apache::thrift::frozen::MappedFrozen<thrift::metadata::metadata>;
 
-  template <typename T>
+  template <typename LoggerPolicy, typename Layout>
   friend class metadata_;
 
   friend class dir_entry_view;
@@ -133,7 +149,7 @@ class dir_entry_view {
   using DirEntryView =
       ::apache::thrift::frozen::View<thrift::metadata::dir_entry>;
 
-  template <typename T>
+  template <typename LoggerPolicy, typename Layout>
   friend class metadata_;
 
  public:
@@ -180,13 +196,20 @@ class dir_entry_view {
   global_metadata const* g_;
 };
 
+// Called with batches of entries by the batched and parallel walks
+using dir_entry_batch_func =
+    std::function<void(std::vector<dir_entry_view> const&)>;
+
+// Default number of entries per batch
+constexpr size_t const kWalkBatchSize{1024};
+
 using chunk_view = ::apache::thrift::frozen::View<thrift::metadata::chunk>;
 
 class chunk_range {
   using Meta =
       ::apache::thrift::frozen::MappedFrozen<thrift::metadata::metadata>;
 
-  template <typename T>
+  template <typename LoggerPolicy, typename Layout>
   friend class metadata_;
 
  public:
@@ -241,6 +264,10 @@ class chunk_range {
 
   bool empty() const { return end_ == begin_; }
 
+  // index of the first chunk in the chunk table; ranges with the same
+  // first index refer to the same chunks
+  uint32_t first_index() const { return begin_; }
+
  private:
   chunk_range(Meta const* meta, uint32_t begin, uint32_t end)
       : meta_(meta)
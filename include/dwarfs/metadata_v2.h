@@ -28,6 +28,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -45,14 +46,34 @@ struct statvfs;
 namespace dwarfs {
 
 class logger;
+class worker_group;
 
 struct metadata_options;
+struct metadata_rebuild_options;
 
 struct filesystem_info;
 
 namespace thrift::metadata {
 class metadata;
-}
+class string_table;
+} // namespace thrift::metadata
+
+// Loaders for string tables stored in separate sections of the image,
+// each returning the uncompressed section data. A loader is only called
+// once its table is first used.
+struct metadata_string_tables {
+  std::function<std::vector<uint8_t>()> names;
+  std::function<std::vector<uint8_t>()> symlinks;
+};
+
+// A range of a regular file that is stored in a particular block
+struct block_file_range {
+  uint32_t inode;
+  std::string path;
+  uint64_t file_offset;
+  uint32_t block_offset;
+  uint32_t size;
+};
 
 class metadata_v2 {
  public:
@@ -60,7 +81,8 @@ class metadata_v2 {
 
   metadata_v2(logger& lgr, folly::ByteRange schema, folly::ByteRange data,
               metadata_options const& options, int inode_offset = 0,
-              bool force_consistency_check = false);
+              bool force_consistency_check = false,
+              metadata_string_tables const& tables = {});
 
   metadata_v2& operator=(metadata_v2&&) = default;
 
@@ -72,6 +94,10 @@ class metadata_v2 {
 
   folly::dynamic as_dynamic() const { return impl_->as_dynamic(); }
 
+  // writes the same JSON as as_dynamic(), but incrementally and without
+  // building the whole document in memory
+  void write_as_json(std::ostream& os) const { impl_->write_as_json(os); }
+
   std::string serialize_as_json(bool simple) const {
     return impl_->serialize_as_json(simple);
   }
@@ -84,10 +110,52 @@ class metadata_v2 {
     impl_->walk(func);
   }
 
+  // Same as above, but without a std::function call per entry
+  template <typename T>
+  void walk(T&& func) const {
+    walk_batched([&func](std::vector<dir_entry_view> const& batch) {
+      for (auto const& entry : batch) {
+        func(entry);
+      }
+    });
+  }
+
   void walk_data_order(std::function<void(dir_entry_view)> const& func) const {
     impl_->walk_data_order(func);
   }
 
+  template <typename T>
+  void walk_data_order(T&& func) const {
+    walk_data_order_batched(
+        [&func](std::vector<dir_entry_view> const& batch) {
+          for (auto const& entry : batch) {
+            func(entry);
+          }
+        });
+  }
+
+  // Same order as walk() / walk_data_order(), with the entries delivered
+  // in batches of up to batch_size
+  void walk_batched(dir_entry_batch_func const& func,
+                    size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_batched(func, batch_size);
+  }
+
+  void walk_data_order_batched(dir_entry_batch_func const& func,
+                               size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_data_order_batched(func, batch_size);
+  }
+
+  // Walks the tree using the workers of wg and returns once all entries
+  // have been delivered. func is called concurrently with batches of
+  // entries from a single directory each. There is no particular order
+  // between batches, except that the entry of a directory is always
+  // delivered before any of its contents.
+  void walk_parallel(worker_group& wg, dir_entry_batch_func const& func,
+                     size_t batch_size = kWalkBatchSize) const {
+    impl_->walk_parallel(wg, func, batch_size);
+  }
+
   std::optional<inode_view> find(const char* path) const {
     return impl_->find(path);
   }
@@ -111,6 +179,15 @@ class metadata_v2 {
     return impl_->readdir(dir, offset);
   }
 
+  // Calls func(offset, entry, name) for all entries starting at offset
+  // until it returns false. Much cheaper than repeated single readdir()
+  // calls, as names are decoded in batches.
+  void readdir(directory_view dir, size_t offset,
+               std::function<bool(size_t, inode_view, std::string_view)> const&
+                   func) const {
+    impl_->readdir(dir, offset, func);
+  }
+
   size_t dirsize(directory_view dir) const { return impl_->dirsize(dir); }
 
   int access(inode_view iv, int mode, uid_t uid, gid_t gid) const {
@@ -135,9 +212,46 @@ class metadata_v2 {
 
   size_t block_size() const { return impl_->block_size(); }
 
+  size_t reference_block_count() const {
+    return impl_->reference_block_count();
+  }
+
+  std::optional<uint64_t> reference_block_digest() const {
+    return impl_->reference_block_digest();
+  }
+
+  // Reverse index from block number to all file ranges stored in that
+  // block. Hardlinked files are only listed once, using the first path
+  // found in data order.
+  std::vector<std::vector<block_file_range>> block_map() const {
+    return impl_->block_map();
+  }
+
+  // Ranges of the frozen metadata that are accessed for lookups and
+  // getattr, i.e. everything except symlink strings and the version
+  // string. The ranges are sorted and don't overlap.
+  std::vector<folly::ByteRange> hot_ranges() const {
+    return impl_->hot_ranges();
+  }
+
+  // The metadata with all packed tables unpacked, so it can be modified
+  // and frozen again
+  thrift::metadata::metadata unpack() const { return impl_->unpack(); }
+
   static std::pair<std::vector<uint8_t>, std::vector<uint8_t>>
   freeze(const thrift::metadata::metadata& data);
 
+  // Freezes a string table into the data of a METADATA_V2_NAMES or
+  // METADATA_V2_SYMLINKS section
+  static std::vector<uint8_t>
+  freeze_string_table(const thrift::metadata::string_table& table);
+
+  // Applies `opts` to metadata returned by unpack(), packing tables as
+  // requested; throws if the metadata is too old to be rebuilt
+  static void rebuild(thrift::metadata::metadata& data,
+                      metadata_rebuild_options const& opts,
+                      size_t num_threads = 1);
+
   class impl {
    public:
     virtual ~impl() = default;
@@ -147,6 +261,8 @@ class metadata_v2 {
         std::function<void(const std::string&, uint32_t)> const& icb) const = 0;
 
     virtual folly::dynamic as_dynamic() const = 0;
+    virtual void write_as_json(std::ostream& os) const = 0;
+    virtual thrift::metadata::metadata unpack() const = 0;
     virtual std::string serialize_as_json(bool simple) const = 0;
 
     virtual size_t size() const = 0;
@@ -158,6 +274,16 @@ class metadata_v2 {
     virtual void
     walk_data_order(std::function<void(dir_entry_view)> const& func) const = 0;
 
+    virtual void walk_batched(dir_entry_batch_func const& func,
+                              size_t batch_size) const = 0;
+
+    virtual void walk_data_order_batched(dir_entry_batch_func const& func,
+                                         size_t batch_size) const = 0;
+
+    virtual void walk_parallel(worker_group& wg,
+                               dir_entry_batch_func const& func,
+                               size_t batch_size) const = 0;
+
     virtual std::optional<inode_view> find(const char* path) const = 0;
     virtual std::optional<inode_view> find(int inode) const = 0;
     virtual std::optional<inode_view>
@@ -170,6 +296,11 @@ class metadata_v2 {
     virtual std::optional<std::pair<inode_view, std::string>>
     readdir(directory_view dir, size_t offset) const = 0;
 
+    virtual void
+    readdir(directory_view dir, size_t offset,
+            std::function<bool(size_t, inode_view, std::string_view)> const&
+                func) const = 0;
+
     virtual size_t dirsize(directory_view dir) const = 0;
 
     virtual int access(inode_view iv, int mode, uid_t uid, gid_t gid) const = 0;
@@ -185,6 +316,12 @@ class metadata_v2 {
     virtual std::optional<chunk_range> get_chunks(int inode) const = 0;
 
     virtual size_t block_size() const = 0;
+    virtual size_t reference_block_count() const = 0;
+    virtual std::optional<uint64_t> reference_block_digest() const = 0;
+
+    virtual std::vector<std::vector<block_file_range>> block_map() const = 0;
+
+    virtual std::vector<folly::ByteRange> hot_ranges() const = 0;
   };
 
  private:
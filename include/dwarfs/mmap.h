@@ -41,6 +41,12 @@ class mmap : public mmif {
   boost::system::error_code lock(off_t offset, size_t size) override;
   boost::system::error_code release(off_t offset, size_t size) override;
   boost::system::error_code release_until(off_t offset) override;
+  boost::system::error_code
+  advise_sequential(off_t offset, size_t size) override;
+  boost::system::error_code
+  advise_willneed(off_t offset, size_t size) override;
+
+  bool read_uncached(void* buf, off_t offset, size_t size) override;
 
  private:
   int fd_;
@@ -50,5 +50,23 @@ class mmif : public boost::noncopyable {
   virtual boost::system::error_code lock(off_t offset, size_t size) = 0;
   virtual boost::system::error_code release(off_t offset, size_t size) = 0;
   virtual boost::system::error_code release_until(off_t offset) = 0;
+  virtual boost::system::error_code
+  advise_sequential(off_t offset, size_t size) = 0;
+  // Starts reading the data in the background, without waiting for it
+  virtual boost::system::error_code
+  advise_willneed(off_t offset, size_t size) = 0;
+
+  // Must be called before accessing data that may not be available
+  // yet, e.g. if the image is fetched on demand; throws if the data
+  // cannot be made available
+  virtual void populate(off_t /*offset*/, size_t /*size*/) {}
+
+  // Reads the data into `buf` without going through the mapping and
+  // drops it from the page cache; returns false if this isn't supported
+  // and throws if reading fails
+  virtual bool
+  read_uncached(void* /*buf*/, off_t /*offset*/, size_t /*size*/) {
+    return false;
+  }
 };
 } // namespace dwarfs
@@ -26,8 +26,25 @@
 #include <memory>
 #include <type_traits>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "dwarfs/compiler.h"
 
+#if defined(__aarch64__)
+#define DWARFS_NILSIMSA_SIMILARITY(r, a, b)                                    \
+  do {                                                                         \
+    auto const* pa = reinterpret_cast<uint8_t const*>(a);                      \
+    auto const* pb = reinterpret_cast<uint8_t const*>(b);                      \
+    uint8x16_t lo = vcntq_u8(veorq_u8(vld1q_u8(pa), vld1q_u8(pb)));            \
+    uint8x16_t hi =                                                            \
+        vcntq_u8(veorq_u8(vld1q_u8(pa + 16), vld1q_u8(pb + 16)));              \
+    r 255 - static_cast<int>(vaddlvq_u8(lo) + vaddlvq_u8(hi));                 \
+  } while (false)
+#else
 #define DWARFS_NILSIMSA_SIMILARITY(r, a, b)                                    \
   do {                                                                         \
     int bits = 0;                                                              \
@@ -40,6 +57,22 @@
     }                                                                          \
     r 255 - bits;                                                              \
   } while (false)
+#endif
+
+#if defined(__x86_64__)
+// requires target("avx512vpopcntdq,avx512vl")
+#define DWARFS_NILSIMSA_SIMILARITY_AVX512(r, a, b)                             \
+  do {                                                                         \
+    __m256i x = _mm256_xor_si256(                                              \
+        _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a)),               \
+        _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b)));              \
+    __m256i c = _mm256_popcnt_epi64(x);                                        \
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(c),                       \
+                              _mm256_extracti128_si256(c, 1));                 \
+    s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));                            \
+    r 255 - static_cast<int>(_mm_cvtsi128_si64(s));                            \
+  } while (false)
+#endif
 
 namespace dwarfs {
 
@@ -54,6 +87,9 @@ class nilsimsa {
   void finalize(hash_type& hash) const;
 
 #ifdef DWARFS_MULTIVERSIONING
+  __attribute__((target("avx512vpopcntdq,avx512vl"))) static int
+  similarity(uint64_t const* a, uint64_t const* b);
+
   __attribute__((target("popcnt"))) static int
   similarity(uint64_t const* a, uint64_t const* b);
 
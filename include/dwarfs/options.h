@@ -23,45 +23,115 @@
 
 #include <cstddef>
 #include <iosfwd>
+#include <map>
+#include <memory>
 #include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <sys/types.h>
 
 namespace dwarfs {
 
+class block_cache;
+class mmif;
+
 enum class mlock_mode { NONE, TRY, MUST };
 
+enum class cache_policy { LRU, SEGMENTED_LRU, COST };
+
 struct block_cache_options {
   size_t max_bytes{0};
+  size_t tier2_max_bytes{0};
   size_t num_workers{0};
+  // maximum number of workers running background jobs, e.g. prefetching;
+  // 0 means all but one worker
+  size_t max_background_jobs{0};
+  // pin the workers to these CPUs, so decompressed blocks are allocated
+  // on their NUMA node; empty means no pinning
+  std::vector<int> worker_cpus;
+  size_t num_shards{1};
   double decompress_ratio{1.0};
+  // demand requests waiting for blocks of at most this compressed size,
+  // or made while all workers are busy, are decompressed on the
+  // requesting thread; 0 disables this
+  size_t inline_max_bytes{0};
+  // number of threads reading in the compressed data of a block before
+  // it is queued for decompression, so I/O overlaps with decompression;
+  // 0 means blocks are queued right away
+  size_t io_workers{0};
+  cache_policy policy{cache_policy::LRU};
   bool mm_release{true};
+  // read compressed blocks into private buffers with pread() and drop
+  // them from the page cache, instead of accessing them through the
+  // image mapping; falls back to the mapping if the image can't do this
+  bool direct_read{false};
+  bool record_access{false};
   bool init_workers{true};
+  bool verify_blocks{false};
+  std::string disk_cache_dir;
+  size_t disk_cache_max_bytes{0};
+};
+
+struct inode_reader_options {
+  size_t readahead{0};
 };
 
 struct metadata_options {
   bool enable_nlink{false};
   bool readonly{false};
   bool check_consistency{false};
+  size_t dir_hash_threshold{0};
+  size_t path_cache_size{0};
+  bool lazy_tables{false};
 };
 
 struct filesystem_options {
   static constexpr off_t IMAGE_OFFSET_AUTO{-1};
 
   mlock_mode lock_mode{mlock_mode::NONE};
+  // only mlock() the metadata structures needed for lookups and leave
+  // bulk data like symlink strings unpinned
+  bool lock_hot_metadata{false};
+  // pre-fault the metadata using MADV_WILLNEED when loading the image
+  bool prefault_metadata{false};
+  // number of threads for decompressing the frames of seekable metadata,
+  // 0 means one per CPU
+  size_t metadata_threads{0};
+  // if set, decompressed metadata is stored in this directory and used
+  // directly when the same image is loaded again
+  std::string metadata_cache_dir;
   off_t image_offset{0};
   block_cache_options block_cache;
+  inode_reader_options inode_reader;
   metadata_options metadata;
+  std::shared_ptr<mmif> reference_image;
+  // if set, blocks are cached in this cache, which can be shared with
+  // other images, instead of in one created from `block_cache`
+  std::shared_ptr<::dwarfs::block_cache> shared_block_cache;
+};
+
+struct adaptive_compression_rule {
+  double min_entropy;
+  std::string compression;
 };
 
 struct filesystem_writer_options {
   size_t max_queue_size{64 << 20};
   bool remove_header{false};
+  bool with_section_index{false};
+  size_t block_alignment{0};
+  std::vector<adaptive_compression_rule> adaptive_compression;
 };
 
 struct inode_options {
   bool with_similarity{false};
   bool with_nilsimsa{false};
+  // files larger than this are split into fragments of this size, each
+  // with its own similarity hashes, that are ordered independently;
+  // 0 means files are never split
+  size_t fragment_size{0};
 
   bool needs_scan() const { return with_similarity || with_nilsimsa; }
 };
@@ -73,6 +143,7 @@ struct file_order_options {
   int nilsimsa_depth{20000};
   int nilsimsa_min_depth{1000};
   int nilsimsa_limit{255};
+  int nilsimsa_lsh_bands{0};
 };
 
 struct scanner_options {
@@ -85,6 +156,12 @@ struct scanner_options {
   bool with_devices{false};
   bool with_specials{false};
   uint32_t time_resolution_sec{1};
+  size_t num_scanner_workers{0};
+  size_t num_segmenters{1};
+  bool base_is_reference{false};
+  bool categorize{false};
+  size_t dictionary_size{0};
+  std::map<std::string, std::string> category_compression;
   inode_options inode;
   bool pack_chunk_table{false};
   bool pack_directories{false};
@@ -96,16 +173,86 @@ struct scanner_options {
   bool pack_symlinks{false};
   bool pack_symlinks_index{false};
   bool force_pack_string_tables{false};
+  // store names and symlinks in their own sections, which are only
+  // loaded when needed
+  bool separate_string_tables{false};
+};
+
+enum class file_read_mode { MMAP, PREAD };
+
+struct os_access_options {
+  file_read_mode read_mode{file_read_mode::MMAP};
+  size_t read_size{8 << 20};
+};
+
+struct http_file_options {
+  // data is fetched in multiples of this size
+  size_t fetch_size{1 << 20};
+  // larger ranges are split into requests of at most this size, which
+  // are fetched in parallel
+  size_t max_request_size{16 << 20};
+  size_t max_connections{8};
+  // timeout for connecting, sending and receiving
+  int timeout_ms{30000};
+  // number of times a failed request is retried
+  size_t retries{3};
+  // delay before the first retry, doubled for each further retry
+  int retry_delay_ms{250};
+};
+
+struct integrity_check_options {
+  size_t num_workers{1};
+  // maximum number of bytes being verified ahead of the oldest
+  // unverified section
+  size_t window_size{256 << 20};
+  off_t image_offset{filesystem_options::IMAGE_OFFSET_AUTO};
+};
+
+// changes applied when rebuilding the metadata of an existing image;
+// see scanner_options for the meaning of the individual fields
+struct metadata_rebuild_options {
+  std::optional<uint16_t> uid;
+  std::optional<uint16_t> gid;
+  std::optional<uint64_t> timestamp;
+  bool pack_chunk_table{false};
+  bool pack_directories{false};
+  bool pack_shared_files_table{false};
+  bool plain_names_table{false};
+  bool pack_names{false};
+  bool pack_names_index{false};
+  bool plain_symlinks_table{false};
+  bool pack_symlinks{false};
+  bool pack_symlinks_index{false};
+  bool force_pack_string_tables{false};
 };
 
 struct rewrite_options {
   bool recompress_block{false};
   bool recompress_metadata{false};
+  // if set, the metadata is unpacked, modified and packed again; all
+  // blocks that aren't recompressed are copied as they are
+  std::optional<metadata_rebuild_options> rebuild_metadata;
+  // verify the integrity of blocks that are copied verbatim, not only
+  // their fast checksum
+  bool verify_blocks{false};
+  // half-open [first, last) ranges of block numbers, empty means all
+  std::vector<std::pair<size_t, size_t>> recompress_block_ranges;
+  size_t num_workers{1};
   off_t image_offset{filesystem_options::IMAGE_OFFSET_AUTO};
+  // blocks with at least hot_min_count accesses are recompressed with
+  // hot_compression, hottest first, up to hot_max_bytes (0 = no limit)
+  std::vector<uint32_t> hot_block_counts;
+  std::string hot_compression;
+  uint32_t hot_min_count{1};
+  size_t hot_max_bytes{0};
 };
 
 std::ostream& operator<<(std::ostream& os, file_order_mode mode);
 
 mlock_mode parse_mlock_mode(std::string_view mode);
 
+cache_policy parse_cache_policy(std::string_view policy);
+
+file_read_mode parse_file_read_mode(std::string_view mode);
+
 } // namespace dwarfs
@@ -21,8 +21,12 @@
 
 #pragma once
 
+#include <cstddef>
 #include <memory>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <sys/stat.h>
 
@@ -47,6 +51,23 @@ class os_access {
   virtual std::string readlink(const std::string& path, size_t size) const = 0;
   virtual std::shared_ptr<mmif>
   map_file(const std::string& path, size_t size) const = 0;
+  // Returns the (offset, size) ranges of the first `size` bytes of a
+  // file that hold data, in ascending order; everything in between is
+  // a hole. Files that can't be checked for holes have a single range.
+  virtual std::vector<std::pair<size_t, size_t>>
+  data_extents(const std::string& path, size_t size) const = 0;
   virtual int access(const std::string& path, int mode) const = 0;
+  // Returns a 16 byte digest of the first `size` bytes of a file if it
+  // is known without reading them, e.g. from the metadata of an existing
+  // image. Digests are only compared with each other: files with the
+  // same digest must have identical contents.
+  virtual std::optional<std::string>
+  content_digest(const std::string& /*path*/, size_t /*size*/) const {
+    return std::nullopt;
+  }
+  // Called once the contents of a file won't be accessed again, so an
+  // implementation that keeps them in memory can drop them. Mappings
+  // returned by map_file() before remain valid.
+  virtual void release_file(const std::string& /*path*/) const {}
 };
 } // namespace dwarfs
@@ -0,0 +1,78 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dwarfs/os_access.h"
+
+namespace dwarfs {
+
+class logger;
+class mmif;
+
+/**
+ * An os_access implementation for the contents of an archive
+ *
+ * Anything libarchive can read is supported, e.g. tar or cpio streams,
+ * optionally compressed. The archive is read sequentially exactly once
+ * when the object is created, so it can be a pipe. The contents of all
+ * files are kept in memory until they are released, as they are needed
+ * again for hashing and segmenting, in an order that's unrelated to
+ * their order in the archive. Only the data extents of sparse files are
+ * stored.
+ *
+ * The root of the archive has the empty path, all other paths start
+ * with a `/`, just like the paths the scanner uses for an empty root.
+ */
+class os_access_archive : public os_access {
+ public:
+  // `path` is the archive file, or `-` to read from stdin
+  os_access_archive(logger& lgr, std::string const& path);
+
+  ~os_access_archive() override;
+
+  std::shared_ptr<dir_reader> opendir(const std::string& path) const override;
+  void lstat(const std::string& path, struct ::stat* st) const override;
+  std::string readlink(const std::string& path, size_t size) const override;
+  std::shared_ptr<mmif>
+  map_file(const std::string& path, size_t size) const override;
+  std::vector<std::pair<size_t, size_t>>
+  data_extents(const std::string& path, size_t size) const override;
+  int access(const std::string& path, int mode) const override;
+  void release_file(const std::string& path) const override;
+
+ private:
+  struct node;
+
+  node* find(std::string const& path) const;
+  node& get(std::string const& path, char const* what) const;
+
+  std::shared_ptr<node> root_;
+  mutable std::mutex mx_;
+};
+} // namespace dwarfs
@@ -0,0 +1,71 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dwarfs/os_access.h"
+
+namespace dwarfs {
+
+class filesystem_v2;
+class mmif;
+
+/**
+ * An os_access implementation for the contents of a DwarFS image
+ *
+ * This allows building a new image from an existing one, e.g. to change
+ * its ordering or segmenting options, without extracting it first. The
+ * image should be opened with `enable_nlink` so hard links are kept.
+ *
+ * File digests are derived from the chunk lists of the image, so files
+ * don't have to be read just to find duplicates.
+ */
+class os_access_filesystem : public os_access {
+ public:
+  explicit os_access_filesystem(std::shared_ptr<filesystem_v2 const> fs);
+
+  std::shared_ptr<dir_reader> opendir(const std::string& path) const override;
+  void lstat(const std::string& path, struct ::stat* st) const override;
+  std::string readlink(const std::string& path, size_t size) const override;
+  std::shared_ptr<mmif>
+  map_file(const std::string& path, size_t size) const override;
+  std::vector<std::pair<size_t, size_t>>
+  data_extents(const std::string& path, size_t size) const override;
+  int access(const std::string& path, int mode) const override;
+  std::optional<std::string>
+  content_digest(const std::string& path, size_t size) const override;
+
+ private:
+  uint32_t find_file(std::string const& path, size_t size,
+                     char const* what) const;
+
+  std::shared_ptr<filesystem_v2 const> fs_;
+};
+} // namespace dwarfs
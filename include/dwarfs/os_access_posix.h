@@ -25,6 +25,7 @@
 #include <memory>
 #include <string>
 
+#include "dwarfs/options.h"
 #include "dwarfs/os_access.h"
 
 namespace dwarfs {
@@ -33,11 +34,19 @@ class mmif;
 
 class os_access_posix : public os_access {
  public:
+  explicit os_access_posix(os_access_options const& opts = {})
+      : opts_{opts} {}
+
   std::shared_ptr<dir_reader> opendir(const std::string& path) const override;
   void lstat(const std::string& path, struct ::stat* st) const override;
   std::string readlink(const std::string& path, size_t size) const override;
   std::shared_ptr<mmif>
   map_file(const std::string& path, size_t size) const override;
+  std::vector<std::pair<size_t, size_t>>
+  data_extents(const std::string& path, size_t size) const override;
   int access(const std::string& path, int mode) const override;
+
+ private:
+  os_access_options const opts_;
 };
 } // namespace dwarfs
@@ -0,0 +1,73 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "dwarfs/mmif.h"
+
+namespace dwarfs {
+
+/**
+ * An mmif implementation that reads a file using pread()
+ *
+ * The file is mapped privately, and a bounded window ahead of the
+ * current position is read into anonymous memory replacing the mapping
+ * using large sequential reads, dropping the page cache for each range
+ * once it has been copied. The window moves as the caller releases the
+ * data it has consumed. Releasing a range maps the file again, so the
+ * memory is returned to the system while the data remains accessible
+ * (albeit through the page cache), just like data outside the window.
+ */
+class pread_file : public mmif {
+ public:
+  pread_file(const std::string& path, size_t size, size_t read_size);
+
+  ~pread_file() noexcept override;
+
+  void const* addr() const override;
+  size_t size() const override;
+
+  boost::system::error_code lock(off_t offset, size_t size) override;
+  boost::system::error_code release(off_t offset, size_t size) override;
+  boost::system::error_code release_until(off_t offset) override;
+  boost::system::error_code
+  advise_sequential(off_t offset, size_t size) override;
+  boost::system::error_code
+  advise_willneed(off_t offset, size_t size) override;
+
+ private:
+  void read_ahead(size_t offset);
+  boost::system::error_code advance(size_t offset);
+  boost::system::error_code remap(off_t offset, size_t size);
+
+  int fd_;
+  size_t size_;
+  void* addr_;
+  off_t const page_size_;
+  size_t read_size_;
+  size_t window_size_;
+  size_t filled_{0};
+  off_t released_{0};
+};
+} // namespace dwarfs
@@ -21,20 +21,124 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <iosfwd>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <folly/Function.h>
+#include <folly/lang/Align.h>
+
+#include "dwarfs/memory_accountant.h"
 
 namespace dwarfs {
 
 class object;
 
+namespace detail {
+
+constexpr size_t kCounterSlots{16};
+
+// Threads are assigned to the slots of all counters round-robin, so up
+// to kCounterSlots threads never share a slot.
+inline size_t counter_slot() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t const slot = next++ % kCounterSlots;
+  return slot;
+}
+
+} // namespace detail
+
+/**
+ * A counter that can be updated concurrently from many threads without
+ * the cache line holding it bouncing between cores
+ *
+ * Each thread updates its own slot, and every slot lives on a separate
+ * cache line. Reading the counter sums up all slots, which is a lot
+ * more expensive than an update, but it's only done for reporting.
+ * Slots may wrap around if the counter is decremented, the sum is
+ * still correct.
+ */
+template <typename T>
+class sharded_counter {
+ public:
+  explicit sharded_counter(T value = 0) {
+    slots_[0].value.store(value, std::memory_order_relaxed);
+  }
+
+  sharded_counter& operator+=(T value) {
+    slot().fetch_add(value, std::memory_order_relaxed);
+    return *this;
+  }
+
+  sharded_counter& operator-=(T value) {
+    slot().fetch_sub(value, std::memory_order_relaxed);
+    return *this;
+  }
+
+  sharded_counter& operator++() { return *this += 1; }
+  void operator++(int) { *this += 1; }
+
+  T load() const {
+    T sum = 0;
+    for (auto const& s : slots_) {
+      sum += s.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  operator T() const { return load(); }
+
+ private:
+  struct alignas(folly::hardware_destructive_interference_size) slot_type {
+    std::atomic<T> value{0};
+  };
+
+  std::atomic<T>& slot() { return slots_[detail::counter_slot()].value; }
+
+  std::array<slot_type, detail::kCounterSlots> slots_;
+};
+
+/**
+ * The object currently being worked on, for display only
+ *
+ * Like sharded_counter, each thread stores its object in its own slot.
+ * load() prefers slots that have been updated since the last call, so
+ * it follows the threads that are still busy.
+ */
+class current_object {
+ public:
+  void store(object const* obj) {
+    auto& s = slots_[detail::counter_slot()];
+    s.obj.store(obj, std::memory_order_relaxed);
+    s.seq.fetch_add(1, std::memory_order_release);
+  }
+
+  object const* load() const;
+
+  // clears all slots, e.g. before the objects are destroyed
+  void reset();
+
+ private:
+  struct alignas(folly::hardware_destructive_interference_size) slot_type {
+    std::atomic<object const*> obj{nullptr};
+    std::atomic<size_t> seq{0};
+  };
+
+  std::array<slot_type, detail::kCounterSlots> slots_;
+  mutable std::mutex mx_;
+  mutable std::array<size_t, detail::kCounterSlots> seen_{};
+  mutable size_t next_{0};
+};
+
 class progress {
  public:
   using status_function_type =
@@ -54,36 +158,95 @@ class progress {
 
   std::string status(size_t max_len) const;
 
-  std::atomic<object const*> current{nullptr};
-  std::atomic<size_t> files_found{0};
-  std::atomic<size_t> files_scanned{0};
-  std::atomic<size_t> dirs_found{0};
-  std::atomic<size_t> dirs_scanned{0};
-  std::atomic<size_t> symlinks_found{0};
-  std::atomic<size_t> symlinks_scanned{0};
-  std::atomic<size_t> specials_found{0};
-  std::atomic<size_t> duplicate_files{0};
-  std::atomic<size_t> hardlinks{0};
-  std::atomic<size_t> block_count{0};
-  std::atomic<size_t> chunk_count{0};
-  std::atomic<size_t> inodes_scanned{0};
-  std::atomic<size_t> inodes_written{0};
-  std::atomic<size_t> blocks_written{0};
-  std::atomic<size_t> errors{0};
+  struct stage_timing {
+    std::string name;
+    double wall_time{0.0};
+    double cpu_time{0.0};
+  };
+
+  // Starts timing a new pipeline stage, ending the current one (if any).
+  // CPU time is accounted for the whole process, so it includes all
+  // worker threads that were busy during the stage.
+  void begin_stage(std::string name);
+  void end_stage();
+  std::vector<stage_timing> stages() const;
+
+  // Statistics of all segmenters, summed up as each segmenter finishes
+  struct segmenter_stats {
+    size_t total_hashes{0};
+    size_t duplicate_hashes{0};
+    size_t total_probes{0};
+    size_t max_probes{0};
+    size_t total_matches{0};
+    size_t good_matches{0};
+    size_t bad_matches{0};
+    size_t bloom_lookups{0};
+    size_t bloom_hits{0};
+    size_t bloom_true_positives{0};
+    size_t cdc_chunks{0};
+    size_t cdc_matches{0};
+    // chunks merged with the preceding, contiguous chunk of an inode
+    size_t merged_chunks{0};
+
+    void merge(segmenter_stats const& other);
+  };
+
+  void add_segmenter_stats(segmenter_stats const& st);
+  segmenter_stats get_segmenter_stats() const;
+
+  // One entry for each block in the order the blocks have been written
+  struct block_stats {
+    std::string category;
+    std::string compression;
+    size_t uncompressed_size{0};
+    size_t compressed_size{0};
+  };
+
+  void add_block_stats(block_stats st);
+  std::vector<block_stats> written_blocks() const;
+
+  // Memory used by all stages, shared by everything that reports progress
+  memory_accountant memory;
+
+  current_object current;
+  sharded_counter<size_t> files_found{0};
+  sharded_counter<size_t> files_scanned{0};
+  sharded_counter<size_t> dirs_found{0};
+  sharded_counter<size_t> dirs_scanned{0};
+  sharded_counter<size_t> symlinks_found{0};
+  sharded_counter<size_t> symlinks_scanned{0};
+  sharded_counter<size_t> specials_found{0};
+  sharded_counter<size_t> duplicate_files{0};
+  sharded_counter<size_t> hardlinks{0};
+  sharded_counter<size_t> block_count{0};
+  sharded_counter<size_t> chunk_count{0};
+  sharded_counter<size_t> inodes_scanned{0};
+  sharded_counter<size_t> inodes_written{0};
+  sharded_counter<size_t> blocks_written{0};
+  sharded_counter<size_t> errors{0};
+  // these are gauges, set by a single thread
   std::atomic<size_t> nilsimsa_depth{0};
   std::atomic<size_t> blockify_queue{0};
   std::atomic<size_t> compress_queue{0};
-  std::atomic<uint64_t> original_size{0};
-  std::atomic<uint64_t> hardlink_size{0};
-  std::atomic<uint64_t> saved_by_deduplication{0};
-  std::atomic<uint64_t> saved_by_segmentation{0};
-  std::atomic<uint64_t> filesystem_size{0};
-  std::atomic<uint64_t> compressed_size{0};
+  sharded_counter<uint64_t> original_size{0};
+  sharded_counter<uint64_t> hardlink_size{0};
+  sharded_counter<uint64_t> saved_by_deduplication{0};
+  sharded_counter<uint64_t> saved_by_segmentation{0};
+  sharded_counter<uint64_t> saved_by_holes{0};
+  sharded_counter<uint64_t> filesystem_size{0};
+  sharded_counter<uint64_t> compressed_size{0};
 
  private:
   std::atomic<bool> running_;
   mutable std::mutex mx_;
   std::condition_variable cond_;
+  mutable std::mutex stage_mx_;
+  std::vector<stage_timing> stages_;
+  std::optional<std::pair<double, double>> stage_start_;
+  uint64_t stage_trace_start_{0};
+  mutable std::mutex stats_mx_;
+  segmenter_stats segmenter_stats_;
+  std::vector<block_stats> block_stats_;
   status_function_type status_fun_;
   std::thread thread_;
 };
@@ -39,11 +39,16 @@ class python_script : public script {
   bool has_filter() const override;
   bool has_transform() const override;
   bool has_order() const override;
+  bool has_categorize() const override;
 
   void configure(options_interface const& oi) override;
   bool filter(entry_interface const& ei) override;
   void transform(entry_interface& ei) override;
   void order(inode_vector& iv) override;
+  std::string categorize(entry_interface const& ei) override;
+  std::vector<bool>
+  filter_batch(std::vector<entry_interface const*> const& entries) override;
+  void transform_batch(std::vector<entry_interface*> const& entries) override;
 
  private:
   class impl;
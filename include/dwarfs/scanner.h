@@ -23,6 +23,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "dwarfs/block_manager.h"
 
@@ -31,6 +32,7 @@ namespace dwarfs {
 struct scanner_options;
 
 class entry_factory;
+class filesystem_v2;
 class filesystem_writer;
 class logger;
 class os_access;
@@ -40,20 +42,37 @@ class worker_group;
 
 class scanner {
  public:
+  // An image to build, with its own writer and block configuration
+  struct output {
+    filesystem_writer& fsw;
+    block_manager::config cfg;
+  };
+
   scanner(logger& lgr, worker_group& wg, const block_manager::config& cfg,
           std::shared_ptr<entry_factory> ef, std::shared_ptr<os_access> os,
           std::shared_ptr<script> scr, const scanner_options& options);
 
-  void scan(filesystem_writer& fsw, const std::string& path, progress& prog) {
-    impl_->scan(fsw, path, prog);
+  void scan(filesystem_writer& fsw, const std::string& path, progress& prog,
+            filesystem_v2 const* base = nullptr) {
+    impl_->scan(fsw, path, prog, base);
+  }
+
+  // Builds several images from a single scan of `path`. The tree is
+  // only scanned, categorized and ordered once; the images are then
+  // segmented and written one after the other.
+  void scan(std::vector<output> const& outputs, const std::string& path,
+            progress& prog) {
+    impl_->scan(outputs, path, prog);
   }
 
   class impl {
    public:
     virtual ~impl() = default;
 
-    virtual void
-    scan(filesystem_writer& fsw, const std::string& path, progress& prog) = 0;
+    virtual void scan(filesystem_writer& fsw, const std::string& path,
+                      progress& prog, filesystem_v2 const* base) = 0;
+    virtual void scan(std::vector<output> const& outputs,
+                      const std::string& path, progress& prog) = 0;
   };
 
  private:
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace dwarfs {
@@ -41,11 +42,33 @@ class script {
   virtual bool has_filter() const = 0;
   virtual bool has_transform() const = 0;
   virtual bool has_order() const = 0;
+  virtual bool has_categorize() const = 0;
 
   virtual void configure(options_interface const& oi) = 0;
   virtual bool filter(entry_interface const& ei) = 0;
   virtual void transform(entry_interface& ei) = 0;
   virtual void order(inode_vector& iv) = 0;
+  virtual std::string categorize(entry_interface const& ei) = 0;
+
+  // Batch variants of filter() and transform(), called with all entries
+  // of a directory at once; filter_batch() returns whether to keep each
+  // of the entries. These may be called from a different thread than
+  // the other methods, but never concurrently.
+  virtual std::vector<bool>
+  filter_batch(std::vector<entry_interface const*> const& entries) {
+    std::vector<bool> keep;
+    keep.reserve(entries.size());
+    for (auto e : entries) {
+      keep.push_back(filter(*e));
+    }
+    return keep;
+  }
+
+  virtual void transform_batch(std::vector<entry_interface*> const& entries) {
+    for (auto e : entries) {
+      transform(*e);
+    }
+  }
 };
 
 } // namespace dwarfs
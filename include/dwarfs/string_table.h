@@ -22,6 +22,7 @@
 #pragma once
 
 #include <array>
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -52,13 +53,36 @@ class string_table {
     bool pack_data;
     bool pack_index;
     bool force_pack_data;
+    // Large tables are encoded in shards on this many threads
+    size_t num_threads{1};
   };
 
+  // A packed table that is loaded by a table_loader; `holder` keeps
+  // the memory `view` refers to alive
+  struct loaded_table {
+    std::shared_ptr<void const> holder;
+    PackedTableView view;
+  };
+
+  using table_loader = std::function<loaded_table()>;
+
   string_table(logger& lgr, std::string_view name, PackedTableView v);
   string_table(LegacyTableView v);
 
+  // The table is only loaded when it is first used; this is safe to do
+  // from multiple threads
+  string_table(logger& lgr, std::string_view name, table_loader loader);
+
   std::string operator[](size_t index) const { return impl_->lookup(index); }
 
+  // Look up a batch of strings, decoding them into a single arena
+  // instead of allocating a string each. The returned views are valid
+  // as long as both the table and the arena are.
+  std::vector<std::string_view>
+  lookup(folly::Range<uint32_t const*> indices, std::string& arena) const {
+    return impl_->lookup(indices, arena);
+  }
+
   std::vector<std::string> unpack() const { return impl_->unpack(); }
 
   bool is_packed() const { return impl_->is_packed(); }
@@ -91,6 +115,9 @@ class string_table {
     virtual ~impl() = default;
 
     virtual std::string lookup(size_t index) const = 0;
+    virtual std::vector<std::string_view>
+    lookup(folly::Range<uint32_t const*> indices,
+           std::string& arena) const = 0;
     virtual std::vector<std::string> unpack() const = 0;
     virtual bool is_packed() const = 0;
     virtual size_t unpacked_size() const = 0;
@@ -23,6 +23,8 @@
 
 #include <cstddef>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace dwarfs {
 
@@ -31,4 +33,14 @@ std::string size_with_unit(size_t size);
 size_t parse_size_with_unit(const std::string& str);
 std::string get_program_path();
 
+// Number of CPUs this process can actually use, taking the scheduler
+// affinity mask as well as cgroup CPU quotas into account
+size_t available_cpus();
+
+// Parses a CPU list like "0-3,8,10-11", as used by the kernel
+std::vector<int> parse_cpu_list(std::string_view list);
+
+// CPUs that belong to the given NUMA node
+std::vector<int> numa_node_cpus(int node);
+
 } // namespace dwarfs
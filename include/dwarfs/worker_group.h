@@ -26,11 +26,22 @@
 #include <limits>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <folly/Function.h>
 
 namespace dwarfs {
 
+/**
+ * Scheduling priority of a job
+ *
+ * Queued jobs are always started in order of priority. DEMAND is for
+ * jobs someone is waiting for, READAHEAD for jobs that will likely be
+ * waited for soon and BACKGROUND for everything else, e.g. warming up
+ * a cache.
+ */
+enum class job_priority { DEMAND, READAHEAD, BACKGROUND };
+
 /**
  * A group of worker threads
  *
@@ -45,6 +56,9 @@ class worker_group {
   static struct load_adaptive_tag {
   } load_adaptive;
 
+  static struct work_stealing_tag {
+  } work_stealing;
+
   /**
    * Create a worker group
    *
@@ -58,12 +72,31 @@ class worker_group {
   /**
    * Create a load adaptive worker group
    *
-   * \param num_workers     Number of worker threads.
+   * The number of workers running jobs is adjusted between the minimum
+   * and maximum based on how CPU bound the jobs are and on the CPU and
+   * memory pressure of the whole system.
+   *
+   * \param max_num_workers Maximum number of worker threads.
+   * \param min_num_workers Minimum number of active worker threads.
    */
   explicit worker_group(
       load_adaptive_tag, const char* group_name = nullptr,
       size_t max_num_workers = 1,
       size_t max_queue_len = std::numeric_limits<size_t>::max(),
+      int niceness = 0, size_t min_num_workers = 1);
+
+  /**
+   * Create a work stealing worker group
+   *
+   * Each worker has its own job queue, which scales better for large
+   * numbers of small jobs.
+   *
+   * \param num_workers     Number of worker threads.
+   */
+  explicit worker_group(
+      work_stealing_tag, const char* group_name = nullptr,
+      size_t num_workers = 1,
+      size_t max_queue_len = std::numeric_limits<size_t>::max(),
       int niceness = 0);
 
   worker_group() = default;
@@ -77,14 +110,30 @@ class worker_group {
   void stop() { impl_->stop(); }
   void wait() { impl_->wait(); }
   bool running() const { return impl_->running(); }
-  bool add_job(job_t&& job) { return impl_->add_job(std::move(job)); }
+  bool add_job(job_t&& job, job_priority prio = job_priority::DEMAND) {
+    return impl_->add_job(std::move(job), prio);
+  }
+  bool add_jobs(std::vector<job_t>&& jobs,
+                job_priority prio = job_priority::DEMAND) {
+    return impl_->add_jobs(std::move(jobs), prio);
+  }
+  // Limits the number of concurrently running BACKGROUND jobs, so they
+  // can't occupy all workers
+  void set_background_limit(size_t limit) {
+    impl_->set_background_limit(limit);
+  }
+  // Restricts all worker threads to the given CPUs
+  void set_affinity(std::vector<int> const& cpus) {
+    impl_->set_affinity(cpus);
+  }
   size_t size() const { return impl_->size(); }
   size_t queue_size() const { return impl_->queue_size(); }
   double get_cpu_time() const { return impl_->get_cpu_time(); }
 
   template <typename T>
-  bool add_job(std::packaged_task<T()>&& task) {
-    return add_job([task = std::move(task)]() mutable { task(); });
+  bool add_job(std::packaged_task<T()>&& task,
+               job_priority prio = job_priority::DEMAND) {
+    return add_job([task = std::move(task)]() mutable { task(); }, prio);
   }
 
   class impl {
@@ -94,7 +143,10 @@ class worker_group {
     virtual void stop() = 0;
     virtual void wait() = 0;
     virtual bool running() const = 0;
-    virtual bool add_job(job_t&& job) = 0;
+    virtual bool add_job(job_t&& job, job_priority prio) = 0;
+    virtual bool add_jobs(std::vector<job_t>&& jobs, job_priority prio) = 0;
+    virtual void set_background_limit(size_t limit) = 0;
+    virtual void set_affinity(std::vector<int> const& cpus) = 0;
     virtual size_t size() const = 0;
     virtual size_t queue_size() const = 0;
     virtual double get_cpu_time() const = 0;
@@ -74,5 +74,18 @@ class mkdwarfs(object):
                 logger.debug(f"  file: {p}")
         return reversed(inodes)
 
+    def categorize(self, entry):
+        """
+        Categorization
+
+        This will be called for every regular file inode when running
+        with `--categorize`. Files in different categories are stored
+        in different blocks. Returning `None` or an empty string uses
+        the built-in categorization.
+        """
+        if entry.name().endswith('.log'):
+            return 'logs'
+        return None
+
     def _something_private(self):
         pass
@@ -19,16 +19,42 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <folly/Conv.h>
+#include <folly/File.h>
 #include <folly/experimental/symbolizer/SignalHandler.h>
 
 #if FUSE_USE_VERSION >= 30
@@ -39,14 +65,17 @@
 #endif
 
 #include "dwarfs/error.h"
+#include "dwarfs/event_tracer.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/fstypes.h"
+#include "dwarfs/http_file.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/metadata_v2.h"
 #include "dwarfs/mmap.h"
 #include "dwarfs/options.h"
 #include "dwarfs/util.h"
 #include "dwarfs/version.h"
+#include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
@@ -55,31 +84,545 @@ struct options {
   std::string fsimage;
   int seen_mountpoint{0};
   const char* cachesize_str{nullptr};        // TODO: const?? -> use string?
+  const char* cachemin_str{nullptr};         // TODO: const?? -> use string?
+  const char* compcache_str{nullptr};        // TODO: const?? -> use string?
   const char* debuglevel_str{nullptr};       // TODO: const?? -> use string?
   const char* workers_str{nullptr};          // TODO: const?? -> use string?
+  const char* bgworkers_str{nullptr};        // TODO: const?? -> use string?
+  const char* ioworkers_str{nullptr};        // TODO: const?? -> use string?
+  const char* cpuset_str{nullptr};           // TODO: const?? -> use string?
+  const char* numa_node_str{nullptr};        // TODO: const?? -> use string?
   const char* mlock_str{nullptr};            // TODO: const?? -> use string?
   const char* decompress_ratio_str{nullptr}; // TODO: const?? -> use string?
+  const char* inline_size_str{nullptr};      // TODO: const?? -> use string?
   const char* image_offset_str{nullptr};     // TODO: const?? -> use string?
+  const char* cache_shards_str{nullptr};     // TODO: const?? -> use string?
+  const char* cache_policy_str{nullptr};     // TODO: const?? -> use string?
+  const char* readahead_str{nullptr};        // TODO: const?? -> use string?
+  const char* max_read_str{nullptr};         // TODO: const?? -> use string?
+  const char* profile_str{nullptr};          // TODO: const?? -> use string?
+  const char* trace_str{nullptr};            // TODO: const?? -> use string?
+  const char* metrics_str{nullptr};          // TODO: const?? -> use string?
+  const char* eventtrace_str{nullptr};       // TODO: const?? -> use string?
+  const char* preload_str{nullptr};          // TODO: const?? -> use string?
+  const char* diskcache_str{nullptr};        // TODO: const?? -> use string?
+  const char* diskcache_size_str{nullptr};   // TODO: const?? -> use string?
+  const char* metacache_str{nullptr};        // TODO: const?? -> use string?
+  const char* async_reads_str{nullptr};      // TODO: const?? -> use string?
+  const char* dir_hash_str{nullptr};         // TODO: const?? -> use string?
+  const char* entry_timeout_str{nullptr};    // TODO: const?? -> use string?
+  const char* attr_timeout_str{nullptr};     // TODO: const?? -> use string?
+  const char* negative_timeout_str{nullptr}; // TODO: const?? -> use string?
+  const char* reference_str{nullptr};        // TODO: const?? -> use string?
+  std::string profile_file;
+  std::string trace_file;
+  std::string metrics_socket;
+  std::string eventtrace_file;
+  std::string preload_file;
+  std::string diskcache_dir;
+  std::string metacache_dir;
+  std::string reference_image;
+  size_t diskcache_size{0};
   int enable_nlink{0};
+  int lazy_tables{0};
+  int mlock_hot{0};
+  int prefault{0};
   int readonly{0};
   int cache_image{0};
+  int direct_read{0};
   int cache_files{0};
+  int splice{0};
+  int verify_blocks{0};
+  int async_log{0};
   size_t cachesize{0};
+  size_t cachemin{0};
+  size_t compcache{0};
   size_t workers{0};
+  size_t bgworkers{0};
+  size_t ioworkers{0};
+  std::vector<int> worker_cpus;
+  size_t cache_shards{0};
+  size_t readahead{0};
+  size_t inline_size{0};
+  size_t max_read{0};
+  size_t async_reads{0};
+  size_t dir_hash_threshold{0};
   mlock_mode lock_mode{mlock_mode::NONE};
+  cache_policy block_cache_policy{cache_policy::LRU};
   double decompress_ratio{0.0};
+  double entry_timeout{0.0};
+  double attr_timeout{0.0};
+  double negative_timeout{0.0};
   logger::level_type debuglevel{logger::level_type::ERROR};
 };
 
+// FUSE operations counted for the metrics endpoint
+enum fuse_op_counter {
+  OPC_LOOKUP,
+  OPC_GETATTR,
+  OPC_ACCESS,
+  OPC_READLINK,
+  OPC_OPENDIR,
+  OPC_OPEN,
+  OPC_READ,
+  OPC_READDIR,
+  OPC_STATFS,
+  OPC_GETXATTR,
+  OPC_NUM_COUNTERS
+};
+
+constexpr std::array<char const*, OPC_NUM_COUNTERS> fuse_op_names{{
+    "lookup",
+    "getattr",
+    "access",
+    "readlink",
+    "opendir",
+    "open",
+    "read",
+    "readdir",
+    "statfs",
+    "getxattr",
+}};
+
+/**
+ * Serves metrics in the Prometheus text format on a Unix domain socket.
+ *
+ * The socket is bound in the constructor, so errors can be reported before
+ * the FUSE driver forks into the background; the server thread is only
+ * started by start(). Each connection gets one response and is closed.
+ * HTTP requests (e.g. `curl --unix-socket`) are answered with an HTTP
+ * response, anything else just gets the metrics.
+ */
+class metrics_server {
+ public:
+  explicit metrics_server(std::string path)
+      : path_{std::move(path)} {
+    struct ::sockaddr_un addr;
+
+    if (path_.size() >= sizeof(addr.sun_path)) {
+      DWARFS_THROW(runtime_error, "metrics socket path too long: " + path_);
+    }
+
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ::strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd_ < 0) {
+      DWARFS_THROW(system_error, "socket");
+    }
+
+    // Only ever replace a stale socket, never some other file that
+    // happens to live at the given path.
+    struct ::stat st;
+
+    if (::lstat(path_.c_str(), &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        ::close(fd_);
+        DWARFS_THROW(runtime_error,
+                     "refusing to replace non-socket file: " + path_);
+      }
+      ::unlink(path_.c_str());
+    } else if (errno != ENOENT) {
+      auto err = errno;
+      ::close(fd_);
+      DWARFS_THROW(system_error, "lstat " + path_, err);
+    }
+
+    // The metrics may leak information about the files being accessed,
+    // so make sure only the owner can connect to the socket.
+    auto old_mask = ::umask(077);
+    auto rv = ::bind(fd_, reinterpret_cast<struct ::sockaddr*>(&addr),
+                     sizeof(addr));
+    ::umask(old_mask);
+
+    if (rv != 0 || ::listen(fd_, 16) != 0) {
+      auto err = errno;
+      ::close(fd_);
+      DWARFS_THROW(system_error, "bind " + path_, err);
+    }
+
+    if (::pipe2(stop_pipe_.data(), O_CLOEXEC) != 0) {
+      auto err = errno;
+      ::close(fd_);
+      ::unlink(path_.c_str());
+      DWARFS_THROW(system_error, "pipe", err);
+    }
+  }
+
+  ~metrics_server() {
+    stop();
+    ::close(stop_pipe_[0]);
+    ::close(stop_pipe_[1]);
+    ::close(fd_);
+    ::unlink(path_.c_str());
+  }
+
+  void start(std::function<std::string()> render) {
+    thread_ = std::thread([this, render = std::move(render)] { run(render); });
+  }
+
+  void stop() {
+    if (thread_.joinable()) {
+      char c = 0;
+      if (::write(stop_pipe_[1], &c, 1) == 1) {
+        thread_.join();
+      } else {
+        thread_.detach();
+      }
+    }
+  }
+
+ private:
+  void run(std::function<std::string()> const& render) {
+    std::array<struct ::pollfd, 2> fds{{{fd_, POLLIN, 0},
+                                        {stop_pipe_[0], POLLIN, 0}}};
+
+    for (;;) {
+      if (::poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+
+      if (fds[1].revents) {
+        break;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client >= 0) {
+          serve(client, render);
+          ::close(client);
+        }
+      }
+    }
+  }
+
+  static void serve(int client, std::function<std::string()> const& render) {
+    // Give clients a moment to send a request, but also serve clients
+    // that don't send anything at all
+    std::array<char, 4096> request;
+    ssize_t len = 0;
+    struct ::pollfd pfd {
+      client, POLLIN, 0
+    };
+
+    if (::poll(&pfd, 1, 100) > 0) {
+      len = ::read(client, request.data(), request.size());
+    }
+
+    std::string response;
+    auto body = render();
+
+    if (len >= 4 && std::string_view(request.data(), 4) == "GET ") {
+      response = "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: " +
+                 std::to_string(body.size()) + "\r\n\r\n";
+    }
+
+    response += body;
+
+    for (size_t off = 0; off < response.size();) {
+      auto rv = ::send(client, response.data() + off, response.size() - off,
+                       MSG_NOSIGNAL);
+      if (rv <= 0) {
+        break;
+      }
+      off += rv;
+    }
+  }
+
+  std::string const path_;
+  int fd_{-1};
+  std::array<int, 2> stop_pipe_{{-1, -1}};
+  std::thread thread_;
+};
+
+/**
+ * Watches the memory pressure stall information (PSI) of the cgroup
+ * of the driver, or of the whole system if that's not available.
+ *
+ * `on_pressure` is called whenever tasks were stalled on memory for
+ * more than 150ms within a 2s window, which is also what happens when
+ * memory.high is exceeded. `on_relief` is called after every period of
+ * `relief_interval` without any pressure.
+ */
+class memory_pressure_monitor {
+ public:
+  explicit memory_pressure_monitor(std::string const& path) {
+    // unprivileged triggers need a window that is a multiple of 2s
+    static constexpr std::string_view trigger{"some 150000 2000000"};
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd_ < 0) {
+      DWARFS_THROW(system_error, "open " + path);
+    }
+
+    // the kernel expects the trigger to be null-terminated
+    if (::write(fd_, trigger.data(), trigger.size() + 1) < 0) {
+      auto err = errno;
+      ::close(fd_);
+      DWARFS_THROW(system_error, "write " + path, err);
+    }
+
+    if (::pipe2(stop_pipe_.data(), O_CLOEXEC) != 0) {
+      auto err = errno;
+      ::close(fd_);
+      DWARFS_THROW(system_error, "pipe", err);
+    }
+  }
+
+  ~memory_pressure_monitor() {
+    stop();
+    ::close(stop_pipe_[0]);
+    ::close(stop_pipe_[1]);
+    ::close(fd_);
+  }
+
+  static std::string default_path() {
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+
+    while (std::getline(cgroup, line)) {
+      // the cgroup v2 hierarchy has an id of 0 and no controllers
+      if (line.compare(0, 3, "0::") == 0) {
+        auto path = "/sys/fs/cgroup" + line.substr(3) + "/memory.pressure";
+        if (::access(path.c_str(), R_OK | W_OK) == 0) {
+          return path;
+        }
+      }
+    }
+
+    return "/proc/pressure/memory";
+  }
+
+  void start(std::function<void()> on_pressure, std::function<void()> on_relief,
+             std::chrono::milliseconds relief_interval) {
+    thread_ = std::thread([this, on_pressure = std::move(on_pressure),
+                           on_relief = std::move(on_relief), relief_interval] {
+      run(on_pressure, on_relief, relief_interval);
+    });
+  }
+
+  void stop() {
+    if (thread_.joinable()) {
+      char c = 0;
+      if (::write(stop_pipe_[1], &c, 1) == 1) {
+        thread_.join();
+      } else {
+        thread_.detach();
+      }
+    }
+  }
+
+ private:
+  void run(std::function<void()> const& on_pressure,
+           std::function<void()> const& on_relief,
+           std::chrono::milliseconds relief_interval) {
+    std::array<struct ::pollfd, 2> fds{{{fd_, POLLPRI, 0},
+                                        {stop_pipe_[0], POLLIN, 0}}};
+
+    for (;;) {
+      auto rv = ::poll(fds.data(), fds.size(), relief_interval.count());
+
+      if (rv < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+
+      if (rv == 0) {
+        on_relief();
+        continue;
+      }
+
+      if (fds[1].revents || (fds[0].revents & POLLERR)) {
+        // POLLERR means the monitored cgroup is gone
+        break;
+      }
+
+      if (fds[0].revents & POLLPRI) {
+        on_pressure();
+      }
+    }
+  }
+
+  int fd_{-1};
+  std::array<int, 2> stop_pipe_{{-1, -1}};
+  std::thread thread_;
+};
+
+// Latency histogram of a FUSE operation with power-of-two buckets in
+// microseconds, i.e. bucket i counts operations that took less than 2^i us
+struct op_latency {
+  static constexpr size_t num_buckets{25};
+
+  void add(uint64_t ns) {
+    size_t bucket = 0;
+    for (auto us = ns / 1000; us > 0 && bucket + 1 < num_buckets; us >>= 1) {
+      ++bucket;
+    }
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> total_ns{0};
+  std::array<std::atomic<uint64_t>, num_buckets> buckets{};
+};
+
 struct dwarfs_userdata {
   dwarfs_userdata(std::ostream& os)
-      : lgr{os} {}
+      : stream_lgr{os}
+      , lgr{stream_lgr} {}
 
   options opts;
-  stream_logger lgr;
+  stream_logger stream_lgr;
+  async_logger lgr;
   filesystem_v2 fs;
+  std::mutex open_count_mx;
+  std::unordered_map<uint32_t, uint32_t> open_count;
+  worker_group read_replies;
+  folly::File image_file;
+  std::mutex trace_mx;
+  std::ofstream trace;
+  std::chrono::steady_clock::time_point trace_start;
+  std::unique_ptr<metrics_server> metrics;
+  std::unique_ptr<memory_pressure_monitor> pressure;
+  std::mutex cache_size_mx;
+  size_t cache_max_bytes{0};
+  size_t cache_bytes{0};
+  std::array<op_latency, OPC_NUM_COUNTERS> op_stats;
+};
+
+// Counts a FUSE operation and records its latency in the histogram
+class op_timer {
+ public:
+  op_timer(dwarfs_userdata* userdata, fuse_op_counter op)
+      : stats_{userdata->op_stats[op]}
+#ifdef DWARFS_EVENT_TRACING
+      , trace_{"fuse", fuse_op_names[op]}
+#endif
+      , start_{std::chrono::steady_clock::now()} {}
+
+  ~op_timer() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start_)
+                  .count();
+    stats_.add(ns);
+  }
+
+ private:
+  op_latency& stats_;
+#ifdef DWARFS_EVENT_TRACING
+  trace_scope trace_;
+#endif
+  std::chrono::steady_clock::time_point const start_;
 };
 
+std::string render_metrics(dwarfs_userdata const& userdata) {
+  auto st = userdata.fs.cache_stats();
+  std::ostringstream os;
+
+  auto metric = [&os](char const* name, char const* type, char const* help) {
+    os << "# HELP dwarfs_" << name << " " << help << "\n";
+    os << "# TYPE dwarfs_" << name << " " << type << "\n";
+  };
+
+  auto value = [&os](char const* name, auto v, char const* labels = nullptr) {
+    os << "dwarfs_" << name;
+    if (labels) {
+      os << "{" << labels << "}";
+    }
+    os << " " << v << "\n";
+  };
+
+  metric("cache_bytes", "gauge", "Decompressed bytes in the block cache.");
+  value("cache_bytes", st.cached_bytes);
+  metric("cache_blocks", "gauge", "Blocks in the block cache.");
+  value("cache_blocks", st.cached_blocks);
+  metric("cache_max_bytes", "gauge", "Configured block cache size.");
+  value("cache_max_bytes", st.max_bytes);
+  metric("compressed_cache_bytes", "gauge",
+         "Bytes in the compressed block cache.");
+  value("compressed_cache_bytes", st.tier2_bytes);
+  metric("cache_queue_depth", "gauge",
+         "Decompression jobs waiting for a block cache worker.");
+  value("cache_queue_depth", st.queue_size);
+
+  metric("cache_requests_total", "counter", "Block range requests.");
+  value("cache_requests_total", st.range_requests);
+  metric("cache_hits_total", "counter", "Block range requests served "
+                                        "without decompressing a new block.");
+  value("cache_hits_total", st.active_hits_fast, "type=\"active_fast\"");
+  value("cache_hits_total", st.active_hits_slow, "type=\"active_slow\"");
+  value("cache_hits_total", st.cache_hits_fast, "type=\"cache_fast\"");
+  value("cache_hits_total", st.cache_hits_slow, "type=\"cache_slow\"");
+  value("cache_hits_total", st.tier2_hits, "type=\"compressed\"");
+  value("cache_hits_total", st.disk_cache_hits, "type=\"disk\"");
+  metric("cache_blocks_created_total", "counter", "Blocks added to the cache.");
+  value("cache_blocks_created_total", st.blocks_created);
+  metric("cache_direct_reads_total", "counter",
+         "Blocks read without going through the page cache.");
+  value("cache_direct_reads_total", st.direct_reads);
+  metric("cache_blocks_evicted_total", "counter",
+         "Blocks evicted from the cache.");
+  value("cache_blocks_evicted_total", st.blocks_evicted);
+  metric("cache_blocks_prefetched_total", "counter", "Blocks prefetched.");
+  value("cache_blocks_prefetched_total", st.blocks_prefetched);
+  metric("cache_sets_merged_total", "counter",
+         "Request sets merged with a running decompression.");
+  value("cache_sets_merged_total", st.sets_merged);
+  metric("cache_inline_jobs_total", "counter",
+         "Blocks decompressed on the requesting thread.");
+  value("cache_inline_jobs_total", st.inline_jobs);
+  metric("decompressed_bytes_total", "counter", "Bytes decompressed.");
+  value("decompressed_bytes_total", st.bytes_decompressed);
+  metric("decompress_seconds_total", "counter",
+         "Time spent decompressing blocks.");
+  value("decompress_seconds_total", st.decompress_seconds);
+
+  metric("fuse_operations_total", "counter", "FUSE requests by operation.");
+  for (size_t i = 0; i < OPC_NUM_COUNTERS; ++i) {
+    auto labels = std::string("op=\"") + fuse_op_names[i] + "\"";
+    value("fuse_operations_total", userdata.op_stats[i].count.load(),
+          labels.c_str());
+  }
+  metric("fuse_operation_seconds_total", "counter",
+         "Time spent handling FUSE requests by operation.");
+  for (size_t i = 0; i < OPC_NUM_COUNTERS; ++i) {
+    auto labels = std::string("op=\"") + fuse_op_names[i] + "\"";
+    value("fuse_operation_seconds_total",
+          1e-9 * userdata.op_stats[i].total_ns.load(), labels.c_str());
+  }
+
+  return os.str();
+}
+
+// Appends a line to the access trace, if enabled. Each line starts with
+// the time in microseconds since the file system was mounted, followed
+// by the operation and its arguments. Names always come last, as they
+// may contain spaces.
+template <typename... Args>
+void trace_op(dwarfs_userdata* userdata, char const* op, Args const&... args) {
+  if (userdata->trace.is_open()) {
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - userdata->trace_start)
+                    .count();
+    std::lock_guard lock(userdata->trace_mx);
+    userdata->trace << usec << ' ' << op;
+    ((userdata->trace << ' ' << args), ...);
+    userdata->trace << '\n';
+  }
+}
+
 // TODO: better error handling
 
 #define DWARFS_OPT(t, p, v)                                                    \
@@ -88,40 +631,259 @@ struct dwarfs_userdata {
 constexpr struct ::fuse_opt dwarfs_opts[] = {
     // TODO: user, group, atime, mtime, ctime for those fs who don't have it?
     DWARFS_OPT("cachesize=%s", cachesize_str, 0),
+    DWARFS_OPT("cachemin=%s", cachemin_str, 0),
+    DWARFS_OPT("compcache=%s", compcache_str, 0),
     DWARFS_OPT("debuglevel=%s", debuglevel_str, 0),
     DWARFS_OPT("workers=%s", workers_str, 0),
+    DWARFS_OPT("bgworkers=%s", bgworkers_str, 0),
+    DWARFS_OPT("ioworkers=%s", ioworkers_str, 0),
+    DWARFS_OPT("cpuset=%s", cpuset_str, 0),
+    DWARFS_OPT("numanode=%s", numa_node_str, 0),
     DWARFS_OPT("mlock=%s", mlock_str, 0),
     DWARFS_OPT("decratio=%s", decompress_ratio_str, 0),
+    DWARFS_OPT("inlinesize=%s", inline_size_str, 0),
     DWARFS_OPT("offset=%s", image_offset_str, 0),
+    DWARFS_OPT("cacheshards=%s", cache_shards_str, 0),
+    DWARFS_OPT("cachepolicy=%s", cache_policy_str, 0),
+    DWARFS_OPT("readahead=%s", readahead_str, 0),
+    DWARFS_OPT("maxread=%s", max_read_str, 0),
+    DWARFS_OPT("asyncreads=%s", async_reads_str, 0),
+    DWARFS_OPT("dirhash=%s", dir_hash_str, 0),
+    DWARFS_OPT("entry_timeout=%s", entry_timeout_str, 0),
+    DWARFS_OPT("attr_timeout=%s", attr_timeout_str, 0),
+    DWARFS_OPT("negative_timeout=%s", negative_timeout_str, 0),
+    DWARFS_OPT("profile=%s", profile_str, 0),
+    DWARFS_OPT("trace=%s", trace_str, 0),
+    DWARFS_OPT("metrics=%s", metrics_str, 0),
+    DWARFS_OPT("eventtrace=%s", eventtrace_str, 0),
+    DWARFS_OPT("preload=%s", preload_str, 0),
+    DWARFS_OPT("diskcache=%s", diskcache_str, 0),
+    DWARFS_OPT("diskcache_size=%s", diskcache_size_str, 0),
+    DWARFS_OPT("metacache=%s", metacache_str, 0),
+    DWARFS_OPT("reference=%s", reference_str, 0),
     DWARFS_OPT("enable_nlink", enable_nlink, 1),
+    DWARFS_OPT("lazy_tables", lazy_tables, 1),
+    DWARFS_OPT("mlock_hot", mlock_hot, 1),
+    DWARFS_OPT("prefault", prefault, 1),
     DWARFS_OPT("readonly", readonly, 1),
     DWARFS_OPT("cache_image", cache_image, 1),
     DWARFS_OPT("no_cache_image", cache_image, 0),
+    DWARFS_OPT("directread", direct_read, 1),
     DWARFS_OPT("cache_files", cache_files, 1),
     DWARFS_OPT("no_cache_files", cache_files, 0),
+    DWARFS_OPT("splice", splice, 1),
+    DWARFS_OPT("verify_blocks", verify_blocks, 1),
+    DWARFS_OPT("asynclog", async_log, 1),
     FUSE_OPT_END};
 
 #define dUSERDATA                                                              \
   auto userdata = reinterpret_cast<dwarfs_userdata*>(fuse_req_userdata(req))
 
 template <typename LoggerPolicy>
-void op_init(void* data, struct fuse_conn_info* /*conn*/) {
+void preload_profile(dwarfs_userdata& userdata) {
+  LOG_PROXY(LoggerPolicy, userdata.lgr);
+
+  std::ifstream ifs(userdata.opts.preload_file);
+
+  if (!ifs) {
+    LOG_WARN << "cannot open profile " << userdata.opts.preload_file;
+    return;
+  }
+
+  std::vector<std::pair<uint32_t, size_t>> hot;
+  std::string line;
+
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string kind;
+    size_t number;
+    uint32_t count;
+
+    if (iss >> kind >> number >> count && kind == "block") {
+      hot.emplace_back(count, number);
+    }
+  }
+
+  std::stable_sort(hot.begin(), hot.end(), [](auto const& a, auto const& b) {
+    return a.first > b.first;
+  });
+
+  std::vector<size_t> blocks;
+  blocks.reserve(hot.size());
+
+  for (auto const& h : hot) {
+    blocks.push_back(h.second);
+  }
+
+  LOG_INFO << "preloading up to " << blocks.size() << " blocks from profile";
+
+  userdata.fs.prefetch_blocks(blocks);
+}
+
+void save_profile(dwarfs_userdata& userdata) {
+  LOG_PROXY(debug_logger_policy, userdata.lgr);
+
+  std::ofstream ofs(userdata.opts.profile_file);
+
+  if (!ofs) {
+    LOG_ERROR << "cannot write profile " << userdata.opts.profile_file;
+    return;
+  }
+
+  ofs << "# dwarfs access profile for " << userdata.opts.fsimage << "\n";
+
+  {
+    std::lock_guard lock(userdata.open_count_mx);
+    for (auto const& [inode, count] : userdata.open_count) {
+      ofs << "inode " << inode << " " << count << "\n";
+    }
+  }
+
+  auto counts = userdata.fs.block_access_counts();
+
+  for (size_t i = 0; i < counts.size(); ++i) {
+    if (counts[i] > 0) {
+      ofs << "block " << i << " " << counts[i] << "\n";
+    }
+  }
+
+  LOG_INFO << "access profile written to " << userdata.opts.profile_file;
+}
+
+// Halves the block cache, but not below cachemin
+template <typename LoggerPolicy>
+void shrink_cache(dwarfs_userdata& userdata) {
+  LOG_PROXY(LoggerPolicy, userdata.lgr);
+  std::lock_guard lock(userdata.cache_size_mx);
+
+  auto min_bytes = std::min(userdata.opts.cachemin, userdata.cache_max_bytes);
+  auto bytes = std::max(userdata.cache_bytes / 2, min_bytes);
+
+  if (bytes < userdata.cache_bytes) {
+    LOG_INFO << "memory pressure, shrinking block cache to "
+             << size_with_unit(bytes);
+    userdata.cache_bytes = bytes;
+    userdata.fs.set_cache_size(bytes);
+  }
+}
+
+// Doubles the block cache, but not beyond its configured size
+template <typename LoggerPolicy>
+void grow_cache(dwarfs_userdata& userdata) {
+  LOG_PROXY(LoggerPolicy, userdata.lgr);
+  std::lock_guard lock(userdata.cache_size_mx);
+
+  auto bytes = std::min(2 * userdata.cache_bytes, userdata.cache_max_bytes);
+
+  if (bytes > userdata.cache_bytes) {
+    LOG_INFO << "no memory pressure, growing block cache to "
+             << size_with_unit(bytes);
+    userdata.cache_bytes = bytes;
+    userdata.fs.set_cache_size(bytes);
+  }
+}
+
+// Sets the configured size of the block cache at runtime
+void set_cache_size(dwarfs_userdata& userdata, size_t bytes) {
+  std::lock_guard lock(userdata.cache_size_mx);
+  userdata.cache_max_bytes = userdata.cache_bytes = bytes;
+  userdata.fs.set_cache_size(bytes);
+}
+
+template <typename LoggerPolicy>
+void op_init(void* data, struct fuse_conn_info* conn) {
   auto userdata = reinterpret_cast<dwarfs_userdata*>(data);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
+  // we must do this *after* the fuse driver has forked into background
+  if (userdata->opts.async_log) {
+    userdata->lgr.start();
+  }
+
   LOG_DEBUG << __func__;
 
+  if (!userdata->opts.eventtrace_file.empty()) {
+    try {
+      if (!event_tracer::start(userdata->opts.eventtrace_file)) {
+        LOG_WARN << "built without event tracing support, ignoring "
+                    "eventtrace option";
+      }
+    } catch (runtime_error const& e) {
+      LOG_ERROR << e.what();
+    }
+  }
+
+  if (userdata->image_file && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+
+#if FUSE_USE_VERSION >= 30
+  if (auto max_read = userdata->opts.max_read; max_read > 0) {
+    // libfuse derives the number of pages per request from max_write
+    // (and limits it to what its buffers can hold), so this is what
+    // allows the kernel to send read requests larger than 128 KiB
+    conn->max_read = max_read;
+    conn->max_write = max_read;
+    LOG_DEBUG << "max_read=" << conn->max_read
+              << ", max_readahead=" << conn->max_readahead;
+  }
+#endif
+
   // we must do this *after* the fuse driver has forked into background
   userdata->fs.set_num_workers(userdata->opts.workers);
+
+  if (userdata->opts.async_reads > 0) {
+    userdata->read_replies =
+        worker_group("reply", userdata->opts.async_reads,
+                     userdata->opts.async_reads * 64);
+  }
+
+  if (!userdata->opts.preload_file.empty()) {
+    preload_profile<LoggerPolicy>(*userdata);
+  }
+
+  if (userdata->metrics) {
+    userdata->metrics->start([userdata] { return render_metrics(*userdata); });
+  }
+
+  if (userdata->pressure) {
+    userdata->pressure->start(
+        [userdata] { shrink_cache<LoggerPolicy>(*userdata); },
+        [userdata] { grow_cache<LoggerPolicy>(*userdata); },
+        std::chrono::seconds(30));
+  }
+}
+
+template <typename LoggerPolicy>
+void op_destroy(void* data) {
+  auto userdata = reinterpret_cast<dwarfs_userdata*>(data);
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__;
+
+  if (userdata->metrics) {
+    userdata->metrics->stop();
+  }
+
+  // all outstanding reads must be replied to before the session goes away
+  if (userdata->read_replies) {
+    userdata->read_replies.wait();
+    userdata->read_replies.stop();
+  }
+
+  event_tracer::stop();
 }
 
 template <typename LoggerPolicy>
 void op_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_LOOKUP);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__ << "(" << parent << ", " << name << ")";
 
+  trace_op(userdata, "lookup", parent, name);
+
   int err = ENOENT;
 
   try {
@@ -135,13 +897,22 @@ void op_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
       if (err == 0) {
         e.generation = 1;
         e.ino = e.attr.st_ino;
-        e.attr_timeout = std::numeric_limits<double>::max();
-        e.entry_timeout = std::numeric_limits<double>::max();
+        e.attr_timeout = userdata->opts.attr_timeout;
+        e.entry_timeout = userdata->opts.entry_timeout;
 
         fuse_reply_entry(req, &e);
 
         return;
       }
+    } else if (userdata->opts.negative_timeout > 0.0) {
+      // a zero inode tells the kernel to cache the negative lookup
+      struct ::fuse_entry_param e;
+      ::memset(&e, 0, sizeof(e));
+      e.entry_timeout = userdata->opts.negative_timeout;
+
+      fuse_reply_entry(req, &e);
+
+      return;
     }
   } catch (dwarfs::system_error const& e) {
     LOG_ERROR << e.what();
@@ -157,10 +928,13 @@ void op_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
 template <typename LoggerPolicy>
 void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_GETATTR);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__ << "(" << ino << ")";
 
+  trace_op(userdata, "getattr", ino);
+
   int err = ENOENT;
 
   // TODO: merge with op_lookup
@@ -173,7 +947,7 @@ void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
       err = userdata->fs.getattr(*entry, &stbuf);
 
       if (err == 0) {
-        fuse_reply_attr(req, &stbuf, std::numeric_limits<double>::max());
+        fuse_reply_attr(req, &stbuf, userdata->opts.attr_timeout);
 
         return;
       }
@@ -192,6 +966,7 @@ void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
 template <typename LoggerPolicy>
 void op_access(fuse_req_t req, fuse_ino_t ino, int mode) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_ACCESS);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
@@ -220,6 +995,7 @@ void op_access(fuse_req_t req, fuse_ino_t ino, int mode) {
 template <typename LoggerPolicy>
 void op_readlink(fuse_req_t req, fuse_ino_t ino) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_READLINK);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
@@ -251,9 +1027,47 @@ void op_readlink(fuse_req_t req, fuse_ino_t ino) {
   fuse_reply_err(req, err);
 }
 
+template <typename LoggerPolicy>
+void op_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  dUSERDATA;
+  op_timer timer(userdata, OPC_OPENDIR);
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__;
+
+  int err = ENOENT;
+
+  try {
+    auto entry = userdata->fs.find(ino);
+
+    if (entry) {
+      if (S_ISDIR(entry->mode())) {
+        // directories never change, so the kernel can cache the listing
+        fi->keep_cache = 1;
+#if FUSE_USE_VERSION >= 35
+        fi->cache_readdir = 1;
+#endif
+        fuse_reply_open(req, fi);
+        return;
+      }
+
+      err = ENOTDIR;
+    }
+  } catch (dwarfs::system_error const& e) {
+    LOG_ERROR << e.what();
+    err = e.get_errno();
+  } catch (std::exception const& e) {
+    LOG_ERROR << e.what();
+    err = EIO;
+  }
+
+  fuse_reply_err(req, err);
+}
+
 template <typename LoggerPolicy>
 void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_OPEN);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
@@ -271,6 +1085,10 @@ void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
       } else {
         fi->fh = FUSE_ROOT_ID + entry->inode_num();
         fi->direct_io = !userdata->opts.cache_files;
+        if (!userdata->opts.profile_file.empty()) {
+          std::lock_guard lock(userdata->open_count_mx);
+          ++userdata->open_count[entry->inode_num()];
+        }
         fi->keep_cache = userdata->opts.cache_files;
         fuse_reply_open(req, fi);
         return;
@@ -287,18 +1105,103 @@ void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
   fuse_reply_err(req, err);
 }
 
+// Waits for the blocks of a read request and replies to it. This runs
+// on one of the reply threads, so the FUSE thread that received the
+// request is free to accept more requests in the meantime.
+template <typename LoggerPolicy>
+void reply_read(dwarfs_userdata* userdata, fuse_req_t req,
+                std::vector<std::future<block_range>>& ranges) {
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  try {
+    iovec_read_buf buf;
+
+    for (auto& r : ranges) {
+      auto br = r.get();
+      buf.buf.resize(buf.buf.size() + 1);
+      buf.buf.back().iov_base = const_cast<uint8_t*>(br.data());
+      buf.buf.back().iov_len = br.size();
+      buf.ranges.emplace_back(std::move(br));
+    }
+
+    fuse_reply_iov(req, buf.buf.empty() ? nullptr : &buf.buf[0],
+                   buf.buf.size());
+
+    return;
+  } catch (std::exception const& e) {
+    LOG_ERROR << e.what();
+  }
+
+  fuse_reply_err(req, EIO);
+}
+
+// Replies with data read straight from the image file. With splice
+// support, the kernel can move the data without it ever being copied
+// to user space.
+void reply_image_ranges(fuse_req_t req, int fd,
+                        std::vector<image_range> const& ranges) {
+  if (ranges.empty()) {
+    fuse_reply_buf(req, nullptr, 0);
+    return;
+  }
+
+  std::vector<uint8_t> storage(offsetof(struct fuse_bufvec, buf) +
+                               ranges.size() * sizeof(struct fuse_buf));
+  auto bufv = reinterpret_cast<struct fuse_bufvec*>(storage.data());
+
+  bufv->count = ranges.size();
+
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    auto& buf = bufv->buf[i];
+    buf.size = ranges[i].size;
+    buf.flags =
+        static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.fd = fd;
+    buf.pos = ranges[i].offset;
+  }
+
+  fuse_reply_data(req, bufv, static_cast<fuse_buf_copy_flags>(0));
+}
+
 template <typename LoggerPolicy>
 void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
              struct fuse_file_info* fi) {
   dUSERDATA;
+  // With asynchronous replies, the timer is handed over to the reply
+  // job, so it covers the whole request and not just queueing it
+  auto timer = std::make_unique<op_timer>(userdata, OPC_READ);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
 
+  trace_op(userdata, "read", ino, off, size);
+
   int err = ENOENT;
 
   try {
-    if (fi->fh == ino) {
+    if (fi->fh == ino && userdata->image_file) {
+      if (auto ranges = userdata->fs.image_ranges(ino, size, off)) {
+        reply_image_ranges(req, userdata->image_file.fd(), *ranges);
+        return;
+      }
+    }
+
+    if (fi->fh == ino && userdata->read_replies) {
+      auto ranges = userdata->fs.readv(ino, size, off);
+
+      if (ranges) {
+        userdata->read_replies.add_job(
+            [userdata, req, ranges = std::move(ranges.value()),
+             timer = std::move(timer)]() mutable {
+              reply_read<LoggerPolicy>(userdata, req, ranges);
+              timer.reset();
+            });
+
+        return;
+      }
+
+      err = -ranges.error();
+    } else if (fi->fh == ino) {
       iovec_read_buf buf;
       ssize_t rv = userdata->fs.readv(ino, buf, size, off);
 
@@ -326,14 +1229,48 @@ void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
   fuse_reply_err(req, err);
 }
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
 template <typename LoggerPolicy>
-void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                struct fuse_file_info* /*fi*/) {
+void op_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+              struct fuse_file_info* fi) {
   dUSERDATA;
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
 
+  int err = EIO;
+
+  try {
+    if (fi->fh == ino) {
+      auto rv = userdata->fs.seek(ino, off, whence);
+
+      if (rv >= 0) {
+        fuse_reply_lseek(req, rv);
+        return;
+      }
+
+      err = -rv;
+    }
+  } catch (dwarfs::system_error const& e) {
+    LOG_ERROR << e.what();
+    err = e.get_errno();
+  } catch (std::exception const& e) {
+    LOG_ERROR << e.what();
+    err = EIO;
+  }
+
+  fuse_reply_err(req, err);
+}
+#endif
+
+// Shared implementation of op_readdir and op_readdirplus; add_entry
+// adds a single entry to the buffer and returns the size it needs
+template <typename LoggerPolicy, typename AddEntry>
+void readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    AddEntry const& add_entry) {
+  dUSERDATA;
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
   int err = ENOENT;
 
   try {
@@ -343,31 +1280,27 @@ void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
       auto dir = userdata->fs.opendir(*dirent);
 
       if (dir) {
-        off_t lastoff = userdata->fs.dirsize(*dir);
-        struct stat stbuf;
         std::vector<char> buf(size);
+        std::string name;
         size_t written = 0;
 
-        while (off < lastoff) {
-          auto res = userdata->fs.readdir(*dir, off);
-          assert(res);
+        userdata->fs.readdir(
+            *dir, off,
+            [&](size_t offset, inode_view entry, std::string_view name_view) {
+              // fuse needs a null-terminated name
+              name.assign(name_view);
 
-          auto [entry, name_view] = *res;
-          std::string name(name_view);
+              size_t needed =
+                  add_entry(&buf[written], buf.size() - written, name.c_str(),
+                            entry, offset + 1);
 
-          userdata->fs.getattr(entry, &stbuf);
-
-          size_t needed =
-              fuse_add_direntry(req, &buf[written], buf.size() - written,
-                                name.c_str(), &stbuf, off + 1);
-
-          if (written + needed > size) {
-            break;
-          }
+              if (written + needed > size) {
+                return false;
+              }
 
-          written += needed;
-          ++off;
-        }
+              written += needed;
+              return true;
+            });
 
         fuse_reply_buf(req, written > 0 ? &buf[0] : nullptr, written);
 
@@ -387,9 +1320,61 @@ void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
   fuse_reply_err(req, err);
 }
 
+template <typename LoggerPolicy>
+void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info* /*fi*/) {
+  dUSERDATA;
+  op_timer timer(userdata, OPC_READDIR);
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__;
+
+  trace_op(userdata, "readdir", ino, off);
+
+  readdir_common<LoggerPolicy>(
+      req, ino, size, off,
+      [&](char* buf, size_t bufsize, char const* name, inode_view entry,
+          off_t nextoff) {
+        struct ::stat stbuf;
+        userdata->fs.getattr(entry, &stbuf);
+        return fuse_add_direntry(req, buf, bufsize, name, &stbuf, nextoff);
+      });
+}
+
+#if FUSE_USE_VERSION >= 30
+// Like op_readdir, but also returns the attributes of all entries to
+// save the kernel a lookup round trip per entry
+template <typename LoggerPolicy>
+void op_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info* /*fi*/) {
+  dUSERDATA;
+  op_timer timer(userdata, OPC_READDIR);
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__;
+
+  trace_op(userdata, "readdir", ino, off);
+
+  readdir_common<LoggerPolicy>(
+      req, ino, size, off,
+      [&](char* buf, size_t bufsize, char const* name, inode_view entry,
+          off_t nextoff) {
+        struct ::fuse_entry_param e;
+        ::memset(&e, 0, sizeof(e));
+        userdata->fs.getattr(entry, &e.attr);
+        e.generation = 1;
+        e.ino = e.attr.st_ino;
+        e.attr_timeout = userdata->opts.attr_timeout;
+        e.entry_timeout = userdata->opts.entry_timeout;
+        return fuse_add_direntry_plus(req, buf, bufsize, name, &e, nextoff);
+      });
+}
+#endif
+
 template <typename LoggerPolicy>
 void op_statfs(fuse_req_t req, fuse_ino_t /*ino*/) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_STATFS);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__;
@@ -417,24 +1402,213 @@ void op_statfs(fuse_req_t req, fuse_ino_t /*ino*/) {
   fuse_reply_err(req, err);
 }
 
+constexpr std::array<char const*, 5> root_xattrs{{
+    "user.dwarfs.driver.pid",
+    "user.dwarfs.driver.latency",
+    "user.dwarfs.driver.cache",
+    "user.dwarfs.driver.memory",
+    "user.dwarfs.driver.cachesize",
+}};
+
+constexpr std::array<char const*, 3> file_xattrs{{
+    "user.dwarfs.inode.chunks",
+    "user.dwarfs.inode.blocks",
+    "user.dwarfs.inode.ratio",
+}};
+
+std::string latency_report(dwarfs_userdata const& userdata) {
+  std::ostringstream os;
+
+  for (size_t i = 0; i < OPC_NUM_COUNTERS; ++i) {
+    auto const& st = userdata.op_stats[i];
+    auto const count = st.count.load();
+
+    if (count == 0) {
+      continue;
+    }
+
+    os << fuse_op_names[i] << ": " << count << " ops, avg "
+       << time_with_unit(1e-9 * st.total_ns.load() / count) << "\n";
+
+    for (size_t b = 0; b < op_latency::num_buckets; ++b) {
+      if (auto n = st.buckets[b].load()) {
+        if (b + 1 < op_latency::num_buckets) {
+          os << "  < " << time_with_unit(1e-6 * (UINT64_C(1) << b));
+        } else {
+          os << "  >= " << time_with_unit(1e-6 * (UINT64_C(1) << (b - 1)));
+        }
+        os << ": " << n << "\n";
+      }
+    }
+  }
+
+  return os.str();
+}
+
+std::string cache_report(dwarfs_userdata const& userdata) {
+  auto st = userdata.fs.cache_stats();
+  auto const hits = st.active_hits_fast + st.active_hits_slow +
+                    st.cache_hits_fast + st.cache_hits_slow;
+  std::ostringstream os;
+
+  os << "cached blocks: " << st.cached_blocks << "\n"
+     << "cached bytes: " << size_with_unit(st.cached_bytes) << " / "
+     << size_with_unit(st.max_bytes) << "\n"
+     << "compressed cache bytes: " << size_with_unit(st.tier2_bytes) << "\n"
+     << "queued decompression jobs: " << st.queue_size << "\n"
+     << "requests: " << st.range_requests << "\n"
+     << "hits: " << hits << " (fast " << st.active_hits_fast + st.cache_hits_fast
+     << ", slow " << st.active_hits_slow + st.cache_hits_slow << ")\n"
+     << "compressed cache hits: " << st.tier2_hits << "\n"
+     << "disk cache hits: " << st.disk_cache_hits << "\n"
+     << "blocks created: " << st.blocks_created << "\n"
+     << "direct reads: " << st.direct_reads << "\n"
+     << "blocks evicted: " << st.blocks_evicted << "\n"
+     << "blocks prefetched: " << st.blocks_prefetched << "\n"
+     << "request sets merged: " << st.sets_merged << "\n"
+     << "inline decompressions: " << st.inline_jobs << "\n"
+     << "bytes decompressed: " << size_with_unit(st.bytes_decompressed)
+     << " in " << time_with_unit(st.decompress_seconds) << "\n";
+
+  return os.str();
+}
+
+std::string memory_report(dwarfs_userdata const& userdata) {
+  std::ostringstream os;
+  std::ifstream statm("/proc/self/statm");
+  size_t vsize, rss;
+
+  if (statm >> vsize >> rss) {
+    auto const page_size = ::sysconf(_SC_PAGESIZE);
+    os << "virtual: " << size_with_unit(vsize * page_size) << "\n"
+       << "resident: " << size_with_unit(rss * page_size) << "\n";
+  }
+
+  os << "block cache: " << size_with_unit(userdata.fs.cache_stats().cached_bytes)
+     << "\n";
+
+  return os.str();
+}
+
+bool is_regular_file(dwarfs_userdata const& userdata, fuse_ino_t ino) {
+  auto iv = userdata.fs.find(ino);
+  return iv && S_ISREG(iv->mode());
+}
+
+std::vector<std::string_view>
+xattr_names(dwarfs_userdata const& userdata, fuse_ino_t ino) {
+  std::vector<std::string_view> names;
+
+  if (ino == FUSE_ROOT_ID) {
+    names.assign(root_xattrs.begin(), root_xattrs.end());
+  } else if (is_regular_file(userdata, ino)) {
+    names.assign(file_xattrs.begin(), file_xattrs.end());
+  }
+
+  return names;
+}
+
+std::optional<std::string>
+get_xattr(dwarfs_userdata const& userdata, fuse_ino_t ino,
+          std::string_view name) {
+  if (ino == FUSE_ROOT_ID) {
+    if (name == root_xattrs[0]) {
+      return std::to_string(::getpid());
+    }
+    if (name == root_xattrs[1]) {
+      return latency_report(userdata);
+    }
+    if (name == root_xattrs[2]) {
+      return cache_report(userdata);
+    }
+    if (name == root_xattrs[3]) {
+      return memory_report(userdata);
+    }
+    if (name == root_xattrs[4]) {
+      return std::to_string(userdata.fs.cache_stats().max_bytes);
+    }
+    return std::nullopt;
+  }
+
+  if (std::find(file_xattrs.begin(), file_xattrs.end(), name) ==
+          file_xattrs.end() ||
+      !is_regular_file(userdata, ino)) {
+    return std::nullopt;
+  }
+
+  auto chunks = userdata.fs.get_chunks(ino);
+
+  if (!chunks) {
+    return std::nullopt;
+  }
+
+  if (name == file_xattrs[0]) {
+    return std::to_string(chunks->size());
+  }
+
+  std::vector<size_t> blocks;
+
+  for (auto const& c : *chunks) {
+    if (c.block() != HOLE_BLOCK) {
+      blocks.push_back(c.block());
+    }
+  }
+
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+  if (name == file_xattrs[1]) {
+    return std::to_string(blocks.size());
+  }
+
+  // Estimate the compressed size of the file by assuming every byte of
+  // a block compresses equally well
+  std::unordered_map<size_t, double> ratios;
+  double size = 0.0;
+  double compressed = 0.0;
+
+  for (auto b : blocks) {
+    if (auto r = userdata.fs.block_compression_ratio(b)) {
+      ratios[b] = *r;
+    }
+  }
+
+  for (auto const& c : *chunks) {
+    if (auto it = ratios.find(c.block()); it != ratios.end()) {
+      size += c.size();
+      compressed += c.size() * it->second;
+    }
+  }
+
+  if (size == 0.0) {
+    return "n/a";
+  }
+
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(4) << compressed / size;
+
+  return os.str();
+}
+
 template <typename LoggerPolicy>
 void op_getxattr(fuse_req_t req, fuse_ino_t ino, char const* name,
                  size_t size) {
   dUSERDATA;
+  op_timer timer(userdata, OPC_GETXATTR);
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
   LOG_DEBUG << __func__ << "(" << ino << ", " << name << ", " << size << ")";
 
-  static constexpr std::string_view pid_xattr{"user.dwarfs.driver.pid"};
   int err = ENODATA;
 
   try {
-    if (ino == FUSE_ROOT_ID && name == pid_xattr) {
-      auto pidstr = std::to_string(::getpid());
-      if (size > 0) {
-        fuse_reply_buf(req, pidstr.data(), pidstr.size());
+    if (auto value = get_xattr(*userdata, ino, name)) {
+      if (size == 0) {
+        fuse_reply_xattr(req, value->size());
+      } else if (size < value->size()) {
+        fuse_reply_err(req, ERANGE);
       } else {
-        fuse_reply_xattr(req, pidstr.size());
+        fuse_reply_buf(req, value->data(), value->size());
       }
       return;
     }
@@ -449,6 +1623,82 @@ void op_getxattr(fuse_req_t req, fuse_ino_t ino, char const* name,
   fuse_reply_err(req, err);
 }
 
+// The only writable attribute is the block cache size on the root inode
+template <typename LoggerPolicy>
+void op_setxattr(fuse_req_t req, fuse_ino_t ino, char const* name,
+                 char const* value, size_t size, int /*flags*/) {
+  dUSERDATA;
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__ << "(" << ino << ", " << name << ", " << size << ")";
+
+  if (ino != FUSE_ROOT_ID || std::string_view(name) != root_xattrs[4]) {
+    fuse_reply_err(req, ENOTSUP);
+    return;
+  }
+
+  int err = 0;
+
+  try {
+    std::string str(value, size);
+
+    while (!str.empty() && (str.back() == '\n' || str.back() == '\0')) {
+      str.pop_back();
+    }
+
+    auto bytes = parse_size_with_unit(str);
+
+    if (bytes == 0) {
+      err = EINVAL;
+    } else {
+      LOG_INFO << "setting block cache size to " << size_with_unit(bytes);
+      set_cache_size(*userdata, bytes);
+    }
+  } catch (std::exception const& e) {
+    LOG_ERROR << "invalid cache size: " << e.what();
+    err = EINVAL;
+  }
+
+  fuse_reply_err(req, err);
+}
+
+template <typename LoggerPolicy>
+void op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  dUSERDATA;
+  LOG_PROXY(LoggerPolicy, userdata->lgr);
+
+  LOG_DEBUG << __func__ << "(" << ino << ", " << size << ")";
+
+  int err = EIO;
+
+  try {
+    std::string names;
+
+    for (auto const& name : xattr_names(*userdata, ino)) {
+      names.append(name);
+      names.push_back('\0');
+    }
+
+    if (size == 0) {
+      fuse_reply_xattr(req, names.size());
+    } else if (size < names.size()) {
+      fuse_reply_err(req, ERANGE);
+    } else {
+      fuse_reply_buf(req, names.data(), names.size());
+    }
+
+    return;
+  } catch (dwarfs::system_error const& e) {
+    LOG_ERROR << e.what();
+    err = e.get_errno();
+  } catch (std::exception const& e) {
+    LOG_ERROR << e.what();
+    err = EIO;
+  }
+
+  fuse_reply_err(req, err);
+}
+
 void usage(const char* progname) {
   std::cerr
       << "dwarfs (" << PRJ_GIT_ID << ", fuse version " << FUSE_USE_VERSION
@@ -456,15 +1706,47 @@ void usage(const char* progname) {
       << "usage: " << progname << " image mountpoint [options]\n\n"
       << "DWARFS options:\n"
       << "    -o cachesize=SIZE      set size of block cache (512M)\n"
+      << "    -o cachemin=SIZE       shrink cache down to SIZE on pressure\n"
+      << "    -o compcache=SIZE      size of compressed block cache (0)\n"
       << "    -o workers=NUM         number of worker threads (2)\n"
+      << "    -o bgworkers=NUM       max. workers for background jobs\n"
+      << "    -o ioworkers=NUM       threads reading blocks ahead (0)\n"
+      << "    -o cpuset=LIST         run workers on these CPUs (e.g. 0-3,8)\n"
+      << "    -o numanode=NUM        run workers on this NUMA node\n"
+      << "    -o cacheshards=NUM     number of block cache shards (1)\n"
+      << "    -o cachepolicy=NAME    block cache policy: (lru), slru, cost\n"
+      << "    -o readahead=SIZE      sequential readahead window (0)\n"
+      << "    -o maxread=SIZE        max. size of read requests (kernel)\n"
+      << "    -o asyncreads=NUM      number of async read reply threads (0)\n"
+      << "    -o profile=FILE        write access profile on unmount\n"
+      << "    -o trace=FILE          record access trace for dwarfsbench\n"
+      << "    -o metrics=SOCKET      serve Prometheus metrics on Unix socket\n"
+      << "    -o eventtrace=FILE     write Chrome trace events to file\n"
+      << "    -o preload=FILE        preload block cache from profile\n"
+      << "    -o diskcache=PATH      persistent decompressed block cache\n"
+      << "    -o diskcache_size=SIZE size limit of disk cache (unlimited)\n"
+      << "    -o metacache=PATH      persistent decompressed metadata cache\n"
       << "    -o mlock=NAME          mlock mode: (none), try, must\n"
+      << "    -o mlock_hot           only mlock metadata needed for lookups\n"
+      << "    -o prefault            pre-fault metadata when mounting\n"
       << "    -o decratio=NUM        ratio for full decompression (0.8)\n"
+      << "    -o inlinesize=SIZE     decompress small blocks inline (0)\n"
       << "    -o offset=NUM|auto     filesystem image offset in bytes (0)\n"
+      << "    -o reference=FILE      reference image for shared blocks\n"
+      << "    -o dirhash=NUM         hash index dirs with NUM+ entries (0)\n"
       << "    -o enable_nlink        show correct hardlink numbers\n"
+      << "    -o lazy_tables         don't fully unpack packed tables\n"
       << "    -o readonly            show read-only file system\n"
       << "    -o (no_)cache_image    (don't) keep image in kernel cache\n"
+      << "    -o directread          read blocks bypassing the page cache\n"
       << "    -o (no_)cache_files    (don't) keep files in kernel cache\n"
+      << "    -o entry_timeout=SECS  kernel cache timeout for names (inf)\n"
+      << "    -o attr_timeout=SECS   kernel cache timeout for attributes (inf)\n"
+      << "    -o negative_timeout=SECS  timeout for failed lookups (inf)\n"
+      << "    -o splice              splice uncompressed data from image\n"
+      << "    -o verify_blocks       verify block checksums on first access\n"
       << "    -o debuglevel=NAME     error, warn, (info), debug, trace\n"
+      << "    -o asynclog            write log messages in the background\n"
       << std::endl;
 
 #if FUSE_USE_VERSION >= 30
@@ -517,16 +1799,25 @@ int option_hdl(void* data, const char* arg, int key,
 template <typename LoggerPolicy>
 void init_lowlevel_ops(struct fuse_lowlevel_ops& ops) {
   ops.init = &op_init<LoggerPolicy>;
+  ops.destroy = &op_destroy<LoggerPolicy>;
   ops.lookup = &op_lookup<LoggerPolicy>;
   ops.getattr = &op_getattr<LoggerPolicy>;
   ops.access = &op_access<LoggerPolicy>;
   ops.readlink = &op_readlink<LoggerPolicy>;
+  ops.opendir = &op_opendir<LoggerPolicy>;
   ops.open = &op_open<LoggerPolicy>;
   ops.read = &op_read<LoggerPolicy>;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+  ops.lseek = &op_lseek<LoggerPolicy>;
+#endif
   ops.readdir = &op_readdir<LoggerPolicy>;
+#if FUSE_USE_VERSION >= 30
+  ops.readdirplus = &op_readdirplus<LoggerPolicy>;
+#endif
   ops.statfs = &op_statfs<LoggerPolicy>;
   ops.getxattr = &op_getxattr<LoggerPolicy>;
-  // ops.listxattr = &op_listxattr<LoggerPolicy>;
+  ops.setxattr = &op_setxattr<LoggerPolicy>;
+  ops.listxattr = &op_listxattr<LoggerPolicy>;
 }
 
 #if FUSE_USE_VERSION > 30
@@ -611,6 +1902,13 @@ int run_fuse(struct fuse_args& args, char* mountpoint, int mt, int fg,
 
 #endif
 
+std::shared_ptr<mmif> open_image(std::string const& path) {
+  if (http_file::is_url(path)) {
+    return std::make_shared<http_file>(path, http_file_options());
+  }
+  return std::make_shared<mmap>(path);
+}
+
 template <typename LoggerPolicy>
 void load_filesystem(dwarfs_userdata& userdata) {
   LOG_PROXY(LoggerPolicy, userdata.lgr);
@@ -619,12 +1917,30 @@ void load_filesystem(dwarfs_userdata& userdata) {
 
   filesystem_options fsopts;
   fsopts.lock_mode = opts.lock_mode;
+  fsopts.lock_hot_metadata = bool(opts.mlock_hot);
+  fsopts.prefault_metadata = bool(opts.prefault);
   fsopts.block_cache.max_bytes = opts.cachesize;
+  fsopts.block_cache.tier2_max_bytes = opts.compcache;
   fsopts.block_cache.num_workers = opts.workers;
+  fsopts.block_cache.max_background_jobs = opts.bgworkers;
+  fsopts.block_cache.io_workers = opts.ioworkers;
+  fsopts.block_cache.worker_cpus = opts.worker_cpus;
+  fsopts.block_cache.num_shards = opts.cache_shards;
+  fsopts.block_cache.policy = opts.block_cache_policy;
+  fsopts.inode_reader.readahead = opts.readahead;
   fsopts.block_cache.decompress_ratio = opts.decompress_ratio;
+  fsopts.block_cache.inline_max_bytes = opts.inline_size;
   fsopts.block_cache.mm_release = !opts.cache_image;
+  fsopts.block_cache.direct_read = opts.direct_read;
   fsopts.block_cache.init_workers = false;
+  fsopts.block_cache.record_access = !opts.profile_file.empty();
+  fsopts.block_cache.disk_cache_dir = opts.diskcache_dir;
+  fsopts.block_cache.disk_cache_max_bytes = opts.diskcache_size;
+  fsopts.metadata_cache_dir = opts.metacache_dir;
+  fsopts.block_cache.verify_blocks = bool(opts.verify_blocks);
   fsopts.metadata.enable_nlink = bool(opts.enable_nlink);
+  fsopts.metadata.lazy_tables = bool(opts.lazy_tables);
+  fsopts.metadata.dir_hash_threshold = opts.dir_hash_threshold;
   fsopts.metadata.readonly = bool(opts.readonly);
 
   if (opts.image_offset_str) {
@@ -639,8 +1955,45 @@ void load_filesystem(dwarfs_userdata& userdata) {
     }
   }
 
-  userdata.fs = filesystem_v2(
-      userdata.lgr, std::make_shared<mmap>(opts.fsimage), fsopts, FUSE_ROOT_ID);
+  if (!opts.reference_image.empty()) {
+    fsopts.reference_image = open_image(opts.reference_image);
+  }
+
+  userdata.fs = filesystem_v2(userdata.lgr, open_image(opts.fsimage), fsopts,
+                              FUSE_ROOT_ID);
+
+  if (!opts.trace_file.empty()) {
+    userdata.trace.open(opts.trace_file);
+    if (!userdata.trace) {
+      DWARFS_THROW(runtime_error, "cannot write trace " + opts.trace_file);
+    }
+    userdata.trace << "# dwarfs access trace for " << opts.fsimage << "\n";
+    userdata.trace_start = std::chrono::steady_clock::now();
+  }
+
+  if (!opts.metrics_socket.empty()) {
+    userdata.metrics = std::make_unique<metrics_server>(opts.metrics_socket);
+  }
+
+  userdata.cache_max_bytes = userdata.cache_bytes = opts.cachesize;
+
+  if (opts.cachemin > 0) {
+    auto path = memory_pressure_monitor::default_path();
+    try {
+      userdata.pressure = std::make_unique<memory_pressure_monitor>(path);
+      LOG_DEBUG << "monitoring memory pressure in " << path;
+    } catch (std::exception const& e) {
+      LOG_WARN << "cache resizing disabled: " << e.what();
+    }
+  }
+
+  if (opts.splice && opts.verify_blocks) {
+    LOG_WARN << "splice disabled, incompatible with verify_blocks";
+  } else if (opts.splice && http_file::is_url(opts.fsimage)) {
+    LOG_WARN << "splice disabled, image is not a local file";
+  } else if (opts.splice) {
+    userdata.image_file = folly::File(opts.fsimage, O_RDONLY);
+  }
 
   ti << "file system initialized";
 }
@@ -682,7 +2035,45 @@ int run_dwarfs(int argc, char** argv) {
   try {
     // TODO: foreground mode, stderr vs. syslog?
 
-    opts.fsimage = std::filesystem::canonical(opts.fsimage).native();
+    if (!http_file::is_url(opts.fsimage)) {
+      opts.fsimage = std::filesystem::canonical(opts.fsimage).native();
+    }
+
+    // these must be absolute as we're changing into / when daemonizing
+    if (opts.profile_str) {
+      opts.profile_file = std::filesystem::absolute(opts.profile_str).native();
+    }
+    if (opts.trace_str) {
+      opts.trace_file = std::filesystem::absolute(opts.trace_str).native();
+    }
+    if (opts.metrics_str) {
+      opts.metrics_socket =
+          std::filesystem::absolute(opts.metrics_str).native();
+    }
+    if (opts.eventtrace_str) {
+      opts.eventtrace_file =
+          std::filesystem::absolute(opts.eventtrace_str).native();
+    }
+    if (opts.preload_str) {
+      opts.preload_file = std::filesystem::absolute(opts.preload_str).native();
+    }
+    if (opts.diskcache_str) {
+      opts.diskcache_dir =
+          std::filesystem::absolute(opts.diskcache_str).native();
+    }
+    if (opts.metacache_str) {
+      opts.metacache_dir =
+          std::filesystem::absolute(opts.metacache_str).native();
+    }
+    if (opts.reference_str) {
+      opts.reference_image =
+          http_file::is_url(opts.reference_str)
+              ? std::string(opts.reference_str)
+              : std::filesystem::absolute(opts.reference_str).native();
+    }
+    opts.diskcache_size = opts.diskcache_size_str
+                              ? parse_size_with_unit(opts.diskcache_size_str)
+                              : 0;
 
     opts.debuglevel = opts.debuglevel_str
                           ? logger::parse_level(opts.debuglevel_str)
@@ -694,12 +2085,58 @@ int run_dwarfs(int argc, char** argv) {
     opts.cachesize = opts.cachesize_str
                          ? parse_size_with_unit(opts.cachesize_str)
                          : (static_cast<size_t>(512) << 20);
+    opts.cachemin =
+        opts.cachemin_str ? parse_size_with_unit(opts.cachemin_str) : 0;
+    opts.compcache =
+        opts.compcache_str ? parse_size_with_unit(opts.compcache_str) : 0;
     opts.workers = opts.workers_str ? folly::to<size_t>(opts.workers_str) : 2;
+    opts.bgworkers =
+        opts.bgworkers_str ? folly::to<size_t>(opts.bgworkers_str) : 0;
+    opts.ioworkers =
+        opts.ioworkers_str ? folly::to<size_t>(opts.ioworkers_str) : 0;
+    if (opts.cpuset_str && opts.numa_node_str) {
+      std::cerr << "error: cpuset and numanode cannot be used together"
+                << std::endl;
+      return 1;
+    }
+    if (opts.cpuset_str) {
+      opts.worker_cpus = parse_cpu_list(opts.cpuset_str);
+    }
+    if (opts.numa_node_str) {
+      opts.worker_cpus = numa_node_cpus(folly::to<int>(opts.numa_node_str));
+    }
+    opts.readahead =
+        opts.readahead_str ? parse_size_with_unit(opts.readahead_str) : 0;
+    opts.inline_size =
+        opts.inline_size_str ? parse_size_with_unit(opts.inline_size_str) : 0;
+    opts.max_read =
+        opts.max_read_str ? parse_size_with_unit(opts.max_read_str) : 0;
+    opts.async_reads =
+        opts.async_reads_str ? folly::to<size_t>(opts.async_reads_str) : 0;
+    opts.dir_hash_threshold =
+        opts.dir_hash_str ? folly::to<size_t>(opts.dir_hash_str) : 0;
+    opts.cache_shards =
+        opts.cache_shards_str ? folly::to<size_t>(opts.cache_shards_str) : 1;
     opts.lock_mode =
         opts.mlock_str ? parse_mlock_mode(opts.mlock_str) : mlock_mode::NONE;
+    if (opts.mlock_hot && opts.lock_mode == mlock_mode::NONE) {
+      opts.lock_mode = mlock_mode::TRY;
+    }
+    opts.block_cache_policy = opts.cache_policy_str
+                                  ? parse_cache_policy(opts.cache_policy_str)
+                                  : cache_policy::LRU;
     opts.decompress_ratio = opts.decompress_ratio_str
                                 ? folly::to<double>(opts.decompress_ratio_str)
                                 : 0.8;
+    opts.entry_timeout = opts.entry_timeout_str
+                             ? folly::to<double>(opts.entry_timeout_str)
+                             : std::numeric_limits<double>::max();
+    opts.attr_timeout = opts.attr_timeout_str
+                            ? folly::to<double>(opts.attr_timeout_str)
+                            : std::numeric_limits<double>::max();
+    opts.negative_timeout = opts.negative_timeout_str
+                                ? folly::to<double>(opts.negative_timeout_str)
+                                : std::numeric_limits<double>::max();
   } catch (runtime_error const& e) {
     std::cerr << "error: " << e.what() << std::endl;
     return 1;
@@ -708,15 +2145,44 @@ int run_dwarfs(int argc, char** argv) {
     return 1;
   }
 
+  if (opts.cache_shards < 1) {
+    std::cerr << "error: cacheshards must be at least 1" << std::endl;
+    return 1;
+  }
+
+  if (opts.entry_timeout < 0.0 || opts.attr_timeout < 0.0 ||
+      opts.negative_timeout < 0.0) {
+    std::cerr << "error: timeouts must not be negative" << std::endl;
+    return 1;
+  }
+
   if (opts.decompress_ratio < 0.0 || opts.decompress_ratio > 1.0) {
     std::cerr << "error: decratio must be between 0.0 and 1.0" << std::endl;
     return 1;
   }
 
+  if (opts.direct_read && opts.cache_image) {
+    std::cerr << "error: directread and cache_image cannot be used together"
+              << std::endl;
+    return 1;
+  }
+
+  if (opts.cachemin > opts.cachesize) {
+    std::cerr << "error: cachemin must not be larger than cachesize"
+              << std::endl;
+    return 1;
+  }
+
   if (!opts.seen_mountpoint) {
     usage(opts.progname);
   }
 
+  if (opts.max_read > 0) {
+    // the max_read negotiated in op_init() must match the mount option
+    fuse_opt_add_arg(&args,
+                     ("-omax_read=" + std::to_string(opts.max_read)).c_str());
+  }
+
   LOG_PROXY(debug_logger_policy, userdata.lgr);
 
   LOG_INFO << "dwarfs (" << PRJ_GIT_ID << ", fuse version " << FUSE_USE_VERSION
@@ -734,10 +2200,16 @@ int run_dwarfs(int argc, char** argv) {
   }
 
 #if FUSE_USE_VERSION >= 30
-  return run_fuse(args, fuse_opts, userdata);
+  int rv = run_fuse(args, fuse_opts, userdata);
 #else
-  return run_fuse(args, mountpoint, mt, fg, userdata);
+  int rv = run_fuse(args, mountpoint, mt, fg, userdata);
 #endif
+
+  if (!opts.profile_file.empty()) {
+    save_profile(userdata);
+  }
+
+  return rv;
 }
 
 } // namespace dwarfs
@@ -22,52 +22,125 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <deque>
 #include <exception>
+#include <functional>
 #include <future>
 #include <iterator>
+#include <limits>
 #include <mutex>
 #include <new>
+#include <optional>
+#include <set>
 #include <shared_mutex>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include <fmt/format.h>
 
+#include <folly/ExceptionWrapper.h>
+#include <folly/Try.h>
 #include <folly/container/EvictingCacheMap.h>
 #include <folly/container/F14Map.h>
+#include <folly/lang/Align.h>
 
 #include "dwarfs/block_cache.h"
+#include "dwarfs/block_compressor.h"
+#include "dwarfs/buffer_pool.h"
+#include "dwarfs/disk_cache.h"
+#include "dwarfs/event_tracer.h"
 #include "dwarfs/fs_section.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/mmif.h"
 #include "dwarfs/options.h"
+#include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
 class cached_block {
  public:
-  cached_block(logger& lgr, fs_section const& b, std::shared_ptr<mmif> mm,
-               bool release)
-      : decompressor_(std::make_unique<block_decompressor>(
-            b.compression(), mm->as<uint8_t>(b.start()), b.length(), data_))
-      , mm_(std::move(mm))
+  // Create a block without any data; it has to be loaded using one of
+  // the load_*() functions before it can be used
+  cached_block(logger& lgr, fs_section const& b,
+               std::shared_ptr<compression_dictionary const> dict,
+               std::shared_ptr<buffer_pool> pool)
+      : pool_(std::move(pool))
+      , data_(pool_ ? pool_->acquire() : std::vector<uint8_t>())
+      , dict_(std::move(dict))
       , section_(b)
-      , LOG_PROXY_INIT(lgr)
-      , release_(release) {
-    if (!section_.check_fast(*mm_)) {
-      DWARFS_THROW(runtime_error, "block data integrity check failed");
-    }
+      , LOG_PROXY_INIT(lgr) {}
+
+  cached_block(logger& lgr, fs_section const& b, std::shared_ptr<mmif> mm,
+               bool release, std::shared_ptr<compression_dictionary const> dict,
+               std::shared_ptr<buffer_pool> pool)
+      : cached_block(lgr, b, std::move(dict), std::move(pool)) {
+    load_from_image(std::move(mm), release);
+  }
+
+  // Create a block from a secondary copy of its data, e.g. a copy that
+  // was re-compressed on eviction
+  cached_block(logger& lgr, fs_section const& b, compression_type type,
+               folly::ByteRange data, std::shared_ptr<void const> owner)
+      : cached_block(lgr, b, nullptr, nullptr) {
+    load_copy(type, data, std::move(owner));
   }
 
   ~cached_block() {
     if (decompressor_) {
       try_release();
     }
+
+    if (pool_) {
+      decompressor_.reset();
+      pool_->release(std::move(data_));
+    }
+  }
+
+  // Load the block from the image mapping
+  void load_from_image(std::shared_ptr<mmif> mm, bool release) {
+    if (!section_.check_fast(*mm)) {
+      DWARFS_THROW(runtime_error, "block data integrity check failed");
+    }
+
+    mm_ = std::move(mm);
+    release_ = release;
+    init(section_.compression(), section_.data(*mm_), dict_.get());
+  }
+
+  // Load the block from a private copy of its compressed data that was
+  // read without going through the image mapping
+  void
+  load_from_buffer(std::shared_ptr<std::vector<uint8_t> const> compressed) {
+    folly::ByteRange data(compressed->data(), compressed->size());
+
+    if (!section_.check_fast(data)) {
+      DWARFS_THROW(runtime_error, "block data integrity check failed");
+    }
+
+    owner_ = std::move(compressed);
+    init(section_.compression(), data, dict_.get());
+  }
+
+  // Load the block from a secondary copy of its data, e.g. a copy that
+  // was re-compressed on eviction or one stored in the disk cache
+  void load_copy(compression_type type, folly::ByteRange data,
+                 std::shared_ptr<void const> owner) {
+    owner_ = std::move(owner);
+    init(type, data, nullptr);
   }
 
+  // This can be called from any thread
+  bool loaded() const { return loaded_.load(std::memory_order_acquire); }
+
   // once the block is fully decompressed, we can reset the decompressor_
 
   // This can be called from any thread
@@ -75,7 +148,56 @@ class cached_block {
 
   const uint8_t* data() const { return data_.data(); }
 
+  // Only safe to call once the block is fully decompressed
+  std::vector<uint8_t> const& vec() const { return data_; }
+
+  bool fully_decompressed() const {
+    return range_end_.load() == uncompressed_size_;
+  }
+
+  // True if the block consists of independently decompressible frames
+  bool seekable() const { return !frame_ends_.empty(); }
+
+  // This can be called from any thread
+  bool has_range(size_t begin, size_t end) const {
+    if (!loaded()) {
+      return false;
+    }
+
+    if (end <= range_end_.load()) {
+      return true;
+    }
+
+    if (!seekable()) {
+      return false;
+    }
+
+    for (auto i = frame_index(begin); i < frame_ends_.size(); ++i) {
+      if (!frame_done_[i].load()) {
+        return false;
+      }
+      if (frame_ends_[i] >= end) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Number of bytes decompressed so far, not necessarily contiguous
+  size_t decompressed_bytes() const {
+    return seekable() ? decompressed_bytes_.load() : range_end_.load();
+  }
+
+  // Returns true only for the first caller
+  bool try_mark_persisted() { return !persisted_.exchange(true); }
+
   void decompress_until(size_t end) {
+    if (seekable()) {
+      decompress_range(0, end);
+      return;
+    }
+
     while (data_.size() < end) {
       if (!decompressor_) {
         DWARFS_THROW(runtime_error, "no decompressor for block");
@@ -84,6 +206,7 @@ class cached_block {
       if (decompressor_->decompress_frame()) {
         // We're done, free the memory
         decompressor_.reset();
+        owner_.reset();
 
         // And release the memory from the mapping
         try_release();
@@ -93,12 +216,72 @@ class cached_block {
     }
   }
 
-  size_t uncompressed_size() const {
-    return decompressor_ ? decompressor_->uncompressed_size()
-                         : range_end_.load();
+  // Only decompresses the frames overlapping [begin, end) for seekable
+  // blocks, everything up to end otherwise
+  void decompress_range(size_t begin, size_t end) {
+    if (!seekable()) {
+      decompress_until(end);
+      return;
+    }
+
+    for (auto i = frame_index(begin);
+         i < frame_ends_.size() && frame_begin(i) < end; ++i) {
+      if (!frame_done_[i].load()) {
+        decompressor_->decompress_seekable_frame(i);
+        decompressed_bytes_ += frame_ends_[i] - frame_begin(i);
+        frame_done_[i] = true;
+      }
+    }
+
+    auto prefix = frames_prefix_.load();
+
+    while (prefix < frame_ends_.size() && frame_done_[prefix].load()) {
+      ++prefix;
+    }
+
+    frames_prefix_ = prefix;
+
+    if (prefix > 0) {
+      range_end_ = frame_ends_[prefix - 1];
+    }
+
+    if (prefix == frame_ends_.size() && decompressor_) {
+      decompressor_.reset();
+      owner_.reset();
+      try_release();
+    }
   }
 
+  size_t uncompressed_size() const { return uncompressed_size_; }
+
+  // Total time spent decompressing this block, i.e. what it would cost
+  // to get it back after it is evicted
+  void add_decompress_time(uint64_t ns) { decompress_ns_ += ns; }
+  uint64_t decompress_ns() const { return decompress_ns_.load(); }
+
  private:
+  void init(compression_type type, folly::ByteRange data,
+            compression_dictionary const* dict) {
+    decompressor_ = std::make_unique<block_decompressor>(
+        type, data.data(), data.size(), data_, dict);
+    uncompressed_size_ = decompressor_->uncompressed_size();
+    frame_ends_ = decompressor_->seekable_frames();
+    if (!frame_ends_.empty()) {
+      frame_done_ = std::make_unique<std::atomic<bool>[]>(frame_ends_.size());
+    }
+    loaded_.store(true, std::memory_order_release);
+  }
+
+  size_t frame_index(size_t offset) const {
+    return std::distance(
+        frame_ends_.begin(),
+        std::upper_bound(frame_ends_.begin(), frame_ends_.end(), offset));
+  }
+
+  size_t frame_begin(size_t index) const {
+    return index > 0 ? frame_ends_[index - 1] : 0;
+  }
+
   void try_release() {
     if (release_) {
       if (auto ec = mm_->release(section_.start(), section_.length())) {
@@ -108,61 +291,96 @@ class cached_block {
   }
 
   std::atomic<size_t> range_end_{0};
+  std::atomic<uint64_t> decompress_ns_{0};
+  std::atomic<bool> persisted_{false};
+  std::atomic<bool> loaded_{false};
+  std::shared_ptr<buffer_pool> pool_;
   std::vector<uint8_t> data_;
+  std::shared_ptr<compression_dictionary const> dict_;
   std::unique_ptr<block_decompressor> decompressor_;
+  size_t uncompressed_size_{0};
+  std::vector<size_t> frame_ends_;
+  std::unique_ptr<std::atomic<bool>[]> frame_done_;
+  std::atomic<size_t> frames_prefix_{0};
+  std::atomic<size_t> decompressed_bytes_{0};
+  std::shared_ptr<void const> owner_;
   std::shared_ptr<mmif> mm_;
   fs_section section_;
   LOG_PROXY_DECL(debug_logger_policy);
-  bool const release_;
+  bool release_{false};
 };
 
 class block_request {
  public:
   block_request() = default;
 
-  block_request(size_t begin, size_t end, std::promise<block_range>&& promise)
+  block_request(size_t begin, size_t end, block_range_callback&& done)
       : begin_(begin)
       , end_(end)
-      , promise_(std::move(promise)) {
+      , done_(std::move(done)) {
     DWARFS_CHECK(begin_ < end_, "invalid block_request");
   }
 
+  ~block_request() {
+    if (done_) {
+      complete(folly::Try<block_range>(folly::exception_wrapper(
+          std::future_error(std::future_errc::broken_promise))));
+    }
+  }
+
   block_request(block_request&&) = default;
   block_request& operator=(block_request&&) = default;
 
   bool operator<(const block_request& rhs) const { return end_ < rhs.end_; }
 
+  size_t begin() const { return begin_; }
   size_t end() const { return end_; }
 
+  // Requests for the whole block can be made before its size is known
+  void limit_end(size_t end) { end_ = std::min(end_, end); }
+
   void fulfill(std::shared_ptr<cached_block const> block) {
-    promise_.set_value(block_range(std::move(block), begin_, end_ - begin_));
+    complete(folly::makeTryWith([&] {
+      return block_range(std::move(block), begin_, end_ - begin_);
+    }));
   }
 
-  void error(std::exception_ptr error) { promise_.set_exception(error); }
+  void error(std::exception_ptr error) {
+    complete(folly::Try<block_range>(folly::exception_wrapper(error)));
+  }
 
  private:
+  void complete(folly::Try<block_range>&& result) {
+    if (auto done = std::move(done_)) {
+      done_ = nullptr;
+      done(std::move(result));
+    }
+  }
+
   size_t begin_{0};
   size_t end_{0};
-  std::promise<block_range> promise_;
+  block_range_callback done_;
 };
 
 class block_request_set {
  public:
-  block_request_set(std::shared_ptr<cached_block> block, size_t block_no)
+  block_request_set(std::shared_ptr<cached_block> block, size_t block_no,
+                    job_priority prio = job_priority::DEMAND)
       : range_end_(0)
       , block_(std::move(block))
-      , block_no_(block_no) {}
+      , block_no_(block_no)
+      , priority_(prio) {}
 
   ~block_request_set() { assert(queue_.empty()); }
 
   size_t range_end() const { return range_end_; }
 
-  void add(size_t begin, size_t end, std::promise<block_range>&& promise) {
+  void add(size_t begin, size_t end, block_range_callback&& done) {
     if (end > range_end_) {
       range_end_ = end;
     }
 
-    queue_.emplace_back(begin, end, std::move(promise));
+    queue_.emplace_back(begin, end, std::move(done));
     std::push_heap(queue_.begin(), queue_.end());
   }
 
@@ -190,11 +408,264 @@ class block_request_set {
 
   size_t block_no() const { return block_no_; }
 
+  job_priority priority() const { return priority_; }
+
  private:
   std::vector<block_request> queue_;
   size_t range_end_;
   std::shared_ptr<cached_block> block_;
   const size_t block_no_;
+  const job_priority priority_;
+};
+
+using block_ptr = std::shared_ptr<cached_block>;
+using prune_hook_type = std::function<void(size_t, block_ptr&&)>;
+
+// GreedyDual-Size: each block gets a priority of L + cost / size on
+// insertion and on every hit, where cost is the time it took to
+// decompress the block and size is the number of bytes decompressed.
+// The block with the lowest priority is evicted and L is set to its
+// priority, so blocks that haven't been used for a while eventually
+// age out no matter how expensive they are.
+class block_gds {
+ public:
+  block_gds(size_t max_blocks, prune_hook_type hook)
+      : max_blocks_(max_blocks)
+      , hook_(std::move(hook)) {}
+
+  void resize(size_t max_blocks) {
+    max_blocks_ = max_blocks;
+    evict_excess();
+  }
+
+  bool contains(size_t block_no) const {
+    return entries_.find(block_no) != entries_.end();
+  }
+
+  block_ptr find(size_t block_no) {
+    auto it = entries_.find(block_no);
+
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+
+    update_priority(it->first, it->second);
+
+    return it->second.block;
+  }
+
+  void set(size_t block_no, block_ptr block) {
+    auto [it, inserted] = entries_.try_emplace(block_no);
+
+    if (!inserted) {
+      queue_.erase({it->second.priority, block_no});
+    }
+
+    it->second.block = std::move(block);
+    it->second.priority = clock_ + cost(*it->second.block);
+    queue_.emplace(it->second.priority, block_no);
+
+    evict_excess();
+  }
+
+  template <typename T>
+  void for_each(T&& func) const {
+    for (auto const& [block_no, e] : entries_) {
+      func(block_no, *e.block);
+    }
+  }
+
+ private:
+  struct entry {
+    block_ptr block;
+    double priority{0.0};
+  };
+
+  // The block may still be decompressed by a worker while this is
+  // called, so this only ever uses the atomic progress counters. The
+  // result is stored with the entry, so it's fine if it changes later.
+  static double cost(cached_block const& block) {
+    return double(block.decompress_ns()) /
+           double(std::max<size_t>(block.decompressed_bytes(), 1));
+  }
+
+  void update_priority(size_t block_no, entry& e) {
+    queue_.erase({e.priority, block_no});
+    e.priority = clock_ + cost(*e.block);
+    queue_.emplace(e.priority, block_no);
+  }
+
+  void evict_excess() {
+    while (entries_.size() > std::max<size_t>(max_blocks_, 1)) {
+      auto victim = queue_.begin();
+      auto block_no = victim->second;
+      clock_ = victim->first;
+      queue_.erase(victim);
+      auto node = entries_.extract(block_no);
+      hook_(block_no, std::move(node.mapped().block));
+    }
+  }
+
+  size_t max_blocks_;
+  prune_hook_type hook_;
+  double clock_{0.0};
+  std::unordered_map<size_t, entry> entries_;
+  std::set<std::pair<double, size_t>> queue_;
+};
+
+// LRU list of cached blocks with optional scan resistance
+//
+// With the segmented policy, blocks enter a probationary segment and
+// are only moved to the protected segment once they are hit again.
+// Blocks evicted from the protected segment drop back to the front of
+// the probationary segment. That way, a one-shot sequential reader can
+// only ever push out probationary blocks, not the working set.
+//
+// With the cost policy, all of this is delegated to a block_gds.
+class block_lru {
+ public:
+  void reset(size_t max_blocks, cache_policy policy, prune_hook_type hook) {
+    policy_ = policy;
+    max_protected_ = protected_size(max_blocks);
+
+    probation_.~lru_type();
+    new (&probation_) lru_type(max_blocks - max_protected_);
+    protected_.~lru_type();
+    new (&protected_) lru_type(max_protected_);
+
+    hook_ = std::move(hook);
+    probation_.setPruneHook(
+        [this](size_t block_no, block_ptr&& block) {
+          hook_(block_no, std::move(block));
+        });
+
+    if (policy == cache_policy::COST) {
+      gds_ = std::make_unique<block_gds>(max_blocks, hook_);
+    } else {
+      gds_.reset();
+    }
+  }
+
+  // Changes the capacity without dropping the cached blocks; excess
+  // blocks are evicted through the prune hook
+  void resize(size_t max_blocks) {
+    if (gds_) {
+      gds_->resize(max_blocks);
+      return;
+    }
+
+    max_protected_ = protected_size(max_blocks);
+
+    while (protected_.size() > max_protected_) {
+      auto victim = protected_.rbegin();
+      auto victim_no = victim->first;
+      auto victim_block = victim->second;
+      protected_.erase(victim_no);
+      probation_.set(victim_no, std::move(victim_block));
+    }
+
+    // A maximum size of 0 means unlimited; the protected segment stays
+    // empty while segmented() is false
+    if (max_protected_ > 0) {
+      protected_.setMaxSize(max_protected_);
+    }
+
+    probation_.setMaxSize(max_blocks - max_protected_);
+  }
+
+  bool contains(size_t block_no) const {
+    if (gds_) {
+      return gds_->contains(block_no);
+    }
+
+    return protected_.exists(block_no) || probation_.exists(block_no);
+  }
+
+  block_ptr find(size_t block_no) {
+    if (gds_) {
+      return gds_->find(block_no);
+    }
+
+    if (auto it = protected_.find(block_no); it != protected_.end()) {
+      return it->second;
+    }
+
+    auto it = probation_.find(block_no);
+
+    if (it == probation_.end()) {
+      return nullptr;
+    }
+
+    auto block = it->second;
+
+    if (segmented()) {
+      probation_.erase(block_no);
+      make_protected(block_no, block);
+    }
+
+    return block;
+  }
+
+  void set(size_t block_no, block_ptr block) {
+    if (gds_) {
+      gds_->set(block_no, std::move(block));
+      return;
+    }
+
+    if (segmented() && protected_.exists(block_no)) {
+      protected_.set(block_no, std::move(block));
+    } else {
+      probation_.set(block_no, std::move(block));
+    }
+  }
+
+  template <typename T>
+  void for_each(T&& func) const {
+    if (gds_) {
+      gds_->for_each(std::forward<T>(func));
+      return;
+    }
+
+    for (auto const& cb : protected_) {
+      func(cb.first, *cb.second);
+    }
+    for (auto const& cb : probation_) {
+      func(cb.first, *cb.second);
+    }
+  }
+
+ private:
+  using lru_type = folly::EvictingCacheMap<size_t, block_ptr>;
+
+  size_t protected_size(size_t max_blocks) const {
+    if (policy_ == cache_policy::SEGMENTED_LRU && max_blocks > 1) {
+      return std::clamp<size_t>(max_blocks * 4 / 5, 1, max_blocks - 1);
+    }
+    return 0;
+  }
+
+  // The protected segment can be disabled temporarily if the cache is
+  // too small, the policy is kept so it comes back once it grows again
+  bool segmented() const { return max_protected_ > 0; }
+
+  void make_protected(size_t block_no, block_ptr block) {
+    if (protected_.size() >= max_protected_) {
+      auto victim = protected_.rbegin();
+      auto victim_no = victim->first;
+      auto victim_block = victim->second;
+      protected_.erase(victim_no);
+      probation_.set(victim_no, std::move(victim_block));
+    }
+
+    protected_.set(block_no, std::move(block));
+  }
+
+  lru_type probation_{0};
+  lru_type protected_{0};
+  cache_policy policy_{cache_policy::LRU};
+  size_t max_protected_{0};
+  prune_hook_type hook_;
+  std::unique_ptr<block_gds> gds_;
 };
 
 // multi-threaded block cache
@@ -203,22 +674,48 @@ class block_cache_ final : public block_cache::impl {
  public:
   block_cache_(logger& lgr, std::shared_ptr<mmif> mm,
                block_cache_options const& options)
-      : cache_(0)
+      : shards_(std::max<size_t>(options.num_shards, 1))
+      , max_bytes_(options.max_bytes)
       , mm_(std::move(mm))
       , LOG_PROXY_INIT(lgr)
-      , options_(options) {
+      , options_(options)
+      , pool_(std::make_shared<buffer_pool>(options.max_bytes / 8)) {
+    if (options.tier2_max_bytes > 0) {
+      try {
+        tier2_bc_ = std::make_unique<block_compressor>("lz4");
+      } catch (std::exception const& e) {
+        LOG_WARN << "compressed block cache disabled: " << e.what();
+      }
+    }
+
+    if (!options.disk_cache_dir.empty()) {
+      disk_cache_ = std::make_unique<disk_cache>(
+          lgr, options.disk_cache_dir, options.disk_cache_max_bytes);
+    }
+
     if (options.init_workers) {
-      wg_ = worker_group("blkcache",
-                         std::max(options.num_workers > 0
-                                      ? options.num_workers
-                                      : std::thread::hardware_concurrency(),
-                                  static_cast<size_t>(1)));
+      auto num = options.num_workers;
+      if (num == 0) {
+        num = options.worker_cpus.empty()
+                  ? available_cpus()
+                  : std::min(available_cpus(), options.worker_cpus.size());
+      }
+      start_workers(num);
+
+      if (options.io_workers > 0) {
+        io_wg_ = worker_group("blkio", options.io_workers);
+      }
     }
   }
 
   ~block_cache_() noexcept override {
     LOG_DEBUG << "stopping cache workers";
 
+    // I/O jobs hand their request sets to the decompression workers
+    if (io_wg_) {
+      io_wg_.stop();
+    }
+
     if (wg_) {
       wg_.stop();
     }
@@ -229,11 +726,12 @@ class block_cache_ final : public block_cache::impl {
 
     LOG_DEBUG << "cached blocks:";
 
-    for (const auto& cb : cache_) {
-      LOG_DEBUG << "  block " << cb.first << ", decompression ratio = "
-                << double(cb.second->range_end()) /
-                       double(cb.second->uncompressed_size());
-      update_block_stats(*cb.second);
+    for (auto& shard : shards_) {
+      shard.cache.for_each([this](size_t block_no, cached_block const& cb) {
+        LOG_DEBUG << "  block " << block_no << ", decompression ratio = "
+                  << double(cb.range_end()) / double(cb.uncompressed_size());
+        update_block_stats(cb);
+      });
     }
 
     double fast_hit_rate =
@@ -244,9 +742,32 @@ class block_cache_ final : public block_cache::impl {
     double avg_decompression =
         100.0 * total_decompressed_bytes_ / total_block_bytes_;
 
+    LOG_INFO << "cache shards: " << shards_.size();
     LOG_INFO << "blocks created: " << blocks_created_.load();
     LOG_INFO << "blocks evicted: " << blocks_evicted_.load();
+    LOG_INFO << "blocks prefetched: " << blocks_prefetched_.load();
+    LOG_INFO << "uncompressed direct reads: " << uncompressed_reads_.load();
+
+    if (tier2_bc_) {
+      LOG_INFO << "compressed cache size: " << tier2_bytes_ << " bytes in "
+               << tier2_.size() << " blocks";
+      LOG_INFO << "compressed cache blocks stored: " << tier2_stored_.load();
+      LOG_INFO << "compressed cache blocks evicted: " << tier2_evicted_.load();
+      LOG_INFO << "compressed cache hits: " << tier2_hits_.load();
+    }
+
+    if (disk_cache_) {
+      LOG_INFO << "disk cache blocks stored: " << disk_cache_stored_.load();
+      LOG_INFO << "disk cache hits: " << disk_cache_hits_.load();
+    }
     LOG_INFO << "request sets merged: " << sets_merged_.load();
+    LOG_INFO << "inline decompressions: " << inline_jobs_.load();
+    LOG_INFO << "blocks read ahead of decompression: "
+             << blocks_faulted_in_.load();
+    LOG_INFO << "blocks read bypassing the page cache: "
+             << direct_reads_.load();
+    LOG_INFO << "sequential full decompressions: "
+             << sequential_full_.load();
     LOG_INFO << "total requests: " << range_requests_.load();
     LOG_INFO << "active hits (fast): " << active_hits_fast_.load();
     LOG_INFO << "active hits (slow): " << active_hits_slow_.load();
@@ -267,7 +788,16 @@ class block_cache_ final : public block_cache::impl {
   size_t block_count() const override { return block_.size(); }
 
   void insert(fs_section const& section) override {
+    insert(section, mm_, nullptr);
+  }
+
+  void insert(fs_section const& section, std::shared_ptr<mmif> mm,
+              std::shared_ptr<compression_dictionary const> dict) override {
+    std::lock_guard lock(mx_resize_);
+    check_not_sealed();
     block_.emplace_back(section);
+    block_mm_.emplace_back(std::move(mm));
+    block_dict_.emplace_back(std::move(dict));
   }
 
   void set_block_size(size_t size) override {
@@ -275,24 +805,73 @@ class block_cache_ final : public block_cache::impl {
     if (size == 0) {
       DWARFS_THROW(runtime_error, "block size is zero");
     }
-    auto max_blocks = std::max<size_t>(options_.max_bytes / size, 1);
 
-    if (!block_.empty() && max_blocks > block_.size()) {
-      max_blocks = block_.size();
+    std::lock_guard lock(mx_resize_);
+    check_not_sealed();
+
+    // A shared cache can hold blocks of images with different block
+    // sizes, so the budget is based on the largest of them.
+    block_size_ = std::max(block_size_, size);
+
+    if (options_.record_access) {
+      access_count_ = std::vector<std::atomic<uint32_t>>(block_.size());
     }
 
-    std::lock_guard lock(mx_);
-    cache_.~lru_type();
-    new (&cache_) lru_type(max_blocks);
-    cache_.setPruneHook(
-        [this](size_t block_no, std::shared_ptr<cached_block>&& block) {
-          LOG_DEBUG << "evicting block " << block_no
-                    << " from cache, decompression ratio = "
-                    << double(block->range_end()) /
-                           double(block->uncompressed_size());
-          ++blocks_evicted_;
-          update_block_stats(*block);
-        });
+    verified_ = std::vector<std::atomic<bool>>(block_.size());
+    access_pattern_ = std::vector<std::atomic<int8_t>>(block_.size());
+    last_request_end_ = std::vector<std::atomic<size_t>>(block_.size());
+
+    if (options_.verify_blocks) {
+      sha_verified_ = std::vector<std::atomic<bool>>(block_.size());
+    }
+
+    auto max_shard_blocks = update_max_blocks();
+
+    for (auto& shard : shards_) {
+      std::lock_guard lock(shard.mx);
+      shard.cache.reset(
+          max_shard_blocks, options_.policy,
+          [this](size_t block_no, std::shared_ptr<cached_block>&& block) {
+            LOG_DEBUG << "evicting block " << block_no
+                      << " from cache, decompression ratio = "
+                      << double(block->range_end()) /
+                             double(block->uncompressed_size());
+            ++blocks_evicted_;
+            update_block_stats(*block);
+            demote_block(block_no, std::move(block));
+          });
+    }
+  }
+
+  void set_max_bytes(size_t max_bytes) override {
+    std::lock_guard lock(mx_resize_);
+
+    auto old_max_bytes = max_bytes_.exchange(max_bytes);
+
+    if (max_bytes == old_max_bytes) {
+      return;
+    }
+
+    LOG_DEBUG << "resizing block cache from " << size_with_unit(old_max_bytes)
+              << " to " << size_with_unit(max_bytes);
+
+    pool_->set_max_bytes(max_bytes / 8);
+
+    if (block_size_ == 0) {
+      // set_block_size() hasn't been called yet
+      return;
+    }
+
+    auto max_shard_blocks = update_max_blocks();
+
+    for (auto& shard : shards_) {
+      std::lock_guard lock(shard.mx);
+      shard.cache.resize(max_shard_blocks);
+    }
+
+    if (max_bytes < old_max_bytes) {
+      release_free_memory();
+    }
   }
 
   void set_num_workers(size_t num) override {
@@ -302,38 +881,298 @@ class block_cache_ final : public block_cache::impl {
       wg_.stop();
     }
 
-    wg_ = worker_group("blkcache", num);
+    start_workers(num);
   }
 
-  std::future<block_range>
-  get(size_t block_no, size_t offset, size_t size) const override {
-    ++range_requests_;
+  std::vector<uint32_t> access_counts() const override {
+    std::vector<uint32_t> counts;
+    counts.reserve(access_count_.size());
+    for (auto const& c : access_count_) {
+      counts.push_back(c.load(std::memory_order_relaxed));
+    }
+    return counts;
+  }
+
+  block_cache_stats stats() const override {
+    block_cache_stats st;
+
+    for (auto& shard : shards_) {
+      std::lock_guard lock(shard.mx);
+      shard.cache.for_each([&st](size_t, cached_block const& cb) {
+        ++st.cached_blocks;
+        st.cached_bytes += cb.decompressed_bytes();
+      });
+    }
+
+    {
+      std::lock_guard lock(mx_tier2_);
+      st.tier2_bytes = tier2_bytes_;
+    }
+
+    {
+      std::shared_lock lock(mx_wg_);
+      if (wg_) {
+        st.queue_size = wg_.queue_size();
+      }
+    }
+
+    st.max_bytes = max_bytes_.load();
+    st.range_requests = range_requests_.load();
+    st.active_hits_fast = active_hits_fast_.load();
+    st.active_hits_slow = active_hits_slow_.load();
+    st.cache_hits_fast = cache_hits_fast_.load();
+    st.cache_hits_slow = cache_hits_slow_.load();
+    st.tier2_hits = tier2_hits_.load();
+    st.disk_cache_hits = disk_cache_hits_.load();
+    st.blocks_created = blocks_created_.load();
+    st.direct_reads = direct_reads_.load();
+    st.blocks_evicted = blocks_evicted_.load();
+    st.blocks_prefetched = blocks_prefetched_.load();
+    st.sets_merged = sets_merged_.load();
+    st.inline_jobs = inline_jobs_.load();
+    st.bytes_decompressed = bytes_decompressed_.load();
+    st.decompress_seconds = 1e-9 * decompress_ns_.load();
+
+    return st;
+  }
+
+  std::optional<size_t>
+  uncompressed_offset(size_t block_no) const override {
+    if (!mm_) {
+      return std::nullopt;
+    }
+    return uncompressed_offset(block_no, *mm_);
+  }
+
+  std::optional<size_t>
+  uncompressed_offset(size_t block_no, mmif const& image) const override {
+    seal();
+
+    if (block_no >= verified_.size()) {
+      return std::nullopt;
+    }
+
+    auto const& section = block_[block_no];
+
+    // blocks from a reference image aren't stored in our image file
+    if (section.compression() != compression_type::NONE ||
+        block_mm_[block_no].get() != &image) {
+      return std::nullopt;
+    }
+
+    // Do the integrity check only once, the data won't change. If it
+    // fails, the regular read path will report the error.
+    if (!verified_[block_no].load()) {
+      if (!section.check_fast(image)) {
+        return std::nullopt;
+      }
+      verified_[block_no] = true;
+    }
+
+    if (block_no < access_count_.size()) {
+      access_count_[block_no].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ++uncompressed_reads_;
+
+    return section.start();
+  }
+
+  void prefetch(std::vector<size_t> const& blocks) const override {
+    // Prefetching more blocks than fit into the cache would only
+    // evict the blocks we've just prefetched.
+    auto count = std::min(blocks.size(), max_blocks_.load());
+
+    seal();
+
+    for (size_t i = 0; i < count; ++i) {
+      prefetch_block(blocks[i]);
+    }
 
+    LOG_DEBUG << "prefetching " << count << " blocks";
+  }
+
+  std::future<block_range> get(size_t block_no, size_t offset, size_t size,
+                               job_priority prio) const override {
     std::promise<block_range> promise;
     auto future = promise.get_future();
 
-    // That is a mighty long lock, let's see how it works...
-    std::lock_guard lock(mx_);
+    // The caller is going to wait for the future anyway, so it might as
+    // well do the work itself
+    get_impl(
+        block_no, offset, size,
+        [promise = std::move(promise)](
+            folly::Try<block_range>&& result) mutable {
+          if (result.hasValue()) {
+            promise.set_value(std::move(result).value());
+          } else {
+            promise.set_exception(result.exception().to_exception_ptr());
+          }
+        },
+        prio, true);
+
+    return future;
+  }
+
+  // Callers passing a callback don't want to wait, so the request is
+  // never processed inline
+  void get(size_t block_no, size_t offset, size_t size,
+           block_range_callback done, job_priority prio) const override {
+    get_impl(block_no, offset, size, std::move(done), prio, false);
+  }
+
+  void get(std::vector<block_cache_request>&& requests,
+           job_priority prio) const override {
+    DWARFS_TRACE_SCOPE("block_cache", "get_batch");
+
+    seal();
+
+    // All requests for the same block are looked up under a single lock.
+    // The request with the largest range end comes first, so all others
+    // can join its request set and the block is decompressed only once.
+    std::sort(requests.begin(), requests.end(),
+              [](auto const& a, auto const& b) {
+                if (a.block_no != b.block_no) {
+                  return a.block_no < b.block_no;
+                }
+                return a.offset + a.size > b.offset + b.size;
+              });
+
+    std::vector<std::pair<size_t, folly::Try<block_range>>> ready;
+
+    for (size_t i = 0; i < requests.size();) {
+      auto const block_no = requests[i].block_no;
+      auto& shard = shard_for(block_no);
+
+      {
+        std::lock_guard lock(shard.mx);
+
+        for (; i < requests.size() && requests[i].block_no == block_no; ++i) {
+          auto& r = requests[i];
+          if (auto res = lookup(shard, block_no, r.offset, r.size, r.done,
+                                prio)) {
+            ready.emplace_back(i, std::move(*res));
+          }
+        }
+      }
+
+      for (auto& [ix, res] : ready) {
+        requests[ix].done(std::move(res));
+      }
+
+      ready.clear();
+    }
+  }
+
+ private:
+  void get_impl(size_t block_no, size_t offset, size_t size,
+                block_range_callback done, job_priority prio,
+                bool allow_inline) const {
+    DWARFS_TRACE_SCOPE("block_cache", "get");
+
+    seal();
+
+    auto& shard = shard_for(block_no);
+    std::optional<folly::Try<block_range>> result;
+    std::shared_ptr<block_request_set> inline_brs;
+
+    {
+      // That is a mighty long lock, but it only covers a single shard
+      std::unique_lock lock(shard.mx, std::defer_lock);
+
+      {
+        DWARFS_TRACE_SCOPE("block_cache", "lock");
+        lock.lock();
+      }
+
+      result = lookup(shard, block_no, offset, size, done, prio,
+                      allow_inline ? &inline_brs : nullptr);
+    }
+
+    // The callback must only be called once the shard lock is released,
+    // as it might well issue the next request right away.
+    if (result) {
+      done(std::move(*result));
+    }
+
+    if (inline_brs) {
+      process_job(std::move(inline_brs));
+    }
+  }
+
+  // Each shard owns a disjoint subset of the blocks, so requests for
+  // blocks in different shards never contend for the same mutex.
+  struct alignas(folly::hardware_destructive_interference_size) cache_shard {
+    std::mutex mx;
+    block_lru cache;
+    folly::F14FastMap<size_t, std::deque<std::weak_ptr<block_request_set>>>
+        active;
+    std::mutex mx_dec;
+    folly::F14FastMap<size_t, std::weak_ptr<block_request_set>> decompressing;
+  };
+
+  // Adding blocks reallocates the per-block state, which would pull the
+  // rug out from under concurrent readers, so the first read seals the
+  // cache. Once sealed, this doesn't take the lock anymore.
+  void seal() const {
+    if (!sealed_.load(std::memory_order_acquire)) {
+      std::lock_guard lock(mx_resize_);
+      sealed_.store(true, std::memory_order_release);
+    }
+  }
+
+  // Must be called with mx_resize_ held
+  void check_not_sealed() const {
+    if (sealed_.load(std::memory_order_relaxed)) {
+      DWARFS_THROW(runtime_error,
+                   "cannot add images to a block cache that is in use");
+    }
+  }
+
+  cache_shard& shard_for(size_t block_no) const {
+    return shards_[block_no % shards_.size()];
+  }
+
+  // Returns the result if the request can be satisfied immediately,
+  // otherwise takes ownership of the callback to complete it later.
+  // Must be called with the shard lock held. If `run_inline` is set,
+  // it may receive a request set that the caller must process once
+  // the lock has been released.
+  std::optional<folly::Try<block_range>>
+  lookup(cache_shard& shard, size_t block_no, size_t offset, size_t size,
+         block_range_callback& done, job_priority prio,
+         std::shared_ptr<block_request_set>* run_inline = nullptr) const {
+    ++range_requests_;
+
+    // readahead requests are only guesses, so they don't count as an
+    // access of the block
+    if (prio == job_priority::DEMAND && block_no < access_count_.size()) {
+      access_count_[block_no].fetch_add(1, std::memory_order_relaxed);
+    }
 
     const auto range_end = offset + size;
 
     // See if the block is currently active (about-to-be decompressed)
-    auto ia = active_.find(block_no);
+    auto ia = shard.active.find(block_no);
 
     std::shared_ptr<block_request_set> brs;
 
-    if (ia != active_.end()) {
+    if (ia != shard.active.end()) {
       LOG_TRACE << "active sets found for block " << block_no;
 
       bool add_to_set = false;
 
-      // Try to find a suitable request set to hook on to
+      // Try to find a suitable request set to hook on to. A set that has
+      // been queued with a lower priority might not be processed for a
+      // while, so we don't add to those.
       auto end =
           std::remove_if(ia->second.begin(), ia->second.end(),
-                         [&brs, range_end, &add_to_set](
+                         [&brs, range_end, prio, &add_to_set](
                              const std::weak_ptr<block_request_set>& wp) {
                            if (auto rs = wp.lock()) {
-                             bool can_add_to_set = range_end <= rs->range_end();
+                             bool can_add_to_set =
+                                 range_end <= rs->range_end() &&
+                                 rs->priority() <= prio;
 
                              if (!brs || (can_add_to_set && !add_to_set)) {
                                brs = std::move(rs);
@@ -350,7 +1189,7 @@ class block_cache_ final : public block_cache::impl {
       if (ia->second.empty()) {
         // No request sets left at all? M'kay.
         assert(!brs);
-        active_.erase(ia);
+        shard.active.erase(ia);
       } else if (brs) {
         // That's the one
         // Check if by any chance the block has already
@@ -362,94 +1201,258 @@ class block_cache_ final : public block_cache::impl {
 
         auto block = brs->block();
 
-        if (range_end <= block->range_end()) {
-          // We can immediately satisfy the promise
-          promise.set_value(block_range(std::move(block), offset, size));
+        if (block->has_range(offset, range_end)) {
+          // We can immediately satisfy the request
           ++active_hits_fast_;
+          return folly::makeTryWith(
+              [&] { return block_range(std::move(block), offset, size); });
         } else {
           if (!add_to_set) {
             // Make a new set for the same block
-            brs =
-                std::make_shared<block_request_set>(std::move(block), block_no);
+            brs = std::make_shared<block_request_set>(std::move(block),
+                                                      block_no, prio);
           }
 
-          // Promise will be fulfilled asynchronously
-          brs->add(offset, range_end, std::move(promise));
+          // Request will be completed asynchronously
+          brs->add(offset, range_end, std::move(done));
           ++active_hits_slow_;
 
           if (!add_to_set) {
             ia->second.emplace_back(brs);
-            enqueue_job(std::move(brs));
+            schedule_job(std::move(brs), run_inline);
           }
         }
 
-        return future;
+        return std::nullopt;
       }
 
       LOG_TRACE << "block " << block_no << " not found in active set";
     }
 
     // See if it's cached (fully or partially decompressed)
-    auto ic = cache_.find(block_no);
-
-    if (ic != cache_.end()) {
+    if (auto block = shard.cache.find(block_no)) {
       // Nice, at least the block is already there.
 
       LOG_TRACE << "block " << block_no << " found in cache";
 
-      auto block = ic->second;
-
-      if (range_end <= block->range_end()) {
-        // We can immediately satisfy the promise
-        promise.set_value(block_range(std::move(block), offset, size));
+      if (block->has_range(offset, range_end)) {
+        // We can immediately satisfy the request
         ++cache_hits_fast_;
+        return folly::makeTryWith(
+            [&] { return block_range(std::move(block), offset, size); });
       } else {
         // Make a new set for the block
-        brs = std::make_shared<block_request_set>(std::move(block), block_no);
+        brs = std::make_shared<block_request_set>(std::move(block), block_no,
+                                                  prio);
 
-        // Promise will be fulfilled asynchronously
-        brs->add(offset, range_end, std::move(promise));
+        // Request will be completed asynchronously
+        brs->add(offset, range_end, std::move(done));
         ++cache_hits_slow_;
 
-        active_[block_no].emplace_back(brs);
-        enqueue_job(std::move(brs));
+        shard.active[block_no].emplace_back(brs);
+        schedule_job(std::move(brs), run_inline);
       }
 
-      return future;
+      return std::nullopt;
     }
 
     // Bummer. We don't know anything about the block.
 
     try {
-      if (block_no >= block_.size()) {
-        DWARFS_THROW(runtime_error,
-                     fmt::format("block number out of range {0} >= {1}",
-                                 block_no, block_.size()));
-      }
-
       LOG_TRACE << "block " << block_no << " not found";
 
-      auto block = std::make_shared<cached_block>(
-          LOG_GET_LOGGER, DWARFS_NOTHROW(block_.at(block_no)), mm_,
-          options_.mm_release);
-      ++blocks_created_;
+      auto block = create_block(block_no);
 
       // Make a new set for the block
-      brs = std::make_shared<block_request_set>(std::move(block), block_no);
+      brs = std::make_shared<block_request_set>(std::move(block), block_no,
+                                                prio);
 
-      // Promise will be fulfilled asynchronously
-      brs->add(offset, range_end, std::move(promise));
+      // Request will be completed asynchronously
+      brs->add(offset, range_end, std::move(done));
 
-      active_[block_no].emplace_back(brs);
-      enqueue_job(std::move(brs));
+      shard.active[block_no].emplace_back(brs);
+      schedule_job(std::move(brs), run_inline);
     } catch (...) {
-      promise.set_exception(std::current_exception());
+      return folly::Try<block_range>(
+          folly::exception_wrapper(std::current_exception()));
     }
 
-    return future;
+    return std::nullopt;
+  }
+
+  // Must be called with the shard lock held
+  std::shared_ptr<cached_block> create_block(size_t block_no) const {
+    if (block_no >= block_.size()) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("block number out of range {0} >= {1}",
+                               block_no, block_.size()));
+    }
+
+    auto const& section = DWARFS_NOTHROW(block_.at(block_no));
+
+    if (tier2_bc_) {
+      std::shared_ptr<std::vector<uint8_t> const> compressed;
+
+      {
+        std::lock_guard lock(mx_tier2_);
+
+        if (auto it = tier2_.find(block_no); it != tier2_.end()) {
+          compressed = std::move(it->second);
+          tier2_bytes_ -= compressed->size();
+          tier2_.erase(block_no);
+        }
+      }
+
+      if (compressed) {
+        LOG_TRACE << "block " << block_no << " found in compressed cache";
+        ++tier2_hits_;
+        folly::ByteRange data(compressed->data(), compressed->size());
+        return std::make_shared<cached_block>(LOG_GET_LOGGER, section,
+                                              tier2_bc_->type(), data,
+                                              std::move(compressed));
+      }
+    }
+
+    auto block = std::make_shared<cached_block>(LOG_GET_LOGGER, section,
+                                                block_dict_[block_no], pool_);
+
+    // Looking up the disk cache or reading the block without going
+    // through the mapping means I/O, which must not happen under the
+    // shard lock; process_job() loads the block instead.
+    if (!disk_cache_ && !options_.direct_read) {
+      ++blocks_created_;
+      load_from_source(block_no, *block);
+    }
+
+    return block;
+  }
+
+  // Loads a block returned by create_block() that hasn't been loaded yet
+  void load_block(size_t block_no, cached_block& block) const {
+    if (disk_cache_) {
+      if (auto key = disk_cache_key(DWARFS_NOTHROW(block_.at(block_no)))) {
+        if (auto entry = disk_cache_->find(*key)) {
+          LOG_TRACE << "block " << block_no << " found in disk cache";
+          ++disk_cache_hits_;
+          block.load_copy(compression_type::NONE, entry->data,
+                          std::move(entry->mm));
+          block.try_mark_persisted();
+          return;
+        }
+      }
+    }
+
+    ++blocks_created_;
+    load_from_source(block_no, block);
+  }
+
+  void load_from_source(size_t block_no, cached_block& block) const {
+    if (options_.direct_read) {
+      auto const& section = DWARFS_NOTHROW(block_.at(block_no));
+      auto compressed = std::make_shared<std::vector<uint8_t>>();
+      compressed->resize(section.length());
+
+      if (block_mm_[block_no]->read_uncached(
+              compressed->data(), section.start(), section.length())) {
+        ++direct_reads_;
+        block.load_from_buffer(std::move(compressed));
+        return;
+      }
+    }
+
+    block.load_from_image(block_mm_[block_no], options_.mm_release);
+  }
+
+  static std::optional<std::string> disk_cache_key(fs_section const& section) {
+    if (auto xxh = section.xxh3_64()) {
+      return fmt::format("{:016x}-{}", *xxh, section.length());
+    }
+    return std::nullopt;
+  }
+
+  // The block is kept alive until its data has been written
+  void persist_block(size_t block_no,
+                     std::shared_ptr<cached_block const> block) const {
+    if (auto key = disk_cache_key(DWARFS_NOTHROW(block_.at(block_no)))) {
+      LOG_TRACE << "storing block " << block_no << " in disk cache";
+      folly::ByteRange data(block->data(), block->uncompressed_size());
+      disk_cache_->store(*key, data, std::move(block));
+      ++disk_cache_stored_;
+    }
+  }
+
+  // Keep a cheaply compressed copy of fully decompressed blocks that
+  // are evicted, so a later miss doesn't pay the full decompression.
+  void demote_block(size_t block_no, std::shared_ptr<cached_block> block) {
+    if (!tier2_bc_ || !block->fully_decompressed()) {
+      return;
+    }
+
+    std::shared_lock lock(mx_wg_);
+
+    wg_.add_job(
+        [this, block_no, block = std::move(block)] {
+          std::shared_ptr<std::vector<uint8_t> const> compressed;
+
+          try {
+            compressed = std::make_shared<std::vector<uint8_t>>(
+                tier2_bc_->compress(block->vec()));
+          } catch (bad_compression_ratio_error const&) {
+            return;
+          } catch (std::exception const& e) {
+            LOG_WARN << "failed to compress block " << block_no << ": "
+                     << e.what();
+            return;
+          }
+
+          std::lock_guard lock(mx_tier2_);
+
+          if (tier2_.exists(block_no)) {
+            return;
+          }
+
+          tier2_bytes_ += compressed->size();
+          tier2_.set(block_no, std::move(compressed));
+          ++tier2_stored_;
+
+          while (tier2_bytes_ > options_.tier2_max_bytes && !tier2_.empty()) {
+            auto victim = tier2_.rbegin();
+            auto victim_no = victim->first;
+            tier2_bytes_ -= victim->second->size();
+            tier2_.erase(victim_no);
+            ++tier2_evicted_;
+          }
+        },
+        job_priority::BACKGROUND);
+  }
+
+  void prefetch_block(size_t block_no) const {
+    auto& shard = shard_for(block_no);
+
+    std::lock_guard lock(shard.mx);
+
+    if (shard.active.find(block_no) != shard.active.end() ||
+        shard.cache.contains(block_no)) {
+      return;
+    }
+
+    try {
+      auto block = create_block(block_no);
+      ++blocks_prefetched_;
+
+      // Request the whole block; nobody is waiting for the result. The
+      // block may not be loaded yet, so its size is filled in later.
+      auto brs = std::make_shared<block_request_set>(
+          std::move(block), block_no, job_priority::BACKGROUND);
+      brs->add(0, kWholeBlock, block_range_callback());
+
+      shard.active[block_no].emplace_back(brs);
+      enqueue_job(std::move(brs));
+    } catch (std::exception const& e) {
+      LOG_WARN << "failed to prefetch block " << block_no << ": " << e.what();
+    }
   }
 
- private:
   void update_block_stats(cached_block const& cb) {
     if (cb.range_end() < cb.uncompressed_size()) {
       ++partially_decompressed_;
@@ -458,50 +1461,268 @@ class block_cache_ final : public block_cache::impl {
     total_block_bytes_ += cb.uncompressed_size();
   }
 
+  void start_workers(size_t num) {
+    wg_ = worker_group("blkcache", num);
+    wg_.set_background_limit(background_limit(num));
+    if (!options_.worker_cpus.empty()) {
+      wg_.set_affinity(options_.worker_cpus);
+    }
+  }
+
+  // Prefetching must never keep all workers busy, otherwise demand reads
+  // would have to wait for a background job to finish
+  size_t background_limit(size_t num_workers) const {
+    if (options_.max_background_jobs > 0) {
+      return options_.max_background_jobs;
+    }
+    return std::max<size_t>(num_workers, 2) - 1;
+  }
+
+  // Updates max_blocks_ from the current budget and returns the
+  // number of blocks each shard may hold
+  size_t update_max_blocks() {
+    auto max_blocks = std::max<size_t>(max_bytes_.load() / block_size_, 1);
+
+    if (!block_.empty() && max_blocks > block_.size()) {
+      max_blocks = block_.size();
+    }
+
+    max_blocks_ = max_blocks;
+
+    // Blocks are assigned to shards round-robin, so splitting the
+    // budget evenly keeps the total close to max_blocks.
+    return std::max<size_t>((max_blocks + shards_.size() - 1) / shards_.size(),
+                            1);
+  }
+
+  // Evicted block buffers are freed, but the allocator usually keeps
+  // the memory around for reuse; hand it back so a smaller cache also
+  // means a smaller footprint
+  static void release_free_memory() {
+#ifdef __GLIBC__
+    ::malloc_trim(0);
+#endif
+  }
+
+  static uint64_t trace_id(block_request_set const& brs) {
+    return reinterpret_cast<uintptr_t>(&brs);
+  }
+
+  // With I/O workers, the compressed data of a block is read in before
+  // the block is queued for decompression, so the decompression workers
+  // don't sit idle waiting for page faults.
   void enqueue_job(std::shared_ptr<block_request_set> brs) const {
+    // Direct reads bypass the mapping, so there's nothing to fault in
+    if (!io_wg_ || options_.direct_read) {
+      submit_job(std::move(brs));
+      return;
+    }
+
+    auto const block_no = brs->block_no();
+    auto const& section = block_[block_no];
+    auto const prio = brs->priority();
+
+    if (auto ec = block_mm_[block_no]->advise_willneed(section.start(),
+                                                       section.length())) {
+      LOG_TRACE << "advise_willneed failed for block " << block_no << ": "
+                << ec.message();
+    }
+
+    io_wg_.add_job(
+        [this, brs = std::move(brs)]() mutable {
+          try {
+            fault_in(brs->block_no());
+          } catch (std::exception const& e) {
+            // Decompression will run into the same error and report it
+            // to the requests
+            LOG_DEBUG << "failed to read block " << brs->block_no() << ": "
+                      << e.what();
+          }
+          submit_job(std::move(brs));
+        },
+        prio);
+  }
+
+  void fault_in(size_t block_no) const {
+    DWARFS_TRACE_SCOPE("block_cache", "fault_in");
+
+    static constexpr size_t kPageSize{4096};
+
+    auto const& section = block_[block_no];
+    auto& mm = *block_mm_[block_no];
+
+    mm.populate(section.start(), section.length());
+
+    // Touch every page, volatile so the reads can't be optimized away
+    auto data = mm.as<uint8_t const volatile>(section.start());
+    auto const size = section.length();
+
+    for (size_t i = 0; i < size; i += kPageSize) {
+      (void)data[i];
+    }
+
+    if (size > 0) {
+      (void)data[size - 1];
+    }
+
+    ++blocks_faulted_in_;
+  }
+
+  void submit_job(std::shared_ptr<block_request_set> brs) const {
     std::shared_lock lock(mx_wg_);
 
+    DWARFS_TRACE_ASYNC_BEGIN("block_cache", "queued", trace_id(*brs));
+
+    auto const prio = brs->priority();
+
     // Lambda needs to be mutable so we can actually move out of it
-    wg_.add_job([this, brs = std::move(brs)]() mutable {
-      process_job(std::move(brs));
-    });
+    wg_.add_job(
+        [this, brs = std::move(brs)]() mutable { process_job(std::move(brs)); },
+        prio);
+  }
+
+  // The request set stays in the shard's active list while it is being
+  // processed inline, so other requests can still join it.
+  void schedule_job(std::shared_ptr<block_request_set> brs,
+                    std::shared_ptr<block_request_set>* run_inline) const {
+    if (run_inline && !*run_inline && should_decompress_inline(*brs)) {
+      DWARFS_TRACE_ASYNC_BEGIN("block_cache", "queued", trace_id(*brs));
+      ++inline_jobs_;
+      *run_inline = std::move(brs);
+    } else {
+      enqueue_job(std::move(brs));
+    }
+  }
+
+  // Handing a job to a worker and waiting for it to finish costs more
+  // than decompressing small blocks right away, and there's no point in
+  // waiting for a worker if all of them are busy anyway. This applies
+  // to blocks with a fast codec as well, as even those take a while to
+  // decompress if they are large. Background jobs are never run inline.
+  bool should_decompress_inline(block_request_set const& brs) const {
+    if (options_.inline_max_bytes == 0 ||
+        brs.priority() != job_priority::DEMAND || !brs.block()->loaded()) {
+      return false;
+    }
+
+    auto const& section = block_[brs.block_no()];
+
+    if (section.length() <= options_.inline_max_bytes) {
+      return true;
+    }
+
+    std::shared_lock lock(mx_wg_);
+    return !wg_ || wg_.queue_size() >= wg_.size();
+  }
+
+  static constexpr size_t kWholeBlock{std::numeric_limits<size_t>::max()};
+  static constexpr int kMaxPattern{4};
+  static constexpr int kSequentialPattern{2};
+  static constexpr int kRandomPattern{-2};
+  static constexpr size_t kSequentialGap{64 << 10};
+
+  // Learns how a block is read from the requests that need more of it
+  // to be decompressed. A request that continues where the previous one
+  // ended counts as sequential, anything else as random. The score is
+  // kept across evictions and returned after the update.
+  int update_access_pattern(size_t block_no, size_t begin, size_t end) const {
+    if (block_no >= access_pattern_.size()) {
+      return 0;
+    }
+
+    auto prev_end =
+        last_request_end_[block_no].exchange(end, std::memory_order_relaxed);
+    auto& pattern = access_pattern_[block_no];
+    int score = pattern.load(std::memory_order_relaxed);
+
+    if (begin == 0) {
+      // Most likely a reader entering the block; without any history,
+      // assume it reads the same way as in the previous block
+      if (score == 0 && block_no > 0) {
+        score = access_pattern_[block_no - 1].load(std::memory_order_relaxed);
+        pattern.store(score, std::memory_order_relaxed);
+      }
+      return score;
+    }
+
+    bool sequential = begin <= prev_end + kSequentialGap && end > prev_end;
+
+    score = std::clamp(score + (sequential ? 1 : -1), -kMaxPattern,
+                       kMaxPattern);
+    pattern.store(score, std::memory_order_relaxed);
+
+    return score;
   }
 
   void process_job(std::shared_ptr<block_request_set> brs) const {
+    DWARFS_TRACE_ASYNC_END("block_cache", "queued", trace_id(*brs));
+    DWARFS_TRACE_SCOPE("block_cache", "process_job");
+
     auto block_no = brs->block_no();
+    auto& shard = shard_for(block_no);
 
     LOG_TRACE << "processing block " << block_no;
 
     // Check if another worker is already processing this block
     {
-      std::lock_guard lock(mx_dec_);
+      std::lock_guard lock(shard.mx_dec);
 
-      auto di = decompressing_.find(block_no);
+      auto di = shard.decompressing.find(block_no);
 
-      if (di != decompressing_.end()) {
-        std::lock_guard lock(mx_);
+      if (di != shard.decompressing.end()) {
+        std::lock_guard lock(shard.mx);
 
         if (auto other = di->second.lock()) {
           LOG_TRACE << "merging sets for block " << block_no;
           other->merge(std::move(*brs));
           ++sets_merged_;
+          DWARFS_TRACE_INSTANT("block_cache", "merge");
           brs.reset();
           return;
         }
       }
 
-      decompressing_[block_no] = brs;
+      shard.decompressing[block_no] = brs;
     }
 
     auto block = brs->block();
 
+    // Loading the block and the full integrity check on first access
+    // are done here rather than in create_block() so they don't run
+    // under the shard lock.
+    std::exception_ptr verify_error;
+
+    if (!block->loaded()) {
+      try {
+        load_block(block_no, *block);
+      } catch (...) {
+        verify_error = std::current_exception();
+      }
+    }
+
+    if (!verify_error && options_.verify_blocks &&
+        !sha_verified_[block_no].load()) {
+      if (block_[block_no].verify(*block_mm_[block_no])) {
+        sha_verified_[block_no] = true;
+      } else {
+        LOG_ERROR << "integrity check failed for block " << block_no;
+        try {
+          DWARFS_THROW(runtime_error,
+                       fmt::format("integrity check failed for block {}",
+                                   block_no));
+        } catch (...) {
+          verify_error = std::current_exception();
+        }
+      }
+    }
+
     for (;;) {
       block_request req;
       bool is_last_req = false;
 
       // Fetch the next request, if any
       {
-        std::lock_guard lock(mx_);
+        std::lock_guard lock(shard.mx);
 
         if (brs->empty()) {
           // This is absolutely crucial! At this point, we can no longer
@@ -517,54 +1738,124 @@ class block_cache_ final : public block_cache::impl {
 
       // Process this request!
 
+      if (verify_error) {
+        req.error(verify_error);
+        continue;
+      }
+
+      if (req.end() == kWholeBlock) {
+        req.limit_end(block->uncompressed_size());
+      }
+
+      size_t range_begin = req.begin();
       size_t range_end = req.end();
+      auto pattern = update_access_pattern(block_no, range_begin, range_end);
 
       if (is_last_req) {
         auto max_end = block->uncompressed_size();
-        double ratio = double(range_end) / double(max_end);
-        if (ratio > options_.decompress_ratio) {
-          LOG_TRACE << "block " << block_no << " over ratio: " << ratio << " > "
-                    << options_.decompress_ratio;
+
+        if (pattern >= kSequentialPattern) {
+          // Sequential readers are going to need the rest of the block
+          // anyway, so get it in one go rather than step by step
+          LOG_TRACE << "block " << block_no << " read sequentially";
+          range_begin = 0;
           range_end = max_end;
+          ++sequential_full_;
+        } else if (pattern > kRandomPattern) {
+          // For seekable blocks, only the frames actually decompressed count
+          double ratio = double(block->seekable()
+                                    ? block->decompressed_bytes() +
+                                          (range_end - range_begin)
+                                    : range_end) /
+                         double(max_end);
+          if (ratio > options_.decompress_ratio) {
+            LOG_TRACE << "block " << block_no << " over ratio: " << ratio
+                      << " > " << options_.decompress_ratio;
+            range_begin = 0;
+            range_end = max_end;
+          }
         }
+        // Random readers only decompress as much as they need
       }
 
       LOG_TRACE << "decompressing block " << block_no << " until position "
                 << req.end();
 
       try {
-        block->decompress_until(range_end);
+        auto const before = block->decompressed_bytes();
+        auto const start = std::chrono::steady_clock::now();
+        {
+          DWARFS_TRACE_SCOPE("block_cache", "decompress");
+          block->decompress_range(range_begin, range_end);
+        }
+        auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+        decompress_ns_ += ns;
+        block->add_decompress_time(ns);
+        bytes_decompressed_ += block->decompressed_bytes() - before;
         req.fulfill(block);
       } catch (...) {
         req.error(std::current_exception());
       }
     }
 
+    if (verify_error) {
+      // Don't cache a corrupt block, subsequent reads will fail again
+      return;
+    }
+
     // Finally, put the block into the cache; it might already be
     // in there, in which case we just promote it to the front of
-    // the LRU queue.
+    // its LRU queue.
+    if (disk_cache_ && block->fully_decompressed() &&
+        block->try_mark_persisted()) {
+      persist_block(block_no, block);
+    }
+
     {
-      std::lock_guard lock(mx_);
-      cache_.set(block_no, std::move(block));
+      std::lock_guard lock(shard.mx);
+      shard.cache.set(block_no, std::move(block));
     }
   }
 
-  using lru_type =
-      folly::EvictingCacheMap<size_t, std::shared_ptr<cached_block>>;
-
-  mutable std::mutex mx_;
-  mutable lru_type cache_;
-  mutable folly::F14FastMap<size_t,
-                            std::deque<std::weak_ptr<block_request_set>>>
-      active_;
-
-  mutable std::mutex mx_dec_;
-  mutable folly::F14FastMap<size_t, std::weak_ptr<block_request_set>>
-      decompressing_;
+  mutable std::vector<cache_shard> shards_;
+  mutable std::vector<std::atomic<uint32_t>> access_count_;
+  mutable std::vector<std::atomic<bool>> verified_;
+  mutable std::vector<std::atomic<bool>> sha_verified_;
+  // > 0 for blocks read sequentially, < 0 for blocks read randomly
+  mutable std::vector<std::atomic<int8_t>> access_pattern_;
+  mutable std::vector<std::atomic<size_t>> last_request_end_;
+  mutable std::atomic<size_t> uncompressed_reads_{0};
+  std::atomic<size_t> max_blocks_{0};
+  std::atomic<size_t> max_bytes_;
+  // protects block_size_ and, until the cache is sealed, the blocks
+  mutable std::mutex mx_resize_;
+  mutable std::atomic<bool> sealed_{false};
+  size_t block_size_{0};
+
+  std::unique_ptr<block_compressor> tier2_bc_;
+  mutable std::mutex mx_tier2_;
+  mutable folly::EvictingCacheMap<size_t,
+                                  std::shared_ptr<std::vector<uint8_t> const>>
+      tier2_{0};
+  mutable size_t tier2_bytes_{0};
+  mutable std::atomic<size_t> tier2_stored_{0};
+  mutable std::atomic<size_t> tier2_evicted_{0};
+  mutable std::atomic<size_t> tier2_hits_{0};
+
+  std::unique_ptr<disk_cache> disk_cache_;
+  mutable std::atomic<size_t> disk_cache_hits_{0};
+  mutable std::atomic<size_t> disk_cache_stored_{0};
 
   mutable std::atomic<size_t> blocks_created_{0};
   mutable std::atomic<size_t> blocks_evicted_{0};
+  mutable std::atomic<size_t> blocks_prefetched_{0};
   mutable std::atomic<size_t> sets_merged_{0};
+  mutable std::atomic<size_t> inline_jobs_{0};
+  mutable std::atomic<size_t> blocks_faulted_in_{0};
+  mutable std::atomic<size_t> direct_reads_{0};
+  mutable std::atomic<size_t> sequential_full_{0};
   mutable std::atomic<size_t> range_requests_{0};
   mutable std::atomic<size_t> active_hits_fast_{0};
   mutable std::atomic<size_t> active_hits_slow_{0};
@@ -573,13 +1864,151 @@ class block_cache_ final : public block_cache::impl {
   mutable std::atomic<size_t> partially_decompressed_{0};
   mutable std::atomic<size_t> total_block_bytes_{0};
   mutable std::atomic<size_t> total_decompressed_bytes_{0};
+  mutable std::atomic<size_t> bytes_decompressed_{0};
+  mutable std::atomic<uint64_t> decompress_ns_{0};
 
   mutable std::shared_mutex mx_wg_;
   mutable worker_group wg_;
+  mutable worker_group io_wg_;
   std::vector<fs_section> block_;
+  std::vector<std::shared_ptr<mmif>> block_mm_;
+  std::vector<std::shared_ptr<compression_dictionary const>> block_dict_;
   std::shared_ptr<mmif> mm_;
   LOG_PROXY_DECL(LoggerPolicy);
   const block_cache_options options_;
+  // Buffers of evicted blocks are recycled for new blocks
+  std::shared_ptr<buffer_pool> pool_;
+};
+
+// The blocks of a single image within a shared cache. Block numbers
+// are relative to the image, the view adds the offset of its first
+// block in the shared cache.
+class block_cache_view final : public block_cache::impl {
+ public:
+  block_cache_view(std::shared_ptr<block_cache> shared,
+                   std::shared_ptr<mmif> mm)
+      : shared_(std::move(shared))
+      , mm_(std::move(mm))
+      , first_block_(shared_->block_count()) {}
+
+  size_t block_count() const override { return num_blocks_; }
+
+  void insert(fs_section const& section) override {
+    insert(section, mm_, nullptr);
+  }
+
+  void insert(fs_section const& section, std::shared_ptr<mmif> mm,
+              std::shared_ptr<compression_dictionary const> dict) override {
+    // The blocks of each image must be contiguous in the shared cache
+    if (shared_->block_count() != first_block_ + num_blocks_) {
+      DWARFS_THROW(runtime_error,
+                   "images must be added to a shared block cache one at a "
+                   "time");
+    }
+    shared_->insert(section, std::move(mm), std::move(dict));
+    ++num_blocks_;
+  }
+
+  void set_block_size(size_t size) override { shared_->set_block_size(size); }
+
+  void set_num_workers(size_t num) override { shared_->set_num_workers(num); }
+
+  void set_max_bytes(size_t max_bytes) override {
+    shared_->set_max_bytes(max_bytes);
+  }
+
+  std::future<block_range> get(size_t block_no, size_t offset, size_t size,
+                               job_priority prio) const override {
+    if (block_no >= num_blocks_) {
+      std::promise<block_range> promise;
+      promise.set_exception(out_of_range(block_no));
+      return promise.get_future();
+    }
+    return shared_->get(first_block_ + block_no, offset, size, prio);
+  }
+
+  void get(size_t block_no, size_t offset, size_t size,
+           block_range_callback done, job_priority prio) const override {
+    if (block_no >= num_blocks_) {
+      done(folly::Try<block_range>(
+          folly::exception_wrapper(out_of_range(block_no))));
+      return;
+    }
+    shared_->get(first_block_ + block_no, offset, size, std::move(done), prio);
+  }
+
+  void get(std::vector<block_cache_request>&& requests,
+           job_priority prio) const override {
+    auto end = std::stable_partition(
+        requests.begin(), requests.end(),
+        [this](auto const& r) { return r.block_no < num_blocks_; });
+
+    for (auto it = end; it != requests.end(); ++it) {
+      it->done(folly::Try<block_range>(
+          folly::exception_wrapper(out_of_range(it->block_no))));
+    }
+
+    requests.erase(end, requests.end());
+
+    for (auto& r : requests) {
+      r.block_no += first_block_;
+    }
+
+    shared_->get(std::move(requests), prio);
+  }
+
+  void prefetch(std::vector<size_t> const& blocks) const override {
+    std::vector<size_t> shared_blocks;
+    shared_blocks.reserve(blocks.size());
+    for (auto b : blocks) {
+      if (b < num_blocks_) {
+        shared_blocks.push_back(first_block_ + b);
+      }
+    }
+    shared_->prefetch(shared_blocks);
+  }
+
+  std::vector<uint32_t> access_counts() const override {
+    auto counts = shared_->access_counts();
+    if (counts.size() < first_block_ + num_blocks_) {
+      return {};
+    }
+    return std::vector<uint32_t>(
+        counts.begin() + first_block_,
+        counts.begin() + first_block_ + num_blocks_);
+  }
+
+  // The counters are those of the shared cache
+  block_cache_stats stats() const override { return shared_->stats(); }
+
+  std::optional<size_t>
+  uncompressed_offset(size_t block_no) const override {
+    return uncompressed_offset(block_no, *mm_);
+  }
+
+  std::optional<size_t>
+  uncompressed_offset(size_t block_no, mmif const& image) const override {
+    if (block_no >= num_blocks_) {
+      return std::nullopt;
+    }
+    return shared_->uncompressed_offset(first_block_ + block_no, image);
+  }
+
+ private:
+  std::exception_ptr out_of_range(size_t block_no) const {
+    try {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("block number out of range {0} >= {1}",
+                               block_no, num_blocks_));
+    } catch (...) {
+      return std::current_exception();
+    }
+  }
+
+  std::shared_ptr<block_cache> shared_;
+  std::shared_ptr<mmif> mm_;
+  size_t const first_block_;
+  size_t num_blocks_{0};
 };
 
 block_cache::block_cache(logger& lgr, std::shared_ptr<mmif> mm,
@@ -587,6 +2016,11 @@ block_cache::block_cache(logger& lgr, std::shared_ptr<mmif> mm,
     : impl_(make_unique_logging_object<impl, block_cache_, logger_policies>(
           lgr, std::move(mm), options)) {}
 
+block_cache::block_cache(std::shared_ptr<block_cache> shared,
+                         std::shared_ptr<mmif> mm)
+    : impl_(std::make_unique<block_cache_view>(std::move(shared),
+                                               std::move(mm))) {}
+
 // TODO: clean up: this is defined in fstypes.h...
 block_range::block_range(std::shared_ptr<cached_block const> block,
                          size_t offset, size_t size)
@@ -596,11 +2030,18 @@ block_range::block_range(std::shared_ptr<cached_block const> block,
   if (!block_->data()) {
     DWARFS_THROW(runtime_error, "block_range: block data is null");
   }
-  if (size > block_->range_end()) {
+  if (!block_->has_range(offset, offset + size)) {
     DWARFS_THROW(runtime_error,
-                 fmt::format("block_range: size out of range ({0} > {1})", size,
-                             block_->range_end()));
+                 fmt::format("block_range: range out of bounds ({0}+{1} > {2})",
+                             offset, size, block_->range_end()));
   }
 }
 
+block_range block_range::zeros(size_t size) {
+  // not const, so this ends up in .bss and never occupies any memory
+  static uint8_t zero_data[max_zeros_size];
+  DWARFS_CHECK(size <= max_zeros_size, "block_range: too many zeros");
+  return block_range(zero_data, size);
+}
+
 } // namespace dwarfs
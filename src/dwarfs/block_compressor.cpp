@@ -21,12 +21,14 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <iterator>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include <sys/types.h>
@@ -36,6 +38,7 @@
 #include <boost/algorithm/string/split.hpp>
 
 #include <folly/Conv.h>
+#include <folly/lang/Bits.h>
 
 #include <fmt/format.h>
 
@@ -45,6 +48,7 @@
 #endif
 
 #ifdef DWARFS_HAVE_LIBZSTD
+#include <zdict.h>
 #include <zstd.h>
 #endif
 
@@ -127,30 +131,116 @@ std::unordered_map<lzma_ret, char const*> const lzma_error_desc{
 };
 #endif
 
+#ifdef DWARFS_HAVE_LIBZSTD
+// Seek table layout of the zstd seekable format (see contrib/seekable_format
+// in the zstd sources): a skippable frame holding one (compressed size,
+// decompressed size) pair per frame, followed by a 9 byte footer.
+constexpr uint32_t kZstdSeekableMagic{0x8F92EAB1};
+constexpr size_t kZstdSkippableHeaderSize{8};
+constexpr size_t kZstdSeekTableFooterSize{9};
+constexpr size_t kZstdSeekTableEntrySize{8};
+
+constexpr size_t zstd_seek_table_size(size_t num_frames) {
+  return kZstdSkippableHeaderSize + num_frames * kZstdSeekTableEntrySize +
+         kZstdSeekTableFooterSize;
+}
+
+uint32_t load_le32(uint8_t const* p) {
+  return folly::Endian::little(folly::loadUnaligned<uint32_t>(p));
+}
+
+struct zstd_seekable_frame {
+  size_t comp_offset;
+  size_t comp_size;
+  size_t uncomp_offset;
+  size_t uncomp_size;
+};
+
+/**
+ * Parse the seek table at the end of a zstd block, if present. Returns
+ * an empty vector for regular (single frame) zstd blocks.
+ */
+std::vector<zstd_seekable_frame>
+parse_zstd_seek_table(uint8_t const* data, size_t size) {
+  std::vector<zstd_seekable_frame> frames;
+
+  if (size < zstd_seek_table_size(0) ||
+      load_le32(data + size - sizeof(uint32_t)) != kZstdSeekableMagic) {
+    return frames;
+  }
+
+  auto footer = data + size - kZstdSeekTableFooterSize;
+  size_t num_frames = load_le32(footer);
+
+  if (footer[4] != 0) {
+    DWARFS_THROW(runtime_error, "unsupported zstd seek table descriptor");
+  }
+
+  if (num_frames == 0 || (size - zstd_seek_table_size(0)) /
+                                 kZstdSeekTableEntrySize <
+                             num_frames) {
+    DWARFS_THROW(runtime_error, "invalid zstd seek table");
+  }
+
+  auto table_size = zstd_seek_table_size(num_frames);
+  auto table = data + size - table_size;
+
+  if (load_le32(table) != (ZSTD_MAGIC_SKIPPABLE_START | 0xE) ||
+      load_le32(table + 4) != table_size - kZstdSkippableHeaderSize) {
+    DWARFS_THROW(runtime_error, "invalid zstd seek table header");
+  }
+
+  frames.reserve(num_frames);
+  size_t comp_offset = 0;
+  size_t uncomp_offset = 0;
+  auto entry = table + kZstdSkippableHeaderSize;
+
+  for (size_t i = 0; i < num_frames; ++i, entry += kZstdSeekTableEntrySize) {
+    auto& f = frames.emplace_back();
+    f.comp_offset = comp_offset;
+    f.comp_size = load_le32(entry);
+    f.uncomp_offset = uncomp_offset;
+    f.uncomp_size = load_le32(entry + 4);
+    comp_offset += f.comp_size;
+    uncomp_offset += f.uncomp_size;
+  }
+
+  if (comp_offset != size - table_size) {
+    DWARFS_THROW(runtime_error, "zstd seek table does not match block size");
+  }
+
+  return frames;
+}
+#endif
+
 } // namespace
 
 #ifdef DWARFS_HAVE_LIBLZMA
 class lzma_block_compressor final : public block_compressor::impl {
  public:
   lzma_block_compressor(unsigned level, bool extreme,
-                        const std::string& binary_mode, unsigned dict_size);
+                        const std::string& binary_mode, unsigned dict_size,
+                        unsigned block_bits);
   lzma_block_compressor(const lzma_block_compressor& rhs) = default;
 
   std::unique_ptr<block_compressor::impl> clone() const override {
     return std::make_unique<lzma_block_compressor>(*this);
   }
 
-  std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data) const override;
-  std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const override {
-    return compress(data);
+  void compress_into(const std::vector<uint8_t>& data,
+                     std::vector<uint8_t>& out) const override {
+    compress_parallel_into(data, out, 1);
   }
 
+  void compress_parallel_into(const std::vector<uint8_t>& data,
+                              std::vector<uint8_t>& out,
+                              size_t num_threads) const override;
+
   compression_type type() const override { return compression_type::LZMA; }
 
  private:
-  std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data, const lzma_filter* filters) const;
+  void compress(const std::vector<uint8_t>& data, const lzma_filter* filters,
+                std::vector<uint8_t>& out, size_t num_threads) const;
 
   static uint32_t get_preset(unsigned level, bool extreme) {
     uint32_t preset = level;
@@ -184,6 +274,7 @@ class lzma_block_compressor final : public block_compressor::impl {
 
   lzma_options_lzma opt_lzma_;
   std::array<lzma_filter, 3> filters_;
+  unsigned const block_bits_;
 };
 #endif
 
@@ -205,13 +296,24 @@ class null_block_compressor final : public block_compressor::impl {
     return std::move(data);
   }
 
+  void compress_into(const std::vector<uint8_t>& data,
+                     std::vector<uint8_t>& out) const override {
+    out.assign(data.begin(), data.end());
+  }
+
   compression_type type() const override { return compression_type::NONE; }
 };
 
 #ifdef DWARFS_HAVE_LIBLZMA
 lzma_block_compressor::lzma_block_compressor(unsigned level, bool extreme,
                                              const std::string& binary_mode,
-                                             unsigned dict_size) {
+                                             unsigned dict_size,
+                                             unsigned block_bits)
+    : block_bits_(block_bits) {
+  if (block_bits_ != 0 && (block_bits_ < 16 || block_bits_ > 30)) {
+    DWARFS_THROW(runtime_error, "lzma block_bits must be between 16 and 30");
+  }
+
   if (lzma_lzma_preset(&opt_lzma_, get_preset(level, extreme))) {
     DWARFS_THROW(runtime_error, "unsupported preset, possibly a bug");
   }
@@ -228,27 +330,46 @@ lzma_block_compressor::lzma_block_compressor(unsigned level, bool extreme,
   filters_[2].options = NULL;
 }
 
-std::vector<uint8_t>
-lzma_block_compressor::compress(const std::vector<uint8_t>& data,
-                                const lzma_filter* filters) const {
+void lzma_block_compressor::compress(const std::vector<uint8_t>& data,
+                                     const lzma_filter* filters,
+                                     std::vector<uint8_t>& out,
+                                     size_t num_threads) const {
   lzma_stream s = LZMA_STREAM_INIT;
 
-  if (lzma_stream_encoder(&s, filters, LZMA_CHECK_CRC64)) {
+  if (block_bits_ > 0) {
+    // The data is split into xz blocks of a fixed size, which are
+    // compressed independently, so the output is the same no matter
+    // how many threads are used
+    lzma_mt mt{};
+    mt.threads = std::max<size_t>(num_threads, 1);
+    mt.block_size = uint64_t(1) << block_bits_;
+    mt.filters = filters;
+    mt.check = LZMA_CHECK_CRC64;
+
+    if (lzma_stream_encoder_mt(&s, &mt)) {
+      DWARFS_THROW(runtime_error, "lzma_stream_encoder_mt");
+    }
+  } else if (lzma_stream_encoder(&s, filters, LZMA_CHECK_CRC64)) {
     DWARFS_THROW(runtime_error, "lzma_stream_encoder");
   }
 
   lzma_action action = LZMA_FINISH;
 
-  std::vector<uint8_t> compressed(data.size() - 1);
+  out.resize(data.size() - 1);
 
   s.next_in = data.data();
   s.avail_in = data.size();
-  s.next_out = compressed.data();
-  s.avail_out = compressed.size();
+  s.next_out = out.data();
+  s.avail_out = out.size();
+
+  lzma_ret ret;
 
-  lzma_ret ret = lzma_code(&s, action);
+  // the multi-threaded encoder can return before it's done
+  do {
+    ret = lzma_code(&s, action);
+  } while (ret == LZMA_OK && s.avail_out > 0);
 
-  compressed.resize(compressed.size() - s.avail_out);
+  out.resize(out.size() - s.avail_out);
 
   lzma_end(&s);
 
@@ -256,32 +377,28 @@ lzma_block_compressor::compress(const std::vector<uint8_t>& data,
     throw bad_compression_ratio_error();
   }
 
-  if (ret == LZMA_STREAM_END) {
-    compressed.shrink_to_fit();
-  } else {
+  if (ret != LZMA_STREAM_END) {
     if (auto it = lzma_error_desc.find(ret); it != lzma_error_desc.end()) {
       DWARFS_THROW(runtime_error, fmt::format("LZMA error: {}", it->second));
     } else {
       DWARFS_THROW(runtime_error, fmt::format("LZMA: unknown error {}", ret));
     }
   }
-
-  return compressed;
 }
 
-std::vector<uint8_t>
-lzma_block_compressor::compress(const std::vector<uint8_t>& data) const {
-  std::vector<uint8_t> best = compress(data, &filters_[1]);
+void lzma_block_compressor::compress_parallel_into(
+    const std::vector<uint8_t>& data, std::vector<uint8_t>& out,
+    size_t num_threads) const {
+  compress(data, &filters_[1], out, num_threads);
 
   if (filters_[0].id != LZMA_VLI_UNKNOWN) {
-    std::vector<uint8_t> compressed = compress(data, &filters_[0]);
+    std::vector<uint8_t> compressed;
+    compress(data, &filters_[0], compressed, num_threads);
 
-    if (compressed.size() < best.size()) {
-      best.swap(compressed);
+    if (compressed.size() < out.size()) {
+      out.swap(compressed);
     }
   }
-
-  return best;
 }
 #endif
 
@@ -315,26 +432,21 @@ class lz4_block_compressor final : public block_compressor::impl {
     return std::make_unique<lz4_block_compressor>(*this);
   }
 
-  std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data) const override {
-    std::vector<uint8_t> compressed(
-        sizeof(uint32_t) + LZ4_compressBound(folly::to<int>(data.size())));
-    *reinterpret_cast<uint32_t*>(&compressed[0]) = data.size();
-    auto csize =
-        Policy::compress(&data[0], &compressed[sizeof(uint32_t)], data.size(),
-                         compressed.size() - sizeof(uint32_t), level_);
+  void compress_into(const std::vector<uint8_t>& data,
+                     std::vector<uint8_t>& out) const override {
+    out.resize(sizeof(uint32_t) +
+               LZ4_compressBound(folly::to<int>(data.size())));
+    *reinterpret_cast<uint32_t*>(&out[0]) = data.size();
+    auto csize = Policy::compress(&data[0], &out[sizeof(uint32_t)],
+                                  data.size(), out.size() - sizeof(uint32_t),
+                                  level_);
     if (csize == 0) {
       DWARFS_THROW(runtime_error, "error during compression");
     }
     if (sizeof(uint32_t) + csize >= data.size()) {
       throw bad_compression_ratio_error();
     }
-    compressed.resize(sizeof(uint32_t) + csize);
-    return compressed;
-  }
-
-  std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const override {
-    return compress(data);
+    out.resize(sizeof(uint32_t) + csize);
   }
 
   compression_type type() const override { return compression_type::LZ4; }
@@ -347,24 +459,65 @@ class lz4_block_compressor final : public block_compressor::impl {
 #ifdef DWARFS_HAVE_LIBZSTD
 class zstd_block_compressor final : public block_compressor::impl {
  public:
-  explicit zstd_block_compressor(int level)
+  explicit zstd_block_compressor(int level, unsigned frame_bits = 0,
+                                 unsigned long_bits = 0, bool mt = false)
       : ctxmgr_(get_context_manager())
-      , level_(level) {}
+      , level_(level)
+      , frame_bits_(frame_bits)
+      , long_bits_(long_bits)
+      , mt_(mt) {
+    if (mt_ && ZSTD_cParam_getBounds(ZSTD_c_nbWorkers).upperBound < 1) {
+      DWARFS_THROW(runtime_error, "zstd was built without threading support");
+    }
+    if (frame_bits_ != 0 && (frame_bits_ < 12 || frame_bits_ > 30)) {
+      DWARFS_THROW(runtime_error, "zstd frame_bits must be between 12 and 30");
+    }
+    if (long_bits_ != 0) {
+      auto bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+      if (static_cast<int>(long_bits_) < bounds.lowerBound ||
+          static_cast<int>(long_bits_) > bounds.upperBound) {
+        DWARFS_THROW(runtime_error,
+                     fmt::format("zstd long must be between {} and {}",
+                                 bounds.lowerBound, bounds.upperBound));
+      }
+    }
+  }
 
   zstd_block_compressor(const zstd_block_compressor& rhs)
-      : level_(rhs.level_) {}
+      : ctxmgr_(rhs.ctxmgr_)
+      , level_(rhs.level_)
+      , frame_bits_(rhs.frame_bits_)
+      , long_bits_(rhs.long_bits_)
+      , mt_(rhs.mt_)
+      , dict_(rhs.dict_)
+      , cdict_(rhs.cdict_) {}
 
   std::unique_ptr<block_compressor::impl> clone() const override {
     return std::make_unique<zstd_block_compressor>(*this);
   }
 
-  std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data) const override;
+  std::unique_ptr<block_compressor::impl> with_dictionary(
+      std::shared_ptr<compression_dictionary const> dict) const override {
+    auto bc = std::make_unique<zstd_block_compressor>(*this);
+    auto const& data = dict->data();
+    auto cdict = ZSTD_createCDict(data.data(), data.size(), level_);
+    if (!cdict) {
+      DWARFS_THROW(runtime_error, "ZSTD: failed to create dictionary");
+    }
+    bc->cdict_.reset(cdict, ZSTD_freeCDict);
+    bc->dict_ = std::move(dict);
+    return bc;
+  }
 
-  std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const override {
-    return compress(data);
+  void compress_into(const std::vector<uint8_t>& data,
+                     std::vector<uint8_t>& out) const override {
+    compress_parallel_into(data, out, 1);
   }
 
+  void compress_parallel_into(const std::vector<uint8_t>& data,
+                              std::vector<uint8_t>& out,
+                              size_t num_threads) const override;
+
   compression_type type() const override { return compression_type::ZSTD; }
 
  private:
@@ -434,20 +587,90 @@ class zstd_block_compressor final : public block_compressor::impl {
   static std::mutex s_mx;
   static std::weak_ptr<context_manager> s_ctxmgr;
 
+  void compress_seekable(const std::vector<uint8_t>& data,
+                         std::vector<uint8_t>& out, size_t num_threads) const;
+
+  size_t compress_frame(ZSTD_CCtx* ctx, uint8_t* dst, size_t capacity,
+                        uint8_t const* src, size_t size,
+                        size_t num_threads) const {
+    if (long_bits_ > 0 || mt_) {
+      return compress_frame_advanced(ctx, dst, capacity, src, size,
+                                     num_threads);
+    }
+    return cdict_ ? ZSTD_compress_usingCDict(ctx, dst, capacity, src, size,
+                                             cdict_.get())
+                  : ZSTD_compressCCtx(ctx, dst, capacity, src, size, level_);
+  }
+
+  // Long distance matching with a window of 2^long_bits_ bytes, so that
+  // repetitions far apart in a large block are still found, and/or
+  // compression using zstd's worker threads. zstd produces the same
+  // output for any number of workers, as long as there is at least one.
+  size_t
+  compress_frame_advanced(ZSTD_CCtx* ctx, uint8_t* dst, size_t capacity,
+                          uint8_t const* src, size_t size,
+                          size_t num_threads) const {
+    // contexts are shared, so start from a clean slate every time
+    ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+
+    std::vector<std::pair<ZSTD_cParameter, int>> params{
+        {ZSTD_c_compressionLevel, level_},
+    };
+
+    if (long_bits_ > 0) {
+      params.emplace_back(ZSTD_c_enableLongDistanceMatching, 1);
+      params.emplace_back(ZSTD_c_windowLog, static_cast<int>(long_bits_));
+    }
+
+    if (mt_) {
+      params.emplace_back(ZSTD_c_nbWorkers,
+                          static_cast<int>(std::max<size_t>(num_threads, 1)));
+    }
+
+    for (auto [param, value] : params) {
+      if (auto rv = ZSTD_CCtx_setParameter(ctx, param, value);
+          ZSTD_isError(rv)) {
+        return rv;
+      }
+    }
+
+    if (cdict_) {
+      if (auto rv = ZSTD_CCtx_refCDict(ctx, cdict_.get()); ZSTD_isError(rv)) {
+        return rv;
+      }
+    }
+
+    auto rv = ZSTD_compress2(ctx, dst, capacity, src, size);
+
+    ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+
+    return rv;
+  }
+
   std::shared_ptr<context_manager> ctxmgr_;
   const int level_;
+  const unsigned frame_bits_;
+  const unsigned long_bits_;
+  const bool mt_;
+  std::shared_ptr<compression_dictionary const> dict_;
+  std::shared_ptr<ZSTD_CDict> cdict_;
 };
 
 std::mutex zstd_block_compressor::s_mx;
 std::weak_ptr<zstd_block_compressor::context_manager>
     zstd_block_compressor::s_ctxmgr;
 
-std::vector<uint8_t>
-zstd_block_compressor::compress(const std::vector<uint8_t>& data) const {
-  std::vector<uint8_t> compressed(ZSTD_compressBound(data.size()));
+void zstd_block_compressor::compress_parallel_into(
+    const std::vector<uint8_t>& data, std::vector<uint8_t>& out,
+    size_t num_threads) const {
+  if (frame_bits_ > 0 && data.size() > (size_t(1) << frame_bits_)) {
+    compress_seekable(data, out, num_threads);
+    return;
+  }
+  out.resize(ZSTD_compressBound(data.size()));
   scoped_context ctx(*ctxmgr_);
-  auto size = ZSTD_compressCCtx(ctx.get(), compressed.data(), compressed.size(),
-                                data.data(), data.size(), level_);
+  auto size = compress_frame(ctx.get(), out.data(), out.size(), data.data(),
+                             data.size(), num_threads);
   if (ZSTD_isError(size)) {
     DWARFS_THROW(runtime_error,
                  fmt::format("ZSTD: {}", ZSTD_getErrorName(size)));
@@ -455,11 +678,136 @@ zstd_block_compressor::compress(const std::vector<uint8_t>& data) const {
   if (size >= data.size()) {
     throw bad_compression_ratio_error();
   }
-  compressed.resize(size);
+  out.resize(size);
+}
+
+/**
+ * Compress data as a sequence of independent zstd frames followed by a
+ * seek table in the zstd seekable format, so that each frame can later
+ * be decompressed on its own.
+ */
+void zstd_block_compressor::compress_seekable(const std::vector<uint8_t>& data,
+                                              std::vector<uint8_t>& out,
+                                              size_t num_threads) const {
+  size_t const frame_size = size_t(1) << frame_bits_;
+  size_t const num_frames = (data.size() + frame_size - 1) / frame_size;
+  size_t const table_size = zstd_seek_table_size(num_frames);
+
+  auto& compressed = out;
+  compressed.resize(num_frames * ZSTD_compressBound(frame_size) + table_size);
+  std::vector<std::pair<uint32_t, uint32_t>> frames;
+  frames.reserve(num_frames);
+
+  scoped_context ctx(*ctxmgr_);
+  size_t pos = 0;
+
+  for (size_t offset = 0; offset < data.size(); offset += frame_size) {
+    auto len = std::min(frame_size, data.size() - offset);
+    auto size = compress_frame(ctx.get(), compressed.data() + pos,
+                               compressed.size() - pos, data.data() + offset,
+                               len, num_threads);
+    if (ZSTD_isError(size)) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("ZSTD: {}", ZSTD_getErrorName(size)));
+    }
+    frames.emplace_back(size, len);
+    pos += size;
+  }
+
+  if (pos + table_size >= data.size()) {
+    throw bad_compression_ratio_error();
+  }
+
+  auto put32 = [&](uint32_t value) {
+    folly::storeUnaligned(compressed.data() + pos, folly::Endian::little(value));
+    pos += sizeof(uint32_t);
+  };
+
+  put32(ZSTD_MAGIC_SKIPPABLE_START | 0xE);
+  put32(table_size - kZstdSkippableHeaderSize);
+  for (auto const& [comp, uncomp] : frames) {
+    put32(comp);
+    put32(uncomp);
+  }
+  put32(num_frames);
+  compressed[pos++] = 0; // seek table descriptor: no checksums
+  put32(kZstdSeekableMagic);
+
+  compressed.resize(pos);
+}
+#endif
+
+std::vector<uint8_t>
+block_compressor::impl::compress(const std::vector<uint8_t>& data) const {
+  std::vector<uint8_t> compressed;
+  compress_into(data, compressed);
   compressed.shrink_to_fit();
   return compressed;
 }
+
+std::vector<uint8_t>
+block_compressor::impl::compress(std::vector<uint8_t>&& data) const {
+  return compress(data);
+}
+
+void block_compressor::impl::compress_parallel_into(
+    const std::vector<uint8_t>& data, std::vector<uint8_t>& out,
+    size_t /*num_threads*/) const {
+  compress_into(data, out);
+}
+
+std::unique_ptr<block_compressor::impl> block_compressor::impl::with_dictionary(
+    std::shared_ptr<compression_dictionary const> /*dict*/) const {
+  DWARFS_THROW(runtime_error,
+               "compression does not support dictionaries: " +
+                   get_compression_name(type()));
+}
+
+class compression_dictionary::impl {
+ public:
+#ifdef DWARFS_HAVE_LIBZSTD
+  explicit impl(std::vector<uint8_t> const& data)
+      : ddict_{ZSTD_createDDict(data.data(), data.size())} {
+    if (!ddict_) {
+      DWARFS_THROW(runtime_error, "ZSTD: failed to load dictionary");
+    }
+  }
+
+  ~impl() { ZSTD_freeDDict(ddict_); }
+
+  ZSTD_DDict const* zstd_ddict() const { return ddict_; }
+
+ private:
+  ZSTD_DDict* ddict_;
+#else
+  explicit impl(std::vector<uint8_t> const&) {}
+#endif
+};
+
+compression_dictionary::compression_dictionary(std::vector<uint8_t> data)
+    : data_{std::move(data)}
+    , impl_{std::make_unique<impl>(data_)} {}
+
+compression_dictionary::~compression_dictionary() = default;
+
+std::vector<uint8_t>
+compression_dictionary::train(std::vector<uint8_t> const& samples,
+                              std::vector<size_t> const& sample_sizes,
+                              size_t max_size) {
+#ifdef DWARFS_HAVE_LIBZSTD
+  std::vector<uint8_t> dict(max_size);
+  auto size = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(),
+                                    sample_sizes.data(), sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    DWARFS_THROW(runtime_error, fmt::format("ZSTD: dictionary training: {}",
+                                            ZDICT_getErrorName(size)));
+  }
+  dict.resize(size);
+  return dict;
+#else
+  DWARFS_THROW(runtime_error, "dictionary training requires zstd support");
 #endif
+}
 
 block_compressor::block_compressor(const std::string& spec) {
   option_map om(spec);
@@ -470,7 +818,8 @@ block_compressor::block_compressor(const std::string& spec) {
   } else if (om.choice() == "lzma") {
     impl_ = std::make_unique<lzma_block_compressor>(
         om.get<unsigned>("level", 9u), om.get<bool>("extreme", false),
-        om.get<std::string>("binary"), om.get<unsigned>("dict_size", 0u));
+        om.get<std::string>("binary"), om.get<unsigned>("dict_size", 0u),
+        om.get<unsigned>("block_bits", 0u));
 #endif
 #ifdef DWARFS_HAVE_LIBLZ4
   } else if (om.choice() == "lz4") {
@@ -482,7 +831,9 @@ block_compressor::block_compressor(const std::string& spec) {
 #ifdef DWARFS_HAVE_LIBZSTD
   } else if (om.choice() == "zstd") {
     impl_ = std::make_unique<zstd_block_compressor>(
-        om.get<int>("level", ZSTD_maxCLevel()));
+        om.get<int>("level", ZSTD_maxCLevel()),
+        om.get<unsigned>("frame_bits", 0u), om.get<unsigned>("long", 0u),
+        om.get<bool>("mt", false));
 #endif
   } else {
     DWARFS_THROW(runtime_error, "unknown compression: " + om.choice());
@@ -678,11 +1029,18 @@ class lz4_block_decompressor final : public block_decompressor::impl {
 class zstd_block_decompressor final : public block_decompressor::impl {
  public:
   zstd_block_decompressor(const uint8_t* data, size_t size,
-                          std::vector<uint8_t>& target)
+                          std::vector<uint8_t>& target,
+                          compression_dictionary const* dict)
       : decompressed_(target)
       , data_(data)
       , size_(size)
-      , uncompressed_size_(ZSTD_getDecompressedSize(data, size)) {
+      , ddict_(dict ? dict->get_impl().zstd_ddict() : nullptr)
+      , frames_(parse_zstd_seek_table(data, size))
+      , frame_done_(frames_.size(), false)
+      , uncompressed_size_(frames_.empty()
+                               ? ZSTD_getDecompressedSize(data, size)
+                               : frames_.back().uncomp_offset +
+                                     frames_.back().uncomp_size) {
     try {
       decompressed_.reserve(uncompressed_size_);
     } catch (std::bad_alloc const&) {
@@ -695,30 +1053,190 @@ class zstd_block_decompressor final : public block_decompressor::impl {
 
   compression_type type() const override { return compression_type::ZSTD; }
 
-  bool decompress_frame(size_t /*frame_size*/) override {
+  bool decompress_frame(size_t frame_size) override {
     if (!error_.empty()) {
       DWARFS_THROW(runtime_error, error_);
     }
 
-    decompressed_.resize(uncompressed_size_);
-    auto rv = ZSTD_decompress(decompressed_.data(), decompressed_.size(), data_,
-                              size_);
+    if (!frames_.empty()) {
+      for (size_t i = 0; i < frames_.size(); ++i) {
+        decompress_seekable_frame(i);
+      }
+      return true;
+    }
+
+    if (!dstream_) {
+      dstream_.reset(ZSTD_createDStream());
+      // blocks compressed with a long window exceed the default limit
+      ZSTD_DCtx_setParameter(
+          dstream_.get(), ZSTD_d_windowLogMax,
+          ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+      if (ddict_) {
+        ZSTD_DCtx_refDDict(dstream_.get(), ddict_);
+      }
+      input_ = ZSTD_inBuffer{data_, size_, 0};
+    }
+
+    size_t offset = decompressed_.size();
+    frame_size = std::min(frame_size, uncompressed_size_ - offset);
+
+    // capacity has been reserved up front, so this won't reallocate
+    decompressed_.resize(offset + frame_size);
+
+    ZSTD_outBuffer output{decompressed_.data() + offset, frame_size, 0};
+
+    while (output.pos < output.size) {
+      auto const in_pos = input_.pos;
+      auto const out_pos = output.pos;
+      auto rv = ZSTD_decompressStream(dstream_.get(), &output, &input_);
+
+      if (ZSTD_isError(rv)) {
+        decompressed_.clear();
+        error_ = fmt::format("ZSTD: {}", ZSTD_getErrorName(rv));
+        DWARFS_THROW(runtime_error, error_);
+      }
+
+      if (rv == 0 || (input_.pos == in_pos && output.pos == out_pos)) {
+        break;
+      }
+    }
 
-    if (ZSTD_isError(rv)) {
+    if (output.pos != output.size) {
       decompressed_.clear();
-      error_ = fmt::format("ZSTD: {}", ZSTD_getErrorName(rv));
+      error_ = "ZSTD: unexpected end of frame";
       DWARFS_THROW(runtime_error, error_);
     }
 
-    return true;
+    if (decompressed_.size() == uncompressed_size_) {
+      dstream_.reset();
+      return true;
+    }
+
+    return false;
   }
 
   size_t uncompressed_size() const override { return uncompressed_size_; }
 
+  std::vector<size_t> seekable_frames() const override {
+    std::vector<size_t> ends;
+    ends.reserve(frames_.size());
+    for (auto const& f : frames_) {
+      ends.push_back(f.uncomp_offset + f.uncomp_size);
+    }
+    return ends;
+  }
+
+  void decompress_seekable_frame(size_t index) override {
+    if (!error_.empty()) {
+      DWARFS_THROW(runtime_error, error_);
+    }
+
+    if (frame_done_.at(index)) {
+      return;
+    }
+
+    // frames may be decompressed out of order, so the target has to be
+    // sized up front; it won't ever be reallocated after this
+    if (decompressed_.size() != uncompressed_size_) {
+      decompressed_.resize(uncompressed_size_);
+    }
+
+    auto const& f = frames_[index];
+    auto rv = decompress(decompressed_.data() + f.uncomp_offset,
+                         f.uncomp_size, data_ + f.comp_offset, f.comp_size);
+
+    if (ZSTD_isError(rv) || rv != f.uncomp_size) {
+      decompressed_.clear();
+      error_ = ZSTD_isError(rv)
+                   ? fmt::format("ZSTD: {}", ZSTD_getErrorName(rv))
+                   : fmt::format("ZSTD: frame {} size mismatch", index);
+      DWARFS_THROW(runtime_error, error_);
+    }
+
+    frame_done_[index] = true;
+  }
+
+  void decompress_all(size_t num_threads) override {
+    if (frames_.size() < 2 || num_threads < 2) {
+      decompress_frame(uncompressed_size_);
+      return;
+    }
+
+    if (!error_.empty()) {
+      DWARFS_THROW(runtime_error, error_);
+    }
+
+    decompressed_.resize(uncompressed_size_);
+
+    // the frames are written to disjoint parts of the target, so the
+    // threads don't need to synchronize beyond picking the next frame
+    std::vector<size_t> results(frames_.size());
+    std::atomic<size_t> next{0};
+
+    auto worker = [&] {
+      for (size_t i; (i = next++) < frames_.size();) {
+        auto const& f = frames_[i];
+        results[i] = frame_done_[i]
+                         ? f.uncomp_size
+                         : decompress(decompressed_.data() + f.uncomp_offset,
+                                      f.uncomp_size, data_ + f.comp_offset,
+                                      f.comp_size);
+      }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (size_t i = 1; i < std::min(num_threads, frames_.size()); ++i) {
+      threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    for (size_t i = 0; i < frames_.size(); ++i) {
+      auto rv = results[i];
+      if (ZSTD_isError(rv) || rv != frames_[i].uncomp_size) {
+        decompressed_.clear();
+        error_ = ZSTD_isError(rv)
+                     ? fmt::format("ZSTD: {}", ZSTD_getErrorName(rv))
+                     : fmt::format("ZSTD: frame {} size mismatch", i);
+        DWARFS_THROW(runtime_error, error_);
+      }
+      frame_done_[i] = true;
+    }
+  }
+
  private:
+  size_t
+  decompress(uint8_t* dst, size_t capacity, uint8_t const* src, size_t size) {
+    // creating a context for each frame is expensive, especially with a
+    // dictionary, so every thread reuses its own
+    thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(
+        ZSTD_createDCtx(), ZSTD_freeDCtx);
+
+    if (!ddict_) {
+      return ZSTD_decompressDCtx(ctx.get(), dst, capacity, src, size);
+    }
+
+    return ZSTD_decompress_usingDDict(ctx.get(), dst, capacity, src, size,
+                                      ddict_);
+  }
+
+  struct dstream_deleter {
+    void operator()(ZSTD_DStream* ds) const { ZSTD_freeDStream(ds); }
+  };
+
   std::vector<uint8_t>& decompressed_;
   const uint8_t* const data_;
   const size_t size_;
+  ZSTD_DDict const* const ddict_;
+  std::unique_ptr<ZSTD_DStream, dstream_deleter> dstream_;
+  ZSTD_inBuffer input_{nullptr, 0, 0};
+  const std::vector<zstd_seekable_frame> frames_;
+  std::vector<bool> frame_done_;
   const size_t uncompressed_size_;
   std::string error_;
 };
@@ -788,7 +1306,8 @@ size_t lzma_block_decompressor::get_uncompressed_size(const uint8_t* data,
 
 block_decompressor::block_decompressor(compression_type type,
                                        const uint8_t* data, size_t size,
-                                       std::vector<uint8_t>& target) {
+                                       std::vector<uint8_t>& target,
+                                       compression_dictionary const* dict) {
   switch (type) {
   case compression_type::NONE:
     impl_ = std::make_unique<null_block_decompressor>(data, size, target);
@@ -809,7 +1328,7 @@ block_decompressor::block_decompressor(compression_type type,
 
 #ifdef DWARFS_HAVE_LIBZSTD
   case compression_type::ZSTD:
-    impl_ = std::make_unique<zstd_block_decompressor>(data, size, target);
+    impl_ = std::make_unique<zstd_block_decompressor>(data, size, target, dict);
     break;
 #endif
 
@@ -20,31 +20,32 @@
  */
 
 #include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <optional>
 #include <string>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
-#include <boost/align.hpp>
-
 #include <fmt/format.h>
 
 #include <parallel_hashmap/phmap.h>
 
 #include <folly/hash/Hash.h>
-#include <folly/small_vector.h>
-#include <folly/stats/Histogram.h>
 
 #include "dwarfs/block_data.h"
 #include "dwarfs/block_manager.h"
+#include "dwarfs/block_manager_detail.h"
+#include "dwarfs/checksum.h"
 #include "dwarfs/compiler.h"
 #include "dwarfs/cyclic_hash.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fstypes.h"
 #include "dwarfs/inode.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/mmif.h"
@@ -75,153 +76,90 @@ namespace dwarfs {
  *
  * A single window size is sufficient. That window size should still be
  * configurable.
+ *
+ * Alternatively, in content-defined chunking mode, files are cut into
+ * chunks at positions determined by a gear hash (FastCDC). Each chunk that
+ * ends up entirely within a single block is recorded in a global index by
+ * its checksum, so repeated chunks can be found across the whole input
+ * using memory proportional to the number of chunks.
  */
 
-struct bm_stats {
-  bm_stats()
-      : l2_collision_vec_size(1, 0, 128) {}
-
-  size_t total_hashes{0};
-  size_t l2_collisions{0};
-  size_t total_matches{0};
-  size_t good_matches{0};
-  size_t bad_matches{0};
-  size_t bloom_lookups{0};
-  size_t bloom_hits{0};
-  size_t bloom_true_positives{0};
-  folly::Histogram<size_t> l2_collision_vec_size;
-};
-
-template <typename KeyT, typename ValT, size_t MaxCollInline = 2>
-class fast_multimap {
- private:
-  using collision_vector = folly::small_vector<ValT, MaxCollInline>;
-  using blockhash_t = phmap::flat_hash_map<KeyT, ValT>;
-  using collision_t = phmap::flat_hash_map<KeyT, collision_vector>;
-
- public:
-  void insert(KeyT const& key, ValT const& val) {
-    if (DWARFS_UNLIKELY(!values_.insert(std::make_pair(key, val)).second)) {
-      collisions_[key].emplace_back(val);
-    }
-  }
+namespace {
 
-  template <typename F>
-  void for_each_value(KeyT const& key, F&& func) const {
-    if (auto it = values_.find(key); DWARFS_UNLIKELY(it != values_.end())) {
-      func(it->second);
-      if (auto it2 = collisions_.find(key);
-          DWARFS_UNLIKELY(it2 != collisions_.end())) {
-        for (auto const& val : it2->second) {
-          func(val);
-        }
-      }
-    }
-  }
+constexpr std::array<uint64_t, 256> make_gear_table() {
+  std::array<uint64_t, 256> table{};
+  uint64_t x = 0;
 
-  void clear() {
-    values_.clear();
-    collisions_.clear();
+  for (auto& v : table) {
+    // splitmix64
+    x += UINT64_C(0x9e3779b97f4a7c15);
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    v = z ^ (z >> 31);
   }
 
-  blockhash_t const& values() const { return values_; };
-  collision_t const& collisions() const { return collisions_; };
-
- private:
-  blockhash_t values_;
-  collision_t collisions_;
-};
-
-constexpr unsigned bitcount(unsigned n) {
-  return n > 0 ? (n & 1) + bitcount(n >> 1) : 0;
+  return table;
 }
 
-constexpr uint64_t pow2ceil(uint64_t n) {
-  n--;
-  n |= n >> 1;
-  n |= n >> 2;
-  n |= n >> 4;
-  n |= n >> 8;
-  n |= n >> 16;
-  n |= n >> 32;
-  n++;
-  return n;
-}
+constexpr auto gear_table = make_gear_table();
 
-/**
- * A very simple bloom filter. This is not generalized at all and highly
- * optimized for the cyclic hash use case.
- *
- * - Since we're already using a hash value, there's no need to hash the
- *   value before accessing the bloom filter bit field.
- *
- * - We can accept a high false positive rate as the secondary lookup
- *   is not very expensive. However, the bloom filter lookup must be
- *   extremely cheap, so we can't afford e.g. using two hashes instead
- *   of one.
- */
-class bloom_filter {
+class fastcdc {
  public:
-  using bits_type = uint64_t;
+  explicit fastcdc(unsigned avg_bits)
+      : min_size_{static_cast<size_t>(1) << (avg_bits - 2)}
+      , avg_size_{static_cast<size_t>(1) << avg_bits}
+      , max_size_{static_cast<size_t>(1) << (avg_bits + 3)}
+      , mask_s_{top_bits(avg_bits + 1)}
+      , mask_l_{top_bits(avg_bits - 1)} {}
+
+  // returns the size of the next chunk starting at p
+  size_t cut(uint8_t const* p, size_t size) const {
+    if (size <= min_size_) {
+      return size;
+    }
 
-  static constexpr size_t value_mask = 8 * sizeof(bits_type) - 1;
-  static constexpr size_t index_shift = bitcount(value_mask);
-  static constexpr size_t alignment = 64;
+    size = std::min(size, max_size_);
 
-  bloom_filter(size_t size)
-      : index_mask_{(std::max(size, value_mask + 1) >> index_shift) - 1}
-      , size_{std::max(size, value_mask + 1)} {
-    if (size & (size - 1)) {
-      throw std::runtime_error("size must be a power of two");
-    }
-    bits_ = reinterpret_cast<bits_type*>(
-        boost::alignment::aligned_alloc(alignment, size_ / 8));
-    if (!bits_) {
-      throw std::runtime_error("failed to allocate aligned memory");
+    auto const normal = std::min(size, avg_size_);
+    uint64_t fp = 0;
+    size_t i = min_size_;
+
+    for (; i < normal; ++i) {
+      fp = (fp << 1) + gear_table[p[i]];
+      if (!(fp & mask_s_)) {
+        return i + 1;
+      }
     }
-    clear();
-  }
 
-  ~bloom_filter() { boost::alignment::aligned_free(bits_); }
+    for (; i < size; ++i) {
+      fp = (fp << 1) + gear_table[p[i]];
+      if (!(fp & mask_l_)) {
+        return i + 1;
+      }
+    }
 
-  void add(size_t ix) {
-    auto bits = bits_;
-    BOOST_ALIGN_ASSUME_ALIGNED(bits, sizeof(bits_type));
-    bits[(ix >> index_shift) & index_mask_] |= static_cast<bits_type>(1)
-                                               << (ix & value_mask);
+    return size;
   }
 
-  bool test(size_t ix) const {
-    auto bits = bits_;
-    BOOST_ALIGN_ASSUME_ALIGNED(bits, sizeof(bits_type));
-    return bits[(ix >> index_shift) & index_mask_] &
-           (static_cast<bits_type>(1) << (ix & value_mask));
+  size_t min_size() const { return min_size_; }
+
+ private:
+  static constexpr uint64_t top_bits(unsigned bits) {
+    return ~UINT64_C(0) << (64 - bits);
   }
 
-  // size in bits
-  size_t size() const { return size_; }
+  size_t const min_size_;
+  size_t const avg_size_;
+  size_t const max_size_;
+  uint64_t const mask_s_;
+  uint64_t const mask_l_;
+};
 
-  void clear() { std::fill(begin(), end(), 0); }
+} // namespace
 
-  void merge(bloom_filter const& other) {
-    if (size() != other.size()) {
-      throw std::runtime_error("size mismatch");
-    }
-    std::transform(cbegin(), cend(), other.cbegin(), begin(), std::bit_or<>{});
-  }
+using bm_stats = progress::segmenter_stats;
 
- private:
-  bits_type const* cbegin() const { return bits_; }
-  bits_type const* cend() const { return bits_ + (size_ >> index_shift); }
-  bits_type const* begin() const { return bits_; }
-  bits_type const* end() const { return bits_ + (size_ >> index_shift); }
-  bits_type* begin() { return bits_; }
-  bits_type* end() { return bits_ + (size_ >> index_shift); }
-
-  bits_type* bits_;
-  size_t const index_mask_;
-  size_t const size_;
-} __attribute__((aligned(64)));
 
 class active_block {
  private:
@@ -236,6 +174,7 @@ class active_block {
       , window_size_(window_size)
       , window_step_mask_(window_step - 1)
       , filter_(bloom_filter_size)
+      , offsets_(window_size > 0 ? size / window_step : 0)
       , data_{std::make_shared<block_data>()} {
     DWARFS_CHECK((window_step & window_step_mask_) == 0,
                  "window step size not a power of two");
@@ -267,23 +206,25 @@ class active_block {
   }
 
   void finalize(bm_stats& stats) {
-    stats.total_hashes += offsets_.values().size();
-    for (auto& c : offsets_.collisions()) {
-      stats.total_hashes += c.second.size();
-      stats.l2_collisions += c.second.size() - 1;
-      stats.l2_collision_vec_size.addValue(c.second.size());
-    }
+    stats.total_hashes += offsets_.size();
+    stats.duplicate_hashes += offsets_.duplicates();
+    stats.total_probes += offsets_.total_probes();
+    stats.max_probes = std::max(stats.max_probes, offsets_.max_probes());
   }
 
   bloom_filter const& filter() const { return filter_; }
 
- private:
-  static constexpr size_t num_inline_offsets = 4;
+  // the data is only touched as the block is filled, so it's fine for
+  // this to be accounted for after construction
+  size_t memory_usage() const {
+    return capacity_ + offsets_.memory_usage() + filter_.size() / 8;
+  }
 
+ private:
   size_t num_, capacity_, window_size_, window_step_mask_;
   rsync_hash hasher_;
   bloom_filter filter_;
-  fast_multimap<hash_t, offset_t, num_inline_offsets> offsets_;
+  offset_table<hash_t, offset_t> offsets_;
   std::shared_ptr<block_data> data_;
 };
 
@@ -291,23 +232,35 @@ template <typename LoggerPolicy>
 class block_manager_ final : public block_manager::impl {
  public:
   block_manager_(logger& lgr, progress& prog, const block_manager::config& cfg,
-                 std::shared_ptr<os_access> os, filesystem_writer& fsw)
+                 std::shared_ptr<os_access> os,
+                 block_manager::block_writer writer)
       : LOG_PROXY_INIT(lgr)
       , prog_{prog}
       , cfg_{cfg}
       , os_{std::move(os)}
-      , fsw_{fsw}
+      , writer_{std::move(writer)}
       , window_size_{window_size(cfg)}
       , window_step_{window_step(cfg)}
       , block_size_{block_size(cfg)}
       , filter_{bloom_filter_size(cfg)} {
-    if (segmentation_enabled()) {
+    if (cfg.cdc_chunk_bits > 0) {
+      DWARFS_CHECK(cfg.cdc_chunk_bits >= 8 &&
+                       cfg.cdc_chunk_bits + 3 <= cfg.block_size_bits,
+                   "invalid content-defined chunk size");
+      cdc_.emplace(cfg.cdc_chunk_bits);
+      LOG_INFO << "using content-defined chunking with an average chunk size"
+               << " of " << size_with_unit(1 << cfg.cdc_chunk_bits);
+    } else if (segmentation_enabled()) {
       LOG_INFO << "using a " << size_with_unit(window_size_) << " window at "
                << size_with_unit(window_step_) << " steps for segment analysis";
       LOG_INFO << "bloom filter size: " << size_with_unit(filter_.size() / 8);
     }
+
+    charge_memory(filter_.size() / 8);
   }
 
+  ~block_manager_() override { release_memory(mem_charged_); }
+
   void add_inode(std::shared_ptr<inode> ino) override;
   void finish_blocks() override;
 
@@ -317,15 +270,30 @@ class block_manager_ final : public block_manager::impl {
     size_t size{0};
   };
 
+  struct cdc_location {
+    uint32_t block;
+    uint32_t offset;
+  };
+
+  using cdc_key = std::pair<uint64_t, uint64_t>;
+
   bool segmentation_enabled() const {
     return cfg_.max_active_blocks > 0 and window_size_ > 0;
   }
 
+  bool cdc_enabled() const { return cdc_.has_value(); }
+
   void block_ready();
   void finish_chunk(inode& ino);
+  void charge_memory(size_t size, bool blocking = false);
+  void release_memory(size_t size);
   void append_to_block(inode& ino, mmif& mm, size_t offset, size_t size);
   void add_data(inode& ino, mmif& mm, size_t offset, size_t size);
-  void segment_and_add_data(inode& ino, mmif& mm, size_t size);
+  void release_input(mmif& mm, size_t offset);
+  void add_range(inode& ino, mmif& mm, size_t begin, size_t end);
+  void add_hole(inode& ino, size_t size);
+  void segment_and_add_data(inode& ino, mmif& mm, size_t begin, size_t end);
+  void cdc_add_data(inode& ino, mmif& mm, size_t begin, size_t end);
 
   static size_t bloom_filter_size(const block_manager::config& cfg) {
     auto hash_count = pow2ceil(std::max<size_t>(1, cfg.max_active_blocks)) *
@@ -351,19 +319,26 @@ class block_manager_ final : public block_manager::impl {
   progress& prog_;
   const block_manager::config& cfg_;
   std::shared_ptr<os_access> os_;
-  filesystem_writer& fsw_;
+  block_manager::block_writer writer_;
 
   size_t const window_size_;
   size_t const window_step_;
   size_t const block_size_;
-  size_t block_count_{0};
+  size_t block_count_{cfg_.first_block};
+
+  static constexpr size_t kInputReleaseStep{4 << 20};
 
   chunk_state chunk_;
+  size_t input_released_{0};
+  size_t mem_charged_{0};
 
   bloom_filter filter_;
 
   bm_stats stats_;
 
+  std::optional<fastcdc> cdc_;
+  phmap::flat_hash_map<cdc_key, cdc_location> cdc_index_;
+
   // Active blocks are blocks that can still be referenced from new chunks.
   // Up to N blocks (configurable) can be active and are kept in this queue.
   // All active blocks except for the last one are immutable and potentially
@@ -431,26 +406,12 @@ void segment_match::verify_and_extend(uint8_t const* pos, size_t len,
                                       uint8_t const* begin,
                                       uint8_t const* end) {
   auto const& v = block_->data()->vec();
+  size_t off = offset_;
 
-  if (::memcmp(v.data() + offset_, pos, len) == 0) {
-    // scan backward
-    auto tmp = offset_;
-    while (tmp > 0 && pos > begin && v[tmp - 1] == pos[-1]) {
-      --tmp;
-      --pos;
-    }
-    len += offset_ - tmp;
-    offset_ = tmp;
+  if (auto size = extend_match(v.data(), v.size(), off, pos, len, begin, end)) {
+    offset_ = off;
+    size_ = size;
     data_ = pos;
-
-    // scan forward
-    pos += len;
-    tmp = offset_ + len;
-    while (tmp < v.size() && pos < end && v[tmp] == *pos) {
-      ++tmp;
-      ++pos;
-    }
-    size_ = tmp - offset_;
   }
 }
 
@@ -458,19 +419,79 @@ template <typename LoggerPolicy>
 void block_manager_<LoggerPolicy>::add_inode(std::shared_ptr<inode> ino) {
   auto e = ino->any();
 
-  if (size_t size = e->size(); size > 0) {
+  // fragments only cover part of the file
+  size_t const begin = ino->fragment_offset();
+  size_t const end = begin + ino->size();
+
+  if (size_t size = e->size(); end > begin) {
     auto mm = os_->map_file(e->path(), size);
 
+    if (auto ec = mm->advise_sequential(begin, end - begin)) {
+      LOG_DEBUG << "madvise(MADV_SEQUENTIAL) failed: " << ec.message();
+    }
+
+    input_released_ = begin;
+
     LOG_TRACE << "adding inode " << ino->num() << " [" << ino->any()->name()
-              << "] - size: " << size;
+              << "] - size: " << size << ", range: [" << begin << ", " << end
+              << ")";
 
-    if (!segmentation_enabled() or size < window_size_) {
-      // no point dealing with hashing, just write it out
-      add_data(*ino, *mm, 0, size);
-      finish_chunk(*ino);
-    } else {
-      segment_and_add_data(*ino, *mm, size);
+    if (!cfg_.detect_holes) {
+      add_range(*ino, *mm, begin, end);
+      return;
+    }
+
+    size_t pos = begin;
+
+    for (auto const& [offset, length] : os_->data_extents(e->path(), size)) {
+      auto const first = std::max<size_t>(offset, begin);
+      auto const last = std::min<size_t>(offset + length, end);
+      if (first >= last) {
+        continue;
+      }
+      if (first > pos) {
+        add_hole(*ino, first - pos);
+      }
+      add_range(*ino, *mm, first, last);
+      pos = last;
     }
+
+    if (pos < end) {
+      add_hole(*ino, end - pos);
+    }
+  }
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::add_range(inode& ino, mmif& mm,
+                                             size_t begin, size_t end) {
+  if (cdc_enabled()) {
+    cdc_add_data(ino, mm, begin, end);
+  } else if (!segmentation_enabled() or end - begin < window_size_) {
+    // no point dealing with hashing, just write it out
+    add_data(ino, mm, begin, end - begin);
+    finish_chunk(ino);
+  } else {
+    segment_and_add_data(ino, mm, begin, end);
+  }
+}
+
+/**
+ * Add a hole, which is stored as chunks that don't reference any block
+ */
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::add_hole(inode& ino, size_t size) {
+  static constexpr size_t kMaxHoleChunk{size_t(1) << 31};
+
+  LOG_TRACE << "adding hole of " << size << " bytes to inode " << ino.num();
+
+  prog_.saved_by_holes += size;
+
+  while (size > 0) {
+    auto len = std::min(size, kMaxHoleChunk);
+    ino.add_chunk(HOLE_BLOCK, 0, len);
+    prog_.chunk_count++;
+    size -= len;
   }
 }
 
@@ -480,7 +501,9 @@ void block_manager_<LoggerPolicy>::finish_blocks() {
     block_ready();
   }
 
-  auto l1_collisions = stats_.l2_collision_vec_size.computeTotalCount();
+  // nothing can reference the active blocks anymore
+  blocks_.clear();
+  release_memory(mem_charged_);
 
   if (stats_.bloom_lookups > 0) {
     LOG_INFO << "bloom filter reject rate: "
@@ -491,37 +514,51 @@ void block_manager_<LoggerPolicy>::finish_blocks() {
                                            stats_.bloom_hits)
              << ", lookups=" << stats_.bloom_lookups << ")";
   }
+  if (stats_.cdc_chunks > 0) {
+    LOG_INFO << "content-defined chunks: " << stats_.cdc_chunks
+             << ", matches: " << stats_.cdc_matches
+             << ", index size: " << cdc_index_.size();
+  }
   if (stats_.total_matches > 0) {
     LOG_INFO << "segmentation matches: good=" << stats_.good_matches
              << ", bad=" << stats_.bad_matches
              << ", total=" << stats_.total_matches;
   }
   if (stats_.total_hashes > 0) {
-    LOG_INFO << "segmentation collisions: L1="
-             << fmt::format("{:.3f}%",
-                            100.0 * (l1_collisions + stats_.l2_collisions) /
-                                stats_.total_hashes)
-             << ", L2="
-             << fmt::format("{:.3f}%",
-                            100.0 * stats_.l2_collisions / stats_.total_hashes)
+    LOG_INFO << "segmentation collisions: "
+             << fmt::format("{:.3f}%", 100.0 * stats_.duplicate_hashes /
+                                           stats_.total_hashes)
              << " [" << stats_.total_hashes << " hashes]";
+    LOG_DEBUG << "offset table probes: avg="
+              << fmt::format("{:.2f}", static_cast<double>(stats_.total_probes) /
+                                           stats_.total_hashes)
+              << ", max=" << stats_.max_probes;
   }
 
-  if (l1_collisions > 0) {
-    auto pct = [&](double p) {
-      return stats_.l2_collision_vec_size.getPercentileEstimate(p);
-    };
-    LOG_DEBUG << "collision vector size p50: " << pct(0.5)
-              << ", p75: " << pct(0.75) << ", p90: " << pct(0.9)
-              << ", p95: " << pct(0.95) << ", p99: " << pct(0.99);
+  prog_.add_segmenter_stats(stats_);
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::charge_memory(size_t size, bool blocking) {
+  if (blocking) {
+    prog_.memory.reserve(memory_stage::SEGMENTER, size);
+  } else {
+    prog_.memory.charge(memory_stage::SEGMENTER, size);
   }
+  mem_charged_ += size;
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::release_memory(size_t size) {
+  prog_.memory.release(memory_stage::SEGMENTER, size);
+  mem_charged_ -= size;
 }
 
 template <typename LoggerPolicy>
 void block_manager_<LoggerPolicy>::block_ready() {
   auto& block = blocks_.back();
   block.finalize(stats_);
-  fsw_.write_block(block.data());
+  writer_(block.num(), block.data());
   ++prog_.block_count;
 }
 
@@ -530,6 +567,7 @@ void block_manager_<LoggerPolicy>::append_to_block(inode& ino, mmif& mm,
                                                    size_t offset, size_t size) {
   if (DWARFS_UNLIKELY(blocks_.empty() or blocks_.back().full())) {
     if (blocks_.size() >= std::max<size_t>(1, cfg_.max_active_blocks)) {
+      release_memory(blocks_.front().memory_usage());
       blocks_.pop_front();
     }
 
@@ -541,6 +579,9 @@ void block_manager_<LoggerPolicy>::append_to_block(inode& ino, mmif& mm,
     blocks_.emplace_back(block_count_++, block_size_,
                          cfg_.max_active_blocks > 0 ? window_size_ : 0,
                          window_step_, filter_.size());
+
+    // wait for the writer to catch up if we're over the memory budget
+    charge_memory(blocks_.back().memory_usage(), true);
   }
 
   auto& block = blocks_.back();
@@ -551,7 +592,6 @@ void block_manager_<LoggerPolicy>::append_to_block(inode& ino, mmif& mm,
   prog_.filesystem_size += size;
 
   if (DWARFS_UNLIKELY(block.full())) {
-    mm.release_until(offset + size);
     finish_chunk(ino);
     block_ready();
   }
@@ -574,6 +614,26 @@ void block_manager_<LoggerPolicy>::add_data(inode& ino, mmif& mm, size_t offset,
     offset += chunk_size;
     size -= chunk_size;
   }
+
+  release_input(mm, offset);
+}
+
+/**
+ * Release the input mapping up to the given offset
+ *
+ * Nothing before the data most recently added to a block is ever looked
+ * at again, not even when extending matches backwards, so there's no
+ * point in keeping these pages mapped. This is done in larger steps to
+ * keep the number of system calls low.
+ */
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::release_input(mmif& mm, size_t offset) {
+  if (offset >= input_released_ + kInputReleaseStep) {
+    if (auto ec = mm.release(input_released_, offset - input_released_)) {
+      LOG_DEBUG << "madvise(MADV_DONTNEED) failed: " << ec.message();
+    }
+    input_released_ = offset;
+  }
 }
 
 template <typename LoggerPolicy>
@@ -589,37 +649,59 @@ void block_manager_<LoggerPolicy>::finish_chunk(inode& ino) {
 
 template <typename LoggerPolicy>
 void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
-                                                        size_t size) {
+                                                        size_t begin,
+                                                        size_t end) {
   rsync_hash hasher;
-  size_t offset = 0;
-  size_t written = 0;
+  size_t offset = begin;
+  size_t written = begin;
   size_t lookback_size = window_size_ + window_step_;
   size_t next_hash_offset =
-      lookback_size +
+      begin + lookback_size +
       (blocks_.empty() ? window_step_ : blocks_.back().next_hash_distance());
   auto p = mm.as<uint8_t>();
 
-  DWARFS_CHECK(size >= window_size_, "unexpected call to segment_and_add_data");
+  DWARFS_CHECK(end - begin >= window_size_,
+               "unexpected call to segment_and_add_data");
 
-  for (; offset < window_size_; ++offset) {
+  for (; offset < begin + window_size_; ++offset) {
     hasher.update(p[offset]);
   }
 
   std::vector<segment_match> matches;
   const bool single_block_mode = cfg_.max_active_blocks == 1;
 
-  while (offset < size) {
+  // Hashes are computed in batches, so the bloom filter lookups for the
+  // whole batch can be prefetched. Most lookups are misses, so without
+  // prefetching, the segmenter spends most of its time waiting for memory.
+  static constexpr size_t kHashBatchSize = 64;
+  std::array<uint32_t, kHashBatchSize> hashes;
+  size_t batch_begin = offset;
+  size_t batch_end = offset;
+
+  while (offset < end) {
+    if (offset == batch_end) {
+      auto n = std::min(kHashBatchSize, end - offset);
+      hasher.update(p + offset, n, hashes.data());
+      for (size_t i = 0; i < n; ++i) {
+        filter_.prefetch(hashes[i]);
+      }
+      batch_begin = offset;
+      batch_end = offset + n;
+    }
+
+    auto const hv = hashes[offset - batch_begin];
+
     ++stats_.bloom_lookups;
-    if (DWARFS_UNLIKELY(filter_.test(hasher()))) {
+    if (DWARFS_UNLIKELY(filter_.test(hv))) {
       ++stats_.bloom_hits;
       if (single_block_mode) {
         auto& block = blocks_.front();
-        block.for_each_offset(hasher(), [&](uint32_t offset) {
+        block.for_each_offset(hv, [&](uint32_t offset) {
           matches.emplace_back(&block, offset);
         });
       } else {
         for (auto const& block : blocks_) {
-          block.for_each_offset_filter(hasher(), [&](uint32_t offset) {
+          block.for_each_offset_filter(hv, [&](uint32_t offset) {
             matches.emplace_back(&block, offset);
           });
         }
@@ -628,13 +710,13 @@ void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
       if (DWARFS_UNLIKELY(!matches.empty())) {
         ++stats_.bloom_true_positives;
 
-        LOG_TRACE << "found " << matches.size() << " matches (hash=" << hasher()
+        LOG_TRACE << "found " << matches.size() << " matches (hash=" << hv
                   << ", window size=" << window_size_ << ")";
 
         for (auto& m : matches) {
           LOG_TRACE << "  block " << m.block_num() << " @ " << m.offset();
           m.verify_and_extend(p + offset - window_size_, window_size_,
-                              p + written, p + size);
+                              p + written, p + end);
         }
 
         stats_.total_matches += matches.size();
@@ -667,7 +749,7 @@ void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
 
           offset = written;
 
-          if (size - written < window_size_) {
+          if (end - written < window_size_) {
             break;
           }
 
@@ -677,6 +759,8 @@ void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
             hasher.update(p[offset]);
           }
 
+          batch_end = offset;
+
           next_hash_offset =
               written + lookback_size + blocks_.back().next_hash_distance();
         }
@@ -699,18 +783,69 @@ void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
       next_hash_offset += window_step_;
     }
 
-    hasher.update(p[offset - window_size_], p[offset]);
     ++offset;
   }
 
-  add_data(ino, mm, written, size - written);
+  add_data(ino, mm, written, end - written);
+  finish_chunk(ino);
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::cdc_add_data(inode& ino, mmif& mm,
+                                                size_t begin, size_t end) {
+  static constexpr auto alg = checksum::algorithm::XXH3_128;
+  static_assert(checksum::digest_size(alg) == sizeof(cdc_key));
+
+  auto p = mm.as<uint8_t>();
+  size_t offset = begin;
+
+  while (offset < end) {
+    auto len = cdc_->cut(p + offset, end - offset);
+    cdc_key key;
+
+    ++stats_.cdc_chunks;
+
+    DWARFS_CHECK(checksum::compute(alg, p + offset, len, &key),
+                 "checksum computation failed");
+
+    if (auto it = cdc_index_.find(key); it != cdc_index_.end()) {
+      finish_chunk(ino);
+      ino.add_chunk(it->second.block, it->second.offset, len);
+      prog_.chunk_count++;
+      prog_.saved_by_segmentation += len;
+      ++stats_.cdc_matches;
+    } else {
+      bool new_block = blocks_.empty() || blocks_.back().full();
+      size_t block_num = new_block ? block_count_ : blocks_.back().num();
+      size_t block_offset = new_block ? 0 : blocks_.back().size();
+
+      add_data(ino, mm, offset, len);
+
+      // only chunks that are stored contiguously can be referenced
+      if (len >= cdc_->min_size() && block_offset + len <= block_size_) {
+        cdc_index_.emplace(key,
+                           cdc_location{static_cast<uint32_t>(block_num),
+                                        static_cast<uint32_t>(block_offset)});
+      }
+    }
+
+    offset += len;
+  }
+
   finish_chunk(ino);
 }
 
 block_manager::block_manager(logger& lgr, progress& prog, const config& cfg,
                              std::shared_ptr<os_access> os,
                              filesystem_writer& fsw)
+    : block_manager(lgr, prog, cfg, std::move(os),
+                    [&fsw](size_t, std::shared_ptr<block_data>&& data) {
+                      fsw.write_block(std::move(data));
+                    }) {}
+
+block_manager::block_manager(logger& lgr, progress& prog, const config& cfg,
+                             std::shared_ptr<os_access> os, block_writer writer)
     : impl_(make_unique_logging_object<impl, block_manager_, logger_policies>(
-          lgr, prog, cfg, os, fsw)) {}
+          lgr, prog, cfg, std::move(os), std::move(writer))) {}
 
 } // namespace dwarfs
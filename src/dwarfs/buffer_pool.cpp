@@ -0,0 +1,138 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dwarfs/buffer_pool.h"
+
+namespace dwarfs {
+
+namespace {
+
+void advise_huge_pages(std::vector<uint8_t>& buf) {
+#ifdef MADV_HUGEPAGE
+  static size_t const page_size = ::sysconf(_SC_PAGESIZE);
+  auto begin = reinterpret_cast<uintptr_t>(buf.data());
+  auto end = begin + buf.capacity();
+  begin = (begin + page_size - 1) & ~(page_size - 1);
+  end &= ~(page_size - 1);
+  if (end > begin) {
+    // this is just a hint, so ignore any errors
+    ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+  }
+#else
+  (void)buf;
+#endif
+}
+
+} // namespace
+
+buffer_pool::buffer_pool(size_t max_bytes)
+    : max_bytes_{max_bytes} {}
+
+std::vector<uint8_t> buffer_pool::acquire(size_t min_capacity) {
+  {
+    std::lock_guard lock(mx_);
+
+    // most recently released buffers first, they're most likely still hot
+    for (auto it = buffers_.rbegin(); it != buffers_.rend(); ++it) {
+      if (it->capacity() >= min_capacity) {
+        auto buf = std::move(*it);
+        buffers_.erase(std::next(it).base());
+        pooled_bytes_ -= buf.capacity();
+        return buf;
+      }
+    }
+
+    if (min_capacity == 0) {
+      min_capacity = max_capacity_;
+    }
+  }
+
+  std::vector<uint8_t> buf;
+
+  if (min_capacity > 0) {
+    buf.reserve(min_capacity);
+    advise_huge_pages(buf);
+  }
+
+  return buf;
+}
+
+void buffer_pool::release(std::vector<uint8_t> buf) {
+  auto const capacity = buf.capacity();
+
+  if (capacity == 0) {
+    return;
+  }
+
+  buf.clear();
+
+  {
+    std::lock_guard lock(mx_);
+
+    max_capacity_ = std::max(max_capacity_, capacity);
+
+    if (pooled_bytes_ + capacity <= max_bytes_) {
+      pooled_bytes_ += capacity;
+      buffers_.push_back(std::move(buf));
+      return;
+    }
+  }
+
+  // otherwise, buf is freed outside of the lock
+}
+
+void buffer_pool::set_max_bytes(size_t max_bytes) {
+  std::vector<std::vector<uint8_t>> dropped;
+
+  {
+    std::lock_guard lock(mx_);
+
+    max_bytes_ = max_bytes;
+
+    // drop the oldest buffers first, they're least likely to be hot
+    auto it = buffers_.begin();
+
+    while (pooled_bytes_ > max_bytes_ && it != buffers_.end()) {
+      pooled_bytes_ -= it->capacity();
+      dropped.push_back(std::move(*it));
+      ++it;
+    }
+
+    buffers_.erase(buffers_.begin(), it);
+  }
+
+  // dropped buffers are freed outside of the lock
+}
+
+size_t buffer_pool::size() const {
+  std::lock_guard lock(mx_);
+  return buffers_.size();
+}
+
+} // namespace dwarfs
@@ -0,0 +1,149 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string_view>
+
+#include <boost/algorithm/string/case_conv.hpp>
+
+#include "dwarfs/categorizer.h"
+#include "dwarfs/entry.h"
+#include "dwarfs/script.h"
+
+namespace dwarfs {
+
+namespace {
+
+struct magic {
+  size_t offset;
+  std::string_view bytes;
+};
+
+using namespace std::string_view_literals;
+
+constexpr std::array<magic, 19> compressed_magic{{
+    {0, "\x1f\x8b"sv},                     // gzip
+    {0, "BZh"sv},                          // bzip2
+    {0, "\xfd" "7zXZ\x00"sv},              // xz
+    {0, "\x28\xb5\x2f\xfd"sv},             // zstd
+    {0, "\x04\x22\x4d\x18"sv},             // lz4
+    {0, "PK\x03\x04"sv},                   // zip, jar, docx, ...
+    {0, "7z\xbc\xaf\x27\x1c"sv},           // 7-zip
+    {0, "Rar!\x1a\x07"sv},                 // rar
+    {0, "\x89PNG\r\n\x1a\n"sv},            // png
+    {0, "\xff\xd8\xff"sv},                 // jpeg
+    {0, "GIF8"sv},                         // gif
+    {8, "WEBP"sv},                         // webp
+    {0, "OggS"sv},                         // ogg
+    {0, "fLaC"sv},                         // flac
+    {0, "ID3"sv},                          // mp3
+    {4, "ftyp"sv},                         // mp4, mov, heic, ...
+    {0, "\x1a\x45\xdf\xa3"sv},             // matroska, webm
+    {0, "DWARFS"sv},                       // dwarfs
+    {0, "hsqs"sv},                         // squashfs
+}};
+
+constexpr std::array<magic, 6> executable_magic{{
+    {0, "\x7f" "ELF"sv},                   // ELF
+    {0, "MZ"sv},                           // PE/COFF
+    {0, "\xfe\xed\xfa\xce"sv},             // Mach-O
+    {0, "\xfe\xed\xfa\xcf"sv},             // Mach-O 64-bit
+    {0, "\xce\xfa\xed\xfe"sv},             // Mach-O (reverse)
+    {0, "\xcf\xfa\xed\xfe"sv},             // Mach-O 64-bit (reverse)
+}};
+
+// for formats that don't have a reliable magic number
+constexpr std::array<std::string_view, 8> compressed_extensions{
+    {".mp3"sv, ".aac"sv, ".m4a"sv, ".avi"sv, ".lzma"sv, ".lzo"sv, ".z"sv,
+     ".tgz"sv}};
+
+template <size_t N>
+bool has_magic(std::array<magic, N> const& table, folly::ByteRange head) {
+  auto const* data = reinterpret_cast<char const*>(head.data());
+  return std::any_of(table.begin(), table.end(), [&](magic const& m) {
+    return head.size() >= m.offset + m.bytes.size() &&
+           std::string_view(data + m.offset, m.bytes.size()) == m.bytes;
+  });
+}
+
+bool has_compressed_extension(std::string const& name) {
+  auto pos = name.rfind('.');
+  if (pos == std::string::npos) {
+    return false;
+  }
+  auto ext = boost::algorithm::to_lower_copy(name.substr(pos));
+  return std::find(compressed_extensions.begin(), compressed_extensions.end(),
+                   ext) != compressed_extensions.end();
+}
+
+// Text is assumed if there are no NUL bytes and hardly any control
+// characters. Bytes >= 0x80 are accepted to allow for UTF-8 input.
+bool is_text(folly::ByteRange head) {
+  if (head.empty()) {
+    return false;
+  }
+
+  size_t control = 0;
+
+  for (auto c : head) {
+    if (c == 0) {
+      return false;
+    }
+    if (c < 0x20 && c != '\n' && c != '\r' && c != '\t' && c != '\f') {
+      ++control;
+    }
+  }
+
+  return control * 100 < head.size();
+}
+
+} // namespace
+
+categorizer::categorizer(std::shared_ptr<script> scr)
+    : script_{std::move(scr)} {}
+
+std::string categorizer::categorize(file const& f, folly::ByteRange head) const {
+  if (script_ && script_->has_categorize()) {
+    // scripts are not thread-safe
+    std::lock_guard lock(script_mx_);
+    if (auto cat = script_->categorize(f); !cat.empty()) {
+      return cat;
+    }
+  }
+
+  if (has_magic(compressed_magic, head) || has_compressed_extension(f.name())) {
+    return COMPRESSED;
+  }
+
+  if (has_magic(executable_magic, head)) {
+    return EXECUTABLE;
+  }
+
+  if (is_text(head)) {
+    return TEXT;
+  }
+
+  return DEFAULT;
+}
+
+} // namespace dwarfs
@@ -34,6 +34,7 @@
 #include "dwarfs/entry.h"
 #include "dwarfs/entry_interface.h"
 #include "dwarfs/inode.h"
+#include "dwarfs/memory_accountant.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/terminal.h"
 #include "dwarfs/util.h"
@@ -195,6 +196,18 @@ void console_writer::update(const progress& p, bool last) {
       if (debug_progress_) {
         oss << " [" << p.nilsimsa_depth << "/" << p.blockify_queue << "/"
             << p.compress_queue << "]";
+
+        oss << newline << "memory: " << size_with_unit(p.memory.used());
+        if (auto limit = p.memory.limit(); limit > 0) {
+          oss << "/" << size_with_unit(limit);
+        }
+        oss << " [";
+        for (size_t i = 0; i < memory_accountant::kNumStages; ++i) {
+          auto const stage = static_cast<memory_stage>(i);
+          oss << (i > 0 ? ", " : "") << memory_accountant::stage_name(stage)
+              << ": " << size_with_unit(p.memory.used(stage));
+        }
+        oss << "]";
       } else {
         if (p.nilsimsa_depth > 0) {
           oss << " [depth: " << p.nilsimsa_depth << "]";
@@ -226,7 +239,9 @@ void console_writer::update(const progress& p, bool last) {
 
   size_t orig = p.original_size - p.saved_by_deduplication;
   double frac_fs =
-      orig > 0 ? double(p.filesystem_size + p.saved_by_segmentation) / orig
+      orig > 0 ? double(p.filesystem_size + p.saved_by_segmentation +
+                        p.saved_by_holes) /
+                     orig
                : 0.0;
   double frac_comp =
       p.block_count > 0 ? double(p.blocks_written) / p.block_count : 0.0;
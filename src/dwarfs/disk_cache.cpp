@@ -0,0 +1,304 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <folly/FileUtil.h>
+#include <folly/container/EvictingCacheMap.h>
+#include <folly/container/F14Set.h>
+
+#include "dwarfs/checksum.h"
+#include "dwarfs/disk_cache.h"
+#include "dwarfs/error.h"
+#include "dwarfs/logger.h"
+#include "dwarfs/mmap.h"
+#include "dwarfs/worker_group.h"
+
+namespace dwarfs {
+
+namespace {
+
+constexpr std::string_view const kEntrySuffix{".blk"};
+
+// "DWCACHE1" when stored in little endian order
+constexpr uint64_t const kEntryMagic{0x3145484341435744};
+
+// maximum number of entries waiting to be written
+constexpr size_t const kMaxPendingWrites{16};
+
+// Stored after the data of each entry
+struct entry_trailer {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t xxh3_64;
+};
+
+static_assert(sizeof(entry_trailer) == 24);
+
+uint64_t data_checksum(folly::ByteRange data) {
+  uint64_t xxh;
+  DWARFS_CHECK(checksum::compute(checksum::algorithm::XXH3_64, data.data(),
+                                 data.size(), &xxh),
+               "checksum computation failed");
+  return xxh;
+}
+
+template <typename LoggerPolicy>
+class disk_cache_ final : public disk_cache::impl {
+ public:
+  disk_cache_(logger& lgr, std::string const& dir, size_t max_bytes)
+      : LOG_PROXY_INIT(lgr)
+      , dir_(dir)
+      , max_bytes_(max_bytes)
+      , writer_("diskcache", 1) {
+    std::filesystem::create_directories(dir_);
+    scan();
+  }
+
+  ~disk_cache_() noexcept override {
+    try {
+      writer_.stop();
+    } catch (...) {
+    }
+  }
+
+  std::optional<disk_cache::entry>
+  find(std::string const& key) const override {
+    auto path = entry_path(key);
+    std::shared_ptr<mmif> mm;
+
+    try {
+      mm = std::make_shared<mmap>(path.native());
+    } catch (std::exception const&) {
+      // Entry may have been removed by another process
+      std::lock_guard lock(mx_);
+      forget(key);
+      return std::nullopt;
+    }
+
+    auto data = validate(*mm);
+
+    if (!data) {
+      LOG_WARN << "removing corrupt disk cache entry " << path.string();
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+      std::lock_guard lock(mx_);
+      forget(key);
+      return std::nullopt;
+    }
+
+    std::lock_guard lock(mx_);
+
+    if (entries_.find(key) == entries_.end()) {
+      // Stored by another process
+      add(key, mm->size());
+    }
+
+    return disk_cache::entry{*data, std::move(mm)};
+  }
+
+  void store(std::string const& key, folly::ByteRange data,
+             std::shared_ptr<void const> owner) const override {
+    {
+      std::lock_guard lock(mx_);
+      if (entries_.exists(key) || pending_.count(key) > 0) {
+        return;
+      }
+      if (pending_.size() >= kMaxPendingWrites) {
+        LOG_TRACE << "disk cache writer busy, not storing " << key;
+        return;
+      }
+      pending_.insert(key);
+    }
+
+    writer_.add_job(
+        [this, key, data, owner = std::move(owner)] {
+          write_entry(key, data);
+          std::lock_guard lock(mx_);
+          pending_.erase(key);
+        },
+        job_priority::BACKGROUND);
+  }
+
+ private:
+  std::filesystem::path entry_path(std::string const& key) const {
+    return dir_ / (key + std::string(kEntrySuffix));
+  }
+
+  // Returns the data of an entry if its trailer and checksum are valid
+  static std::optional<folly::ByteRange> validate(mmif const& mm) {
+    if (mm.size() < sizeof(entry_trailer)) {
+      return std::nullopt;
+    }
+
+    auto const size = mm.size() - sizeof(entry_trailer);
+    entry_trailer trailer;
+    std::memcpy(&trailer, mm.as<void>(size), sizeof(trailer));
+
+    if (trailer.magic != kEntryMagic || trailer.size != size) {
+      return std::nullopt;
+    }
+
+    auto data = mm.range(0, size);
+
+    if (data_checksum(data) != trailer.xxh3_64) {
+      return std::nullopt;
+    }
+
+    return data;
+  }
+
+  void write_entry(std::string const& key, folly::ByteRange data) const {
+    auto path = entry_path(key);
+    auto tmp = path;
+    tmp += fmt::format(".{}.{}.tmp", ::getpid(), ++tmp_counter_);
+
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1) {
+      LOG_WARN << "cannot create " << tmp.string() << ": "
+               << std::strerror(errno);
+      return;
+    }
+
+    entry_trailer const trailer{kEntryMagic, data.size(), data_checksum(data)};
+
+    // The data must be on disk before the rename, otherwise a crash can
+    // leave a truncated entry behind under its final name.
+    bool ok = folly::writeFull(fd, data.data(), data.size()) ==
+                  static_cast<ssize_t>(data.size()) &&
+              folly::writeFull(fd, &trailer, sizeof(trailer)) ==
+                  static_cast<ssize_t>(sizeof(trailer)) &&
+              ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+
+    if (!ok) {
+      LOG_WARN << "failed to write " << tmp.string();
+      std::error_code ec;
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+
+    if (ec) {
+      LOG_WARN << "failed to rename " << tmp.string() << ": "
+               << ec.message();
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+
+    LOG_TRACE << "stored " << data.size() << " bytes in " << path.string();
+
+    std::lock_guard lock(mx_);
+    add(key, data.size() + sizeof(trailer));
+    prune();
+  }
+
+  void scan() {
+    std::vector<std::tuple<std::filesystem::file_time_type, std::string,
+                           size_t>>
+        found;
+
+    for (auto const& e : std::filesystem::directory_iterator(dir_)) {
+      auto const& p = e.path();
+      if (e.is_regular_file() && p.extension().string() == kEntrySuffix) {
+        found.emplace_back(e.last_write_time(), p.stem().string(),
+                           e.file_size());
+      }
+    }
+
+    // insert oldest first, so the newest entries end up in front
+    std::sort(found.begin(), found.end());
+
+    std::lock_guard lock(mx_);
+
+    for (auto const& [mtime, key, size] : found) {
+      add(key, size);
+    }
+
+    LOG_DEBUG << "disk cache: found " << entries_.size() << " entries with "
+              << total_bytes_ << " bytes in " << dir_.string();
+
+    prune();
+  }
+
+  void add(std::string const& key, size_t size) const {
+    forget(key);
+    entries_.set(key, size);
+    total_bytes_ += size;
+  }
+
+  void forget(std::string const& key) const {
+    if (auto it = entries_.findWithoutPromotion(key); it != entries_.end()) {
+      total_bytes_ -= it->second;
+      entries_.erase(key);
+    }
+  }
+
+  void prune() const {
+    while (max_bytes_ > 0 && total_bytes_ > max_bytes_ && !entries_.empty()) {
+      auto victim = entries_.rbegin();
+      auto key = victim->first;
+      total_bytes_ -= victim->second;
+      entries_.erase(key);
+      std::error_code ec;
+      std::filesystem::remove(entry_path(key), ec);
+      LOG_TRACE << "removed disk cache entry " << key;
+    }
+  }
+
+  LOG_PROXY_DECL(LoggerPolicy);
+  std::filesystem::path const dir_;
+  size_t const max_bytes_;
+  mutable std::mutex mx_;
+  mutable folly::EvictingCacheMap<std::string, size_t> entries_{0};
+  mutable size_t total_bytes_{0};
+  mutable std::atomic<size_t> tmp_counter_{0};
+  mutable folly::F14FastSet<std::string> pending_;
+  mutable worker_group writer_;
+};
+
+} // namespace
+
+disk_cache::disk_cache(logger& lgr, std::string const& dir, size_t max_bytes)
+    : impl_(make_unique_logging_object<impl, disk_cache_, logger_policies>(
+          lgr, dir, max_bytes)) {}
+
+} // namespace dwarfs
@@ -21,6 +21,8 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory_resource>
+#include <mutex>
 #include <utility>
 
 #include <fmt/format.h>
@@ -30,6 +32,7 @@
 #include "dwarfs/error.h"
 #include "dwarfs/global_entry_data.h"
 #include "dwarfs/inode.h"
+#include "dwarfs/memory_accountant.h"
 #include "dwarfs/mmif.h"
 #include "dwarfs/nilsimsa.h"
 #include "dwarfs/options.h"
@@ -40,34 +43,41 @@
 
 namespace dwarfs {
 
-entry::entry(const std::string& name, std::shared_ptr<entry> parent,
-             const struct ::stat& st)
-    : name_(name)
-    , parent_(std::move(parent))
-    , stat_(st) {}
+namespace {
 
-bool entry::has_parent() const {
-  if (parent_.lock()) {
-    return true;
-  }
+constexpr size_t kScanChunkSize{32 << 20};
 
-  return false;
-}
+} // namespace
+
+entry_stat::entry_stat(struct ::stat const& st)
+    : ino(st.st_ino)
+    , size(st.st_size)
+    , rdev(st.st_rdev)
+    , atime(st.st_atime)
+    , mtime(st.st_mtime)
+    , ctime(st.st_ctime)
+    , mode(st.st_mode)
+    , nlink(st.st_nlink)
+    , uid(st.st_uid)
+    , gid(st.st_gid) {}
 
-std::shared_ptr<entry> entry::parent() const { return parent_.lock(); }
+entry::entry(const std::string& name, entry* parent, const struct ::stat& st)
+    : name_(name)
+    , parent_(parent)
+    , stat_(st) {}
 
 void entry::set_name(const std::string& name) { name_ = name; }
 
 std::string entry::path() const {
-  if (auto parent = parent_.lock()) {
-    return parent->path() + "/" + name_;
+  if (parent_) {
+    return parent_->path() + "/" + name_;
   }
 
   return name_;
 }
 
 std::string entry::type_string() const {
-  auto mode = stat_.st_mode;
+  auto mode = stat_.mode;
 
   if (S_ISREG(mode)) {
     return "file";
@@ -93,52 +103,52 @@ void entry::walk(std::function<void(entry*)> const& f) { f(this); }
 void entry::walk(std::function<void(const entry*)> const& f) const { f(this); }
 
 void entry::update(global_entry_data& data) const {
-  data.add_uid(stat_.st_uid);
-  data.add_gid(stat_.st_gid);
-  data.add_mode(stat_.st_mode & 0xFFFF);
-  data.add_atime(stat_.st_atime);
-  data.add_mtime(stat_.st_mtime);
-  data.add_ctime(stat_.st_ctime);
+  data.add_uid(stat_.uid);
+  data.add_gid(stat_.gid);
+  data.add_mode(stat_.mode & 0xFFFF);
+  data.add_atime(stat_.atime);
+  data.add_mtime(stat_.mtime);
+  data.add_ctime(stat_.ctime);
 }
 
 void entry::pack(thrift::metadata::inode_data& entry_v2,
                  global_entry_data const& data) const {
-  entry_v2.mode_index = data.get_mode_index(stat_.st_mode & 0xFFFF);
-  entry_v2.owner_index = data.get_uid_index(stat_.st_uid);
-  entry_v2.group_index = data.get_gid_index(stat_.st_gid);
-  entry_v2.atime_offset = data.get_atime_offset(stat_.st_atime);
-  entry_v2.mtime_offset = data.get_mtime_offset(stat_.st_mtime);
-  entry_v2.ctime_offset = data.get_ctime_offset(stat_.st_ctime);
+  entry_v2.mode_index = data.get_mode_index(stat_.mode & 0xFFFF);
+  entry_v2.owner_index = data.get_uid_index(stat_.uid);
+  entry_v2.group_index = data.get_gid_index(stat_.gid);
+  entry_v2.atime_offset = data.get_atime_offset(stat_.atime);
+  entry_v2.mtime_offset = data.get_mtime_offset(stat_.mtime);
+  entry_v2.ctime_offset = data.get_ctime_offset(stat_.ctime);
 }
 
 entry::type_t file::type() const { return E_FILE; }
 
-uint16_t entry::get_permissions() const { return stat_.st_mode & 07777; }
+uint16_t entry::get_permissions() const { return stat_.mode & 07777; }
 
 void entry::set_permissions(uint16_t perm) {
-  stat_.st_mode &= ~07777;
-  stat_.st_mode |= perm;
+  stat_.mode &= ~07777;
+  stat_.mode |= perm;
 }
 
-uint16_t entry::get_uid() const { return stat_.st_uid; }
+uint16_t entry::get_uid() const { return stat_.uid; }
 
-void entry::set_uid(uint16_t uid) { stat_.st_uid = uid; }
+void entry::set_uid(uint16_t uid) { stat_.uid = uid; }
 
-uint16_t entry::get_gid() const { return stat_.st_gid; }
+uint16_t entry::get_gid() const { return stat_.gid; }
 
-void entry::set_gid(uint16_t gid) { stat_.st_gid = gid; }
+void entry::set_gid(uint16_t gid) { stat_.gid = gid; }
 
-uint64_t entry::get_atime() const { return stat_.st_atime; }
+uint64_t entry::get_atime() const { return stat_.atime; }
 
-void entry::set_atime(uint64_t atime) { stat_.st_atime = atime; }
+void entry::set_atime(uint64_t atime) { stat_.atime = atime; }
 
-uint64_t entry::get_mtime() const { return stat_.st_mtime; }
+uint64_t entry::get_mtime() const { return stat_.mtime; }
 
-void entry::set_mtime(uint64_t mtime) { stat_.st_atime = mtime; }
+void entry::set_mtime(uint64_t mtime) { stat_.mtime = mtime; }
 
-uint64_t entry::get_ctime() const { return stat_.st_ctime; }
+uint64_t entry::get_ctime() const { return stat_.ctime; }
 
-void entry::set_ctime(uint64_t ctime) { stat_.st_atime = ctime; }
+void entry::set_ctime(uint64_t ctime) { stat_.ctime = ctime; }
 
 std::string_view file::hash() const {
   auto& h = data_->hash;
@@ -164,27 +174,38 @@ void file::scan(os_access& os, progress& prog) {
     mm = os.map_file(path(), s);
   }
 
+  // only about a single chunk of the mapping is resident at any time
+  memory_accountant::scoped_charge charge(
+      prog.memory, memory_stage::SCANNER, std::min(size(), kScanChunkSize));
+
   scan(mm, prog);
 }
 
-void file::scan(std::shared_ptr<mmif> const& mm, progress& prog) {
+void file::scan(std::shared_ptr<mmif> const& mm, progress& prog,
+                std::function<void(uint8_t const*, size_t)> const& on_data) {
   constexpr auto alg = checksum::algorithm::XXH3_128;
   static_assert(checksum::digest_size(alg) == sizeof(data::hash_type));
 
   if (size_t s = size(); s > 0) {
-    constexpr size_t chunk_size = 32 << 20;
+    constexpr size_t chunk_size = kScanChunkSize;
     prog.original_size += s;
     checksum cs(alg);
     size_t offset = 0;
 
     while (s >= chunk_size) {
       cs.update(mm->as<void>(offset), chunk_size);
+      if (on_data) {
+        on_data(mm->as<uint8_t>(offset), chunk_size);
+      }
       mm->release_until(offset);
       offset += chunk_size;
       s -= chunk_size;
     }
 
     cs.update(mm->as<void>(offset), s);
+    if (on_data) {
+      on_data(mm->as<uint8_t>(offset), s);
+    }
 
     DWARFS_CHECK(cs.finalize(&data_->hash[0]), "checksum computation failed");
   } else {
@@ -193,6 +214,12 @@ void file::scan(std::shared_ptr<mmif> const& mm, progress& prog) {
   }
 }
 
+void file::set_hash(std::string_view digest, progress& prog) {
+  DWARFS_CHECK(digest.size() == data_->hash.size(), "invalid digest size");
+  prog.original_size += size();
+  std::copy(digest.begin(), digest.end(), data_->hash.begin());
+}
+
 uint32_t file::unique_file_id() const { return inode_->num(); }
 
 void file::set_inode_num(uint32_t inode_num) {
@@ -275,7 +302,7 @@ void dir::pack(thrift::metadata::metadata& mv2,
                global_entry_data const& data) const {
   thrift::metadata::directory d;
   if (has_parent()) {
-    auto pd = std::dynamic_pointer_cast<dir>(parent());
+    auto pd = dynamic_cast<dir const*>(parent());
     DWARFS_CHECK(pd, "unexpected parent entry (not a directory)");
     auto pe = pd->entry_index();
     DWARFS_CHECK(pe, "parent entry index not set");
@@ -324,7 +351,7 @@ void link::scan(os_access& os, progress& prog) {
 }
 
 entry::type_t device::type() const {
-  auto mode = status().st_mode;
+  auto mode = status().mode;
   return S_ISCHR(mode) || S_ISBLK(mode) ? E_DEVICE : E_OTHER;
 }
 
@@ -332,7 +359,68 @@ void device::accept(entry_visitor& v, bool) { v.visit(this); }
 
 void device::scan(os_access&, progress&) {}
 
-uint64_t device::device_id() const { return status().st_rdev; }
+uint64_t device::device_id() const { return status().rdev; }
+
+namespace {
+
+/**
+ * Bump allocator for entries. Trees can easily have millions of entries,
+ * none of which is freed before the whole tree goes away, so there's no
+ * point in paying for individual heap allocations. Entries are created
+ * concurrently by the directory listing workers, hence the mutex.
+ */
+class entry_arena {
+ public:
+  static constexpr size_t kInitialSize{64 << 10};
+
+  void* allocate(size_t bytes, size_t alignment) {
+    std::lock_guard lock(mx_);
+    return mr_.allocate(bytes, alignment);
+  }
+
+ private:
+  std::mutex mx_;
+  std::pmr::monotonic_buffer_resource mr_{kInitialSize};
+};
+
+// Every entry keeps a reference to the arena, so the memory stays valid
+// even if entries outlive the factory.
+template <typename T>
+class arena_allocator {
+ public:
+  using value_type = T;
+
+  explicit arena_allocator(std::shared_ptr<entry_arena> arena)
+      : arena_{std::move(arena)} {}
+
+  template <typename U>
+  arena_allocator(arena_allocator<U> const& other)
+      : arena_{other.arena_} {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, size_t) noexcept {}
+
+  template <typename U>
+  bool operator==(arena_allocator<U> const& other) const {
+    return arena_ == other.arena_;
+  }
+
+  template <typename U>
+  bool operator!=(arena_allocator<U> const& other) const {
+    return arena_ != other.arena_;
+  }
+
+ private:
+  template <typename>
+  friend class arena_allocator;
+
+  std::shared_ptr<entry_arena> arena_;
+};
+
+} // namespace
 
 class entry_factory_ : public entry_factory {
  public:
@@ -345,20 +433,30 @@ class entry_factory_ : public entry_factory {
     auto mode = st.st_mode;
 
     if (S_ISREG(mode)) {
-      return std::make_shared<file>(name, std::move(parent), st);
+      return make<file>(name, parent.get(), st);
     } else if (S_ISDIR(mode)) {
-      return std::make_shared<dir>(name, std::move(parent), st);
+      return make<dir>(name, parent.get(), st);
     } else if (S_ISLNK(mode)) {
-      return std::make_shared<link>(name, std::move(parent), st);
+      return make<link>(name, parent.get(), st);
     } else if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) ||
                S_ISSOCK(mode)) {
-      return std::make_shared<device>(name, std::move(parent), st);
+      return make<device>(name, parent.get(), st);
     } else {
       // TODO: warn
     }
 
     return nullptr;
   }
+
+ private:
+  template <typename T>
+  std::shared_ptr<entry>
+  make(const std::string& name, entry* parent, struct ::stat const& st) {
+    return std::allocate_shared<T>(arena_allocator<T>(arena_), name, parent,
+                                   st);
+  }
+
+  std::shared_ptr<entry_arena> arena_{std::make_shared<entry_arena>()};
 };
 
 std::unique_ptr<entry_factory> entry_factory::create() {
@@ -0,0 +1,250 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+#include <folly/system/ThreadId.h>
+#include <folly/system/ThreadName.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/event_tracer.h"
+
+namespace dwarfs {
+
+namespace {
+
+struct event {
+  char const* cat;
+  char const* name;
+  char phase;
+  uint64_t ts;
+  uint64_t dur;
+  uint64_t id;
+};
+
+// Events beyond this limit are dropped to bound memory usage
+constexpr size_t max_events_per_thread{1 << 20};
+
+struct thread_buffer {
+  uint64_t tid;
+  std::string thread_name;
+  std::mutex mx;
+  std::vector<event> events;
+  size_t dropped{0};
+};
+
+// Thread buffers are never freed, a thread may still hold on to its
+// buffer while tracing is stopped
+struct tracer_state {
+  std::mutex mx;
+  std::string path;
+  std::vector<std::unique_ptr<thread_buffer>> buffers;
+  std::set<std::string> strings;
+  std::chrono::steady_clock::time_point epoch;
+};
+
+tracer_state& state() {
+  static tracer_state st;
+  return st;
+}
+
+std::atomic<uint64_t> next_event_id{1};
+
+thread_buffer& current_buffer() {
+  thread_local thread_buffer* buffer{nullptr};
+
+  if (!buffer) {
+    auto& st = state();
+    std::lock_guard lock(st.mx);
+    auto tb = std::make_unique<thread_buffer>();
+    tb->tid = folly::getOSThreadID();
+    buffer = tb.get();
+    st.buffers.push_back(std::move(tb));
+  }
+
+  if (buffer->thread_name.empty()) {
+    // worker threads are named only after they have been started
+    buffer->thread_name = folly::getCurrentThreadName().value_or("");
+  }
+
+  return *buffer;
+}
+
+void record(event const& ev) {
+  auto& tb = current_buffer();
+  std::lock_guard lock(tb.mx);
+  if (tb.events.size() < max_events_per_thread) {
+    tb.events.push_back(ev);
+  } else {
+    ++tb.dropped;
+  }
+}
+
+void write_string(std::ostream& os, std::string_view str) {
+  os << '"';
+  for (auto c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) >= 0x20) {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+} // namespace
+
+std::atomic<bool> event_tracer::enabled_{false};
+
+bool event_tracer::start(std::string const& path) {
+  if (!available()) {
+    return false;
+  }
+
+  auto& st = state();
+
+  {
+    std::ofstream ofs(path);
+    if (!ofs) {
+      DWARFS_THROW(runtime_error, "cannot write event trace " + path);
+    }
+  }
+
+  std::lock_guard lock(st.mx);
+  st.path = path;
+  for (auto& tb : st.buffers) {
+    std::lock_guard tblock(tb->mx);
+    tb->events.clear();
+    tb->dropped = 0;
+  }
+  st.epoch = std::chrono::steady_clock::now();
+  enabled_ = true;
+
+  return true;
+}
+
+void event_tracer::stop() {
+  if (!enabled_.exchange(false)) {
+    return;
+  }
+
+  auto& st = state();
+  std::lock_guard lock(st.mx);
+  std::ofstream ofs(st.path);
+  auto const pid = ::getpid();
+  bool first = true;
+
+  auto sep = [&] {
+    ofs << (first ? "\n" : ",\n");
+    first = false;
+  };
+
+  ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+  for (auto& tb : st.buffers) {
+    std::lock_guard tblock(tb->mx);
+
+    sep();
+    ofs << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+        << ",\"tid\":" << tb->tid << ",\"args\":{\"name\":";
+    write_string(ofs, tb->thread_name);
+    ofs << "}}";
+
+    for (auto const& ev : tb->events) {
+      sep();
+      ofs << "{\"cat\":";
+      write_string(ofs, ev.cat);
+      ofs << ",\"name\":";
+      write_string(ofs, ev.name);
+      ofs << ",\"ph\":\"" << ev.phase << "\",\"pid\":" << pid
+          << ",\"tid\":" << tb->tid << ",\"ts\":" << ev.ts / 1000 << '.'
+          << ev.ts / 100 % 10;
+      switch (ev.phase) {
+      case 'X':
+        ofs << ",\"dur\":" << ev.dur / 1000 << '.' << ev.dur / 100 % 10;
+        break;
+      case 'i':
+        ofs << ",\"s\":\"t\"";
+        break;
+      default:
+        ofs << ",\"id\":\"0x" << std::hex << ev.id << std::dec << '"';
+        break;
+      }
+      ofs << '}';
+    }
+
+    if (tb->dropped > 0) {
+      sep();
+      ofs << "{\"name\":\"dropped events\",\"ph\":\"C\",\"pid\":" << pid
+          << ",\"tid\":" << tb->tid << ",\"ts\":0,\"args\":{\"dropped\":"
+          << tb->dropped << "}}";
+    }
+
+    tb->events.clear();
+    tb->events.shrink_to_fit();
+    tb->dropped = 0;
+  }
+
+  ofs << "\n]}\n";
+}
+
+char const* event_tracer::intern(std::string const& str) {
+  auto& st = state();
+  std::lock_guard lock(st.mx);
+  return st.strings.insert(str).first->c_str();
+}
+
+uint64_t event_tracer::now() {
+  // Never returns 0, which trace_scope uses as "not started"
+  return 1 + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - state().epoch)
+                 .count();
+}
+
+uint64_t event_tracer::next_id() { return next_event_id++; }
+
+void event_tracer::complete(char const* cat, char const* name, uint64_t start,
+                            uint64_t end) {
+  record({cat, name, 'X', start, end - start, 0});
+}
+
+void event_tracer::instant(char const* cat, char const* name) {
+  record({cat, name, 'i', now(), 0, 0});
+}
+
+void event_tracer::async_begin(char const* cat, char const* name,
+                               uint64_t id) {
+  record({cat, name, 'b', now(), 0, id});
+}
+
+void event_tracer::async_end(char const* cat, char const* name, uint64_t id) {
+  record({cat, name, 'e', now(), 0, id});
+}
+
+} // namespace dwarfs
@@ -19,12 +19,26 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
 #include <condition_variable>
+#include <cstring>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
-
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <archive.h>
@@ -113,7 +127,7 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
     check_result(::archive_write_open_fd(a_, pipefd_[1]));
   }
 
-  void open_disk(std::string const& output) override {
+  void open_disk(std::string const& output, size_t num_writers) override {
     if (!output.empty()) {
       if (::chdir(output.c_str()) != 0) {
         DWARFS_THROW(runtime_error,
@@ -121,6 +135,11 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
       }
     }
 
+    if (num_writers > 0) {
+      num_writers_ = num_writers;
+      return;
+    }
+
     a_ = ::archive_write_disk_new();
 
     check_result(::archive_write_disk_set_options(
@@ -146,9 +165,40 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
     closefd(pipefd_[0]);
   }
 
+  void set_filter(std::vector<std::string> const& include,
+                  std::vector<std::string> const& exclude) override {
+    auto normalize = [](std::string p) {
+      while (!p.empty() && p.front() == '/') {
+        p.erase(0, 1);
+      }
+      while (!p.empty() && p.back() == '/') {
+        p.pop_back();
+      }
+      return p;
+    };
+
+    include_.clear();
+    exclude_.clear();
+
+    for (auto const& p : include) {
+      include_.push_back(normalize(p));
+    }
+
+    for (auto const& p : exclude) {
+      exclude_.push_back(normalize(p));
+    }
+  }
+
   void extract(filesystem_v2 const& fs, size_t max_queued_bytes) override;
 
  private:
+  using entry_set = std::unordered_set<uint32_t>;
+
+  std::optional<entry_set> select_entries(filesystem_v2 const& fs) const;
+  void extract_parallel(filesystem_v2 const& fs, size_t max_queued_bytes);
+  void write_fragment(int fd, std::string const& path, off_t offset,
+                      block_range const& br);
+
   void closefd(int& fd) {
     if (fd >= 0) {
       if (::close(fd) != 0) {
@@ -193,15 +243,383 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
 
   LOG_PROXY_DECL(debug_logger_policy);
   struct ::archive* a_{nullptr};
+  size_t num_writers_{0};
+  std::vector<std::string> include_;
+  std::vector<std::string> exclude_;
   int pipefd_[2]{-1, -1};
   std::unique_ptr<std::thread> iot_;
 };
 
+template <typename LoggerPolicy>
+auto filesystem_extractor_<LoggerPolicy>::select_entries(
+    filesystem_v2 const& fs) const -> std::optional<entry_set> {
+  if (include_.empty() && exclude_.empty()) {
+    return std::nullopt;
+  }
+
+  auto td = LOG_TIMED_DEBUG;
+
+  enum class match { NONE, INCLUDE, EXCLUDE };
+
+  auto matches = [](std::vector<std::string> const& patterns,
+                    std::string const& path) {
+    return std::any_of(patterns.begin(), patterns.end(), [&](auto const& p) {
+      return ::fnmatch(p.c_str(), path.c_str(), FNM_PATHNAME) == 0;
+    });
+  };
+
+  match const initial = include_.empty() ? match::INCLUDE : match::NONE;
+  std::unordered_map<uint32_t, match> dir_match;
+  entry_set selected;
+
+  fs.walk([&](auto entry) {
+    if (entry.is_root()) {
+      return;
+    }
+
+    auto parent = entry.parent();
+    auto state = initial;
+
+    if (auto it = dir_match.find(parent->self_index()); it != dir_match.end()) {
+      state = it->second;
+    }
+
+    if (state != match::EXCLUDE) {
+      auto path = entry.path();
+      if (matches(exclude_, path)) {
+        state = match::EXCLUDE;
+      } else if (state == match::NONE && matches(include_, path)) {
+        state = match::INCLUDE;
+      }
+    }
+
+    if (S_ISDIR(entry.inode().mode())) {
+      dir_match.emplace(entry.self_index(), state);
+    }
+
+    if (state == match::INCLUDE) {
+      selected.insert(entry.self_index());
+
+      // make sure all parent directories get created, too
+      for (auto p = parent; p && !p->is_root(); p = p->parent()) {
+        if (!selected.insert(p->self_index()).second) {
+          break;
+        }
+      }
+    }
+  });
+
+  td << "selected " << selected.size() << " entries";
+
+  return selected;
+}
+
+template <typename LoggerPolicy>
+void filesystem_extractor_<LoggerPolicy>::write_fragment(
+    int fd, std::string const& path, off_t offset, block_range const& br) {
+  LOG_TRACE << "writing " << br.size() << " bytes to " << path << " @ "
+            << offset;
+
+  auto data = br.data();
+  auto size = br.size();
+
+  while (size > 0) {
+    auto rv = ::pwrite(fd, data, size, offset);
+
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DWARFS_THROW(system_error, "pwrite(): " + path);
+    }
+
+    data += rv;
+    size -= rv;
+    offset += rv;
+  }
+}
+
+/**
+ * Native extraction to disk. This happens in three passes:
+ *
+ *  1. Walk the tree, create all directories, links and special files,
+ *     as well as empty regular files.
+ *  2. Write the file contents in the order they are stored in the image,
+ *     i.e. block by block, from a pool of writer threads. Each block is
+ *     only requested once, no matter how many files it contributes to,
+ *     and the memory in flight is bounded by whole blocks.
+ *  3. Set ownership, permissions and times, visiting children before
+ *     their parents so directory times survive.
+ */
+template <typename LoggerPolicy>
+void filesystem_extractor_<LoggerPolicy>::extract_parallel(
+    filesystem_v2 const& fs, size_t max_queued_bytes) {
+  auto const selected = select_entries(fs);
+  std::vector<std::pair<std::string, struct ::stat>> entries;
+  std::unordered_map<uint32_t, std::string> seen_inodes;
+  std::vector<std::pair<std::string, int>> data_files;
+
+  auto remove_existing = [](std::string const& path, bool keep_dir) {
+    struct ::stat st;
+    if (::lstat(path.c_str(), &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        if (keep_dir) {
+          return false;
+        }
+        if (::rmdir(path.c_str()) != 0) {
+          DWARFS_THROW(system_error, "rmdir(): " + path);
+        }
+      } else if (::unlink(path.c_str()) != 0) {
+        DWARFS_THROW(system_error, "unlink(): " + path);
+      }
+    }
+    return true;
+  };
+
+  fs.walk([&](auto entry) {
+    if (entry.is_root() ||
+        (selected && selected->count(entry.self_index()) == 0)) {
+      return;
+    }
+
+    if (auto name = entry.name();
+        name.empty() || name == "." || name == ".." ||
+        name.find('/') != std::string::npos) {
+      DWARFS_THROW(runtime_error, "invalid file name: " + name);
+    }
+
+    auto inode = entry.inode();
+    auto path = entry.path();
+    struct ::stat st;
+
+    if (fs.getattr(inode, &st) != 0) {
+      DWARFS_THROW(runtime_error, "getattr() failed");
+    }
+
+    LOG_TRACE << "creating " << path;
+
+    if (S_ISDIR(st.st_mode)) {
+      if (remove_existing(path, true) && ::mkdir(path.c_str(), 0700) != 0) {
+        DWARFS_THROW(system_error, "mkdir(): " + path);
+      }
+    } else {
+      remove_existing(path, false);
+
+      if (S_ISREG(st.st_mode)) {
+        if (auto [it, inserted] = seen_inodes.emplace(inode.inode_num(), path);
+            !inserted) {
+          if (::link(it->second.c_str(), path.c_str()) != 0) {
+            DWARFS_THROW(system_error, "link(): " + path);
+          }
+          return;
+        }
+
+        auto fd = ::open(path.c_str(),
+                         O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW | O_CLOEXEC,
+                         0600);
+        if (fd < 0) {
+          DWARFS_THROW(system_error, "open(): " + path);
+        }
+        ::close(fd);
+
+        if (st.st_size > 0) {
+          data_files.emplace_back(path, fs.open(inode));
+        }
+      } else if (S_ISLNK(st.st_mode)) {
+        std::string link;
+        if (fs.readlink(inode, &link) != 0) {
+          DWARFS_THROW(runtime_error, "readlink() failed");
+        }
+        if (::symlink(link.c_str(), path.c_str()) != 0) {
+          DWARFS_THROW(system_error, "symlink(): " + path);
+        }
+      } else if (::mknod(path.c_str(), st.st_mode, st.st_rdev) != 0) {
+        LOG_WARN << "mknod(): " << path << ": " << ::strerror(errno);
+        return;
+      }
+    }
+
+    entries.emplace_back(std::move(path), st);
+  });
+
+  struct fragment {
+    size_t block;
+    size_t block_offset;
+    size_t size;
+    size_t file;
+    off_t file_offset;
+  };
+
+  // Each file is opened when its first fragment is written and closed
+  // after its last one, so it's only opened once no matter how many
+  // blocks its fragments are spread over.
+  struct output_file {
+    int fd{-1};
+    size_t pending{0};
+  };
+
+  std::vector<fragment> fragments;
+  std::vector<output_file> output_files(data_files.size());
+  std::mutex output_mx;
+
+  SCOPE_EXIT {
+    for (auto& of : output_files) {
+      if (of.fd >= 0) {
+        ::close(of.fd);
+      }
+    }
+  };
+
+  for (size_t i = 0; i < data_files.size(); ++i) {
+    auto const& [path, fd] = data_files[i];
+    auto chunks = fs.get_chunks(fd);
+
+    if (!chunks) {
+      DWARFS_THROW(runtime_error, "error reading chunks for " + path);
+    }
+
+    off_t file_offset = 0;
+
+    for (auto const& chunk : *chunks) {
+      // holes are left as they are, the file is truncated to its full
+      // size below so they don't need any data to be written
+      if (chunk.block() != HOLE_BLOCK) {
+        fragments.push_back(
+            {chunk.block(), chunk.offset(), chunk.size(), i, file_offset});
+        ++output_files[i].pending;
+      }
+      file_offset += chunk.size();
+    }
+
+    if (::truncate(path.c_str(), file_offset) != 0) {
+      DWARFS_THROW(system_error, "truncate(): " + path);
+    }
+  }
+
+  std::sort(fragments.begin(), fragments.end(), [](auto& a, auto& b) {
+    return a.block < b.block ||
+           (a.block == b.block && a.block_offset < b.block_offset);
+  });
+
+  if (selected) {
+    size_t num_blocks = 0;
+    for (size_t i = 0; i < fragments.size(); ++i) {
+      if (i == 0 || fragments[i].block != fragments[i - 1].block) {
+        ++num_blocks;
+      }
+    }
+    LOG_INFO << "extracting " << entries.size() << " entries using "
+             << num_blocks << " of " << fs.num_blocks() << " blocks";
+  }
+
+  cache_semaphore sem;
+
+  sem.post(max_queued_bytes);
+
+  std::atomic<bool> abort{false};
+  worker_group writers("writer", num_writers_);
+
+  // All fragments of a block share the same cached block, so the memory
+  // in flight is accounted for in units of whole blocks.
+  auto const block_size = fs.block_size();
+
+  for (size_t first = 0; first < fragments.size() && !abort;) {
+    auto last = first + 1;
+
+    while (last < fragments.size() &&
+           fragments[last].block == fragments[first].block) {
+      ++last;
+    }
+
+    sem.wait(block_size);
+
+    std::vector<std::future<block_range>> ranges;
+    ranges.reserve(last - first);
+
+    for (auto i = first; i < last; ++i) {
+      auto const& f = fragments[i];
+      ranges.push_back(fs.read_block(f.block, f.block_offset, f.size));
+    }
+
+    writers.add_job([this, &sem, &abort, &fragments, &data_files,
+                     &output_files, &output_mx, block_size, first,
+                     ranges = std::move(ranges)]() mutable {
+      SCOPE_EXIT { sem.post(block_size); };
+      try {
+        for (size_t i = 0; i < ranges.size(); ++i) {
+          auto const& f = fragments[first + i];
+          auto const& path = data_files[f.file].first;
+          auto& of = output_files[f.file];
+          int fd;
+
+          {
+            std::lock_guard lock(output_mx);
+            if (of.fd < 0) {
+              of.fd = ::open(path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+              if (of.fd < 0) {
+                DWARFS_THROW(system_error, "open(): " + path);
+              }
+            }
+            fd = of.fd;
+          }
+
+          write_fragment(fd, path, f.file_offset, ranges[i].get());
+
+          std::lock_guard lock(output_mx);
+          if (--of.pending == 0) {
+            auto done = std::exchange(of.fd, -1);
+            closefd(done);
+          }
+        }
+      } catch (...) {
+        LOG_ERROR << folly::exceptionStr(std::current_exception());
+        abort = true;
+      }
+    });
+
+    first = last;
+  }
+
+  writers.wait();
+
+  if (abort) {
+    DWARFS_THROW(runtime_error, "extraction aborted");
+  }
+
+  bool const set_owner = ::geteuid() == 0;
+
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    auto const& [path, st] = *it;
+
+    // chown() must come first, it may clear the set-id bits
+    if (set_owner && ::lchown(path.c_str(), st.st_uid, st.st_gid) != 0) {
+      LOG_WARN << "lchown(): " << path << ": " << ::strerror(errno);
+    }
+
+    if (!S_ISLNK(st.st_mode) && ::chmod(path.c_str(), st.st_mode & 07777) != 0) {
+      LOG_WARN << "chmod(): " << path << ": " << ::strerror(errno);
+    }
+
+    std::array<struct ::timespec, 2> times{st.st_atim, st.st_mtim};
+
+    if (::utimensat(AT_FDCWD, path.c_str(), times.data(),
+                    AT_SYMLINK_NOFOLLOW) != 0) {
+      LOG_WARN << "utimensat(): " << path << ": " << ::strerror(errno);
+    }
+  }
+}
+
 template <typename LoggerPolicy>
 void filesystem_extractor_<LoggerPolicy>::extract(filesystem_v2 const& fs,
                                                   size_t max_queued_bytes) {
+  if (num_writers_ > 0) {
+    extract_parallel(fs, max_queued_bytes);
+    return;
+  }
+
   DWARFS_CHECK(a_, "filesystem not opened");
 
+  auto const selected = select_entries(fs);
   auto lr = ::archive_entry_linkresolver_new();
 
   SCOPE_EXIT { ::archive_entry_linkresolver_free(lr); };
@@ -264,7 +682,8 @@ void filesystem_extractor_<LoggerPolicy>::extract(filesystem_v2 const& fs,
 
   fs.walk_data_order([&](auto entry) {
     // TODO: we can surely early abort walk() somehow
-    if (entry.is_root() || abort) {
+    if (entry.is_root() || abort ||
+        (selected && selected->count(entry.self_index()) == 0)) {
       return;
     }
 
@@ -304,17 +723,32 @@ void filesystem_extractor_<LoggerPolicy>::extract(filesystem_v2 const& fs,
     }
   });
 
+  // Unless we're filtering, we're visiting *all* hardlinks and should
+  // never see any deferred entries.
+  bool unexpected_deferred = false;
+
+  for (;;) {
+    ::archive_entry* ae = nullptr;
+    ::archive_entry_linkify(lr, &ae, &spare);
+    if (!ae) {
+      break;
+    }
+    auto ev = selected ? fs.find(::archive_entry_ino(ae)) : std::nullopt;
+    if (!ev) {
+      ::archive_entry_free(ae);
+      unexpected_deferred = true;
+      break;
+    }
+    do_archive(ae, *ev);
+  }
+
   archiver.wait();
 
   if (abort) {
     DWARFS_THROW(runtime_error, "extraction aborted");
   }
 
-  // As we're visiting *all* hardlinks, we should never see any deferred
-  // entries.
-  ::archive_entry* ae = nullptr;
-  ::archive_entry_linkify(lr, &ae, &spare);
-  if (ae) {
+  if (unexpected_deferred) {
     DWARFS_THROW(runtime_error, "unexpected deferred entry");
   }
 }
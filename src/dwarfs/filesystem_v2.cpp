@@ -19,13 +19,24 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <optional>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
 #include <sys/mman.h>
 #include <sys/statvfs.h>
+#include <unistd.h>
 
 #include <boost/system/system_error.hpp>
 
@@ -36,6 +47,8 @@
 #include "dwarfs/block_cache.h"
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/checksum.h"
+#include "dwarfs/disk_cache.h"
 #include "dwarfs/error.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
@@ -47,8 +60,11 @@
 #include "dwarfs/mmif.h"
 #include "dwarfs/options.h"
 #include "dwarfs/progress.h"
+#include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
 
+#include "dwarfs/gen-cpp2/metadata_types.h"
+
 namespace dwarfs {
 
 namespace {
@@ -63,17 +79,29 @@ class filesystem_parser {
     static constexpr std::array<char, 7> magic{
         {'D', 'W', 'A', 'R', 'F', 'S', MAJOR_VERSION}};
 
+    // The image is searched in steps, so an image that is fetched on
+    // demand only needs to be populated up to the filesystem header
+    static constexpr size_t kSearchStep{1 << 20};
+
     off_t start = 0;
     for (;;) {
       if (start + magic.size() >= mm.size()) {
         break;
       }
 
+      auto len = std::min(kSearchStep, mm.size() - start);
+      mm.populate(start, len);
+
       auto ps = mm.as<void>(start);
-      auto pc = ::memmem(ps, mm.size() - start, magic.data(), magic.size());
+      auto pc = ::memmem(ps, len, magic.data(), magic.size());
 
       if (!pc) {
-        break;
+        if (start + len >= mm.size()) {
+          break;
+        }
+        // the magic may cross the end of this step
+        start += len - (magic.size() - 1);
+        continue;
       }
 
       off_t pos = start + static_cast<uint8_t const*>(pc) -
@@ -83,6 +111,7 @@ class filesystem_parser {
         break;
       }
 
+      mm.populate(pos, sizeof(section_header_v2));
       auto fh = mm.as<file_header>(pos);
 
       if (fh->minor < 2) {
@@ -110,6 +139,8 @@ class filesystem_parser {
         }
 
         ps = mm.as<void>(pos + sh->length + sizeof(section_header_v2));
+        mm.populate(pos + sh->length + sizeof(section_header_v2),
+                    sizeof(section_header_v2));
 
         if (::memcmp(ps, magic.data(), magic.size()) == 0 and
             reinterpret_cast<section_header_v2 const*>(ps)->number == 1) {
@@ -130,6 +161,7 @@ class filesystem_parser {
       DWARFS_THROW(runtime_error, "file too small");
     }
 
+    mm_->populate(image_offset_, sizeof(file_header));
     auto fh = mm_->as<file_header>(image_offset_);
 
     if (::memcmp(&fh->magic[0], "DWARFS", 6) != 0) {
@@ -148,10 +180,23 @@ class filesystem_parser {
     major_ = fh->major;
     minor_ = fh->minor;
 
+    if (version_ >= 2) {
+      find_section_index();
+    }
+
     rewind();
   }
 
   std::optional<fs_section> next_section() {
+    if (!index_.empty()) {
+      if (index_pos_ < index_.size()) {
+        auto const& [type, offset, size] = index_[index_pos_++];
+        return fs_section(mm_, type, image_offset_ + offset, size, version_);
+      }
+
+      return std::nullopt;
+    }
+
     if (offset_ < static_cast<off_t>(mm_->size())) {
       auto section = fs_section(*mm_, offset_, version_);
       offset_ = section.end();
@@ -165,24 +210,113 @@ class filesystem_parser {
     if (image_offset_ == 0) {
       return std::nullopt;
     }
+    mm_->populate(0, image_offset_);
     return folly::ByteRange(mm_->as<uint8_t>(), image_offset_);
   }
 
   void rewind() {
     offset_ = image_offset_ + (version_ == 1 ? sizeof(file_header) : 0);
+    index_pos_ = 0;
   }
 
+  bool has_section_index() const { return !index_.empty(); }
+
   std::string version() const {
     return fmt::format("{0}.{1} [{2}]", major_, minor_, version_);
   }
 
   off_t image_offset() const { return image_offset_; }
 
+  uint8_t minor_version() const { return minor_; }
+
   bool has_checksums() const { return version_ >= 2; }
 
  private:
+  struct index_entry {
+    section_type type;
+    size_t offset;
+    size_t size;
+  };
+
+  // If the image ends with a valid section index, use it instead of
+  // walking all section headers. Anything that doesn't look right just
+  // makes us fall back to the sequential scan.
+  void find_section_index() {
+    static constexpr uint64_t kOffsetMask = (UINT64_C(1) << 48) - 1;
+
+    auto const image_size = mm_->size() - image_offset_;
+
+    if (image_size < sizeof(section_header_v2) + sizeof(uint64_t)) {
+      return;
+    }
+
+    uint64_t last;
+    mm_->populate(mm_->size() - sizeof(uint64_t), sizeof(uint64_t));
+    ::memcpy(&last, mm_->as<uint8_t>(mm_->size() - sizeof(uint64_t)),
+             sizeof(last));
+
+    if ((last >> 48) != static_cast<uint16_t>(section_type::SECTION_INDEX)) {
+      return;
+    }
+
+    auto const index_offset = last & kOffsetMask;
+
+    if (index_offset + sizeof(section_header_v2) >= image_size) {
+      return;
+    }
+
+    std::optional<fs_section> sec;
+
+    try {
+      sec.emplace(*mm_, image_offset_ + index_offset, version_);
+    } catch (std::exception const&) {
+      return;
+    }
+
+    if (sec->type() != section_type::SECTION_INDEX ||
+        sec->compression() != compression_type::NONE ||
+        sec->end() != mm_->size() || sec->length() % sizeof(uint64_t) != 0 ||
+        !sec->check_fast(*mm_)) {
+      return;
+    }
+
+    auto const num_entries = sec->length() / sizeof(uint64_t);
+    std::vector<index_entry> index;
+    index.reserve(num_entries);
+
+    for (size_t i = 0; i < num_entries; ++i) {
+      uint64_t entry;
+      ::memcpy(&entry, mm_->as<uint8_t>(sec->start() + i * sizeof(entry)),
+               sizeof(entry));
+
+      auto const type = static_cast<section_type>(entry >> 48);
+      auto const offset = entry & kOffsetMask;
+
+      if (!is_valid_section_type(type) ||
+          (!index.empty() &&
+           offset < index.back().offset + sizeof(section_header_v2))) {
+        return;
+      }
+
+      if (!index.empty()) {
+        index.back().size = offset - index.back().offset;
+      }
+
+      index.push_back(index_entry{type, offset, 0});
+    }
+
+    if (index.empty() || index.back().offset != index_offset) {
+      return;
+    }
+
+    index.back().size = image_size - index_offset;
+    index_ = std::move(index);
+  }
+
   std::shared_ptr<mmif> mm_;
   off_t const image_offset_;
+  std::vector<index_entry> index_;
+  size_t index_pos_{0};
   off_t offset_{0};
   int version_{0};
   uint8_t major_{0};
@@ -194,28 +328,148 @@ using section_map = std::unordered_map<section_type, fs_section>;
 size_t
 get_uncompressed_section_size(std::shared_ptr<mmif> mm, fs_section const& sec) {
   std::vector<uint8_t> tmp;
-  block_decompressor bd(sec.compression(), mm->as<uint8_t>(sec.start()),
+  block_decompressor bd(sec.compression(), sec.data(*mm).data(),
                         sec.length(), tmp);
   return bd.uncompressed_size();
 }
 
 folly::ByteRange
 get_section_data(std::shared_ptr<mmif> mm, fs_section const& section,
-                 std::vector<uint8_t>& buffer, bool force_buffer) {
+                 std::vector<uint8_t>& buffer, bool force_buffer,
+                 size_t num_threads = 1) {
   auto compression = section.compression();
-  auto start = section.start();
-  auto length = section.length();
+  auto data = section.data(*mm);
 
   if (!force_buffer && compression == compression_type::NONE) {
-    return mm->range(start, length);
+    return data;
   }
 
-  buffer = block_decompressor::decompress(compression, mm->as<uint8_t>(start),
-                                          length);
+  buffer = block_decompressor::decompress_parallel(compression, data.data(),
+                                                   data.size(), num_threads);
 
   return buffer;
 }
 
+// Digest over the checksums of all blocks of an image, in order. This
+// identifies the exact blocks an image built with `--reference` points
+// into. Old images without section checksums use the block data.
+uint64_t block_digest(mmif& mm, std::vector<fs_section> const& blocks) {
+  checksum cs(checksum::algorithm::XXH3_64);
+
+  for (auto const& s : blocks) {
+    if (auto hash = s.xxh3_64()) {
+      cs.update(&*hash, sizeof(*hash));
+    } else {
+      auto data = s.data(mm);
+      cs.update(data.data(), data.size());
+    }
+  }
+
+  uint64_t digest;
+  cs.finalize(&digest);
+
+  return digest;
+}
+
+// Like get_section_data(), but looks up the decompressed metadata in
+// `cache` first and stores it there after decompressing it. The cache
+// verifies the checksum of the decompressed data stored with each
+// entry, so a corrupt entry is never used. A cache hit keeps the cache
+// entry mapped via `cached`.
+folly::ByteRange
+get_metadata_data(logger& lgr, std::shared_ptr<mmif> mm,
+                  fs_section const& section, std::vector<uint8_t>& buffer,
+                  bool force_buffer, size_t num_threads,
+                  disk_cache const* cache, std::shared_ptr<mmif>& cached) {
+  LOG_PROXY(debug_logger_policy, lgr);
+
+  std::optional<std::string> key;
+
+  if (cache && !force_buffer &&
+      section.compression() != compression_type::NONE) {
+    if (auto xxh = section.xxh3_64()) {
+      key = fmt::format("metadata-{:016x}-{}", *xxh, section.length());
+    }
+  }
+
+  if (key) {
+    if (auto entry = cache->find(*key)) {
+      if (entry->data.size() == get_uncompressed_section_size(mm, section)) {
+        LOG_DEBUG << "using cached metadata " << *key;
+        cached = std::move(entry->mm);
+        return entry->data;
+      }
+      LOG_WARN << "ignoring cached metadata " << *key << " of wrong size";
+    }
+  }
+
+  auto data = get_section_data(mm, section, buffer, force_buffer, num_threads);
+
+  if (key) {
+    // `buffer` outlives the cache, which finishes all writes before
+    // it is destroyed
+    cache->store(*key, data, nullptr);
+  }
+
+  return data;
+}
+
+std::shared_ptr<compression_dictionary const>
+load_dictionary(std::shared_ptr<mmif> mm, fs_section const& section) {
+  std::vector<uint8_t> buffer;
+  auto data = get_section_data(mm, section, buffer, true);
+  return std::make_shared<compression_dictionary>(
+      std::vector<uint8_t>(data.begin(), data.end()));
+}
+
+std::shared_ptr<compression_dictionary const>
+load_dictionary(std::shared_ptr<mmif> mm, section_map const& sections) {
+  if (auto it = sections.find(section_type::BLOCK_DICTIONARY);
+      it != sections.end()) {
+    return load_dictionary(mm, it->second);
+  }
+  return nullptr;
+}
+
+// Apply `op` to all pages overlapping `range`
+template <typename T>
+boost::system::error_code for_pages(folly::ByteRange range, T&& op) {
+  static auto const page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+  boost::system::error_code ec;
+  auto begin = reinterpret_cast<uintptr_t>(range.begin()) & ~(page_size - 1);
+  auto end = reinterpret_cast<uintptr_t>(range.end());
+  if (op(reinterpret_cast<void*>(begin), end - begin) != 0) {
+    ec.assign(errno, boost::system::generic_category());
+  }
+  return ec;
+}
+
+bool is_string_table_section(section_type type) {
+  return type == section_type::METADATA_V2_NAMES ||
+         type == section_type::METADATA_V2_SYMLINKS;
+}
+
+// String table sections are only read, checked and decompressed once
+// the table is first used
+std::function<std::vector<uint8_t>()>
+string_table_loader(std::shared_ptr<mmif> mm, section_map const& sections,
+                    section_type type) {
+  auto it = sections.find(type);
+
+  if (it == sections.end()) {
+    return {};
+  }
+
+  return [mm = std::move(mm), sec = it->second] {
+    if (!sec.check_fast(*mm)) {
+      DWARFS_THROW(runtime_error, "checksum error in section: " + sec.name());
+    }
+    std::vector<uint8_t> buffer;
+    get_section_data(mm, sec, buffer, true);
+    return buffer;
+  };
+}
+
 metadata_v2
 make_metadata(logger& lgr, std::shared_ptr<mmif> mm,
               section_map const& sections, std::vector<uint8_t>& schema_buffer,
@@ -223,7 +477,10 @@ make_metadata(logger& lgr, std::shared_ptr<mmif> mm,
               const metadata_options& options, int inode_offset = 0,
               bool force_buffers = false,
               mlock_mode lock_mode = mlock_mode::NONE,
-              bool force_consistency_check = false) {
+              bool force_consistency_check = false, bool lock_hot = false,
+              bool prefault = false, size_t num_threads = 1,
+              disk_cache const* meta_cache = nullptr,
+              std::shared_ptr<mmif>* cached_meta = nullptr) {
   LOG_PROXY(debug_logger_policy, lgr);
   auto schema_it = sections.find(section_type::METADATA_V2_SCHEMA);
   auto meta_it = sections.find(section_type::METADATA_V2);
@@ -238,10 +495,24 @@ make_metadata(logger& lgr, std::shared_ptr<mmif> mm,
 
   auto& meta_section = meta_it->second;
 
+  std::shared_ptr<mmif> cached;
   auto meta_section_range =
-      get_section_data(mm, meta_section, meta_buffer, force_buffers);
+      get_metadata_data(lgr, mm, meta_section, meta_buffer, force_buffers,
+                        num_threads, meta_cache, cached);
+
+  if (cached_meta) {
+    *cached_meta = std::move(cached);
+  }
 
-  if (lock_mode != mlock_mode::NONE) {
+  if (prefault && !meta_section_range.empty()) {
+    if (auto ec = for_pages(meta_section_range, [](void* addr, size_t size) {
+          return ::madvise(addr, size, MADV_WILLNEED);
+        })) {
+      LOG_WARN << "madvise(MADV_WILLNEED) failed: " << ec.message();
+    }
+  }
+
+  if (lock_mode != mlock_mode::NONE && !lock_hot) {
     if (auto ec = mm->lock(meta_section.start(), meta_section_range.size())) {
       if (lock_mode == mlock_mode::MUST) {
         DWARFS_THROW(system_error, "mlock");
@@ -258,10 +529,37 @@ make_metadata(logger& lgr, std::shared_ptr<mmif> mm,
     }
   }
 
-  return metadata_v2(
+  metadata_string_tables tables;
+  tables.names =
+      string_table_loader(mm, sections, section_type::METADATA_V2_NAMES);
+  tables.symlinks =
+      string_table_loader(mm, sections, section_type::METADATA_V2_SYMLINKS);
+
+  metadata_v2 meta(
       lgr,
       get_section_data(mm, schema_it->second, schema_buffer, force_buffers),
-      meta_section_range, options, inode_offset, force_consistency_check);
+      meta_section_range, options, inode_offset, force_consistency_check,
+      tables);
+
+  if (lock_mode != mlock_mode::NONE && lock_hot) {
+    size_t locked = 0;
+
+    for (auto const& r : meta.hot_ranges()) {
+      if (auto ec = for_pages(r, ::mlock)) {
+        if (lock_mode == mlock_mode::MUST) {
+          DWARFS_THROW(system_error, "mlock");
+        }
+        LOG_WARN << "mlock() failed: " << ec.message();
+        break;
+      }
+      locked += r.size();
+    }
+
+    LOG_DEBUG << "locked " << size_with_unit(locked) << " of "
+              << size_with_unit(meta_section_range.size()) << " metadata";
+  }
+
+  return meta;
 }
 
 template <typename LoggerPolicy>
@@ -271,11 +569,27 @@ class filesystem_ final : public filesystem_v2::impl {
               const filesystem_options& options, int inode_offset);
 
   void dump(std::ostream& os, int detail_level) const override;
+  void dump_block_map(std::ostream& os) const override;
   folly::dynamic metadata_as_dynamic() const override;
+  void write_metadata_as_json(std::ostream& os) const override {
+    meta_.write_as_json(os);
+  }
   std::string serialize_metadata_as_json(bool simple) const override;
   void walk(std::function<void(dir_entry_view)> const& func) const override;
   void walk_data_order(
       std::function<void(dir_entry_view)> const& func) const override;
+  void walk_batched(dir_entry_batch_func const& func,
+                    size_t batch_size) const override {
+    meta_.walk_batched(func, batch_size);
+  }
+  void walk_data_order_batched(dir_entry_batch_func const& func,
+                               size_t batch_size) const override {
+    meta_.walk_data_order_batched(func, batch_size);
+  }
+  void walk_parallel(worker_group& wg, dir_entry_batch_func const& func,
+                     size_t batch_size) const override {
+    meta_.walk_parallel(wg, func, batch_size);
+  }
   std::optional<inode_view> find(const char* path) const override;
   std::optional<inode_view> find(int inode) const override;
   std::optional<inode_view> find(int inode, const char* name) const override;
@@ -284,6 +598,9 @@ class filesystem_ final : public filesystem_v2::impl {
   std::optional<directory_view> opendir(inode_view entry) const override;
   std::optional<std::pair<inode_view, std::string>>
   readdir(directory_view dir, size_t offset) const override;
+  void readdir(directory_view dir, size_t offset,
+               std::function<bool(size_t, inode_view, std::string_view)> const&
+                   func) const override;
   size_t dirsize(directory_view dir) const override;
   int readlink(inode_view entry, std::string* buf) const override;
   folly::Expected<std::string, int> readlink(inode_view entry) const override;
@@ -295,8 +612,41 @@ class filesystem_ final : public filesystem_v2::impl {
                 off_t offset) const override;
   folly::Expected<std::vector<std::future<block_range>>, int>
   readv(uint32_t inode, size_t size, off_t offset) const override;
+  read_handle read_async(uint32_t inode, size_t size, off_t offset,
+                         read_callback done) const override;
+  read_handle read_batch(std::vector<file_read_request> const& reads,
+                         batch_read_callback done) const override;
+  std::optional<std::vector<image_range>>
+  image_ranges(uint32_t inode, size_t size, off_t offset) const override;
   std::optional<folly::ByteRange> header() const override;
+  off_t seek(uint32_t inode, off_t offset, int whence) const override;
+  std::optional<chunk_range> get_chunks(uint32_t inode) const override {
+    return meta_.get_chunks(inode);
+  }
+  size_t block_size() const override { return meta_.block_size(); }
+  size_t num_blocks() const override { return blocks_.size(); }
+  uint64_t block_digest() const override {
+    return dwarfs::block_digest(*mm_, blocks_);
+  }
+  std::optional<double>
+  block_compression_ratio(size_t block_no) const override;
+  void copy_blocks(filesystem_writer& writer,
+                   std::vector<size_t> const& blocks) const override;
   void set_num_workers(size_t num) override { ir_.set_num_workers(num); }
+  void set_cache_size(size_t max_bytes) override {
+    ir_.set_cache_size(max_bytes);
+  }
+  void prefetch_blocks(std::vector<size_t> const& blocks) const override {
+    ir_.prefetch_blocks(blocks);
+  }
+  std::vector<uint32_t> block_access_counts() const override {
+    return ir_.block_access_counts();
+  }
+  block_cache_stats cache_stats() const override { return ir_.cache_stats(); }
+  std::future<block_range>
+  read_block(size_t block_no, size_t offset, size_t size) const override {
+    return ir_.read_block(block_no, offset, size);
+  }
 
  private:
   LOG_PROXY_DECL(LoggerPolicy);
@@ -304,7 +654,11 @@ class filesystem_ final : public filesystem_v2::impl {
   metadata_v2 meta_;
   inode_reader_v2 ir_;
   std::vector<uint8_t> meta_buffer_;
+  std::shared_ptr<mmif> cached_meta_;
   std::optional<folly::ByteRange> header_;
+  std::vector<fs_section> blocks_;
+  std::shared_ptr<compression_dictionary const> dict_;
+  bool has_dictionary_{false};
   filesystem_info fsinfo_;
 };
 
@@ -315,7 +669,10 @@ filesystem_<LoggerPolicy>::filesystem_(logger& lgr, std::shared_ptr<mmif> mm,
     : LOG_PROXY_INIT(lgr)
     , mm_(std::move(mm)) {
   filesystem_parser parser(mm_, options.image_offset);
-  block_cache cache(lgr, mm_, options.block_cache);
+  block_cache cache =
+      options.shared_block_cache
+          ? block_cache(options.shared_block_cache, mm_)
+          : block_cache(lgr, mm_, options.block_cache);
 
   header_ = parser.header();
 
@@ -325,12 +682,18 @@ filesystem_<LoggerPolicy>::filesystem_(logger& lgr, std::shared_ptr<mmif> mm,
     LOG_DEBUG << "section " << s->description() << " @ " << s->start() << " ["
               << s->length() << " bytes]";
     if (s->type() == section_type::BLOCK) {
-      cache.insert(*s);
+      // the uncompressed size is only determined when needed, as that
+      // requires reading from every single block
+      blocks_.push_back(*s);
       ++fsinfo_.block_count;
       fsinfo_.compressed_block_size += s->length();
-      fsinfo_.uncompressed_block_size += get_uncompressed_section_size(mm_, *s);
+    } else if (s->type() == section_type::PADDING) {
+      if (fsinfo_.block_alignment == 0 && s->length() >= sizeof(uint32_t)) {
+        ::memcpy(&fsinfo_.block_alignment, s->data(*mm_).data(),
+                 sizeof(uint32_t));
+      }
     } else {
-      if (!s->check_fast(*mm_)) {
+      if (!is_string_table_section(s->type()) && !s->check_fast(*mm_)) {
         DWARFS_THROW(runtime_error, "checksum error in section: " + s->name());
       }
 
@@ -347,22 +710,87 @@ filesystem_<LoggerPolicy>::filesystem_(logger& lgr, std::shared_ptr<mmif> mm,
   }
 
   std::vector<uint8_t> schema_buffer;
+  std::unique_ptr<disk_cache> meta_cache;
+
+  if (!options.metadata_cache_dir.empty()) {
+    meta_cache =
+        std::make_unique<disk_cache>(lgr, options.metadata_cache_dir, 0);
+  }
 
   meta_ = make_metadata(lgr, mm_, sections, schema_buffer, meta_buffer_,
                         options.metadata, inode_offset, false,
-                        options.lock_mode, !parser.has_checksums());
+                        options.lock_mode, !parser.has_checksums(),
+                        options.lock_hot_metadata, options.prefault_metadata,
+                        options.metadata_threads > 0
+                            ? options.metadata_threads
+                            : std::thread::hardware_concurrency(),
+                        meta_cache.get(), &cached_meta_);
+
+  if (auto ref_blocks = meta_.reference_block_count(); ref_blocks > 0) {
+    if (!options.reference_image) {
+      DWARFS_THROW(runtime_error,
+                   "image requires a reference image with " +
+                       std::to_string(ref_blocks) + " blocks");
+    }
+
+    filesystem_parser ref_parser(options.reference_image,
+                                 filesystem_options::IMAGE_OFFSET_AUTO);
+    std::vector<fs_section> ref_sections;
+    std::shared_ptr<compression_dictionary const> ref_dict;
+
+    while (auto s = ref_parser.next_section()) {
+      if (s->type() == section_type::BLOCK) {
+        ref_sections.push_back(*s);
+      } else if (s->type() == section_type::BLOCK_DICTIONARY) {
+        ref_dict = load_dictionary(options.reference_image, *s);
+      }
+    }
+
+    if (ref_sections.size() != ref_blocks) {
+      DWARFS_THROW(runtime_error, "reference image has " +
+                                      std::to_string(ref_sections.size()) +
+                                      " blocks, expected " +
+                                      std::to_string(ref_blocks));
+    }
+
+    if (auto expected = meta_.reference_block_digest()) {
+      if (dwarfs::block_digest(*options.reference_image, ref_sections) !=
+          *expected) {
+        DWARFS_THROW(runtime_error,
+                     "reference image does not match the image it was "
+                     "built against");
+      }
+    }
+
+    for (auto const& s : ref_sections) {
+      cache.insert(s, options.reference_image, ref_dict);
+    }
+  }
+
+  dict_ = load_dictionary(mm_, sections);
+  has_dictionary_ = static_cast<bool>(dict_);
+
+  for (auto const& s : blocks_) {
+    cache.insert(s, mm_, dict_);
+  }
 
   LOG_DEBUG << "read " << cache.block_count() << " blocks and " << meta_.size()
             << " bytes of metadata";
 
   cache.set_block_size(meta_.block_size());
 
-  ir_ = inode_reader_v2(lgr, std::move(cache));
+  ir_ = inode_reader_v2(lgr, std::move(cache), options.inode_reader);
 }
 
 template <typename LoggerPolicy>
 void filesystem_<LoggerPolicy>::dump(std::ostream& os, int detail_level) const {
-  meta_.dump(os, detail_level, fsinfo_,
+  auto fsinfo = fsinfo_;
+
+  for (auto const& s : blocks_) {
+    fsinfo.uncompressed_block_size += get_uncompressed_section_size(mm_, s);
+  }
+
+  meta_.dump(os, detail_level, fsinfo,
              [&](const std::string& indent, uint32_t inode) {
                if (auto chunks = meta_.get_chunks(inode)) {
                  os << indent << chunks->size() << " chunks in inode " << inode
@@ -374,6 +802,95 @@ void filesystem_<LoggerPolicy>::dump(std::ostream& os, int detail_level) const {
              });
 }
 
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::dump_block_map(std::ostream& os) const {
+  auto map = meta_.block_map();
+  auto const ref_blocks = meta_.reference_block_count();
+  auto const num_blocks = ref_blocks + blocks_.size();
+
+  if (map.size() < num_blocks) {
+    map.resize(num_blocks);
+  }
+
+  for (size_t block_no = 0; block_no < map.size(); ++block_no) {
+    auto& ranges = map[block_no];
+    size_t referenced = 0;
+
+    for (auto const& r : ranges) {
+      referenced += r.size;
+    }
+
+    os << "block " << block_no;
+
+    if (block_no < ref_blocks) {
+      os << ": reference block";
+    } else if (block_no < num_blocks) {
+      auto const& s = blocks_[block_no - ref_blocks];
+
+      auto start = std::chrono::steady_clock::now();
+      auto data = block_decompressor::decompress(
+          s.compression(), s.data(*mm_).data(), s.length(),
+          dict_.get());
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      os << ": " << get_compression_name(s.compression()) << ", "
+         << size_with_unit(s.length()) << " -> " << size_with_unit(data.size())
+         << fmt::format(" ({:.2f}%)", 100.0 * s.length() / data.size())
+         << ", decompressed in " << time_with_unit(elapsed.count()) << " ("
+         << size_with_unit(data.size() / std::max(elapsed.count(), 1e-9))
+         << "/s)";
+    } else {
+      os << ": missing";
+    }
+
+    os << ", " << ranges.size() << " ranges, " << size_with_unit(referenced)
+       << " referenced\n";
+
+    for (auto const& r : ranges) {
+      os << "  [" << r.block_offset << ", +" << r.size << "] -> " << r.path
+         << " @ " << r.file_offset << " (inode " << r.inode << ")\n";
+    }
+  }
+}
+
+template <typename LoggerPolicy>
+std::optional<double>
+filesystem_<LoggerPolicy>::block_compression_ratio(size_t block_no) const {
+  auto const ref_blocks = meta_.reference_block_count();
+
+  if (block_no < ref_blocks || block_no - ref_blocks >= blocks_.size()) {
+    return std::nullopt;
+  }
+
+  auto const& s = blocks_[block_no - ref_blocks];
+  std::vector<uint8_t> tmp;
+  block_decompressor bd(s.compression(), s.data(*mm_).data(),
+                        s.length(), tmp, dict_.get());
+
+  return static_cast<double>(s.length()) /
+         std::max<size_t>(bd.uncompressed_size(), 1);
+}
+
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::copy_blocks(
+    filesystem_writer& writer, std::vector<size_t> const& blocks) const {
+  if (has_dictionary_) {
+    DWARFS_THROW(runtime_error,
+                 "cannot copy blocks compressed using a dictionary");
+  }
+
+  for (auto block_no : blocks) {
+    auto const& s = DWARFS_NOTHROW(blocks_.at(block_no));
+
+    if (!s.check_fast(*mm_)) {
+      DWARFS_THROW(runtime_error, "checksum error in section: " + s.name());
+    }
+
+    writer.write_compressed_section(s.type(), s.compression(), s.data(*mm_));
+  }
+}
+
 template <typename LoggerPolicy>
 folly::dynamic filesystem_<LoggerPolicy>::metadata_as_dynamic() const {
   return meta_.as_dynamic();
@@ -438,6 +955,14 @@ filesystem_<LoggerPolicy>::readdir(directory_view dir, size_t offset) const {
   return meta_.readdir(dir, offset);
 }
 
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::readdir(
+    directory_view dir, size_t offset,
+    std::function<bool(size_t, inode_view, std::string_view)> const& func)
+    const {
+  meta_.readdir(dir, offset, func);
+}
+
 template <typename LoggerPolicy>
 size_t filesystem_<LoggerPolicy>::dirsize(directory_view dir) const {
   return meta_.dirsize(dir);
@@ -470,7 +995,7 @@ template <typename LoggerPolicy>
 ssize_t filesystem_<LoggerPolicy>::read(uint32_t inode, char* buf, size_t size,
                                         off_t offset) const {
   if (auto chunks = meta_.get_chunks(inode)) {
-    return ir_.read(buf, size, offset, *chunks);
+    return ir_.read(inode, buf, size, offset, *chunks);
   }
   return -EBADF;
 }
@@ -479,7 +1004,7 @@ template <typename LoggerPolicy>
 ssize_t filesystem_<LoggerPolicy>::readv(uint32_t inode, iovec_read_buf& buf,
                                          size_t size, off_t offset) const {
   if (auto chunks = meta_.get_chunks(inode)) {
-    return ir_.readv(buf, size, offset, *chunks);
+    return ir_.readv(inode, buf, size, offset, *chunks);
   }
   return -EBADF;
 }
@@ -489,11 +1014,74 @@ folly::Expected<std::vector<std::future<block_range>>, int>
 filesystem_<LoggerPolicy>::readv(uint32_t inode, size_t size,
                                  off_t offset) const {
   if (auto chunks = meta_.get_chunks(inode)) {
-    return ir_.readv(size, offset, *chunks);
+    return ir_.readv(inode, size, offset, *chunks);
   }
   return folly::makeUnexpected(-EBADF);
 }
 
+template <typename LoggerPolicy>
+read_handle
+filesystem_<LoggerPolicy>::read_async(uint32_t inode, size_t size,
+                                      off_t offset, read_callback done) const {
+  if (auto chunks = meta_.get_chunks(inode)) {
+    return ir_.read_async(inode, size, offset, *chunks, std::move(done));
+  }
+  done(folly::makeUnexpected(-EBADF));
+  return read_handle();
+}
+
+template <typename LoggerPolicy>
+read_handle filesystem_<LoggerPolicy>::read_batch(
+    std::vector<file_read_request> const& reads,
+    batch_read_callback done) const {
+  std::vector<inode_read_request> requests;
+  requests.reserve(reads.size());
+
+  for (auto const& r : reads) {
+    requests.push_back({r.inode, r.size, r.offset, meta_.get_chunks(r.inode)});
+  }
+
+  return ir_.read_batch(requests, std::move(done));
+}
+
+template <typename LoggerPolicy>
+std::optional<std::vector<image_range>>
+filesystem_<LoggerPolicy>::image_ranges(uint32_t inode, size_t size,
+                                        off_t offset) const {
+  if (auto chunks = meta_.get_chunks(inode)) {
+    return ir_.image_ranges(size, offset, *chunks);
+  }
+  return std::nullopt;
+}
+
+template <typename LoggerPolicy>
+off_t filesystem_<LoggerPolicy>::seek(uint32_t inode, off_t offset,
+                                      int whence) const {
+  auto chunks = meta_.get_chunks(inode);
+
+  if (!chunks) {
+    return -EBADF;
+  }
+
+  if (offset < 0 || (whence != SEEK_DATA && whence != SEEK_HOLE)) {
+    return -EINVAL;
+  }
+
+  bool const want_hole = whence == SEEK_HOLE;
+  off_t pos = 0;
+
+  for (auto const& c : *chunks) {
+    off_t end = pos + c.size();
+    if (offset < end && (c.block() == HOLE_BLOCK) == want_hole) {
+      return std::max(pos, offset);
+    }
+    pos = end;
+  }
+
+  // there's an implicit hole at the end of each file
+  return offset < pos && want_hole ? pos : -ENXIO;
+}
+
 template <typename LoggerPolicy>
 std::optional<folly::ByteRange> filesystem_<LoggerPolicy>::header() const {
   return header_;
@@ -514,7 +1102,6 @@ filesystem_v2::filesystem_v2(logger& lgr, std::shared_ptr<mmif> mm,
 void filesystem_v2::rewrite(logger& lgr, progress& prog,
                             std::shared_ptr<mmif> mm, filesystem_writer& writer,
                             rewrite_options const& opts) {
-  // TODO:
   LOG_PROXY(debug_logger_policy, lgr);
   filesystem_parser parser(mm, opts.image_offset);
 
@@ -522,60 +1109,233 @@ void filesystem_v2::rewrite(logger& lgr, progress& prog,
     writer.copy_header(*hdr);
   }
 
+  // the image may contain holes, which must still be rejected by
+  // versions that don't support them
+  if (parser.minor_version() > COMPAT_MINOR_VERSION) {
+    writer.enable_feature(image_feature::SPARSE_FILES);
+  }
+
   std::vector<section_type> section_types;
+  std::vector<fs_section> blocks;
   section_map sections;
 
+  auto check_section = [&mm](fs_section const& s) {
+    if (!s.check_fast(*mm)) {
+      DWARFS_THROW(runtime_error, "checksum error in section: " + s.name());
+    }
+    if (!s.verify(*mm)) {
+      DWARFS_THROW(runtime_error,
+                   "integrity check error in section: " + s.name());
+    }
+  };
+
+  auto const& ranges = opts.recompress_block_ranges;
+
+  auto recompress_block = [&](size_t block_no) {
+    if (!opts.recompress_block) {
+      return false;
+    }
+    if (ranges.empty()) {
+      return true;
+    }
+    return std::any_of(ranges.begin(), ranges.end(), [=](auto const& r) {
+      return block_no >= r.first && block_no < r.second;
+    });
+  };
+
   while (auto s = parser.next_section()) {
     LOG_DEBUG << "section " << s->description() << " @ " << s->start() << " ["
               << s->length() << " bytes]";
-    if (!s->check_fast(*mm)) {
-      DWARFS_THROW(runtime_error, "checksum error in section: " + s->name());
-    }
-    if (!s->verify(*mm)) {
-      DWARFS_THROW(runtime_error,
-                   "integrity check error in section: " + s->name());
+    // blocks are checked by the rewrite workers below
+    if (s->type() != section_type::BLOCK) {
+      check_section(*s);
     }
     prog.original_size += s->length();
     prog.filesystem_size += s->length();
     if (s->type() == section_type::BLOCK) {
       ++prog.block_count;
+      blocks.push_back(*s);
+    } else if (s->type() == section_type::PADDING) {
+      // the writer adds its own padding if needed
     } else {
       if (!sections.emplace(s->type(), *s).second) {
         DWARFS_THROW(runtime_error, "duplicate section: " + s->name());
       }
-      section_types.push_back(s->type());
+      // the writer creates its own section index if needed
+      if (s->type() != section_type::BLOCK_DICTIONARY &&
+          s->type() != section_type::SECTION_INDEX) {
+        section_types.push_back(s->type());
+      }
     }
   }
 
+  auto dict = load_dictionary(mm, sections);
+
+  // blocks that aren't recompressed still need their dictionary
+  if (dict && (!opts.recompress_block || !ranges.empty())) {
+    auto& sec = DWARFS_NOTHROW(sections.at(section_type::BLOCK_DICTIONARY));
+    writer.write_compressed_section(section_type::BLOCK_DICTIONARY,
+                                    sec.compression(), sec.data(*mm));
+  }
+
   std::vector<uint8_t> schema_raw;
   std::vector<uint8_t> meta_raw;
 
   // force metadata check
   auto meta =
       make_metadata(lgr, mm, sections, schema_raw, meta_raw, metadata_options(),
-                    0, true, mlock_mode::NONE, !parser.has_checksums());
+                    0, true, mlock_mode::NONE, !parser.has_checksums(), false,
+                    false, opts.num_workers);
+
+  if (meta.reference_block_count() > 0) {
+    writer.enable_feature(image_feature::REFERENCE_IMAGE);
+  }
+
+  if (opts.rebuild_metadata) {
+    auto ti = LOG_TIMED_INFO;
+    auto data = meta.unpack();
+    metadata_v2::rebuild(data, *opts.rebuild_metadata, opts.num_workers);
+    // drop the view into the old buffers before replacing them
+    meta = metadata_v2();
+    std::tie(schema_raw, meta_raw) = metadata_v2::freeze(data);
+    ti << "rebuilt metadata";
+  }
+
+  // Select the most frequently accessed blocks for recompression with
+  // the hot compressor, stopping once their uncompressed size would
+  // exceed the budget.
+  std::unique_ptr<block_compressor> hot_bc;
+  std::vector<bool> hot_blocks(blocks.size(), false);
+
+  if (!opts.hot_compression.empty()) {
+    auto const& counts = opts.hot_block_counts;
+    std::vector<size_t> candidates;
+
+    for (size_t i = 0; i < std::min(counts.size(), blocks.size()); ++i) {
+      if (counts[i] > 0 && counts[i] >= opts.hot_min_count) {
+        candidates.push_back(i);
+      }
+    }
+
+    std::stable_sort(
+        candidates.begin(), candidates.end(),
+        [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+
+    size_t hot_bytes = 0;
+    size_t num_hot = 0;
+
+    for (auto i : candidates) {
+      auto& sec = blocks[i];
+      std::vector<uint8_t> unused;
+      block_decompressor bd(sec.compression(), sec.data(*mm).data(),
+                            sec.length(), unused, dict.get());
+      auto size = bd.uncompressed_size();
+
+      if (opts.hot_max_bytes > 0 && hot_bytes + size > opts.hot_max_bytes) {
+        break;
+      }
+
+      hot_bytes += size;
+      hot_blocks[i] = true;
+      ++num_hot;
+    }
+
+    LOG_INFO << "recompressing " << num_hot << " hot blocks ("
+             << size_with_unit(hot_bytes) << ") with " << opts.hot_compression;
+
+    hot_bc = std::make_unique<block_compressor>(opts.hot_compression);
+  }
 
   parser.rewind();
 
-  while (auto s = parser.next_section()) {
-    // TODO: multi-thread this?
-    if (s->type() == section_type::BLOCK) {
-      if (opts.recompress_block) {
-        auto block =
-            std::make_shared<block_data>(block_decompressor::decompress(
-                s->compression(), mm->as<uint8_t>(s->start()), s->length()));
-        writer.write_block(std::move(block));
+  // Blocks are checked and decompressed by a pool of workers, then
+  // handed to the writer in their original order. The writer compresses
+  // in parallel and applies its own memory limit; the window below caps
+  // the number of decompressed blocks waiting to be passed on.
+  worker_group wg("rewrite", std::max<size_t>(opts.num_workers, 1));
+  size_t const max_pending = 2 * wg.size();
+  std::deque<std::tuple<fs_section, block_compressor const*,
+                        std::future<std::shared_ptr<block_data>>>>
+      pending;
+  size_t block_no = 0;
+
+  auto write_next = [&] {
+    auto& [sec, bc, future] = pending.front();
+    // a null block means the section is copied verbatim
+    if (auto block = future.get()) {
+      if (bc) {
+        writer.write_block(std::move(block), *bc);
       } else {
-        writer.write_compressed_section(s->type(), s->compression(),
-                                        s->data(*mm));
+        writer.write_block(std::move(block));
+      }
+    } else {
+      writer.write_compressed_section(sec.type(), sec.compression(),
+                                      sec.data(*mm));
+    }
+    pending.pop_front();
+  };
+
+  while (auto s = parser.next_section()) {
+    if (s->type() != section_type::BLOCK) {
+      continue;
+    }
+
+    bool const hot = hot_blocks[block_no];
+    bool const recompress = hot || recompress_block(block_no);
+    ++block_no;
+
+    std::promise<std::shared_ptr<block_data>> promise;
+    pending.emplace_back(*s, hot ? hot_bc.get() : nullptr,
+                         promise.get_future());
+
+    wg.add_job([&, sec = *s, recompress,
+                promise = std::move(promise)]() mutable {
+      try {
+        // verbatim copies only get the fast checksum check by default,
+        // so a corrupt block isn't written with a new, valid checksum
+        if (recompress || opts.verify_blocks) {
+          check_section(sec);
+        } else if (!sec.check_fast(*mm)) {
+          DWARFS_THROW(runtime_error,
+                       "checksum error in section: " + sec.name());
+        }
+        std::shared_ptr<block_data> block;
+        if (recompress) {
+          block = std::make_shared<block_data>(block_decompressor::decompress(
+              sec.compression(), sec.data(*mm).data(), sec.length(),
+              dict.get()));
+        }
+        promise.set_value(std::move(block));
+      } catch (...) {
+        promise.set_exception(std::current_exception());
       }
+    });
+
+    while (pending.size() >= max_pending) {
+      write_next();
     }
   }
 
-  if (opts.recompress_metadata) {
+  while (!pending.empty()) {
+    write_next();
+  }
+
+  if (opts.recompress_metadata || opts.rebuild_metadata) {
     writer.write_metadata_v2_schema(
         std::make_shared<block_data>(std::move(schema_raw)));
     writer.write_metadata_v2(std::make_shared<block_data>(std::move(meta_raw)));
+
+    // rebuilt metadata contains the string tables
+    if (!opts.rebuild_metadata) {
+      for (auto type : section_types) {
+        if (is_string_table_section(type)) {
+          std::vector<uint8_t> buffer;
+          get_section_data(mm, DWARFS_NOTHROW(sections.at(type)), buffer, true);
+          writer.write_string_table(
+              type, std::make_shared<block_data>(std::move(buffer)));
+        }
+      }
+    }
   } else {
     for (auto type : section_types) {
       auto& sec = DWARFS_NOTHROW(sections.at(type));
@@ -664,6 +1424,79 @@ int filesystem_v2::identify(logger& lgr, std::shared_ptr<mmif> mm,
   return errors;
 }
 
+int filesystem_v2::verify_integrity(logger& lgr, std::shared_ptr<mmif> mm,
+                                    integrity_check_options const& opts) {
+  LOG_PROXY(debug_logger_policy, lgr);
+  auto ti = LOG_TIMED_INFO;
+  filesystem_parser parser(mm, opts.image_offset);
+
+  if (auto ec = mm->advise_sequential(0, mm->size())) {
+    LOG_WARN << "madvise(MADV_SEQUENTIAL) failed: " << ec.message();
+  }
+
+  // Sections are handed to the workers in image order, and no more than
+  // window_size bytes are in flight at any time. This keeps the reads
+  // close to sequential. Once a section and everything before it has
+  // been verified, its range is released.
+  worker_group wg("verify", std::max<size_t>(opts.num_workers, 1));
+  std::deque<std::pair<fs_section, std::future<bool>>> pending;
+  size_t pending_bytes = 0;
+  size_t num_sections = 0;
+  size_t total_bytes = 0;
+  int errors = 0;
+
+  auto finish_next = [&] {
+    auto& [s, future] = pending.front();
+
+    try {
+      if (!future.get()) {
+        LOG_ERROR << "integrity check error in section: " << s.description();
+        ++errors;
+      }
+    } catch (std::exception const& e) {
+      LOG_ERROR << "error in section " << s.description() << ": " << e.what();
+      ++errors;
+    }
+
+    pending_bytes -= s.length();
+
+    if (auto ec = mm->release_until(s.end())) {
+      LOG_DEBUG << "release_until() failed: " << ec.message();
+    }
+
+    pending.pop_front();
+  };
+
+  while (auto sp = parser.next_section()) {
+    LOG_DEBUG << "verifying section " << sp->description() << " @ "
+              << sp->start() << " [" << sp->length() << " bytes]";
+
+    while (!pending.empty() &&
+           pending_bytes + sp->length() > opts.window_size) {
+      finish_next();
+    }
+
+    std::packaged_task<bool()> task{
+        [&mm, s = *sp] { return s.check_fast(*mm) && s.verify(*mm); }};
+
+    pending.emplace_back(*sp, task.get_future());
+    pending_bytes += sp->length();
+    total_bytes += sp->length();
+    ++num_sections;
+
+    wg.add_job(std::move(task));
+  }
+
+  while (!pending.empty()) {
+    finish_next();
+  }
+
+  ti << "verified " << num_sections << " sections ("
+     << size_with_unit(total_bytes) << "), " << errors << " errors";
+
+  return errors;
+}
+
 std::optional<folly::ByteRange>
 filesystem_v2::header(std::shared_ptr<mmif> mm) {
   return header(std::move(mm), filesystem_options::IMAGE_OFFSET_AUTO);
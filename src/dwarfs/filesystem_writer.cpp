@@ -19,24 +19,35 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <folly/Range.h>
+#include <folly/ScopeGuard.h>
 #include <folly/system/ThreadName.h>
 
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/buffer_pool.h"
 #include "dwarfs/checksum.h"
 #include "dwarfs/filesystem_writer.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/memory_accountant.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
@@ -45,15 +56,74 @@ namespace dwarfs {
 
 namespace {
 
+using compressor_selector =
+    std::function<block_compressor const&(folly::ByteRange)>;
+
+// Called with the final size of a section once it has been compressed
+using compression_callback = std::function<void(size_t)>;
+
+/**
+ * Estimate the order-0 entropy of a block in bits per byte
+ *
+ * Only a number of evenly spaced slices of the block are looked at,
+ * which is good enough to tell text from binary from compressed data.
+ */
+double estimate_entropy(folly::ByteRange data) {
+  static constexpr size_t kNumSlices = 16;
+  static constexpr size_t kSliceSize = 4096;
+
+  std::array<size_t, 256> hist{};
+  size_t total = 0;
+
+  auto add = [&](folly::ByteRange r) {
+    for (auto c : r) {
+      ++hist[c];
+    }
+    total += r.size();
+  };
+
+  if (data.size() <= kNumSlices * kSliceSize) {
+    add(data);
+  } else {
+    auto const stride = data.size() / kNumSlices;
+    for (size_t i = 0; i < kNumSlices; ++i) {
+      add(data.subpiece(i * stride, kSliceSize));
+    }
+  }
+
+  if (total == 0) {
+    return 0.0;
+  }
+
+  double entropy = 0.0;
+
+  for (auto n : hist) {
+    if (n > 0) {
+      auto p = static_cast<double>(n) / total;
+      entropy -= p * std::log2(p);
+    }
+  }
+
+  return entropy;
+}
+
 class fsblock {
  public:
   fsblock(section_type type, block_compressor const& bc,
-          std::shared_ptr<block_data>&& data, uint32_t number);
+          std::shared_ptr<block_data>&& data, uint32_t number,
+          compressor_selector select = {}, buffer_pool* pool = nullptr,
+          memory_accountant* memory = nullptr,
+          std::atomic<size_t>* running = nullptr);
 
   fsblock(section_type type, compression_type compression,
           folly::ByteRange data, uint32_t number);
 
-  void compress(worker_group& wg) { impl_->compress(wg); }
+  void compress(worker_group& wg, compression_callback done = {}) {
+    impl_->compress(wg, std::move(done));
+  }
+  // Compresses the block and computes its checksums in the calling
+  // thread; for small sections whose header is needed right away
+  void compress_inline() { impl_->compress_inline(); }
   void wait_until_compressed() { impl_->wait_until_compressed(); }
   section_type type() const { return impl_->type(); }
   compression_type compression() const { return impl_->compression(); }
@@ -63,11 +133,15 @@ class fsblock {
   uint32_t number() const { return impl_->number(); }
   section_header_v2 const& header() const { return impl_->header(); }
 
+  void set_category(std::string category) { category_ = std::move(category); }
+  std::string const& category() const { return category_; }
+
   class impl {
    public:
     virtual ~impl() = default;
 
-    virtual void compress(worker_group& wg) = 0;
+    virtual void compress(worker_group& wg, compression_callback done) = 0;
+    virtual void compress_inline() = 0;
     virtual void wait_until_compressed() = 0;
     virtual section_type type() const = 0;
     virtual compression_type compression() const = 0;
@@ -83,41 +157,62 @@ class fsblock {
 
  private:
   std::unique_ptr<impl> impl_;
+  std::string category_;
 };
 
 class raw_fsblock : public fsblock::impl {
  public:
   raw_fsblock(section_type type, const block_compressor& bc,
-              std::shared_ptr<block_data>&& data, uint32_t number)
+              std::shared_ptr<block_data>&& data, uint32_t number,
+              compressor_selector select, buffer_pool* pool,
+              memory_accountant* memory, std::atomic<size_t>* running)
       : type_{type}
-      , bc_{bc}
+      , bc_{&bc}
+      , select_{std::move(select)}
+      , pool_{pool}
+      , memory_{memory}
+      , running_{running}
       , uncompressed_size_{data->size()}
       , data_{std::move(data)}
       , number_{number}
-      , comp_type_{bc_.type()} {}
+      , comp_type_{bc_->type()} {}
+
+  ~raw_fsblock() override {
+    // the compressed data is ours, so hand the buffer back for reuse
+    if (pool_ && compressed_ && data_.use_count() == 1) {
+      pool_->release(std::move(data_->vec()));
+    }
+  }
 
-  void compress(worker_group& wg) override {
+  void compress(worker_group& wg, compression_callback done) override {
     std::promise<void> prom;
     future_ = prom.get_future();
 
-    wg.add_job([this, prom = std::move(prom)]() mutable {
-      try {
-        auto tmp = std::make_shared<block_data>(bc_.compress(data_->vec()));
-
-        {
-          std::lock_guard lock(mx_);
-          data_.swap(tmp);
-        }
-      } catch (bad_compression_ratio_error const& e) {
-        comp_type_ = compression_type::NONE;
+    wg.add_job([this, &wg, prom = std::move(prom),
+                done = std::move(done)]() mutable {
+      if (running_) {
+        auto const running = ++*running_;
+        SCOPE_EXIT { --*running_; };
+        run_compress(thread_budget(wg, running));
+      } else {
+        run_compress();
       }
 
-      fsblock::build_section_header(header_, *this);
+      if (done) {
+        done(size());
+      }
 
       prom.set_value();
     });
   }
 
+  void compress_inline() override {
+    std::promise<void> prom;
+    future_ = prom.get_future();
+    run_compress();
+    prom.set_value();
+  }
+
   void wait_until_compressed() override { future_.wait(); }
 
   section_type type() const override { return type_; }
@@ -138,8 +233,54 @@ class raw_fsblock : public fsblock::impl {
   section_header_v2 const& header() const override { return header_; }
 
  private:
+  // Once there are fewer blocks waiting than there are workers, e.g. for
+  // the last few blocks of an image, the workers that will soon run out
+  // of work can help compressing the blocks that are still running. The
+  // idle workers are shared among all running blocks, so the number of
+  // threads never exceeds the number of workers by much.
+  static size_t thread_budget(worker_group const& wg, size_t running) {
+    auto const workers = wg.size();
+    auto const busy = running + wg.queue_size();
+    return busy < workers ? 1 + (workers - busy) / running : 1;
+  }
+
+  // compresses the data and builds the section header, including the
+  // checksums; compressors that support it may use up to `num_threads`
+  // threads
+  void run_compress(size_t num_threads = 1) {
+    if (select_) {
+      bc_ = &select_(data_->vec());
+      comp_type_ = bc_->type();
+    }
+
+    try {
+      // the output buffer can grow up to about the input size
+      std::optional<memory_accountant::scoped_charge> charge;
+      if (memory_) {
+        charge.emplace(*memory_, memory_stage::COMPRESSOR, uncompressed_size_);
+      }
+      auto buf = pool_ ? pool_->acquire() : std::vector<uint8_t>();
+      bc_->compress(data_->vec(), buf, num_threads);
+      auto tmp = std::make_shared<block_data>(std::move(buf));
+
+      {
+        std::lock_guard lock(mx_);
+        data_.swap(tmp);
+        compressed_ = true;
+      }
+    } catch (bad_compression_ratio_error const& e) {
+      comp_type_ = compression_type::NONE;
+    }
+
+    fsblock::build_section_header(header_, *this);
+  }
+
   const section_type type_;
-  block_compressor const& bc_;
+  block_compressor const* bc_;
+  compressor_selector const select_;
+  buffer_pool* const pool_;
+  memory_accountant* const memory_;
+  std::atomic<size_t>* const running_;
   const size_t uncompressed_size_;
   mutable std::mutex mx_;
   std::shared_ptr<block_data> data_;
@@ -147,6 +288,7 @@ class raw_fsblock : public fsblock::impl {
   uint32_t const number_;
   section_header_v2 header_;
   compression_type comp_type_;
+  bool compressed_{false};
 };
 
 class compressed_fsblock : public fsblock::impl {
@@ -158,16 +300,27 @@ class compressed_fsblock : public fsblock::impl {
       , range_{range}
       , number_{number} {}
 
-  void compress(worker_group& wg) override {
+  void compress(worker_group& wg, compression_callback done) override {
     std::promise<void> prom;
     future_ = prom.get_future();
 
-    wg.add_job([this, prom = std::move(prom)]() mutable {
+    wg.add_job([this, prom = std::move(prom),
+                done = std::move(done)]() mutable {
       fsblock::build_section_header(header_, *this);
+      if (done) {
+        done(range_.size());
+      }
       prom.set_value();
     });
   }
 
+  void compress_inline() override {
+    std::promise<void> prom;
+    future_ = prom.get_future();
+    fsblock::build_section_header(header_, *this);
+    prom.set_value();
+  }
+
   void wait_until_compressed() override { future_.wait(); }
 
   section_type type() const override { return type_; }
@@ -192,8 +345,12 @@ class compressed_fsblock : public fsblock::impl {
 };
 
 fsblock::fsblock(section_type type, block_compressor const& bc,
-                 std::shared_ptr<block_data>&& data, uint32_t number)
-    : impl_(std::make_unique<raw_fsblock>(type, bc, std::move(data), number)) {}
+                 std::shared_ptr<block_data>&& data, uint32_t number,
+                 compressor_selector select, buffer_pool* pool,
+                 memory_accountant* memory, std::atomic<size_t>* running)
+    : impl_(std::make_unique<raw_fsblock>(type, bc, std::move(data), number,
+                                          std::move(select), pool, memory,
+                                          running)) {}
 
 fsblock::fsblock(section_type type, compression_type compression,
                  folly::ByteRange data, uint32_t number)
@@ -206,7 +363,8 @@ void fsblock::build_section_header(section_header_v2& sh,
 
   ::memcpy(&sh.magic[0], "DWARFS", 6);
   sh.major = MAJOR_VERSION;
-  sh.minor = MINOR_VERSION;
+  // the writer may bump this, it's not part of the checksums
+  sh.minor = COMPAT_MINOR_VERSION;
   sh.number = fsb.number();
   sh.type = static_cast<uint16_t>(fsb.type());
   sh.compression = static_cast<uint16_t>(fsb.compression());
@@ -237,9 +395,20 @@ class filesystem_writer_ final : public filesystem_writer::impl {
   ~filesystem_writer_() noexcept override;
 
   void copy_header(folly::ByteRange header) override;
-  void write_block(std::shared_ptr<block_data>&& data) override;
+  void enable_feature(image_feature feature) override {
+    features_ |= 1u << static_cast<unsigned>(feature);
+  }
+  void write_block(std::shared_ptr<block_data>&& data,
+                   std::string const& category) override;
+  void write_block(std::shared_ptr<block_data>&& data,
+                   block_compressor const& bc,
+                   std::string const& category) override;
+  void
+  write_dictionary(std::shared_ptr<compression_dictionary const> dict) override;
   void write_metadata_v2_schema(std::shared_ptr<block_data>&& data) override;
   void write_metadata_v2(std::shared_ptr<block_data>&& data) override;
+  void write_string_table(section_type type,
+                          std::shared_ptr<block_data>&& data) override;
   void write_compressed_section(section_type type, compression_type compression,
                                 folly::ByteRange data) override;
   void flush() override;
@@ -248,14 +417,36 @@ class filesystem_writer_ final : public filesystem_writer::impl {
 
  private:
   void write_section(section_type type, std::shared_ptr<block_data>&& data,
-                     block_compressor const& bc);
+                     block_compressor const& bc,
+                     compressor_selector select = {},
+                     std::string category = {});
+  block_compressor const& select_compressor(folly::ByteRange data) const;
+  block_compressor const& block_bc() const {
+    return dict_bc_ ? *dict_bc_ : bc_;
+  }
   void write(fsblock const& fsb);
+  void write_header(fsblock const& fsb);
   void write(const char* data, size_t size);
   template <typename T>
   void write(const T& obj);
   void write(folly::ByteRange range);
   void writer_thread();
-  size_t mem_used() const;
+  bool over_budget() const;
+
+  // must be called with mx_ held
+  void add_mem_used(size_t size) {
+    mem_used_ += size;
+    prog_.memory.charge(memory_stage::WRITER, size);
+  }
+
+  void sub_mem_used(size_t size) {
+    mem_used_ -= size;
+    prog_.memory.release(memory_stage::WRITER, size);
+  }
+
+  void write_section_index();
+  void write_padding(uint32_t number);
+  uint32_t next_section_number(section_type type);
 
   std::ostream& os_;
   std::istream* header_;
@@ -265,13 +456,25 @@ class filesystem_writer_ final : public filesystem_writer::impl {
   const block_compressor& schema_bc_;
   const block_compressor& metadata_bc_;
   const filesystem_writer_options options_;
+  std::vector<std::pair<double, std::unique_ptr<block_compressor>>>
+      adaptive_bc_;
+  std::shared_ptr<compression_dictionary const> dict_;
+  std::optional<block_compressor> dict_bc_;
   LOG_PROXY_DECL(LoggerPolicy);
+  buffer_pool pool_;
   std::deque<std::unique_ptr<fsblock>> queue_;
   mutable std::mutex mx_;
   std::condition_variable cond_;
+  size_t mem_used_{0};
+  size_t num_compressing_{0};
+  // blocks currently being compressed by a worker
+  std::atomic<size_t> num_running_{0};
   volatile bool flush_;
   std::thread writer_thread_;
   uint32_t section_number_{0};
+  size_t sections_size_{0};
+  std::vector<uint64_t> section_index_;
+  std::atomic<unsigned> features_{0};
 };
 
 template <typename LoggerPolicy>
@@ -289,8 +492,18 @@ filesystem_writer_<LoggerPolicy>::filesystem_writer_(
     , metadata_bc_(metadata_bc)
     , options_(options)
     , LOG_PROXY_INIT(lgr)
+    , pool_(options.max_queue_size / 4)
     , flush_(false)
     , writer_thread_(&filesystem_writer_::writer_thread, this) {
+  for (auto const& rule : options_.adaptive_compression) {
+    adaptive_bc_.emplace_back(
+        rule.min_entropy, std::make_unique<block_compressor>(rule.compression));
+  }
+
+  // highest threshold first, so the first match wins
+  std::sort(adaptive_bc_.begin(), adaptive_bc_.end(),
+            [](auto const& a, auto const& b) { return a.first > b.first; });
+
   if (header_) {
     if (options_.remove_header) {
       LOG_WARN << "header will not be written because remove_header is set";
@@ -335,8 +548,6 @@ void filesystem_writer_<LoggerPolicy>::writer_thread() {
       queue_.pop_front();
     }
 
-    cond_.notify_one();
-
     fsb->wait_until_compressed();
 
     LOG_DEBUG << get_section_name(fsb->type()) << " compressed from "
@@ -344,18 +555,50 @@ void filesystem_writer_<LoggerPolicy>::writer_thread() {
               << size_with_unit(fsb->size());
 
     write(*fsb);
+
+    if (fsb->type() == section_type::BLOCK) {
+      prog_.add_block_stats({fsb->category(),
+                             get_compression_name(fsb->compression()),
+                             fsb->uncompressed_size(), fsb->size()});
+    }
+
+    {
+      std::lock_guard lock(mx_);
+      sub_mem_used(fsb->size());
+    }
+
+    cond_.notify_all();
   }
 }
 
+/**
+ * Whether producers should wait before queueing another section
+ *
+ * Sections have to be written in order, so a single slow block at the
+ * head of the queue can hold up writing while all blocks behind it are
+ * long done. Compressed blocks only count with their compressed size,
+ * which frees up the budget as soon as they are done. On top of that,
+ * the budget may be exceeded by up to a factor of two as long as some
+ * compression workers would otherwise be idle.
+ *
+ * If the global memory budget is exhausted, producers have to wait until
+ * the queue is empty, which is the least we can do without deadlocking.
+ *
+ * Must be called with mx_ held.
+ */
 template <typename LoggerPolicy>
-size_t filesystem_writer_<LoggerPolicy>::mem_used() const {
-  size_t s = 0;
+bool filesystem_writer_<LoggerPolicy>::over_budget() const {
+  auto const limit = options_.max_queue_size;
+
+  if (mem_used_ > 0 && prog_.memory.over_limit()) {
+    return true;
+  }
 
-  for (const auto& fsb : queue_) {
-    s += fsb->size();
+  if (mem_used_ <= limit) {
+    return false;
   }
 
-  return s;
+  return num_compressing_ >= wg_.size() || mem_used_ > 2 * limit;
 }
 
 template <typename LoggerPolicy>
@@ -378,7 +621,19 @@ void filesystem_writer_<LoggerPolicy>::write(folly::ByteRange range) {
 
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write(fsblock const& fsb) {
-  write(fsb.header());
+  if (options_.block_alignment > 0 && fsb.type() == section_type::BLOCK) {
+    // the section number right before the block has been reserved
+    write_padding(fsb.number() - 1);
+  }
+
+  if (options_.with_section_index) {
+    section_index_.push_back(
+        (static_cast<uint64_t>(fsb.type()) << 48) | sections_size_);
+  }
+
+  sections_size_ += sizeof(section_header_v2) + fsb.data().size();
+
+  write_header(fsb);
   write(fsb.data());
 
   if (fsb.type() == section_type::BLOCK) {
@@ -386,45 +641,100 @@ void filesystem_writer_<LoggerPolicy>::write(fsblock const& fsb) {
   }
 }
 
+/**
+ * Write a padding section so that the data of the next section starts
+ * at a multiple of the block alignment, relative to the image start
+ *
+ * A padding section is written before every block, even if no padding
+ * is needed, so that section numbers remain contiguous.
+ */
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_padding(uint32_t number) {
+  auto const align = options_.block_alignment;
+  uint32_t const value = align;
+  auto const pos = sections_size_ + 2 * sizeof(section_header_v2) +
+                   sizeof(value);
+  std::vector<uint8_t> data(sizeof(value) + (align - pos % align) % align);
+  ::memcpy(data.data(), &value, sizeof(value));
+
+  fsblock fsb(section_type::PADDING, compression_type::NONE,
+              folly::ByteRange(data.data(), data.size()), number);
+
+  // this runs on the writer thread, so don't queue up behind the
+  // compression jobs for a few bytes of padding
+  fsb.compress_inline();
+
+  write(fsb);
+}
+
+template <typename LoggerPolicy>
+uint32_t
+filesystem_writer_<LoggerPolicy>::next_section_number(section_type type) {
+  if (options_.block_alignment > 0 && type == section_type::BLOCK) {
+    // reserve a number for the padding section
+    ++section_number_;
+  }
+
+  return section_number_++;
+}
+
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write_section(
     section_type type, std::shared_ptr<block_data>&& data,
-    block_compressor const& bc) {
+    block_compressor const& bc, compressor_selector select,
+    std::string category) {
+  auto const uncompressed_size = data->size();
+
   {
     std::unique_lock lock(mx_);
 
-    while (mem_used() > options_.max_queue_size) {
-      cond_.wait(lock);
-    }
+    cond_.wait(lock, [this] { return !over_budget(); });
+
+    add_mem_used(uncompressed_size);
+    ++num_compressing_;
   }
 
   auto fsb =
-      std::make_unique<fsblock>(type, bc, std::move(data), section_number_++);
+      std::make_unique<fsblock>(type, bc, std::move(data),
+                                next_section_number(type), std::move(select),
+                                &pool_, &prog_.memory, &num_running_);
 
-  fsb->compress(wg_);
+  fsb->set_category(std::move(category));
+
+  fsb->compress(wg_, [this, uncompressed_size](size_t compressed_size) {
+    {
+      std::lock_guard lock(mx_);
+      add_mem_used(compressed_size);
+      sub_mem_used(uncompressed_size);
+      --num_compressing_;
+    }
+
+    cond_.notify_all();
+  });
 
   {
     std::lock_guard lock(mx_);
     queue_.push_back(std::move(fsb));
   }
 
-  cond_.notify_one();
+  cond_.notify_all();
 }
 
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write_compressed_section(
     section_type type, compression_type compression, folly::ByteRange data) {
-  auto fsb =
-      std::make_unique<fsblock>(type, compression, data, section_number_++);
+  auto fsb = std::make_unique<fsblock>(type, compression, data,
+                                       next_section_number(type));
 
   fsb->compress(wg_);
 
   {
     std::lock_guard lock(mx_);
+    add_mem_used(fsb->size());
     queue_.push_back(std::move(fsb));
   }
 
-  cond_.notify_one();
+  cond_.notify_all();
 }
 
 template <typename LoggerPolicy>
@@ -440,8 +750,54 @@ void filesystem_writer_<LoggerPolicy>::copy_header(folly::ByteRange header) {
 
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write_block(
-    std::shared_ptr<block_data>&& data) {
-  write_section(section_type::BLOCK, std::move(data), bc_);
+    std::shared_ptr<block_data>&& data, std::string const& category) {
+  if (adaptive_bc_.empty()) {
+    write_section(section_type::BLOCK, std::move(data), block_bc(), {},
+                  category);
+  } else {
+    write_section(
+        section_type::BLOCK, std::move(data), block_bc(),
+        [this](folly::ByteRange d) -> block_compressor const& {
+          return select_compressor(d);
+        },
+        category);
+  }
+}
+
+template <typename LoggerPolicy>
+block_compressor const&
+filesystem_writer_<LoggerPolicy>::select_compressor(
+    folly::ByteRange data) const {
+  auto entropy = estimate_entropy(data);
+
+  for (auto const& [min_entropy, bc] : adaptive_bc_) {
+    if (entropy >= min_entropy) {
+      LOG_TRACE << "block entropy " << entropy << ", using "
+                << get_compression_name(bc->type());
+      return *bc;
+    }
+  }
+
+  LOG_TRACE << "block entropy " << entropy << ", using "
+            << get_compression_name(bc_.type());
+
+  return block_bc();
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_dictionary(
+    std::shared_ptr<compression_dictionary const> dict) {
+  dict_bc_.emplace(bc_.with_dictionary(dict));
+  dict_ = std::move(dict);
+  write_compressed_section(section_type::BLOCK_DICTIONARY,
+                           compression_type::NONE, dict_->data());
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_block(
+    std::shared_ptr<block_data>&& data, block_compressor const& bc,
+    std::string const& category) {
+  write_section(section_type::BLOCK, std::move(data), bc, {}, category);
 }
 
 template <typename LoggerPolicy>
@@ -456,6 +812,12 @@ void filesystem_writer_<LoggerPolicy>::write_metadata_v2(
   write_section(section_type::METADATA_V2, std::move(data), metadata_bc_);
 }
 
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_string_table(
+    section_type type, std::shared_ptr<block_data>&& data) {
+  write_section(type, std::move(data), metadata_bc_);
+}
+
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::flush() {
   {
@@ -468,9 +830,40 @@ void filesystem_writer_<LoggerPolicy>::flush() {
     flush_ = true;
   }
 
-  cond_.notify_one();
+  cond_.notify_all();
 
   writer_thread_.join();
+
+  if (options_.with_section_index) {
+    write_section_index();
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_section_index() {
+  // the last entry refers to the index itself
+  section_index_.push_back(
+      (static_cast<uint64_t>(section_type::SECTION_INDEX) << 48) |
+      sections_size_);
+
+  folly::ByteRange data(reinterpret_cast<uint8_t const*>(section_index_.data()),
+                        section_index_.size() * sizeof(uint64_t));
+  fsblock fsb(section_type::SECTION_INDEX, compression_type::NONE, data,
+              section_number_++);
+
+  fsb.compress_inline();
+
+  write_header(fsb);
+  write(fsb.data());
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_header(fsblock const& fsb) {
+  auto header = fsb.header();
+  if (features_ != 0) {
+    header.minor = MINOR_VERSION;
+  }
+  write(header);
 }
 
 } // namespace
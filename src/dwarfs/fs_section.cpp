@@ -20,6 +20,7 @@
  */
 
 #include <cstddef>
+#include <mutex>
 
 #include <fmt/format.h>
 
@@ -39,6 +40,7 @@ void read_section_header_common(T& header, size_t& start, mmif& mm,
     DWARFS_THROW(runtime_error, "truncated section header");
   }
 
+  mm.populate(offset, sizeof(T));
   ::memcpy(&header, mm.as<void>(offset), sizeof(T));
 
   offset += sizeof(T);
@@ -86,12 +88,16 @@ class fs_section_v1 : public fs_section::impl {
   std::string description() const override { return hdr_.to_string(); }
 
   bool check_fast(mmif&) const override { return true; }
+  bool check_fast(folly::ByteRange) const override { return true; }
   bool verify(mmif&) const override { return true; }
 
   folly::ByteRange data(mmif& mm) const override {
+    mm.populate(start_, hdr_.length);
     return folly::ByteRange(mm.as<uint8_t>(start_), hdr_.length);
   }
 
+  std::optional<uint64_t> xxh3_64() const override { return std::nullopt; }
+
  private:
   size_t start_;
   section_header hdr_;
@@ -121,28 +127,103 @@ class fs_section_v2 : public fs_section::impl {
   bool check_fast(mmif& mm) const override {
     auto hdr_cs_len =
         sizeof(section_header_v2) - offsetof(section_header_v2, number);
+    mm.populate(start_ - hdr_cs_len, hdr_.length + hdr_cs_len);
     return checksum::verify(checksum::algorithm::XXH3_64,
                             mm.as<void>(start_ - hdr_cs_len),
                             hdr_.length + hdr_cs_len, &hdr_.xxh3_64);
   }
 
+  bool check_fast(folly::ByteRange data) const override {
+    auto hdr_cs_len =
+        sizeof(section_header_v2) - offsetof(section_header_v2, number);
+    checksum cs(checksum::algorithm::XXH3_64);
+    cs.update(&hdr_.number, hdr_cs_len);
+    cs.update(data.data(), data.size());
+    return data.size() == hdr_.length && cs.verify(&hdr_.xxh3_64);
+  }
+
   bool verify(mmif& mm) const override {
     auto hdr_sha_len =
         sizeof(section_header_v2) - offsetof(section_header_v2, xxh3_64);
+    mm.populate(start_ - hdr_sha_len, hdr_.length + hdr_sha_len);
     return checksum::verify(checksum::algorithm::SHA2_512_256,
                             mm.as<void>(start_ - hdr_sha_len),
                             hdr_.length + hdr_sha_len, &hdr_.sha2_512_256);
   }
 
   folly::ByteRange data(mmif& mm) const override {
+    mm.populate(start_, hdr_.length);
     return folly::ByteRange(mm.as<uint8_t>(start_), hdr_.length);
   }
 
+  std::optional<uint64_t> xxh3_64() const override { return hdr_.xxh3_64; }
+
  private:
   size_t start_;
   section_header_v2 hdr_;
 };
 
+class fs_section_v2_lazy : public fs_section::impl {
+ public:
+  fs_section_v2_lazy(std::shared_ptr<mmif> mm, section_type type,
+                     size_t offset, size_t size);
+
+  size_t start() const override { return offset_ + sizeof(section_header_v2); }
+  size_t length() const override { return size_ - sizeof(section_header_v2); }
+
+  compression_type compression() const override {
+    return section().compression();
+  }
+
+  section_type type() const override { return type_; }
+
+  std::string name() const override { return get_section_name(type_); }
+
+  std::string description() const override {
+    return section().description();
+  }
+
+  bool check_fast(mmif& mm) const override {
+    return section().check_fast(mm);
+  }
+
+  bool check_fast(folly::ByteRange data) const override {
+    return section().check_fast(data);
+  }
+
+  bool verify(mmif& mm) const override { return section().verify(mm); }
+
+  folly::ByteRange data(mmif& mm) const override {
+    mm.populate(start(), length());
+    return folly::ByteRange(mm.as<uint8_t>(start()), length());
+  }
+
+  std::optional<uint64_t> xxh3_64() const override {
+    return section().xxh3_64();
+  }
+
+ private:
+  fs_section_v2 const& section() const {
+    std::call_once(once_, [this] {
+      sec_ = std::make_unique<fs_section_v2>(*mm_, offset_);
+      if (sec_->type() != type_ || sec_->start() != start() ||
+          sec_->length() != length()) {
+        DWARFS_THROW(runtime_error,
+                     fmt::format("section index mismatch at offset {}",
+                                 offset_));
+      }
+    });
+    return *sec_;
+  }
+
+  std::shared_ptr<mmif> mm_;
+  section_type const type_;
+  size_t const offset_;
+  size_t const size_;
+  mutable std::once_flag once_;
+  mutable std::unique_ptr<fs_section_v2 const> sec_;
+};
+
 fs_section::fs_section(mmif& mm, size_t offset, int version) {
   switch (version) {
   case 1:
@@ -160,6 +241,21 @@ fs_section::fs_section(mmif& mm, size_t offset, int version) {
   }
 }
 
+fs_section::fs_section(std::shared_ptr<mmif> mm, section_type type,
+                       size_t offset, size_t size, int version) {
+  if (version != 2) {
+    DWARFS_THROW(runtime_error,
+                 fmt::format("unsupported section version {}", version));
+  }
+
+  if (size < sizeof(section_header_v2)) {
+    DWARFS_THROW(runtime_error, "invalid section index entry");
+  }
+
+  impl_ = std::make_shared<fs_section_v2_lazy>(std::move(mm), type, offset,
+                                               size);
+}
+
 fs_section_v1::fs_section_v1(mmif& mm, size_t offset) {
   read_section_header_common(hdr_, start_, mm, offset);
   check_section(*this);
@@ -170,4 +266,12 @@ fs_section_v2::fs_section_v2(mmif& mm, size_t offset) {
   check_section(*this);
 }
 
+fs_section_v2_lazy::fs_section_v2_lazy(std::shared_ptr<mmif> mm,
+                                       section_type type, size_t offset,
+                                       size_t size)
+    : mm_{std::move(mm)}
+    , type_{type}
+    , offset_{offset}
+    , size_{size} {}
+
 } // namespace dwarfs
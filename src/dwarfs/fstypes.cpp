@@ -39,6 +39,11 @@ const std::map<section_type, std::string_view> sections{
     SECTION_TYPE_(BLOCK),
     SECTION_TYPE_(METADATA_V2_SCHEMA),
     SECTION_TYPE_(METADATA_V2),
+    SECTION_TYPE_(BLOCK_DICTIONARY),
+    SECTION_TYPE_(SECTION_INDEX),
+    SECTION_TYPE_(PADDING),
+    SECTION_TYPE_(METADATA_V2_NAMES),
+    SECTION_TYPE_(METADATA_V2_SYMLINKS),
 #undef SECTION_TYPE_
 };
 
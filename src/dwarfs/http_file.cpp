@@ -0,0 +1,638 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/system/error_code.hpp>
+
+#include <fmt/format.h>
+
+#include <folly/Conv.h>
+#include <folly/String.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/http_file.h"
+
+namespace dwarfs {
+
+namespace {
+
+constexpr std::string_view kHttpScheme{"http://"};
+constexpr size_t kMaxHeaderSize{64 << 10};
+
+void send_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    auto rv = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DWARFS_THROW(system_error, "send");
+    }
+
+    data.remove_prefix(rv);
+  }
+}
+
+size_t recv_some(int fd, void* buf, size_t len) {
+  for (;;) {
+    auto rv = ::recv(fd, buf, len, 0);
+
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DWARFS_THROW(system_error, "recv");
+    }
+
+    if (rv == 0) {
+      DWARFS_THROW(runtime_error, "connection closed by server");
+    }
+
+    return rv;
+  }
+}
+
+void* safe_alloc(size_t size) {
+  if (size == 0) {
+    DWARFS_THROW(runtime_error, "empty file");
+  }
+
+  // Only the pages that are actually fetched will ever be allocated
+  void* addr = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (addr == MAP_FAILED) {
+    DWARFS_THROW(system_error, "mmap");
+  }
+
+  return addr;
+}
+
+} // namespace
+
+struct http_file::response {
+  int status{0};
+  bool keep_alive{true};
+  size_t range_begin{0};
+  size_t range_end{0};
+  std::optional<size_t> total_size;
+};
+
+bool http_file::is_url(std::string_view path) {
+  return path.substr(0, kHttpScheme.size()) == kHttpScheme ||
+         path.substr(0, 8) == "https://";
+}
+
+http_file::http_file(std::string const& url, http_file_options const& opts)
+    : opts_(opts) {
+  if (url.substr(0, kHttpScheme.size()) != kHttpScheme) {
+    DWARFS_THROW(runtime_error,
+                 "only http:// URLs are supported, use a TLS terminating "
+                 "proxy for other image locations: " +
+                     url);
+  }
+
+  if (opts_.fetch_size == 0) {
+    DWARFS_THROW(runtime_error, "fetch size must not be zero");
+  }
+
+  auto location = url.substr(kHttpScheme.size());
+  auto slash = location.find('/');
+
+  path_ = slash == std::string::npos ? "/" : location.substr(slash);
+  host_ = location.substr(0, slash);
+  port_ = "80";
+
+  if (auto colon = host_.rfind(':'); colon != std::string::npos) {
+    port_ = host_.substr(colon + 1);
+    host_.resize(colon);
+  }
+
+  if (host_.empty()) {
+    DWARFS_THROW(runtime_error, "no host in URL: " + url);
+  }
+
+  // Fetching the first chunk also tells us the size of the image
+  std::vector<uint8_t> head;
+  fetch(0, opts_.fetch_size, &head);
+
+  addr_ = safe_alloc(size_);
+  num_chunks_ = (size_ + opts_.fetch_size - 1) / opts_.fetch_size;
+  chunks_ = std::make_unique<std::atomic<uint8_t>[]>(num_chunks_);
+
+  ::memcpy(addr_, head.data(), std::min(head.size(), size_));
+
+  if (head.size() >= std::min(opts_.fetch_size, size_)) {
+    chunks_[0] = PRESENT;
+  }
+}
+
+http_file::~http_file() noexcept {
+  for (auto fd : idle_) {
+    ::close(fd);
+  }
+
+  if (addr_) {
+    ::munmap(addr_, size_);
+  }
+}
+
+int http_file::connect() const {
+  struct ::addrinfo hints;
+  ::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct ::addrinfo* res = nullptr;
+
+  if (auto rv = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res);
+      rv != 0) {
+    DWARFS_THROW(runtime_error, fmt::format("cannot resolve {}: {}", host_,
+                                            ::gai_strerror(rv)));
+  }
+
+  struct ::timeval tv;
+  tv.tv_sec = opts_.timeout_ms / 1000;
+  tv.tv_usec = (opts_.timeout_ms % 1000) * 1000;
+
+  int fd = -1;
+  int err = 0;
+
+  for (auto ai = res; ai; ai = ai->ai_next) {
+    fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                  ai->ai_protocol);
+
+    if (fd < 0) {
+      err = errno;
+      continue;
+    }
+
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // also limits the time spent in connect()
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+
+    err = errno;
+    ::close(fd);
+    fd = -1;
+  }
+
+  ::freeaddrinfo(res);
+
+  if (fd < 0) {
+    DWARFS_THROW(system_error, fmt::format("connect to {}:{}", host_, port_),
+                 err);
+  }
+
+  return fd;
+}
+
+int http_file::get_connection() {
+  {
+    std::lock_guard lock(mx_);
+
+    if (!idle_.empty()) {
+      auto fd = idle_.back();
+      idle_.pop_back();
+      return fd;
+    }
+  }
+
+  return connect();
+}
+
+void http_file::put_connection(int fd) {
+  {
+    std::lock_guard lock(mx_);
+
+    if (idle_.size() < opts_.max_connections) {
+      idle_.push_back(fd);
+      return;
+    }
+  }
+
+  ::close(fd);
+}
+
+// Requests the half-open range [begin, end). The body is written to its
+// place in the image, or to `body` if the size of the image isn't known
+// yet, in which case `end` may be past the end of the image.
+http_file::response http_file::request(int fd, size_t begin, size_t end,
+                                       std::vector<uint8_t>* body) {
+  send_all(fd, fmt::format("GET {} HTTP/1.1\r\n"
+                           "Host: {}:{}\r\n"
+                           "Range: bytes={}-{}\r\n"
+                           "User-Agent: dwarfs\r\n"
+                           "\r\n",
+                           path_, host_, port_, begin, end - 1));
+
+  std::string buf;
+  size_t header_end;
+
+  for (;;) {
+    if (header_end = buf.find("\r\n\r\n"); header_end != std::string::npos) {
+      break;
+    }
+
+    if (buf.size() > kMaxHeaderSize) {
+      DWARFS_THROW(runtime_error, "HTTP response header too large");
+    }
+
+    char tmp[4096];
+    auto len = recv_some(fd, tmp, sizeof(tmp));
+    buf.append(tmp, len);
+  }
+
+  std::vector<folly::StringPiece> lines;
+  folly::split("\r\n", folly::StringPiece(buf.data(), header_end), lines);
+
+  response r;
+  std::optional<size_t> content_length;
+
+  {
+    // e.g. "HTTP/1.1 206 Partial Content"
+    std::vector<folly::StringPiece> status;
+    folly::split(' ', lines.at(0), status);
+
+    if (status.size() < 2 || !status[0].startsWith("HTTP/")) {
+      DWARFS_THROW(runtime_error, "invalid HTTP response");
+    }
+
+    r.status = folly::to<int>(status[1]);
+    r.keep_alive = status[0] != "HTTP/1.0";
+  }
+
+  for (size_t i = 1; i < lines.size(); ++i) {
+    auto colon = lines[i].find(':');
+
+    if (colon == folly::StringPiece::npos) {
+      continue;
+    }
+
+    auto name = folly::trimWhitespace(lines[i].subpiece(0, colon)).str();
+    auto value = folly::trimWhitespace(lines[i].subpiece(colon + 1));
+    folly::toLowerAscii(name);
+
+    if (name == "content-length") {
+      content_length = folly::to<size_t>(value);
+    } else if (name == "connection") {
+      r.keep_alive = !value.equals("close", folly::AsciiCaseInsensitive());
+    } else if (name == "transfer-encoding") {
+      // only range responses with a known length are used
+      r.keep_alive = false;
+    } else if (name == "content-range") {
+      // e.g. "bytes 0-1023/4096"
+      auto spec = value.subpiece(value.find(' ') + 1);
+      auto dash = spec.find('-');
+      auto slash = spec.find('/');
+
+      if (dash == folly::StringPiece::npos ||
+          slash == folly::StringPiece::npos || slash < dash) {
+        DWARFS_THROW(runtime_error, "invalid Content-Range: " + value.str());
+      }
+
+      r.range_begin = folly::to<size_t>(spec.subpiece(0, dash));
+      r.range_end =
+          folly::to<size_t>(spec.subpiece(dash + 1, slash - dash - 1)) + 1;
+
+      if (auto total = spec.subpiece(slash + 1); total != "*") {
+        r.total_size = folly::to<size_t>(total);
+      }
+    }
+  }
+
+  if (r.status != 206) {
+    // don't bother reading the body, the connection won't be reused
+    r.keep_alive = false;
+    return r;
+  }
+
+  if (!content_length || *content_length != r.range_end - r.range_begin ||
+      r.range_begin != begin) {
+    DWARFS_THROW(runtime_error, "unexpected range in HTTP response");
+  }
+
+  uint8_t* data;
+
+  if (body) {
+    if (!r.total_size) {
+      DWARFS_THROW(runtime_error, "HTTP server did not report the size");
+    }
+    body->resize(*content_length);
+    data = body->data();
+  } else {
+    if (r.range_end != end) {
+      DWARFS_THROW(runtime_error, "unexpected range in HTTP response");
+    }
+    data = reinterpret_cast<uint8_t*>(addr_) + begin;
+  }
+
+  auto pending = buf.size() - (header_end + 4);
+
+  if (pending > *content_length) {
+    DWARFS_THROW(runtime_error, "unexpected data in HTTP response");
+  }
+
+  ::memcpy(data, buf.data() + header_end + 4, pending);
+
+  for (size_t pos = pending; pos < *content_length;) {
+    pos += recv_some(fd, data + pos, *content_length - pos);
+  }
+
+  return r;
+}
+
+void http_file::fetch(size_t begin, size_t end, std::vector<uint8_t>* body) {
+  for (size_t attempt = 0;; ++attempt) {
+    std::optional<response> r;
+    std::string error;
+    int fd = -1;
+
+    try {
+      fd = get_connection();
+      r = request(fd, begin, end, body);
+    } catch (std::exception const& e) {
+      error = e.what();
+    }
+
+    if (r && r->status == 206) {
+      if (body) {
+        size_ = *r->total_size;
+      }
+
+      if (r->keep_alive) {
+        put_connection(fd);
+      } else {
+        ::close(fd);
+      }
+
+      return;
+    }
+
+    if (fd >= 0) {
+      ::close(fd);
+    }
+
+    if (r) {
+      error = r->status == 200 ? "server does not support range requests"
+                               : fmt::format("HTTP status {}", r->status);
+    }
+
+    // client errors won't go away by trying again
+    if (attempt >= opts_.retries || (r && r->status < 500)) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("failed to fetch bytes {}-{} of http://{}{}: {}",
+                               begin, end - 1, host_, path_, error));
+    }
+
+    // back off exponentially, so an overloaded server can recover
+    auto delay = static_cast<int64_t>(opts_.retry_delay_ms)
+                 << std::min<size_t>(attempt, 10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+  }
+}
+
+// Fetches all chunks in [first, last), which must have been claimed by
+// the caller, and marks them as present or, on error, missing.
+void http_file::fetch_chunks(size_t first, size_t last) {
+  auto set_state = [this](size_t b, size_t e, chunk_state state) {
+    for (auto c = b; c < e; ++c) {
+      chunks_[c].store(state, std::memory_order_release);
+    }
+    { std::lock_guard lock(mx_); }
+    cv_.notify_all();
+  };
+
+  auto const piece_chunks =
+      std::max<size_t>(opts_.max_request_size / opts_.fetch_size, 1);
+  auto const num_pieces = (last - first + piece_chunks - 1) / piece_chunks;
+  std::atomic<size_t> next{0};
+
+  auto worker = [&] {
+    std::exception_ptr error;
+
+    for (size_t i; (i = next++) < num_pieces;) {
+      auto b = first + i * piece_chunks;
+      auto e = std::min(b + piece_chunks, last);
+
+      try {
+        fetch(b * opts_.fetch_size, std::min(e * opts_.fetch_size, size_),
+              nullptr);
+        set_state(b, e, PRESENT);
+      } catch (...) {
+        set_state(b, e, MISSING);
+        error = std::current_exception();
+      }
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  };
+
+  std::vector<std::future<void>> helpers;
+  auto const num_workers =
+      std::min(num_pieces, std::max<size_t>(opts_.max_connections, 1));
+
+  for (size_t i = 1; i < num_workers; ++i) {
+    helpers.push_back(std::async(std::launch::async, worker));
+  }
+
+  std::exception_ptr error;
+
+  try {
+    worker();
+  } catch (...) {
+    error = std::current_exception();
+  }
+
+  for (auto& h : helpers) {
+    try {
+      h.get();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+bool http_file::is_present(size_t first, size_t last) const {
+  for (auto c = first; c < last; ++c) {
+    if (chunks_[c].load(std::memory_order_acquire) != PRESENT) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void http_file::populate(off_t offset, size_t size) {
+  if (size == 0 || static_cast<size_t>(offset) >= size_) {
+    return;
+  }
+
+  size = std::min(size, size_ - static_cast<size_t>(offset));
+
+  auto const first = offset / opts_.fetch_size;
+  auto const last = (offset + size - 1) / opts_.fetch_size + 1;
+
+  while (!is_present(first, last)) {
+    std::vector<std::pair<size_t, size_t>> runs;
+
+    {
+      // Claim all missing chunks, the ones already being fetched by
+      // someone else are waited for below
+      std::lock_guard lock(mx_);
+
+      for (auto c = first; c < last; ++c) {
+        if (chunks_[c].load() == MISSING) {
+          chunks_[c].store(FETCHING);
+          if (!runs.empty() && runs.back().second == c) {
+            ++runs.back().second;
+          } else {
+            runs.emplace_back(c, c + 1);
+          }
+        }
+      }
+    }
+
+    std::exception_ptr error;
+
+    for (auto [b, e] : runs) {
+      try {
+        fetch_chunks(b, e);
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    std::unique_lock lock(mx_);
+    cv_.wait(lock, [&] {
+      for (auto c = first; c < last; ++c) {
+        if (chunks_[c].load() == FETCHING) {
+          return false;
+        }
+      }
+      return true;
+    });
+
+    // If someone else failed to fetch a chunk, we'll give it a try
+  }
+}
+
+boost::system::error_code http_file::lock(off_t offset, size_t size) {
+  boost::system::error_code ec;
+  populate(offset, size);
+  auto addr = reinterpret_cast<uint8_t*>(addr_) + offset;
+  if (::mlock(addr, size) != 0) {
+    ec.assign(errno, boost::system::generic_category());
+  }
+  return ec;
+}
+
+boost::system::error_code http_file::release(off_t offset, size_t size) {
+  boost::system::error_code ec;
+
+  // chunks can only be dropped if they're page aligned
+  if (static_cast<size_t>(offset) >= size_ ||
+      opts_.fetch_size % ::sysconf(_SC_PAGESIZE) != 0) {
+    return ec;
+  }
+
+  size = std::min(size, size_ - static_cast<size_t>(offset));
+
+  // Only chunks that are completely covered are dropped, as other users
+  // might still be looking at a chunk shared by two sections. Dropped
+  // chunks are fetched again the next time they're populated.
+  auto const first = (offset + opts_.fetch_size - 1) / opts_.fetch_size;
+  auto last = (offset + size) / opts_.fetch_size;
+
+  if (offset + size == size_) {
+    last = num_chunks_;
+  }
+
+  std::lock_guard lock(mx_);
+
+  for (auto c = first; c < last; ++c) {
+    if (chunks_[c].load() != PRESENT) {
+      continue;
+    }
+
+    auto const begin = c * opts_.fetch_size;
+    auto const len = std::min(opts_.fetch_size, size_ - begin);
+
+    if (::madvise(reinterpret_cast<uint8_t*>(addr_) + begin, len,
+                  MADV_DONTNEED) != 0) {
+      ec.assign(errno, boost::system::generic_category());
+      break;
+    }
+
+    chunks_[c].store(MISSING);
+  }
+
+  return ec;
+}
+
+boost::system::error_code http_file::release_until(off_t offset) {
+  return release(0, offset);
+}
+
+boost::system::error_code http_file::advise_sequential(off_t, size_t) {
+  return {};
+}
+
+boost::system::error_code http_file::advise_willneed(off_t, size_t) {
+  // Fetching is synchronous, data is only fetched by populate()
+  return {};
+}
+
+void const* http_file::addr() const { return addr_; }
+
+size_t http_file::size() const { return size_; }
+} // namespace dwarfs
@@ -32,6 +32,8 @@
 
 #include <fmt/format.h>
 
+#include <folly/container/F14Map.h>
+
 #include "dwarfs/compiler.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
@@ -49,7 +51,7 @@
 
 namespace dwarfs {
 
-#define DWARFS_FIND_SIMILAR_INODE_IMPL                                         \
+#define DWARFS_FIND_SIMILAR_INODE_IMPL(similarity)                             \
   std::pair<int_fast32_t, int_fast32_t> find_similar_inode(                    \
       uint64_t const* ref_hash,                                                \
       std::vector<std::shared_ptr<inode>> const& inodes,                       \
@@ -62,7 +64,7 @@ namespace dwarfs {
       auto const* test_hash =                                                  \
           inodes[index[i]]->nilsimsa_similarity_hash().data();                 \
       int sim;                                                                 \
-      DWARFS_NILSIMSA_SIMILARITY(sim =, ref_hash, test_hash);                  \
+      similarity(sim =, ref_hash, test_hash);                                  \
                                                                                \
       if (DWARFS_UNLIKELY(sim > max_sim)) {                                    \
         max_sim = sim;                                                         \
@@ -79,13 +81,98 @@ namespace dwarfs {
   static_assert(true, "")
 
 #ifdef DWARFS_MULTIVERSIONING
-__attribute__((target("popcnt"))) DWARFS_FIND_SIMILAR_INODE_IMPL;
+__attribute__((target("avx512vpopcntdq,avx512vl")))
+DWARFS_FIND_SIMILAR_INODE_IMPL(DWARFS_NILSIMSA_SIMILARITY_AVX512);
+__attribute__((target("popcnt")))
+DWARFS_FIND_SIMILAR_INODE_IMPL(DWARFS_NILSIMSA_SIMILARITY);
 __attribute__((target("default")))
 #endif
-DWARFS_FIND_SIMILAR_INODE_IMPL;
+DWARFS_FIND_SIMILAR_INODE_IMPL(DWARFS_NILSIMSA_SIMILARITY);
 
 namespace {
 
+std::vector<std::shared_ptr<inode>> const no_fragments;
+
+/**
+ * A fragment of a large file that is ordered on its own
+ */
+class inode_fragment_ : public inode {
+ public:
+  using chunk_type = thrift::metadata::chunk;
+
+  inode_fragment_(inode const& parent, size_t offset, size_t size)
+      : parent_{parent}
+      , offset_{offset}
+      , size_{size} {}
+
+  void set_num(uint32_t) override {
+    DWARFS_THROW(runtime_error, "cannot set number of inode fragment");
+  }
+
+  uint32_t num() const override { return parent_.num(); }
+
+  uint32_t similarity_hash() const override { return similarity_hash_; }
+
+  nilsimsa::hash_type const& nilsimsa_similarity_hash() const override {
+    return nilsimsa_similarity_hash_;
+  }
+
+  void set_files(files_vector&&) override {
+    DWARFS_THROW(runtime_error, "cannot set files for inode fragment");
+  }
+
+  void scan(std::shared_ptr<mmif> const&, inode_options const&) override {
+    DWARFS_THROW(runtime_error, "cannot scan inode fragment");
+  }
+
+  void set_similarity_hashes(uint32_t sim,
+                             nilsimsa::hash_type const& nh) override {
+    similarity_hash_ = sim;
+    nilsimsa_similarity_hash_ = nh;
+  }
+
+  void add_chunk(size_t block, size_t offset, size_t size) override {
+    chunk_type c;
+    c.block = block;
+    c.offset = offset;
+    c.size = size;
+    chunks_.push_back(c);
+  }
+
+  void clear_chunks() override { chunks_.clear(); }
+
+  size_t size() const override { return size_; }
+
+  files_vector const& files() const override { return parent_.files(); }
+
+  file const* any() const override { return parent_.any(); }
+
+  void append_chunks_to(std::vector<chunk_type>& vec) const override {
+    vec.insert(vec.end(), chunks_.begin(), chunks_.end());
+  }
+
+  void add_fragment(size_t, size_t, uint32_t,
+                    nilsimsa::hash_type const&) override {
+    DWARFS_THROW(runtime_error, "cannot split inode fragment");
+  }
+
+  std::vector<std::shared_ptr<inode>> const& fragments() const override {
+    return no_fragments;
+  }
+
+  bool is_fragment() const override { return true; }
+
+  size_t fragment_offset() const override { return offset_; }
+
+ private:
+  inode const& parent_;
+  size_t const offset_;
+  size_t const size_;
+  uint32_t similarity_hash_{0};
+  std::vector<chunk_type> chunks_;
+  nilsimsa::hash_type nilsimsa_similarity_hash_;
+};
+
 class inode_ : public inode {
  public:
   using chunk_type = thrift::metadata::chunk;
@@ -127,42 +214,30 @@ class inode_ : public inode {
   void
   scan(std::shared_ptr<mmif> const& mm, inode_options const& opts) override {
     if (opts.needs_scan()) {
-      similarity sc;
-      nilsimsa nc;
-
-      auto update_hashes = [&](uint8_t const* data, size_t size) {
-        if (opts.with_similarity) {
-          sc.update(data, size);
-        }
-
-        if (opts.with_nilsimsa) {
-          nc.update(data, size);
-        }
-      };
+      inode_hasher hasher(opts);
 
       constexpr size_t chunk_size = 32 << 20;
       size_t offset = 0;
       size_t size = mm->size();
 
       while (size >= chunk_size) {
-        update_hashes(mm->as<uint8_t>(offset), chunk_size);
+        hasher.update(mm->as<uint8_t>(offset), chunk_size);
         mm->release_until(offset);
         offset += chunk_size;
         size -= chunk_size;
       }
 
-      update_hashes(mm->as<uint8_t>(offset), size);
-
-      if (opts.with_similarity) {
-        similarity_hash_ = sc.finalize();
-      }
-
-      if (opts.with_nilsimsa) {
-        nc.finalize(nilsimsa_similarity_hash_);
-      }
+      hasher.update(mm->as<uint8_t>(offset), size);
+      hasher.finalize(*this);
     }
   }
 
+  void set_similarity_hashes(uint32_t sim,
+                             nilsimsa::hash_type const& nh) override {
+    similarity_hash_ = sim;
+    nilsimsa_similarity_hash_ = nh;
+  }
+
   void add_chunk(size_t block, size_t offset, size_t size) override {
     chunk_type c;
     c.block = block;
@@ -171,6 +246,13 @@ class inode_ : public inode {
     chunks_.push_back(c);
   }
 
+  void clear_chunks() override {
+    chunks_.clear();
+    for (auto const& frag : fragments_) {
+      frag->clear_chunks();
+    }
+  }
+
   size_t size() const override { return any()->size(); }
 
   files_vector const& files() const override { return files_; }
@@ -183,19 +265,124 @@ class inode_ : public inode {
   }
 
   void append_chunks_to(std::vector<chunk_type>& vec) const override {
-    vec.insert(vec.end(), chunks_.begin(), chunks_.end());
+    if (chunks_.empty()) {
+      for (auto const& frag : fragments_) {
+        frag->append_chunks_to(vec);
+      }
+    } else {
+      vec.insert(vec.end(), chunks_.begin(), chunks_.end());
+    }
   }
 
+  void add_fragment(size_t offset, size_t size, uint32_t sim,
+                    nilsimsa::hash_type const& nh) override {
+    auto frag = std::make_shared<inode_fragment_>(*this, offset, size);
+    frag->set_similarity_hashes(sim, nh);
+    fragments_.push_back(std::move(frag));
+  }
+
+  std::vector<std::shared_ptr<inode>> const& fragments() const override {
+    return fragments_;
+  }
+
+  bool is_fragment() const override { return false; }
+
+  size_t fragment_offset() const override { return 0; }
+
  private:
   std::optional<uint32_t> num_;
   uint32_t similarity_hash_{0};
   files_vector files_;
   std::vector<chunk_type> chunks_;
+  std::vector<std::shared_ptr<inode>> fragments_;
   nilsimsa::hash_type nilsimsa_similarity_hash_;
 };
 
 } // namespace
 
+inode_hasher::inode_hasher(inode_options const& opts)
+    : with_similarity_{opts.with_similarity}
+    , with_nilsimsa_{opts.with_nilsimsa}
+    , fragment_size_{opts.fragment_size} {
+  if (with_similarity_) {
+    sc_ = std::make_unique<similarity>();
+  }
+
+  if (with_nilsimsa_) {
+    nc_ = std::make_unique<nilsimsa>();
+  }
+}
+
+inode_hasher::~inode_hasher() = default;
+
+void inode_hasher::update(uint8_t const* data, size_t size) {
+  while (size > 0) {
+    // only start a new fragment once there's more data, so a file that
+    // is exactly one fragment in size isn't split
+    if (fragment_size_ > 0 && fill_ == fragment_size_) {
+      fragments_.push_back(finish_fragment());
+    }
+
+    auto len =
+        fragment_size_ > 0 ? std::min(size, fragment_size_ - fill_) : size;
+
+    if (sc_) {
+      sc_->update(data, len);
+    }
+
+    if (nc_) {
+      nc_->update(data, len);
+    }
+
+    fill_ += len;
+    data += len;
+    size -= len;
+  }
+}
+
+auto inode_hasher::finish_fragment() -> hashes {
+  hashes h;
+
+  std::fill(h.nh.begin(), h.nh.end(), 0);
+
+  if (sc_) {
+    h.sim = sc_->finalize();
+    sc_ = std::make_unique<similarity>();
+  }
+
+  if (nc_) {
+    nc_->finalize(h.nh);
+    nc_ = std::make_unique<nilsimsa>();
+  }
+
+  fill_ = 0;
+
+  return h;
+}
+
+void inode_hasher::finalize(inode& ino) {
+  auto const last_size = fill_;
+  auto last = finish_fragment();
+
+  if (fragments_.empty()) {
+    ino.set_similarity_hashes(last.sim, last.nh);
+    return;
+  }
+
+  fragments_.push_back(last);
+
+  // the inode itself is only ordered as a whole if fragments aren't used
+  ino.set_similarity_hashes(fragments_.front().sim, fragments_.front().nh);
+
+  for (size_t i = 0; i < fragments_.size(); ++i) {
+    auto size = i + 1 < fragments_.size() ? fragment_size_ : last_size;
+    ino.add_fragment(i * fragment_size_, size, fragments_[i].sim,
+                     fragments_[i].nh);
+  }
+
+  fragments_.clear();
+}
+
 template <typename LoggerPolicy>
 class inode_manager_ final : public inode_manager::impl {
  public:
@@ -215,6 +402,10 @@ class inode_manager_ final : public inode_manager::impl {
                     file_order_options const& file_order,
                     inode_manager::order_cb const& fn) override;
 
+  void order_units(std::shared_ptr<script> scr,
+                   file_order_options const& file_order,
+                   inode_manager::order_cb const& fn);
+
   void for_each_inode_in_order(
       std::function<void(std::shared_ptr<inode> const&)> const& fn)
       const override {
@@ -274,15 +465,61 @@ class inode_manager_ final : public inode_manager::impl {
   void order_inodes_by_nilsimsa(inode_manager::order_cb const& fn,
                                 file_order_options const& file_order);
 
+  void order_inodes_by_nilsimsa_lsh(inode_manager::order_cb const& fn,
+                                    file_order_options const& file_order,
+                                    std::vector<std::shared_ptr<inode>>& inodes,
+                                    std::vector<uint32_t>& index);
+
   std::vector<std::shared_ptr<inode>> inodes_;
   LOG_PROXY_DECL(LoggerPolicy);
   progress& prog_;
 };
 
+// For the similarity based orders, large files that have been split
+// into fragments are replaced by their fragments while ordering, so
+// similar regions of different files can end up next to each other.
+// Fragments are passed to `fn` in place of their inode.
 template <typename LoggerPolicy>
 void inode_manager_<LoggerPolicy>::order_inodes(
     std::shared_ptr<script> scr, file_order_options const& file_order,
     inode_manager::order_cb const& fn) {
+  bool const use_fragments = file_order.mode == file_order_mode::SIMILARITY ||
+                             file_order.mode == file_order_mode::NILSIMSA;
+  std::vector<std::shared_ptr<inode>> whole;
+
+  if (use_fragments &&
+      std::any_of(inodes_.begin(), inodes_.end(),
+                  [](auto const& ino) { return !ino->fragments().empty(); })) {
+    std::vector<std::shared_ptr<inode>> units;
+    size_t num_split = 0;
+
+    for (auto const& ino : inodes_) {
+      if (auto const& frags = ino->fragments(); frags.empty()) {
+        units.push_back(ino);
+      } else {
+        units.insert(units.end(), frags.begin(), frags.end());
+        ++num_split;
+      }
+    }
+
+    LOG_INFO << "ordering " << num_split << " large files in "
+             << (units.size() + num_split - inodes_.size()) << " fragments";
+
+    whole.swap(inodes_);
+    inodes_.swap(units);
+  }
+
+  order_units(std::move(scr), file_order, fn);
+
+  if (!whole.empty()) {
+    inodes_.swap(whole);
+  }
+}
+
+template <typename LoggerPolicy>
+void inode_manager_<LoggerPolicy>::order_units(
+    std::shared_ptr<script> scr, file_order_options const& file_order,
+    inode_manager::order_cb const& fn) {
   switch (file_order.mode) {
   case file_order_mode::NONE:
     LOG_INFO << "keeping inode order";
@@ -423,7 +660,12 @@ void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa(
 
     presort_index(inodes, index);
 
-    finalize_inode();
+    if (file_order.nilsimsa_lsh_bands > 0) {
+      order_inodes_by_nilsimsa_lsh(fn, file_order, inodes, index);
+      index.clear();
+    } else {
+      finalize_inode();
+    }
 
     while (!index.empty()) {
       auto [max_sim_ix, max_sim] = find_similar_inode(
@@ -459,6 +701,136 @@ void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa(
   }
 }
 
+/**
+ * Like the exhaustive nilsimsa ordering, but only considers candidates
+ * that share at least one LSH bucket with the most recently added inode.
+ * Each band samples 16 bits of the 256-bit nilsimsa hash, so inodes with
+ * a small hamming distance are very likely to end up in a common bucket.
+ * If no candidate is found, the next inode in presort order is used.
+ */
+template <typename LoggerPolicy>
+void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa_lsh(
+    inode_manager::order_cb const& fn, file_order_options const& file_order,
+    std::vector<std::shared_ptr<inode>>& inodes, std::vector<uint32_t>& index) {
+  auto ti = LOG_TIMED_INFO;
+
+  int const num_bands = std::min(file_order.nilsimsa_lsh_bands, 16);
+  const int_fast32_t max_depth = file_order.nilsimsa_depth;
+  const int_fast32_t min_depth =
+      std::min<int32_t>(file_order.nilsimsa_min_depth, max_depth);
+  const int_fast32_t limit = file_order.nilsimsa_limit;
+  int_fast32_t depth = max_depth;
+  int64_t processed = 0;
+  size_t lsh_hits = 0;
+
+  auto band_key = [](nilsimsa::hash_type const& h, int band) {
+    return static_cast<uint16_t>(h[band / 4] >> (16 * (band % 4)));
+  };
+
+  // buckets contain inode indices in presort order, the most promising
+  // candidates are at the back, just like in the exhaustive search
+  std::vector<folly::F14FastMap<uint16_t, std::vector<uint32_t>>> buckets(
+      num_bands);
+  std::vector<bool> done(inodes.size(), false);
+
+  for (auto i : index) {
+    auto const& h = inodes[i]->nilsimsa_similarity_hash();
+    for (int b = 0; b < num_bands; ++b) {
+      buckets[b][band_key(h, b)].push_back(i);
+    }
+  }
+
+  auto finalize_inode = [&](uint32_t i) {
+    done[i] = true;
+    inodes_.push_back(std::move(inodes[i]));
+    return fn(inodes_.back());
+  };
+
+  std::vector<uint32_t> candidates;
+
+  finalize_inode(index.back());
+  index.pop_back();
+
+  while (!index.empty()) {
+    auto const& ref = inodes_.back()->nilsimsa_similarity_hash();
+
+    candidates.clear();
+
+    for (int b = 0; b < num_bands; ++b) {
+      auto it = buckets[b].find(band_key(ref, b));
+
+      if (it == buckets[b].end()) {
+        continue;
+      }
+
+      auto& bucket = it->second;
+      size_t skipped = 0;
+
+      while (!bucket.empty() && done[bucket.back()]) {
+        bucket.pop_back();
+      }
+
+      for (auto j = bucket.size();
+           j-- > 0 && static_cast<int_fast32_t>(candidates.size()) < depth;) {
+        if (done[bucket[j]]) {
+          ++skipped;
+        } else {
+          candidates.push_back(bucket[j]);
+        }
+      }
+
+      // compact buckets once they're cluttered with finalized inodes
+      if (skipped > static_cast<size_t>(min_depth)) {
+        bucket.erase(std::remove_if(bucket.begin(), bucket.end(),
+                                    [&](auto i) { return done[i]; }),
+                     bucket.end());
+      }
+    }
+
+    uint32_t next;
+
+    if (!candidates.empty()) {
+      // find_similar_inode() scans from the back, so keep the best
+      // candidates of the first band there
+      std::reverse(candidates.begin(), candidates.end());
+      auto [max_sim_ix, max_sim] = find_similar_inode(
+          ref.data(), inodes, candidates, limit, 0);
+      LOG_TRACE << max_sim << " @ " << max_sim_ix << "/" << candidates.size();
+      next = candidates[max_sim_ix];
+      ++lsh_hits;
+    } else {
+      while (done[index.back()]) {
+        index.pop_back();
+      }
+      next = index.back();
+    }
+
+    auto fill = finalize_inode(next);
+
+    while (!index.empty() && done[index.back()]) {
+      index.pop_back();
+    }
+
+    if (++processed >= 4096 && processed % 32 == 0) {
+      constexpr int64_t smooth = 512;
+      auto target_depth = fill * max_depth / 2048;
+
+      depth = ((smooth - 1) * depth + target_depth) / smooth;
+
+      if (depth > max_depth) {
+        depth = max_depth;
+      } else if (depth < min_depth) {
+        depth = min_depth;
+      }
+    }
+
+    prog_.nilsimsa_depth = depth;
+  }
+
+  ti << "nilsimsa LSH ordering: " << lsh_hits << "/" << processed
+     << " inodes found via " << num_bands << " bands";
+}
+
 inode_manager::inode_manager(logger& lgr, progress& prog)
     : impl_(make_unique_logging_object<impl, inode_manager_, logger_policies>(
           lgr, prog)) {}
@@ -19,35 +19,215 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <ostream>
 #include <utility>
 #include <vector>
 
 #include <folly/String.h>
+#include <folly/Try.h>
 #include <folly/container/Enumerate.h>
+#include <folly/container/EvictingCacheMap.h>
 #include <folly/stats/Histogram.h>
 
 #include "dwarfs/block_cache.h"
+#include "dwarfs/compiler.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/inode_reader_v2.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/options.h"
 
 namespace dwarfs {
 
 namespace {
 
+constexpr size_t const kMaxReadaheadInodes{1024};
+
+// files with at least this many chunks get an offset index, so the
+// first chunk of a read can be found by binary search
+constexpr size_t const kOffsetIndexMinChunks{256};
+// the offset index cache is sharded to avoid contention between readers
+// of different files, and each shard is limited by the size of its
+// indexes rather than their number
+constexpr size_t const kOffsetIndexShards{16};
+constexpr size_t const kMaxOffsetIndexBytes{64 << 20};
+
+/**
+ * State shared by all block requests of an asynchronous read
+ *
+ * Whatever happens first completes the read: the last range arriving,
+ * an error or cancellation. Any results trickling in after that are
+ * simply dropped.
+ */
+class async_read final : public read_handle::impl {
+ public:
+  async_read(size_t num_ranges, read_callback&& done)
+      : done_{std::move(done)}
+      , ranges_(num_ranges)
+      , pending_{num_ranges} {}
+
+  void complete(size_t index, folly::Try<block_range>&& result) {
+    read_callback cb;
+    read_result res;
+
+    {
+      std::lock_guard lock(mx_);
+
+      if (finished_) {
+        return;
+      }
+
+      if (result.hasException()) {
+        res = folly::makeUnexpected(-EIO);
+      } else {
+        ranges_[index].emplace(std::move(result).value());
+
+        if (--pending_ > 0) {
+          return;
+        }
+
+        std::vector<block_range> ranges;
+        ranges.reserve(ranges_.size());
+        for (auto& r : ranges_) {
+          ranges.push_back(std::move(*r));
+        }
+        res = std::move(ranges);
+      }
+
+      cb = finish();
+    }
+
+    cb(std::move(res));
+  }
+
+  bool cancel() override {
+    read_callback cb;
+
+    {
+      std::lock_guard lock(mx_);
+
+      if (finished_) {
+        return false;
+      }
+
+      cb = finish();
+    }
+
+    cb(folly::makeUnexpected(-ECANCELED));
+
+    return true;
+  }
+
+  bool done() const override {
+    std::lock_guard lock(mx_);
+    return finished_;
+  }
+
+ private:
+  // Must be called with mx_ held; drops all references to blocks we've
+  // already got, so they can be evicted
+  read_callback finish() {
+    finished_ = true;
+    ranges_.clear();
+    return std::move(done_);
+  }
+
+  mutable std::mutex mx_;
+  read_callback done_;
+  std::vector<std::optional<block_range>> ranges_;
+  size_t pending_;
+  bool finished_{false};
+};
+
+/**
+ * State of a batch of asynchronous reads, completes once all of its
+ * reads have completed
+ */
+class batch_read final : public read_handle::impl {
+ public:
+  batch_read(size_t num_reads, batch_read_callback&& done)
+      : done_{std::move(done)}
+      , results_(num_reads)
+      , pending_{num_reads} {}
+
+  void add(std::shared_ptr<async_read> read) {
+    std::lock_guard lock(mx_);
+    if (!finished_) {
+      reads_.push_back(std::move(read));
+    }
+  }
+
+  void complete(size_t index, read_result&& result) {
+    batch_read_callback cb;
+    std::vector<read_result> results;
+
+    {
+      std::lock_guard lock(mx_);
+
+      results_[index] = std::move(result);
+
+      if (--pending_ > 0) {
+        return;
+      }
+
+      finished_ = true;
+      reads_.clear();
+      results.swap(results_);
+      cb = std::move(done_);
+    }
+
+    cb(std::move(results));
+  }
+
+  bool cancel() override {
+    std::vector<std::shared_ptr<async_read>> reads;
+
+    {
+      std::lock_guard lock(mx_);
+      reads = reads_;
+    }
+
+    bool cancelled = false;
+
+    for (auto& r : reads) {
+      cancelled |= r->cancel();
+    }
+
+    return cancelled;
+  }
+
+  bool done() const override {
+    std::lock_guard lock(mx_);
+    return finished_;
+  }
+
+ private:
+  mutable std::mutex mx_;
+  batch_read_callback done_;
+  std::vector<read_result> results_;
+  std::vector<std::shared_ptr<async_read>> reads_;
+  size_t pending_;
+  bool finished_{false};
+};
+
 template <typename LoggerPolicy>
 class inode_reader_ final : public inode_reader_v2::impl {
  public:
-  inode_reader_(logger& lgr, block_cache&& bc)
+  inode_reader_(logger& lgr, block_cache&& bc,
+                inode_reader_options const& opts)
       : cache_(std::move(bc))
       , LOG_PROXY_INIT(lgr)
-      , iovec_sizes_(1, 0, 256) {}
+      , iovec_sizes_(1, 0, 256)
+      , readahead_(kMaxReadaheadInodes)
+      , options_(opts) {}
 
   ~inode_reader_() override {
     std::lock_guard lock(iovec_sizes_mutex_);
@@ -60,28 +240,83 @@ class inode_reader_ final : public inode_reader_v2::impl {
     }
   }
 
-  ssize_t
-  read(char* buf, size_t size, off_t offset, chunk_range chunks) const override;
-  ssize_t readv(iovec_read_buf& buf, size_t size, off_t offset,
+  ssize_t read(uint32_t inode, char* buf, size_t size, off_t offset,
+               chunk_range chunks) const override;
+  ssize_t readv(uint32_t inode, iovec_read_buf& buf, size_t size, off_t offset,
                 chunk_range chunks) const override;
   folly::Expected<std::vector<std::future<block_range>>, int>
-  readv(size_t size, off_t offset, chunk_range chunks) const override;
+  readv(uint32_t inode, size_t size, off_t offset,
+        chunk_range chunks) const override;
+  read_handle read_async(uint32_t inode, size_t size, off_t offset,
+                         chunk_range chunks,
+                         read_callback done) const override;
+  read_handle read_batch(std::vector<inode_read_request> const& reads,
+                         batch_read_callback done) const override;
+  std::optional<std::vector<image_range>>
+  image_ranges(size_t size, off_t offset, chunk_range chunks) const override;
   void dump(std::ostream& os, const std::string& indent,
             chunk_range chunks) const override;
   void set_num_workers(size_t num) override { cache_.set_num_workers(num); }
+  void set_cache_size(size_t max_bytes) override {
+    cache_.set_max_bytes(max_bytes);
+  }
+  void prefetch_blocks(std::vector<size_t> const& blocks) const override {
+    cache_.prefetch(blocks);
+  }
+  std::vector<uint32_t> block_access_counts() const override {
+    return cache_.access_counts();
+  }
+  block_cache_stats cache_stats() const override { return cache_.stats(); }
+  std::future<block_range>
+  read_block(size_t block_no, size_t offset, size_t size) const override {
+    return cache_.get(block_no, offset, size);
+  }
 
  private:
+  struct readahead_state {
+    off_t next_offset{0};
+    off_t readahead_end{0};
+  };
+
+  // offset_index[i] is the file offset of the i-th chunk, the last
+  // element is the file size
+  using offset_index = std::vector<uint64_t>;
+
+  struct offset_index_shard {
+    std::mutex mx;
+    folly::EvictingCacheMap<uint32_t, std::shared_ptr<offset_index const>>
+        indexes{0};
+    size_t bytes{0};
+  };
+
   folly::Expected<std::vector<std::future<block_range>>, int>
-  read(size_t size, off_t offset, chunk_range chunks) const;
+  get_ranges(size_t size, off_t offset, chunk_range chunks,
+             job_priority prio = job_priority::DEMAND) const;
+
+  template <typename RangeFunc>
+  int for_each_range(size_t size, off_t offset, chunk_range chunks,
+                     RangeFunc const& func) const;
+
+  void get_blocks(std::vector<block_cache_request>&& requests) const;
+
+  std::shared_ptr<offset_index const>
+  get_offset_index(chunk_range chunks) const;
+
+  void readahead(uint32_t inode, size_t size, off_t offset,
+                 chunk_range chunks) const;
 
   template <typename StoreFunc>
-  ssize_t read(size_t size, off_t offset, chunk_range chunks,
+  ssize_t read(uint32_t inode, size_t size, off_t offset, chunk_range chunks,
                const StoreFunc& store) const;
 
   block_cache cache_;
   LOG_PROXY_DECL(LoggerPolicy);
   mutable folly::Histogram<size_t> iovec_sizes_;
   mutable std::mutex iovec_sizes_mutex_;
+  mutable folly::EvictingCacheMap<uint32_t, readahead_state> readahead_;
+  mutable std::mutex readahead_mutex_;
+  mutable std::array<offset_index_shard, kOffsetIndexShards> offset_index_;
+  inode_reader_options const options_;
 };
 
 template <typename LoggerPolicy>
@@ -94,39 +329,54 @@ void inode_reader_<LoggerPolicy>::dump(std::ostream& os,
   }
 }
 
+// Calls func(block, offset, size) for each block range covering the
+// request; stops early if func returns false. Returns 0 or -errno.
 template <typename LoggerPolicy>
-folly::Expected<std::vector<std::future<block_range>>, int>
-inode_reader_<LoggerPolicy>::readv(size_t size, off_t offset,
-                                   chunk_range chunks) const {
+template <typename RangeFunc>
+int inode_reader_<LoggerPolicy>::for_each_range(size_t size, off_t offset,
+                                                chunk_range chunks,
+                                                RangeFunc const& func) const {
   if (offset < 0) {
-    return folly::makeUnexpected(-EINVAL);
+    return -EINVAL;
   }
 
-  // request ranges from block cache
-  std::vector<std::future<block_range>> ranges;
-
   if (size == 0 || chunks.empty()) {
-    return ranges;
+    return 0;
   }
 
   auto it = chunks.begin();
   auto end = chunks.end();
 
   // search for the first chunk that contains data from this request
-  while (it < end) {
-    size_t chunksize = it->size();
-
-    if (static_cast<size_t>(offset) < chunksize) {
-      break;
+  if (chunks.size() >= kOffsetIndexMinChunks) {
+    auto index = get_offset_index(chunks);
+    auto pos = std::upper_bound(index->begin(), index->end(),
+                                static_cast<uint64_t>(offset));
+
+    if (pos == index->end()) {
+      // offset beyond EOF
+      return 0;
     }
 
-    offset -= chunksize;
-    ++it;
+    auto i = std::distance(index->begin(), pos) - 1;
+    it += i;
+    offset -= (*index)[i];
+  } else {
+    while (it < end) {
+      size_t chunksize = it->size();
+
+      if (static_cast<size_t>(offset) < chunksize) {
+        break;
+      }
+
+      offset -= chunksize;
+      ++it;
+    }
   }
 
   if (it == end) {
     // offset beyond EOF; TODO: check if this should rather be -EINVAL
-    return ranges;
+    return 0;
   }
 
   for (size_t num_read = 0; it != end && num_read < size; ++it) {
@@ -135,28 +385,337 @@ inode_reader_<LoggerPolicy>::readv(size_t size, off_t offset,
 
     if (chunksize == 0) {
       LOG_ERROR << "invalid zero-sized chunk";
-      return folly::makeUnexpected(-EIO);
+      return -EIO;
     }
 
     if (num_read + chunksize > size) {
       chunksize = size - num_read;
     }
 
-    ranges.emplace_back(cache_.get(it->block(), chunkoff, chunksize));
+    bool more = true;
+
+    if (DWARFS_UNLIKELY(it->block() == HOLE_BLOCK)) {
+      // holes are split into ranges that block_range::zeros() can return
+      for (size_t off = 0; more && off < chunksize;) {
+        auto len = std::min(chunksize - off, block_range::max_zeros_size);
+        more = func(HOLE_BLOCK, 0, len);
+        off += len;
+      }
+    } else {
+      more = func(it->block(), chunkoff, chunksize);
+    }
+
+    if (!more) {
+      break;
+    }
 
     num_read += chunksize;
     offset = 0;
   }
 
+  return 0;
+}
+
+// Returns the (possibly cached) offset index for a range of chunks;
+// the index is shared by all inodes referring to the same chunks
+template <typename LoggerPolicy>
+auto inode_reader_<LoggerPolicy>::get_offset_index(chunk_range chunks) const
+    -> std::shared_ptr<offset_index const> {
+  auto const key = chunks.first_index();
+  auto& shard = offset_index_[key % kOffsetIndexShards];
+
+  {
+    std::lock_guard lock(shard.mx);
+    if (auto it = shard.indexes.find(key); it != shard.indexes.end()) {
+      return it->second;
+    }
+  }
+
+  auto index = std::make_shared<offset_index>();
+  uint64_t offset = 0;
+
+  index->reserve(chunks.size() + 1);
+  index->push_back(offset);
+
+  for (auto const& chunk : chunks) {
+    offset += chunk.size();
+    index->push_back(offset);
+  }
+
+  LOG_TRACE << "built offset index for " << chunks.size() << " chunks";
+
+  auto index_bytes = [](offset_index const& oi) {
+    return oi.capacity() * sizeof(oi[0]);
+  };
+
+  std::lock_guard lock(shard.mx);
+
+  // another thread may have built the same index in the meantime
+  if (auto it = shard.indexes.find(key); it != shard.indexes.end()) {
+    return it->second;
+  }
+
+  shard.indexes.set(key, index);
+  shard.bytes += index_bytes(*index);
+
+  // always keep the index we've just added, even if it's too large
+  while (shard.bytes > kMaxOffsetIndexBytes / kOffsetIndexShards &&
+         shard.indexes.size() > 1) {
+    auto victim = shard.indexes.rbegin();
+    auto victim_key = victim->first;
+    shard.bytes -= index_bytes(*victim->second);
+    shard.indexes.erase(victim_key);
+  }
+
+  return index;
+}
+
+// Like block_cache::get(), but requests for holes are completed with
+// zeros right away instead of being passed on to the cache
+template <typename LoggerPolicy>
+void inode_reader_<LoggerPolicy>::get_blocks(
+    std::vector<block_cache_request>&& requests) const {
+  auto holes = std::stable_partition(
+      requests.begin(), requests.end(),
+      [](auto const& r) { return r.block_no != HOLE_BLOCK; });
+
+  for (auto it = holes; it != requests.end(); ++it) {
+    it->done(folly::Try<block_range>(block_range::zeros(it->size)));
+  }
+
+  requests.erase(holes, requests.end());
+
+  if (!requests.empty()) {
+    cache_.get(std::move(requests));
+  }
+}
+
+template <typename LoggerPolicy>
+folly::Expected<std::vector<std::future<block_range>>, int>
+inode_reader_<LoggerPolicy>::get_ranges(size_t size, off_t offset,
+                                        chunk_range chunks,
+                                        job_priority prio) const {
+  // request ranges from block cache
+  std::vector<std::future<block_range>> ranges;
+
+  auto err = for_each_range(
+      size, offset, chunks, [&](size_t block, size_t off, size_t len) {
+        if (block == HOLE_BLOCK) {
+          std::promise<block_range> zeros;
+          zeros.set_value(block_range::zeros(len));
+          ranges.emplace_back(zeros.get_future());
+        } else {
+          ranges.emplace_back(cache_.get(block, off, len, prio));
+        }
+        return true;
+      });
+
+  if (err < 0) {
+    return folly::makeUnexpected(err);
+  }
+
+  return ranges;
+}
+
+template <typename LoggerPolicy>
+std::optional<std::vector<image_range>>
+inode_reader_<LoggerPolicy>::image_ranges(size_t size, off_t offset,
+                                          chunk_range chunks) const {
+  std::vector<image_range> ranges;
+  bool uncompressed = true;
+
+  auto err = for_each_range(
+      size, offset, chunks, [&](size_t block, size_t off, size_t len) {
+        if (block == HOLE_BLOCK) {
+          uncompressed = false;
+          return false;
+        }
+        if (auto start = cache_.uncompressed_offset(block)) {
+          // merge adjacent ranges, e.g. a file spanning consecutive blocks
+          if (!ranges.empty() &&
+              ranges.back().offset + ranges.back().size == *start + off) {
+            ranges.back().size += len;
+          } else {
+            ranges.push_back({*start + off, len});
+          }
+          return true;
+        }
+        uncompressed = false;
+        return false;
+      });
+
+  if (err < 0 || !uncompressed) {
+    return std::nullopt;
+  }
+
   return ranges;
 }
 
+template <typename LoggerPolicy>
+void inode_reader_<LoggerPolicy>::readahead(uint32_t inode, size_t size,
+                                            off_t offset,
+                                            chunk_range chunks) const {
+  off_t const end = offset + size;
+  off_t const window = options_.readahead;
+  off_t begin;
+
+  {
+    std::lock_guard lock(readahead_mutex_);
+
+    readahead_state state;
+    bool sequential = offset == 0;
+
+    if (auto it = readahead_.find(inode); it != readahead_.end()) {
+      if (it->second.next_offset == offset) {
+        sequential = true;
+        state = it->second;
+      }
+    }
+
+    state.next_offset = end;
+
+    if (!sequential || state.readahead_end - end >= window / 2) {
+      // Either a random access, or we're still far enough ahead
+      readahead_.set(inode, state);
+      return;
+    }
+
+    begin = std::max(state.readahead_end, end);
+    state.readahead_end = end + window;
+    readahead_.set(inode, state);
+  }
+
+  LOG_TRACE << "readahead for inode " << inode << ": [" << begin << ", "
+            << (end + window) << ")";
+
+  // We're not interested in the results, we only want the blocks to be
+  // decompressed by the time the next sequential read comes in.
+  auto ranges = get_ranges(end + window - begin, begin, chunks,
+                           job_priority::READAHEAD);
+
+  if (!ranges) {
+    LOG_DEBUG << "readahead for inode " << inode << " failed";
+  }
+}
+
+template <typename LoggerPolicy>
+folly::Expected<std::vector<std::future<block_range>>, int>
+inode_reader_<LoggerPolicy>::readv(uint32_t inode, size_t size, off_t offset,
+                                   chunk_range chunks) const {
+  auto ranges = get_ranges(size, offset, chunks);
+
+  if (ranges && options_.readahead > 0 && !ranges.value().empty()) {
+    readahead(inode, size, offset, chunks);
+  }
+
+  return ranges;
+}
+
+template <typename LoggerPolicy>
+read_handle
+inode_reader_<LoggerPolicy>::read_async(uint32_t inode, size_t size,
+                                        off_t offset, chunk_range chunks,
+                                        read_callback done) const {
+  std::vector<block_cache_request> ranges;
+
+  auto err = for_each_range(
+      size, offset, chunks, [&](size_t block, size_t off, size_t len) {
+        ranges.push_back({block, off, len, {}});
+        return true;
+      });
+
+  if (err < 0) {
+    done(folly::makeUnexpected(err));
+    return read_handle();
+  }
+
+  if (ranges.empty()) {
+    done(std::vector<block_range>());
+    return read_handle();
+  }
+
+  // All ranges must be known before the first one is requested, as
+  // requests can complete right away.
+  auto state = std::make_shared<async_read>(ranges.size(), std::move(done));
+
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    ranges[i].done = [state, i](folly::Try<block_range>&& result) {
+      state->complete(i, std::move(result));
+    };
+  }
+
+  get_blocks(std::move(ranges));
+
+  if (options_.readahead > 0) {
+    readahead(inode, size, offset, chunks);
+  }
+
+  return read_handle(std::move(state));
+}
+
+template <typename LoggerPolicy>
+read_handle inode_reader_<LoggerPolicy>::read_batch(
+    std::vector<inode_read_request> const& reads,
+    batch_read_callback done) const {
+  if (reads.empty()) {
+    done(std::vector<read_result>());
+    return read_handle();
+  }
+
+  auto batch = std::make_shared<batch_read>(reads.size(), std::move(done));
+  std::vector<block_cache_request> requests;
+
+  for (size_t i = 0; i < reads.size(); ++i) {
+    auto const& rd = reads[i];
+
+    if (!rd.chunks) {
+      batch->complete(i, folly::makeUnexpected(-EBADF));
+      continue;
+    }
+
+    auto const first = requests.size();
+
+    auto err = for_each_range(
+        rd.size, rd.offset, *rd.chunks,
+        [&](size_t block, size_t off, size_t len) {
+          requests.push_back({block, off, len, {}});
+          return true;
+        });
+
+    if (err < 0 || requests.size() == first) {
+      requests.resize(first);
+      batch->complete(i, err < 0 ? read_result(folly::makeUnexpected(err))
+                                 : read_result());
+      continue;
+    }
+
+    auto read = std::make_shared<async_read>(
+        requests.size() - first, [batch, i](read_result&& res) {
+          batch->complete(i, std::move(res));
+        });
+
+    for (size_t k = first; k < requests.size(); ++k) {
+      requests[k].done = [read, k = k - first](
+                             folly::Try<block_range>&& result) {
+        read->complete(k, std::move(result));
+      };
+    }
+
+    batch->add(std::move(read));
+  }
+
+  get_blocks(std::move(requests));
+
+  return read_handle(std::move(batch));
+}
+
 template <typename LoggerPolicy>
 template <typename StoreFunc>
 ssize_t
-inode_reader_<LoggerPolicy>::read(size_t size, off_t offset, chunk_range chunks,
+inode_reader_<LoggerPolicy>::read(uint32_t inode, size_t size, off_t offset,
+                                  chunk_range chunks,
                                   const StoreFunc& store) const {
-  auto ranges = readv(size, offset, chunks);
+  auto ranges = readv(inode, size, offset, chunks);
 
   if (!ranges) {
     return ranges.error();
@@ -181,9 +740,10 @@ inode_reader_<LoggerPolicy>::read(size_t size, off_t offset, chunk_range chunks,
 }
 
 template <typename LoggerPolicy>
-ssize_t inode_reader_<LoggerPolicy>::read(char* buf, size_t size, off_t offset,
+ssize_t inode_reader_<LoggerPolicy>::read(uint32_t inode, char* buf,
+                                          size_t size, off_t offset,
                                           chunk_range chunks) const {
-  return read(size, offset, chunks,
+  return read(inode, size, offset, chunks,
               [&](size_t num_read, const block_range& br) {
                 ::memcpy(buf + num_read, br.data(), br.size());
               });
@@ -191,25 +751,64 @@ ssize_t inode_reader_<LoggerPolicy>::read(char* buf, size_t size, off_t offset,
 
 template <typename LoggerPolicy>
 ssize_t
-inode_reader_<LoggerPolicy>::readv(iovec_read_buf& buf, size_t size,
-                                   off_t offset, chunk_range chunks) const {
-  auto rv = read(size, offset, chunks, [&](size_t, const block_range& br) {
-    buf.buf.resize(buf.buf.size() + 1);
-    buf.buf.back().iov_base = const_cast<uint8_t*>(br.data());
-    buf.buf.back().iov_len = br.size();
-    buf.ranges.emplace_back(br);
-  });
+inode_reader_<LoggerPolicy>::readv(uint32_t inode, iovec_read_buf& buf,
+                                   size_t size, off_t offset,
+                                   chunk_range chunks) const {
+  auto ranges = readv(inode, size, offset, chunks);
+
+  if (!ranges) {
+    return ranges.error();
+  }
+
+  // large reads can span hundreds of chunks, so make room for all of
+  // them up front
+  buf.buf.reserve(buf.buf.size() + ranges.value().size());
+  buf.ranges.reserve(buf.ranges.size() + ranges.value().size());
+
+  ssize_t rv = -EIO;
+
+  try {
+    size_t num_read = 0;
+
+    for (auto& r : ranges.value()) {
+      auto br = r.get();
+      auto data = const_cast<uint8_t*>(br.data());
+
+      // adjacent chunks of the same block are sent as a single iovec
+      auto last = buf.buf.empty() ? nullptr : &buf.buf.back();
+
+      if (last &&
+          static_cast<uint8_t*>(last->iov_base) + last->iov_len == data) {
+        last->iov_len += br.size();
+      } else {
+        buf.buf.push_back({data, br.size()});
+      }
+
+      num_read += br.size();
+      buf.ranges.emplace_back(std::move(br));
+    }
+
+    rv = num_read;
+  } catch (runtime_error const& e) {
+    LOG_ERROR << e.what();
+  } catch (...) {
+    LOG_ERROR << folly::exceptionStr(std::current_exception());
+  }
+
   {
     std::lock_guard lock(iovec_sizes_mutex_);
     iovec_sizes_.addValue(buf.buf.size());
   }
+
   return rv;
 }
 
 } // namespace
 
-inode_reader_v2::inode_reader_v2(logger& lgr, block_cache&& bc)
+inode_reader_v2::inode_reader_v2(logger& lgr, block_cache&& bc,
+                                 inode_reader_options const& opts)
     : impl_(make_unique_logging_object<inode_reader_v2::impl, inode_reader_,
-                                       logger_policies>(lgr, std::move(bc))) {}
+                                       logger_policies>(lgr, std::move(bc),
+                                                        opts)) {}
 
 } // namespace dwarfs
@@ -0,0 +1,119 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <folly/hash/Hash.h>
+#include <folly/lang/Bits.h>
+
+#include "dwarfs/entry_interface.h"
+#include "dwarfs/error.h"
+#include "dwarfs/input_sample.h"
+#include "dwarfs/os_access.h"
+
+namespace dwarfs {
+
+input_sample
+sample_input(os_access const& os, std::string const& root, size_t max_bytes) {
+  using file_list = std::vector<std::pair<std::string, size_t>>;
+  std::map<std::pair<std::string, unsigned>, file_list> strata;
+  std::vector<std::pair<std::string, std::string>> todo{{root, ""}};
+  input_sample sample;
+
+  while (!todo.empty()) {
+    auto [dir, top] = std::move(todo.back());
+    todo.pop_back();
+
+    try {
+      auto dr = os.opendir(dir);
+      std::string name;
+
+      while (dr->read(name)) {
+        if (name == "." || name == "..") {
+          continue;
+        }
+
+        auto path = dir + "/" + name;
+        struct ::stat st;
+        os.lstat(path, &st);
+
+        if (S_ISDIR(st.st_mode)) {
+          todo.emplace_back(path, top.empty() ? name : top);
+        } else if (S_ISREG(st.st_mode)) {
+          size_t size = st.st_size;
+          strata[{top, folly::findLastSet(size)}].emplace_back(path, size);
+          ++sample.total_files;
+          sample.total_bytes += size;
+        }
+      }
+    } catch (system_error const&) {
+      // the scanner will report this
+    }
+  }
+
+  std::vector<std::pair<file_list::const_iterator, file_list::const_iterator>>
+      cursors;
+
+  for (auto& [key, files] : strata) {
+    // deterministic, but unrelated to the order of the files on disk
+    std::sort(files.begin(), files.end(), [](auto const& a, auto const& b) {
+      return folly::hash::fnv64(a.first) < folly::hash::fnv64(b.first);
+    });
+    cursors.emplace_back(files.cbegin(), files.cend());
+  }
+
+  for (bool added = true; added;) {
+    added = false;
+
+    for (auto& [it, end] : cursors) {
+      while (it != end) {
+        auto const& [path, size] = *it++;
+        if (sample.sample_bytes + size <= max_bytes) {
+          sample.files.insert(path);
+          sample.sample_bytes += size;
+          added = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return sample;
+}
+
+sample_script::sample_script(std::shared_ptr<script> base,
+                             std::unordered_set<std::string> const& files)
+    : base_{std::move(base)}
+    , files_{files} {}
+
+bool sample_script::filter(entry_interface const& ei) {
+  if (ei.type_string() == "file" && files_.count(ei.path()) == 0) {
+    return false;
+  }
+  return !(base_ && base_->has_filter()) || base_->filter(ei);
+}
+
+} // namespace dwarfs
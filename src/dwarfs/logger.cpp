@@ -19,15 +19,20 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iterator>
 #include <locale>
 #include <stdexcept>
+#include <thread>
 
+#include <boost/date_time/c_local_time_adjustor.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <folly/Conv.h>
+#include <folly/lang/Align.h>
+#include <folly/system/ThreadName.h>
 
 #ifndef NDEBUG
 #include <folly/experimental/symbolizer/Symbolizer.h>
@@ -43,6 +48,24 @@
 
 namespace dwarfs {
 
+namespace {
+
+constexpr std::chrono::milliseconds kAsyncFlushInterval{20};
+
+std::atomic<uint64_t> next_async_logger_id{0};
+
+boost::posix_time::ptime
+to_local_time(std::chrono::system_clock::time_point t) {
+  using namespace std::chrono;
+  auto us = duration_cast<microseconds>(t.time_since_epoch()).count();
+  auto utc = boost::posix_time::from_time_t(us / 1000000) +
+             boost::posix_time::microseconds(us % 1000000);
+  return boost::date_time::c_local_adjustor<
+      boost::posix_time::ptime>::utc_to_local(utc);
+}
+
+} // namespace
+
 logger::level_type logger::parse_level(std::string_view level) {
   if (level == "error") {
     return ERROR;
@@ -74,8 +97,21 @@ stream_logger::stream_logger(std::ostream& os, level_type threshold,
 
 void stream_logger::write(level_type level, const std::string& output,
                           char const* file, int line) {
+  do_write(level, output, file, line, std::chrono::system_clock::now(), true);
+}
+
+void stream_logger::write_at(level_type level, const std::string& output,
+                             char const* file, int line,
+                             std::chrono::system_clock::time_point t) {
+  do_write(level, output, file, line, t, false);
+}
+
+void stream_logger::do_write(level_type level, const std::string& output,
+                             char const* file, int line,
+                             std::chrono::system_clock::time_point tp,
+                             bool with_stack) {
   if (level <= threshold_) {
-    auto t = boost::posix_time::microsec_clock::local_time();
+    auto t = to_local_time(tp);
     const char* prefix = "";
     const char* suffix = "";
 
@@ -100,7 +136,7 @@ void stream_logger::write(level_type level, const std::string& output,
     folly::symbolizer::StringSymbolizePrinter printer(
         color_ ? folly::symbolizer::SymbolizePrinter::COLOR : 0);
 
-    if (threshold_ == TRACE) {
+    if (with_stack && threshold_ == TRACE) {
       using namespace folly::symbolizer;
       Symbolizer symbolizer(LocationInfoMode::FULL);
       FrameArray<5> addresses;
@@ -127,7 +163,7 @@ void stream_logger::write(level_type level, const std::string& output,
         << "\n";
 
 #if DWARFS_SYMBOLIZE
-    if (threshold_ == TRACE) {
+    if (with_stack && threshold_ == TRACE) {
       os_ << printer.str();
     }
 #endif
@@ -143,4 +179,259 @@ void stream_logger::set_threshold(level_type threshold) {
     set_policy<prod_logger_policy>();
   }
 }
+
+class async_logger::ring {
+ public:
+  struct entry {
+    level_type level;
+    std::string output;
+    char const* file;
+    int line;
+    std::chrono::system_clock::time_point time;
+  };
+
+  explicit ring(size_t size)
+      : entries_(size) {}
+
+  // only called by the owning thread
+  void push(level_type level, const std::string& output, char const* file,
+            int line) {
+    auto head = head_.load(std::memory_order_relaxed);
+
+    if (head - tail_.load(std::memory_order_acquire) == entries_.size()) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    auto& e = entries_[head % entries_.size()];
+    e.level = level;
+    e.output = output;
+    e.file = file;
+    e.line = line;
+    e.time = std::chrono::system_clock::now();
+
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // only called by the background thread
+  template <typename F>
+  void consume(F&& func) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+
+    while (tail != head) {
+      func(entries_[tail % entries_.size()]);
+      tail_.store(++tail, std::memory_order_release);
+    }
+  }
+
+  size_t take_dropped() {
+    return dropped_.exchange(0, std::memory_order_relaxed);
+  }
+
+  void detach() { detached_.store(true, std::memory_order_release); }
+  bool detached() const { return detached_.load(std::memory_order_acquire); }
+
+  // Set by the owning thread around push(), so stop() can wait for
+  // pushes that started before the logger was stopped. This must be
+  // sequentially consistent with the logger's running flag.
+  void set_writing(bool writing) { writing_.store(writing); }
+  bool writing() const { return writing_.load(); }
+
+ private:
+  std::vector<entry> entries_;
+  alignas(folly::hardware_destructive_interference_size)
+      std::atomic<size_t> head_{0};
+  alignas(folly::hardware_destructive_interference_size)
+      std::atomic<size_t> tail_{0};
+  std::atomic<size_t> dropped_{0};
+  std::atomic<bool> detached_{false};
+  std::atomic<bool> writing_{false};
+};
+
+async_logger::async_logger(stream_logger& backend, size_t ring_size)
+    : backend_(backend)
+    , ring_size_(ring_size)
+    , id_(next_async_logger_id++) {
+  set_policy_name(backend_.policy_name());
+}
+
+async_logger::~async_logger() { stop(); }
+
+void async_logger::write(level_type level, const std::string& output,
+                         char const* file, int line) {
+  if (level > backend_.threshold()) {
+    return;
+  }
+
+  if (!running_.load(std::memory_order_acquire)) {
+    backend_.write(level, output, file, line);
+    return;
+  }
+
+  auto& r = thread_ring();
+
+  r.set_writing(true);
+
+  // the logger may have been stopped since the check above, in which
+  // case it would never pick up the message
+  if (!running_.load()) {
+    r.set_writing(false);
+    backend_.write(level, output, file, line);
+    return;
+  }
+
+  r.push(level, output, file, line);
+  r.set_writing(false);
+}
+
+void async_logger::start() {
+  std::lock_guard lock(mx_);
+
+  if (!thread_.joinable()) {
+    stop_ = false;
+    thread_ = std::thread([this] {
+      folly::setThreadName("logger");
+      run();
+    });
+    running_.store(true, std::memory_order_release);
+  }
+}
+
+void async_logger::stop() {
+  {
+    std::lock_guard lock(mx_);
+    if (!thread_.joinable()) {
+      return;
+    }
+    running_.store(false);
+    stop_ = true;
+  }
+
+  cond_.notify_all();
+  thread_.join();
+  thread_ = std::thread();
+
+  // Threads that have seen the logger running may still be pushing
+  // messages. Wait for them, then pick up everything that was pushed
+  // while the thread was exiting.
+  std::vector<std::shared_ptr<ring>> rings;
+
+  {
+    std::lock_guard lock(mx_);
+    rings = rings_;
+  }
+
+  for (auto const& r : rings) {
+    while (r->writing()) {
+      std::this_thread::yield();
+    }
+  }
+
+  drain();
+}
+
+void async_logger::set_threshold(level_type threshold) {
+  backend_.set_threshold(threshold);
+  set_policy_name(backend_.policy_name());
+}
+
+size_t async_logger::dropped() const {
+  return dropped_.load(std::memory_order_relaxed);
+}
+
+auto async_logger::thread_ring() -> ring& {
+  // rings are detached when their thread exits, so the background
+  // thread can release them once they have been drained
+  struct thread_rings {
+    ~thread_rings() {
+      for (auto& [id, r] : rings) {
+        r->detach();
+      }
+    }
+
+    std::vector<std::pair<uint64_t, std::shared_ptr<ring>>> rings;
+  };
+
+  thread_local thread_rings tr;
+
+  for (auto& [id, r] : tr.rings) {
+    if (id == id_) {
+      return *r;
+    }
+  }
+
+  // drop rings of loggers that no longer exist
+  tr.rings.erase(std::remove_if(tr.rings.begin(), tr.rings.end(),
+                                [](auto const& p) {
+                                  return p.second.use_count() == 1;
+                                }),
+                 tr.rings.end());
+
+  auto r = std::make_shared<ring>(ring_size_);
+
+  {
+    std::lock_guard lock(mx_);
+    rings_.push_back(r);
+  }
+
+  tr.rings.emplace_back(id_, r);
+
+  return *r;
+}
+
+void async_logger::run() {
+  std::unique_lock lock(mx_);
+
+  while (!stop_) {
+    lock.unlock();
+    drain();
+    lock.lock();
+    cond_.wait_for(lock, kAsyncFlushInterval, [this] { return stop_; });
+  }
+}
+
+void async_logger::drain() {
+  std::vector<std::shared_ptr<ring>> rings;
+
+  {
+    std::lock_guard lock(mx_);
+    rings = rings_;
+  }
+
+  size_t dropped = 0;
+  std::vector<ring*> done;
+
+  for (auto& r : rings) {
+    // a detached ring cannot receive any more messages
+    bool detached = r->detached();
+
+    r->consume([this](ring::entry& e) {
+      backend_.write_at(e.level, e.output, e.file, e.line, e.time);
+    });
+
+    dropped += r->take_dropped();
+
+    if (detached) {
+      done.push_back(r.get());
+    }
+  }
+
+  if (!done.empty()) {
+    std::lock_guard lock(mx_);
+    rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                [&](auto const& r) {
+                                  return std::find(done.begin(), done.end(),
+                                                   r.get()) != done.end();
+                                }),
+                 rings_.end());
+  }
+
+  if (dropped > 0) {
+    dropped_.fetch_add(dropped, std::memory_order_relaxed);
+    backend_.write(WARN, fmt::format("{} log messages dropped", dropped),
+                   __FILE__, __LINE__);
+  }
+}
+
 } // namespace dwarfs
@@ -0,0 +1,119 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "dwarfs/error.h"
+#include "dwarfs/memory_accountant.h"
+
+namespace dwarfs {
+
+void memory_accountant::set_limit(size_t limit) {
+  {
+    std::lock_guard lock(mx_);
+    limit_ = limit;
+  }
+
+  cond_.notify_all();
+}
+
+size_t memory_accountant::limit() const {
+  std::lock_guard lock(mx_);
+  return limit_;
+}
+
+void memory_accountant::reserve(memory_stage stage, size_t bytes) {
+  std::unique_lock lock(mx_);
+
+  cond_.wait(lock, [&] {
+    return limit_ == 0 || used_ + bytes <= limit_ ||
+           stage_used_[static_cast<size_t>(memory_stage::WRITER)] == 0;
+  });
+
+  add(stage, bytes);
+}
+
+void memory_accountant::charge(memory_stage stage, size_t bytes) {
+  std::lock_guard lock(mx_);
+  add(stage, bytes);
+}
+
+void memory_accountant::release(memory_stage stage, size_t bytes) {
+  {
+    std::lock_guard lock(mx_);
+    auto& su = stage_used_[static_cast<size_t>(stage)];
+    DWARFS_CHECK(bytes <= su, "releasing more memory than accounted for");
+    su -= bytes;
+    used_ -= bytes;
+  }
+
+  cond_.notify_all();
+}
+
+bool memory_accountant::over_limit() const {
+  std::lock_guard lock(mx_);
+  return limit_ > 0 && used_ > limit_;
+}
+
+size_t memory_accountant::used() const {
+  std::lock_guard lock(mx_);
+  return used_;
+}
+
+size_t memory_accountant::used(memory_stage stage) const {
+  std::lock_guard lock(mx_);
+  return stage_used_[static_cast<size_t>(stage)];
+}
+
+size_t memory_accountant::peak() const {
+  std::lock_guard lock(mx_);
+  return peak_;
+}
+
+size_t memory_accountant::peak(memory_stage stage) const {
+  std::lock_guard lock(mx_);
+  return stage_peak_[static_cast<size_t>(stage)];
+}
+
+std::string_view memory_accountant::stage_name(memory_stage stage) {
+  switch (stage) {
+  case memory_stage::SCANNER:
+    return "scanner";
+  case memory_stage::SEGMENTER:
+    return "segmenter";
+  case memory_stage::COMPRESSOR:
+    return "compressor";
+  case memory_stage::WRITER:
+    return "writer";
+  }
+
+  return "unknown";
+}
+
+void memory_accountant::add(memory_stage stage, size_t bytes) {
+  auto const ix = static_cast<size_t>(stage);
+  stage_used_[ix] += bytes;
+  stage_peak_[ix] = std::max(stage_peak_[ix], stage_used_[ix]);
+  used_ += bytes;
+  peak_ = std::max(peak_, used_);
+}
+
+} // namespace dwarfs
@@ -26,6 +26,7 @@
 #include <fmt/format.h>
 
 #include "dwarfs/error.h"
+#include "dwarfs/fstypes.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/metadata_types.h"
 #include "dwarfs/overloaded.h"
@@ -136,6 +137,8 @@ void check_index_range(global_metadata::Meta const* meta) {
   auto num_gids = meta->gids().size();
   auto num_names = meta->names().size();
   auto num_inodes = meta->inodes().size();
+  // the names aren't loaded for the check if they're stored separately
+  bool const separate = global_metadata::has_separate_string_tables(meta);
   bool v2_2 = !static_cast<bool>(meta->dir_entries());
 
   if (num_modes >= std::numeric_limits<uint16_t>::max()) {
@@ -191,7 +194,7 @@ void check_index_range(global_metadata::Meta const* meta) {
     }
 
     for (auto de : *dep) {
-      if (auto i = de.name_index(); i >= num_names && i > 0) {
+      if (auto i = de.name_index(); i >= num_names && i > 0 && !separate) {
         DWARFS_THROW(runtime_error, "name_index out of range");
       }
       if (auto i = de.inode_num(); i >= num_inodes) {
@@ -329,7 +332,13 @@ void check_plain_strings(
   }
 }
 
-void check_string_tables(global_metadata::Meta const* meta) {
+// max name length is usually 255, but fsst compression, in the worst
+// case, will use 2 bytes per input byte...
+constexpr size_t const kMaxNameLen = 512;
+constexpr size_t const kMaxSymlinkLen = 4096;
+
+// The number of names referenced by the directory entries
+size_t num_referenced_names(global_metadata::Meta const* meta) {
   size_t num_names = 0;
   if (auto dep = meta->dir_entries()) {
     if (dep->size() > 1) {
@@ -352,29 +361,42 @@ void check_string_tables(global_metadata::Meta const* meta) {
     }
   }
 
-  // max name length is usually 255, but fsst compression, in the worst
-  // case, will use 2 bytes per input byte...
-  constexpr size_t max_name_len = 512;
-  constexpr size_t max_symlink_len = 4096;
+  return num_names;
+}
+
+// The number of symlink strings referenced by the symlink table
+size_t num_referenced_symlinks(global_metadata::Meta const* meta) {
+  if (meta->symlink_table().empty()) {
+    return 0;
+  }
+
+  return *std::max_element(meta->symlink_table().begin(),
+                           meta->symlink_table().end()) +
+         1;
+}
+
+void check_string_tables(global_metadata::Meta const* meta) {
+  if (global_metadata::has_separate_string_tables(meta)) {
+    // these are checked by check_separate_names() / _symlinks() once
+    // they are loaded
+    return;
+  }
+
+  auto num_names = num_referenced_names(meta);
 
   if (auto cn = meta->compact_names()) {
-    check_compact_strings(*cn, num_names, max_name_len, "names");
+    check_compact_strings(*cn, num_names, kMaxNameLen, "names");
   } else {
-    check_plain_strings(meta->names(), num_names, max_name_len, "names");
+    check_plain_strings(meta->names(), num_names, kMaxNameLen, "names");
   }
 
-  size_t num_symlink_strings = 0;
-  if (!meta->symlink_table().empty()) {
-    num_symlink_strings = *std::max_element(meta->symlink_table().begin(),
-                                            meta->symlink_table().end()) +
-                          1;
-  }
+  auto num_symlink_strings = num_referenced_symlinks(meta);
 
   if (auto cs = meta->compact_symlinks()) {
-    check_compact_strings(*cs, num_symlink_strings, max_symlink_len,
+    check_compact_strings(*cs, num_symlink_strings, kMaxSymlinkLen,
                           "symlink strings");
   } else {
-    check_plain_strings(meta->symlinks(), num_symlink_strings, max_symlink_len,
+    check_plain_strings(meta->symlinks(), num_symlink_strings, kMaxSymlinkLen,
                         "symlink strings");
   }
 }
@@ -391,6 +413,12 @@ void check_chunks(global_metadata::Meta const* meta) {
   }
 
   for (auto c : meta->chunks()) {
+    if (c.block() == HOLE_BLOCK) {
+      if (c.offset() != 0 || c.size() == 0) {
+        DWARFS_THROW(runtime_error, "invalid hole chunk");
+      }
+      continue;
+    }
     if (c.offset() >= block_size || c.size() > block_size) {
       DWARFS_THROW(runtime_error, "chunk offset/size out of range");
     }
@@ -513,15 +541,36 @@ check_metadata(logger& lgr, global_metadata::Meta const* meta, bool check) {
 } // namespace
 
 global_metadata::global_metadata(logger& lgr, Meta const* meta,
-                                 bool check_consistency)
+                                 bool check_consistency,
+                                 string_table::table_loader names)
     : meta_{check_metadata(lgr, meta, check_consistency)}
     , directories_storage_{unpack_directories(lgr, meta_)}
     , directories_{directories_storage_.empty() ? nullptr
                                                 : directories_storage_.data()}
     , names_{meta_->compact_names()
                  ? string_table(lgr, "names", *meta_->compact_names())
+             : has_separate_string_tables(meta_)
+                 ? string_table(lgr, "names", std::move(names))
                  : string_table(meta_->names())} {}
 
+bool global_metadata::has_separate_string_tables(Meta const* meta) {
+  auto opts = meta->options();
+  return opts && opts->separate_string_tables().value_or(false);
+}
+
+void global_metadata::check_separate_names(
+    Meta const* meta, string_table::PackedTableView names) {
+  // this also makes sure all name indices are within the table
+  check_compact_strings(names, num_referenced_names(meta), kMaxNameLen,
+                        "names");
+}
+
+void global_metadata::check_separate_symlinks(
+    Meta const* meta, string_table::PackedTableView symlinks) {
+  check_compact_strings(symlinks, num_referenced_symlinks(meta),
+                        kMaxSymlinkLen, "symlink strings");
+}
+
 uint32_t global_metadata::first_dir_entry(uint32_t ino) const {
   return directories_ ? directories_[ino].first_entry
                       : meta_->directories()[ino].first_entry();
@@ -20,13 +20,23 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <cstring>
 #include <ctime>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <ostream>
+#include <shared_mutex>
+#include <string_view>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -43,7 +53,11 @@
 #include <fmt/format.h>
 #include <fmt/locale.h>
 
+#include <folly/ScopeGuard.h>
+#include <folly/container/EvictingCacheMap.h>
+#include <folly/container/F14Map.h>
 #include <folly/container/F14Set.h>
+#include <folly/json.h>
 
 #include <fsst.h>
 
@@ -54,6 +68,7 @@
 #include "dwarfs/options.h"
 #include "dwarfs/string_table.h"
 #include "dwarfs/util.h"
+#include "dwarfs/worker_group.h"
 
 #include "dwarfs/gen-cpp2/metadata_layouts.h"
 #include "dwarfs/gen-cpp2/metadata_types_custom_protocol.h"
@@ -66,6 +81,43 @@ namespace {
 
 using ::apache::thrift::frozen::MappedFrozen;
 
+// Run-length encodes the sorted shared files table, as done by the
+// scanner: each element stores the number of inodes sharing a file
+// minus two
+void pack_shared_files(std::vector<uint32_t>& shared_files) {
+  if (shared_files.empty()) {
+    return;
+  }
+
+  std::vector<uint32_t> compressed;
+  compressed.reserve(shared_files.back() + 1);
+
+  uint32_t count = 0;
+  uint32_t index = 0;
+  for (auto i : shared_files) {
+    if (i == index) {
+      ++count;
+    } else {
+      ++index;
+      DWARFS_CHECK(i == index, "inconsistent shared files vector");
+      DWARFS_CHECK(count >= 2, "unique file in shared files vector");
+      compressed.emplace_back(count - 2);
+      count = 1;
+    }
+  }
+
+  compressed.emplace_back(count - 2);
+
+  shared_files.swap(compressed);
+}
+
+std::string json_string(std::string_view s) {
+  std::string out;
+  folly::json::escapeString(folly::StringPiece(s.data(), s.size()), out,
+                            folly::json::serialization_opts());
+  return out;
+}
+
 template <class T>
 std::pair<std::vector<uint8_t>, std::vector<uint8_t>>
 freeze_to_buffer(const T& x) {
@@ -134,6 +186,59 @@ MappedFrozen<T> map_frozen(folly::ByteRange schema, folly::ByteRange data) {
   return ret;
 }
 
+// Builds a loader for a string table stored in a separate section, or
+// an empty loader if the string tables are part of the metadata. The
+// loaded table is validated against `meta` using `check`.
+string_table::table_loader
+separate_table_loader(MappedFrozen<thrift::metadata::metadata> const& meta,
+                      std::function<std::vector<uint8_t>()> const& load,
+                      std::string_view what,
+                      void (*check)(global_metadata::Meta const*,
+                                    string_table::PackedTableView)) {
+  if (!global_metadata::has_separate_string_tables(&meta)) {
+    return {};
+  }
+
+  if (!load) {
+    DWARFS_THROW(runtime_error, fmt::format("no {} section found", what));
+  }
+
+  return [load, what = std::string(what), meta = &meta, check] {
+    struct holder {
+      std::vector<uint8_t> buffer;
+      std::optional<MappedFrozen<thrift::metadata::string_table>> table;
+    };
+
+    auto h = std::make_shared<holder>();
+    h->buffer = load();
+
+    uint32_t schema_size;
+
+    if (h->buffer.size() < sizeof(schema_size)) {
+      DWARFS_THROW(runtime_error, "invalid " + what + " section");
+    }
+
+    std::memcpy(&schema_size, h->buffer.data(), sizeof(schema_size));
+
+    if (h->buffer.size() - sizeof(schema_size) < schema_size) {
+      DWARFS_THROW(runtime_error, "invalid " + what + " section size");
+    }
+
+    auto schema_begin = h->buffer.data() + sizeof(schema_size);
+    auto data_begin = schema_begin + schema_size;
+
+    h->table = map_frozen<thrift::metadata::string_table>(
+        folly::ByteRange(schema_begin, data_begin),
+        folly::ByteRange(data_begin, h->buffer.data() + h->buffer.size()));
+
+    string_table::PackedTableView view = *h->table;
+
+    check(meta, view);
+
+    return string_table::loaded_table{std::move(h), view};
+  };
+}
+
 void analyze_frozen(std::ostream& os,
                     MappedFrozen<thrift::metadata::metadata> const& meta,
                     size_t total_size, int detail) {
@@ -294,18 +399,161 @@ void analyze_frozen(std::ostream& os,
 
 const uint16_t READ_ONLY_MASK = ~(S_IWUSR | S_IWGRP | S_IWOTH);
 
+// Number of directory entry names decoded in one go
+constexpr uint32_t kNameBatchSize = 256;
+
+// Distance between checkpoints for lazily unpacked tables
+constexpr size_t kTableCheckpointInterval = 256;
+
+/**
+ * Checkpoints for a packed table
+ *
+ * Instead of fully unpacking a delta / run-length encoded table, only
+ * the running sum at every kTableCheckpointInterval-th entry is kept.
+ * Any value can then be reconstructed by scanning at most that many
+ * entries of the packed table.
+ */
+struct table_checkpoints {
+  template <typename Table, typename WeightFunc>
+  table_checkpoints(Table const& table, WeightFunc const& weight) {
+    sums.reserve(table.size() / kTableCheckpointInterval + 1);
+    size_t i = 0;
+    for (auto v : table) {
+      if (i++ % kTableCheckpointInterval == 0) {
+        sums.push_back(total);
+      }
+      total += weight(v);
+    }
+  }
+
+  table_checkpoints() = default;
+
+  bool empty() const { return sums.empty(); }
+
+  size_t memory_usage() const {
+    return sizeof(sums.front()) * sums.capacity();
+  }
+
+  std::vector<uint32_t> sums;
+  uint32_t total{0};
+};
+
+/**
+ * Hash index for a single directory
+ *
+ * Open addressing table mapping name hashes to directory entry indices.
+ * A lookup only needs to decode the name of an entry whose hash matches,
+ * which is typically just the one being looked up.
+ */
+class dir_hash_index {
+ public:
+  explicit dir_hash_index(size_t num_entries) {
+    size_t capacity = 1;
+    while (capacity < 2 * num_entries) {
+      capacity <<= 1;
+    }
+    mask_ = capacity - 1;
+    slots_.resize(capacity);
+  }
+
+  void insert(uint32_t ix, std::string_view name) {
+    auto h = hash(name);
+    auto pos = h & mask_;
+    while (slots_[pos].index != kEmpty) {
+      pos = (pos + 1) & mask_;
+    }
+    slots_[pos] = {h, ix};
+  }
+
+  template <typename NameFunc>
+  std::optional<uint32_t>
+  find(std::string_view key, NameFunc const& name) const {
+    auto h = hash(key);
+    for (auto pos = h & mask_; slots_[pos].index != kEmpty;
+         pos = (pos + 1) & mask_) {
+      if (slots_[pos].hash == h && name(slots_[pos].index) == key) {
+        return slots_[pos].index;
+      }
+    }
+    return std::nullopt;
+  }
+
+  size_t memory_usage() const { return sizeof(slot) * slots_.capacity(); }
+
+ private:
+  static constexpr uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
+
+  struct slot {
+    uint32_t hash{0};
+    uint32_t index{kEmpty};
+  };
+
+  static uint32_t hash(std::string_view s) {
+    return static_cast<uint32_t>(std::hash<std::string_view>{}(s));
+  }
+
+  std::vector<slot> slots_;
+  uint32_t mask_{0};
+};
+
+// Collects entries and passes them on in batches
+class walk_batcher {
+ public:
+  walk_batcher(dir_entry_batch_func const& func, size_t batch_size)
+      : func_{func}
+      , batch_size_{std::max<size_t>(batch_size, 1)} {
+    batch_.reserve(batch_size_);
+  }
+
+  void add(dir_entry_view entry) {
+    batch_.push_back(entry);
+    if (batch_.size() >= batch_size_) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (!batch_.empty()) {
+      func_(batch_);
+      batch_.clear();
+    }
+  }
+
+ private:
+  dir_entry_batch_func const& func_;
+  size_t const batch_size_;
+  std::vector<dir_entry_view> batch_;
+};
+
+enum class chunk_table_kind { PLAIN, UNPACKED, CHECKPOINTED };
+
+/**
+ * Properties of an image's metadata layout that are fixed at load time.
+ *
+ * These are hoisted into the type so the hot accessors don't have to
+ * re-check them on every call.
+ */
+template <chunk_table_kind ChunkTable, bool MtimeOnly>
+struct metadata_layout {
+  static constexpr chunk_table_kind chunk_table = ChunkTable;
+  static constexpr bool mtime_only = MtimeOnly;
+};
+
 } // namespace
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 class metadata_ final : public metadata_v2::impl {
  public:
   metadata_(logger& lgr, folly::ByteRange schema, folly::ByteRange data,
             metadata_options const& options, int inode_offset,
-            bool force_consistency_check)
+            bool force_consistency_check,
+            metadata_string_tables const& tables)
       : data_(data)
       , meta_(map_frozen<thrift::metadata::metadata>(schema, data_))
       , global_(lgr, &meta_,
-                options.check_consistency || force_consistency_check)
+                options.check_consistency || force_consistency_check,
+                separate_table_loader(meta_, tables.names, "names",
+                                      &global_metadata::check_separate_names))
       , root_(dir_entry_view::from_dir_entry_index(0, &global_))
       , LOG_PROXY_INIT(lgr)
       , inode_offset_(inode_offset)
@@ -315,18 +563,30 @@ class metadata_ final : public metadata_v2::impl {
       , inode_count_(meta_.dir_entries() ? meta_.inodes().size()
                                          : meta_.entry_table_v2_2().size())
       , nlinks_(build_nlinks(options))
-      , chunk_table_(unpack_chunk_table())
-      , shared_files_(decompress_shared_files())
+      , chunk_table_(Layout::chunk_table == chunk_table_kind::UNPACKED
+                         ? unpack_chunk_table()
+                         : std::vector<uint32_t>())
+      , chunk_table_cp_(Layout::chunk_table == chunk_table_kind::CHECKPOINTED
+                            ? build_chunk_table_checkpoints()
+                            : table_checkpoints())
+      , shared_files_(options.lazy_tables ? std::vector<uint32_t>()
+                                          : decompress_shared_files())
+      , shared_files_cp_(options.lazy_tables
+                             ? build_shared_files_checkpoints()
+                             : table_checkpoints())
       , unique_files_(dev_inode_offset_ - file_inode_offset_ -
-                      (shared_files_.empty()
-                           ? meta_.shared_files_table()
-                                 ? meta_.shared_files_table()->size()
-                                 : 0
-                           : shared_files_.size()))
+                      num_shared_files())
       , options_(options)
-      , symlinks_(meta_.compact_symlinks()
-                      ? string_table(lgr, "symlinks", *meta_.compact_symlinks())
-                      : string_table(meta_.symlinks())) {
+      , symlinks_(
+            meta_.compact_symlinks()
+                ? string_table(lgr, "symlinks", *meta_.compact_symlinks())
+            : global_metadata::has_separate_string_tables(&meta_)
+                ? string_table(lgr, "symlinks",
+                               separate_table_loader(
+                                   meta_, tables.symlinks, "symlinks",
+                                   &global_metadata::check_separate_symlinks))
+                : string_table(meta_.symlinks()))
+      , path_cache_(options.path_cache_size) {
     if (static_cast<int>(meta_.directories().size() - 1) !=
         symlink_inode_offset_) {
       DWARFS_THROW(
@@ -376,11 +636,23 @@ class metadata_ final : public metadata_v2::impl {
     }
   }
 
+  ~metadata_() override {
+    if (options_.path_cache_size > 0) {
+      LOG_INFO << "path cache: " << path_cache_hits_.load() << " hits, "
+               << path_cache_negative_hits_.load() << " negative hits, "
+               << path_cache_misses_.load() << " misses";
+    }
+  }
+
   void dump(std::ostream& os, int detail_level, filesystem_info const& fsinfo,
             std::function<void(const std::string&, uint32_t)> const& icb)
       const override;
 
   folly::dynamic as_dynamic() const override;
+  void write_as_json(std::ostream& os) const override;
+  thrift::metadata::metadata unpack() const override {
+    return unpack_metadata();
+  }
   std::string serialize_as_json(bool simple) const override;
 
   size_t size() const override { return data_.size(); }
@@ -398,6 +670,25 @@ class metadata_ final : public metadata_v2::impl {
     walk_data_order_impl(func);
   }
 
+  void walk_batched(dir_entry_batch_func const& func,
+                    size_t batch_size) const override {
+    walk_batcher batcher(func, batch_size);
+    walk_tree([&](uint32_t self_index, uint32_t parent_index) {
+      batcher.add(make_dir_entry_view(self_index, parent_index));
+    });
+    batcher.flush();
+  }
+
+  void walk_data_order_batched(dir_entry_batch_func const& func,
+                               size_t batch_size) const override {
+    walk_batcher batcher(func, batch_size);
+    walk_data_order_impl([&](dir_entry_view entry) { batcher.add(entry); });
+    batcher.flush();
+  }
+
+  void walk_parallel(worker_group& wg, dir_entry_batch_func const& func,
+                     size_t batch_size) const override;
+
   std::optional<inode_view> find(const char* path) const override;
   std::optional<inode_view> find(int inode) const override;
   std::optional<inode_view> find(int inode, const char* name) const override;
@@ -409,6 +700,10 @@ class metadata_ final : public metadata_v2::impl {
   std::optional<std::pair<inode_view, std::string>>
   readdir(directory_view dir, size_t offset) const override;
 
+  void readdir(directory_view dir, size_t offset,
+               std::function<bool(size_t, inode_view, std::string_view)> const&
+                   func) const override;
+
   size_t dirsize(directory_view dir) const override {
     return 2 + dir.entry_count(); // adds '.' and '..', which we fake in ;-)
   }
@@ -425,8 +720,23 @@ class metadata_ final : public metadata_v2::impl {
 
   std::optional<chunk_range> get_chunks(int inode) const override;
 
+  std::vector<std::vector<block_file_range>> block_map() const override;
+
+  std::vector<folly::ByteRange> hot_ranges() const override;
+
   size_t block_size() const override { return meta_.block_size(); }
 
+  size_t reference_block_count() const override {
+    return meta_.reference_block_count().value_or(0);
+  }
+
+  std::optional<uint64_t> reference_block_digest() const override {
+    if (auto digest = meta_.reference_block_digest()) {
+      return *digest;
+    }
+    return std::nullopt;
+  }
+
  private:
   template <typename K>
   using set_type = folly::F14ValueSet<K>;
@@ -522,6 +832,30 @@ class metadata_ final : public metadata_v2::impl {
     }
   }
 
+  dir_hash_index const& get_dir_hash_index(directory_view dir) const;
+
+  // Decode the names of count consecutive directory entries in one go
+  std::vector<std::string_view>
+  entry_names(uint32_t first, uint32_t count, std::string& arena) const {
+    std::vector<uint32_t> name_index;
+    name_index.reserve(count);
+
+    if (auto de = meta_.dir_entries()) {
+      for (uint32_t ix = first; ix < first + count; ++ix) {
+        name_index.push_back((*de)[ix].name_index());
+      }
+    } else {
+      for (uint32_t ix = first; ix < first + count; ++ix) {
+        name_index.push_back(meta_.inodes()[ix].name_index_v2_2());
+      }
+    }
+
+    return global_.names().lookup(
+        folly::Range(name_index.data(), name_index.size()), arena);
+  }
+
+  std::optional<inode_view> find_uncached(const char* path) const;
+
   directory_view make_directory_view(inode_view iv) const {
     // TODO: revisit: is this the way to do it?
     return directory_view(iv.inode_num(), &global_);
@@ -539,13 +873,59 @@ class metadata_ final : public metadata_v2::impl {
   folly::dynamic as_dynamic(dir_entry_view entry) const;
   folly::dynamic as_dynamic(directory_view dir, dir_entry_view entry) const;
 
+  void write_as_json(std::ostream& os, dir_entry_view entry,
+                     size_t level) const;
+
   std::optional<inode_view>
   find(directory_view dir, std::string_view name) const;
 
   std::string modestring(uint16_t mode) const;
 
   uint32_t chunk_table_lookup(uint32_t ino) const {
-    return chunk_table_.empty() ? meta_.chunk_table()[ino] : chunk_table_[ino];
+    if constexpr (Layout::chunk_table == chunk_table_kind::CHECKPOINTED) {
+      auto ct = meta_.chunk_table();
+      auto first = ino - ino % kTableCheckpointInterval;
+      auto value = chunk_table_cp_.sums[ino / kTableCheckpointInterval];
+      for (auto i = first; i <= ino; ++i) {
+        value += ct[i];
+      }
+      return value;
+    } else if constexpr (Layout::chunk_table == chunk_table_kind::UNPACKED) {
+      return chunk_table_[ino];
+    } else {
+      return meta_.chunk_table()[ino];
+    }
+  }
+
+  // Equivalent to shared_files_[index], but using the checkpoints
+  uint32_t shared_files_lookup(uint32_t index) const {
+    auto const& sums = shared_files_cp_.sums;
+    auto sfp = *meta_.shared_files_table();
+    auto k = std::distance(sums.begin(),
+                           std::upper_bound(sums.begin(), sums.end(), index)) -
+             1;
+    auto pos = sums[k];
+    uint32_t i = k * kTableCheckpointInterval;
+    for (;; ++i) {
+      pos += sfp[i] + 2;
+      if (index < pos) {
+        break;
+      }
+    }
+    return i;
+  }
+
+  size_t num_shared_files() const {
+    if (!shared_files_.empty()) {
+      return shared_files_.size();
+    }
+    if (!shared_files_cp_.empty()) {
+      return shared_files_cp_.total;
+    }
+    if (auto sfp = meta_.shared_files_table()) {
+      return sfp->size();
+    }
+    return 0;
   }
 
   int file_inode_to_chunk_index(int inode) const {
@@ -558,6 +938,10 @@ class metadata_ final : public metadata_v2::impl {
         if (inode < static_cast<int>(shared_files_.size())) {
           inode = shared_files_[inode] + unique_files_;
         }
+      } else if (!shared_files_cp_.empty()) {
+        if (inode < static_cast<int>(shared_files_cp_.total)) {
+          inode = shared_files_lookup(inode) + unique_files_;
+        }
       } else if (auto sfp = meta_.shared_files_table()) {
         if (inode < static_cast<int>(sfp->size())) {
           inode = (*sfp)[inode] + unique_files_;
@@ -617,8 +1001,8 @@ class metadata_ final : public metadata_v2::impl {
     walk(0, 0, seen, std::forward<T>(func));
   }
 
-  void
-  walk_data_order_impl(std::function<void(dir_entry_view)> const& func) const;
+  template <typename T>
+  void walk_data_order_impl(T&& func) const;
 
   std::optional<inode_view> get_entry(int inode) const {
     inode -= inode_offset_;
@@ -660,6 +1044,39 @@ class metadata_ final : public metadata_v2::impl {
     return chunk_table;
   }
 
+  table_checkpoints build_chunk_table_checkpoints() const {
+    table_checkpoints cp;
+
+    if (auto opts = meta_.options(); opts and opts->packed_chunk_table()) {
+      auto ti = LOG_TIMED_DEBUG;
+
+      cp = table_checkpoints(meta_.chunk_table(), [](auto v) { return v; });
+
+      ti << "built chunk table checkpoints ("
+         << size_with_unit(cp.memory_usage()) << ")";
+    }
+
+    return cp;
+  }
+
+  table_checkpoints build_shared_files_checkpoints() const {
+    table_checkpoints cp;
+
+    if (auto opts = meta_.options();
+        opts and opts->packed_shared_files_table()) {
+      if (auto sfp = meta_.shared_files_table(); sfp and !sfp->empty()) {
+        auto ti = LOG_TIMED_DEBUG;
+
+        cp = table_checkpoints(*sfp, [](auto c) { return c + 2; });
+
+        ti << "built shared files table checkpoints ("
+           << size_with_unit(cp.memory_usage()) << ")";
+      }
+    }
+
+    return cp;
+  }
+
   std::vector<uint32_t> decompress_shared_files() const {
     std::vector<uint32_t> decompressed;
 
@@ -732,14 +1149,61 @@ class metadata_ final : public metadata_v2::impl {
   const int inode_count_;
   const std::vector<uint32_t> nlinks_;
   const std::vector<uint32_t> chunk_table_;
+  const table_checkpoints chunk_table_cp_;
   const std::vector<uint32_t> shared_files_;
+  const table_checkpoints shared_files_cp_;
   const int unique_files_;
   const metadata_options options_;
   const string_table symlinks_;
+  mutable std::mutex path_cache_mx_;
+  mutable folly::EvictingCacheMap<std::string, std::optional<uint32_t>>
+      path_cache_;
+  mutable std::atomic<size_t> path_cache_hits_{0};
+  mutable std::atomic<size_t> path_cache_negative_hits_{0};
+  mutable std::atomic<size_t> path_cache_misses_{0};
+  mutable std::shared_mutex dir_hash_mx_;
+  mutable folly::F14FastMap<uint32_t, std::unique_ptr<dir_hash_index const>>
+      dir_hash_;
 };
 
-template <typename LoggerPolicy>
-void metadata_<LoggerPolicy>::dump(
+template <typename LoggerPolicy, typename Layout>
+dir_hash_index const&
+metadata_<LoggerPolicy, Layout>::get_dir_hash_index(directory_view dir) const {
+  {
+    std::shared_lock lock(dir_hash_mx_);
+    if (auto it = dir_hash_.find(dir.inode()); it != dir_hash_.end()) {
+      return *it->second;
+    }
+  }
+
+  // Build outside of the lock; if another thread wins the race, its
+  // index is used and ours is simply discarded.
+  auto ti = LOG_TIMED_DEBUG;
+
+  auto index = std::make_unique<dir_hash_index>(dir.entry_count());
+  std::string arena;
+
+  for (uint32_t i = 0; i < dir.entry_count(); i += kNameBatchSize) {
+    auto first = dir.first_entry() + i;
+    auto names = entry_names(
+        first, std::min(kNameBatchSize, dir.entry_count() - i), arena);
+    for (size_t k = 0; k < names.size(); ++k) {
+      index->insert(first + k, names[k]);
+    }
+  }
+
+  ti << "built hash index for directory " << dir.inode() << " ("
+     << dir.entry_count() << " entries, "
+     << size_with_unit(index->memory_usage()) << ")";
+
+  std::unique_lock lock(dir_hash_mx_);
+  auto [it, inserted] = dir_hash_.emplace(dir.inode(), std::move(index));
+
+  return *it->second;
+}
+
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::dump(
     std::ostream& os, const std::string& indent, dir_entry_view entry,
     int detail_level,
     std::function<void(const std::string&, uint32_t)> const& icb) const {
@@ -778,8 +1242,8 @@ void metadata_<LoggerPolicy>::dump(
 }
 
 // TODO: can we move this to dir_entry_view?
-template <typename LoggerPolicy>
-void metadata_<LoggerPolicy>::dump(
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::dump(
     std::ostream& os, const std::string& indent, directory_view dir,
     dir_entry_view entry, int detail_level,
     std::function<void(const std::string&, uint32_t)> const& icb) const {
@@ -794,8 +1258,8 @@ void metadata_<LoggerPolicy>::dump(
   }
 }
 
-template <typename LoggerPolicy>
-void metadata_<LoggerPolicy>::dump(
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::dump(
     std::ostream& os, int detail_level, filesystem_info const& fsinfo,
     std::function<void(const std::string&, uint32_t)> const& icb) const {
   struct ::statvfs stbuf;
@@ -813,9 +1277,17 @@ void metadata_<LoggerPolicy>::dump(
     os << "created on: " << str << std::endl;
   }
 
+  if (auto count = meta_.reference_block_count()) {
+    os << "reference image blocks: " << *count << std::endl;
+  }
+
   if (detail_level > 0) {
     os << "block size: " << size_with_unit(stbuf.f_bsize) << std::endl;
     os << "block count: " << fsinfo.block_count << std::endl;
+    if (fsinfo.block_alignment > 0) {
+      os << "block alignment: " << size_with_unit(fsinfo.block_alignment)
+         << std::endl;
+    }
     os << "inode count: " << stbuf.f_files << std::endl;
     os << "original filesystem size: " << size_with_unit(stbuf.f_blocks)
        << std::endl;
@@ -844,6 +1316,8 @@ void metadata_<LoggerPolicy>::dump(
       boolopt("packed_chunk_table", opt->packed_chunk_table());
       boolopt("packed_directories", opt->packed_directories());
       boolopt("packed_shared_files_table", opt->packed_shared_files_table());
+      boolopt("separate_string_tables",
+              opt->separate_string_tables().value_or(false));
       if (auto names = meta_.compact_names()) {
         boolopt("packed_names", static_cast<bool>(names->symtab()));
         boolopt("packed_names_index", names->packed_index());
@@ -887,7 +1361,7 @@ void metadata_<LoggerPolicy>::dump(
     if (auto sfp = meta_.shared_files_table()) {
       if (meta_.options()->packed_shared_files_table()) {
         os << "packed shared_files_table: " << sfp->size() << std::endl;
-        os << "unpacked shared_files_table: " << shared_files_.size()
+        os << "unpacked shared_files_table: " << num_shared_files()
            << std::endl;
       } else {
         os << "shared_files_table: " << sfp->size() << std::endl;
@@ -905,9 +1379,10 @@ void metadata_<LoggerPolicy>::dump(
   }
 }
 
-template <typename LoggerPolicy>
-folly::dynamic metadata_<LoggerPolicy>::as_dynamic(directory_view dir,
-                                                   dir_entry_view entry) const {
+template <typename LoggerPolicy, typename Layout>
+folly::dynamic
+metadata_<LoggerPolicy, Layout>::as_dynamic(directory_view dir,
+                                            dir_entry_view entry) const {
   folly::dynamic obj = folly::dynamic::array;
 
   auto count = dir.entry_count();
@@ -921,8 +1396,9 @@ folly::dynamic metadata_<LoggerPolicy>::as_dynamic(directory_view dir,
   return obj;
 }
 
-template <typename LoggerPolicy>
-folly::dynamic metadata_<LoggerPolicy>::as_dynamic(dir_entry_view entry) const {
+template <typename LoggerPolicy, typename Layout>
+folly::dynamic
+metadata_<LoggerPolicy, Layout>::as_dynamic(dir_entry_view entry) const {
   folly::dynamic obj = folly::dynamic::object;
 
   auto iv = entry.inode();
@@ -961,8 +1437,8 @@ folly::dynamic metadata_<LoggerPolicy>::as_dynamic(dir_entry_view entry) const {
   return obj;
 }
 
-template <typename LoggerPolicy>
-folly::dynamic metadata_<LoggerPolicy>::as_dynamic() const {
+template <typename LoggerPolicy, typename Layout>
+folly::dynamic metadata_<LoggerPolicy, Layout>::as_dynamic() const {
   folly::dynamic obj = folly::dynamic::object;
 
   struct ::statvfs stbuf;
@@ -976,20 +1452,110 @@ folly::dynamic metadata_<LoggerPolicy>::as_dynamic() const {
   return obj;
 }
 
-template <typename LoggerPolicy>
-thrift::metadata::metadata metadata_<LoggerPolicy>::unpack_metadata() const {
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::write_as_json(std::ostream& os,
+                                                    dir_entry_view entry,
+                                                    size_t level) const {
+  std::string const indent(2 * (level + 1), ' ');
+  bool first = true;
+
+  auto key = [&](std::string_view name) -> std::ostream& {
+    os << (first ? "" : ",\n") << indent << '"' << name << "\": ";
+    first = false;
+    return os;
+  };
+
+  auto iv = entry.inode();
+  auto mode = iv.mode();
+  auto inode = iv.inode_num();
+
+  os << "{\n";
+
+  key("mode") << mode;
+  key("modestring") << json_string(modestring(mode));
+  key("inode") << inode;
+
+  if (inode > 0) {
+    key("name") << json_string(entry.name());
+  }
+
+  if (S_ISREG(mode)) {
+    key("type") << "\"file\"";
+    key("size") << file_size(iv, mode);
+  } else if (S_ISDIR(mode)) {
+    auto dir = make_directory_view(iv);
+    auto count = dir.entry_count();
+    auto first_entry = dir.first_entry();
+
+    key("type") << "\"directory\"";
+    key("inodes") << '[';
+
+    for (size_t i = 0; i < count; ++i) {
+      os << (i > 0 ? ",\n" : "\n") << indent << "  ";
+      write_as_json(
+          os, make_dir_entry_view(first_entry + i, entry.self_index()),
+          level + 2);
+    }
+
+    if (count > 0) {
+      os << '\n' << indent;
+    }
+
+    os << ']';
+  } else if (S_ISLNK(mode)) {
+    key("type") << "\"link\"";
+    key("target") << json_string(link_value(iv));
+  } else if (S_ISBLK(mode)) {
+    key("type") << "\"blockdev\"";
+    key("device_id") << get_device_id(inode);
+  } else if (S_ISCHR(mode)) {
+    key("type") << "\"chardev\"";
+    key("device_id") << get_device_id(inode);
+  } else if (S_ISFIFO(mode)) {
+    key("type") << "\"fifo\"";
+  } else if (S_ISSOCK(mode)) {
+    key("type") << "\"socket\"";
+  }
+
+  os << '\n' << std::string(2 * level, ' ') << '}';
+}
+
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::write_as_json(std::ostream& os) const {
+  struct ::statvfs stbuf;
+  statvfs(&stbuf);
+
+  os << "{\n  \"statvfs\": {\n"
+     << "    \"f_bsize\": " << stbuf.f_bsize << ",\n"
+     << "    \"f_files\": " << stbuf.f_files << ",\n"
+     << "    \"f_blocks\": " << stbuf.f_blocks << "\n  },\n"
+     << "  \"root\": ";
+
+  write_as_json(os, root_, 1);
+
+  os << "\n}\n";
+}
+
+template <typename LoggerPolicy, typename Layout>
+thrift::metadata::metadata
+metadata_<LoggerPolicy, Layout>::unpack_metadata() const {
   auto meta = meta_.thaw();
 
   if (auto opts = meta.options_ref()) {
     if (opts->packed_chunk_table) {
-      meta.chunk_table = chunk_table_;
+      meta.chunk_table =
+          chunk_table_cp_.empty() ? chunk_table_ : unpack_chunk_table();
     }
     if (opts->packed_directories) {
       meta.directories = global_.directories();
     }
     if (opts->packed_shared_files_table) {
-      meta.shared_files_table_ref() = shared_files_;
+      meta.shared_files_table_ref() = shared_files_cp_.empty()
+                                          ? shared_files_
+                                          : decompress_shared_files();
     }
+    // separate string tables are always packed, so they're unpacked
+    // into the metadata here
     if (auto const& names = global_.names(); names.is_packed()) {
       meta.names = names.unpack();
       meta.compact_names_ref().reset();
@@ -998,6 +1564,7 @@ thrift::metadata::metadata metadata_<LoggerPolicy>::unpack_metadata() const {
       meta.symlinks = symlinks_.unpack();
       meta.compact_symlinks_ref().reset();
     }
+    opts->separate_string_tables_ref().reset();
     opts->packed_chunk_table = false;
     opts->packed_directories = false;
     opts->packed_shared_files_table = false;
@@ -1006,8 +1573,9 @@ thrift::metadata::metadata metadata_<LoggerPolicy>::unpack_metadata() const {
   return meta;
 }
 
-template <typename LoggerPolicy>
-std::string metadata_<LoggerPolicy>::serialize_as_json(bool simple) const {
+template <typename LoggerPolicy, typename Layout>
+std::string
+metadata_<LoggerPolicy, Layout>::serialize_as_json(bool simple) const {
   std::string json;
   if (simple) {
     apache::thrift::SimpleJSONSerializer serializer;
@@ -1019,8 +1587,8 @@ std::string metadata_<LoggerPolicy>::serialize_as_json(bool simple) const {
   return json;
 }
 
-template <typename LoggerPolicy>
-std::string metadata_<LoggerPolicy>::modestring(uint16_t mode) const {
+template <typename LoggerPolicy, typename Layout>
+std::string metadata_<LoggerPolicy, Layout>::modestring(uint16_t mode) const {
   std::ostringstream oss;
 
   oss << (mode & S_ISUID ? 'U' : '-');
@@ -1040,10 +1608,12 @@ std::string metadata_<LoggerPolicy>::modestring(uint16_t mode) const {
   return oss.str();
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 template <typename T>
-void metadata_<LoggerPolicy>::walk(uint32_t self_index, uint32_t parent_index,
-                                   set_type<int>& seen, T&& func) const {
+void metadata_<LoggerPolicy, Layout>::walk(uint32_t self_index,
+                                           uint32_t parent_index,
+                                           set_type<int>& seen,
+                                           T&& func) const {
   func(self_index, parent_index);
 
   auto entry = make_dir_entry_view(self_index, parent_index);
@@ -1066,9 +1636,9 @@ void metadata_<LoggerPolicy>::walk(uint32_t self_index, uint32_t parent_index,
   }
 }
 
-template <typename LoggerPolicy>
-void metadata_<LoggerPolicy>::walk_data_order_impl(
-    std::function<void(dir_entry_view)> const& func) const {
+template <typename LoggerPolicy, typename Layout>
+template <typename T>
+void metadata_<LoggerPolicy, Layout>::walk_data_order_impl(T&& func) const {
   std::vector<std::pair<uint32_t, uint32_t>> entries;
 
   if (auto dep = meta_.dir_entries()) {
@@ -1142,15 +1712,129 @@ void metadata_<LoggerPolicy>::walk_data_order_impl(
   }
 
   for (auto [self_index, parent_index] : entries) {
-    walk_call(func, self_index, parent_index);
+    func(make_dir_entry_view(self_index, parent_index));
+  }
+}
+
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::walk_parallel(
+    worker_group& wg, dir_entry_batch_func const& func,
+    size_t batch_size) const {
+  std::mutex mx;
+  std::condition_variable cond;
+  size_t pending = 0;
+  std::exception_ptr error;
+  set_type<int> seen;
+
+  std::function<void(uint32_t, uint32_t)> walk_dir;
+
+  auto finish = [&](std::exception_ptr ep) {
+    std::lock_guard lock(mx);
+    if (ep && !error) {
+      error = ep;
+    }
+    if (--pending == 0) {
+      cond.notify_all();
+    }
+  };
+
+  auto spawn = [&](uint32_t self_index, uint32_t parent_index) {
+    {
+      std::lock_guard lock(mx);
+      ++pending;
+    }
+    // the job won't run if it cannot be added, so don't wait for it
+    SCOPE_FAIL { finish(nullptr); };
+    wg.add_job([&, self_index, parent_index] {
+      try {
+        walk_dir(self_index, parent_index);
+        finish(nullptr);
+      } catch (...) {
+        finish(std::current_exception());
+      }
+    });
+  };
+
+  // Delivers the contents of a single directory. Subdirectories are only
+  // walked once the batch containing their entry has been delivered.
+  walk_dir = [&](uint32_t self_index, uint32_t parent_index) {
+    auto iv = make_dir_entry_view(self_index, parent_index).inode();
+
+    {
+      std::lock_guard lock(mx);
+      if (error) {
+        return;
+      }
+      if (!seen.emplace(iv.inode_num()).second) {
+        DWARFS_THROW(runtime_error, "cycle detected during directory walk");
+      }
+    }
+
+    std::vector<dir_entry_view> batch;
+    std::vector<uint32_t> subdirs;
+
+    auto flush = [&] {
+      if (!batch.empty()) {
+        func(batch);
+        batch.clear();
+      }
+      for (auto index : subdirs) {
+        spawn(index, self_index);
+      }
+      subdirs.clear();
+    };
+
+    for (auto cur_index : make_directory_view(iv).entry_range()) {
+      auto entry = make_dir_entry_view(cur_index, self_index);
+      if (S_ISDIR(entry.inode().mode())) {
+        subdirs.push_back(cur_index);
+      }
+      batch.push_back(entry);
+      if (batch.size() >= batch_size) {
+        flush();
+      }
+    }
+
+    flush();
+  };
+
+  auto root = make_dir_entry_view(0, 0);
+
+  func({root});
+
+  if (S_ISDIR(root.inode().mode())) {
+    spawn(0, 0);
+
+    std::unique_lock lock(mx);
+    cond.wait(lock, [&] { return pending == 0; });
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<inode_view>
-metadata_<LoggerPolicy>::find(directory_view dir, std::string_view name) const {
+metadata_<LoggerPolicy, Layout>::find(directory_view dir,
+                                      std::string_view name) const {
   auto range = dir.entry_range();
 
+  if (options_.dir_hash_threshold > 0 &&
+      range.size() >= options_.dir_hash_threshold) {
+    auto entry_name = [this](uint32_t ix) {
+      return dir_entry_view::name(ix, &global_);
+    };
+
+    std::optional<inode_view> rv;
+
+    if (auto ix = get_dir_hash_index(dir).find(name, entry_name)) {
+      rv = dir_entry_view::inode(*ix, &global_);
+    }
+
+    return rv;
+  }
+
   auto it = std::lower_bound(range.begin(), range.end(), name,
                              [&](auto ix, std::string_view name) {
                                return dir_entry_view::name(ix, &global_) < name;
@@ -1167,13 +1851,49 @@ metadata_<LoggerPolicy>::find(directory_view dir, std::string_view name) const {
   return rv;
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<inode_view>
-metadata_<LoggerPolicy>::find(const char* path) const {
+metadata_<LoggerPolicy, Layout>::find(const char* path) const {
   while (*path and *path == '/') {
     ++path;
   }
 
+  if (options_.path_cache_size == 0) {
+    return find_uncached(path);
+  }
+
+  std::string key(path);
+
+  {
+    std::lock_guard lock(path_cache_mx_);
+
+    if (auto it = path_cache_.find(key); it != path_cache_.end()) {
+      if (auto ino = it->second) {
+        ++path_cache_hits_;
+        return make_inode_view(*ino);
+      }
+
+      ++path_cache_negative_hits_;
+      return std::nullopt;
+    }
+  }
+
+  ++path_cache_misses_;
+
+  auto iv = find_uncached(path);
+
+  {
+    std::lock_guard lock(path_cache_mx_);
+    path_cache_.set(key, iv ? std::optional<uint32_t>(iv->inode_num())
+                            : std::nullopt);
+  }
+
+  return iv;
+}
+
+template <typename LoggerPolicy, typename Layout>
+std::optional<inode_view>
+metadata_<LoggerPolicy, Layout>::find_uncached(const char* path) const {
   std::optional<inode_view> iv = root_.inode();
 
   while (*path) {
@@ -1192,14 +1912,15 @@ metadata_<LoggerPolicy>::find(const char* path) const {
   return iv;
 }
 
-template <typename LoggerPolicy>
-std::optional<inode_view> metadata_<LoggerPolicy>::find(int inode) const {
+template <typename LoggerPolicy, typename Layout>
+std::optional<inode_view>
+metadata_<LoggerPolicy, Layout>::find(int inode) const {
   return get_entry(inode);
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<inode_view>
-metadata_<LoggerPolicy>::find(int inode, const char* name) const {
+metadata_<LoggerPolicy, Layout>::find(int inode, const char* name) const {
   auto iv = get_entry(inode);
 
   if (iv) {
@@ -1209,15 +1930,14 @@ metadata_<LoggerPolicy>::find(int inode, const char* name) const {
   return iv;
 }
 
-template <typename LoggerPolicy>
-int metadata_<LoggerPolicy>::getattr(inode_view iv,
-                                     struct ::stat* stbuf) const {
+template <typename LoggerPolicy, typename Layout>
+int metadata_<LoggerPolicy, Layout>::getattr(inode_view iv,
+                                             struct ::stat* stbuf) const {
   ::memset(stbuf, 0, sizeof(*stbuf));
 
   auto mode = iv.mode();
   auto timebase = meta_.timestamp_base();
   auto inode = iv.inode_num();
-  bool mtime_only = meta_.options() && meta_.options()->mtime_only();
   uint32_t resolution = 1;
   if (meta_.options()) {
     if (auto res = meta_.options()->time_resolution_sec()) {
@@ -1239,7 +1959,7 @@ int metadata_<LoggerPolicy>::getattr(inode_view iv,
   stbuf->st_uid = iv.getuid();
   stbuf->st_gid = iv.getgid();
   stbuf->st_mtime = resolution * (timebase + iv.mtime_offset());
-  if (mtime_only) {
+  if constexpr (Layout::mtime_only) {
     stbuf->st_atime = stbuf->st_ctime = stbuf->st_mtime;
   } else {
     stbuf->st_atime = resolution * (timebase + iv.atime_offset());
@@ -1256,9 +1976,9 @@ int metadata_<LoggerPolicy>::getattr(inode_view iv,
   return 0;
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<directory_view>
-metadata_<LoggerPolicy>::opendir(inode_view iv) const {
+metadata_<LoggerPolicy, Layout>::opendir(inode_view iv) const {
   std::optional<directory_view> rv;
 
   if (S_ISDIR(iv.mode())) {
@@ -1268,9 +1988,10 @@ metadata_<LoggerPolicy>::opendir(inode_view iv) const {
   return rv;
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<std::pair<inode_view, std::string>>
-metadata_<LoggerPolicy>::readdir(directory_view dir, size_t offset) const {
+metadata_<LoggerPolicy, Layout>::readdir(directory_view dir,
+                                         size_t offset) const {
   switch (offset) {
   case 0:
     return std::pair(make_inode_view(dir.inode()), ".");
@@ -1293,9 +2014,43 @@ metadata_<LoggerPolicy>::readdir(directory_view dir, size_t offset) const {
   return std::nullopt;
 }
 
-template <typename LoggerPolicy>
-int metadata_<LoggerPolicy>::access(inode_view iv, int mode, uid_t uid,
-                                    gid_t gid) const {
+template <typename LoggerPolicy, typename Layout>
+void metadata_<LoggerPolicy, Layout>::readdir(
+    directory_view dir, size_t offset,
+    std::function<bool(size_t, inode_view, std::string_view)> const& func)
+    const {
+  if (offset == 0) {
+    if (!func(offset++, make_inode_view(dir.inode()), ".")) {
+      return;
+    }
+  }
+
+  if (offset == 1) {
+    if (!func(offset++, make_inode_view(dir.parent_inode()), "..")) {
+      return;
+    }
+  }
+
+  std::string arena;
+
+  for (auto i = offset - 2; i < dir.entry_count(); i += kNameBatchSize) {
+    auto first = dir.first_entry() + i;
+    auto names = entry_names(
+        first,
+        std::min<size_t>(kNameBatchSize, dir.entry_count() - i), arena);
+
+    for (size_t k = 0; k < names.size(); ++k) {
+      if (!func(offset++, dir_entry_view::inode(first + k, &global_),
+                names[k])) {
+        return;
+      }
+    }
+  }
+}
+
+template <typename LoggerPolicy, typename Layout>
+int metadata_<LoggerPolicy, Layout>::access(inode_view iv, int mode,
+                                            uid_t uid, gid_t gid) const {
   if (mode == F_OK) {
     // easy; we're only interested in the file's existance
     return 0;
@@ -1327,8 +2082,8 @@ int metadata_<LoggerPolicy>::access(inode_view iv, int mode, uid_t uid,
   return (access_mode & mode) == mode ? 0 : EACCES;
 }
 
-template <typename LoggerPolicy>
-int metadata_<LoggerPolicy>::open(inode_view iv) const {
+template <typename LoggerPolicy, typename Layout>
+int metadata_<LoggerPolicy, Layout>::open(inode_view iv) const {
   if (S_ISREG(iv.mode())) {
     return iv.inode_num();
   }
@@ -1336,8 +2091,9 @@ int metadata_<LoggerPolicy>::open(inode_view iv) const {
   return -1;
 }
 
-template <typename LoggerPolicy>
-int metadata_<LoggerPolicy>::readlink(inode_view iv, std::string* buf) const {
+template <typename LoggerPolicy, typename Layout>
+int metadata_<LoggerPolicy, Layout>::readlink(inode_view iv,
+                                              std::string* buf) const {
   if (S_ISLNK(iv.mode())) {
     buf->assign(link_value(iv));
     return 0;
@@ -1346,9 +2102,9 @@ int metadata_<LoggerPolicy>::readlink(inode_view iv, std::string* buf) const {
   return -EINVAL;
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 folly::Expected<std::string, int>
-metadata_<LoggerPolicy>::readlink(inode_view iv) const {
+metadata_<LoggerPolicy, Layout>::readlink(inode_view iv) const {
   if (S_ISLNK(iv.mode())) {
     return link_value(iv);
   }
@@ -1356,8 +2112,8 @@ metadata_<LoggerPolicy>::readlink(inode_view iv) const {
   return folly::makeUnexpected(-EINVAL);
 }
 
-template <typename LoggerPolicy>
-int metadata_<LoggerPolicy>::statvfs(struct ::statvfs* stbuf) const {
+template <typename LoggerPolicy, typename Layout>
+int metadata_<LoggerPolicy, Layout>::statvfs(struct ::statvfs* stbuf) const {
   ::memset(stbuf, 0, sizeof(*stbuf));
 
   stbuf->f_bsize = meta_.block_size();
@@ -1375,22 +2131,286 @@ int metadata_<LoggerPolicy>::statvfs(struct ::statvfs* stbuf) const {
   return 0;
 }
 
-template <typename LoggerPolicy>
+template <typename LoggerPolicy, typename Layout>
 std::optional<chunk_range>
-metadata_<LoggerPolicy>::get_chunks(int inode) const {
+metadata_<LoggerPolicy, Layout>::get_chunks(int inode) const {
   return get_chunk_range(inode - inode_offset_);
 }
 
+template <typename LoggerPolicy, typename Layout>
+std::vector<std::vector<block_file_range>>
+metadata_<LoggerPolicy, Layout>::block_map() const {
+  auto td = LOG_TIMED_DEBUG;
+  std::vector<std::vector<block_file_range>> map;
+  set_type<uint32_t> seen;
+
+  walk_data_order_impl([&](dir_entry_view entry) {
+    auto iv = entry.inode();
+
+    if (!S_ISREG(iv.mode()) || !seen.emplace(iv.inode_num()).second) {
+      return;
+    }
+
+    auto chunks = get_chunks(iv.inode_num());
+
+    if (!chunks) {
+      LOG_ERROR << "no chunks for inode " << iv.inode_num();
+      return;
+    }
+
+    auto path = entry.path();
+    uint64_t file_offset = 0;
+
+    for (auto const& chunk : *chunks) {
+      auto block = chunk.block();
+
+      if (block == HOLE_BLOCK) {
+        file_offset += chunk.size();
+        continue;
+      }
+
+      if (block >= map.size()) {
+        map.resize(block + 1);
+      }
+
+      map[block].push_back(block_file_range{iv.inode_num(), path, file_offset,
+                                             chunk.offset(), chunk.size()});
+      file_offset += chunk.size();
+    }
+  });
+
+  td << "built block map for " << seen.size() << " files and " << map.size()
+     << " blocks";
+
+  return map;
+}
+
+template <typename LoggerPolicy, typename Layout>
+std::vector<folly::ByteRange>
+metadata_<LoggerPolicy, Layout>::hot_ranges() const {
+  std::vector<folly::ByteRange> cold;
+
+  auto add_cold = [&](auto const* begin, auto const* end) {
+    auto b = reinterpret_cast<uint8_t const*>(begin);
+    auto e = reinterpret_cast<uint8_t const*>(end);
+    if (data_.begin() <= b && b < e && e <= data_.end()) {
+      cold.emplace_back(b, e);
+    }
+  };
+
+  // Everything used by lookup() and getattr() must stay hot. This
+  // includes the chunks, as the size of a regular file is derived from
+  // them, and the names. Symlink strings are only needed for readlink()
+  // and for the size of symlinks, and the version string is only used
+  // for dumping the metadata.
+  if (auto cs = meta_.compact_symlinks()) {
+    auto buf = cs->buffer();
+    add_cold(buf.begin(), buf.end());
+    if (auto st = cs->symtab()) {
+      add_cold(st->begin(), st->end());
+    }
+  } else if (auto sl = meta_.symlinks(); !sl.empty()) {
+    add_cold(sl.front().begin(), sl.back().end());
+  }
+
+  if (auto ver = meta_.dwarfs_version()) {
+    add_cold(ver->begin(), ver->end());
+  }
+
+  std::sort(cold.begin(), cold.end(), [](auto const& a, auto const& b) {
+    return a.begin() < b.begin();
+  });
+
+  std::vector<folly::ByteRange> hot;
+  auto pos = data_.begin();
+
+  for (auto const& c : cold) {
+    if (pos < c.begin()) {
+      hot.emplace_back(pos, c.begin());
+    }
+    pos = std::max(pos, c.end());
+  }
+
+  if (pos < data_.end()) {
+    hot.emplace_back(pos, data_.end());
+  }
+
+  return hot;
+}
+
 std::pair<std::vector<uint8_t>, std::vector<uint8_t>>
 metadata_v2::freeze(const thrift::metadata::metadata& data) {
   return freeze_to_buffer(data);
 }
 
+std::vector<uint8_t>
+metadata_v2::freeze_string_table(const thrift::metadata::string_table& table) {
+  auto [schema, data] = freeze_to_buffer(table);
+  auto const schema_size = static_cast<uint32_t>(schema.size());
+
+  std::vector<uint8_t> buffer(sizeof(schema_size));
+  buffer.reserve(sizeof(schema_size) + schema.size() + data.size());
+  std::memcpy(buffer.data(), &schema_size, sizeof(schema_size));
+  buffer.insert(buffer.end(), schema.begin(), schema.end());
+  buffer.insert(buffer.end(), data.begin(), data.end());
+
+  return buffer;
+}
+
+void metadata_v2::rebuild(thrift::metadata::metadata& data,
+                          metadata_rebuild_options const& opts,
+                          size_t num_threads) {
+  if (!data.dir_entries_ref().has_value()) {
+    DWARFS_THROW(runtime_error,
+                 "cannot rebuild metadata of filesystems older than v2.3");
+  }
+
+  if (!data.options_ref().has_value()) {
+    data.options_ref() = thrift::metadata::fs_options();
+  }
+
+  auto& fsopts = *data.options_ref();
+
+  if (opts.uid) {
+    data.uids = {*opts.uid};
+    for (auto& ino : data.inodes) {
+      ino.owner_index = 0;
+    }
+  }
+
+  if (opts.gid) {
+    data.gids = {*opts.gid};
+    for (auto& ino : data.inodes) {
+      ino.group_index = 0;
+    }
+  }
+
+  if (opts.timestamp) {
+    auto res = fsopts.time_resolution_sec_ref().value_or(1);
+    data.timestamp_base = *opts.timestamp / res;
+    for (auto& ino : data.inodes) {
+      ino.atime_offset = 0;
+      ino.mtime_offset = 0;
+      ino.ctime_offset = 0;
+    }
+  }
+
+  if (opts.pack_chunk_table) {
+    std::adjacent_difference(data.chunk_table.begin(), data.chunk_table.end(),
+                             data.chunk_table.begin());
+  }
+
+  if (opts.pack_directories) {
+    uint32_t last_first_entry = 0;
+
+    for (auto& d : data.directories) {
+      d.parent_entry = 0; // this will be recovered
+      auto delta = d.first_entry - last_first_entry;
+      last_first_entry = d.first_entry;
+      d.first_entry = delta;
+    }
+  }
+
+  if (opts.pack_shared_files_table &&
+      data.shared_files_table_ref().has_value()) {
+    pack_shared_files(*data.shared_files_table_ref());
+  }
+
+  auto pack_strings = [&](std::vector<std::string>& strings, bool plain,
+                          bool pack, bool pack_index, auto compact) {
+    if (plain) {
+      compact.reset();
+    } else {
+      string_table::pack_options po(pack, pack_index,
+                                    opts.force_pack_string_tables);
+      po.num_threads = num_threads;
+      compact = string_table::pack(strings, po);
+      strings.clear();
+    }
+  };
+
+  pack_strings(data.names, opts.plain_names_table, opts.pack_names,
+               opts.pack_names_index, data.compact_names_ref());
+  pack_strings(data.symlinks, opts.plain_symlinks_table, opts.pack_symlinks,
+               opts.pack_symlinks_index, data.compact_symlinks_ref());
+
+  fsopts.packed_chunk_table = opts.pack_chunk_table;
+  fsopts.packed_directories = opts.pack_directories;
+  fsopts.packed_shared_files_table = opts.pack_shared_files_table;
+}
+
+namespace {
+
+template <typename Layout>
+struct metadata_factory {
+  template <typename LoggerPolicy>
+  using type = metadata_<LoggerPolicy, Layout>;
+};
+
+template <chunk_table_kind ChunkTable, bool MtimeOnly>
+std::unique_ptr<metadata_v2::impl>
+make_metadata(logger& lgr, folly::ByteRange schema, folly::ByteRange data,
+              metadata_options const& options, int inode_offset,
+              bool force_consistency_check,
+              metadata_string_tables const& tables) {
+  using factory = metadata_factory<metadata_layout<ChunkTable, MtimeOnly>>;
+  return make_unique_logging_object<metadata_v2::impl,
+                                    factory::template type, logger_policies>(
+      lgr, schema, data, options, inode_offset, force_consistency_check,
+      tables);
+}
+
+template <chunk_table_kind ChunkTable>
+std::unique_ptr<metadata_v2::impl>
+make_metadata(bool mtime_only, logger& lgr, folly::ByteRange schema,
+              folly::ByteRange data, metadata_options const& options,
+              int inode_offset, bool force_consistency_check,
+              metadata_string_tables const& tables) {
+  if (mtime_only) {
+    return make_metadata<ChunkTable, true>(lgr, schema, data, options,
+                                           inode_offset,
+                                           force_consistency_check, tables);
+  }
+  return make_metadata<ChunkTable, false>(lgr, schema, data, options,
+                                          inode_offset,
+                                          force_consistency_check, tables);
+}
+
+std::unique_ptr<metadata_v2::impl>
+make_metadata(logger& lgr, folly::ByteRange schema, folly::ByteRange data,
+              metadata_options const& options, int inode_offset,
+              bool force_consistency_check,
+              metadata_string_tables const& tables) {
+  // peek at the layout options to pick the matching instantiation
+  auto meta = map_frozen<thrift::metadata::metadata>(schema, data);
+  auto opts = meta.options();
+  bool mtime_only = opts && opts->mtime_only();
+  bool packed = opts && opts->packed_chunk_table();
+
+  if (!packed) {
+    return make_metadata<chunk_table_kind::PLAIN>(
+        mtime_only, lgr, schema, data, options, inode_offset,
+        force_consistency_check, tables);
+  }
+
+  if (options.lazy_tables) {
+    return make_metadata<chunk_table_kind::CHECKPOINTED>(
+        mtime_only, lgr, schema, data, options, inode_offset,
+        force_consistency_check, tables);
+  }
+
+  return make_metadata<chunk_table_kind::UNPACKED>(
+      mtime_only, lgr, schema, data, options, inode_offset,
+      force_consistency_check, tables);
+}
+
+} // namespace
+
 metadata_v2::metadata_v2(logger& lgr, folly::ByteRange schema,
                          folly::ByteRange data, metadata_options const& options,
-                         int inode_offset, bool force_consistency_check)
-    : impl_(make_unique_logging_object<metadata_v2::impl, metadata_,
-                                       logger_policies>(
-          lgr, schema, data, options, inode_offset, force_consistency_check)) {}
+                         int inode_offset, bool force_consistency_check,
+                         metadata_string_tables const& tables)
+    : impl_(make_metadata(lgr, schema, data, options, inode_offset,
+                          force_consistency_check, tables)) {}
 
 } // namespace dwarfs
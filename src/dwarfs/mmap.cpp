@@ -106,6 +106,62 @@ boost::system::error_code mmap::release_until(off_t offset) {
   return ec;
 }
 
+boost::system::error_code mmap::advise_sequential(off_t offset, size_t size) {
+  boost::system::error_code ec;
+  auto misalign = offset % page_size_;
+
+  offset -= misalign;
+  size += misalign;
+
+  auto addr = reinterpret_cast<uint8_t*>(addr_) + offset;
+  if (::madvise(addr, size, MADV_SEQUENTIAL) != 0) {
+    ec.assign(errno, boost::system::generic_category());
+  }
+  return ec;
+}
+
+boost::system::error_code mmap::advise_willneed(off_t offset, size_t size) {
+  boost::system::error_code ec;
+  auto misalign = offset % page_size_;
+
+  offset -= misalign;
+  size += misalign;
+
+  auto addr = reinterpret_cast<uint8_t*>(addr_) + offset;
+  if (::madvise(addr, size, MADV_WILLNEED) != 0) {
+    ec.assign(errno, boost::system::generic_category());
+  }
+  return ec;
+}
+
+bool mmap::read_uncached(void* buf, off_t offset, size_t size) {
+  auto data = reinterpret_cast<uint8_t*>(buf);
+  size_t done = 0;
+
+  while (done < size) {
+    auto rv = ::pread(fd_, data + done, size - done, offset + done);
+
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DWARFS_THROW(system_error, "pread");
+    }
+
+    if (rv == 0) {
+      DWARFS_THROW(runtime_error, "unexpected end of file");
+    }
+
+    done += rv;
+  }
+
+  // Pages shared with neighbouring sections are dropped, too, but the
+  // next read will simply fetch them again
+  ::posix_fadvise(fd_, offset, size, POSIX_FADV_DONTNEED);
+
+  return true;
+}
+
 void const* mmap::addr() const { return addr_; }
 
 size_t mmap::size() const { return size_; }
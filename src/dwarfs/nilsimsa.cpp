@@ -55,6 +55,33 @@ uint8_t tran3(uint8_t a, uint8_t b, uint8_t c, uint8_t n) {
   return ((TT53[(a + n) & 0xFF] ^ TT53[b] * (n + n + 1)) + TT53[c ^ TT53[n]]);
 }
 
+// tran3() split into per-accumulator lookup tables, so the hot loop only
+// needs three table lookups, an xor and an add per trigram
+struct tran3_tables {
+  std::array<std::array<uint8_t, 256>, 8> a;
+  std::array<std::array<uint8_t, 256>, 8> b;
+  std::array<std::array<uint8_t, 256>, 8> c;
+};
+
+constexpr tran3_tables make_tran3_tables() {
+  tran3_tables t{};
+  for (int n = 0; n < 8; ++n) {
+    for (int x = 0; x < 256; ++x) {
+      t.a[n][x] = TT53[(x + n) & 0xFF];
+      t.b[n][x] = static_cast<uint8_t>(TT53[x] * (n + n + 1));
+      t.c[n][x] = TT53[x ^ TT53[n]];
+    }
+  }
+  return t;
+}
+
+constexpr tran3_tables TT3 = make_tran3_tables();
+
+template <int N>
+inline uint8_t tran3_fast(uint8_t a, uint8_t b, uint8_t c) {
+  return (TT3.a[N][a] ^ TT3.b[N][b]) + TT3.c[N][c];
+}
+
 } // namespace
 
 class nilsimsa::impl {
@@ -147,14 +174,14 @@ class nilsimsa::impl {
     for (size_t i = 0; i < size; ++i) {                                        \
       uint8_t w0 = data[i];                                                    \
                                                                                \
-      ++acc_[tran3(w0, w1, w2, 0)];                                            \
-      ++acc_[tran3(w0, w1, w3, 1)];                                            \
-      ++acc_[tran3(w0, w2, w3, 2)];                                            \
-      ++acc_[tran3(w0, w1, w4, 3)];                                            \
-      ++acc_[tran3(w0, w2, w4, 4)];                                            \
-      ++acc_[tran3(w0, w3, w4, 5)];                                            \
-      ++acc_[tran3(w4, w1, w0, 6)];                                            \
-      ++acc_[tran3(w4, w3, w0, 7)];                                            \
+      ++acc_[tran3_fast<0>(w0, w1, w2)];                                       \
+      ++acc_[tran3_fast<1>(w0, w1, w3)];                                       \
+      ++acc_[tran3_fast<2>(w0, w2, w3)];                                       \
+      ++acc_[tran3_fast<3>(w0, w1, w4)];                                       \
+      ++acc_[tran3_fast<4>(w0, w2, w4)];                                       \
+      ++acc_[tran3_fast<5>(w0, w3, w4)];                                       \
+      ++acc_[tran3_fast<6>(w4, w1, w0)];                                       \
+      ++acc_[tran3_fast<7>(w4, w3, w0)];                                       \
                                                                                \
       w4 = w3;                                                                 \
       w3 = w2;                                                                 \
@@ -172,6 +199,7 @@ class nilsimsa::impl {
   static_assert(true, "")
 
 #ifdef DWARFS_MULTIVERSIONING
+  __attribute__((target("avx2"))) DWARFS_NILSIMSA_UPDATE_FAST_IMPL;
   __attribute__((target("avx"))) DWARFS_NILSIMSA_UPDATE_FAST_IMPL;
   __attribute__((target("default")))
 #endif
@@ -193,6 +221,11 @@ void nilsimsa::update(uint8_t const* data, size_t size) {
 void nilsimsa::finalize(hash_type& hash) const { impl_->finalize(hash); }
 
 #ifdef DWARFS_MULTIVERSIONING
+__attribute__((target("avx512vpopcntdq,avx512vl"))) int
+nilsimsa::similarity(uint64_t const* a, uint64_t const* b) {
+  DWARFS_NILSIMSA_SIMILARITY_AVX512(return, a, b);
+}
+
 __attribute__((target("popcnt"))) int
 nilsimsa::similarity(uint64_t const* a, uint64_t const* b) {
   DWARFS_NILSIMSA_SIMILARITY(return, a, b);
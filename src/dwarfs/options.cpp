@@ -68,4 +68,27 @@ mlock_mode parse_mlock_mode(std::string_view mode) {
   DWARFS_THROW(runtime_error, fmt::format("invalid lock mode: {}", mode));
 }
 
+cache_policy parse_cache_policy(std::string_view policy) {
+  if (policy == "lru") {
+    return cache_policy::LRU;
+  }
+  if (policy == "slru") {
+    return cache_policy::SEGMENTED_LRU;
+  }
+  if (policy == "cost") {
+    return cache_policy::COST;
+  }
+  DWARFS_THROW(runtime_error, fmt::format("invalid cache policy: {}", policy));
+}
+
+file_read_mode parse_file_read_mode(std::string_view mode) {
+  if (mode == "mmap") {
+    return file_read_mode::MMAP;
+  }
+  if (mode == "pread") {
+    return file_read_mode::PREAD;
+  }
+  DWARFS_THROW(runtime_error, fmt::format("invalid read mode: {}", mode));
+}
+
 } // namespace dwarfs
@@ -0,0 +1,471 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string_view>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <folly/ScopeGuard.h>
+
+#include <fmt/format.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/logger.h"
+#include "dwarfs/mmif.h"
+#include "dwarfs/os_access_archive.h"
+
+namespace dwarfs {
+
+struct os_access_archive::node {
+  struct ::stat st {};
+  std::string link;
+  // only the data of the extents, stored back to back
+  std::shared_ptr<std::vector<uint8_t> const> data;
+  // (offset, size) ranges of data, everything else is a hole
+  std::vector<std::pair<size_t, size_t>> extents;
+  std::map<std::string, std::shared_ptr<node>> entries;
+};
+
+namespace {
+
+constexpr size_t kReadBlockSize{64 << 10};
+
+// The data of a file that has been read from the archive; holes in
+// sparse files are filled with zeros in a buffer owned by this object
+class archive_file final : public mmif {
+ public:
+  archive_file(std::shared_ptr<std::vector<uint8_t> const> data,
+               std::vector<std::pair<size_t, size_t>> const& extents,
+               size_t size)
+      : data_{expand(std::move(data), extents, size)}
+      , size_{std::min(size, data_->size())} {}
+
+  void const* addr() const override { return data_->data(); }
+  size_t size() const override { return size_; }
+
+  // The data is kept in memory for as long as this object exists, so
+  // there's nothing to lock or to release.
+  boost::system::error_code lock(off_t, size_t) override { return {}; }
+  boost::system::error_code release(off_t, size_t) override { return {}; }
+  boost::system::error_code release_until(off_t) override { return {}; }
+  boost::system::error_code advise_sequential(off_t, size_t) override {
+    return {};
+  }
+  boost::system::error_code advise_willneed(off_t, size_t) override {
+    return {};
+  }
+
+ private:
+  static std::shared_ptr<std::vector<uint8_t> const>
+  expand(std::shared_ptr<std::vector<uint8_t> const> data,
+         std::vector<std::pair<size_t, size_t>> const& extents, size_t size) {
+    // a file without holes can be used as it is; trailing holes must be
+    // expanded, too, as users rely on size() covering the whole file
+    if (extents.size() == 1 && extents.front().first == 0 &&
+        extents.front().second >= size) {
+      return data;
+    }
+
+    auto full = std::make_shared<std::vector<uint8_t>>(size);
+    size_t pos = 0;
+
+    for (auto [offset, len] : extents) {
+      if (offset >= size) {
+        break;
+      }
+      std::memcpy(full->data() + offset, data->data() + pos,
+                  std::min(len, size - offset));
+      pos += len;
+    }
+
+    return full;
+  }
+
+  std::shared_ptr<std::vector<uint8_t> const> data_;
+  size_t const size_;
+};
+
+class archive_dir_reader final : public dir_reader {
+ public:
+  explicit archive_dir_reader(std::vector<std::string> names)
+      : names_{std::move(names)} {}
+
+  bool read(std::string& name) const override {
+    if (next_ < names_.size()) {
+      name = names_[next_++];
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  std::vector<std::string> const names_;
+  mutable size_t next_{0};
+};
+
+std::vector<std::string> split_path(std::string_view const full) {
+  std::vector<std::string> parts;
+  auto path = full;
+
+  while (!path.empty()) {
+    auto pos = path.find('/');
+    auto part = path.substr(0, pos);
+
+    if (part == "..") {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("unsupported path in archive: {}", full));
+    }
+
+    if (!part.empty() && part != ".") {
+      parts.emplace_back(part);
+    }
+
+    if (pos == std::string_view::npos) {
+      break;
+    }
+
+    path.remove_prefix(pos + 1);
+  }
+
+  return parts;
+}
+
+} // namespace
+
+os_access_archive::os_access_archive(logger& lgr, std::string const& path) {
+  LOG_PROXY(debug_logger_policy, lgr);
+
+  ino_t next_ino = 1;
+
+  auto make_dir = [&next_ino] {
+    auto n = std::make_shared<node>();
+    n->st.st_mode = S_IFDIR | 0755;
+    n->st.st_nlink = 1;
+    n->st.st_ino = next_ino++;
+    return n;
+  };
+
+  root_ = make_dir();
+
+  auto a = ::archive_read_new();
+
+  SCOPE_EXIT { ::archive_read_free(a); };
+
+  auto check_result = [&](int res) {
+    switch (res) {
+    case ARCHIVE_OK:
+      break;
+    case ARCHIVE_WARN:
+      LOG_WARN << path << ": " << ::archive_error_string(a);
+      break;
+    default:
+      DWARFS_THROW(runtime_error, fmt::format("{}: {}", path,
+                                              ::archive_error_string(a)));
+    }
+  };
+
+  check_result(::archive_read_support_filter_all(a));
+  check_result(::archive_read_support_format_all(a));
+
+  if (path == "-") {
+    check_result(::archive_read_open_fd(a, STDIN_FILENO, kReadBlockSize));
+  } else {
+    check_result(
+        ::archive_read_open_filename(a, path.c_str(), kReadBlockSize));
+  }
+
+  // Returns the directory holding the last component of parts, creating
+  // all missing directories on the way
+  auto parent_dir = [&](std::vector<std::string> const& parts) {
+    auto dir = root_.get();
+
+    for (size_t i = 0; i + 1 < parts.size(); ++i) {
+      auto& sub = dir->entries[parts[i]];
+
+      if (!sub) {
+        sub = make_dir();
+      } else if (!S_ISDIR(sub->st.st_mode)) {
+        DWARFS_THROW(runtime_error,
+                     fmt::format("{}: not a directory in archive", parts[i]));
+      }
+
+      dir = sub.get();
+    }
+
+    return dir;
+  };
+
+  // Returns the entry for parts, or nullptr, without creating anything
+  auto lookup = [this](std::vector<std::string> const& parts) {
+    auto n = root_;
+
+    for (auto const& part : parts) {
+      auto it = n->entries.find(part);
+
+      if (it == n->entries.end()) {
+        return std::shared_ptr<node>();
+      }
+
+      n = it->second;
+    }
+
+    return n;
+  };
+
+  struct ::archive_entry* ae;
+
+  for (;;) {
+    auto res = ::archive_read_next_header(a, &ae);
+
+    if (res == ARCHIVE_EOF) {
+      break;
+    }
+
+    check_result(res);
+
+    auto parts = split_path(::archive_entry_pathname(ae));
+    auto const st = ::archive_entry_stat(ae);
+
+    if (auto target = ::archive_entry_hardlink(ae)) {
+      auto orig = lookup(split_path(target));
+
+      if (!orig || S_ISDIR(orig->st.st_mode) || parts.empty()) {
+        LOG_WARN << path << ": ignoring invalid hardlink "
+                 << ::archive_entry_pathname(ae) << " -> " << target;
+        continue;
+      }
+
+      // all links share the same node, and thus the same inode number
+      parent_dir(parts)->entries[parts.back()] = orig;
+      ++orig->st.st_nlink;
+      continue;
+    }
+
+    if (parts.empty()) {
+      // the root directory itself
+      if (S_ISDIR(st->st_mode)) {
+        auto ino = root_->st.st_ino;
+        root_->st = *st;
+        root_->st.st_ino = ino;
+        root_->st.st_nlink = 1;
+      }
+      continue;
+    }
+
+    auto dir = parent_dir(parts);
+    auto& ent = dir->entries[parts.back()];
+
+    if (ent && S_ISDIR(ent->st.st_mode) && S_ISDIR(st->st_mode)) {
+      // directories can be listed more than once, keep their contents
+      auto ino = ent->st.st_ino;
+      ent->st = *st;
+      ent->st.st_ino = ino;
+      ent->st.st_nlink = 1;
+      continue;
+    }
+
+    // later entries replace earlier ones
+    ent = std::make_shared<node>();
+    ent->st = *st;
+    ent->st.st_ino = next_ino++;
+    ent->st.st_nlink = 1;
+
+    if (S_ISLNK(st->st_mode)) {
+      if (auto target = ::archive_entry_symlink(ae)) {
+        ent->link = target;
+      }
+      ent->st.st_size = ent->link.size();
+    } else if (S_ISREG(st->st_mode)) {
+      auto const size = static_cast<size_t>(
+          std::max<int64_t>(::archive_entry_size(ae), 0));
+      auto data = std::make_shared<std::vector<uint8_t>>();
+      auto& ext = ent->extents;
+
+      if (::archive_entry_sparse_count(ae) == 0) {
+        data->reserve(size);
+      }
+
+      for (;;) {
+        void const* buf;
+        size_t len;
+        int64_t offset;
+
+        res = ::archive_read_data_block(a, &buf, &len, &offset);
+
+        if (res == ARCHIVE_EOF) {
+          break;
+        }
+
+        check_result(res);
+
+        if (len == 0) {
+          continue;
+        }
+
+        // data blocks are always delivered in ascending order
+        if (offset < 0 || static_cast<size_t>(offset) + len > size ||
+            (!ext.empty() && static_cast<size_t>(offset) <
+                                 ext.back().first + ext.back().second)) {
+          DWARFS_THROW(runtime_error,
+                       fmt::format("{}: invalid data for {}", path,
+                                   ::archive_entry_pathname(ae)));
+        }
+
+        auto const* p = static_cast<uint8_t const*>(buf);
+        data->insert(data->end(), p, p + len);
+
+        if (!ext.empty() && ext.back().first + ext.back().second ==
+                                static_cast<size_t>(offset)) {
+          ext.back().second += len;
+        } else {
+          ext.emplace_back(offset, len);
+        }
+      }
+
+      data->shrink_to_fit();
+      ent->data = std::move(data);
+      ent->st.st_size = size;
+    }
+  }
+}
+
+os_access_archive::~os_access_archive() = default;
+
+auto os_access_archive::find(std::string const& path) const -> node* {
+  auto n = root_.get();
+
+  for (auto const& part : split_path(path)) {
+    if (!S_ISDIR(n->st.st_mode)) {
+      return nullptr;
+    }
+
+    auto it = n->entries.find(part);
+
+    if (it == n->entries.end()) {
+      return nullptr;
+    }
+
+    n = it->second.get();
+  }
+
+  return n;
+}
+
+auto os_access_archive::get(std::string const& path, char const* what) const
+    -> node& {
+  if (auto n = find(path)) {
+    return *n;
+  }
+
+  DWARFS_THROW(system_error, fmt::format("{}('{}')", what, path), ENOENT);
+}
+
+std::shared_ptr<dir_reader>
+os_access_archive::opendir(const std::string& path) const {
+  auto& n = get(path, "opendir");
+
+  if (!S_ISDIR(n.st.st_mode)) {
+    DWARFS_THROW(system_error, fmt::format("opendir('{}')", path), ENOTDIR);
+  }
+
+  std::vector<std::string> names;
+  names.reserve(n.entries.size());
+
+  for (auto const& [name, ent] : n.entries) {
+    names.push_back(name);
+  }
+
+  return std::make_shared<archive_dir_reader>(std::move(names));
+}
+
+void os_access_archive::lstat(const std::string& path,
+                              struct ::stat* st) const {
+  *st = get(path, "lstat").st;
+}
+
+std::string
+os_access_archive::readlink(const std::string& path, size_t size) const {
+  auto& n = get(path, "readlink");
+
+  if (!S_ISLNK(n.st.st_mode) || n.link.size() != size) {
+    DWARFS_THROW(system_error, fmt::format("readlink('{}')", path), EINVAL);
+  }
+
+  return n.link;
+}
+
+std::shared_ptr<mmif>
+os_access_archive::map_file(const std::string& path, size_t size) const {
+  auto& n = get(path, "open");
+  std::shared_ptr<std::vector<uint8_t> const> data;
+
+  {
+    std::lock_guard lock(mx_);
+    data = n.data;
+  }
+
+  if (!data) {
+    DWARFS_THROW(system_error, fmt::format("open('{}')", path), EINVAL);
+  }
+
+  return std::make_shared<archive_file>(std::move(data), n.extents, size);
+}
+
+void os_access_archive::release_file(const std::string& path) const {
+  if (auto n = find(path)) {
+    std::lock_guard lock(mx_);
+    n->data.reset();
+  }
+}
+
+std::vector<std::pair<size_t, size_t>>
+os_access_archive::data_extents(const std::string& path, size_t size) const {
+  std::vector<std::pair<size_t, size_t>> extents;
+
+  for (auto [offset, len] : get(path, "open").extents) {
+    if (offset >= size) {
+      break;
+    }
+    extents.emplace_back(offset, std::min(len, size - offset));
+  }
+
+  return extents;
+}
+
+int os_access_archive::access(const std::string& path, int) const {
+  if (find(path)) {
+    return 0;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+} // namespace dwarfs
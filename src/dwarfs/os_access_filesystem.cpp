@@ -0,0 +1,266 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+
+#include <sys/stat.h>
+
+#include <fmt/format.h>
+
+#include "dwarfs/checksum.h"
+#include "dwarfs/error.h"
+#include "dwarfs/filesystem_v2.h"
+#include "dwarfs/fstypes.h"
+#include "dwarfs/mmif.h"
+#include "dwarfs/os_access_filesystem.h"
+
+namespace dwarfs {
+
+namespace {
+
+// The (partial) contents of a file read from the image
+class filesystem_file final : public mmif {
+ public:
+  explicit filesystem_file(std::vector<uint8_t> data)
+      : data_{std::move(data)} {}
+
+  void const* addr() const override { return data_.data(); }
+  size_t size() const override { return data_.size(); }
+
+  boost::system::error_code lock(off_t, size_t) override { return {}; }
+  boost::system::error_code release(off_t, size_t) override { return {}; }
+  boost::system::error_code release_until(off_t) override { return {}; }
+  boost::system::error_code advise_sequential(off_t, size_t) override {
+    return {};
+  }
+  boost::system::error_code advise_willneed(off_t, size_t) override {
+    return {};
+  }
+
+ private:
+  std::vector<uint8_t> const data_;
+};
+
+class filesystem_dir_reader final : public dir_reader {
+ public:
+  explicit filesystem_dir_reader(std::vector<std::string> names)
+      : names_{std::move(names)} {}
+
+  bool read(std::string& name) const override {
+    if (next_ < names_.size()) {
+      name = names_[next_++];
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  std::vector<std::string> const names_;
+  mutable size_t next_{0};
+};
+
+} // namespace
+
+os_access_filesystem::os_access_filesystem(
+    std::shared_ptr<filesystem_v2 const> fs)
+    : fs_{std::move(fs)} {}
+
+std::shared_ptr<dir_reader>
+os_access_filesystem::opendir(const std::string& path) const {
+  auto iv = fs_->find(path.c_str());
+
+  if (!iv) {
+    DWARFS_THROW(system_error, fmt::format("opendir('{}')", path), ENOENT);
+  }
+
+  auto dir = fs_->opendir(*iv);
+
+  if (!dir) {
+    DWARFS_THROW(system_error, fmt::format("opendir('{}')", path), ENOTDIR);
+  }
+
+  std::vector<std::string> names;
+  names.reserve(fs_->dirsize(*dir));
+
+  // skip the fake '.' and '..' entries
+  fs_->readdir(*dir, 2, [&](size_t, inode_view, std::string_view name) {
+    names.emplace_back(name);
+    return true;
+  });
+
+  return std::make_shared<filesystem_dir_reader>(std::move(names));
+}
+
+void os_access_filesystem::lstat(const std::string& path,
+                                 struct ::stat* st) const {
+  auto iv = fs_->find(path.c_str());
+
+  if (!iv) {
+    DWARFS_THROW(system_error, fmt::format("lstat('{}')", path), ENOENT);
+  }
+
+  if (auto err = fs_->getattr(*iv, st); err != 0) {
+    DWARFS_THROW(system_error, fmt::format("lstat('{}')", path), -err);
+  }
+}
+
+std::string
+os_access_filesystem::readlink(const std::string& path, size_t size) const {
+  auto iv = fs_->find(path.c_str());
+
+  if (!iv) {
+    DWARFS_THROW(system_error, fmt::format("readlink('{}')", path), ENOENT);
+  }
+
+  auto link = fs_->readlink(*iv);
+
+  if (!link) {
+    DWARFS_THROW(system_error, fmt::format("readlink('{}')", path),
+                 -link.error());
+  }
+
+  if (link->size() != size) {
+    DWARFS_THROW(runtime_error,
+                 fmt::format("readlink('{}'): unexpected size", path));
+  }
+
+  return std::move(*link);
+}
+
+std::shared_ptr<mmif>
+os_access_filesystem::map_file(const std::string& path, size_t size) const {
+  auto const inode = find_file(path, size, "open");
+  std::vector<uint8_t> data(size);
+  size_t offset = 0;
+
+  while (offset < size) {
+    auto rv = fs_->read(inode, reinterpret_cast<char*>(data.data()) + offset,
+                        size - offset, offset);
+
+    if (rv < 0) {
+      DWARFS_THROW(system_error, fmt::format("read('{}')", path), -rv);
+    }
+
+    if (rv == 0) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("read('{}'): unexpected end of file", path));
+    }
+
+    offset += rv;
+  }
+
+  return std::make_shared<filesystem_file>(std::move(data));
+}
+
+std::vector<std::pair<size_t, size_t>>
+os_access_filesystem::data_extents(const std::string& path,
+                                   size_t size) const {
+  auto chunks = fs_->get_chunks(find_file(path, size, "open"));
+  std::vector<std::pair<size_t, size_t>> extents;
+  size_t offset = 0;
+
+  for (auto const& c : *chunks) {
+    if (offset >= size) {
+      break;
+    }
+
+    size_t len = std::min<size_t>(c.size(), size - offset);
+
+    if (c.block() != HOLE_BLOCK) {
+      if (!extents.empty() &&
+          extents.back().first + extents.back().second == offset) {
+        extents.back().second += len;
+      } else {
+        extents.emplace_back(offset, len);
+      }
+    }
+
+    offset += len;
+  }
+
+  return extents;
+}
+
+int os_access_filesystem::access(const std::string& path, int) const {
+  if (fs_->find(path.c_str())) {
+    return 0;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+std::optional<std::string>
+os_access_filesystem::content_digest(const std::string& path,
+                                     size_t size) const {
+  auto iv = fs_->find(path.c_str());
+  struct ::stat st;
+
+  if (!iv || fs_->getattr(*iv, &st) != 0 || !S_ISREG(st.st_mode) ||
+      static_cast<size_t>(st.st_size) != size) {
+    return std::nullopt;
+  }
+
+  auto chunks = fs_->get_chunks(iv->inode_num());
+
+  if (!chunks) {
+    return std::nullopt;
+  }
+
+  // Files with the same chunk list always have identical contents, so
+  // the chunk list can stand in for the contents. The converse is not
+  // true: nothing guarantees that identical files share a chunk list,
+  // and those that don't get different digests and will simply not be
+  // deduplicated as files.
+  constexpr auto alg = checksum::algorithm::XXH3_128;
+  checksum cs(alg);
+
+  for (auto const& c : *chunks) {
+    std::array<uint32_t, 3> const v{c.block(), c.offset(), c.size()};
+    cs.update(v.data(), sizeof(v));
+  }
+
+  std::string digest(checksum::digest_size(alg), '\0');
+  DWARFS_CHECK(cs.finalize(digest.data()), "checksum computation failed");
+
+  return digest;
+}
+
+uint32_t os_access_filesystem::find_file(std::string const& path, size_t size,
+                                         char const* what) const {
+  auto iv = fs_->find(path.c_str());
+  struct ::stat st;
+
+  if (!iv) {
+    DWARFS_THROW(system_error, fmt::format("{}('{}')", what, path), ENOENT);
+  }
+
+  if (fs_->getattr(*iv, &st) != 0 || !S_ISREG(st.st_mode) ||
+      static_cast<size_t>(st.st_size) < size) {
+    DWARFS_THROW(system_error, fmt::format("{}('{}')", what, path), EINVAL);
+  }
+
+  return iv->inode_num();
+}
+
+} // namespace dwarfs
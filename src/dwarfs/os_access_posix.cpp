@@ -19,18 +19,24 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cerrno>
 #include <stdexcept>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <folly/ScopeGuard.h>
+
 #include <fmt/format.h>
 
 #include "dwarfs/error.h"
 #include "dwarfs/mmap.h"
 #include "dwarfs/os_access_posix.h"
+#include "dwarfs/pread_file.h"
 
 namespace dwarfs {
 
@@ -95,9 +101,61 @@ os_access_posix::readlink(const std::string& path, size_t size) const {
 
 std::shared_ptr<mmif>
 os_access_posix::map_file(const std::string& path, size_t size) const {
+  if (opts_.read_mode == file_read_mode::PREAD) {
+    return std::make_shared<pread_file>(path, size, opts_.read_size);
+  }
+
   return std::make_shared<mmap>(path, size);
 }
 
+std::vector<std::pair<size_t, size_t>>
+os_access_posix::data_extents(const std::string& path, size_t size) const {
+  std::vector<std::pair<size_t, size_t>> extents;
+
+  if (size == 0) {
+    return extents;
+  }
+
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    DWARFS_THROW(system_error, fmt::format("open('{}')", path));
+  }
+
+  SCOPE_EXIT { ::close(fd); };
+
+  off_t pos = 0;
+
+  while (static_cast<size_t>(pos) < size) {
+    auto data = ::lseek(fd, pos, SEEK_DATA);
+
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // nothing but a hole up to the end of the file
+        break;
+      }
+      // SEEK_DATA isn't supported, so assume there are no holes
+      return {{0, size}};
+    }
+
+    if (static_cast<size_t>(data) >= size) {
+      break;
+    }
+
+    auto hole = ::lseek(fd, data, SEEK_HOLE);
+
+    if (hole < 0) {
+      return {{0, size}};
+    }
+
+    auto end = std::min(static_cast<size_t>(hole), size);
+    extents.emplace_back(data, end - data);
+    pos = hole;
+  }
+
+  return extents;
+}
+
 int os_access_posix::access(const std::string& path, int mode) const {
   return ::access(path.c_str(), mode);
 }
@@ -0,0 +1,231 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/system/error_code.hpp>
+
+#include <fmt/format.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/pread_file.h"
+
+namespace dwarfs {
+
+namespace {
+
+// The data ahead of the current position is read in a window of at
+// least this size, so callers consuming large chunks at once always
+// find their data already in memory
+constexpr size_t kMinWindowSize{64 << 20};
+
+int safe_open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd == -1) {
+    DWARFS_THROW(system_error, fmt::format("open('{}')", path));
+  }
+
+  return fd;
+}
+
+void* safe_map(int fd, size_t size) {
+  if (size == 0) {
+    DWARFS_THROW(runtime_error, "empty file");
+  }
+
+  void* addr = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (addr == MAP_FAILED) {
+    DWARFS_THROW(system_error, "mmap");
+  }
+
+  return addr;
+}
+
+} // namespace
+
+pread_file::pread_file(const std::string& path, size_t size, size_t read_size)
+    : fd_(safe_open(path))
+    , size_(size)
+    , addr_(nullptr)
+    , page_size_(::sysconf(_SC_PAGESIZE)) {
+  // keep reads page aligned
+  read_size_ = std::max<size_t>(read_size - read_size % page_size_, page_size_);
+  window_size_ = std::max(kMinWindowSize, 4 * read_size_);
+
+  try {
+    addr_ = safe_map(fd_, size_);
+    ::posix_fadvise(fd_, 0, size_, POSIX_FADV_SEQUENTIAL);
+    read_ahead(0);
+  } catch (...) {
+    if (addr_) {
+      ::munmap(addr_, size_);
+    }
+    ::close(fd_);
+    throw;
+  }
+}
+
+pread_file::~pread_file() noexcept {
+  ::munmap(addr_, size_);
+  ::close(fd_);
+}
+
+void pread_file::read_ahead(size_t offset) {
+  size_t begin = std::max(filled_, offset - offset % page_size_);
+  size_t const end = std::min(size_, offset + window_size_);
+
+  if (begin >= end) {
+    return;
+  }
+
+  // replace the file mapping with anonymous memory for the new range
+  auto data = reinterpret_cast<uint8_t*>(addr_);
+  size_t const map_len = end - begin;
+
+  if (::mmap(data + begin, map_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    DWARFS_THROW(system_error, "mmap");
+  }
+
+  size_t const map_begin = begin;
+
+  while (begin < end) {
+    auto len = std::min(read_size_, end - begin);
+
+    // explicitly schedule the next read while we're waiting for this one
+    if (begin + len < size_) {
+      ::posix_fadvise(fd_, begin + len,
+                      std::min(read_size_, size_ - begin - len),
+                      POSIX_FADV_WILLNEED);
+    }
+
+    auto rv = ::pread(fd_, data + begin, len, begin);
+
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DWARFS_THROW(system_error, "pread");
+    }
+
+    if (rv == 0) {
+      DWARFS_THROW(runtime_error, "unexpected end of file");
+    }
+
+    ::posix_fadvise(fd_, begin, rv, POSIX_FADV_DONTNEED);
+
+    begin += rv;
+  }
+
+  if (::mprotect(data + map_begin, map_len, PROT_READ) != 0) {
+    DWARFS_THROW(system_error, "mprotect");
+  }
+
+  filled_ = end;
+}
+
+boost::system::error_code pread_file::remap(off_t offset, size_t size) {
+  boost::system::error_code ec;
+
+  if (size > 0) {
+    auto addr = reinterpret_cast<uint8_t*>(addr_) + offset;
+    if (::mmap(addr, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd_, offset) ==
+        MAP_FAILED) {
+      ec.assign(errno, boost::system::generic_category());
+    }
+  }
+
+  return ec;
+}
+
+boost::system::error_code pread_file::advance(size_t offset) {
+  boost::system::error_code ec;
+
+  try {
+    read_ahead(offset);
+  } catch (boost::system::system_error const& e) {
+    ec = e.code();
+  } catch (...) {
+    ec.assign(EIO, boost::system::generic_category());
+  }
+
+  return ec;
+}
+
+boost::system::error_code pread_file::lock(off_t offset, size_t size) {
+  boost::system::error_code ec;
+  auto addr = reinterpret_cast<uint8_t*>(addr_) + offset;
+  if (::mlock(addr, size) != 0) {
+    ec.assign(errno, boost::system::generic_category());
+  }
+  return ec;
+}
+
+boost::system::error_code pread_file::release(off_t offset, size_t size) {
+  auto const end = offset + size;
+  auto misalign = offset % page_size_;
+
+  offset -= misalign;
+  size += misalign;
+  size -= size % page_size_;
+
+  if (auto ec = remap(offset, size)) {
+    return ec;
+  }
+
+  return advance(end);
+}
+
+boost::system::error_code pread_file::release_until(off_t offset) {
+  auto const end = offset;
+
+  offset -= offset % page_size_;
+
+  if (offset > released_) {
+    if (auto ec = remap(released_, offset - released_)) {
+      return ec;
+    }
+
+    released_ = offset;
+  }
+
+  return advance(end);
+}
+
+boost::system::error_code pread_file::advise_sequential(off_t offset, size_t) {
+  return advance(offset);
+}
+
+boost::system::error_code pread_file::advise_willneed(off_t offset, size_t) {
+  return advance(offset);
+}
+
+void const* pread_file::addr() const { return addr_; }
+
+size_t pread_file::size() const { return size_; }
+} // namespace dwarfs
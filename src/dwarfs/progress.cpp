@@ -19,15 +19,57 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <chrono>
 #include <utility>
 
+#include <time.h>
+
 #include <folly/system/ThreadName.h>
 
+#include "dwarfs/event_tracer.h"
 #include "dwarfs/progress.h"
 
 namespace dwarfs {
 
+namespace {
+
+double clock_seconds(::clockid_t cid) {
+  struct ::timespec ts;
+  if (::clock_gettime(cid, &ts) != 0) {
+    return 0.0;
+  }
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+} // namespace
+
+object const* current_object::load() const {
+  std::lock_guard lock(mx_);
+
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    auto ix = (next_ + i) % slots_.size();
+    auto const& s = slots_[ix];
+
+    if (auto seq = s.seq.load(std::memory_order_acquire); seq != seen_[ix]) {
+      seen_[ix] = seq;
+      next_ = ix + 1;
+      return s.obj.load(std::memory_order_relaxed);
+    }
+  }
+
+  // nothing has changed, so stick with the last slot
+  return slots_[(next_ + slots_.size() - 1) % slots_.size()].obj.load(
+      std::memory_order_relaxed);
+}
+
+void current_object::reset() {
+  for (auto& s : slots_) {
+    s.obj.store(nullptr, std::memory_order_relaxed);
+    s.seq.fetch_add(1, std::memory_order_release);
+  }
+}
+
 progress::progress(folly::Function<void(const progress&, bool)>&& func,
                    unsigned interval_ms)
     : running_(true)
@@ -62,4 +104,69 @@ std::string progress::status(size_t max_len) const {
   return std::string();
 }
 
+void progress::begin_stage(std::string name) {
+  end_stage();
+  std::lock_guard lock(stage_mx_);
+  stages_.push_back({std::move(name)});
+  stage_start_.emplace(clock_seconds(CLOCK_MONOTONIC),
+                       clock_seconds(CLOCK_PROCESS_CPUTIME_ID));
+  stage_trace_start_ = event_tracer::enabled() ? event_tracer::now() : 0;
+}
+
+void progress::end_stage() {
+  std::lock_guard lock(stage_mx_);
+  if (stage_start_) {
+    auto& st = stages_.back();
+    st.wall_time = clock_seconds(CLOCK_MONOTONIC) - stage_start_->first;
+    st.cpu_time =
+        clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - stage_start_->second;
+    stage_start_.reset();
+    if (stage_trace_start_ > 0 && event_tracer::enabled()) {
+      event_tracer::complete("mkdwarfs", event_tracer::intern(st.name),
+                             stage_trace_start_, event_tracer::now());
+    }
+  }
+}
+
+std::vector<progress::stage_timing> progress::stages() const {
+  std::lock_guard lock(stage_mx_);
+  return stages_;
+}
+
+void progress::segmenter_stats::merge(segmenter_stats const& other) {
+  total_hashes += other.total_hashes;
+  duplicate_hashes += other.duplicate_hashes;
+  total_probes += other.total_probes;
+  max_probes = std::max(max_probes, other.max_probes);
+  total_matches += other.total_matches;
+  good_matches += other.good_matches;
+  bad_matches += other.bad_matches;
+  bloom_lookups += other.bloom_lookups;
+  bloom_hits += other.bloom_hits;
+  bloom_true_positives += other.bloom_true_positives;
+  cdc_chunks += other.cdc_chunks;
+  cdc_matches += other.cdc_matches;
+  merged_chunks += other.merged_chunks;
+}
+
+void progress::add_segmenter_stats(segmenter_stats const& st) {
+  std::lock_guard lock(stats_mx_);
+  segmenter_stats_.merge(st);
+}
+
+progress::segmenter_stats progress::get_segmenter_stats() const {
+  std::lock_guard lock(stats_mx_);
+  return segmenter_stats_;
+}
+
+void progress::add_block_stats(block_stats st) {
+  std::lock_guard lock(stats_mx_);
+  block_stats_.push_back(std::move(st));
+}
+
+std::vector<progress::block_stats> progress::written_blocks() const {
+  std::lock_guard lock(stats_mx_);
+  return block_stats_;
+}
+
 } // namespace dwarfs
@@ -21,6 +21,7 @@
 
 #include <chrono>
 #include <unordered_set>
+#include <vector>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/python.hpp>
@@ -42,17 +43,32 @@ namespace py = boost::python;
 
 namespace {
 
-std::unordered_set<std::string> supported_methods{"configure", "filter",
-                                                  "transform", "order"};
+std::unordered_set<std::string> supported_methods{
+    "configure",  "filter",       "transform",      "order",
+    "categorize", "filter_batch", "transform_batch"};
 
 void init_python() {
   static bool initialized = false;
   if (!initialized) {
     Py_Initialize();
+    // Only hold the GIL while actually running Python code, so the
+    // script can be called from other threads
+    PyEval_SaveThread();
     initialized = true;
   }
 }
 
+class gil_lock {
+ public:
+  gil_lock()
+      : state_(PyGILState_Ensure()) {}
+
+  ~gil_lock() { PyGILState_Release(state_); }
+
+ private:
+  PyGILState_STATE state_;
+};
+
 bool callable(py::object object) { return 1 == PyCallable_Check(object.ptr()); }
 
 bool hasattr(py::object obj, const char* name) {
@@ -142,12 +158,19 @@ class python_script::impl {
   void configure(options_interface const& oi);
   bool filter(entry_interface const& ei);
   void transform(entry_interface& ei);
+  std::vector<bool>
+  filter_batch(std::vector<entry_interface const*> const& entries);
+  void transform_batch(std::vector<entry_interface*> const& entries);
   void order(inode_vector& iv);
+  std::string categorize(entry_interface const& ei);
 
   bool has_configure() const { return has_configure_; }
-  bool has_filter() const { return has_filter_; }
-  bool has_transform() const { return has_transform_; }
+  bool has_filter() const { return has_filter_ || has_filter_batch_; }
+  bool has_transform() const {
+    return has_transform_ || has_transform_batch_;
+  }
   bool has_order() const { return has_order_; }
+  bool has_categorize() const { return has_categorize_; }
 
  private:
   void check_instance_methods(py::object obj) const;
@@ -174,7 +197,10 @@ class python_script::impl {
   bool has_configure_{false};
   bool has_filter_{false};
   bool has_transform_{false};
+  bool has_filter_batch_{false};
+  bool has_transform_batch_{false};
   bool has_order_{false};
+  bool has_categorize_{false};
   py::object instance_;
   py::object main_module_;
   py::object main_namespace_;
@@ -182,14 +208,18 @@ class python_script::impl {
   clock::duration filter_time_{};
   clock::duration transform_time_{};
   clock::duration order_time_{};
+  clock::duration categorize_time_{};
 };
 
 python_script::impl::impl(logger& lgr, const std::string& code,
                           const std::string& ctor)
     : log_(lgr)
     , pylog_(lgr) {
+  init_python();
+
+  gil_lock gil;
+
   try {
-    init_python();
 
     main_module_ = py::import("__main__");
     main_namespace_ = main_module_.attr("__dict__");
@@ -279,7 +309,10 @@ python_script::impl::impl(logger& lgr, const std::string& code,
     has_configure_ = has_callable(instance_, "configure");
     has_filter_ = has_callable(instance_, "filter");
     has_transform_ = has_callable(instance_, "transform");
+    has_filter_batch_ = has_callable(instance_, "filter_batch");
+    has_transform_batch_ = has_callable(instance_, "transform_batch");
     has_order_ = has_callable(instance_, "order");
+    has_categorize_ = has_callable(instance_, "categorize");
   } catch (py::error_already_set const&) {
     log_py_error();
     DWARFS_THROW(runtime_error, "error initializing script");
@@ -335,14 +368,21 @@ python_script::impl::~impl() {
   add_timing(has_filter_, "filter", filter_time_);
   add_timing(has_transform_, "transform", transform_time_);
   add_timing(has_order_, "order", order_time_);
+  add_timing(has_categorize_, "categorize", categorize_time_);
 
   LOG_INFO << "script time: " << boost::join(timings, ", ");
 
-  // nothing else, really, as boost::python docs forbid using Py_Finalize
+  // Drop our references while holding the GIL; nothing else, really,
+  // as boost::python docs forbid using Py_Finalize
+  gil_lock gil;
+  instance_ = py::object();
+  main_namespace_ = py::object();
+  main_module_ = py::object();
 }
 
 void python_script::impl::configure(options_interface const& oi) {
   timer tmr(configure_time_);
+  gil_lock gil;
   try {
     instance_.attr("configure")(py::ptr(&oi));
   } catch (py::error_already_set const&) {
@@ -352,7 +392,12 @@ void python_script::impl::configure(options_interface const& oi) {
 }
 
 bool python_script::impl::filter(entry_interface const& ei) {
+  if (!has_filter_) {
+    return filter_batch({&ei}).at(0);
+  }
+
   timer tmr(filter_time_);
+  gil_lock gil;
   try {
     return py::extract<bool>(
         instance_.attr("filter")(std::make_shared<entry_wrapper>(ei)));
@@ -363,7 +408,13 @@ bool python_script::impl::filter(entry_interface const& ei) {
 }
 
 void python_script::impl::transform(entry_interface& ei) {
+  if (!has_transform_) {
+    transform_batch({&ei});
+    return;
+  }
+
   timer tmr(transform_time_);
+  gil_lock gil;
   try {
     instance_.attr("transform")(std::make_shared<mutable_entry_wrapper>(ei));
   } catch (py::error_already_set const&) {
@@ -372,8 +423,79 @@ void python_script::impl::transform(entry_interface& ei) {
   }
 }
 
+// Without a batch method in the script, this still saves taking the
+// GIL for every single entry
+std::vector<bool> python_script::impl::filter_batch(
+    std::vector<entry_interface const*> const& entries) {
+  timer tmr(filter_time_);
+  gil_lock gil;
+  try {
+    std::vector<bool> keep;
+    keep.reserve(entries.size());
+
+    if (has_filter_batch_) {
+      py::list batch;
+
+      for (auto e : entries) {
+        batch.append(std::make_shared<entry_wrapper>(*e));
+      }
+
+      py::object result = instance_.attr("filter_batch")(batch);
+
+      for (py::stl_input_iterator<py::object> it(result), end; it != end;
+           ++it) {
+        keep.push_back(py::extract<bool>(*it));
+      }
+
+      if (keep.size() != entries.size()) {
+        DWARFS_THROW(runtime_error,
+                     "filter_batch() returned different number of results");
+      }
+    } else {
+      py::object filter = instance_.attr("filter");
+
+      for (auto e : entries) {
+        keep.push_back(
+            py::extract<bool>(filter(std::make_shared<entry_wrapper>(*e))));
+      }
+    }
+
+    return keep;
+  } catch (py::error_already_set const&) {
+    log_py_error();
+    DWARFS_THROW(runtime_error, "error filtering entries");
+  }
+}
+
+void python_script::impl::transform_batch(
+    std::vector<entry_interface*> const& entries) {
+  timer tmr(transform_time_);
+  gil_lock gil;
+  try {
+    if (has_transform_batch_) {
+      py::list batch;
+
+      for (auto e : entries) {
+        batch.append(std::make_shared<mutable_entry_wrapper>(*e));
+      }
+
+      instance_.attr("transform_batch")(batch);
+    } else {
+      py::object transform = instance_.attr("transform");
+
+      for (auto e : entries) {
+        transform(std::make_shared<mutable_entry_wrapper>(*e));
+      }
+    }
+  } catch (py::error_already_set const&) {
+    log_py_error();
+    DWARFS_THROW(runtime_error, "error transforming entries");
+  }
+}
+
 void python_script::impl::order(inode_vector& iv) {
   timer tmr(order_time_);
+  gil_lock gil;
   try {
     py::list files;
 
@@ -427,6 +549,22 @@ void python_script::impl::order(inode_vector& iv) {
   }
 }
 
+std::string python_script::impl::categorize(entry_interface const& ei) {
+  timer tmr(categorize_time_);
+  gil_lock gil;
+  try {
+    py::object cat =
+        instance_.attr("categorize")(std::make_shared<entry_wrapper>(ei));
+    if (cat.is_none()) {
+      return std::string();
+    }
+    return py::extract<std::string>(cat);
+  } catch (py::error_already_set const&) {
+    log_py_error();
+    DWARFS_THROW(runtime_error, "error categorizing entry");
+  }
+}
+
 python_script::python_script(logger& lgr, const std::string& code,
                              const std::string& ctor)
     : impl_(std::make_unique<impl>(lgr, code, ctor)) {}
@@ -437,6 +575,9 @@ bool python_script::has_configure() const { return impl_->has_configure(); }
 bool python_script::has_filter() const { return impl_->has_filter(); }
 bool python_script::has_transform() const { return impl_->has_transform(); }
 bool python_script::has_order() const { return impl_->has_order(); }
+bool python_script::has_categorize() const {
+  return impl_->has_categorize();
+}
 
 void python_script::configure(options_interface const& oi) {
   impl_->configure(oi);
@@ -450,4 +591,18 @@ void python_script::transform(entry_interface& ei) { impl_->transform(ei); }
 
 void python_script::order(inode_vector& iv) { impl_->order(iv); }
 
+std::string python_script::categorize(entry_interface const& ei) {
+  return impl_->categorize(ei);
+}
+
+std::vector<bool> python_script::filter_batch(
+    std::vector<entry_interface const*> const& entries) {
+  return impl_->filter_batch(entries);
+}
+
+void python_script::transform_batch(
+    std::vector<entry_interface*> const& entries) {
+  impl_->transform_batch(entries);
+}
+
 } // namespace dwarfs
@@ -20,19 +20,24 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
 #include <deque>
+#include <future>
 #include <iterator>
+#include <limits>
 #include <mutex>
 #include <numeric>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <boost/system/system_error.hpp>
@@ -42,15 +47,23 @@
 
 #include <fmt/format.h>
 
+#include <parallel_hashmap/phmap.h>
+
+#include "dwarfs/block_compressor.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/categorizer.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
+#include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fstypes.h"
 #include "dwarfs/global_entry_data.h"
 #include "dwarfs/inode.h"
 #include "dwarfs/inode_manager.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/memory_accountant.h"
 #include "dwarfs/metadata_v2.h"
+#include "dwarfs/mmif.h"
 #include "dwarfs/options.h"
 #include "dwarfs/os_access.h"
 #include "dwarfs/progress.h"
@@ -100,50 +113,73 @@ class file_scanner {
 
     p->create_data();
 
-    wg_.add_job([=] {
-      auto const size = p->size();
-      std::shared_ptr<mmif> mm;
+    // Files are bucketed by size first, as a file can only possibly be a
+    // duplicate of another file of the same size. Only once a second file
+    // of the same size shows up do we need to compute the hashes. Files
+    // that still have a unique size at the end of the scan never need to
+    // be hashed at all (see scan_unique_sizes()).
+    auto [it, is_new] = unique_size_.emplace(p->size(), inode::files_vector());
 
-      if (size > 0) {
-        mm = os_.map_file(p->path(), size);
-      }
+    if (is_new) {
+      it->second.push_back(p);
+      return;
+    }
 
-      prog_.current.store(p);
-      p->scan(mm, prog_);
-      ++prog_.files_scanned;
-      std::shared_ptr<inode> inode;
-
-      {
-        std::lock_guard lock(mx_);
-        auto& ref = hash_[p->hash()];
-        if (ref.empty()) {
-          inode = im_.create_inode();
-          p->set_inode(inode);
-        } else {
-          p->set_inode(ref.front()->get_inode());
-        }
-        ref.push_back(p);
+    if (!it->second.empty()) {
+      DWARFS_CHECK(it->second.size() == 1, "unexpected hardlinks in bucket");
+      hash_file(it->second.front());
+      it->second.clear();
+    }
+
+    hash_file(p);
+  }
+
+  void scan_unique_sizes() {
+    std::vector<worker_group::job_t> jobs;
+    jobs.reserve(unique_size_.size());
+
+    for (auto& [size, files] : unique_size_) {
+      if (files.empty()) {
+        continue;
       }
 
-      if (inode) {
+      jobs.emplace_back([this, p = files.front(), size = size] {
+        std::shared_ptr<inode> inode;
+
+        prog_.current.store(p);
+        prog_.original_size += size;
+        ++prog_.files_scanned;
+
+        inode = create_inode();
+        p->set_inode(inode);
+
         if (ino_opts_.needs_scan()) {
-          if (mm) {
-            inode->scan(mm, ino_opts_);
+          if (size > 0) {
+            inode->scan(os_.map_file(p->path(), size), ino_opts_);
           }
           ++prog_.inodes_scanned;
         }
-      } else {
-        ++prog_.duplicate_files;
-        prog_.saved_by_deduplication += size;
-      }
-    });
+      });
+    }
+
+    wg_.add_jobs(std::move(jobs));
   }
 
   void finalize(uint32_t& inode_num) {
     hardlink_cache_.clear();
 
+    // duplicates share the inode of the first file with the same hash
+    for (auto& [hash, fv] : hash_) {
+      for (size_t i = 1; i < fv.size(); ++i) {
+        fv[i]->set_inode(fv.front()->get_inode());
+      }
+    }
+
     for (auto p : hardlinked_) {
-      auto& fv = hash_[p->hash()];
+      auto it = unique_size_.find(p->size());
+      auto& fv = it != unique_size_.end() && !it->second.empty()
+                     ? it->second
+                     : hash_[p->hash()];
       p->set_inode(fv.front()->get_inode());
       fv.push_back(p);
     }
@@ -152,23 +188,93 @@ class file_scanner {
 
     uint32_t obj_num = 0;
 
-    finalize_inodes<true>(inode_num, obj_num);
-    finalize_inodes<false>(inode_num, obj_num);
+    finalize_inodes<true>(unique_size_, inode_num, obj_num);
+    finalize_inodes<true>(hash_, inode_num, obj_num);
+    finalize_inodes<false>(hash_, inode_num, obj_num);
 
+    unique_size_.clear();
     hash_.clear();
   }
 
   uint32_t num_unique() const { return num_unique_; }
 
  private:
-  template <bool Unique>
-  void finalize_inodes(uint32_t& inode_num, uint32_t& obj_num) {
-    for (auto& p : hash_) {
+  void hash_file(file* p) {
+    wg_.add_job([=] {
+      auto const size = p->size();
+      std::shared_ptr<mmif> mm;
+      std::optional<std::string> digest;
+
+      // If the data needs to be scanned anyway, there's no point in
+      // asking for a digest.
+      if (!ino_opts_.needs_scan()) {
+        digest = os_.content_digest(p->path(), size);
+      }
+
+      if (size > 0 && !digest) {
+        mm = os_.map_file(p->path(), size);
+      }
+
+      prog_.current.store(p);
+
+      // The similarity hashes are computed in the same pass as the
+      // checksum, even though they'll be thrown away if the file turns
+      // out to be a duplicate. This avoids reading the file twice.
+      std::optional<inode_hasher> hasher;
+
+      if (digest) {
+        p->set_hash(*digest, prog_);
+      } else if (ino_opts_.needs_scan()) {
+        hasher.emplace(ino_opts_);
+        p->scan(mm, prog_, [&](uint8_t const* data, size_t len) {
+          hasher->update(data, len);
+        });
+      } else {
+        p->scan(mm, prog_);
+      }
+
+      ++prog_.files_scanned;
+      bool is_new = false;
+
+      // Only the submap the hash belongs to is locked, and only for
+      // appending the file; duplicates get their inode in finalize().
+      hash_.lazy_emplace_l(
+          p->hash(), [&](auto& kv) { kv.second.push_back(p); },
+          [&](auto const& ctor) {
+            ctor(p->hash(), inode::files_vector{p});
+            is_new = true;
+          });
+
+      if (is_new) {
+        auto inode = create_inode();
+        p->set_inode(inode);
+
+        if (hasher) {
+          if (mm) {
+            hasher->finalize(*inode);
+          }
+          ++prog_.inodes_scanned;
+        }
+      } else {
+        ++prog_.duplicate_files;
+        prog_.saved_by_deduplication += size;
+      }
+    });
+  }
+
+  std::shared_ptr<inode> create_inode() {
+    std::lock_guard lock(mx_);
+    return im_.create_inode();
+  }
+
+  template <bool Unique, typename FileMap>
+  void finalize_inodes(FileMap& fmap, uint32_t& inode_num, uint32_t& obj_num) {
+    for (auto& p : fmap) {
       auto& files = p.second;
 
       if constexpr (Unique) {
         // this is true regardless of how the files are ordered
-        if (files.size() > files.front()->refcount()) {
+        if (files.empty() || files.size() > files.front()->refcount()) {
           continue;
         }
 
@@ -211,8 +317,24 @@ class file_scanner {
   uint32_t num_unique_{0};
   std::vector<file*> hardlinked_;
   folly::F14FastMap<uint64_t, file*> hardlink_cache_;
-  std::mutex mx_;
-  folly::F14FastMap<std::string_view, inode::files_vector> hash_;
+  folly::F14FastMap<uint64_t, inode::files_vector> unique_size_;
+  // the hashes are XXH3-128 digests, so any 64 bits of them make for
+  // a perfectly good hash value
+  struct digest_hash {
+    size_t operator()(std::string_view digest) const {
+      uint64_t h;
+      std::memcpy(&h, digest.data(), sizeof(h));
+      return h;
+    }
+  };
+
+  std::mutex mx_; // only protects im_
+  phmap::parallel_flat_hash_map<
+      std::string_view, inode::files_vector, digest_hash,
+      std::equal_to<std::string_view>,
+      std::allocator<std::pair<std::string_view const, inode::files_vector>>,
+      6, std::mutex>
+      hash_;
 };
 
 class dir_set_inode_visitor : public visitor_base {
@@ -418,6 +540,43 @@ std::string status_string(progress const& p, size_t width) {
   return label + path;
 }
 
+// Rough estimate of the memory used by an entry in the tree
+size_t entry_footprint(entry const& e) {
+  return std::max(sizeof(file), sizeof(dir)) + e.name().capacity();
+}
+
+// The segmenter emits separate chunks for data that is contiguous in a
+// block, e.g. for a match immediately followed by new data, or across
+// fragment boundaries. Merges all chunks from `first` onwards that
+// continue right where the previous one ends and returns the number of
+// chunks that have been removed.
+size_t
+coalesce_chunks(std::vector<thrift::metadata::chunk>& chunks, size_t first) {
+  if (chunks.size() < first + 2) {
+    return 0;
+  }
+
+  auto last = first;
+
+  for (auto i = first + 1; i < chunks.size(); ++i) {
+    auto& prev = chunks[last];
+    auto const& c = chunks[i];
+
+    // hole chunks are already as large as they can be
+    if (c.block == prev.block && c.block != HOLE_BLOCK &&
+        prev.offset + prev.size == c.offset) {
+      prev.size += c.size;
+    } else {
+      chunks[++last] = c;
+    }
+  }
+
+  auto const removed = chunks.size() - (last + 1);
+  chunks.resize(last + 1);
+
+  return removed;
+}
+
 } // namespace
 
 template <typename LoggerPolicy>
@@ -427,13 +586,77 @@ class scanner_ final : public scanner::impl {
            std::shared_ptr<entry_factory> ef, std::shared_ptr<os_access> os,
            std::shared_ptr<script> scr, const scanner_options& options);
 
-  void scan(filesystem_writer& fsw, const std::string& path,
-            progress& prog) override;
+  void scan(filesystem_writer& fsw, const std::string& path, progress& prog,
+            filesystem_v2 const* base) override;
+
+  void scan(std::vector<scanner::output> const& outputs,
+            const std::string& path, progress& prog) override {
+    scan_outputs(outputs, path, prog, nullptr);
+  }
 
  private:
+  // Everything that is shared by all images built from a single scan
+  struct scanned_tree {
+    std::shared_ptr<entry> root;
+    inode_manager& im;
+    file_scanner& fs;
+    std::vector<uint32_t> const& inode_category;
+    std::vector<std::string> const& categories;
+    global_entry_data& ge_data;
+    std::vector<uint32_t> const& symlink_table;
+    std::vector<uint64_t> const& devices;
+    std::shared_ptr<compression_dictionary const> dict;
+    uint32_t first_link_inode;
+    uint32_t first_file_inode;
+    uint32_t first_device_inode;
+    uint32_t last_inode;
+  };
+
+  void scan_outputs(std::vector<scanner::output> const& outputs,
+                    const std::string& path, progress& prog,
+                    filesystem_v2 const* base);
+
+  // Builds image number `image` of `num_images`. If there's more than
+  // one image, the order of the inodes is recorded in `order` for the
+  // first image and taken from it for all others. The input files are
+  // released once they have been segmented for the last image.
+  void build_image(scanner::output const& out, scanned_tree const& tree,
+                   progress& prog, filesystem_v2 const* base,
+                   std::vector<std::shared_ptr<inode>>& order, size_t image,
+                   size_t num_images);
+
+  std::optional<std::vector<thrift::metadata::chunk>>
+  find_base_chunks(filesystem_v2 const& base, std::string const& root_path,
+                   inode const& ino) const;
+
+  std::vector<std::string>
+  categorize_inodes(inode_manager const& im,
+                    std::vector<uint32_t>& inode_category);
+
+  std::shared_ptr<compression_dictionary const>
+  train_dictionary(inode_manager const& im);
+
   std::shared_ptr<entry>
   scan_tree(const std::string& path, progress& prog, file_scanner& fs);
 
+  struct listed_entry {
+    std::shared_ptr<entry> pe;
+    std::string error;
+  };
+
+  using dir_listing = std::vector<listed_entry>;
+
+  struct pending_dir {
+    std::shared_ptr<dir> d;
+    std::future<dir_listing> listing;
+    bool scripted{false};
+  };
+
+  dir_listing list_dir(std::shared_ptr<dir> const& parent);
+  void apply_script(dir_listing& listing);
+  pending_dir enqueue_dir(worker_group& wg, worker_group& script_wg,
+                          std::shared_ptr<entry> const& e);
+
   const block_manager::config& cfg_;
   const scanner_options& options_;
   std::shared_ptr<entry_factory> entry_;
@@ -460,6 +683,124 @@ scanner_<LoggerPolicy>::scanner_(logger& lgr, worker_group& wg,
     , lgr_(lgr)
     , LOG_PROXY_INIT(lgr_) {}
 
+template <typename LoggerPolicy>
+auto scanner_<LoggerPolicy>::list_dir(std::shared_ptr<dir> const& parent)
+    -> dir_listing {
+  dir_listing listing;
+  auto d = os_->opendir(parent->path());
+  std::string name;
+
+  while (d->read(name)) {
+    if (name == "." or name == "..") {
+      continue;
+    }
+
+    auto& le = listing.emplace_back();
+
+    try {
+      le.pe = entry_->create(*os_, name, parent);
+    } catch (const boost::system::system_error& e) {
+      le.error = e.what();
+    }
+  }
+
+  return listing;
+}
+
+// Runs the script's filter and transform on all entries of a directory
+// at once; entries that are filtered out are reset.
+template <typename LoggerPolicy>
+void scanner_<LoggerPolicy>::apply_script(dir_listing& listing) {
+  if (!script_) {
+    return;
+  }
+
+  std::vector<listed_entry*> batch;
+
+  for (auto& le : listing) {
+    if (le.pe) {
+      batch.push_back(&le);
+    }
+  }
+
+  if (batch.empty()) {
+    return;
+  }
+
+  if (script_->has_filter()) {
+    std::vector<entry_interface const*> entries;
+    entries.reserve(batch.size());
+    for (auto le : batch) {
+      entries.push_back(le->pe.get());
+    }
+
+    auto keep = script_->filter_batch(entries);
+
+    DWARFS_CHECK(keep.size() == batch.size(), "unexpected filter result");
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (keep[i]) {
+        batch[kept++] = batch[i];
+      } else {
+        LOG_DEBUG << "skipping " << batch[i]->pe->name();
+        batch[i]->pe.reset();
+      }
+    }
+
+    batch.resize(kept);
+  }
+
+  if (script_->has_transform() && !batch.empty()) {
+    std::vector<entry_interface*> entries;
+    entries.reserve(batch.size());
+    for (auto le : batch) {
+      entries.push_back(le->pe.get());
+    }
+
+    script_->transform_batch(entries);
+  }
+}
+
+template <typename LoggerPolicy>
+auto scanner_<LoggerPolicy>::enqueue_dir(worker_group& wg,
+                                         worker_group& script_wg,
+                                         std::shared_ptr<entry> const& e)
+    -> pending_dir {
+  pending_dir pd;
+
+  pd.d = std::dynamic_pointer_cast<dir>(e);
+
+  DWARFS_CHECK(pd.d, "expected directory");
+
+  if (wg) {
+    std::packaged_task<dir_listing()> task(
+        [this, d = pd.d] { return list_dir(d); });
+    pd.listing = task.get_future();
+    wg.add_job(std::move(task));
+
+    // The script runs on a single thread and thus sees the directories
+    // in the order in which they've been enqueued, i.e. in the order of
+    // discovery rather than depth-first. Only the order of the script
+    // calls differs from sequential mode, the results are consumed in
+    // depth-first order all the same.
+    if (script_wg) {
+      std::packaged_task<dir_listing()> script_task(
+          [this, listing = std::move(pd.listing)]() mutable {
+            auto l = listing.get();
+            apply_script(l);
+            return l;
+          });
+      pd.listing = script_task.get_future();
+      pd.scripted = true;
+      script_wg.add_job(std::move(script_task));
+    }
+  }
+
+  return pd;
+}
+
 template <typename LoggerPolicy>
 std::shared_ptr<entry>
 scanner_<LoggerPolicy>::scan_tree(const std::string& path, progress& prog,
@@ -470,41 +811,53 @@ scanner_<LoggerPolicy>::scan_tree(const std::string& path, progress& prog,
     DWARFS_THROW(runtime_error, fmt::format("'{}' must be a directory", path));
   }
 
-  std::deque<std::shared_ptr<entry>> queue({root});
+  // In parallel mode, directories are listed (and their entries lstat'ed)
+  // ahead of time by a pool of workers, but the results are consumed in
+  // exactly the same depth-first order as in sequential mode. This keeps
+  // script invocations, file scanning and thus the resulting image fully
+  // deterministic.
+  // The script calls are then overlapped with the traversal, running
+  // on their own thread.
+  worker_group lister;
+  worker_group scripter;
+
+  if (options_.num_scanner_workers > 0) {
+    lister = worker_group("lister", options_.num_scanner_workers);
+
+    if (script_ && (script_->has_filter() || script_->has_transform())) {
+      scripter = worker_group("script");
+    }
+  }
+
+  std::deque<pending_dir> queue;
+  queue.push_back(enqueue_dir(lister, scripter, root));
   prog.dirs_found++;
 
   while (!queue.empty()) {
-    auto parent = std::dynamic_pointer_cast<dir>(queue.front());
-
-    DWARFS_CHECK(parent, "expected directory");
+    auto pd = std::move(queue.front());
+    auto parent = std::move(pd.d);
 
     queue.pop_front();
-    const std::string& path = parent->path();
 
     try {
-      auto d = os_->opendir(path);
-      std::string name;
-      std::vector<std::shared_ptr<entry>> subdirs;
+      auto listing =
+          pd.listing.valid() ? pd.listing.get() : list_dir(parent);
+      std::vector<pending_dir> subdirs;
 
-      while (d->read(name)) {
-        if (name == "." or name == "..") {
-          continue;
-        }
+      if (!pd.scripted) {
+        apply_script(listing);
+      }
 
+      for (auto& le : listing) {
         try {
-          auto pe = entry_->create(*os_, name, parent);
-
-          if (script_) {
-            if (script_->has_filter() && !script_->filter(*pe)) {
-              LOG_DEBUG << "skipping " << name;
-              continue;
-            }
-
-            if (script_->has_transform()) {
-              script_->transform(*pe);
-            }
+          if (!le.error.empty()) {
+            LOG_ERROR << "error reading entry: " << le.error;
+            prog.errors++;
+            continue;
           }
 
+          auto pe = std::move(le.pe);
+
           if (pe) {
             switch (pe->type()) {
             case entry::E_FILE:
@@ -532,13 +885,14 @@ scanner_<LoggerPolicy>::scan_tree(const std::string& path, progress& prog,
             }
 
             parent->add(pe);
+            prog.memory.charge(memory_stage::SCANNER, entry_footprint(*pe));
 
             switch (pe->type()) {
             case entry::E_DIR:
               // prog.current.store(pe.get());
               prog.dirs_found++;
               pe->scan(*os_, prog);
-              subdirs.push_back(pe);
+              subdirs.push_back(enqueue_dir(lister, scripter, pe));
               break;
 
             case entry::E_FILE:
@@ -570,7 +924,8 @@ scanner_<LoggerPolicy>::scan_tree(const std::string& path, progress& prog,
         }
       }
 
-      queue.insert(queue.begin(), subdirs.begin(), subdirs.end());
+      queue.insert(queue.begin(), std::make_move_iterator(subdirs.begin()),
+                   std::make_move_iterator(subdirs.end()));
 
       prog.dirs_scanned++;
     } catch (const boost::system::system_error& e) {
@@ -582,18 +937,229 @@ scanner_<LoggerPolicy>::scan_tree(const std::string& path, progress& prog,
   return root;
 }
 
+template <typename LoggerPolicy>
+std::optional<std::vector<thrift::metadata::chunk>>
+scanner_<LoggerPolicy>::find_base_chunks(filesystem_v2 const& base,
+                                         std::string const& root_path,
+                                         inode const& ino) const {
+  auto const res = options_.time_resolution_sec;
+
+  for (auto fp : ino.files()) {
+    // All file paths start with the root path and a separator
+    auto rel = fp->path().substr(root_path.size() + 1);
+    auto iv = base.find(rel.c_str());
+
+    if (!iv) {
+      continue;
+    }
+
+    struct ::stat st;
+
+    if (base.getattr(*iv, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    auto const& cur = fp->status();
+
+    if (static_cast<uint64_t>(st.st_size) != cur.size ||
+        static_cast<uint64_t>(st.st_mtime) != (cur.mtime / res) * res) {
+      continue;
+    }
+
+    auto chunks = base.get_chunks(iv->inode_num());
+
+    if (!chunks) {
+      continue;
+    }
+
+    std::vector<thrift::metadata::chunk> result;
+    result.reserve(chunks->size());
+
+    for (auto const& c : *chunks) {
+      auto& rc = result.emplace_back();
+      rc.block = c.block();
+      rc.offset = c.offset();
+      rc.size = c.size();
+    }
+
+    LOG_TRACE << "reusing " << chunks->size() << " chunks for " << rel;
+
+    return result;
+  }
+
+  return std::nullopt;
+}
+
+template <typename LoggerPolicy>
+std::vector<std::string>
+scanner_<LoggerPolicy>::categorize_inodes(inode_manager const& im,
+                                          std::vector<uint32_t>& inode_category) {
+  auto ti = LOG_TIMED_INFO;
+  categorizer cat(script_);
+  std::vector<std::string> names(im.count());
+
+  im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
+    wg_.add_job([&, ino] {
+      auto const* f = ino->any();
+      auto const size = std::min(ino->size(), categorizer::head_size);
+      folly::ByteRange head;
+      std::shared_ptr<mmif> mm;
+
+      if (size > 0) {
+        try {
+          mm = os_->map_file(f->path(), size);
+          head = mm->range(0, size);
+        } catch (...) {
+          LOG_WARN << "failed to categorize " << f->path() << ": "
+                   << folly::exceptionStr(std::current_exception());
+        }
+      }
+
+      names[ino->num()] = size > 0 ? cat.categorize(*f, head)
+                                   : std::string(categorizer::DEFAULT);
+    });
+  });
+
+  wg_.wait();
+
+  // The default category always comes first, all others are sorted by
+  // name. The category index determines the order in which the blocks
+  // of each category are written, so it must not depend on the order in
+  // which the inodes have been numbered.
+  std::vector<std::string> categories(names.begin(), names.end());
+  std::sort(categories.begin(), categories.end());
+  categories.erase(std::unique(categories.begin(), categories.end()),
+                   categories.end());
+  categories.erase(std::remove(categories.begin(), categories.end(),
+                               categorizer::DEFAULT),
+                   categories.end());
+  categories.insert(categories.begin(), categorizer::DEFAULT);
+
+  folly::F14FastMap<std::string, uint32_t> index;
+  for (size_t i = 0; i < categories.size(); ++i) {
+    index.emplace(categories[i], i);
+  }
+
+  std::vector<size_t> counts(categories.size(), 0);
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto cat = index.at(names[i]);
+    inode_category[i] = cat;
+    ++counts[cat];
+  }
+
+  for (size_t i = 0; i < categories.size(); ++i) {
+    LOG_INFO << "category " << categories[i] << ": " << counts[i] << " inodes";
+  }
+
+  ti << "categorized " << names.size() << " inodes into " << categories.size()
+     << " categories";
+
+  return categories;
+}
+
+/**
+ * Train a compression dictionary from samples of the input files
+ *
+ * Samples are taken from evenly spaced inodes, and from several evenly
+ * spaced offsets of each inode if there are only few inodes, until the
+ * total sample size is about 100 times the dictionary size, which is
+ * what zstd recommends.
+ */
+template <typename LoggerPolicy>
+std::shared_ptr<compression_dictionary const>
+scanner_<LoggerPolicy>::train_dictionary(inode_manager const& im) {
+  static constexpr size_t kSampleSize = 8192;
+
+  auto ti = LOG_TIMED_INFO;
+  auto const max_size = options_.dictionary_size;
+  auto const budget = 100 * max_size;
+  std::vector<std::shared_ptr<inode>> inodes;
+
+  im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
+    if (ino->size() > 0) {
+      inodes.push_back(ino);
+    }
+  });
+
+  if (inodes.empty()) {
+    return nullptr;
+  }
+
+  auto const wanted = std::max<size_t>(1, budget / kSampleSize);
+  auto const stride = std::max<size_t>(1, inodes.size() / wanted);
+  auto const per_inode = std::max<size_t>(1, wanted / inodes.size());
+  std::vector<uint8_t> samples;
+  std::vector<size_t> sample_sizes;
+
+  for (size_t i = 0; i < inodes.size() && samples.size() < budget;
+       i += stride) {
+    auto const& ino = inodes[i];
+    auto const size = ino->size();
+
+    try {
+      auto mm = os_->map_file(ino->any()->path(), size);
+      auto const step = size / per_inode;
+
+      for (size_t k = 0; k < per_inode && samples.size() < budget; ++k) {
+        auto const offset = k * step;
+        auto sample = mm->range(offset, std::min(kSampleSize, size - offset));
+        samples.insert(samples.end(), sample.begin(), sample.end());
+        sample_sizes.push_back(sample.size());
+      }
+    } catch (...) {
+      LOG_WARN << "failed to sample " << ino->any()->path() << ": "
+               << folly::exceptionStr(std::current_exception());
+    }
+  }
+
+  try {
+    auto dict = compression_dictionary::train(samples, sample_sizes, max_size);
+
+    ti << "trained " << size_with_unit(dict.size()) << " dictionary from "
+       << sample_sizes.size() << " samples ("
+       << size_with_unit(samples.size()) << ")";
+
+    return std::make_shared<compression_dictionary>(std::move(dict));
+  } catch (runtime_error const& e) {
+    LOG_WARN << "not using a dictionary: " << e.what();
+  }
+
+  return nullptr;
+}
+
 template <typename LoggerPolicy>
 void scanner_<LoggerPolicy>::scan(filesystem_writer& fsw,
-                                  const std::string& path, progress& prog) {
+                                  const std::string& path, progress& prog,
+                                  filesystem_v2 const* base) {
+  scan_outputs({{fsw, cfg_}}, path, prog, base);
+}
+
+template <typename LoggerPolicy>
+void scanner_<LoggerPolicy>::scan_outputs(
+    std::vector<scanner::output> const& outputs, const std::string& path,
+    progress& prog, filesystem_v2 const* base) {
+  if (outputs.empty()) {
+    DWARFS_THROW(runtime_error, "no output images");
+  }
+
+  if (base && outputs.size() > 1) {
+    DWARFS_THROW(runtime_error,
+                 "a base image cannot be used with multiple outputs");
+  }
+
   LOG_INFO << "scanning " << path;
 
   prog.set_status_function(status_string);
+  prog.begin_stage("scan");
 
   inode_manager im(lgr_, prog);
   file_scanner fs(wg_, *os_, im, options_.inode, prog);
 
   auto root = scan_tree(path, prog, fs);
 
+  fs.scan_unique_sizes();
+
   if (options_.remove_empty_dirs) {
     LOG_INFO << "removing empty directories...";
     auto d = dynamic_cast<dir*>(root.get());
@@ -615,6 +1181,8 @@ void scanner_<LoggerPolicy>::scan(filesystem_writer& fsw,
 
   LOG_INFO << "scanning CPU time: " << time_with_unit(wg_.get_cpu_time());
 
+  prog.begin_stage("finalize");
+
   LOG_INFO << "finalizing file inodes...";
   uint32_t first_device_inode = first_file_inode;
   fs.finalize(first_device_inode);
@@ -624,16 +1192,24 @@ void scanner_<LoggerPolicy>::scan(filesystem_writer& fsw,
            << prog.duplicate_files << "/" << prog.files_found
            << " duplicate files";
 
+  std::vector<uint32_t> inode_category(im.count(), 0);
+  std::vector<std::string> categories{categorizer::DEFAULT};
+
+  if (options_.categorize) {
+    prog.begin_stage("categorize");
+    LOG_INFO << "categorizing file inodes...";
+    categories = categorize_inodes(im, inode_category);
+  }
+
   global_entry_data ge_data(options_);
-  thrift::metadata::metadata mv2;
+  std::vector<uint32_t> symlink_table(first_file_inode - first_link_inode);
 
-  mv2.symlink_table.resize(first_file_inode - first_link_inode);
+  prog.begin_stage("prepare");
 
   LOG_INFO << "assigning device inodes...";
   uint32_t first_pipe_inode = first_device_inode;
   device_set_inode_visitor devsiv(first_pipe_inode);
   root->accept(devsiv);
-  mv2.devices_ref() = std::move(devsiv.device_ids());
 
   LOG_INFO << "assigning pipe/socket inodes...";
   uint32_t last_inode = first_pipe_inode;
@@ -654,100 +1230,516 @@ void scanner_<LoggerPolicy>::scan(filesystem_writer& fsw,
       ep->update(ge_data);
       if (auto lp = dynamic_cast<link*>(ep)) {
         DWARFS_NOTHROW(
-            mv2.symlink_table.at(ep->inode_num().value() - first_link_inode)) =
+            symlink_table.at(ep->inode_num().value() - first_link_inode)) =
             ge_data.get_symlink_table_entry(lp->linkname());
       }
     });
   });
 
+  std::shared_ptr<compression_dictionary const> dict;
+
+  if (options_.dictionary_size > 0) {
+    prog.begin_stage("dictionary");
+    LOG_INFO << "training compression dictionary...";
+    dict = train_dictionary(im);
+  }
+
+  scanned_tree tree{root,
+                    im,
+                    fs,
+                    inode_category,
+                    categories,
+                    ge_data,
+                    symlink_table,
+                    devsiv.device_ids(),
+                    dict,
+                    first_link_inode,
+                    first_file_inode,
+                    first_device_inode,
+                    last_inode};
+
+  // Inodes are only ordered for the first image, the other images
+  // are built from the same order
+  std::vector<std::shared_ptr<inode>> order;
+
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (outputs.size() > 1) {
+      LOG_INFO << "building image " << (i + 1) << " of " << outputs.size();
+    }
+
+    build_image(outputs[i], tree, prog, base, order, i, outputs.size());
+  }
+
+  prog.end_stage();
+
+  for (auto const& st : prog.stages()) {
+    LOG_DEBUG << "stage " << st.name << ": " << time_with_unit(st.wall_time)
+              << " wall, " << time_with_unit(st.cpu_time) << " CPU";
+  }
+}
+
+template <typename LoggerPolicy>
+void scanner_<LoggerPolicy>::build_image(
+    scanner::output const& out, scanned_tree const& tree, progress& prog,
+    filesystem_v2 const* base, std::vector<std::shared_ptr<inode>>& order,
+    size_t image, size_t num_images) {
+  auto& fsw = out.fsw;
+  auto const& cfg = out.cfg;
+  auto& root = tree.root;
+  auto& im = tree.im;
+  auto& fs = tree.fs;
+  auto const& inode_category = tree.inode_category;
+  auto const& categories = tree.categories;
+  auto& ge_data = tree.ge_data;
+  auto const first_link_inode = tree.first_link_inode;
+  auto const first_file_inode = tree.first_file_inode;
+  auto const first_device_inode = tree.first_device_inode;
+  auto const last_inode = tree.last_inode;
+  auto const compressed_before = prog.compressed_size.load();
+  bool const record = num_images > 1 && image == 0;
+  bool const replay = image > 0;
+  bool const release_files = image + 1 == num_images;
+
+  // keep the timings of the stages of each image apart
+  auto begin_stage = [&](char const* name) {
+    prog.begin_stage(num_images > 1 ? fmt::format("{} #{}", name, image + 1)
+                                    : std::string(name));
+  };
+
+  if (replay) {
+    // the chunks of the previous image are no longer needed
+    im.for_each_inode_in_order(
+        [](std::shared_ptr<inode> const& ino) { ino->clear_chunks(); });
+  }
+
   LOG_INFO << "building blocks...";
-  block_manager bm(lgr_, prog, cfg_, os_, fsw);
-
-  worker_group blockify("blockify", 1, 1 << 20);
-
-  im.order_inodes(script_, options_.file_order,
-                  [&](std::shared_ptr<inode> const& ino) {
-                    blockify.add_job([&] {
-                      prog.current.store(ino.get());
-                      bm.add_inode(ino);
-                      prog.inodes_written++;
-                    });
-                    auto queued_files = blockify.queue_size();
-                    auto queued_blocks = fsw.queue_fill();
-                    prog.blockify_queue = queued_files;
-                    prog.compress_queue = queued_blocks;
-                    return INT64_C(500) * queued_blocks +
-                           static_cast<int64_t>(queued_files);
-                  });
+  auto bm_cfg = cfg;
+  size_t reused_inodes = 0;
+  // chunks of unchanged files in the base image, by inode number
+  std::vector<std::optional<std::vector<thrift::metadata::chunk>>>
+      base_chunks;
+
+  if (base) {
+    auto const block_size = static_cast<size_t>(1) << cfg.block_size_bits;
+
+    if (base->block_size() != block_size) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("block size of base image ({}) does not match",
+                               size_with_unit(base->block_size())));
+    }
+
+    auto const root_path = root->path();
+    base_chunks.resize(im.count());
+
+    // Inodes with fragments are segmented fragment by fragment, so
+    // they cannot reuse the chunks of a single base image file
+    im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
+      if (ino->fragments().empty()) {
+        wg_.add_job([&, ino] {
+          base_chunks[ino->num()] = find_base_chunks(*base, root_path, *ino);
+        });
+      }
+    });
+
+    wg_.wait();
+
+    reused_inodes = std::count_if(base_chunks.begin(), base_chunks.end(),
+                                  [](auto const& c) { return c.has_value(); });
+
+    if (options_.base_is_reference) {
+      LOG_INFO << "referencing " << base->num_blocks()
+               << " blocks from reference image";
+      bm_cfg.first_block = base->num_blocks();
+      fsw.enable_feature(image_feature::REFERENCE_IMAGE);
+    } else {
+      // Only copy the blocks that are still referenced, and renumber the
+      // reused chunks accordingly
+      static constexpr size_t kNoBlock = std::numeric_limits<size_t>::max();
+      std::vector<size_t> block_map(base->num_blocks(), kNoBlock);
+
+      for (auto const& chunks : base_chunks) {
+        if (chunks) {
+          for (auto const& c : *chunks) {
+            if (c.block != HOLE_BLOCK) {
+              DWARFS_NOTHROW(block_map.at(c.block)) = 0;
+            }
+          }
+        }
+      }
+
+      std::vector<size_t> blocks;
+
+      for (size_t i = 0; i < block_map.size(); ++i) {
+        if (block_map[i] != kNoBlock) {
+          block_map[i] = blocks.size();
+          blocks.push_back(i);
+        }
+      }
+
+      for (auto& chunks : base_chunks) {
+        if (chunks) {
+          for (auto& c : *chunks) {
+            if (c.block != HOLE_BLOCK) {
+              c.block = block_map[c.block];
+            }
+          }
+        }
+      }
+
+      LOG_INFO << "copying " << blocks.size() << "/" << base->num_blocks()
+               << " blocks from base image";
+      base->copy_blocks(fsw, blocks);
+      bm_cfg.first_block = blocks.size();
+    }
+  }
+
+  if (tree.dict) {
+    fsw.write_dictionary(tree.dict);
+  }
+
+  // With more than one segmenter, the ordered inodes are split into runs
+  // of consecutive inodes that are distributed among the segmenters. Each
+  // segmenter only sees its own blocks for de-duplication. The block
+  // numbers used by each segmenter have to be mapped to the final block
+  // numbers once all chunks are known.
+  //
+  // To keep the image reproducible, blocks are handed to the writer in
+  // the order of the jobs they have been emitted by rather than the order
+  // in which they're finished. Blocks of the oldest unfinished job are
+  // written right away, those of later jobs are held back until all
+  // previous jobs are done.
+  //
+  // Each category gets its own set of segmenters, so data from different
+  // categories never ends up in the same block. Blocks can be compressed
+  // with a category specific compressor.
+  struct segmenter {
+    std::unique_ptr<block_manager> bm;
+    worker_group wg;
+    std::vector<size_t> block_map;
+    size_t job{0};
+  };
+
+  struct pending_block {
+    size_t segmenter;
+    size_t num;
+    std::shared_ptr<block_data> data;
+  };
+
+  static constexpr uint32_t kNoSegmenter = std::numeric_limits<uint32_t>::max();
+
+  auto const num_segmenters = std::max<size_t>(1, options_.num_segmenters);
+  auto const num_categories = categories.size();
+  auto const run_size = static_cast<size_t>(16) << cfg.block_size_bits;
+  std::vector<segmenter> segmenters(num_categories * num_segmenters);
+  std::vector<uint32_t> inode_segmenter(im.count(), kNoSegmenter);
+  // all fragments of an inode must go to the same segmenter, otherwise
+  // their chunks couldn't be mapped to the final block numbers
+  std::vector<uint32_t> pinned_segmenter(im.count(), kNoSegmenter);
+  // bytes segmented per inode, only accessed by its pinned segmenter
+  std::vector<size_t> segmented_size(im.count(), 0);
+  std::vector<std::unique_ptr<block_compressor>> category_bc(num_categories);
+  std::mutex block_mx;
+  size_t next_block = bm_cfg.first_block;
+  size_t next_job = 0;
+  size_t num_jobs = 0;
+  std::vector<bool> job_done;
+  folly::F14FastMap<size_t, std::vector<pending_block>> pending_blocks;
+  std::vector<size_t> current(num_categories, 0);
+  std::vector<size_t> current_run(num_categories, 0);
+
+  for (size_t c = 0; c < num_categories; ++c) {
+    if (auto it = options_.category_compression.find(categories[c]);
+        it != options_.category_compression.end()) {
+      LOG_INFO << "using compression " << it->second << " for category "
+               << categories[c];
+      category_bc[c] = std::make_unique<block_compressor>(it->second);
+    }
+  }
+
+  // must be called with block_mx held
+  auto write_block = [&](pending_block&& b) {
+    auto const* bc = category_bc[b.segmenter / num_segmenters].get();
+    auto const& category = categories[b.segmenter / num_segmenters];
+    auto& map = segmenters[b.segmenter].block_map;
+    auto ix = b.num - bm_cfg.first_block;
+    if (map.size() <= ix) {
+      map.resize(ix + 1);
+    }
+    map[ix] = next_block++;
+    if (bc) {
+      fsw.write_block(std::move(b.data), *bc, category);
+    } else {
+      fsw.write_block(std::move(b.data), category);
+    }
+  };
+
+  auto finish_job = [&](size_t job) {
+    std::lock_guard lock(block_mx);
+    if (job_done.size() <= job) {
+      job_done.resize(job + 1);
+    }
+    job_done[job] = true;
+    while (next_job < job_done.size() && job_done[next_job]) {
+      ++next_job;
+      if (auto it = pending_blocks.find(next_job);
+          it != pending_blocks.end()) {
+        for (auto& b : it->second) {
+          write_block(std::move(b));
+        }
+        pending_blocks.erase(it);
+      }
+    }
+  };
+
+  for (size_t i = 0; i < segmenters.size(); ++i) {
+    auto& seg = segmenters[i];
+    seg.wg = worker_group("blockify", 1, 1 << 20);
+    seg.bm = std::make_unique<block_manager>(
+        lgr_, prog, bm_cfg, os_,
+        [&, i](size_t num, std::shared_ptr<block_data>&& data) {
+          std::lock_guard lock(block_mx);
+          pending_block b{i, num, std::move(data)};
+          if (auto job = segmenters[i].job; job == next_job) {
+            write_block(std::move(b));
+          } else {
+            pending_blocks[job].push_back(std::move(b));
+          }
+        });
+  }
+
+  begin_stage("order/segment");
+
+  auto add_inode = [&](std::shared_ptr<inode> const& ino) {
+    if (record) {
+      order.push_back(ino);
+    }
+
+    auto const cat = inode_category[ino->num()];
+    auto& pinned = pinned_segmenter[ino->num()];
+
+    if (pinned == kNoSegmenter) {
+      if (current_run[cat] >= run_size) {
+        current[cat] = (current[cat] + 1) % num_segmenters;
+        current_run[cat] = 0;
+      }
+
+      pinned = cat * num_segmenters + current[cat];
+    }
+
+    auto const seg_num = pinned;
+    auto& seg = segmenters[seg_num];
+    current_run[cat] += ino->size();
+
+    seg.wg.add_job([&, &bm = *seg.bm, ino, seg_num, job = num_jobs++] {
+      segmenters[seg_num].job = job;
+      prog.current.store(ino.get());
+      if (auto const* chunks =
+              base && !ino->is_fragment() ? &base_chunks[ino->num()] : nullptr;
+          chunks && *chunks) {
+        for (auto const& c : **chunks) {
+          ino->add_chunk(c.block, c.offset, c.size);
+        }
+      } else {
+        inode_segmenter[ino->num()] = seg_num;
+        bm.add_inode(ino);
+      }
+      // count each inode only once, no matter how many images are built
+      if (ino->fragment_offset() == 0 && !replay) {
+        prog.inodes_written++;
+      }
+      if (release_files) {
+        auto& done = segmented_size[ino->num()];
+        done += ino->size();
+        if (done == ino->any()->size()) {
+          for (auto fp : ino->files()) {
+            os_->release_file(fp->path());
+          }
+        }
+      }
+      finish_job(job);
+    });
+
+    size_t queued_files = 0;
+    for (auto const& s : segmenters) {
+      queued_files += s.wg.queue_size();
+    }
+    auto queued_blocks = fsw.queue_fill();
+    prog.blockify_queue = queued_files;
+    prog.compress_queue = queued_blocks;
+    return INT64_C(500) * queued_blocks + static_cast<int64_t>(queued_files);
+  };
+
+  if (replay) {
+    for (auto const& ino : order) {
+      add_inode(ino);
+    }
+  } else {
+    im.order_inodes(script_, options_.file_order, add_inode);
+  }
 
   LOG_INFO << "waiting for segmenting/blockifying to finish...";
 
-  blockify.wait();
+  double blockify_cpu_time = 0.0;
+
+  for (auto& seg : segmenters) {
+    seg.wg.wait();
+    blockify_cpu_time += seg.wg.get_cpu_time();
+  }
 
   LOG_INFO << "segmenting/blockifying CPU time: "
-           << time_with_unit(blockify.get_cpu_time());
+           << time_with_unit(blockify_cpu_time);
+
+  if (base) {
+    LOG_INFO << "reused data from base image for " << reused_inodes << "/"
+             << im.count() << " inodes";
+  }
+
+  // all jobs are done, so the remaining blocks are written right away
+  for (auto& seg : segmenters) {
+    seg.job = next_job;
+    seg.bm->finish_blocks();
+  }
 
-  bm.finish_blocks();
   wg_.wait();
 
+  begin_stage("metadata");
+
   prog.set_status_function([](progress const&, size_t) {
     return "waiting for block compression to finish";
   });
-  prog.sync([&] { prog.current.store(nullptr); });
+  prog.sync([&] { prog.current.reset(); });
+
+  // The metadata tables below don't depend on each other, so build them
+  // in parallel while the last blocks are still being compressed. Each
+  // job only fills its own local table, the results are moved into the
+  // metadata below.
+  std::vector<thrift::metadata::chunk> chunks;
+  std::vector<uint32_t> chunk_table(im.count() + 1);
+  std::vector<thrift::metadata::directory> directories;
+  std::vector<thrift::metadata::inode_data> inodes;
+  std::vector<thrift::metadata::dir_entry> dir_entries;
+  std::vector<uint32_t> shared_files;
+  std::optional<thrift::metadata::string_table> compact_names;
+  std::optional<thrift::metadata::string_table> compact_symlinks;
 
-  // this is actually needed
-  root->set_name(std::string());
+  wg_.add_job([&] {
+    LOG_INFO << "saving chunks...";
+
+    progress::segmenter_stats coalesce_stats;
+
+    im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
+      auto const first_chunk = chunks.size();
+      DWARFS_NOTHROW(chunk_table.at(ino->num())) = first_chunk;
+      ino->append_chunks_to(chunks);
+
+      if (segmenters.size() > 1) {
+        if (auto seg = inode_segmenter[ino->num()]; seg != kNoSegmenter) {
+          auto const& map = segmenters[seg].block_map;
+          for (auto i = first_chunk; i < chunks.size(); ++i) {
+            auto& c = chunks[i];
+            if (c.block != HOLE_BLOCK) {
+              c.block = DWARFS_NOTHROW(map.at(c.block - bm_cfg.first_block));
+            }
+          }
+        }
+      }
 
-  LOG_INFO << "saving chunks...";
-  mv2.chunk_table.resize(im.count() + 1);
+      coalesce_stats.merged_chunks += coalesce_chunks(chunks, first_chunk);
+    });
 
-  // TODO: we should be able to start this once all blocks have been
-  //       submitted for compression
-  im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
-    DWARFS_NOTHROW(mv2.chunk_table.at(ino->num())) = mv2.chunks.size();
-    ino->append_chunks_to(mv2.chunks);
-  });
+    prog.add_segmenter_stats(coalesce_stats);
+    prog.chunk_count -= coalesce_stats.merged_chunks;
 
-  // insert dummy inode to help determine number of chunks per inode
-  DWARFS_NOTHROW(mv2.chunk_table.at(im.count())) = mv2.chunks.size();
+    // insert dummy inode to help determine number of chunks per inode
+    DWARFS_NOTHROW(chunk_table.at(im.count())) = chunks.size();
 
-  LOG_DEBUG << "total number of unique files: " << im.count();
-  LOG_DEBUG << "total number of chunks: " << mv2.chunks.size();
+    LOG_DEBUG << "total number of unique files: " << im.count();
+    LOG_DEBUG << "total number of chunks: " << chunks.size() << " ("
+              << coalesce_stats.merged_chunks << " merged)";
 
-  LOG_INFO << "saving directories...";
-  mv2.dir_entries_ref() = std::vector<thrift::metadata::dir_entry>();
-  mv2.inodes.resize(last_inode);
-  mv2.directories.reserve(first_link_inode + 1);
-  save_directories_visitor sdv(first_link_inode);
-  root->accept(sdv);
-  sdv.pack(mv2, ge_data);
+    if (options_.pack_chunk_table) {
+      // delta-compress chunk table
+      std::adjacent_difference(chunk_table.begin(), chunk_table.end(),
+                               chunk_table.begin());
+    }
+  });
 
-  if (options_.pack_directories) {
-    // pack directories
-    uint32_t last_first_entry = 0;
+  wg_.add_job([&] {
+    LOG_INFO << "saving directories...";
+
+    thrift::metadata::metadata dmv2;
+    dmv2.dir_entries_ref() = std::vector<thrift::metadata::dir_entry>();
+    dmv2.inodes.resize(last_inode);
+    dmv2.directories.reserve(first_link_inode + 1);
+    save_directories_visitor sdv(first_link_inode);
+    root->accept(sdv);
+    sdv.pack(dmv2, ge_data);
+
+    if (options_.pack_directories) {
+      // pack directories
+      uint32_t last_first_entry = 0;
+
+      for (auto& d : dmv2.directories) {
+        d.parent_entry = 0; // this will be recovered
+        auto delta = d.first_entry - last_first_entry;
+        last_first_entry = d.first_entry;
+        d.first_entry = delta;
+      }
+    }
 
-    for (auto& d : mv2.directories) {
-      d.parent_entry = 0; // this will be recovered
-      auto delta = d.first_entry - last_first_entry;
-      last_first_entry = d.first_entry;
-      d.first_entry = delta;
+    directories = std::move(dmv2.directories);
+    inodes = std::move(dmv2.inodes);
+    dir_entries = std::move(*dmv2.dir_entries_ref());
+  });
+
+  wg_.add_job([&] {
+    LOG_INFO << "saving shared files table...";
+    save_shared_files_visitor ssfv(first_file_inode, first_device_inode,
+                                   fs.num_unique());
+    root->accept(ssfv);
+    if (options_.pack_shared_files_table) {
+      ssfv.pack_shared_files();
     }
-  }
+    shared_files = std::move(ssfv.get_shared_files());
+  });
 
-  if (options_.pack_chunk_table) {
-    // delta-compress chunk table
-    std::adjacent_difference(mv2.chunk_table.begin(), mv2.chunk_table.end(),
-                             mv2.chunk_table.begin());
+  // separate string tables are always stored as compact tables
+  if (!options_.plain_names_table || options_.separate_string_tables) {
+    wg_.add_job([&] {
+      auto ti = LOG_TIMED_INFO;
+      string_table::pack_options opts(options_.pack_names,
+                                      options_.pack_names_index,
+                                      options_.force_pack_string_tables);
+      opts.num_threads = wg_.size();
+      compact_names = string_table::pack(ge_data.get_names(), opts);
+      ti << "saving names table...";
+    });
   }
 
-  LOG_INFO << "saving shared files table...";
-  save_shared_files_visitor ssfv(first_file_inode, first_device_inode,
-                                 fs.num_unique());
-  root->accept(ssfv);
-  if (options_.pack_shared_files_table) {
-    ssfv.pack_shared_files();
+  if (!options_.plain_symlinks_table || options_.separate_string_tables) {
+    wg_.add_job([&] {
+      auto ti = LOG_TIMED_INFO;
+      string_table::pack_options opts(options_.pack_symlinks,
+                                      options_.pack_symlinks_index,
+                                      options_.force_pack_string_tables);
+      opts.num_threads = wg_.size();
+      compact_symlinks = string_table::pack(ge_data.get_symlinks(), opts);
+      ti << "saving symlinks table...";
+    });
   }
-  mv2.shared_files_table_ref() = std::move(ssfv.get_shared_files());
+
+  wg_.wait();
+
+  thrift::metadata::metadata mv2;
+
+  mv2.symlink_table = tree.symlink_table;
+  mv2.devices_ref() = tree.devices;
+  mv2.chunks = std::move(chunks);
+  mv2.chunk_table = std::move(chunk_table);
+  mv2.directories = std::move(directories);
+  mv2.inodes = std::move(inodes);
+  mv2.dir_entries_ref() = std::move(dir_entries);
+  mv2.shared_files_table_ref() = std::move(shared_files);
 
   thrift::metadata::fs_options fsopts;
   fsopts.mtime_only = !options_.keep_all_times;
@@ -758,53 +1750,65 @@ void scanner_<LoggerPolicy>::scan(filesystem_writer& fsw,
   fsopts.packed_directories = options_.pack_directories;
   fsopts.packed_shared_files_table = options_.pack_shared_files_table;
 
-  if (options_.plain_names_table) {
-    mv2.names = ge_data.get_names();
+  // separate string tables are written after the metadata
+  if (options_.separate_string_tables) {
+    fsopts.separate_string_tables_ref() = true;
   } else {
-    auto ti = LOG_TIMED_INFO;
-    mv2.compact_names_ref() = string_table::pack(
-        ge_data.get_names(), string_table::pack_options(
-                                 options_.pack_names, options_.pack_names_index,
-                                 options_.force_pack_string_tables));
-    ti << "saving names table...";
-  }
+    if (compact_names) {
+      mv2.compact_names_ref() = std::move(*compact_names);
+    } else {
+      mv2.names = ge_data.get_names();
+    }
 
-  if (options_.plain_symlinks_table) {
-    mv2.symlinks = ge_data.get_symlinks();
-  } else {
-    auto ti = LOG_TIMED_INFO;
-    mv2.compact_symlinks_ref() = string_table::pack(
-        ge_data.get_symlinks(),
-        string_table::pack_options(options_.pack_symlinks,
-                                   options_.pack_symlinks_index,
-                                   options_.force_pack_string_tables));
-    ti << "saving symlinks table...";
+    if (compact_symlinks) {
+      mv2.compact_symlinks_ref() = std::move(*compact_symlinks);
+    } else {
+      mv2.symlinks = ge_data.get_symlinks();
+    }
   }
 
   mv2.uids = ge_data.get_uids();
   mv2.gids = ge_data.get_gids();
   mv2.modes = ge_data.get_modes();
   mv2.timestamp_base = ge_data.get_timestamp_base();
-  mv2.block_size = UINT32_C(1) << cfg_.block_size_bits;
+  mv2.block_size = UINT32_C(1) << cfg.block_size_bits;
   mv2.total_fs_size = prog.original_size;
   mv2.total_hardlink_size_ref() = prog.hardlink_size;
   mv2.options_ref() = fsopts;
   mv2.dwarfs_version_ref() = std::string("libdwarfs ") + PRJ_GIT_ID;
   mv2.create_timestamp_ref() = std::time(nullptr);
+  if (base && options_.base_is_reference) {
+    mv2.reference_block_count_ref() = base->num_blocks();
+    mv2.reference_block_digest_ref() = base->block_digest();
+  }
 
   auto [schema, data] = metadata_v2::freeze(mv2);
 
   fsw.write_metadata_v2_schema(std::make_shared<block_data>(std::move(schema)));
   fsw.write_metadata_v2(std::make_shared<block_data>(std::move(data)));
 
+  if (options_.separate_string_tables) {
+    fsw.write_string_table(
+        section_type::METADATA_V2_NAMES,
+        std::make_shared<block_data>(
+            metadata_v2::freeze_string_table(*compact_names)));
+    fsw.write_string_table(
+        section_type::METADATA_V2_SYMLINKS,
+        std::make_shared<block_data>(
+            metadata_v2::freeze_string_table(*compact_symlinks)));
+  }
+
   LOG_INFO << "waiting for compression to finish...";
 
+  begin_stage("compress");
+
   fsw.flush();
 
+  auto const compressed_size = prog.compressed_size.load() - compressed_before;
+
   LOG_INFO << "compressed " << size_with_unit(prog.original_size) << " to "
-           << size_with_unit(prog.compressed_size) << " (ratio="
-           << static_cast<double>(prog.compressed_size) / prog.original_size
-           << ")";
+           << size_with_unit(compressed_size) << " (ratio="
+           << static_cast<double>(compressed_size) / prog.original_size << ")";
 }
 
 scanner::scanner(logger& lgr, worker_group& wg,
@@ -20,7 +20,11 @@
  */
 
 #include <algorithm>
+#include <cstring>
+#include <mutex>
 #include <numeric>
+#include <thread>
+#include <utility>
 
 #include <fmt/format.h>
 
@@ -41,6 +45,18 @@ class legacy_string_table : public string_table::impl {
     return std::string(v_[index]);
   }
 
+  std::vector<std::string_view>
+  lookup(folly::Range<uint32_t const*> indices,
+         std::string& /*arena*/) const override {
+    std::vector<std::string_view> out;
+    out.reserve(indices.size());
+    for (auto i : indices) {
+      auto s = v_[i];
+      out.emplace_back(s.data(), s.size());
+    }
+    return out;
+  }
+
   std::vector<std::string> unpack() const override {
     throw std::runtime_error("cannot unpack legacy string table");
   }
@@ -98,16 +114,7 @@ class packed_string_table : public string_table::impl {
   }
 
   std::string lookup(size_t index) const override {
-    auto beg = buffer_;
-    auto end = buffer_;
-
-    if constexpr (PackedIndex) {
-      beg += index_[index];
-      end += index_[index + 1];
-    } else {
-      beg += v_.index()[index];
-      end += v_.index()[index + 1];
-    }
+    auto [beg, end] = packed_range(index);
 
     if constexpr (PackedData) {
       thread_local std::string out;
@@ -124,6 +131,44 @@ class packed_string_table : public string_table::impl {
     return std::string(beg, end);
   }
 
+  std::vector<std::string_view>
+  lookup(folly::Range<uint32_t const*> indices,
+         std::string& arena) const override {
+    std::vector<std::string_view> out;
+    out.reserve(indices.size());
+
+    if constexpr (PackedData) {
+      size_t packed_size = 0;
+      for (auto i : indices) {
+        auto [beg, end] = packed_range(i);
+        packed_size += end - beg;
+      }
+
+      // Same upper bound as for a single lookup; the arena is sized
+      // once, so the views we hand out won't be invalidated below.
+      arena.resize(8 * packed_size);
+      size_t pos = 0;
+
+      for (auto i : indices) {
+        auto [beg, end] = packed_range(i);
+        auto outlen = fsst_decompress(
+            dec_.get(), end - beg,
+            reinterpret_cast<unsigned char*>(const_cast<char*>(beg)),
+            arena.size() - pos,
+            reinterpret_cast<unsigned char*>(arena.data() + pos));
+        out.emplace_back(arena.data() + pos, outlen);
+        pos += outlen;
+      }
+    } else {
+      for (auto i : indices) {
+        auto [beg, end] = packed_range(i);
+        out.emplace_back(beg, end - beg);
+      }
+    }
+
+    return out;
+  }
+
   std::vector<std::string> unpack() const override {
     std::vector<std::string> v;
     auto size = PackedIndex ? index_.size() : v_.index().size();
@@ -148,6 +193,14 @@ class packed_string_table : public string_table::impl {
   }
 
  private:
+  std::pair<char const*, char const*> packed_range(size_t index) const {
+    if constexpr (PackedIndex) {
+      return {buffer_ + index_[index], buffer_ + index_[index + 1]};
+    } else {
+      return {buffer_ + v_.index()[index], buffer_ + v_.index()[index + 1]};
+    }
+  }
+
   string_table::PackedTableView v_;
   char const* const buffer_;
   std::vector<uint32_t> index_;
@@ -177,12 +230,141 @@ build_string_table(logger& lgr, std::string_view name,
   }
 }
 
+class lazy_string_table : public string_table::impl {
+ public:
+  lazy_string_table(logger& lgr, std::string_view name,
+                    string_table::table_loader loader)
+      : lgr_{lgr}
+      , name_{name}
+      , loader_{std::move(loader)} {}
+
+  std::string lookup(size_t index) const override {
+    return get().lookup(index);
+  }
+
+  std::vector<std::string_view>
+  lookup(folly::Range<uint32_t const*> indices,
+         std::string& arena) const override {
+    return get().lookup(indices, arena);
+  }
+
+  std::vector<std::string> unpack() const override { return get().unpack(); }
+
+  bool is_packed() const override { return get().is_packed(); }
+
+  size_t unpacked_size() const override { return get().unpacked_size(); }
+
+ private:
+  string_table::impl const& get() const {
+    std::call_once(loaded_, [this] {
+      auto table = loader_();
+      holder_ = std::move(table.holder);
+      table_ = build_string_table(lgr_, name_, table.view);
+      loader_ = nullptr;
+    });
+    return *table_;
+  }
+
+  logger& lgr_;
+  std::string const name_;
+  mutable string_table::table_loader loader_;
+  mutable std::once_flag loaded_;
+  mutable std::shared_ptr<void const> holder_;
+  mutable std::unique_ptr<string_table::impl const> table_;
+};
+
+constexpr size_t kMinParallelPackSize{1 << 16};
+
+// Compress shards of the input on separate threads, each with its own copy
+// of the encoder, and concatenate the results into `buffer`. Returns false
+// if any of the shards could not be compressed.
+bool fsst_compress_parallel(::fsst_encoder_t* enc, size_t num_threads,
+                            std::vector<size_t>& len_vec,
+                            std::vector<unsigned char*>& ptr_vec,
+                            std::string& buffer,
+                            std::vector<size_t>& out_len_vec,
+                            std::vector<unsigned char*>& out_ptr_vec) {
+  struct shard {
+    size_t begin;
+    size_t end;
+    std::string buffer;
+    bool ok{false};
+  };
+
+  auto const size = len_vec.size();
+  auto const shard_size = (size + num_threads - 1) / num_threads;
+  std::vector<shard> shards;
+
+  for (size_t begin = 0; begin < size; begin += shard_size) {
+    shards.push_back(shard{begin, std::min(size, begin + shard_size)});
+  }
+
+  out_len_vec.resize(size);
+  out_ptr_vec.resize(size);
+
+  std::vector<std::thread> threads;
+  threads.reserve(shards.size());
+
+  for (auto& s : shards) {
+    threads.emplace_back([&, sp = &s] {
+      std::unique_ptr<::fsst_encoder_t, decltype(&::fsst_destroy)> local{
+          ::fsst_duplicate(enc), &::fsst_destroy};
+      auto const count = sp->end - sp->begin;
+      auto const input_size =
+          std::accumulate(len_vec.begin() + sp->begin,
+                          len_vec.begin() + sp->end, static_cast<size_t>(0));
+
+      // worst case, every single byte has to be escaped
+      sp->buffer.resize(2 * input_size + 8);
+
+      sp->ok = ::fsst_compress(
+                   local.get(), count, len_vec.data() + sp->begin,
+                   ptr_vec.data() + sp->begin, sp->buffer.size(),
+                   reinterpret_cast<unsigned char*>(sp->buffer.data()),
+                   out_len_vec.data() + sp->begin,
+                   out_ptr_vec.data() + sp->begin) == count;
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  if (!std::all_of(shards.begin(), shards.end(),
+                   [](auto const& s) { return s.ok; })) {
+    return false;
+  }
+
+  buffer.resize(std::accumulate(out_len_vec.begin(), out_len_vec.end(),
+                                static_cast<size_t>(0)));
+
+  size_t pos = 0;
+
+  for (auto const& s : shards) {
+    auto const start = pos;
+
+    for (auto i = s.begin; i < s.end; ++i) {
+      out_ptr_vec[i] = reinterpret_cast<unsigned char*>(buffer.data()) + pos;
+      pos += out_len_vec[i];
+    }
+
+    std::memcpy(buffer.data() + start, s.buffer.data(), pos - start);
+  }
+
+  return true;
+}
+
 } // namespace
 
 string_table::string_table(logger& lgr, std::string_view name,
                            PackedTableView v)
     : impl_{build_string_table(lgr, name, v)} {}
 
+string_table::string_table(logger& lgr, std::string_view name,
+                           table_loader loader)
+    : impl_{std::make_unique<lazy_string_table>(lgr, name,
+                                                std::move(loader))} {}
+
 template <typename T>
 thrift::metadata::string_table
 string_table::pack_generic(folly::Range<T const*> input,
@@ -223,7 +405,17 @@ string_table::pack_generic(folly::Range<T const*> input,
         enc.get(), reinterpret_cast<unsigned char*>(symtab.data()));
     symtab.resize(symtab_size);
 
-    if (symtab.size() < total_input_size or options.force_pack_data) {
+    if (options.num_threads > 1 && size >= kMinParallelPackSize &&
+        (symtab.size() < total_input_size or options.force_pack_data)) {
+      pack_data = fsst_compress_parallel(enc.get(), options.num_threads,
+                                         len_vec, ptr_vec, buffer,
+                                         out_len_vec, out_ptr_vec);
+
+      if (pack_data && !options.force_pack_data &&
+          buffer.size() + symtab.size() >= total_input_size) {
+        pack_data = false;
+      }
+    } else if (symtab.size() < total_input_size or options.force_pack_data) {
       out_len_vec.resize(size);
       out_ptr_vec.resize(size);
 
@@ -19,12 +19,19 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <array>
 #include <climits>
+#include <cmath>
+#include <fstream>
+#include <optional>
 #include <string>
+#include <thread>
 
+#include <sched.h>
 #include <unistd.h>
 
+#include <folly/Conv.h>
 #include <folly/String.h>
 
 #include "dwarfs/error.h"
@@ -40,6 +47,37 @@ inline std::string trimmed(std::string in) {
   }
   return in;
 }
+
+// CPU limit imposed by a cgroup (v2 or v1) CPU quota, if any
+std::optional<double> cgroup_cpu_limit() {
+  {
+    // cgroup v2: "<quota> <period>" or "max <period>"
+    std::ifstream ifs("/sys/fs/cgroup/cpu.max");
+    std::string quota;
+    double period;
+    if (ifs >> quota >> period) {
+      if (quota != "max" && period > 0) {
+        return folly::to<double>(quota) / period;
+      }
+      return std::nullopt;
+    }
+  }
+
+  for (auto dir : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+    std::ifstream qfs(std::string(dir) + "/cpu.cfs_quota_us");
+    std::ifstream pfs(std::string(dir) + "/cpu.cfs_period_us");
+    double quota, period;
+    if (qfs >> quota && pfs >> period) {
+      if (quota > 0 && period > 0) {
+        return quota / period;
+      }
+      return std::nullopt;
+    }
+  }
+
+  return std::nullopt;
+}
+
 } // namespace
 
 std::string size_with_unit(size_t size) {
@@ -106,4 +144,74 @@ std::string get_program_path() {
   return std::string();
 }
 
+size_t available_cpus() {
+  size_t num = std::thread::hardware_concurrency();
+
+  ::cpu_set_t set;
+  if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+    num = CPU_COUNT(&set);
+  }
+
+  try {
+    if (auto limit = cgroup_cpu_limit()) {
+      num = std::min(num, static_cast<size_t>(std::ceil(*limit)));
+    }
+  } catch (std::exception const&) {
+    // ignore malformed cgroup files
+  }
+
+  return std::max<size_t>(num, 1);
+}
+
+std::vector<int> parse_cpu_list(std::string_view list) {
+  std::vector<folly::StringPiece> parts;
+  std::vector<int> cpus;
+
+  folly::split(',', folly::StringPiece(list.data(), list.size()), parts, true);
+
+  for (auto const& part : parts) {
+    auto const trimmed = folly::trimWhitespace(part);
+    auto const dash = trimmed.find('-');
+
+    try {
+      if (dash == folly::StringPiece::npos) {
+        cpus.push_back(folly::to<int>(trimmed));
+      } else {
+        auto const first = folly::to<int>(trimmed.subpiece(0, dash));
+        auto const last = folly::to<int>(trimmed.subpiece(dash + 1));
+        if (first > last) {
+          DWARFS_THROW(runtime_error, "invalid CPU range: " + trimmed.str());
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      }
+    } catch (folly::ConversionError const&) {
+      DWARFS_THROW(runtime_error, "invalid CPU list: " + std::string(list));
+    }
+  }
+
+  if (cpus.empty()) {
+    DWARFS_THROW(runtime_error, "empty CPU list");
+  }
+
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+  return cpus;
+}
+
+std::vector<int> numa_node_cpus(int node) {
+  auto path = "/sys/devices/system/node/node" + std::to_string(node) +
+              "/cpulist";
+  std::ifstream ifs(path);
+  std::string list;
+
+  if (!std::getline(ifs, list)) {
+    DWARFS_THROW(runtime_error, "unknown NUMA node " + std::to_string(node));
+  }
+
+  return parse_cpu_list(list);
+}
+
 } // namespace dwarfs
@@ -19,12 +19,18 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <fstream>
+#include <limits>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <string>
 #include <thread>
@@ -36,11 +42,13 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #include <folly/Conv.h>
 #include <folly/system/ThreadName.h>
 
 #include "dwarfs/error.h"
+#include "dwarfs/event_tracer.h"
 #include "dwarfs/semaphore.h"
 #include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
@@ -49,6 +57,9 @@ namespace dwarfs {
 
 namespace {
 
+constexpr size_t kNumPriorities = 3;
+constexpr size_t kBackground = static_cast<size_t>(job_priority::BACKGROUND);
+
 pthread_t std_to_pthread_id(std::thread::id tid) {
   static_assert(std::is_same_v<pthread_t, std::thread::native_handle_type>);
   static_assert(sizeof(std::thread::id) ==
@@ -58,6 +69,58 @@ pthread_t std_to_pthread_id(std::thread::id tid) {
   return id;
 }
 
+double threads_cpu_time(std::vector<std::thread> const& threads) {
+  double t = 0.0;
+
+  for (auto const& w : threads) {
+    ::clockid_t cid;
+    struct ::timespec ts;
+    if (::pthread_getcpuclockid(std_to_pthread_id(w.get_id()), &cid) == 0 &&
+        ::clock_gettime(cid, &ts) == 0) {
+      t += ts.tv_sec + 1e-9 * ts.tv_nsec;
+    }
+  }
+
+  return t;
+}
+
+void set_threads_affinity(std::vector<std::thread>& threads,
+                          std::vector<int> const& cpus) {
+  ::cpu_set_t set;
+  CPU_ZERO(&set);
+
+  for (auto cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      DWARFS_THROW(runtime_error, "invalid CPU " + std::to_string(cpu));
+    }
+    CPU_SET(cpu, &set);
+  }
+
+  for (auto& t : threads) {
+    if (auto rv =
+            ::pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+        rv != 0) {
+      DWARFS_THROW(system_error, "pthread_setaffinity_np", rv);
+    }
+  }
+}
+
+worker_group::job_t wrap_job(worker_group::job_t&& job) {
+#ifdef DWARFS_EVENT_TRACING
+  if (event_tracer::enabled()) {
+    auto id = event_tracer::next_id();
+    event_tracer::async_begin("worker_group", "queued", id);
+    return [id, job = std::move(job)]() mutable {
+      event_tracer::async_end("worker_group", "queued", id);
+      DWARFS_TRACE_SCOPE("worker_group", "job");
+      job();
+    };
+  }
+#endif
+
+  return std::move(job);
+}
+
 } // namespace
 
 template <typename Policy>
@@ -140,12 +203,15 @@ class basic_worker_group final : public worker_group::impl, private Policy {
    *
    * \param job             The job to add to the dispatcher.
    */
-  bool add_job(worker_group::job_t&& job) override {
+  bool add_job(worker_group::job_t&& job, job_priority prio) override {
     if (running_) {
+      job = wrap_job(std::move(job));
+
       {
         std::unique_lock lock(mx_);
-        queue_.wait(lock, [this] { return jobs_.size() < max_queue_len_; });
-        jobs_.emplace(std::move(job));
+        queue_.wait(lock, [this] { return num_queued_ < max_queue_len_; });
+        jobs_[static_cast<size_t>(prio)].emplace(std::move(job));
+        ++num_queued_;
         ++pending_;
       }
 
@@ -155,6 +221,55 @@ class basic_worker_group final : public worker_group::impl, private Policy {
     return false;
   }
 
+  /**
+   * Add a batch of jobs to the worker group
+   *
+   * \param jobs            The jobs to add to the dispatcher.
+   */
+  bool add_jobs(std::vector<worker_group::job_t>&& jobs,
+                job_priority prio) override {
+    if (running_) {
+      {
+        std::unique_lock lock(mx_);
+
+        for (auto& job : jobs) {
+          queue_.wait(lock, [this] { return num_queued_ < max_queue_len_; });
+          jobs_[static_cast<size_t>(prio)].emplace(wrap_job(std::move(job)));
+          ++num_queued_;
+          ++pending_;
+          cond_.notify_one();
+        }
+      }
+
+      jobs.clear();
+    }
+
+    return false;
+  }
+
+  /**
+   * Limit the number of background jobs running concurrently
+   *
+   * \param limit           Maximum number of background jobs.
+   */
+  void set_background_limit(size_t limit) override {
+    {
+      std::lock_guard lock(mx_);
+      background_limit_ = std::max<size_t>(limit, 1);
+    }
+
+    cond_.notify_all();
+  }
+
+  /**
+   * Pin all worker threads to a set of CPUs
+   *
+   * \param cpus            The CPUs to run on.
+   */
+  void set_affinity(std::vector<int> const& cpus) override {
+    set_threads_affinity(workers_, cpus);
+  }
+
   /**
    * Return the number of worker threads
    *
@@ -169,50 +284,59 @@ class basic_worker_group final : public worker_group::impl, private Policy {
    */
   size_t queue_size() const override {
     std::lock_guard lock(mx_);
-    return jobs_.size();
+    return num_queued_;
   }
 
   double get_cpu_time() const override {
     std::lock_guard lock(mx_);
-    double t = 0.0;
-
-    for (auto const& w : workers_) {
-      ::clockid_t cid;
-      struct ::timespec ts;
-      if (::pthread_getcpuclockid(std_to_pthread_id(w.get_id()), &cid) == 0 &&
-          ::clock_gettime(cid, &ts) == 0) {
-        t += ts.tv_sec + 1e-9 * ts.tv_nsec;
-      }
-    }
-
-    return t;
+    return threads_cpu_time(workers_);
   }
 
  private:
   using jobs_t = std::queue<worker_group::job_t>;
 
+  // Returns the highest priority with a job that may run now, if any.
+  // Must be called with mx_ held.
+  std::optional<size_t> next_priority() const {
+    for (size_t i = 0; i < kNumPriorities; ++i) {
+      if (i == kBackground && running_background_ >= background_limit_) {
+        break;
+      }
+      if (!jobs_[i].empty()) {
+        return i;
+      }
+    }
+    return std::nullopt;
+  }
+
   void do_work() {
     for (;;) {
       worker_group::job_t job;
+      size_t prio;
 
       {
         std::unique_lock lock(mx_);
 
-        while (jobs_.empty() && running_) {
-          cond_.wait(lock);
-        }
+        // Jobs are still run after the group has been stopped, so
+        // only leave once all queues are empty
+        cond_.wait(lock, [this] {
+          return next_priority() || (!running_ && num_queued_ == 0);
+        });
 
-        if (jobs_.empty()) {
-          if (running_) {
-            continue;
-          } else {
-            break;
-          }
+        auto next = next_priority();
+
+        if (!next) {
+          break;
         }
 
-        job = std::move(jobs_.front());
+        prio = *next;
+        job = std::move(jobs_[prio].front());
+        jobs_[prio].pop();
+        --num_queued_;
 
-        jobs_.pop();
+        if (prio == kBackground) {
+          ++running_background_;
+        }
       }
 
       {
@@ -223,15 +347,25 @@ class basic_worker_group final : public worker_group::impl, private Policy {
       {
         std::lock_guard lock(mx_);
         pending_--;
+        if (prio == kBackground) {
+          --running_background_;
+        }
       }
 
       wait_.notify_one();
       queue_.notify_one();
+
+      if (prio == kBackground) {
+        cond_.notify_one();
+      }
     }
   }
 
   std::vector<std::thread> workers_;
-  jobs_t jobs_;
+  std::array<jobs_t, kNumPriorities> jobs_;
+  size_t num_queued_{0};
+  size_t running_background_{0};
+  size_t background_limit_{std::numeric_limits<size_t>::max()};
   std::condition_variable cond_;
   std::condition_variable queue_;
   std::condition_variable wait_;
@@ -272,20 +406,24 @@ class load_adaptive_policy {
     struct timeval utime_, stime_;
   };
 
-  explicit load_adaptive_policy(size_t workers)
-      : sem_(workers)
-      , max_throttled_(static_cast<int>(workers) - 1) {}
+  load_adaptive_policy(size_t max_workers, size_t min_workers)
+      : sem_(max_workers)
+      , max_throttled_(static_cast<int>(max_workers) -
+                       static_cast<int>(std::clamp<size_t>(min_workers, 1,
+                                                           max_workers))) {}
 
   void start_task() { sem_.acquire(); }
 
   void stop_task(uint64_t wall_ns, uint64_t cpu_ns);
 
  private:
+  static std::optional<double> read_pressure(char const* path);
+
   semaphore sem_;
-  int max_throttled_;
+  int const max_throttled_;
   std::mutex mx_;
-  uint64_t wall_ns_, cpu_ns_;
-  int throttled_;
+  uint64_t wall_ns_{0}, cpu_ns_{0};
+  int throttled_{0};
 };
 
 load_adaptive_policy::task::~task() {
@@ -307,7 +445,36 @@ load_adaptive_policy::task::~task() {
   policy_->stop_task(wall_ns, cpu_ns);
 }
 
+/**
+ * Read the "some" 10 second average from a PSI file, in percent
+ *
+ * Returns nothing if pressure stall information isn't available.
+ */
+std::optional<double> load_adaptive_policy::read_pressure(char const* path) {
+  std::ifstream ifs(path);
+  std::string kind, avg10;
+
+  if (ifs >> kind >> avg10 && kind == "some" && avg10.rfind("avg10=", 0) == 0) {
+    return folly::tryTo<double>(avg10.substr(6)).value_or(0.0);
+  }
+
+  return std::nullopt;
+}
+
+/**
+ * Adjust the number of active workers about once per second
+ *
+ * Workers are throttled if the tasks spend most of their time waiting
+ * rather than on the CPU, or if the system is under CPU or memory
+ * pressure (e.g. from other jobs), as reported by Linux PSI. They are
+ * unthrottled again if the tasks are CPU bound and the system has
+ * capacity to spare.
+ */
 void load_adaptive_policy::stop_task(uint64_t wall_ns, uint64_t cpu_ns) {
+  static constexpr double kCpuPressureHigh{25.0};
+  static constexpr double kCpuPressureLow{5.0};
+  static constexpr double kMemoryPressureHigh{10.0};
+
   int adjust = 0;
 
   {
@@ -318,16 +485,23 @@ void load_adaptive_policy::stop_task(uint64_t wall_ns, uint64_t cpu_ns) {
 
     if (wall_ns_ >= 1000000000) {
       auto load = float(cpu_ns_) / float(wall_ns_);
-      if (load > 0.75f) {
-        if (throttled_ > 0) {
-          --throttled_;
-          adjust = 1;
-        }
-      } else if (load < 0.25f) {
+      auto cpu_pressure = read_pressure("/proc/pressure/cpu");
+      auto mem_pressure = read_pressure("/proc/pressure/memory");
+      bool const pressure =
+          cpu_pressure.value_or(0.0) > kCpuPressureHigh ||
+          mem_pressure.value_or(0.0) > kMemoryPressureHigh;
+      bool const spare = cpu_pressure.value_or(0.0) < kCpuPressureLow;
+
+      if (pressure || load < 0.25f) {
         if (throttled_ < max_throttled_) {
           ++throttled_;
           adjust = -1;
         }
+      } else if (load > 0.75f && spare) {
+        if (throttled_ > 0) {
+          --throttled_;
+          adjust = 1;
+        }
       }
       wall_ns_ = 0;
       cpu_ns_ = 0;
@@ -345,6 +519,314 @@ void load_adaptive_policy::stop_task(uint64_t wall_ns, uint64_t cpu_ns) {
   sem_.release();
 }
 
+/**
+ * A worker group with per-worker job queues
+ *
+ * Each worker has its own queue, so submitting and fetching jobs doesn't
+ * contend on a single lock. Jobs added from outside the group are spread
+ * across the queues round-robin, jobs added by a worker go to its own
+ * queue. Workers take jobs from the back of their own queue and, once
+ * that is empty, steal from the front of the other workers' queues.
+ */
+class work_stealing_worker_group final : public worker_group::impl {
+ public:
+  work_stealing_worker_group(const char* group_name, size_t num_workers,
+                             size_t max_queue_len, int niceness)
+      : queues_(num_workers)
+      , max_queue_len_(max_queue_len) {
+    if (num_workers < 1) {
+      DWARFS_THROW(runtime_error, "invalid number of worker threads");
+    }
+
+    if (!group_name) {
+      group_name = "worker";
+    }
+
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers_.emplace_back([=] {
+        folly::setThreadName(folly::to<std::string>(group_name, i + 1));
+        [[maybe_unused]] auto rv = ::nice(niceness);
+        do_work(i);
+      });
+    }
+  }
+
+  work_stealing_worker_group(const work_stealing_worker_group&) = delete;
+  work_stealing_worker_group&
+  operator=(const work_stealing_worker_group&) = delete;
+
+  ~work_stealing_worker_group() noexcept override {
+    try {
+      stop();
+    } catch (...) {
+    }
+  }
+
+  void stop() override {
+    if (running_) {
+      {
+        std::lock_guard lock(idle_mx_);
+        running_ = false;
+      }
+
+      idle_cond_.notify_all();
+
+      for (auto& w : workers_) {
+        w.join();
+      }
+    }
+  }
+
+  void wait() override {
+    if (running_) {
+      std::unique_lock lock(wait_mx_);
+      wait_cond_.wait(lock, [this] { return pending_ == 0; });
+    }
+  }
+
+  bool running() const override { return running_; }
+
+  bool add_job(worker_group::job_t&& job, job_priority prio) override {
+    if (running_) {
+      // counters must be updated before the job can be taken
+      wait_for_space(1);
+      ++pending_;
+      add_queued(prio, 1);
+      push(next_queue(), prio, wrap_job(std::move(job)));
+      wake_workers(1);
+    }
+
+    return false;
+  }
+
+  bool add_jobs(std::vector<worker_group::job_t>&& jobs,
+                job_priority prio) override {
+    if (running_ && !jobs.empty()) {
+      auto const num_queues = queues_.size();
+      auto const per_queue = (jobs.size() + num_queues - 1) / num_queues;
+      auto it = jobs.begin();
+
+      while (it != jobs.end()) {
+        auto const count = std::min<size_t>(per_queue, jobs.end() - it);
+        wait_for_space(count);
+        pending_ += count;
+        add_queued(prio, count);
+
+        {
+          auto& q = queues_[next_queue()];
+          auto& jq = q.jobs[static_cast<size_t>(prio)];
+          std::lock_guard lock(q.mx);
+          for (auto end = it + count; it != end; ++it) {
+            jq.push_back(wrap_job(std::move(*it)));
+          }
+        }
+
+        wake_workers(count);
+      }
+
+      jobs.clear();
+    }
+
+    return false;
+  }
+
+  void set_background_limit(size_t limit) override {
+    background_limit_ = std::max<size_t>(limit, 1);
+    wake_workers(2);
+  }
+
+  void set_affinity(std::vector<int> const& cpus) override {
+    set_threads_affinity(workers_, cpus);
+  }
+
+  size_t size() const override { return workers_.size(); }
+
+  size_t queue_size() const override { return queued_; }
+
+  double get_cpu_time() const override { return threads_cpu_time(workers_); }
+
+ private:
+  struct alignas(64) job_queue {
+    std::mutex mx;
+    std::array<std::deque<worker_group::job_t>, kNumPriorities> jobs;
+  };
+
+  // Jobs added from one of our own workers stay on that worker's queue
+  size_t next_queue() {
+    if (current_group_ == this) {
+      return current_index_;
+    }
+    return next_queue_.fetch_add(1, std::memory_order_relaxed) %
+           queues_.size();
+  }
+
+  void add_queued(job_priority prio, size_t count) {
+    if (prio == job_priority::BACKGROUND) {
+      queued_background_ += count;
+    }
+    queued_ += count;
+  }
+
+  void push(size_t index, job_priority prio, worker_group::job_t&& job) {
+    auto& q = queues_[index];
+    std::lock_guard lock(q.mx);
+    q.jobs[static_cast<size_t>(prio)].push_back(std::move(job));
+  }
+
+  // Our own workers never wait, as they might all end up waiting for
+  // each other
+  void wait_for_space(size_t count) {
+    if (current_group_ != this && queued_ + count > max_queue_len_ &&
+        queued_ > 0) {
+      std::unique_lock lock(space_mx_);
+      ++space_waiters_;
+      space_cond_.wait(lock, [&] {
+        return queued_ + count <= max_queue_len_ || queued_ == 0;
+      });
+      --space_waiters_;
+    }
+  }
+
+  void wake_workers(size_t count) {
+    if (idle_ > 0) {
+      std::lock_guard lock(idle_mx_);
+      if (count > 1) {
+        idle_cond_.notify_all();
+      } else {
+        idle_cond_.notify_one();
+      }
+    }
+  }
+
+  // Whether there may be a queued job that is allowed to run
+  bool have_runnable() const {
+    auto const background = queued_background_.load();
+    return queued_ > background ||
+           (background > 0 && running_background_ < background_limit_);
+  }
+
+  bool try_pop(size_t index, size_t prio, worker_group::job_t& job) {
+    {
+      auto& own = queues_[index];
+      std::lock_guard lock(own.mx);
+      auto& jq = own.jobs[prio];
+      if (!jq.empty()) {
+        job = std::move(jq.back());
+        jq.pop_back();
+        return true;
+      }
+    }
+
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      auto& victim = queues_[(index + i) % queues_.size()];
+      std::unique_lock lock(victim.mx, std::try_to_lock);
+      auto& jq = victim.jobs[prio];
+      if (lock.owns_lock() && !jq.empty()) {
+        job = std::move(jq.front());
+        jq.pop_front();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Higher priority jobs are always taken first, from any queue
+  std::optional<size_t> try_pop(size_t index, worker_group::job_t& job) {
+    for (size_t prio = 0; prio < kNumPriorities; ++prio) {
+      if (prio == kBackground) {
+        // reserve a slot before taking the job
+        if (running_background_++ >= background_limit_) {
+          --running_background_;
+          break;
+        }
+        if (try_pop(index, prio, job)) {
+          --queued_background_;
+          return prio;
+        }
+        --running_background_;
+      } else if (try_pop(index, prio, job)) {
+        return prio;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  void do_work(size_t index) {
+    current_group_ = this;
+    current_index_ = index;
+
+    for (;;) {
+      worker_group::job_t job;
+      std::optional<size_t> prio;
+
+      // A failed try_lock while stealing can miss a job, so only go to
+      // sleep once there are really no runnable jobs left. Jobs are
+      // still run after the group has been stopped.
+      while (!(prio = try_pop(index, job))) {
+        std::unique_lock lock(idle_mx_);
+        if (have_runnable()) {
+          continue;
+        }
+        if (!running_ && queued_ == 0) {
+          return;
+        }
+        ++idle_;
+        idle_cond_.wait(lock, [this] {
+          return have_runnable() || (!running_ && queued_ == 0);
+        });
+        --idle_;
+      }
+
+      --queued_;
+
+      if (space_waiters_ > 0) {
+        std::lock_guard lock(space_mx_);
+        space_cond_.notify_all();
+      }
+
+      job();
+
+      if (*prio == kBackground) {
+        --running_background_;
+        wake_workers(1);
+      }
+
+      if (--pending_ == 0) {
+        std::lock_guard lock(wait_mx_);
+        wait_cond_.notify_all();
+      }
+    }
+  }
+
+  static thread_local work_stealing_worker_group const* current_group_;
+  static thread_local size_t current_index_;
+
+  std::vector<std::thread> workers_;
+  std::vector<job_queue> queues_;
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> queued_background_{0};
+  std::atomic<size_t> running_background_{0};
+  std::atomic<size_t> background_limit_{std::numeric_limits<size_t>::max()};
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> idle_{0};
+  std::atomic<size_t> space_waiters_{0};
+  std::atomic<bool> running_{true};
+  std::mutex idle_mx_;
+  std::condition_variable idle_cond_;
+  std::mutex space_mx_;
+  std::condition_variable space_cond_;
+  std::mutex wait_mx_;
+  std::condition_variable wait_cond_;
+  size_t const max_queue_len_;
+};
+
+thread_local work_stealing_worker_group const*
+    work_stealing_worker_group::current_group_{nullptr};
+thread_local size_t work_stealing_worker_group::current_index_{0};
+
 worker_group::worker_group(const char* group_name, size_t num_workers,
                            size_t max_queue_len, int niceness)
     : impl_{std::make_unique<basic_worker_group<no_policy>>(
@@ -352,9 +834,15 @@ worker_group::worker_group(const char* group_name, size_t num_workers,
 
 worker_group::worker_group(load_adaptive_tag, const char* group_name,
                            size_t max_num_workers, size_t max_queue_len,
-                           int niceness)
+                           int niceness, size_t min_num_workers)
     : impl_{std::make_unique<basic_worker_group<load_adaptive_policy>>(
           group_name, max_num_workers, max_queue_len, niceness,
-          max_num_workers)} {}
+          max_num_workers, min_num_workers)} {}
+
+worker_group::worker_group(work_stealing_tag, const char* group_name,
+                           size_t num_workers, size_t max_queue_len,
+                           int niceness)
+    : impl_{std::make_unique<work_stealing_worker_group>(
+          group_name, num_workers, max_queue_len, niceness)} {}
 
 } // namespace dwarfs
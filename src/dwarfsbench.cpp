@@ -19,16 +19,35 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include <boost/program_options.hpp>
 
+#include <fmt/format.h>
+
 #include <folly/Conv.h>
 #include <folly/String.h>
 
+#include "dwarfs/error.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/metadata_types.h"
 #include "dwarfs/mmap.h"
 #include "dwarfs/options.h"
 #include "dwarfs/util.h"
@@ -41,11 +60,151 @@ using namespace dwarfs;
 
 namespace {
 
+using clock_type = std::chrono::steady_clock;
+
+struct op_data {
+  std::vector<double> latency;
+  size_t bytes{0};
+};
+
+using op_map = std::map<std::string, op_data>;
+
+// Per-thread recording of operation latencies, so there's no need
+// to synchronize in the hot path
+class op_recorder {
+ public:
+  void record(std::string const& op, clock_type::time_point start,
+              size_t bytes = 0) {
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+    auto& d = ops_[op];
+    d.latency.push_back(elapsed.count());
+    d.bytes += bytes;
+  }
+
+  op_map& ops() { return ops_; }
+
+ private:
+  op_map ops_;
+};
+
+class op_stats {
+ public:
+  void merge(op_map& ops) {
+    std::lock_guard lock(mx_);
+    for (auto& [op, d] : ops) {
+      auto& t = ops_[op];
+      t.latency.insert(t.latency.end(), d.latency.begin(), d.latency.end());
+      t.bytes += d.bytes;
+    }
+  }
+
+  void print(std::ostream& os, double elapsed) {
+    std::lock_guard lock(mx_);
+
+    os << fmt::format("{:<10} {:>10} {:>12} {:>12} {:>10} {:>10} {:>10}\n",
+                      "op", "count", "ops/s", "throughput", "p50", "p99",
+                      "p999");
+
+    for (auto& [op, d] : ops_) {
+      auto& lat = d.latency;
+      std::sort(lat.begin(), lat.end());
+
+      auto percentile = [&](double p) {
+        return lat.empty() ? 0.0
+                           : lat[std::min(lat.size() - 1,
+                                          static_cast<size_t>(p * lat.size()))];
+      };
+
+      os << fmt::format(
+          "{:<10} {:>10} {:>12.1f} {:>12} {:>10} {:>10} {:>10}\n", op,
+          lat.size(), lat.size() / elapsed,
+          d.bytes > 0 ? size_with_unit(d.bytes / elapsed) + "/s" : "-",
+          time_with_unit(percentile(0.5)), time_with_unit(percentile(0.99)),
+          time_with_unit(percentile(0.999)));
+    }
+  }
+
+ private:
+  std::mutex mx_;
+  op_map ops_;
+};
+
+struct file_info {
+  int fh;
+  size_t size;
+};
+
+struct trace_entry {
+  std::string op;
+  int inode{0};
+  off_t offset{0};
+  size_t size{0};
+  std::string name;
+};
+
+std::vector<trace_entry> load_trace(std::string const& path) {
+  std::ifstream ifs(path);
+
+  if (!ifs) {
+    DWARFS_THROW(runtime_error, "cannot open trace " + path);
+  }
+
+  std::vector<trace_entry> trace;
+  std::string line;
+
+  while (std::getline(ifs, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    std::istringstream iss(line);
+    uint64_t usec;
+    trace_entry e;
+
+    if (!(iss >> usec >> e.op >> e.inode)) {
+      DWARFS_THROW(runtime_error, "invalid trace line: " + line);
+    }
+
+    if (e.op == "read") {
+      iss >> e.offset >> e.size;
+    } else if (e.op == "readdir") {
+      iss >> e.offset;
+    } else if (e.op == "lookup") {
+      iss.get();
+      std::getline(iss, e.name);
+    } else if (e.op != "getattr") {
+      DWARFS_THROW(runtime_error, "unknown trace operation: " + e.op);
+    }
+
+    if (!iss && !iss.eof()) {
+      DWARFS_THROW(runtime_error, "invalid trace line: " + line);
+    }
+
+    trace.push_back(std::move(e));
+  }
+
+  return trace;
+}
+
+// Parses MIN[:MAX]
+std::pair<size_t, size_t> parse_size_range(std::string const& str) {
+  auto pos = str.find(':');
+  auto min = parse_size_with_unit(str.substr(0, pos));
+  auto max = pos == std::string::npos ? min
+                                      : parse_size_with_unit(str.substr(pos + 1));
+  if (min == 0 || max < min) {
+    DWARFS_THROW(runtime_error, "invalid size range: " + str);
+  }
+  return {min, max};
+}
+
 int dwarfsbench(int argc, char** argv) {
   std::string filesystem, cache_size_str, lock_mode_str, decompress_ratio_str,
-      log_level;
+      log_level, mode, trace_file, read_size_str, small_file_size_str;
   size_t num_workers;
   size_t num_readers;
+  size_t num_ops;
+  unsigned seed;
 
   // clang-format off
   po::options_description opts("Command line options");
@@ -68,6 +227,24 @@ int dwarfsbench(int argc, char** argv) {
     ("decompress-ratio,r",
         po::value<std::string>(&decompress_ratio_str)->default_value("0.8"),
         "block cache size")
+    ("mode",
+        po::value<std::string>(&mode)->default_value("sequential"),
+        "workload (sequential, random, small-files, metadata, replay)")
+    ("num-ops",
+        po::value<size_t>(&num_ops)->default_value(100000),
+        "number of operations for random and metadata workloads")
+    ("read-size",
+        po::value<std::string>(&read_size_str)->default_value("4k:128k"),
+        "size range (MIN[:MAX]) of random reads, log-uniform")
+    ("small-file-size",
+        po::value<std::string>(&small_file_size_str)->default_value("64k"),
+        "maximum size of files read by the small-files workload")
+    ("trace",
+        po::value<std::string>(&trace_file),
+        "access trace recorded with 'dwarfs -o trace' (for replay)")
+    ("seed",
+        po::value<unsigned>(&seed)->default_value(0),
+        "seed for random workloads")
     ("log-level,l",
         po::value<std::string>(&log_level)->default_value("info"),
         "log level (error, warn, info, debug, trace)")
@@ -90,6 +267,19 @@ int dwarfsbench(int argc, char** argv) {
     return 0;
   }
 
+  if (!trace_file.empty() && !vm["mode"].defaulted() && mode != "replay") {
+    std::cerr << "error: --trace can only be used with --mode=replay"
+              << std::endl;
+    return 1;
+  }
+
+  if (!trace_file.empty()) {
+    mode = "replay";
+  } else if (mode == "replay") {
+    std::cerr << "error: --mode=replay requires --trace" << std::endl;
+    return 1;
+  }
+
   try {
     stream_logger lgr(std::cerr, logger::parse_level(log_level));
     filesystem_options fsopts;
@@ -100,35 +290,205 @@ int dwarfsbench(int argc, char** argv) {
     fsopts.block_cache.decompress_ratio =
         folly::to<double>(decompress_ratio_str);
 
+    // Traces contain the inode numbers seen by the kernel, which are
+    // offset by FUSE_ROOT_ID (1)
+    int const inode_offset = mode == "replay" ? 1 : 0;
+
     dwarfs::filesystem_v2 fs(lgr, std::make_shared<dwarfs::mmap>(filesystem),
-                             fsopts);
+                             fsopts, inode_offset);
 
-    worker_group wg("reader", num_readers);
+    std::vector<file_info> files;
+    std::vector<inode_view> dirs;
+    std::vector<std::string> paths;
+    std::vector<trace_entry> trace;
 
-    fs.walk([&](auto entry) {
-      auto inode_data = entry.inode();
-      if (S_ISREG(inode_data.mode())) {
-        wg.add_job([&fs, inode_data] {
-          try {
-            struct ::stat stbuf;
-            if (fs.getattr(inode_data, &stbuf) == 0) {
-              std::vector<char> buf(stbuf.st_size);
-              int fh = fs.open(inode_data);
-              fs.read(fh, buf.data(), buf.size());
-            }
-          } catch (runtime_error const& e) {
-            std::cerr << "error: " << e.what() << std::endl;
-          } catch (...) {
-            std::cerr << "error: "
-                      << folly::exceptionStr(std::current_exception())
-                      << std::endl;
-            dump_exceptions();
+    if (mode == "replay") {
+      trace = load_trace(trace_file);
+    } else {
+      fs.walk([&](auto entry) {
+        auto iv = entry.inode();
+        if (!entry.is_root()) {
+          paths.push_back(entry.path());
+        }
+        if (S_ISREG(iv.mode())) {
+          struct ::stat stbuf;
+          if (fs.getattr(iv, &stbuf) == 0) {
+            files.push_back({fs.open(iv), static_cast<size_t>(stbuf.st_size)});
           }
-        });
+        } else if (S_ISDIR(iv.mode())) {
+          dirs.push_back(iv);
+        }
+      });
+    }
+
+    std::function<void(size_t, op_recorder&)> workload;
+
+    auto read = [&fs](op_recorder& rec, std::vector<char>& buf, int fh,
+                      size_t size, off_t offset, char const* op) {
+      buf.resize(size);
+      auto start = clock_type::now();
+      auto rv = fs.read(fh, buf.data(), size, offset);
+      if (rv < 0) {
+        DWARFS_THROW(runtime_error, fmt::format("read({}) failed: {}", fh,
+                                                ::strerror(-rv)));
+      }
+      rec.record(op, start, rv);
+    };
+
+    if (mode == "sequential") {
+      workload = [&](size_t index, op_recorder& rec) {
+        std::vector<char> buf;
+        for (size_t i = index; i < files.size(); i += num_readers) {
+          read(rec, buf, files[i].fh, files[i].size, 0, "read_file");
+        }
+      };
+    } else if (mode == "random") {
+      auto [min_size, max_size] = parse_size_range(read_size_str);
+
+      // pick files proportional to their size, i.e. uniformly across
+      // all file data
+      std::vector<size_t> cumulative;
+      size_t total = 0;
+      for (auto const& f : files) {
+        total += f.size;
+        cumulative.push_back(total);
+      }
+
+      if (total == 0) {
+        DWARFS_THROW(runtime_error, "file system contains no data");
+      }
+
+      workload = [&, min_size = min_size, max_size = max_size,
+                  total](size_t index, op_recorder& rec) {
+        std::mt19937_64 rng(seed + index);
+        std::uniform_int_distribution<size_t> pos_dist(0, total - 1);
+        std::uniform_real_distribution<double> size_dist(std::log(min_size),
+                                                         std::log(max_size));
+        std::vector<char> buf;
+
+        for (size_t i = index; i < num_ops; i += num_readers) {
+          auto it = std::upper_bound(cumulative.begin(), cumulative.end(),
+                                     pos_dist(rng));
+          auto const& f = files[std::distance(cumulative.begin(), it)];
+          auto size = std::min(
+              f.size, static_cast<size_t>(std::exp(size_dist(rng)) + 0.5));
+          std::uniform_int_distribution<size_t> off_dist(0, f.size - size);
+          read(rec, buf, f.fh, size, off_dist(rng), "read");
+        }
+      };
+    } else if (mode == "small-files") {
+      auto const max_size = parse_size_with_unit(small_file_size_str);
+
+      files.erase(std::remove_if(files.begin(), files.end(),
+                                 [&](auto const& f) {
+                                   return f.size == 0 || f.size > max_size;
+                                 }),
+                  files.end());
+
+      std::mt19937_64 rng(seed);
+      std::shuffle(files.begin(), files.end(), rng);
+
+      workload = [&](size_t index, op_recorder& rec) {
+        std::vector<char> buf;
+        for (size_t i = index; i < files.size(); i += num_readers) {
+          read(rec, buf, files[i].fh, files[i].size, 0, "read_file");
+        }
+      };
+    } else if (mode == "metadata") {
+      if (paths.empty()) {
+        DWARFS_THROW(runtime_error, "file system is empty");
       }
-    });
+
+      workload = [&](size_t index, op_recorder& rec) {
+        std::mt19937_64 rng(seed + index);
+        std::uniform_int_distribution<size_t> path_dist(0, paths.size() - 1);
+        std::uniform_int_distribution<size_t> dir_dist(0, dirs.size() - 1);
+
+        for (size_t i = index; i < num_ops; i += num_readers) {
+          // one in four operations lists a directory
+          if (rng() % 4 == 0) {
+            auto start = clock_type::now();
+            if (auto dir = fs.opendir(dirs[dir_dist(rng)])) {
+              fs.readdir(*dir, 0, [](size_t, inode_view, std::string_view) {
+                return true;
+              });
+            }
+            rec.record("readdir", start);
+          } else {
+            auto start = clock_type::now();
+            auto iv = fs.find(paths[path_dist(rng)].c_str());
+            rec.record("lookup", start);
+            if (iv) {
+              struct ::stat stbuf;
+              start = clock_type::now();
+              fs.getattr(*iv, &stbuf);
+              rec.record("getattr", start);
+            }
+          }
+        }
+      };
+    } else if (mode == "replay") {
+      workload = [&](size_t index, op_recorder& rec) {
+        std::vector<char> buf;
+
+        for (size_t i = index; i < trace.size(); i += num_readers) {
+          auto const& e = trace[i];
+
+          if (e.op == "read") {
+            read(rec, buf, e.inode, e.size, e.offset, "read");
+          } else {
+            auto start = clock_type::now();
+            if (e.op == "lookup") {
+              fs.find(e.inode, e.name.c_str());
+            } else if (auto iv = fs.find(e.inode)) {
+              if (e.op == "getattr") {
+                struct ::stat stbuf;
+                fs.getattr(*iv, &stbuf);
+              } else if (auto dir = fs.opendir(*iv)) {
+                fs.readdir(*dir, e.offset,
+                           [](size_t, inode_view, std::string_view) {
+                             return true;
+                           });
+              }
+            }
+            rec.record(e.op, start);
+          }
+        }
+      };
+    } else {
+      std::cerr << "error: invalid mode: " << mode << std::endl;
+      return 1;
+    }
+
+    worker_group wg("reader", num_readers);
+    op_stats stats;
+
+    auto start = clock_type::now();
+
+    for (size_t i = 0; i < num_readers; ++i) {
+      wg.add_job([&, i] {
+        op_recorder rec;
+        try {
+          workload(i, rec);
+        } catch (runtime_error const& e) {
+          std::cerr << "error: " << e.what() << std::endl;
+        } catch (...) {
+          std::cerr << "error: "
+                    << folly::exceptionStr(std::current_exception())
+                    << std::endl;
+          dump_exceptions();
+        }
+        stats.merge(rec.ops());
+      });
+    }
 
     wg.wait();
+
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+    std::cout << mode << " workload with " << num_readers << " readers took "
+              << time_with_unit(elapsed.count()) << "\n";
+    stats.print(std::cout, elapsed.count());
   } catch (runtime_error const& e) {
     std::cerr << "error: " << e.what() << std::endl;
     return 1;
@@ -28,13 +28,13 @@
 #include <folly/File.h>
 #include <folly/FileUtil.h>
 #include <folly/String.h>
-#include <folly/json.h>
 
 #include "dwarfs/error.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/mmap.h"
 #include "dwarfs/options.h"
+#include "dwarfs/util.h"
 #include "dwarfs/version.h"
 
 namespace dwarfs {
@@ -42,13 +42,15 @@ namespace dwarfs {
 namespace po = boost::program_options;
 
 int dwarfsck(int argc, char** argv) {
-  const size_t num_cpu = std::max(std::thread::hardware_concurrency(), 1u);
+  const size_t num_cpu = available_cpus();
 
-  std::string log_level, input, export_metadata, image_offset;
+  std::string log_level, input, export_metadata, image_offset, verify_window;
   size_t num_workers;
   int detail;
   bool json = false;
   bool check_integrity = false;
+  bool verify_only = false;
+  bool block_map = false;
   bool print_header = false;
 
   // clang-format off
@@ -72,6 +74,15 @@ int dwarfsck(int argc, char** argv) {
     ("check-integrity",
         po::value<bool>(&check_integrity)->zero_tokens(),
         "check integrity of each block")
+    ("verify-only",
+        po::value<bool>(&verify_only)->zero_tokens(),
+        "only verify all section checksums, streaming through the image")
+    ("verify-window",
+        po::value<std::string>(&verify_window)->default_value("256m"),
+        "amount of data being verified concurrently (with --verify-only)")
+    ("block-map",
+        po::value<bool>(&block_map)->zero_tokens(),
+        "list the file ranges stored in each block")
     ("json",
         po::value<bool>(&json)->zero_tokens(),
         "print metadata in JSON format")
@@ -134,7 +145,19 @@ int dwarfsck(int argc, char** argv) {
       of.close();
     } else if (json) {
       filesystem_v2 fs(lgr, mm, fsopts);
-      std::cout << folly::toPrettyJson(fs.metadata_as_dynamic()) << std::endl;
+      fs.write_metadata_as_json(std::cout);
+      std::cout.flush();
+    } else if (block_map) {
+      filesystem_v2 fs(lgr, mm, fsopts);
+      fs.dump_block_map(std::cout);
+    } else if (verify_only) {
+      integrity_check_options icopts;
+      icopts.num_workers = num_workers;
+      icopts.window_size = parse_size_with_unit(verify_window);
+      icopts.image_offset = fsopts.image_offset;
+      if (filesystem_v2::verify_integrity(lgr, mm, icopts) != 0) {
+        return 1;
+      }
     } else if (print_header) {
       if (auto hdr = filesystem_v2::header(mm, fsopts.image_offset)) {
         std::cout << std::string_view(
@@ -22,6 +22,7 @@
 #include <exception>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <sys/statvfs.h>
 
@@ -46,7 +47,8 @@ namespace {
 int dwarfsextract(int argc, char** argv) {
   std::string filesystem, output, format, cache_size_str, log_level,
       image_offset;
-  size_t num_workers;
+  std::vector<std::string> include, exclude;
+  size_t num_workers, num_writers;
 
   // clang-format off
   po::options_description opts("Command line options");
@@ -63,9 +65,18 @@ int dwarfsextract(int argc, char** argv) {
     ("format,f",
         po::value<std::string>(&format),
         "output format")
+    ("include",
+        po::value<std::vector<std::string>>(&include)->composing(),
+        "only extract paths matching this pattern")
+    ("exclude",
+        po::value<std::vector<std::string>>(&exclude)->composing(),
+        "don't extract paths matching this pattern")
     ("num-workers,n",
         po::value<size_t>(&num_workers)->default_value(4),
         "number of worker threads")
+    ("num-writers,w",
+        po::value<size_t>(&num_writers)->default_value(0),
+        "number of disk writer threads (0 = use libarchive)")
     ("cache-size,s",
         po::value<std::string>(&cache_size_str)->default_value("512m"),
         "block cache size")
@@ -122,14 +133,20 @@ int dwarfsextract(int argc, char** argv) {
     }
 
     if (format.empty()) {
-      fsx.open_disk(output);
+      fsx.open_disk(output, num_writers);
     } else {
+      if (num_writers > 0) {
+        std::cerr << "error: --num-writers cannot be used with --format"
+                  << std::endl;
+        return 1;
+      }
       if (output == "-") {
         output.clear();
       }
       fsx.open_archive(output, format);
     }
 
+    fsx.set_filter(include, exclude);
     fsx.extract(fs, max_queued_bytes);
 
     fsx.close();
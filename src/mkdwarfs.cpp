@@ -22,15 +22,20 @@
 #include <algorithm>
 #include <array>
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -39,6 +44,7 @@
 #include <vector>
 
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include <boost/algorithm/string.hpp>
@@ -46,7 +52,9 @@
 
 #include <folly/Conv.h>
 #include <folly/FileUtil.h>
+#include <folly/ScopeGuard.h>
 #include <folly/gen/String.h>
+#include <folly/json.h>
 
 #include <fmt/format.h>
 
@@ -59,12 +67,17 @@
 #include "dwarfs/console_writer.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
+#include "dwarfs/event_tracer.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/input_sample.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/memory_accountant.h"
 #include "dwarfs/mmap.h"
 #include "dwarfs/options.h"
 #include "dwarfs/options_interface.h"
+#include "dwarfs/os_access_archive.h"
+#include "dwarfs/os_access_filesystem.h"
 #include "dwarfs/os_access_posix.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
@@ -207,6 +220,281 @@ int parse_order_option(std::string const& ordname, std::string const& opt,
   return 0;
 }
 
+// Parses a comma separated list of block numbers and ranges, e.g.
+// "0-99,150,200-" (open ranges extend to the last block).
+int parse_block_ranges(std::string const& spec,
+                       std::vector<std::pair<size_t, size_t>>& ranges) {
+  std::vector<std::string> parts;
+  boost::split(parts, spec, boost::is_any_of(","));
+
+  for (auto const& part : parts) {
+    auto pos = part.find('-');
+    auto first = folly::tryTo<size_t>(part.substr(0, pos));
+    auto last = first;
+
+    if (pos != std::string::npos) {
+      last = pos + 1 == part.size()
+                 ? std::numeric_limits<size_t>::max() - 1
+                 : folly::tryTo<size_t>(part.substr(pos + 1));
+    }
+
+    if (!first || !last || *last < *first) {
+      std::cerr << "error: invalid block range: " << part << std::endl;
+      return 1;
+    }
+
+    ranges.emplace_back(*first, *last + 1);
+  }
+
+  return 0;
+}
+
+// Reads the block access counts from a profile written by `dwarfs -o profile`.
+int load_hot_profile(std::string const& path, std::vector<uint32_t>& counts) {
+  std::ifstream ifs(path);
+
+  if (!ifs) {
+    std::cerr << "error: cannot open profile " << path << std::endl;
+    return 1;
+  }
+
+  std::string line;
+
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string kind;
+    size_t block_no;
+    uint32_t count;
+
+    if (!(iss >> kind) || kind != "block") {
+      continue;
+    }
+
+    if (!(iss >> block_no >> count)) {
+      std::cerr << "error: invalid line in profile " << path << ": " << line
+                << std::endl;
+      return 1;
+    }
+
+    if (block_no >= counts.size()) {
+      counts.resize(block_no + 1);
+    }
+
+    counts[block_no] += count;
+  }
+
+  return 0;
+}
+
+struct analyze_result {
+  unsigned level;
+  size_t block_size;
+  std::string compression;
+  size_t image_size;
+  double wall_time;
+  double cpu_time;
+  double read_time;
+};
+
+constexpr size_t kAnalyzeNumReads{1000};
+constexpr size_t kAnalyzeReadSize{4096};
+
+// Mean time of a random read from an image with a cold cache, which is
+// dominated by decompressing the block that holds the data.
+double random_read_time(logger& lgr, std::string const& image) {
+  filesystem_options fsopts;
+  // only a single block is cached, so almost all reads are misses
+  fsopts.block_cache.max_bytes = 0;
+  fsopts.block_cache.num_workers = 1;
+
+  filesystem_v2 fs(lgr, std::make_shared<dwarfs::mmap>(image), fsopts);
+
+  std::vector<std::pair<int, size_t>> files;
+  std::vector<size_t> cumulative;
+  size_t total = 0;
+
+  fs.walk([&](auto entry) {
+    auto iv = entry.inode();
+    struct ::stat st;
+    if (S_ISREG(iv.mode()) && fs.getattr(iv, &st) == 0 && st.st_size > 0) {
+      files.emplace_back(fs.open(iv), st.st_size);
+      total += st.st_size;
+      cumulative.push_back(total);
+    }
+  });
+
+  if (total == 0) {
+    return 0.0;
+  }
+
+  std::mt19937_64 rng(0);
+  std::uniform_int_distribution<size_t> pos_dist(0, total - 1);
+  std::vector<char> buf(kAnalyzeReadSize);
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < kAnalyzeNumReads; ++i) {
+    auto pos = pos_dist(rng);
+    auto ix = std::distance(
+        cumulative.begin(),
+        std::upper_bound(cumulative.begin(), cumulative.end(), pos));
+    auto [fh, size] = files[ix];
+    fs.read(fh, buf.data(), buf.size(), pos - (cumulative[ix] - size));
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  return elapsed.count() / kAnalyzeNumReads;
+}
+
+// Extrapolates the results for the sample to the whole input.
+void print_analysis(std::ostream& os, input_sample const& sample,
+                    std::vector<analyze_result> const& results) {
+  double const scale =
+      sample.sample_bytes > 0
+          ? static_cast<double>(sample.total_bytes) / sample.sample_bytes
+          : 1.0;
+
+  os << fmt::format("sampled {} of {} files ({} of {})\n\n",
+                    sample.files.size(), sample.total_files,
+                    size_with_unit(sample.sample_bytes),
+                    size_with_unit(sample.total_bytes))
+     << fmt::format("{:<5}  {:>6}  {:<16}  {:>10}  {:>6}  {:>10}  {:>10}  "
+                    "{:>10}\n",
+                    "level", "block", "compression", "image size", "ratio",
+                    "build time", "CPU time", "4k read");
+
+  for (auto const& r : results) {
+    os << fmt::format(
+        "{:<5}  {:>6}  {:<16}  {:>10}  {:>5.1f}%  {:>10}  {:>10}  {:>10}\n",
+        r.level, size_with_unit(r.block_size), r.compression,
+        size_with_unit(static_cast<size_t>(r.image_size * scale)),
+        sample.sample_bytes > 0 ? 100.0 * r.image_size / sample.sample_bytes
+                                : 0.0,
+        time_with_unit(r.wall_time * scale),
+        time_with_unit(r.cpu_time * scale), time_with_unit(r.read_time));
+  }
+}
+
+folly::dynamic ratio(uint64_t compressed, uint64_t uncompressed) {
+  if (uncompressed == 0) {
+    return nullptr;
+  }
+  return static_cast<double>(compressed) / uncompressed;
+}
+
+// Writes the final counters of a build in a machine-readable format,
+// so build effectiveness can be tracked over time.
+int write_json_report(std::string const& path, progress const& prog,
+                      double wall_time) {
+  folly::dynamic counters = folly::dynamic::object;
+  counters["files_found"] = prog.files_found.load();
+  counters["files_scanned"] = prog.files_scanned.load();
+  counters["dirs_found"] = prog.dirs_found.load();
+  counters["symlinks_found"] = prog.symlinks_found.load();
+  counters["specials_found"] = prog.specials_found.load();
+  counters["duplicate_files"] = prog.duplicate_files.load();
+  counters["hardlinks"] = prog.hardlinks.load();
+  counters["inodes_scanned"] = prog.inodes_scanned.load();
+  counters["inodes_written"] = prog.inodes_written.load();
+  counters["block_count"] = prog.block_count.load();
+  counters["chunk_count"] = prog.chunk_count.load();
+  counters["blocks_written"] = prog.blocks_written.load();
+  counters["errors"] = prog.errors.load();
+  counters["original_size"] = prog.original_size.load();
+  counters["hardlink_size"] = prog.hardlink_size.load();
+  counters["saved_by_deduplication"] = prog.saved_by_deduplication.load();
+  counters["saved_by_segmentation"] = prog.saved_by_segmentation.load();
+  counters["saved_by_holes"] = prog.saved_by_holes.load();
+  counters["filesystem_size"] = prog.filesystem_size.load();
+  counters["compressed_size"] = prog.compressed_size.load();
+
+  auto const seg = prog.get_segmenter_stats();
+  folly::dynamic segmenter = folly::dynamic::object;
+  segmenter["total_hashes"] = seg.total_hashes;
+  segmenter["duplicate_hashes"] = seg.duplicate_hashes;
+  segmenter["total_probes"] = seg.total_probes;
+  segmenter["max_probes"] = seg.max_probes;
+  segmenter["total_matches"] = seg.total_matches;
+  segmenter["good_matches"] = seg.good_matches;
+  segmenter["bad_matches"] = seg.bad_matches;
+  segmenter["bloom_lookups"] = seg.bloom_lookups;
+  segmenter["bloom_hits"] = seg.bloom_hits;
+  segmenter["bloom_true_positives"] = seg.bloom_true_positives;
+  segmenter["cdc_chunks"] = seg.cdc_chunks;
+  segmenter["cdc_matches"] = seg.cdc_matches;
+  segmenter["merged_chunks"] = seg.merged_chunks;
+
+  folly::dynamic stages = folly::dynamic::array;
+  for (auto const& st : prog.stages()) {
+    stages.push_back(folly::dynamic::object("name", st.name)(
+        "wall_time", st.wall_time)("cpu_time", st.cpu_time));
+  }
+
+  folly::dynamic memory = folly::dynamic::object;
+  memory["limit"] = prog.memory.limit();
+  memory["peak"] = prog.memory.peak();
+  for (size_t i = 0; i < memory_accountant::kNumStages; ++i) {
+    auto const stage = static_cast<memory_stage>(i);
+    memory[std::string(memory_accountant::stage_name(stage))] =
+        prog.memory.peak(stage);
+  }
+
+  folly::dynamic blocks = folly::dynamic::array;
+  std::map<std::string, std::array<uint64_t, 3>> per_category;
+  for (auto const& b : prog.written_blocks()) {
+    folly::dynamic block = folly::dynamic::object("compression", b.compression)(
+        "uncompressed_size", b.uncompressed_size)(
+        "compressed_size", b.compressed_size)(
+        "ratio", ratio(b.compressed_size, b.uncompressed_size));
+    if (!b.category.empty()) {
+      block["category"] = b.category;
+      auto& cat = per_category[b.category];
+      ++cat[0];
+      cat[1] += b.uncompressed_size;
+      cat[2] += b.compressed_size;
+    }
+    blocks.push_back(std::move(block));
+  }
+
+  folly::dynamic categories = folly::dynamic::object;
+  for (auto const& [name, cat] : per_category) {
+    categories[name] = folly::dynamic::object("blocks", cat[0])(
+        "uncompressed_size", cat[1])("compressed_size", cat[2])(
+        "ratio", ratio(cat[2], cat[1]));
+  }
+
+  struct ::rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+
+  folly::dynamic report = folly::dynamic::object;
+  report["version"] = PRJ_GIT_ID;
+  report["wall_time"] = wall_time;
+  report["peak_memory"] = static_cast<int64_t>(usage.ru_maxrss) * 1024;
+  report["compression_ratio"] =
+      ratio(prog.compressed_size.load(), prog.original_size.load());
+  report["counters"] = std::move(counters);
+  report["segmenter"] = std::move(segmenter);
+  report["stages"] = std::move(stages);
+  report["memory"] = std::move(memory);
+  report["categories"] = std::move(categories);
+  report["blocks"] = std::move(blocks);
+
+  std::ofstream ofs(path);
+
+  if (ofs) {
+    ofs << folly::toPrettyJson(report) << std::endl;
+  }
+
+  if (!ofs) {
+    std::cerr << "error: cannot write report " << path << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
 size_t get_term_width() {
   struct ::winsize w;
   ::ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
@@ -327,18 +615,27 @@ constexpr unsigned default_level = 7;
 int mkdwarfs(int argc, char** argv) {
   using namespace folly::gen;
 
-  const size_t num_cpu = std::max(std::thread::hardware_concurrency(), 1u);
+  const size_t num_cpu = available_cpus();
 
   block_manager::config cfg;
   std::string path, output, memory_limit, script_arg, compression, header,
       schema_compression, metadata_compression, log_level_str, timestamp,
-      time_resolution, order, progress_mode, recompress_opts, pack_metadata;
-  size_t num_workers;
-  bool no_progress = false, remove_header = false;
+      time_resolution, order, progress_mode, recompress_opts, pack_metadata,
+      base_image, reference_image, read_mode, read_size, dictionary_size,
+      block_alignment_str, recompress_blocks, hot_profile, hot_compression,
+      hot_size, event_trace, report, cpuset, fragment_size, analyze,
+      analyze_sample_size, input_cache_size;
+  std::vector<std::string> category_compression, adaptive_compression,
+      extra_outputs;
+  size_t num_workers, min_workers;
+  uint32_t hot_min_count;
+  bool no_progress = false, remove_header = false, section_index = false,
+       input_archive = false;
   unsigned level;
   uint16_t uid, gid;
 
   scanner_options options;
+  rewrite_options rw_opts;
 
   auto order_desc =
       "inode order (" + (from(order_choices) | get<0>() | unsplit(", ")) + ")";
@@ -355,10 +652,21 @@ int mkdwarfs(int argc, char** argv) {
   opts.add_options()
     ("input,i",
         po::value<std::string>(&path),
-        "path to root directory or source filesystem")
+        "path to root directory, source filesystem or image to re-pack")
+    ("input-archive",
+        po::value<bool>(&input_archive)->zero_tokens(),
+        "input is an archive (tar, cpio, ...) instead of a directory,"
+        " use '-' to read it from stdin")
+    ("input-cache-size",
+        po::value<std::string>(&input_cache_size)->default_value("512m"),
+        "block cache size when re-packing an existing image")
     ("output,o",
         po::value<std::string>(&output),
         "filesystem output name")
+    ("extra-output",
+        po::value<std::vector<std::string>>(&extra_outputs)->composing(),
+        "build another image from the same scan "
+        "(FILE[:BLOCK_SIZE_BITS[:COMPRESSION]])")
     ("compress-level,l",
         po::value<unsigned>(&level)->default_value(default_level),
         "compression level (0=fast, 9=best, please see man page for details)")
@@ -368,6 +676,18 @@ int mkdwarfs(int argc, char** argv) {
     ("num-workers,N",
         po::value<size_t>(&num_workers)->default_value(num_cpu),
         "number of scanner/writer worker threads")
+    ("min-workers",
+        po::value<size_t>(&min_workers)->default_value(0),
+        "adapt number of compression threads to system load")
+    ("cpuset",
+        po::value<std::string>(&cpuset),
+        "run worker threads on these CPUs (e.g. 0-7,16-23)")
+    ("num-scanner-workers",
+        po::value<size_t>(&options.num_scanner_workers)->default_value(0),
+        "number of threads for parallel directory traversal")
+    ("num-segmenters",
+        po::value<size_t>(&options.num_segmenters)->default_value(1),
+        "number of independent segmenter streams")
     ("max-lookback-blocks,B",
         po::value<size_t>(&cfg.max_active_blocks)->default_value(1),
         "how many blocks to scan for segments")
@@ -377,12 +697,24 @@ int mkdwarfs(int argc, char** argv) {
     ("window-step,w",
         po::value<unsigned>(&cfg.window_increment_shift),
         "window step (as right shift of size)")
+    ("cdc-chunk-bits",
+        po::value<unsigned>(&cfg.cdc_chunk_bits)->default_value(0),
+        "average content-defined chunk size bits (0 = disabled)")
+    ("sparse-files",
+        po::value<bool>(&cfg.detect_holes)->zero_tokens(),
+        "store holes in sparse files without data")
     ("bloom-filter-size",
         po::value<unsigned>(&cfg.bloom_filter_size)->default_value(4),
         "bloom filter size (2^N*values bits)")
     ("memory-limit,L",
         po::value<std::string>(&memory_limit)->default_value("1g"),
         "block manager memory limit")
+    ("read-mode",
+        po::value<std::string>(&read_mode)->default_value("mmap"),
+        "how to read input files (mmap, pread)")
+    ("read-size",
+        po::value<std::string>(&read_size)->default_value("8m"),
+        "size of individual reads in pread mode")
     ("compression,C",
         po::value<std::string>(&compression),
         "block compression algorithm")
@@ -392,6 +724,20 @@ int mkdwarfs(int argc, char** argv) {
     ("metadata-compression",
         po::value<std::string>(&metadata_compression),
         "metadata compression algorithm")
+    ("adaptive-compression",
+        po::value<std::vector<std::string>>(&adaptive_compression)
+            ->composing(),
+        "block compression by block entropy (ENTROPY:ALGORITHM)")
+    ("dictionary-size",
+        po::value<std::string>(&dictionary_size)->default_value("0"),
+        "train a zstd dictionary of this size for all blocks")
+    ("categorize",
+        po::value<bool>(&options.categorize)->zero_tokens(),
+        "store files of different categories in separate blocks")
+    ("category-compression",
+        po::value<std::vector<std::string>>(&category_compression)
+            ->composing(),
+        "block compression for category (CATEGORY:ALGORITHM)")
     ("pack-metadata,P",
         po::value<std::string>(&pack_metadata)->default_value("auto"),
         "pack certain metadata elements (auto, all, none, chunk_table, "
@@ -400,6 +746,30 @@ int mkdwarfs(int argc, char** argv) {
     ("recompress",
         po::value<std::string>(&recompress_opts)->implicit_value("all"),
         "recompress an existing filesystem (none, block, metadata, all)")
+    ("recompress-blocks",
+        po::value<std::string>(&recompress_blocks),
+        "only recompress these blocks (e.g. 0-99,150,200-)")
+    ("verify-blocks",
+        po::value<bool>(&rw_opts.verify_blocks)->zero_tokens(),
+        "verify integrity of blocks copied by --recompress")
+    ("hot-profile",
+        po::value<std::string>(&hot_profile),
+        "access profile for selecting hot blocks (use with --recompress)")
+    ("hot-compression",
+        po::value<std::string>(&hot_compression),
+        "compression algorithm for hot blocks")
+    ("hot-min-count",
+        po::value<uint32_t>(&hot_min_count)->default_value(1),
+        "minimum number of accesses for a block to be hot")
+    ("hot-size",
+        po::value<std::string>(&hot_size),
+        "maximum uncompressed size of all hot blocks")
+    ("base",
+        po::value<std::string>(&base_image),
+        "reuse data of unchanged files from this filesystem image")
+    ("reference",
+        po::value<std::string>(&reference_image),
+        "like --base, but reference blocks instead of copying them")
     ("set-owner",
         po::value<uint16_t>(&uid),
         "set owner (uid) for whole file system")
@@ -418,6 +788,13 @@ int mkdwarfs(int argc, char** argv) {
     ("order",
         po::value<std::string>(&order),
         order_desc.c_str())
+    ("nilsimsa-lsh-bands",
+        po::value<int>(&options.file_order.nilsimsa_lsh_bands)
+            ->default_value(0),
+        "number of LSH bands for nilsimsa ordering (0 = exhaustive, max 16)")
+    ("order-fragment-size",
+        po::value<std::string>(&fragment_size)->default_value("0"),
+        "order larger files in fragments of this size (0 = disabled)")
 #ifdef DWARFS_HAVE_PYTHON
     ("script",
         po::value<std::string>(&script_arg),
@@ -439,6 +816,27 @@ int mkdwarfs(int argc, char** argv) {
         po::value<bool>(&remove_header)->zero_tokens(),
         "remove any header present before filesystem data"
         " (use with --recompress)")
+    ("section-index",
+        po::value<bool>(&section_index)->zero_tokens(),
+        "write an index of all sections for faster mounting")
+    ("separate-string-tables",
+        po::value<bool>(&options.separate_string_tables)->zero_tokens(),
+        "store names and symlinks in sections that are loaded on demand")
+    ("block-alignment",
+        po::value<std::string>(&block_alignment_str),
+        "align block data to this size (e.g. 4k or 2m)")
+    ("event-trace",
+        po::value<std::string>(&event_trace),
+        "write Chrome trace events to this file")
+    ("report",
+        po::value<std::string>(&report),
+        "write a build report (json=FILE)")
+    ("analyze",
+        po::value<std::string>(&analyze)->implicit_value("1,3,5,7,9"),
+        "predict image size and build time for these compression levels")
+    ("analyze-sample-size",
+        po::value<std::string>(&analyze_sample_size)->default_value("256m"),
+        "amount of input data to sample for --analyze")
     ("log-level",
         po::value<std::string>(&log_level_str)->default_value("info"),
         "log level (error, warn, info, debug, trace)")
@@ -473,7 +871,8 @@ int mkdwarfs(int argc, char** argv) {
     return 1;
   }
 
-  if (vm.count("help") or !vm.count("input") or !vm.count("output")) {
+  if (vm.count("help") or !vm.count("input") or
+      (!vm.count("output") and !vm.count("analyze"))) {
     size_t l_dc = 0, l_sc = 0, l_mc = 0, l_or = 0;
     for (auto const& l : levels) {
       l_dc = std::max(l_dc, ::strlen(l.data_compression));
@@ -522,11 +921,15 @@ int mkdwarfs(int argc, char** argv) {
                  "               level=["
               << ZSTD_MIN_LEVEL << ".." << ZSTD_maxCLevel()
               << "]\n"
+                 "               frame_bits=[12..30]\n"
+                 "               long=[10..31]\n"
+                 "               mt\n"
 #endif
 #ifdef DWARFS_HAVE_LIBLZMA
                  "  lzma     LZMA compression\n"
                  "               level=[0..9]\n"
                  "               dict_size=[12..30]\n"
+                 "               block_bits=[16..30]\n"
                  "               extreme\n"
                  "               binary={x86,powerpc,ia64,arm,armthumb,sparc}\n"
 #endif
@@ -570,8 +973,49 @@ int mkdwarfs(int argc, char** argv) {
     order = defaults.order;
   }
 
+  if (!base_image.empty() && !reference_image.empty()) {
+    std::cerr << "error: --base and --reference are mutually exclusive"
+              << std::endl;
+    return 1;
+  }
+
+  if (!reference_image.empty()) {
+    base_image = reference_image;
+    options.base_is_reference = true;
+  }
+
+  for (auto const& spec : category_compression) {
+    auto pos = spec.find(':');
+    if (pos == std::string::npos || pos == 0) {
+      std::cerr << "error: invalid category compression: " << spec
+                << std::endl;
+      return 1;
+    }
+    auto algorithm = spec.substr(pos + 1);
+    try {
+      block_compressor bc(algorithm);
+    } catch (runtime_error const& e) {
+      std::cerr << "error: invalid category compression: " << spec << ": "
+                << e.what() << std::endl;
+      return 1;
+    }
+    options.category_compression[spec.substr(0, pos)] = std::move(algorithm);
+  }
+
+  if (!options.category_compression.empty() && !options.categorize) {
+    std::cerr << "error: --category-compression requires --categorize"
+              << std::endl;
+    return 1;
+  }
+
   bool recompress = vm.count("recompress");
-  rewrite_options rw_opts;
+
+  if (recompress && input_archive) {
+    std::cerr << "error: --input-archive cannot be used with --recompress"
+              << std::endl;
+    return 1;
+  }
+
   if (recompress) {
     std::unordered_map<std::string, unsigned> const modes{
         {"all", 3},
@@ -586,6 +1030,75 @@ int mkdwarfs(int argc, char** argv) {
       std::cerr << "invalid recompress mode: " << recompress_opts << std::endl;
       return 1;
     }
+    if (!recompress_blocks.empty()) {
+      if (!rw_opts.recompress_block) {
+        std::cerr << "error: --recompress-blocks requires block recompression"
+                  << std::endl;
+        return 1;
+      }
+      if (parse_block_ranges(recompress_blocks,
+                             rw_opts.recompress_block_ranges)) {
+        return 1;
+      }
+    }
+    rw_opts.num_workers = num_workers;
+    if (!hot_profile.empty()) {
+      if (hot_compression.empty()) {
+        std::cerr << "error: --hot-profile requires --hot-compression"
+                  << std::endl;
+        return 1;
+      }
+      if (load_hot_profile(hot_profile, rw_opts.hot_block_counts)) {
+        return 1;
+      }
+      rw_opts.hot_compression = hot_compression;
+      rw_opts.hot_min_count = hot_min_count;
+      if (!hot_size.empty()) {
+        rw_opts.hot_max_bytes = parse_size_with_unit(hot_size);
+      }
+    } else if (!hot_compression.empty() || !hot_size.empty()) {
+      std::cerr << "error: --hot-compression and --hot-size require "
+                   "--hot-profile"
+                << std::endl;
+      return 1;
+    }
+  } else if (!recompress_blocks.empty() || !hot_profile.empty()) {
+    std::cerr << "error: --recompress-blocks and --hot-profile require "
+                 "--recompress"
+              << std::endl;
+    return 1;
+  }
+
+  if (!extra_outputs.empty() &&
+      (recompress || !base_image.empty() || vm.count("analyze"))) {
+    std::cerr << "error: --extra-output cannot be used with --recompress, "
+                 "--base, --reference or --analyze"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<unsigned> analyze_levels;
+
+  if (vm.count("analyze")) {
+    if (recompress || !base_image.empty()) {
+      std::cerr << "error: --analyze cannot be used with --recompress, "
+                   "--base or --reference"
+                << std::endl;
+      return 1;
+    }
+
+    std::vector<std::string> parts;
+    boost::split(parts, analyze, boost::is_any_of(","));
+
+    for (auto const& part : parts) {
+      auto lvl = folly::tryTo<unsigned>(part);
+      if (!lvl || *lvl >= levels.size()) {
+        std::cerr << "error: invalid compression level for --analyze: "
+                  << part << std::endl;
+        return 1;
+      }
+      analyze_levels.push_back(*lvl);
+    }
   }
 
   std::vector<std::string> order_opts;
@@ -637,9 +1150,62 @@ int mkdwarfs(int argc, char** argv) {
   }
 
   size_t mem_limit = parse_size_with_unit(memory_limit);
+  options.dictionary_size = parse_size_with_unit(dictionary_size);
+  options.inode.fragment_size = parse_size_with_unit(fragment_size);
+
+  if (auto fs = options.inode.fragment_size;
+      fs > 0 && fs < (size_t(1) << cfg.block_size_bits)) {
+    std::cerr << "error: --order-fragment-size must not be smaller than the "
+                 "block size"
+              << std::endl;
+    return 1;
+  }
+
+  // the maximum chunk size is eight times the average chunk size
+  if (auto bits = cfg.cdc_chunk_bits;
+      bits > 0 && (bits < 8 || bits + 3 > cfg.block_size_bits)) {
+    std::cerr << "error: --cdc-chunk-bits must be between 8 and "
+              << (cfg.block_size_bits - 3) << std::endl;
+    return 1;
+  }
+
+  os_access_options os_opts;
+
+  try {
+    os_opts.read_mode = parse_file_read_mode(read_mode);
+  } catch (runtime_error const& e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  os_opts.read_size = parse_size_with_unit(read_size);
+
+  std::vector<int> worker_cpus;
 
-  worker_group wg_compress("compress", num_workers);
-  worker_group wg_scanner("scanner", num_workers);
+  if (!cpuset.empty()) {
+    try {
+      worker_cpus = parse_cpu_list(cpuset);
+    } catch (runtime_error const& e) {
+      std::cerr << "error: " << e.what() << std::endl;
+      return 1;
+    }
+
+    if (vm["num-workers"].defaulted()) {
+      num_workers = std::min(num_workers, worker_cpus.size());
+    }
+  }
+
+  auto wg_compress =
+      min_workers > 0
+          ? worker_group(worker_group::load_adaptive, "compress", num_workers,
+                         std::numeric_limits<size_t>::max(), 0, min_workers)
+          : worker_group("compress", num_workers);
+  worker_group wg_scanner(worker_group::work_stealing, "scanner", num_workers);
+
+  if (!worker_cpus.empty()) {
+    wg_compress.set_affinity(worker_cpus);
+    wg_scanner.set_affinity(worker_cpus);
+  }
 
   if (no_progress) {
     progress_mode = "none";
@@ -787,11 +1353,195 @@ int mkdwarfs(int argc, char** argv) {
     }
   }
 
+  if (recompress &&
+      (options.uid || options.gid || options.timestamp ||
+       !vm["pack-metadata"].defaulted())) {
+    // metadata is rebuilt, blocks are copied unless asked otherwise
+    metadata_rebuild_options mro;
+    mro.uid = options.uid;
+    mro.gid = options.gid;
+    mro.timestamp = options.timestamp;
+    mro.pack_chunk_table = options.pack_chunk_table;
+    mro.pack_directories = options.pack_directories;
+    mro.pack_shared_files_table = options.pack_shared_files_table;
+    mro.plain_names_table = options.plain_names_table;
+    mro.pack_names = options.pack_names;
+    mro.pack_names_index = options.pack_names_index;
+    mro.plain_symlinks_table = options.plain_symlinks_table;
+    mro.pack_symlinks = options.pack_symlinks;
+    mro.pack_symlinks_index = options.pack_symlinks_index;
+    mro.force_pack_string_tables = options.force_pack_string_tables;
+    rw_opts.rebuild_metadata = mro;
+  }
+
+  std::shared_ptr<os_access> os;
+  // the scanner's paths are relative to the root of an archive or image
+  std::string root = input_archive ? std::string() : path;
+
+  if (!recompress) {
+    if (input_archive) {
+      try {
+        os = std::make_shared<os_access_archive>(lgr, path);
+      } catch (std::exception const& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+      }
+    } else if (std::filesystem::is_regular_file(path)) {
+      // re-pack an existing image
+      filesystem_options fsopts;
+      fsopts.image_offset = filesystem_options::IMAGE_OFFSET_AUTO;
+      fsopts.metadata.enable_nlink = true;
+      fsopts.block_cache.max_bytes = parse_size_with_unit(input_cache_size);
+      fsopts.block_cache.num_workers = num_workers;
+      root.clear();
+
+      try {
+        os = std::make_shared<os_access_filesystem>(
+            std::make_shared<filesystem_v2>(
+                lgr, std::make_shared<dwarfs::mmap>(path), fsopts));
+      } catch (std::exception const& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+      }
+    } else {
+      os = std::make_shared<os_access_posix>(os_opts);
+    }
+  }
+
   unsigned interval_ms =
       pg_mode == console_writer::NONE || pg_mode == console_writer::SIMPLE
           ? 2000
           : 200;
 
+  if (!analyze_levels.empty()) {
+    LOG_PROXY(debug_logger_policy, lgr);
+
+    auto sample =
+        sample_input(*os, root, parse_size_with_unit(analyze_sample_size));
+    auto sample_scr = std::make_shared<sample_script>(script, sample.files);
+    std::vector<analyze_result> results;
+
+    for (auto lvl : analyze_levels) {
+      // explicitly given options apply to all levels, just like they
+      // override the defaults of a single level
+      auto const& d = levels[lvl];
+      auto lcfg = cfg;
+      auto lopts = options;
+      std::string lcomp{vm.count("compression") ? compression
+                                                : d.data_compression};
+      std::string lschema{vm.count("schema-compression")
+                              ? schema_compression
+                              : d.schema_compression};
+      std::string lmeta{vm.count("metadata-compression")
+                            ? metadata_compression
+                            : d.metadata_compression};
+
+      if (!vm.count("block-size-bits")) {
+        lcfg.block_size_bits = d.block_size_bits;
+      }
+      if (!vm.count("window-size")) {
+        lcfg.blockhash_window_size = d.window_size;
+      }
+      if (!vm.count("window-step")) {
+        lcfg.window_increment_shift = d.window_step;
+      }
+      if (!vm.count("order")) {
+        lopts.file_order.mode = order_choices.at(d.order);
+      }
+
+      lopts.inode.with_similarity =
+          force_similarity ||
+          lopts.file_order.mode == file_order_mode::SIMILARITY;
+      lopts.inode.with_nilsimsa =
+          lopts.file_order.mode == file_order_mode::NILSIMSA;
+
+      block_compressor bc(lcomp);
+      block_compressor schema_bc(lschema);
+      block_compressor metadata_bc(lmeta);
+
+      if (bc.type() != compression_type::ZSTD) {
+        lopts.dictionary_size = 0;
+      }
+
+      worker_group wg_compress("compress", num_workers);
+      worker_group wg_scanner(worker_group::work_stealing, "scanner",
+                              num_workers);
+
+      if (!worker_cpus.empty()) {
+        wg_compress.set_affinity(worker_cpus);
+        wg_scanner.set_affinity(worker_cpus);
+      }
+
+      progress prog([&](const progress& p, bool last) { lgr.update(p, last); },
+                    interval_ms);
+      prog.memory.set_limit(mem_limit);
+
+      filesystem_writer_options fswopts;
+      fswopts.max_queue_size = mem_limit;
+
+      // create the file exclusively so nobody can make us write elsewhere
+      auto image = (std::filesystem::temp_directory_path() /
+                    "mkdwarfs-analyze-XXXXXX")
+                       .string();
+
+      if (auto fd = ::mkstemp(image.data()); fd >= 0) {
+        ::close(fd);
+      } else {
+        LOG_ERROR << "failed to create temporary file '" << image
+                  << "': " << strerror(errno);
+        return 1;
+      }
+
+      SCOPE_EXIT {
+        std::error_code ec;
+        std::filesystem::remove(image, ec);
+      };
+
+      LOG_INFO << "analyzing compression level " << lvl;
+
+      try {
+        auto const start = std::chrono::steady_clock::now();
+        std::ofstream ofs(image, std::ios::binary);
+
+        {
+          filesystem_writer fsw(ofs, lgr, wg_compress, prog, bc, schema_bc,
+                                metadata_bc, fswopts);
+          scanner s(lgr, wg_scanner, lcfg, entry_factory::create(), os,
+                    sample_scr, lopts);
+          s.scan(fsw, root, prog);
+        }
+
+        ofs.close();
+
+        if (ofs.bad()) {
+          LOG_ERROR << "failed to write '" << image
+                    << "': " << strerror(errno);
+          return 1;
+        }
+
+        std::chrono::duration<double> wall_time =
+            std::chrono::steady_clock::now() - start;
+
+        results.push_back(
+            {lvl, size_t(1) << lcfg.block_size_bits, lcomp,
+             static_cast<size_t>(std::filesystem::file_size(image)),
+             wall_time.count(),
+             wg_compress.get_cpu_time() + wg_scanner.get_cpu_time(),
+             random_read_time(lgr, image)});
+      } catch (runtime_error const& e) {
+        LOG_ERROR << e.what();
+        return 1;
+      } catch (system_error const& e) {
+        LOG_ERROR << e.what();
+        return 1;
+      }
+    }
+
+    print_analysis(std::cout, sample, results);
+
+    return 0;
+  }
+
   std::ofstream ofs(output, std::ios::binary);
 
   if (ofs.bad() || !ofs.is_open()) {
@@ -800,9 +1550,52 @@ int mkdwarfs(int argc, char** argv) {
     return 1;
   }
 
+  std::string report_file;
+
+  if (!report.empty()) {
+    if (report.rfind("json=", 0) != 0 || report.size() <= 5) {
+      std::cerr << "error: invalid report specification: " << report
+                << std::endl;
+      return 1;
+    }
+
+    report_file = report.substr(5);
+  }
+
   filesystem_writer_options fswopts;
   fswopts.max_queue_size = mem_limit;
   fswopts.remove_header = remove_header;
+  fswopts.with_section_index = section_index;
+
+  if (!block_alignment_str.empty()) {
+    auto align = parse_size_with_unit(block_alignment_str);
+
+    if (align < 512 || align > (UINT32_C(1) << 30) || (align & (align - 1))) {
+      std::cerr << "error: block alignment must be a power of two between "
+                   "512 and 1g"
+                << std::endl;
+      return 1;
+    }
+
+    fswopts.block_alignment = align;
+  }
+
+  for (auto const& spec : adaptive_compression) {
+    auto pos = spec.find(':');
+    std::optional<double> min_entropy;
+    if (pos != std::string::npos) {
+      if (auto e = folly::tryTo<double>(spec.substr(0, pos))) {
+        min_entropy = *e;
+      }
+    }
+    if (!min_entropy || *min_entropy < 0.0 || *min_entropy > 8.0) {
+      std::cerr << "error: invalid adaptive compression: " << spec
+                << std::endl;
+      return 1;
+    }
+    fswopts.adaptive_compression.push_back(
+        {*min_entropy, spec.substr(pos + 1)});
+  }
 
   std::unique_ptr<std::ifstream> header_ifs;
 
@@ -821,10 +1614,18 @@ int mkdwarfs(int argc, char** argv) {
   progress prog([&](const progress& p, bool last) { lgr.update(p, last); },
                 interval_ms);
 
+  prog.memory.set_limit(mem_limit);
+
   block_compressor bc(compression);
   block_compressor schema_bc(schema_compression);
   block_compressor metadata_bc(metadata_compression);
 
+  if (options.dictionary_size > 0 && bc.type() != compression_type::ZSTD) {
+    std::cerr << "error: --dictionary-size requires zstd compression"
+              << std::endl;
+    return 1;
+  }
+
   size_t min_memory_req = num_workers * (1 << cfg.block_size_bits);
 
   if (mem_limit < min_memory_req && compression != "null") {
@@ -837,6 +1638,108 @@ int mkdwarfs(int argc, char** argv) {
   filesystem_writer fsw(ofs, lgr, wg_compress, prog, bc, schema_bc, metadata_bc,
                         fswopts, header_ifs.get());
 
+  if (cfg.detect_holes) {
+    fsw.enable_feature(image_feature::SPARSE_FILES);
+  }
+
+  // Each extra output has its own file, writer and block configuration,
+  // everything else is shared with the main output
+  struct extra_output {
+    std::string path;
+    block_manager::config cfg;
+    std::ofstream ofs;
+    std::unique_ptr<std::ifstream> header_ifs;
+    std::unique_ptr<block_compressor> bc;
+    std::unique_ptr<filesystem_writer> fsw;
+  };
+
+  std::vector<std::unique_ptr<extra_output>> extras;
+
+  for (auto const& spec : extra_outputs) {
+    auto eo = std::make_unique<extra_output>();
+    auto ecomp = compression;
+    auto pos = spec.find(':');
+
+    eo->path = spec.substr(0, pos);
+    eo->cfg = cfg;
+
+    if (pos != std::string::npos) {
+      auto rest = spec.substr(pos + 1);
+      auto cpos = rest.find(':');
+      auto bits = folly::tryTo<unsigned>(rest.substr(0, cpos));
+
+      if (!bits || *bits < 10 || *bits > 30) {
+        std::cerr << "error: invalid block size bits for extra output: "
+                  << spec << std::endl;
+        return 1;
+      }
+
+      eo->cfg.block_size_bits = *bits;
+
+      if (cpos != std::string::npos) {
+        ecomp = rest.substr(cpos + 1);
+      }
+    }
+
+    if (eo->path.empty() || eo->path == output) {
+      std::cerr << "error: invalid extra output: " << spec << std::endl;
+      return 1;
+    }
+
+    eo->ofs.open(eo->path, std::ios::binary);
+
+    if (eo->ofs.bad() || !eo->ofs.is_open()) {
+      std::cerr << "error: cannot open output file '" << eo->path
+                << "': " << strerror(errno) << std::endl;
+      return 1;
+    }
+
+    if (!header.empty()) {
+      eo->header_ifs =
+          std::make_unique<std::ifstream>(header.c_str(), std::ios::binary);
+      if (eo->header_ifs->bad() || !eo->header_ifs->is_open()) {
+        std::cerr << "error: cannot open header file '" << header
+                  << "': " << strerror(errno) << std::endl;
+        return 1;
+      }
+    }
+
+    eo->bc = std::make_unique<block_compressor>(ecomp);
+
+    if (options.dictionary_size > 0 &&
+        eo->bc->type() != compression_type::ZSTD) {
+      std::cerr << "error: --dictionary-size requires zstd compression"
+                << std::endl;
+      return 1;
+    }
+
+    eo->fsw = std::make_unique<filesystem_writer>(
+        eo->ofs, lgr, wg_compress, prog, *eo->bc, schema_bc, metadata_bc,
+        fswopts, eo->header_ifs.get());
+
+    if (cfg.detect_holes) {
+      eo->fsw->enable_feature(image_feature::SPARSE_FILES);
+    }
+
+    extras.push_back(std::move(eo));
+  }
+
+  if (!event_trace.empty()) {
+    try {
+      if (!event_tracer::start(event_trace)) {
+        LOG_WARN << "built without event tracing support, ignoring "
+                    "--event-trace";
+      }
+    } catch (runtime_error const& e) {
+      LOG_ERROR << e.what();
+      return 1;
+    }
+  }
+
+  // make sure the trace is written even if the build fails
+  SCOPE_EXIT { event_tracer::stop(); };
+
+  auto const build_start = std::chrono::steady_clock::now();
   auto ti = LOG_TIMED_INFO;
 
   try {
@@ -851,11 +1754,25 @@ int mkdwarfs(int argc, char** argv) {
       options.inode.with_nilsimsa =
           options.file_order.mode == file_order_mode::NILSIMSA;
 
-      scanner s(lgr, wg_scanner, cfg, entry_factory::create(),
-                std::make_shared<os_access_posix>(), std::move(script),
-                options);
+      scanner s(lgr, wg_scanner, cfg, entry_factory::create(), os,
+                std::move(script), options);
+
+      std::unique_ptr<filesystem_v2> base_fs;
 
-      s.scan(fsw, path, prog);
+      if (!base_image.empty()) {
+        base_fs = std::make_unique<filesystem_v2>(
+            lgr, std::make_shared<dwarfs::mmap>(base_image));
+      }
+
+      if (extras.empty()) {
+        s.scan(fsw, root, prog, base_fs.get());
+      } else {
+        std::vector<scanner::output> outputs{{fsw, cfg}};
+        for (auto const& eo : extras) {
+          outputs.push_back({*eo->fsw, eo->cfg});
+        }
+        s.scan(outputs, root, prog);
+      }
     }
   } catch (runtime_error const& e) {
     LOG_ERROR << e.what();
@@ -868,6 +1785,8 @@ int mkdwarfs(int argc, char** argv) {
   LOG_INFO << "compression CPU time: "
            << time_with_unit(wg_compress.get_cpu_time());
 
+  event_tracer::stop();
+
   ofs.close();
 
   if (ofs.bad()) {
@@ -876,6 +1795,24 @@ int mkdwarfs(int argc, char** argv) {
     return 1;
   }
 
+  for (auto& eo : extras) {
+    eo->ofs.close();
+
+    if (eo->ofs.bad()) {
+      LOG_ERROR << "failed to close output file '" << eo->path
+                << "': " << strerror(errno);
+      return 1;
+    }
+  }
+
+  if (!report_file.empty()) {
+    std::chrono::duration<double> wall_time =
+        std::chrono::steady_clock::now() - build_start;
+    if (write_json_report(report_file, prog, wall_time.count())) {
+      return 1;
+    }
+  }
+
   std::ostringstream err;
 
   if (prog.errors) {
@@ -20,56 +20,146 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <random>
 #include <regex>
 #include <set>
 #include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <folly/ScopeGuard.h>
+#include <folly/String.h>
+
 #include <gtest/gtest.h>
 
+#include "dwarfs/block_cache.h"
 #include "dwarfs/block_compressor.h"
+#include "dwarfs/buffer_pool.h"
+#include "dwarfs/cyclic_hash.h"
 #include "dwarfs/entry.h"
+#include "dwarfs/filesystem_extractor.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fs_section.h"
+#include "dwarfs/fstypes.h"
+#include "dwarfs/input_sample.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/memory_accountant.h"
+#include "dwarfs/metadata_v2.h"
 #include "dwarfs/mmif.h"
 #include "dwarfs/options.h"
+#include "dwarfs/os_access_archive.h"
+#include "dwarfs/pread_file.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
+#include "dwarfs/string_table.h"
+#include "dwarfs/util.h"
+#include "dwarfs/worker_group.h"
 #include "loremipsum.h"
 #include "mmap_mock.h"
 #include "test_helpers.h"
+#include "test_strings.h"
 
 using namespace dwarfs;
 
 namespace {
 
 std::string
-build_dwarfs(logger& lgr, std::shared_ptr<test::os_access_mock> input,
+build_dwarfs(logger& lgr, std::shared_ptr<os_access> input,
              std::string const& compression,
              block_manager::config const& cfg = block_manager::config(),
-             scanner_options const& options = scanner_options()) {
+             scanner_options const& options = scanner_options(),
+             filesystem_v2 const* base = nullptr,
+             std::shared_ptr<script> scr = nullptr,
+             filesystem_writer_options const& fswopts =
+                 filesystem_writer_options()) {
   // force multithreading
   worker_group wg("worker", 4);
 
-  scanner s(lgr, wg, cfg, entry_factory::create(), input,
-            std::make_shared<test::script_mock>(), options);
+  if (!scr) {
+    scr = std::make_shared<test::script_mock>();
+  }
+
+  scanner s(lgr, wg, cfg, entry_factory::create(), input, std::move(scr),
+            options);
 
   std::ostringstream oss;
   progress prog([](const progress&, bool) {}, 1000);
 
   block_compressor bc(compression);
-  filesystem_writer fsw(oss, lgr, wg, prog, bc);
+  filesystem_writer fsw(oss, lgr, wg, prog, bc, fswopts);
+
+  if (cfg.detect_holes) {
+    fsw.enable_feature(image_feature::SPARSE_FILES);
+  }
+
+  s.scan(fsw, "", prog, base);
+
+  return oss.str();
+}
+
+std::string rewrite_dwarfs(logger& lgr, std::string const& image,
+                           rewrite_options const& opts,
+                           std::string const& compression = "null",
+                           filesystem_writer_options const& fswopts =
+                               filesystem_writer_options()) {
+  worker_group wg("rewriter", 2);
+  progress prog([](const progress&, bool) {}, 1000);
+  block_compressor bc(compression);
+  std::ostringstream oss;
 
-  s.scan(fsw, "", prog);
+  {
+    filesystem_writer fsw(oss, lgr, wg, prog, bc, fswopts);
+    filesystem_v2::rewrite(lgr, prog, std::make_shared<test::mmap_mock>(image),
+                           fsw, opts);
+  }
 
   return oss.str();
 }
 
+// Maps the path of each entry to the contents of regular files or the
+// targets of symlinks, which is good enough to compare two images
+std::map<std::string, std::string> image_contents(filesystem_v2 const& fs) {
+  std::map<std::string, std::string> rv;
+
+  fs.walk([&](dir_entry_view entry) {
+    auto iv = entry.inode();
+    auto& data = rv[entry.path()];
+
+    if (S_ISREG(iv.mode())) {
+      struct ::stat st;
+      EXPECT_EQ(0, fs.getattr(iv, &st));
+      data.resize(st.st_size);
+      EXPECT_EQ(st.st_size, fs.read(fs.open(iv), data.data(), data.size()))
+          << entry.path();
+    } else if (S_ISLNK(iv.mode())) {
+      EXPECT_EQ(0, fs.readlink(iv, &data));
+    }
+  });
+
+  return rv;
+}
+
 void basic_end_to_end_test(std::string const& compressor,
                            unsigned block_size_bits, file_order_mode file_order,
                            bool with_devices, bool with_specials, bool set_uid,
@@ -78,7 +168,8 @@ void basic_end_to_end_test(std::string const& compressor,
                            bool pack_directories, bool pack_shared_files_table,
                            bool pack_names, bool pack_names_index,
                            bool pack_symlinks, bool pack_symlinks_index,
-                           bool plain_names_table, bool plain_symlinks_table) {
+                           bool plain_names_table, bool plain_symlinks_table,
+                           bool lazy_tables = false) {
   block_manager::config cfg;
   scanner_options options;
 
@@ -127,6 +218,8 @@ void basic_end_to_end_test(std::string const& compressor,
   opts.block_cache.max_bytes = 1 << 20;
   opts.metadata.enable_nlink = enable_nlink;
   opts.metadata.check_consistency = true;
+  opts.metadata.path_cache_size = pack_names ? 4 : 0;
+  opts.metadata.lazy_tables = lazy_tables;
 
   filesystem_v2 fs(lgr, mm, opts);
 
@@ -168,6 +261,42 @@ void basic_end_to_end_test(std::string const& compressor,
   EXPECT_EQ(rv, st.st_size);
   EXPECT_EQ(std::string(buf.begin(), buf.end()), test::loremipsum(st.st_size));
 
+  {
+    std::promise<std::string> promise;
+    auto future = promise.get_future();
+    auto handle = fs.read_async(inode, st.st_size, 0, [&](read_result&& res) {
+      std::string data;
+      if (res) {
+        for (auto const& br : res.value()) {
+          data.append(reinterpret_cast<char const*>(br.data()), br.size());
+        }
+      }
+      promise.set_value(std::move(data));
+    });
+    EXPECT_EQ(future.get(), test::loremipsum(st.st_size));
+    EXPECT_TRUE(handle.done());
+    EXPECT_FALSE(handle.cancel());
+
+    auto results = fs.read_batch({{static_cast<uint32_t>(inode), 100, 0},
+                                  {static_cast<uint32_t>(inode), 50, 1000},
+                                  {static_cast<uint32_t>(inode), 10, 1 << 20}});
+    ASSERT_EQ(3, results.size());
+    for (auto const& r : results) {
+      ASSERT_TRUE(r);
+    }
+    auto to_string = [](std::vector<block_range> const& ranges) {
+      std::string data;
+      for (auto const& br : ranges) {
+        data.append(reinterpret_cast<char const*>(br.data()), br.size());
+      }
+      return data;
+    };
+    auto const expected = test::loremipsum(st.st_size);
+    EXPECT_EQ(to_string(results[0].value()), expected.substr(0, 100));
+    EXPECT_EQ(to_string(results[1].value()), expected.substr(1000, 50));
+    EXPECT_TRUE(results[2].value().empty());
+  }
+
   entry = fs.find("/somelink");
 
   ASSERT_TRUE(entry);
@@ -292,6 +421,16 @@ void basic_end_to_end_test(std::string const& compressor,
 
   EXPECT_EQ(expected, names);
 
+  std::vector<std::string> batch_names;
+  fs.readdir(*dir, 1, [&](size_t off, inode_view, std::string_view name) {
+    EXPECT_EQ(batch_names.size() + 1, off);
+    batch_names.emplace_back(name);
+    return true;
+  });
+
+  EXPECT_EQ(std::vector<std::string>(expected.begin() + 1, expected.end()),
+            batch_names);
+
   entry = fs.find("/foo.pl");
   ASSERT_TRUE(entry);
 
@@ -382,9 +521,12 @@ std::vector<std::string> const compressions{"null",
 #endif
 #ifdef DWARFS_HAVE_LIBZSTD
                                             "zstd:level=1",
+                                            "zstd:level=1:frame_bits=12",
+                                            "zstd:level=1:mt",
 #endif
 #ifdef DWARFS_HAVE_LIBLZMA
-                                            "lzma:level=1"
+                                            "lzma:level=1",
+                                            "lzma:level=1:block_bits=16"
 #endif
 };
 
@@ -398,9 +540,9 @@ class scanner_test : public testing::TestWithParam<
                          std::tuple<bool, bool, bool, bool, bool, bool, bool>> {
 };
 
-class packing_test : public testing::TestWithParam<
-                         std::tuple<bool, bool, bool, bool, bool, bool, bool>> {
-};
+class packing_test
+    : public testing::TestWithParam<
+          std::tuple<bool, bool, bool, bool, bool, bool, bool, bool>> {};
 
 class plain_tables_test
     : public testing::TestWithParam<std::tuple<bool, bool>> {};
@@ -415,7 +557,7 @@ TEST_P(compression_test, end_to_end) {
 
   basic_end_to_end_test(compressor, block_size_bits, file_order, true, true,
                         false, false, false, false, false, true, true, true,
-                        true, true, true, true, false, false);
+                        true, true, true, true, false, false, true);
 }
 
 TEST_P(scanner_test, end_to_end) {
@@ -425,18 +567,19 @@ TEST_P(scanner_test, end_to_end) {
   basic_end_to_end_test(compressions[0], 15, file_order_mode::NONE,
                         with_devices, with_specials, set_uid, set_gid, set_time,
                         keep_all_times, enable_nlink, true, true, true, true,
-                        true, true, true, false, false);
+                        true, true, true, false, false, true);
 }
 
 TEST_P(packing_test, end_to_end) {
   auto [pack_chunk_table, pack_directories, pack_shared_files_table, pack_names,
-        pack_names_index, pack_symlinks, pack_symlinks_index] = GetParam();
+        pack_names_index, pack_symlinks, pack_symlinks_index, lazy_tables] =
+      GetParam();
 
   basic_end_to_end_test(compressions[0], 15, file_order_mode::NONE, true, true,
                         false, false, false, false, false, pack_chunk_table,
                         pack_directories, pack_shared_files_table, pack_names,
                         pack_names_index, pack_symlinks, pack_symlinks_index,
-                        false, false);
+                        false, false, lazy_tables);
 }
 
 TEST_P(plain_tables_test, end_to_end) {
@@ -450,7 +593,8 @@ TEST_P(plain_tables_test, end_to_end) {
 
 TEST_P(packing_test, regression_empty_fs) {
   auto [pack_chunk_table, pack_directories, pack_shared_files_table, pack_names,
-        pack_names_index, pack_symlinks, pack_symlinks_index] = GetParam();
+        pack_names_index, pack_symlinks, pack_symlinks_index, lazy_tables] =
+      GetParam();
 
   block_manager::config cfg;
   scanner_options options;
@@ -481,6 +625,7 @@ TEST_P(packing_test, regression_empty_fs) {
   filesystem_options opts;
   opts.block_cache.max_bytes = 1 << 20;
   opts.metadata.check_consistency = true;
+  opts.metadata.lazy_tables = lazy_tables;
 
   filesystem_v2 fs(lgr, mm, opts);
 
@@ -520,12 +665,98 @@ INSTANTIATE_TEST_SUITE_P(
     dwarfs, packing_test,
     ::testing::Combine(::testing::Bool(), ::testing::Bool(), ::testing::Bool(),
                        ::testing::Bool(), ::testing::Bool(), ::testing::Bool(),
-                       ::testing::Bool()));
+                       ::testing::Bool(), ::testing::Bool()));
 
 INSTANTIATE_TEST_SUITE_P(dwarfs, plain_tables_test,
                          ::testing::Combine(::testing::Bool(),
                                             ::testing::Bool()));
 
+TEST(filesystem_v2, find_with_dir_hash_index) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  // Find two names whose hashes collide in the 32 bits stored in the
+  // index; this must match the hash used by dir_hash_index
+  auto hash32 = [](std::string const& s) {
+    return static_cast<uint32_t>(std::hash<std::string_view>{}(s));
+  };
+
+  std::optional<std::pair<std::string, std::string>> collision;
+  std::unordered_map<uint32_t, std::string> seen;
+
+  for (size_t i = 0; i < (1 << 20) && !collision; ++i) {
+    auto name = "f" + std::to_string(i);
+    auto [it, inserted] = seen.emplace(hash32(name), name);
+    if (!inserted) {
+      collision.emplace(it->second, name);
+    }
+  }
+
+  seen.clear();
+
+  if (!collision) {
+    GTEST_SKIP() << "no hash collision found";
+  }
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_dir("dir");
+
+  std::vector<std::string> names;
+  for (int i = 0; i < 200; ++i) {
+    names.push_back("file" + std::to_string(i));
+  }
+  names.push_back(collision->first);
+
+  for (auto const& name : names) {
+    input->add_file("dir/" + name, name);
+  }
+
+  // a second directory that has both names
+  input->add_dir("both");
+  input->add_file("both/" + collision->first, collision->first);
+  input->add_file("both/" + collision->second, collision->second);
+
+  auto image = build_dwarfs(lgr, input, "null");
+
+  for (size_t threshold : {0, 2, 16}) {
+    filesystem_options opts;
+    opts.metadata.dir_hash_threshold = threshold;
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(image), opts);
+
+    auto dir = fs.find("/dir");
+    ASSERT_TRUE(dir);
+
+    for (auto const& name : names) {
+      auto entry = fs.find(dir->inode_num(), name.c_str());
+      ASSERT_TRUE(entry) << name << ", threshold " << threshold;
+      struct ::stat st;
+      ASSERT_EQ(0, fs.getattr(*entry, &st));
+      EXPECT_EQ(name.size(), st.st_size) << name;
+      EXPECT_EQ(entry->inode_num(),
+                fs.find(("/dir/" + name).c_str())->inode_num());
+    }
+
+    // missing names, including one that has the same hash as an entry
+    for (auto name : {"", "file", "file200", "file19x", "zzz"}) {
+      EXPECT_FALSE(fs.find(dir->inode_num(), name)) << name;
+    }
+    EXPECT_FALSE(fs.find(dir->inode_num(), collision->second.c_str()))
+        << threshold;
+    EXPECT_FALSE(fs.find(("/dir/" + collision->second).c_str()));
+
+    // both entries with the same hash are found
+    auto both = fs.find("/both");
+    ASSERT_TRUE(both);
+    auto a = fs.find(both->inode_num(), collision->first.c_str());
+    auto b = fs.find(both->inode_num(), collision->second.c_str());
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+    EXPECT_NE(a->inode_num(), b->inode_num());
+    EXPECT_FALSE(fs.find(both->inode_num(), "f"));
+  }
+}
+
 TEST(block_manager, regression_block_boundary) {
   block_manager::config cfg;
 
@@ -568,22 +799,147 @@ TEST(block_manager, regression_block_boundary) {
       << folly::join(", ", fs_sizes);
 }
 
-class compression_regression : public testing::TestWithParam<std::string> {};
+TEST(block_manager, sparse_files) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 10;
+  cfg.block_size_bits = 15;
+  cfg.detect_holes = true;
 
-TEST_P(compression_regression, github45) {
-  auto compressor = GetParam();
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.metadata.check_consistency = true;
 
-  block_manager::config cfg;
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
 
-  constexpr size_t block_size_bits = 18;
-  constexpr size_t file_size = 1 << block_size_bits;
+  // the mock treats all-zero pages as holes
+  auto contents = test::loremipsum(8192) + std::string(65536, '\0') +
+                  test::loremipsum(5000) + std::string(20000, '\0');
 
-  cfg.blockhash_window_size = 0;
-  cfg.block_size_bits = block_size_bits;
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("sparse", contents);
+
+  auto image = build_dwarfs(lgr, input, "null", cfg);
+
+  // images that may contain holes must be rejected by older readers
+  EXPECT_EQ(MINOR_VERSION, static_cast<uint8_t>(image[7]));
+
+  auto mm = std::make_shared<test::mmap_mock>(std::move(image));
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/sparse");
+  ASSERT_TRUE(entry);
+
+  auto inode = fs.open(*entry);
+  auto chunks = fs.get_chunks(inode);
+  ASSERT_TRUE(chunks);
+  EXPECT_EQ(2, std::count_if(chunks->begin(), chunks->end(), [](auto c) {
+              return c.block() == HOLE_BLOCK;
+            }));
+
+  std::vector<char> buf(contents.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(contents, std::string(buf.begin(), buf.end()));
+
+  EXPECT_EQ(0, fs.seek(inode, 0, SEEK_DATA));
+  EXPECT_EQ(8192, fs.seek(inode, 0, SEEK_HOLE));
+  EXPECT_EQ(73728, fs.seek(inode, 8192, SEEK_DATA));
+  EXPECT_EQ(81920, fs.seek(inode, 73728, SEEK_HOLE));
+  EXPECT_EQ(-ENXIO, fs.seek(inode, 81920, SEEK_DATA));
+  EXPECT_EQ(-ENXIO, fs.seek(inode, contents.size(), SEEK_HOLE));
+}
+
+TEST(block_manager, content_defined_chunking) {
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint8_t>
+      rng;
+
+  auto random = [&](size_t size) {
+    std::string s(size, '\0');
+    std::generate(begin(s), end(s), std::ref(rng));
+    return s;
+  };
+
+  // "b" repeats most of "a" at an offset that isn't aligned to anything
+  auto a = random(200000);
+  auto b = random(3333) + a.substr(5000, 150000) + random(7777);
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("a", a);
+  input->add_file("b", b);
+
+  scanner_options options;
+  options.file_order.mode = file_order_mode::PATH;
+
+  auto build = [&](unsigned cdc_chunk_bits) {
+    block_manager::config cfg;
+    cfg.blockhash_window_size = 0;
+    cfg.block_size_bits = 16;
+    cfg.cdc_chunk_bits = cdc_chunk_bits;
+
+    worker_group wg("worker", 4);
+    scanner s(lgr, wg, cfg, entry_factory::create(), input,
+              std::make_shared<test::script_mock>(), options);
+
+    std::ostringstream oss;
+    progress prog([](const progress&, bool) {}, 1000);
+    block_compressor bc("null");
+    filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+    s.scan(fsw, "", prog);
+
+    return std::pair{oss.str(), prog.get_segmenter_stats()};
+  };
+
+  auto [plain, plain_stats] = build(0);
+  auto [cdc, cdc_stats] = build(10);
+
+  EXPECT_EQ(0, plain_stats.cdc_chunks);
+  EXPECT_EQ(0, plain_stats.cdc_matches);
+
+  // with an average chunk size of 1 KiB, almost all of the repeated
+  // data is found again
+  EXPECT_GT(cdc_stats.cdc_chunks, 200);
+  EXPECT_GT(cdc_stats.cdc_matches, 100);
+  EXPECT_LT(cdc_stats.cdc_matches, cdc_stats.cdc_chunks);
+  EXPECT_LT(cdc.size() + 120000, plain.size());
 
   filesystem_options opts;
-  opts.block_cache.max_bytes = 1 << 20;
   opts.metadata.check_consistency = true;
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(cdc), opts);
+
+  std::map<std::string, std::string> expected{{"", ""}, {"a", a}, {"b", b}};
+  EXPECT_EQ(expected, image_contents(fs));
+
+  // the chunks of "b" mostly point back into the data of "a"
+  auto entry = fs.find("/b");
+  ASSERT_TRUE(entry);
+  auto chunks = fs.get_chunks(fs.open(*entry));
+  ASSERT_TRUE(chunks);
+
+  size_t total = 0;
+  for (auto const& c : *chunks) {
+    total += c.size();
+  }
+
+  EXPECT_EQ(b.size(), total);
+  EXPECT_GT(std::distance(chunks->begin(), chunks->end()), 2);
+}
+
+TEST(scanner, coalesce_chunks) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 10;
+  cfg.block_size_bits = 16;
+
+  scanner_options options;
+  options.file_order.mode = file_order_mode::PATH;
 
   std::ostringstream logss;
   stream_logger lgr(logss); // TODO: mock
@@ -594,67 +950,3057 @@ TEST_P(compression_regression, github45) {
       rng;
 
   std::string random;
-  random.resize(file_size);
+  random.resize(30000);
   std::generate(begin(random), end(random), std::ref(rng));
 
+  // the start of "b" matches the end of "a", and the rest of "b" is
+  // new data that is stored right after the data of "a"
+  auto a = random.substr(0, 20000);
+  auto b = random.substr(4000);
+
   auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("a", a);
+  input->add_file("b", b);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg, options));
+
+  filesystem_options opts;
+  opts.metadata.check_consistency = true;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/b");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  auto chunks = fs.get_chunks(inode);
+  ASSERT_TRUE(chunks);
+  EXPECT_EQ(1, std::distance(chunks->begin(), chunks->end()));
+
+  std::vector<char> buf(b.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(b, std::string(buf.begin(), buf.end()));
+}
+
+TEST(scanner, order_fragments) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 10;
+  cfg.block_size_bits = 12;
+
+  scanner_options options;
+  options.file_order.mode = file_order_mode::NILSIMSA;
+  options.inode.with_nilsimsa = true;
+  options.inode.fragment_size = 16384;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  std::map<std::string, std::string> contents{
+      {"large1", test::loremipsum(100000)},
+      {"large2", test::loremipsum(50000) + test::loremipsum(70000)},
+      {"small", test::loremipsum(3000)},
+  };
 
+  auto input = std::make_shared<test::os_access_mock>();
   input->add_dir("");
-  input->add_file("random", random);
-  input->add_file("test", file_size);
+  for (auto const& [name, data] : contents) {
+    input->add_file(name, data);
+  }
 
-  auto fsdata = build_dwarfs(lgr, input, compressor, cfg);
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg, options));
 
-  auto mm = std::make_shared<test::mmap_mock>(fsdata);
+  filesystem_options opts;
+  opts.metadata.check_consistency = true;
+  filesystem_v2 fs(lgr, mm, opts);
 
-  std::stringstream idss;
-  filesystem_v2::identify(lgr, mm, idss, 3);
+  for (auto const& [name, data] : contents) {
+    auto entry = fs.find(("/" + name).c_str());
+    ASSERT_TRUE(entry) << name;
+    auto inode = fs.open(*entry);
+    std::vector<char> buf(data.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0)) << name;
+    EXPECT_EQ(data, std::string(buf.begin(), buf.end())) << name;
+  }
+}
 
-  std::string line;
-  std::regex const re("^SECTION num=\\d+, type=BLOCK, compression=(\\w+).*");
-  std::set<std::string> compressions;
-  while (std::getline(idss, line)) {
-    std::smatch m;
-    if (std::regex_match(line, m, re)) {
-      compressions.emplace(m[1]);
-    }
+TEST(block_cache, shared_between_images) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  block_cache_options cache_opts;
+  cache_opts.max_bytes = 1 << 20;
+
+  filesystem_options opts;
+  opts.shared_block_cache =
+      std::make_shared<block_cache>(lgr, nullptr, cache_opts);
+
+  std::vector<std::string> contents;
+  std::vector<std::unique_ptr<filesystem_v2>> images;
+
+  for (size_t i = 0; i < 3; ++i) {
+    contents.push_back(test::loremipsum(10000 + 3000 * i).substr(i));
+
+    auto input = std::make_shared<test::os_access_mock>();
+    input->add_dir("");
+    input->add_file("file", contents.back());
+
+    auto mm = std::make_shared<test::mmap_mock>(
+        build_dwarfs(lgr, input, "null", cfg));
+
+    images.push_back(std::make_unique<filesystem_v2>(lgr, mm, opts));
   }
 
-  if (compressor == "null") {
-    EXPECT_EQ(1, compressions.size());
-  } else {
-    EXPECT_EQ(2, compressions.size());
+  // each image has at least 3 blocks of its own
+  EXPECT_GE(opts.shared_block_cache->block_count(), 9);
+
+  for (size_t i = 0; i < images.size(); ++i) {
+    auto& fs = *images[i];
+    auto entry = fs.find("/file");
+    ASSERT_TRUE(entry);
+
+    auto inode = fs.open(*entry);
+    std::vector<char> buf(contents[i].size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(contents[i], std::string(buf.begin(), buf.end()));
   }
-  EXPECT_EQ(1, compressions.count("NONE"));
 
-  filesystem_v2 fs(lgr, mm, opts);
+  // all images are served from the same cache
+  auto stats = opts.shared_block_cache->stats();
+  EXPECT_GT(stats.range_requests, 0);
+  EXPECT_EQ(stats.range_requests, images[0]->cache_stats().range_requests);
+  EXPECT_EQ(stats.range_requests, images[2]->cache_stats().range_requests);
 
-  struct ::statvfs vfsbuf;
-  fs.statvfs(&vfsbuf);
+  // no more images can be added once the cache is in use
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", contents.front());
 
-  EXPECT_EQ(3, vfsbuf.f_files);
-  EXPECT_EQ(2 * file_size, vfsbuf.f_blocks);
+  auto mm =
+      std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null", cfg));
 
-  auto check_file = [&](char const* name, std::string const& contents) {
-    auto entry = fs.find(name);
-    struct ::stat st;
+  EXPECT_THROW(filesystem_v2 fs(lgr, mm, opts), runtime_error);
+}
+
+TEST(block_cache, shards) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
 
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  // 0 shards are treated like a single shard
+  for (size_t shards : {0, 1, 4}) {
+    filesystem_options opts;
+    opts.block_cache.max_bytes = 8 << 12;
+    opts.block_cache.num_shards = shards;
+    filesystem_v2 fs(lgr, mm, opts);
+
+    auto entry = fs.find("/file");
     ASSERT_TRUE(entry);
-    EXPECT_EQ(fs.getattr(*entry, &st), 0);
-    EXPECT_EQ(st.st_size, file_size);
+    auto inode = fs.open(*entry);
+
+    auto read_block = [&](size_t block) {
+      auto offset = block << 12;
+      auto size = std::min<size_t>(1 << 12, data.size() - offset);
+      std::vector<char> buf(size);
+      EXPECT_EQ(size, fs.read(inode, buf.data(), size, offset));
+      EXPECT_EQ(data.substr(offset, size),
+                std::string(buf.begin(), buf.end()));
+    };
+
+    // one block at a time, so the blocks of each shard are evicted
+    // in a predictable order
+    for (size_t i = 0; i < 10; ++i) {
+      read_block(i);
+      while (fs.cache_stats().cached_blocks < std::min<size_t>(i + 1, 8) ||
+             fs.cache_stats().blocks_evicted + 8 < i + 1) {
+        std::this_thread::yield();
+      }
+    }
 
-    int inode = fs.open(*entry);
-    EXPECT_GE(inode, 0);
+    auto stats = fs.cache_stats();
+    EXPECT_EQ(10, stats.blocks_created) << shards;
+    EXPECT_EQ(2, stats.blocks_evicted) << shards;
+    EXPECT_EQ(8, stats.cached_blocks) << shards;
+    EXPECT_EQ(data.size() - (2 << 12), stats.cached_bytes) << shards;
 
-    std::vector<char> buf(st.st_size);
-    ssize_t rv = fs.read(inode, &buf[0], st.st_size, 0);
-    EXPECT_EQ(rv, st.st_size);
-    EXPECT_EQ(std::string(buf.begin(), buf.end()), contents);
-  };
+    // with 8 blocks split evenly across shards, each of them has lost
+    // its oldest blocks, which are the first two overall
+    for (size_t i = 2; i < 10; ++i) {
+      read_block(i);
+    }
 
-  check_file("random", random);
-  check_file("test", test::loremipsum(file_size));
+    auto hits = fs.cache_stats();
+    EXPECT_EQ(stats.blocks_created, hits.blocks_created) << shards;
+    EXPECT_EQ(8, hits.cache_hits_fast + hits.cache_hits_slow -
+                     stats.cache_hits_fast - stats.cache_hits_slow)
+        << shards;
+
+    read_block(0);
+    EXPECT_EQ(stats.blocks_created + 1, fs.cache_stats().blocks_created)
+        << shards;
+  }
 }
 
-INSTANTIATE_TEST_SUITE_P(dwarfs, compression_regression,
-                         ::testing::ValuesIn(compressions));
+TEST(block_cache, resize) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  auto read_all = [&] {
+    std::vector<char> buf(data.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+  };
+
+  read_all();
+  EXPECT_GE(fs.cache_stats().cached_blocks, 9);
+
+  fs.set_cache_size(2 << 12);
+
+  auto stats = fs.cache_stats();
+  EXPECT_EQ(2 << 12, stats.max_bytes);
+  EXPECT_LE(stats.cached_blocks, 2);
+  EXPECT_GE(stats.blocks_evicted, 7);
+
+  read_all();
+  EXPECT_LE(fs.cache_stats().cached_blocks, 2);
+
+  fs.set_cache_size(1 << 20);
+  read_all();
+  EXPECT_GE(fs.cache_stats().cached_blocks, 9);
+}
+
+TEST(block_cache, segmented_lru_scan_resistance) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  for (auto policy : {cache_policy::LRU, cache_policy::SEGMENTED_LRU}) {
+    filesystem_options opts;
+    opts.block_cache.max_bytes = 5 << 12;
+    opts.block_cache.policy = policy;
+    filesystem_v2 fs(lgr, mm, opts);
+
+    auto entry = fs.find("/file");
+    ASSERT_TRUE(entry);
+    auto inode = fs.open(*entry);
+
+    auto read = [&](size_t offset, size_t size) {
+      std::vector<char> buf(size);
+      EXPECT_EQ(size, fs.read(inode, buf.data(), size, offset));
+      EXPECT_EQ(data.substr(offset, size),
+                std::string(buf.begin(), buf.end()));
+    };
+
+    auto wait_cached = [&](size_t blocks) {
+      while (fs.cache_stats().cached_blocks < blocks) {
+        std::this_thread::yield();
+      }
+    };
+
+    // the first block is hot...
+    read(0, 100);
+    wait_cached(1);
+    read(0, 100);
+
+    // ...until a sequential scan over all other blocks, which are more
+    // than fit into the cache, comes along
+    read(1 << 12, data.size() - (1 << 12));
+    wait_cached(2);
+
+    auto stats = fs.cache_stats();
+    EXPECT_GT(stats.blocks_evicted, 0);
+
+    read(0, 100);
+
+    if (policy == cache_policy::SEGMENTED_LRU) {
+      EXPECT_EQ(stats.blocks_created, fs.cache_stats().blocks_created);
+    } else {
+      EXPECT_EQ(stats.blocks_created + 1, fs.cache_stats().blocks_created);
+    }
+  }
+}
+
+TEST(block_cache, resize_keeps_segmented_lru) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 5 << 12;
+  opts.block_cache.policy = cache_policy::SEGMENTED_LRU;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  // too small for a protected segment
+  fs.set_cache_size(1 << 12);
+  fs.set_cache_size(5 << 12);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  auto read = [&](size_t offset, size_t size) {
+    std::vector<char> buf(size);
+    EXPECT_EQ(size, fs.read(inode, buf.data(), size, offset));
+    EXPECT_EQ(data.substr(offset, size), std::string(buf.begin(), buf.end()));
+  };
+
+  auto wait_cached = [&](size_t blocks) {
+    while (fs.cache_stats().cached_blocks < blocks) {
+      std::this_thread::yield();
+    }
+  };
+
+  // the second read of the first block moves it to the protected segment
+  read(0, 100);
+  wait_cached(1);
+  read(0, 100);
+
+  // so scanning all other blocks doesn't evict it
+  read(1 << 12, data.size() - (1 << 12));
+  wait_cached(2);
+
+  auto created = fs.cache_stats().blocks_created;
+  read(0, 100);
+  EXPECT_EQ(created, fs.cache_stats().blocks_created);
+}
+
+TEST(block_cache, cost_policy) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 3 << 12;
+  opts.block_cache.policy = cache_policy::COST;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  for (int i = 0; i < 2; ++i) {
+    std::vector<char> buf(data.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+  }
+
+  auto stats = fs.cache_stats();
+  EXPECT_LE(stats.cached_blocks, 3);
+  EXPECT_GE(stats.blocks_evicted, 7);
+}
+
+#ifdef DWARFS_HAVE_LIBLZMA
+TEST(block_cache, cost_policy_keeps_expensive_blocks) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint8_t>
+      rng;
+
+  std::string random;
+  random.resize(6 << 12);
+  std::generate(begin(random), end(random), std::ref(rng));
+
+  // The text ends up in an LZMA compressed block, the random data
+  // can't be compressed and is stored in cheap uncompressed blocks.
+  auto text = test::loremipsum(1 << 12);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("a", text);
+  input->add_file("b", random);
+
+  scanner_options sopts;
+  sopts.file_order.mode = file_order_mode::PATH;
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "lzma:level=9", cfg, sopts));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 3 << 12;
+  opts.block_cache.policy = cache_policy::COST;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto read = [&](char const* path, std::string const& expected) {
+    auto entry = fs.find(path);
+    ASSERT_TRUE(entry);
+    auto inode = fs.open(*entry);
+    std::vector<char> buf(expected.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(expected, std::string(buf.begin(), buf.end()));
+  };
+
+  read("/a", text);
+
+  while (fs.cache_stats().cached_blocks < 1) {
+    std::this_thread::yield();
+  }
+
+  read("/b", random);
+
+  auto stats = fs.cache_stats();
+  EXPECT_GE(stats.blocks_evicted, 3);
+
+  // the expensive block outlives all of the cheap ones
+  read("/a", text);
+  EXPECT_EQ(stats.blocks_created, fs.cache_stats().blocks_created);
+}
+#endif
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(block_cache, cost_policy_concurrent_reprioritise) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 14;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(1 << 17);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  // seekable blocks are decompressed frame by frame, so their cost
+  // keeps changing while other readers hit them in the cache
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "zstd:level=1:frame_bits=10", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 3 << 14;
+  opts.block_cache.num_workers = 4;
+  opts.block_cache.policy = cache_policy::COST;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  std::atomic<bool> done{false};
+  std::atomic<size_t> mismatches{0};
+  std::vector<std::thread> readers;
+
+  for (unsigned seed = 0; seed < 4; ++seed) {
+    readers.emplace_back([&, seed] {
+      std::mt19937_64 rng(seed);
+      std::uniform_int_distribution<size_t> dist(0, data.size() - 512);
+      std::vector<char> buf(512);
+      for (int i = 0; i < 500; ++i) {
+        auto offset = dist(rng);
+        auto rv = fs.read(inode, buf.data(), buf.size(), offset);
+        if (rv != static_cast<ssize_t>(buf.size()) ||
+            data.compare(offset, buf.size(), buf.data(), buf.size()) != 0) {
+          ++mismatches;
+        }
+      }
+    });
+  }
+
+  std::thread observer([&] {
+    while (!done) {
+      auto st = fs.cache_stats();
+      EXPECT_LE(st.cached_bytes, 1 << 17);
+      std::this_thread::yield();
+    }
+  });
+
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  done = true;
+  observer.join();
+
+  EXPECT_EQ(0, mismatches);
+
+  auto stats = fs.cache_stats();
+  EXPECT_LE(stats.cached_blocks, 3);
+  EXPECT_GT(stats.blocks_evicted, 0);
+}
+#endif
+
+TEST(block_cache, access_pattern) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 20;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(3 << 20);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 4 << 20;
+  opts.block_cache.decompress_ratio = 0.5;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  // returns the number of bytes decompressed by the read
+  auto read = [&](size_t offset) {
+    auto before = fs.cache_stats().bytes_decompressed;
+    std::vector<char> buf(8 << 10);
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), offset));
+    EXPECT_EQ(data.substr(offset, buf.size()),
+              std::string(buf.begin(), buf.end()));
+    return fs.cache_stats().bytes_decompressed - before;
+  };
+
+  // The third of a series of sequential reads decompresses the
+  // whole block
+  read(0);
+  EXPECT_LT(read(8 << 10), 1 << 19);
+  read(16 << 10);
+  EXPECT_EQ(1 << 20, fs.cache_stats().bytes_decompressed);
+
+  // A block read randomly is never fully decompressed, not even once
+  // more than decompress_ratio of it has been decompressed
+  size_t const base = 1 << 20;
+  read(base + (200 << 10));
+  read(base + (400 << 10));
+  read(base + (700 << 10));
+  auto random_bytes = fs.cache_stats().bytes_decompressed - (1 << 20);
+  EXPECT_GE(random_bytes, 708 << 10);
+  EXPECT_LT(random_bytes, 1 << 20);
+}
+
+TEST(block_cache, inline_decompression) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.inline_max_bytes = 1 << 12;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  std::vector<char> buf(data.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+
+  auto stats = fs.cache_stats();
+  EXPECT_GE(stats.inline_jobs, 10);
+  EXPECT_EQ(stats.blocks_created, stats.inline_jobs);
+}
+
+TEST(block_cache, no_inline_decompression) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+  input->add_file("file2", test::loremipsum(20000));
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  // enough workers that they are never all busy
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.num_workers = 16;
+  opts.block_cache.inline_max_bytes = 1 << 11;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  // uncompressed blocks larger than the limit use the workers
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  std::vector<char> buf(data.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+  EXPECT_EQ(0, fs.cache_stats().inline_jobs);
+
+  // asynchronous reads never decompress on the calling thread
+  opts.block_cache.inline_max_bytes = 1 << 20;
+  filesystem_v2 fs2(lgr, mm, opts);
+
+  entry = fs2.find("/file2");
+  ASSERT_TRUE(entry);
+  inode = fs2.open(*entry);
+
+  std::promise<size_t> promise;
+  auto future = promise.get_future();
+  auto handle = fs2.read_async(inode, 20000, 0, [&](read_result&& res) {
+    size_t size = 0;
+    if (res) {
+      for (auto const& br : res.value()) {
+        size += br.size();
+      }
+    }
+    promise.set_value(size);
+  });
+  EXPECT_EQ(20000, future.get());
+  EXPECT_EQ(0, fs2.cache_stats().inline_jobs);
+}
+
+TEST(block_cache, io_workers) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.io_workers = 2;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  std::vector<char> buf(data.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+}
+
+TEST(block_cache, access_counts_ignore_readahead) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.record_access = true;
+  opts.inode_reader.readahead = 4 << 12;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  // only the first block is read, the next ones are read ahead
+  std::vector<char> buf(100);
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+
+  auto counts = fs.block_access_counts();
+  ASSERT_GE(counts.size(), 5);
+  EXPECT_EQ(1, counts[0]);
+  for (size_t i = 1; i < counts.size(); ++i) {
+    EXPECT_EQ(0, counts[i]) << i;
+  }
+}
+
+TEST(block_cache, readahead_only_for_sequential_reads) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(80000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.record_access = true;
+  opts.inode_reader.readahead = 4 << 12;
+
+  // Every block lookup counts as a range request, but only demand
+  // requests are recorded as accesses, so the difference is the
+  // number of readahead requests.
+  auto readahead_requests = [](filesystem_v2 const& fs) {
+    size_t demand = 0;
+    for (auto c : fs.block_access_counts()) {
+      demand += c;
+    }
+    return fs.cache_stats().range_requests - demand;
+  };
+
+  auto read = [&](filesystem_v2 const& fs, uint32_t inode, size_t offset,
+                  size_t size) {
+    std::vector<char> buf(size);
+    EXPECT_EQ(size, fs.read(inode, buf.data(), size, offset));
+    EXPECT_EQ(data.substr(offset, size), std::string(buf.begin(), buf.end()));
+  };
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    auto entry = fs.find("/file");
+    ASSERT_TRUE(entry);
+    auto inode = fs.open(*entry);
+
+    read(fs, inode, 0, 1000);
+    auto first = readahead_requests(fs);
+    EXPECT_GT(first, 0);
+
+    // keeps reading ahead as the reader moves forward
+    for (size_t offset = 1000; offset < 40000; offset += 1000) {
+      read(fs, inode, offset, 1000);
+    }
+    EXPECT_GT(readahead_requests(fs), first);
+  }
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    auto entry = fs.find("/file");
+    ASSERT_TRUE(entry);
+    auto inode = fs.open(*entry);
+
+    for (size_t offset : {50000, 10000, 70000, 30000, 20000, 60000}) {
+      read(fs, inode, offset, 1000);
+    }
+    EXPECT_EQ(0, readahead_requests(fs));
+  }
+}
+
+namespace {
+
+class direct_read_mock : public test::mmap_mock {
+ public:
+  using test::mmap_mock::mmap_mock;
+
+  bool read_uncached(void* buf, off_t offset, size_t size) override {
+    EXPECT_LE(static_cast<size_t>(offset) + size, this->size());
+    std::memcpy(buf, as<uint8_t>(offset), size);
+    ++reads;
+    return true;
+  }
+
+  std::atomic<size_t> reads{0};
+};
+
+// Block loads wait until the gate is opened, which keeps reads pending
+class gated_read_mock : public direct_read_mock {
+ public:
+  using direct_read_mock::direct_read_mock;
+
+  bool read_uncached(void* buf, off_t offset, size_t size) override {
+    gate_.wait();
+    return direct_read_mock::read_uncached(buf, offset, size);
+  }
+
+  void open_gate() {
+    std::call_once(once_, [this] { promise_.set_value(); });
+  }
+
+ private:
+  std::once_flag once_;
+  std::promise<void> promise_;
+  std::shared_future<void> gate_{promise_.get_future().share()};
+};
+
+} // namespace
+
+TEST(block_cache, direct_read) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm =
+      std::make_shared<direct_read_mock>(build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.direct_read = true;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/file");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+
+  std::vector<char> buf(data.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+
+  auto stats = fs.cache_stats();
+  EXPECT_GT(stats.blocks_created, 0);
+  EXPECT_EQ(stats.blocks_created, stats.direct_reads);
+  EXPECT_EQ(stats.direct_reads, mm->reads.load());
+}
+
+TEST(filesystem_v2, cancel_read) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+  auto const block_size = size_t(1) << cfg.block_size_bits;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+  input->add_file("file2", test::loremipsum(20000));
+
+  auto mm =
+      std::make_shared<gated_read_mock>(build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.direct_read = true;
+
+  // must outlive the filesystem, which is where late results would
+  // show up if they weren't dropped
+  std::atomic<int> calls{0};
+  std::atomic<int> batch_calls{0};
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    SCOPE_EXIT { mm->open_gate(); };
+
+    auto entry = fs.find("/file");
+    ASSERT_TRUE(entry);
+    auto const inode = static_cast<uint32_t>(fs.open(*entry));
+    entry = fs.find("/file2");
+    ASSERT_TRUE(entry);
+    auto const inode2 = static_cast<uint32_t>(fs.open(*entry));
+
+    auto const offset = block_size / 2;
+    auto const size = 3 * block_size;
+
+    std::promise<read_result> promise;
+    auto future = promise.get_future();
+    auto handle = fs.read_async(inode, size, offset, [&](read_result&& res) {
+      ++calls;
+      promise.set_value(std::move(res));
+    });
+
+    EXPECT_FALSE(handle.done());
+    EXPECT_TRUE(handle.cancel());
+    EXPECT_TRUE(handle.done());
+    EXPECT_FALSE(handle.cancel());
+
+    // the callback is called right away, not once the blocks arrive
+    ASSERT_EQ(std::future_status::ready,
+              future.wait_for(std::chrono::seconds(0)));
+    auto res = future.get();
+    ASSERT_FALSE(res);
+    EXPECT_EQ(-ECANCELED, res.error());
+
+    std::promise<std::vector<read_result>> batch_promise;
+    auto batch_future = batch_promise.get_future();
+    auto batch_handle =
+        fs.read_batch({{inode, 100, 0}, {inode2, 100, 5000}},
+                      [&](std::vector<read_result>&& results) {
+                        ++batch_calls;
+                        batch_promise.set_value(std::move(results));
+                      });
+
+    EXPECT_FALSE(batch_handle.done());
+    EXPECT_TRUE(batch_handle.cancel());
+    EXPECT_TRUE(batch_handle.done());
+
+    ASSERT_EQ(std::future_status::ready,
+              batch_future.wait_for(std::chrono::seconds(0)));
+    auto results = batch_future.get();
+    ASSERT_EQ(2, results.size());
+    for (auto const& r : results) {
+      ASSERT_FALSE(r);
+      EXPECT_EQ(-ECANCELED, r.error());
+    }
+
+    mm->open_gate();
+
+    // cancelled reads don't affect anyone else reading the same blocks
+    std::vector<char> buf(size);
+    EXPECT_EQ(size, fs.read(inode, buf.data(), buf.size(), offset));
+    EXPECT_EQ(data.substr(offset, size), std::string(buf.begin(), buf.end()));
+  }
+
+  EXPECT_EQ(1, calls.load());
+  EXPECT_EQ(1, batch_calls.load());
+}
+
+TEST(block_cache, disk_cache_corrupt_entry) {
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+  auto dir = std::filesystem::path(testing::TempDir()) / "dwarfs_disk_cache";
+
+  std::filesystem::remove_all(dir);
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.block_cache.disk_cache_dir = dir.string();
+
+  auto read_file = [&] {
+    filesystem_v2 fs(lgr, mm, opts);
+    auto entry = fs.find("/file");
+    EXPECT_TRUE(entry);
+    auto inode = fs.open(*entry);
+    std::vector<char> buf(data.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(data, std::string(buf.begin(), buf.end()));
+    // the cache is destroyed with the filesystem, after all pending
+    // writes are done
+    return fs.cache_stats();
+  };
+
+  auto stats = read_file();
+  EXPECT_EQ(0, stats.disk_cache_hits);
+
+  std::vector<std::filesystem::path> entries;
+  for (auto const& e : std::filesystem::directory_iterator(dir)) {
+    entries.push_back(e.path());
+  }
+  ASSERT_EQ(stats.blocks_created, entries.size());
+
+  {
+    std::fstream f(entries.front(),
+                   std::ios::in | std::ios::out | std::ios::binary);
+    char c;
+    f.seekg(100);
+    f.get(c);
+    f.seekp(100);
+    f.put(~c);
+  }
+
+  stats = read_file();
+  EXPECT_EQ(entries.size() - 1, stats.disk_cache_hits);
+  EXPECT_EQ(1, stats.blocks_created);
+  EXPECT_NE(std::string::npos,
+            logss.str().find("removing corrupt disk cache entry"));
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST(block_cache, verify_blocks) {
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  auto data = test::loremipsum(40000);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", data);
+
+  auto image = build_dwarfs(lgr, input, "null", cfg);
+
+  // corrupt the SHA-512/256 hash of the second block, which leaves the
+  // fast XXH3 checksum intact
+  size_t block_offset = 0;
+
+  {
+    test::mmap_mock mm(image);
+    size_t num_blocks = 0;
+
+    for (size_t offset = 0; offset < mm.size();) {
+      fs_section sec(mm, offset, 2);
+      if (sec.type() == section_type::BLOCK && num_blocks++ == 1) {
+        block_offset = offset;
+      }
+      offset = sec.end();
+    }
+  }
+
+  ASSERT_GT(block_offset, 0);
+  image[block_offset + offsetof(section_header_v2, sha2_512_256)] ^= 0xff;
+
+  auto mm = std::make_shared<test::mmap_mock>(image);
+  auto const block_size = size_t(1) << cfg.block_size_bits;
+
+  auto read = [&](filesystem_v2 const& fs, off_t offset, size_t size) {
+    auto entry = fs.find("/file");
+    EXPECT_TRUE(entry);
+    std::vector<char> buf(size);
+    auto rv = fs.read(fs.open(*entry), buf.data(), buf.size(), offset);
+    if (rv == static_cast<ssize_t>(size)) {
+      EXPECT_EQ(data.substr(offset, size), std::string(buf.begin(), buf.end()));
+    }
+    return rv;
+  };
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    EXPECT_EQ(data.size(), read(fs, 0, data.size()));
+  }
+
+  opts.block_cache.verify_blocks = true;
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  EXPECT_EQ(block_size, read(fs, 0, block_size));
+  EXPECT_EQ(block_size, read(fs, 2 * block_size, block_size));
+  EXPECT_EQ(-EIO, read(fs, block_size, block_size));
+  EXPECT_NE(std::string::npos,
+            logss.str().find("integrity check failed for block 1"));
+
+  // the corrupt block isn't cached, so it fails every time
+  EXPECT_EQ(-EIO, read(fs, block_size + 100, 100));
+  EXPECT_EQ(-EIO, read(fs, 0, data.size()));
+  EXPECT_EQ(data.size() - 3 * block_size,
+            read(fs, 3 * block_size, data.size() - 3 * block_size));
+}
+
+class compression_regression : public testing::TestWithParam<std::string> {};
+
+TEST_P(compression_regression, github45) {
+  auto compressor = GetParam();
+
+  block_manager::config cfg;
+
+  constexpr size_t block_size_bits = 18;
+  constexpr size_t file_size = 1 << block_size_bits;
+
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = block_size_bits;
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.metadata.check_consistency = true;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss); // TODO: mock
+  lgr.set_policy<prod_logger_policy>();
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint8_t>
+      rng;
+
+  std::string random;
+  random.resize(file_size);
+  std::generate(begin(random), end(random), std::ref(rng));
+
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add_dir("");
+  input->add_file("random", random);
+  input->add_file("test", file_size);
+
+  auto fsdata = build_dwarfs(lgr, input, compressor, cfg);
+
+  auto mm = std::make_shared<test::mmap_mock>(fsdata);
+
+  std::stringstream idss;
+  filesystem_v2::identify(lgr, mm, idss, 3);
+
+  std::string line;
+  std::regex const re("^SECTION num=\\d+, type=BLOCK, compression=(\\w+).*");
+  std::set<std::string> compressions;
+  while (std::getline(idss, line)) {
+    std::smatch m;
+    if (std::regex_match(line, m, re)) {
+      compressions.emplace(m[1]);
+    }
+  }
+
+  if (compressor == "null") {
+    EXPECT_EQ(1, compressions.size());
+  } else {
+    EXPECT_EQ(2, compressions.size());
+  }
+  EXPECT_EQ(1, compressions.count("NONE"));
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  struct ::statvfs vfsbuf;
+  fs.statvfs(&vfsbuf);
+
+  EXPECT_EQ(3, vfsbuf.f_files);
+  EXPECT_EQ(2 * file_size, vfsbuf.f_blocks);
+
+  auto check_file = [&](char const* name, std::string const& contents) {
+    auto entry = fs.find(name);
+    struct ::stat st;
+
+    ASSERT_TRUE(entry);
+    EXPECT_EQ(fs.getattr(*entry, &st), 0);
+    EXPECT_EQ(st.st_size, file_size);
+
+    int inode = fs.open(*entry);
+    EXPECT_GE(inode, 0);
+
+    std::vector<char> buf(st.st_size);
+    ssize_t rv = fs.read(inode, &buf[0], st.st_size, 0);
+    EXPECT_EQ(rv, st.st_size);
+    EXPECT_EQ(std::string(buf.begin(), buf.end()), contents);
+  };
+
+  check_file("random", random);
+  check_file("test", test::loremipsum(file_size));
+}
+
+INSTANTIATE_TEST_SUITE_P(dwarfs, compression_regression,
+                         ::testing::ValuesIn(compressions));
+
+TEST(pread_file, moving_window) {
+  auto path = std::filesystem::path(testing::TempDir()) / "dwarfs_pread_file";
+
+  // larger than the read-ahead window
+  std::string data;
+  while (data.size() < (80 << 20)) {
+    data += test::loremipsum(1 << 20);
+  }
+
+  {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(data.data(), data.size());
+  }
+
+  pread_file pf(path.string(), data.size(), 1 << 20);
+  constexpr size_t chunk_size = 8 << 20;
+
+  for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+    auto len = std::min(chunk_size, data.size() - offset);
+    EXPECT_EQ(0, std::memcmp(pf.as<char>(offset), data.data() + offset, len))
+        << offset;
+    EXPECT_FALSE(pf.release_until(offset));
+  }
+
+  // released data must still be accessible
+  EXPECT_EQ(0, std::memcmp(pf.addr(), data.data(), chunk_size));
+
+  std::filesystem::remove(path);
+}
+
+TEST(rsync_hash, batch_update) {
+  constexpr size_t window = 64;
+  std::mt19937_64 rng(42);
+  std::vector<uint8_t> data(4096);
+  std::generate(data.begin(), data.end(), rng);
+
+  rsync_hash h1, h2;
+
+  for (size_t i = 0; i < window; ++i) {
+    h1.update(data[i]);
+    h2.update(data[i]);
+  }
+
+  std::vector<uint32_t> hashes(data.size() - window);
+  h2.update(data.data() + window, hashes.size(), hashes.data());
+
+  for (size_t i = window; i < data.size(); ++i) {
+    EXPECT_EQ(h1(), hashes[i - window]) << i;
+    h1.update(data[i - window], data[i]);
+  }
+
+  EXPECT_EQ(h1(), h2());
+}
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(block_compressor, zstd_dictionary) {
+  auto text = test::loremipsum(1 << 20);
+  std::vector<uint8_t> samples;
+  std::vector<size_t> sample_sizes;
+
+  for (size_t offset = 0; offset + 1024 <= text.size(); offset += 2048) {
+    samples.insert(samples.end(), text.begin() + offset,
+                   text.begin() + offset + 1024);
+    sample_sizes.push_back(1024);
+  }
+
+  auto dict = std::make_shared<compression_dictionary>(
+      compression_dictionary::train(samples, sample_sizes, 16 << 10));
+
+  auto bc = block_compressor("zstd:level=3").with_dictionary(dict);
+  std::vector<uint8_t> block(text.begin() + 1000, text.begin() + 5000);
+  auto compressed = bc.compress(block);
+
+  EXPECT_EQ(block, block_decompressor::decompress(compression_type::ZSTD,
+                                                  compressed.data(),
+                                                  compressed.size(),
+                                                  dict.get()));
+  EXPECT_THROW(block_decompressor::decompress(
+                   compression_type::ZSTD, compressed.data(), compressed.size()),
+               runtime_error);
+}
+#endif
+
+TEST(block_compressor, compress_into_pooled_buffer) {
+  auto text = test::loremipsum(1 << 16);
+  std::vector<uint8_t> block(text.begin(), text.end());
+  block_compressor bc("null");
+  buffer_pool pool(1 << 20);
+
+  auto buf = pool.acquire();
+  bc.compress(block, buf);
+  EXPECT_EQ(block, buf);
+
+  auto const* data = buf.data();
+  pool.release(std::move(buf));
+  EXPECT_EQ(1, pool.size());
+
+  buf = pool.acquire();
+  EXPECT_EQ(0, pool.size());
+  EXPECT_TRUE(buf.empty());
+  EXPECT_EQ(data, buf.data());
+
+  bc.compress(block, buf);
+  EXPECT_EQ(block, buf);
+  EXPECT_EQ(data, buf.data());
+}
+
+TEST(string_table, parallel_pack) {
+  string_table::pack_options options(true, true, true);
+  auto serial = string_table::pack(test::test_strings, options);
+  options.num_threads = 4;
+  auto parallel = string_table::pack(test::test_strings, options);
+
+  ASSERT_TRUE(serial.symtab_ref().has_value());
+  ASSERT_TRUE(parallel.symtab_ref().has_value());
+  EXPECT_EQ(*serial.symtab_ref(), *parallel.symtab_ref());
+  EXPECT_EQ(serial.buffer, parallel.buffer);
+  EXPECT_EQ(serial.index, parallel.index);
+}
+
+TEST(scanner, parallel_segmenters_are_deterministic) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 8;
+  cfg.block_size_bits = 10;
+
+  scanner_options options;
+  options.num_segmenters = 4;
+  options.file_order.mode = file_order_mode::PATH;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  for (int i = 0; i < 200; ++i) {
+    input->add_file("file" + std::to_string(i),
+                    test::loremipsum(1000 + 97 * i));
+  }
+
+  std::optional<uint64_t> digest;
+
+  for (int run = 0; run < 5; ++run) {
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                              lgr, input, "null", cfg, options)));
+    if (digest) {
+      EXPECT_EQ(*digest, fs.block_digest()) << run;
+    } else {
+      digest = fs.block_digest();
+    }
+  }
+}
+
+TEST(scanner, parallel_traversal_with_script) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  // drops everything called "skip*" and changes the permissions of the
+  // rest, recording all entries it has been called for
+  class filter_script : public test::script_mock {
+   public:
+    bool filter(entry_interface const& ei) override {
+      filtered.push_back(ei.path());
+      return ei.name().rfind("skip", 0) != 0;
+    }
+
+    void transform(entry_interface& ei) override {
+      ei.set_permissions(ei.get_permissions() & 0750);
+    }
+
+    std::vector<std::string> filtered;
+  };
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+
+  for (int i = 0; i < 4; ++i) {
+    auto top = "dir" + std::to_string(i);
+    input->add_dir(top);
+    input->add_dir(top + "/skipdir");
+    input->add_file(top + "/skipdir/file", 1000);
+    for (int j = 0; j < 3; ++j) {
+      auto sub = top + "/sub" + std::to_string(j);
+      input->add_dir(sub);
+      input->add_file(sub + "/file", test::loremipsum(1000 + 100 * j + i));
+      input->add_file(sub + "/skipfile", 500);
+    }
+  }
+
+  std::vector<std::map<std::string, std::string>> contents;
+  std::vector<std::map<std::string, mode_t>> modes;
+  std::vector<uint64_t> digests;
+  std::vector<std::vector<std::string>> calls;
+
+  for (size_t workers : {0, 4}) {
+    scanner_options options;
+    options.num_scanner_workers = workers;
+    options.file_order.mode = file_order_mode::PATH;
+
+    auto scr = std::make_shared<filter_script>();
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                              lgr, input, "null", cfg, options, nullptr, scr)));
+
+    contents.push_back(image_contents(fs));
+    digests.push_back(fs.block_digest());
+
+    auto& m = modes.emplace_back();
+    fs.walk([&](auto e) { m[e.path()] = e.inode().mode(); });
+
+    calls.push_back(std::move(scr->filtered));
+  }
+
+  EXPECT_EQ(contents[0], contents[1]);
+  EXPECT_EQ(modes[0], modes[1]);
+  EXPECT_EQ(digests[0], digests[1]);
+  EXPECT_EQ(0, contents[0].count("dir0/skipdir"));
+  EXPECT_EQ(0, contents[0].count("dir0/sub0/skipfile"));
+  EXPECT_EQ(1, contents[0].count("dir3/sub2/file"));
+  EXPECT_EQ(S_IFREG | 0640, modes[0]["dir3/sub2/file"]);
+
+  // the script sees the directories in a different order in parallel
+  // mode, but is still called exactly once for each entry
+  EXPECT_EQ(4 + 4 * 4 + 4 * 3 * 2, calls[0].size());
+  std::sort(calls[0].begin(), calls[0].end());
+  std::sort(calls[1].begin(), calls[1].end());
+  EXPECT_EQ(calls[0], calls[1]);
+}
+
+TEST(scanner, categories_are_deterministic) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 8;
+  cfg.block_size_bits = 10;
+
+  scanner_options options;
+  options.categorize = true;
+  options.num_segmenters = 2;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  for (int i = 0; i < 60; ++i) {
+    auto data = test::loremipsum(2000 + 89 * i);
+    switch (i % 3) {
+    case 0:
+      data = "\x1f\x8b" + data;
+      break;
+    case 1:
+      data = std::string("\x7f" "ELF\0", 5) + data;
+      break;
+    }
+    input->add_file("file" + std::to_string(i), data);
+  }
+
+  std::optional<uint64_t> digest;
+
+  for (int run = 0; run < 5; ++run) {
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                              lgr, input, "null", cfg, options)));
+    if (digest) {
+      EXPECT_EQ(*digest, fs.block_digest()) << run;
+    } else {
+      digest = fs.block_digest();
+    }
+  }
+}
+
+TEST(scanner, multiple_outputs) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  auto input = test::os_access_mock::create_test_instance();
+  worker_group wg("worker", 4);
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 10;
+
+  scanner s(lgr, wg, cfg, entry_factory::create(), input,
+            std::make_shared<test::script_mock>(), scanner_options());
+
+  std::ostringstream oss1, oss2;
+  progress prog([](const progress&, bool) {}, 1000);
+  block_compressor bc("null");
+  filesystem_writer fsw1(oss1, lgr, wg, prog, bc);
+  filesystem_writer fsw2(oss2, lgr, wg, prog, bc);
+
+  auto cfg1 = cfg;
+  auto cfg2 = cfg;
+  cfg1.block_size_bits = 12;
+  cfg2.block_size_bits = 15;
+
+  s.scan({{fsw1, cfg1}, {fsw2, cfg2}}, "", prog);
+
+  for (auto [image, block_size] :
+       {std::pair{oss1.str(), 1 << 12}, std::pair{oss2.str(), 1 << 15}}) {
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(image));
+
+    EXPECT_EQ(fs.block_size(), block_size);
+
+    auto entry = fs.find("/foo.pl");
+    struct ::stat st;
+
+    ASSERT_TRUE(entry);
+    EXPECT_EQ(fs.getattr(*entry, &st), 0);
+
+    int inode = fs.open(*entry);
+    std::vector<char> buf(st.st_size);
+    EXPECT_EQ(fs.read(inode, &buf[0], st.st_size, 0), st.st_size);
+    EXPECT_EQ(std::string(buf.begin(), buf.end()),
+              test::loremipsum(st.st_size));
+  }
+
+  // inodes must only be counted once, and stages are kept apart per image
+  std::ostringstream oss;
+  progress ref_prog([](const progress&, bool) {}, 1000);
+  filesystem_writer fsw(oss, lgr, wg, ref_prog, bc);
+  scanner ref(lgr, wg, cfg1, entry_factory::create(), input,
+              std::make_shared<test::script_mock>(), scanner_options());
+  ref.scan(fsw, "", ref_prog, nullptr);
+
+  EXPECT_GT(ref_prog.inodes_written.load(), 0);
+  EXPECT_EQ(ref_prog.inodes_written.load(), prog.inodes_written.load());
+
+  std::set<std::string> stages;
+  for (auto const& st : prog.stages()) {
+    EXPECT_TRUE(stages.insert(st.name).second) << st.name;
+  }
+  EXPECT_EQ(1, stages.count("order/segment #2"));
+}
+
+namespace {
+
+class digest_tracking_mock : public test::os_access_mock {
+ public:
+  std::optional<std::string>
+  content_digest(const std::string& path, size_t /*size*/) const override {
+    std::lock_guard lock(mx_);
+    hashed_.insert(std::filesystem::path(path).filename().string());
+    return std::nullopt;
+  }
+
+  std::multiset<std::string> hashed() const {
+    std::lock_guard lock(mx_);
+    return hashed_;
+  }
+
+  void reset() {
+    std::lock_guard lock(mx_);
+    hashed_.clear();
+  }
+
+ private:
+  std::mutex mutable mx_;
+  std::multiset<std::string> mutable hashed_;
+};
+
+} // namespace
+
+TEST(scanner, size_buckets) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  auto input = std::make_shared<digest_tracking_mock>();
+  input->add_dir("");
+
+  // sizes nothing else shares
+  input->add_file("unique1", test::loremipsum(1000));
+  input->add_file("unique2", test::loremipsum(2000));
+
+  // bit-identical files and one of the same size with other contents
+  auto dup = test::loremipsum(3000);
+  input->add_file("dup1", dup);
+  input->add_file("dup2", dup);
+  auto other = dup;
+  other[1500] ^= 1;
+  input->add_file("same_size", other);
+
+  input->add_file("empty1", "");
+  input->add_file("empty2", "");
+
+  struct ::stat st;
+  std::memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFREG | 0644;
+  st.st_nlink = 2;
+
+  // a hardlink whose size matches the size of a parked file...
+  auto linked = test::loremipsum(4000);
+  st.st_ino = 42;
+  st.st_size = linked.size();
+  input->add("hl_a", st, linked);
+  input->add("hl_b", st, linked);
+  input->add_file("parked", std::string(linked.size(), 'x'));
+
+  // ...and one that has a size of its own
+  auto solo = test::loremipsum(5000);
+  st.st_ino = 43;
+  st.st_size = solo.size();
+  input->add("solo_a", st, solo);
+  input->add("solo_b", st, solo);
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg));
+
+  auto hashed = input->hashed();
+
+  for (auto name : {"unique1", "unique2", "solo_a", "solo_b"}) {
+    EXPECT_EQ(0, hashed.count(name)) << name;
+  }
+
+  for (auto name :
+       {"dup1", "dup2", "same_size", "empty1", "empty2", "parked"}) {
+    EXPECT_EQ(1, hashed.count(name)) << name;
+  }
+
+  // only one of the hardlinks is ever hashed
+  EXPECT_EQ(1, hashed.count("hl_a") + hashed.count("hl_b"));
+  EXPECT_EQ(7, hashed.size());
+
+  filesystem_options opts;
+  opts.metadata.check_consistency = true;
+  filesystem_v2 fs(lgr, mm, opts);
+
+  std::map<std::string, std::string> expected{
+      {"", ""},
+      {"unique1", test::loremipsum(1000)},
+      {"unique2", test::loremipsum(2000)},
+      {"dup1", dup},
+      {"dup2", dup},
+      {"same_size", other},
+      {"empty1", ""},
+      {"empty2", ""},
+      {"hl_a", linked},
+      {"hl_b", linked},
+      {"parked", std::string(linked.size(), 'x')},
+      {"solo_a", solo},
+      {"solo_b", solo},
+  };
+
+  EXPECT_EQ(expected, image_contents(fs));
+
+  auto inode_of = [&](char const* path) {
+    auto entry = fs.find(path);
+    EXPECT_TRUE(entry) << path;
+    struct ::stat st;
+    EXPECT_EQ(0, fs.getattr(*entry, &st)) << path;
+    return st.st_ino;
+  };
+
+  EXPECT_EQ(inode_of("/dup1"), inode_of("/dup2"));
+  EXPECT_EQ(inode_of("/empty1"), inode_of("/empty2"));
+  EXPECT_EQ(inode_of("/hl_a"), inode_of("/hl_b"));
+  EXPECT_EQ(inode_of("/solo_a"), inode_of("/solo_b"));
+  EXPECT_NE(inode_of("/dup1"), inode_of("/same_size"));
+  EXPECT_NE(inode_of("/hl_a"), inode_of("/parked"));
+  EXPECT_NE(inode_of("/unique1"), inode_of("/unique2"));
+
+  // the same files are hashed again and end up in the same blocks
+  input->reset();
+  filesystem_v2 fs2(lgr, std::make_shared<test::mmap_mock>(
+                             build_dwarfs(lgr, input, "null", cfg)));
+  EXPECT_EQ(hashed, input->hashed());
+  EXPECT_EQ(fs.block_digest(), fs2.block_digest());
+}
+
+TEST(scanner, concurrent_deduplication) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 14;
+
+  scanner_options options;
+  options.file_order.mode = file_order_mode::PATH;
+
+  // Many small files with only a few distinct contents, and pairs of
+  // contents of the same size, so all of them end up being hashed
+  std::vector<std::string> variants;
+  for (int i = 0; i < 16; ++i) {
+    auto s = test::loremipsum(500 + 37 * (i / 2));
+    if (i % 2) {
+      s[s.size() / 2] ^= 1;
+    }
+    variants.push_back(std::move(s));
+  }
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+
+  std::map<std::string, std::set<std::string>> expected_groups;
+
+  for (int i = 0; i < 400; ++i) {
+    auto name = "file" + std::to_string(i);
+    auto const& data = variants[(i * 7) % variants.size()];
+    input->add_file(name, data);
+    expected_groups[data].insert(name);
+  }
+
+  std::set<std::set<std::string>> expected;
+  for (auto& [data, names] : expected_groups) {
+    expected.insert(names);
+  }
+
+  auto build = [&](size_t num_workers) {
+    worker_group wg("worker", num_workers);
+    scanner s(lgr, wg, cfg, entry_factory::create(), input,
+              std::make_shared<test::script_mock>(), options);
+
+    std::ostringstream oss;
+    progress prog([](const progress&, bool) {}, 1000);
+    block_compressor bc("null");
+    filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+    s.scan(fsw, "", prog);
+
+    EXPECT_EQ(400 - variants.size(), prog.duplicate_files.load())
+        << num_workers;
+
+    return oss.str();
+  };
+
+  // A single worker inserts the files one after the other, just like
+  // the old mutex-protected table; with many workers, the shards of the
+  // table are updated concurrently.
+  std::optional<uint64_t> digest;
+
+  for (size_t num_workers : {1, 16}) {
+    filesystem_v2 fs(lgr,
+                     std::make_shared<test::mmap_mock>(build(num_workers)));
+
+    std::map<uint32_t, std::set<std::string>> by_inode;
+    fs.walk([&](dir_entry_view e) {
+      if (S_ISREG(e.inode().mode())) {
+        by_inode[e.inode().inode_num()].insert(e.name());
+      }
+    });
+
+    std::set<std::set<std::string>> groups;
+    for (auto& [ino, names] : by_inode) {
+      groups.insert(names);
+    }
+
+    EXPECT_EQ(expected, groups) << num_workers;
+
+    if (digest) {
+      EXPECT_EQ(*digest, fs.block_digest());
+    } else {
+      digest = fs.block_digest();
+    }
+  }
+}
+
+TEST(filesystem_v2, random_reads_in_file_with_many_chunks) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 10;
+  cfg.block_size_bits = 12;
+
+  auto const contents = test::loremipsum(2 << 20);
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("large", contents);
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(
+                            build_dwarfs(lgr, input, "null", cfg)));
+
+  auto entry = fs.find("/large");
+  ASSERT_TRUE(entry);
+
+  int inode = fs.open(*entry);
+  auto chunks = fs.get_chunks(inode);
+
+  // chunks can't span blocks, so the offset index will be used
+  ASSERT_TRUE(chunks);
+  EXPECT_GE(chunks->size(), contents.size() >> cfg.block_size_bits);
+
+  std::mt19937_64 rng{42};
+  std::vector<char> buf(20000);
+
+  for (int i = 0; i < 1000; ++i) {
+    auto offset = rng() % contents.size();
+    auto size = std::min<size_t>(rng() % buf.size(), contents.size() - offset);
+    ASSERT_EQ(static_cast<ssize_t>(size),
+              fs.read(inode, buf.data(), size, offset))
+        << offset;
+    EXPECT_EQ(contents.substr(offset, size), std::string(buf.data(), size))
+        << offset;
+  }
+
+  EXPECT_EQ(0, fs.read(inode, buf.data(), buf.size(), contents.size()));
+  EXPECT_EQ(0, fs.read(inode, buf.data(), buf.size(), contents.size() + 1));
+}
+
+TEST(filesystem_v2, separate_string_tables) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  auto input = test::os_access_mock::create_test_instance();
+  scanner_options options;
+  options.separate_string_tables = true;
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", block_manager::config(), options));
+
+  filesystem_v2 fs(lgr, mm);
+
+  auto entry = fs.find("/somelink");
+  ASSERT_TRUE(entry);
+
+  std::string link;
+  EXPECT_EQ(fs.readlink(*entry, &link), 0);
+  EXPECT_EQ(link, "somedir/ipsum.py");
+
+  EXPECT_TRUE(fs.find("/somedir/ipsum.py"));
+  EXPECT_FALSE(fs.find("/somedir/nope"));
+
+  filesystem_v2 ref(
+      lgr, std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null")));
+
+  std::vector<std::string> paths, ref_paths;
+  fs.walk([&](auto e) { paths.push_back(e.path()); });
+  ref.walk([&](auto e) { ref_paths.push_back(e.path()); });
+
+  EXPECT_EQ(ref_paths, paths);
+}
+
+TEST(filesystem_v2, parallel_walk) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  auto input = test::os_access_mock::create_test_instance();
+  auto mm = std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null"));
+
+  filesystem_v2 fs(lgr, mm);
+
+  std::vector<std::string> expected;
+  fs.walk([&](auto entry) { expected.push_back(entry.path()); });
+
+  worker_group wg("walker", 4);
+  std::mutex mx;
+  std::set<std::string> seen;
+  std::vector<std::string> paths;
+
+  fs.walk_parallel(
+      wg,
+      [&](std::vector<dir_entry_view> const& batch) {
+        std::lock_guard lock(mx);
+        for (auto const& entry : batch) {
+          auto path = entry.path();
+          if (!path.empty()) {
+            // a directory is always delivered before its contents
+            auto parent = std::filesystem::path(path).parent_path().string();
+            EXPECT_TRUE(seen.count(parent)) << path;
+          }
+          seen.insert(path);
+          paths.push_back(path);
+        }
+      },
+      2);
+
+  std::sort(expected.begin(), expected.end());
+  std::sort(paths.begin(), paths.end());
+  EXPECT_EQ(expected, paths);
+}
+
+TEST(filesystem_v2, base_image_copies_referenced_blocks) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+  scanner_options options;
+  options.file_order.mode = file_order_mode::PATH;
+
+  auto a = test::loremipsum(16384);
+  auto b = std::string(16384, 'b');
+  auto c = std::string(8192, 'c');
+
+  auto base_input = std::make_shared<test::os_access_mock>();
+  base_input->add_dir("");
+  base_input->add_file("a", a);
+  base_input->add_file("b", b);
+
+  filesystem_v2 base(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                              lgr, base_input, "null", cfg, options)));
+  ASSERT_EQ(8, base.num_blocks());
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("b", b);
+  // ordered before "b", so it would end up in the first blocks if "b"
+  // wasn't reusing the blocks from the base image
+  input->add_file("0", c);
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                            lgr, input, "null", cfg, options, &base)));
+
+  // the blocks of "a" are no longer referenced
+  EXPECT_EQ(6, fs.num_blocks());
+
+  auto entry = fs.find("/b");
+  ASSERT_TRUE(entry);
+  auto chunks = fs.get_chunks(fs.open(*entry));
+  ASSERT_TRUE(chunks);
+  EXPECT_EQ(0, chunks->begin()->block());
+
+  for (auto const& [path, contents] :
+       {std::pair{"/b", b}, std::pair{"/0", c}}) {
+    auto entry = fs.find(path);
+    ASSERT_TRUE(entry) << path;
+    auto inode = fs.open(*entry);
+    std::vector<char> buf(contents.size());
+    EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+    EXPECT_EQ(contents, std::string(buf.begin(), buf.end())) << path;
+  }
+}
+
+TEST(filesystem_v2, reference_image) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  auto build_base = [&](std::string const& contents) {
+    auto input = std::make_shared<test::os_access_mock>();
+    input->add_dir("");
+    input->add_file("base", contents);
+    return std::make_shared<test::mmap_mock>(
+        build_dwarfs(lgr, input, "null", cfg));
+  };
+
+  auto base_contents = test::loremipsum(20000);
+  auto base_mm = build_base(base_contents);
+  // same number of blocks, but different data
+  auto other_mm = build_base(std::string(base_contents.size(), 'x'));
+
+  filesystem_v2 base(lgr, base_mm);
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("base", base_contents);
+  input->add_file("new", test::loremipsum(5000));
+
+  scanner_options options;
+  options.base_is_reference = true;
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", cfg, options, &base));
+
+  // versions that don't know about reference images must refuse to
+  // read the image, also after rewriting it
+  EXPECT_EQ(COMPAT_MINOR_VERSION, base_mm->as<section_header_v2>()->minor);
+  EXPECT_EQ(MINOR_VERSION, mm->as<section_header_v2>()->minor);
+
+  auto rewritten = std::make_shared<test::mmap_mock>(rewrite_dwarfs(
+      lgr, std::string(mm->as<char>(), mm->size()), rewrite_options()));
+  EXPECT_EQ(MINOR_VERSION, rewritten->as<section_header_v2>()->minor);
+
+  filesystem_options opts;
+  opts.reference_image = base_mm;
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto entry = fs.find("/base");
+  ASSERT_TRUE(entry);
+  auto inode = fs.open(*entry);
+  std::vector<char> buf(base_contents.size());
+  EXPECT_EQ(buf.size(), fs.read(inode, buf.data(), buf.size(), 0));
+  EXPECT_EQ(base_contents, std::string(buf.begin(), buf.end()));
+
+  EXPECT_THROW(filesystem_v2 missing(lgr, mm), std::exception);
+
+  opts.reference_image = other_mm;
+  EXPECT_THROW(filesystem_v2 wrong(lgr, mm, opts), std::exception);
+}
+
+TEST(filesystem_v2, section_index) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  auto input = test::os_access_mock::create_test_instance();
+  filesystem_writer_options fswopts;
+  fswopts.with_section_index = true;
+
+  auto image = build_dwarfs(lgr, input, "null", block_manager::config(),
+                            scanner_options(), nullptr, nullptr, fswopts);
+
+  // the index is the last section and lists the header offsets of all
+  // sections, including itself
+  std::vector<uint64_t> expected;
+  std::optional<fs_section> last;
+
+  {
+    test::mmap_mock mm(image);
+
+    for (size_t offset = 0; offset < mm.size();) {
+      last.emplace(mm, offset, 2);
+      expected.push_back((static_cast<uint64_t>(last->type()) << 48) |
+                         offset);
+      offset = last->end();
+    }
+
+    ASSERT_TRUE(last);
+    ASSERT_EQ(section_type::SECTION_INDEX, last->type());
+    ASSERT_EQ(compression_type::NONE, last->compression());
+    ASSERT_EQ(expected.size() * sizeof(uint64_t), last->length());
+
+    std::vector<uint64_t> index(expected.size());
+    ::memcpy(index.data(), last->data(mm).data(), last->length());
+    EXPECT_EQ(expected, index);
+  }
+
+  filesystem_v2 ref(
+      lgr, std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null")));
+  auto const ref_contents = image_contents(ref);
+
+  auto mm = std::make_shared<test::mmap_mock>(image);
+  EXPECT_EQ(0, filesystem_v2::identify(lgr, mm, logss, 0, 1, true));
+
+  {
+    filesystem_v2 fs(lgr, mm);
+    EXPECT_EQ(ref_contents, image_contents(fs));
+  }
+
+  // a corrupt index must be ignored in favour of the sequential scan
+  image[last->start()] ^= 0xff;
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(image));
+  EXPECT_EQ(ref_contents, image_contents(fs));
+}
+
+TEST(filesystem_v2, block_alignment) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 14;
+
+  auto input = test::os_access_mock::create_test_instance();
+  filesystem_writer_options fswopts;
+  fswopts.block_alignment = 4096;
+
+  auto image = build_dwarfs(lgr, input, "null", cfg, scanner_options(),
+                            nullptr, nullptr, fswopts);
+
+  // returns the number of blocks, each of which must be preceded by a
+  // padding section that records the alignment
+  auto check_alignment = [](std::string const& image, uint32_t align) {
+    test::mmap_mock mm(image);
+    size_t num_blocks = 0;
+    bool after_padding = false;
+
+    for (size_t offset = 0; offset < mm.size();) {
+      fs_section sec(mm, offset, 2);
+
+      if (sec.type() == section_type::BLOCK) {
+        EXPECT_EQ(align > 0, after_padding) << offset;
+        if (align > 0) {
+          EXPECT_EQ(0, sec.start() % align) << offset;
+        }
+        ++num_blocks;
+      } else if (sec.type() == section_type::PADDING) {
+        EXPECT_GT(align, 0u) << offset;
+        uint32_t value = 0;
+        EXPECT_GE(sec.length(), sizeof(value));
+        ::memcpy(&value, sec.data(mm).data(), sizeof(value));
+        EXPECT_EQ(align, value) << offset;
+      }
+
+      after_padding = sec.type() == section_type::PADDING;
+      offset = sec.end();
+    }
+
+    return num_blocks;
+  };
+
+  auto const num_blocks = check_alignment(image, 4096);
+  EXPECT_GT(num_blocks, 1);
+
+  filesystem_v2 ref(lgr, std::make_shared<test::mmap_mock>(
+                             build_dwarfs(lgr, input, "null", cfg)));
+  auto const ref_contents = image_contents(ref);
+
+  {
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(image));
+    EXPECT_EQ(ref_contents, image_contents(fs));
+    EXPECT_EQ(num_blocks, fs.num_blocks());
+
+    std::ostringstream info;
+    fs.dump(info, 1);
+    EXPECT_NE(std::string::npos, info.str().find("block alignment: 4 KiB"));
+  }
+
+  // rewriting drops the old padding and adds the writer's own
+  for (uint32_t align : {0, 8192}) {
+    fswopts.block_alignment = align;
+    auto rewritten =
+        rewrite_dwarfs(lgr, image, rewrite_options(), "null", fswopts);
+    EXPECT_EQ(num_blocks, check_alignment(rewritten, align)) << align;
+
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(rewritten));
+    EXPECT_EQ(ref_contents, image_contents(fs)) << align;
+  }
+}
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(filesystem_v2, rewrite_hot_blocks) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+  auto const block_size = size_t(1) << cfg.block_size_bits;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", test::loremipsum(10 * block_size));
+
+  auto image = build_dwarfs(lgr, input, "null", cfg);
+
+  filesystem_v2 ref(lgr, std::make_shared<test::mmap_mock>(image));
+  auto const ref_contents = image_contents(ref);
+  ASSERT_EQ(10, ref.num_blocks());
+
+  auto block_compressions = [](std::string const& image) {
+    test::mmap_mock mm(image);
+    std::vector<compression_type> rv;
+
+    for (size_t offset = 0; offset < mm.size();) {
+      fs_section sec(mm, offset, 2);
+      if (sec.type() == section_type::BLOCK) {
+        rv.push_back(sec.compression());
+      }
+      offset = sec.end();
+    }
+
+    return rv;
+  };
+
+  auto const N = compression_type::NONE;
+  auto const Z = compression_type::ZSTD;
+
+  rewrite_options opts;
+  opts.hot_compression = "zstd";
+  opts.hot_min_count = 2;
+  // block 2 is below the minimum count, blocks beyond the profile are
+  // never hot
+  opts.hot_block_counts = {0, 5, 1, 9, 3, 0};
+
+  // the hottest blocks are selected first, until the budget is used up
+  std::vector<std::pair<size_t, std::vector<compression_type>>> cases{
+      {0, {N, Z, N, Z, Z, N, N, N, N, N}},
+      {2 * block_size, {N, Z, N, Z, N, N, N, N, N, N}},
+      {block_size, {N, N, N, Z, N, N, N, N, N, N}},
+      {block_size - 1, {N, N, N, N, N, N, N, N, N, N}},
+  };
+
+  for (auto const& [max_bytes, expected] : cases) {
+    opts.hot_max_bytes = max_bytes;
+    auto rewritten = rewrite_dwarfs(lgr, image, opts);
+    EXPECT_EQ(expected, block_compressions(rewritten)) << max_bytes;
+
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(rewritten));
+    EXPECT_EQ(ref_contents, image_contents(fs)) << max_bytes;
+  }
+}
+#endif
+
+namespace {
+
+class release_tracking_mock : public test::mmap_mock {
+ public:
+  using test::mmap_mock::mmap_mock;
+
+  boost::system::error_code
+  advise_sequential(off_t offset, size_t size) override {
+    EXPECT_EQ(0, offset);
+    EXPECT_EQ(this->size(), size);
+    ++advised;
+    return boost::system::error_code();
+  }
+
+  boost::system::error_code release_until(off_t offset) override {
+    released.push_back(offset);
+    return boost::system::error_code();
+  }
+
+  size_t advised{0};
+  std::vector<off_t> released;
+};
+
+} // namespace
+
+TEST(filesystem_v2, verify_integrity) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_file("file", test::loremipsum(40000));
+
+  auto image = build_dwarfs(lgr, input, "null", cfg);
+
+  std::vector<size_t> blocks;
+  size_t num_sections = 0;
+
+  {
+    test::mmap_mock mm(image);
+
+    for (size_t offset = 0; offset < mm.size(); ++num_sections) {
+      fs_section sec(mm, offset, 2);
+      if (sec.type() == section_type::BLOCK) {
+        blocks.push_back(offset);
+      }
+      offset = sec.end();
+    }
+  }
+
+  ASSERT_GE(blocks.size(), 3);
+
+  // the verified prefix of the image is released in order
+  auto verify = [&](std::string const& data, size_t num_workers,
+                    size_t window_size) {
+    auto mm = std::make_shared<release_tracking_mock>(data);
+    integrity_check_options opts;
+    opts.num_workers = num_workers;
+    opts.window_size = window_size;
+
+    auto errors = filesystem_v2::verify_integrity(lgr, mm, opts);
+
+    EXPECT_EQ(1, mm->advised);
+    EXPECT_EQ(num_sections, mm->released.size());
+    EXPECT_TRUE(std::is_sorted(mm->released.begin(), mm->released.end()));
+    if (!mm->released.empty()) {
+      EXPECT_EQ(static_cast<off_t>(data.size()), mm->released.back());
+    }
+
+    return errors;
+  };
+
+  std::vector<std::pair<size_t, size_t>> const params{
+      {1, 256 << 20}, {4, 1}, {4, 10000}};
+
+  for (auto const& [num_workers, window_size] : params) {
+    EXPECT_EQ(0, verify(image, num_workers, window_size))
+        << num_workers << "/" << window_size;
+  }
+
+  // a bad hash that only the full check catches, and bad data
+  image[blocks[0] + offsetof(section_header_v2, sha2_512_256)] ^= 0xff;
+  image[blocks[2] + sizeof(section_header_v2) + 100] ^= 0xff;
+
+  for (auto const& [num_workers, window_size] : params) {
+    EXPECT_EQ(2, verify(image, num_workers, window_size))
+        << num_workers << "/" << window_size;
+  }
+
+  EXPECT_NE(std::string::npos,
+            logss.str().find("integrity check error in section"));
+}
+
+TEST(os_access_archive, sparse_entries) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  using extent_list = std::vector<std::pair<size_t, size_t>>;
+
+  // size and data extents of each file, everything else is a hole
+  std::map<std::string, std::pair<size_t, extent_list>> const files{
+      {"plain", {10000, {}}},
+      {"tail", {40000, {{0, 10000}}}},
+      {"holes", {40000, {{0, 5000}, {20000, 3000}}}},
+  };
+
+  std::map<std::string, std::string> expected;
+
+  for (auto const& [name, spec] : files) {
+    auto const& [size, extents] = spec;
+    auto& data = expected[name];
+    data = test::loremipsum(size);
+    if (!extents.empty()) {
+      std::string sparse(size, '\0');
+      for (auto [offset, len] : extents) {
+        sparse.replace(offset, len, data, offset, len);
+      }
+      data.swap(sparse);
+    }
+  }
+
+  auto const path =
+      std::filesystem::path(testing::TempDir()) / "dwarfs_sparse.tar";
+
+  {
+    auto a = ::archive_write_new();
+    SCOPE_EXIT { ::archive_write_free(a); };
+
+    ASSERT_EQ(ARCHIVE_OK, ::archive_write_set_format_pax(a));
+    ASSERT_EQ(ARCHIVE_OK, ::archive_write_open_filename(a, path.c_str()));
+
+    for (auto const& [name, spec] : files) {
+      auto const& [size, extents] = spec;
+      auto ae = ::archive_entry_new();
+      SCOPE_EXIT { ::archive_entry_free(ae); };
+
+      ::archive_entry_set_pathname(ae, name.c_str());
+      ::archive_entry_set_filetype(ae, AE_IFREG);
+      ::archive_entry_set_perm(ae, 0644);
+      ::archive_entry_set_size(ae, size);
+      for (auto [offset, len] : extents) {
+        ::archive_entry_sparse_add_entry(ae, offset, len);
+      }
+
+      ASSERT_EQ(ARCHIVE_OK, ::archive_write_header(a, ae));
+
+      // the writer skips the data in holes
+      auto const& data = expected.at(name);
+      ::archive_write_data(a, data.data(), data.size());
+    }
+
+    ASSERT_EQ(ARCHIVE_OK, ::archive_write_close(a));
+  }
+
+  auto os = std::make_shared<os_access_archive>(lgr, path.string());
+
+  for (auto const& [name, spec] : files) {
+    auto const& [size, extents] = spec;
+    auto const& data = expected.at(name);
+
+    // the mapping must cover the whole file, including a trailing hole
+    auto mm = os->map_file("/" + name, size);
+    ASSERT_EQ(size, mm->size()) << name;
+    EXPECT_EQ(data, std::string(mm->as<char>(), mm->size())) << name;
+
+    auto expected_extents = extents.empty() ? extent_list{{0, size}} : extents;
+    EXPECT_EQ(expected_extents, os->data_extents("/" + name, size)) << name;
+  }
+
+  expected[""];
+
+  for (bool detect_holes : {false, true}) {
+    block_manager::config cfg;
+    cfg.detect_holes = detect_holes;
+
+    // the scanner releases the files it has read
+    os = std::make_shared<os_access_archive>(lgr, path.string());
+
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(
+                              build_dwarfs(lgr, os, "null", cfg)));
+    EXPECT_EQ(expected, image_contents(fs)) << detect_holes;
+  }
+
+  std::filesystem::remove(path);
+}
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(filesystem_v2, metadata_cache) {
+  std::ostringstream logss;
+  stream_logger lgr(logss, logger::DEBUG);
+
+  auto input = test::os_access_mock::create_test_instance();
+  auto mm = std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "zstd"));
+  auto dir =
+      std::filesystem::path(testing::TempDir()) / "dwarfs_metadata_cache";
+
+  std::filesystem::remove_all(dir);
+
+  filesystem_options opts;
+  opts.metadata_cache_dir = dir.string();
+
+  std::set<std::string> expected;
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    fs.walk([&](auto entry) { expected.insert(entry.path()); });
+  }
+
+  EXPECT_EQ(std::string::npos, logss.str().find("using cached metadata"));
+  EXPECT_EQ(1, std::distance(std::filesystem::directory_iterator(dir),
+                             std::filesystem::directory_iterator()));
+
+  std::set<std::string> paths;
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    fs.walk([&](auto entry) { paths.insert(entry.path()); });
+  }
+
+  EXPECT_NE(std::string::npos, logss.str().find("using cached metadata"));
+  EXPECT_EQ(expected, paths);
+
+  // a corrupt entry is removed and the metadata decompressed again
+  {
+    auto file = std::filesystem::directory_iterator(dir)->path();
+    std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+    char c;
+    f.seekg(10);
+    f.get(c);
+    f.seekp(10);
+    f.put(~c);
+  }
+
+  logss.str("");
+  paths.clear();
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    fs.walk([&](auto entry) { paths.insert(entry.path()); });
+  }
+
+  EXPECT_EQ(std::string::npos, logss.str().find("using cached metadata"));
+  EXPECT_NE(std::string::npos,
+            logss.str().find("removing corrupt disk cache entry"));
+  EXPECT_EQ(expected, paths);
+
+  std::filesystem::remove_all(dir);
+}
+#endif
+
+TEST(metadata_v2, hot_ranges) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  auto input = test::os_access_mock::create_test_instance();
+  scanner_options options;
+  options.plain_symlinks_table = true;
+
+  auto mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, input, "null", block_manager::config(), options));
+
+  folly::ByteRange schema, data;
+
+  for (size_t offset = 0; offset < mm->size();) {
+    fs_section sec(*mm, offset, 2);
+    if (sec.type() == section_type::METADATA_V2_SCHEMA) {
+      schema = sec.data(*mm);
+    } else if (sec.type() == section_type::METADATA_V2) {
+      data = sec.data(*mm);
+    }
+    offset = sec.end();
+  }
+
+  ASSERT_FALSE(schema.empty());
+  ASSERT_FALSE(data.empty());
+
+  metadata_v2 meta(lgr, schema, data, metadata_options());
+  auto hot = meta.hot_ranges();
+
+  ASSERT_FALSE(hot.empty());
+
+  size_t hot_size = 0;
+  auto pos = data.begin();
+
+  for (auto const& r : hot) {
+    EXPECT_LE(pos, r.begin());
+    EXPECT_LT(r.begin(), r.end());
+    EXPECT_LE(r.end(), data.end());
+    pos = r.end();
+    hot_size += r.size();
+  }
+
+  EXPECT_LT(hot_size, data.size());
+
+  // the symlink target must be cold, the names used for lookups hot
+  auto is_hot = [&](std::string_view str) {
+    auto it = std::search(data.begin(), data.end(), str.begin(), str.end());
+    EXPECT_NE(data.end(), it) << str;
+    return std::any_of(hot.begin(), hot.end(), [&](auto const& r) {
+      return r.begin() <= it && it + str.size() <= r.end();
+    });
+  };
+
+  EXPECT_FALSE(is_hot("somedir/ipsum.py"));
+  EXPECT_TRUE(is_hot("somelink"));
+}
+
+namespace {
+
+std::shared_ptr<test::os_access_mock> sample_test_input() {
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  for (auto top : {"a", "b"}) {
+    input->add_dir(top);
+    input->add_dir(std::string(top) + "/sub");
+    for (int i = 0; i < 10; ++i) {
+      input->add_file(std::string(top) + "/small" + std::to_string(i),
+                      test::loremipsum(100));
+    }
+    input->add_file(std::string(top) + "/sub/large", test::loremipsum(100000));
+  }
+  return input;
+}
+
+} // namespace
+
+TEST(input_sample, covers_all_strata) {
+  auto input = sample_test_input();
+  auto sample = sample_input(*input, "", 200400);
+
+  EXPECT_EQ(22, sample.total_files);
+  EXPECT_EQ(202000, sample.total_bytes);
+
+  // one file from each of the four strata, then small files from both
+  // top-level directories until the budget is used up
+  EXPECT_EQ(200400, sample.sample_bytes);
+  EXPECT_EQ(6, sample.files.size());
+  EXPECT_EQ(1, sample.files.count("/a/sub/large"));
+  EXPECT_EQ(1, sample.files.count("/b/sub/large"));
+
+  for (auto top : {"/a/small", "/b/small"}) {
+    EXPECT_EQ(2, std::count_if(
+                     sample.files.begin(), sample.files.end(),
+                     [&](auto const& f) { return f.rfind(top, 0) == 0; }))
+        << top;
+  }
+
+  EXPECT_EQ(sample.files, sample_input(*input, "", 200400).files);
+  EXPECT_TRUE(sample_input(*input, "", 99).files.empty());
+}
+
+TEST(input_sample, sample_script) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  class reject_script : public test::script_mock {
+   public:
+    bool filter(entry_interface const& ei) override {
+      return ei.path() != "/a/small0";
+    }
+  };
+
+  auto input = sample_test_input();
+  auto sample = sample_input(*input, "", 1000);
+
+  ASSERT_EQ(10, sample.files.size());
+
+  auto scr = std::make_shared<sample_script>(
+      std::make_shared<reject_script>(), sample.files);
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(build_dwarfs(
+                            lgr, input, "null", block_manager::config(),
+                            scanner_options(), nullptr, scr)));
+
+  std::set<std::string> dirs, files;
+
+  fs.walk([&](auto e) {
+    auto mode = e.inode().mode();
+    (S_ISDIR(mode) ? dirs : files).insert("/" + e.path());
+  });
+
+  std::set<std::string> expected(sample.files.begin(), sample.files.end());
+  expected.erase("/a/small0");
+
+  EXPECT_EQ(expected, files);
+  EXPECT_EQ(1, dirs.count("/a/sub"));
+  EXPECT_EQ(1, dirs.count("/b/sub"));
+}
+
+namespace {
+
+std::shared_ptr<test::os_access_mock> extract_test_input() {
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add_dir("");
+  input->add_dir("dir");
+  input->add_dir("dir/sub");
+  input->add_file("empty", "");
+  input->add_file("large", 50000);
+  input->add_file("dir/a.txt", 3000);
+  input->add_file("dir/b.bin", 7000);
+  input->add_file("dir/sub/c.txt", 12345);
+  input->add_file("dir/sub/d.bin", 100);
+
+  struct ::stat st;
+  std::memset(&st, 0, sizeof(st));
+  st.st_ino = 42;
+  st.st_mode = S_IFLNK | 0777;
+  st.st_nlink = 1;
+  st.st_size = 8;
+  input->add("dir/link", st, "../large");
+
+  auto contents = test::loremipsum(5000);
+  st.st_ino = 43;
+  st.st_mode = S_IFREG | 0600;
+  st.st_nlink = 2;
+  st.st_size = contents.size();
+  input->add("dir/sub/e", st, contents);
+  input->add("f", st, contents);
+
+  return input;
+}
+
+// Same as image_contents(), but for a directory on disk
+std::map<std::string, std::string>
+disk_contents(std::filesystem::path const& root) {
+  std::map<std::string, std::string> rv;
+
+  for (auto const& e : std::filesystem::recursive_directory_iterator(root)) {
+    auto& data = rv[std::filesystem::relative(e.path(), root).string()];
+
+    if (e.is_symlink()) {
+      data = std::filesystem::read_symlink(e.path()).string();
+    } else if (e.is_regular_file()) {
+      std::ifstream ifs(e.path(), std::ios::binary);
+      data.assign(std::istreambuf_iterator<char>(ifs),
+                  std::istreambuf_iterator<char>());
+    }
+  }
+
+  return rv;
+}
+
+// Extracts to a fresh directory, without changing the current directory
+void extract_to_disk(logger& lgr, filesystem_v2 const& fs,
+                     std::filesystem::path const& dir, size_t num_writers,
+                     std::vector<std::string> const& include = {},
+                     std::vector<std::string> const& exclude = {}) {
+  auto const cwd = std::filesystem::current_path();
+  SCOPE_EXIT { std::filesystem::current_path(cwd); };
+
+  filesystem_extractor ext(lgr);
+  ext.set_filter(include, exclude);
+  ext.open_disk(dir.string(), num_writers);
+  ext.extract(fs, 1 << 20);
+  ext.close();
+}
+
+} // namespace
+
+TEST(filesystem_extractor, native_disk_writer) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  auto input = extract_test_input();
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(
+                            build_dwarfs(lgr, input, "null", cfg)));
+
+  auto expected = image_contents(fs);
+  expected.erase("");
+
+  auto const base = std::filesystem::path(testing::TempDir()) /
+                    "dwarfs_native_disk_writer";
+  auto const dir = base / "out";
+
+  std::filesystem::remove_all(base);
+  std::filesystem::create_directories(dir);
+
+  auto check = [&] {
+    EXPECT_EQ(expected, disk_contents(dir));
+
+    fs.walk([&](dir_entry_view e) {
+      if (e.is_root()) {
+        return;
+      }
+      auto st = std::filesystem::symlink_status(dir / e.path());
+      EXPECT_EQ(static_cast<unsigned>(e.inode().mode() & 07777),
+                static_cast<unsigned>(st.permissions()))
+          << e.path();
+    });
+
+    struct ::stat st1, st2;
+    ASSERT_EQ(0, ::stat((dir / "f").c_str(), &st1));
+    ASSERT_EQ(0, ::stat((dir / "dir/sub/e").c_str(), &st2));
+    EXPECT_EQ(st1.st_ino, st2.st_ino);
+    EXPECT_EQ(2, st2.st_nlink);
+  };
+
+  for (size_t num_writers : {1, 4}) {
+    extract_to_disk(lgr, fs, dir, num_writers);
+    check();
+  }
+
+  // existing entries are replaced, links are never followed
+  {
+    std::ofstream ofs(base / "outside");
+    ofs << "keep me";
+  }
+
+  std::filesystem::remove(dir / "large");
+  std::filesystem::create_symlink(base / "outside", dir / "large");
+  std::filesystem::remove(dir / "dir/a.txt");
+  std::filesystem::create_directory(dir / "dir/a.txt");
+  std::filesystem::remove_all(dir / "dir/sub");
+  {
+    std::ofstream ofs(dir / "dir/sub");
+    ofs << "not a directory";
+  }
+
+  extract_to_disk(lgr, fs, dir, 4);
+  check();
+
+  std::ifstream ifs(base / "outside");
+  std::string outside;
+  std::getline(ifs, outside);
+  EXPECT_EQ("keep me", outside);
+
+  std::filesystem::remove_all(base);
+}
+
+TEST(filesystem_extractor, block_order) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  auto input = extract_test_input();
+  auto mm =
+      std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null", cfg));
+
+  // a cache that holds only a single block, so any block requested more
+  // than once would have to be decompressed again
+  filesystem_options opts;
+  opts.block_cache.max_bytes = size_t(1) << cfg.block_size_bits;
+
+  filesystem_v2 fs(lgr, mm, opts);
+  ASSERT_GT(fs.num_blocks(), 10);
+
+  auto expected = image_contents(fs);
+  expected.erase("");
+
+  // read_block() returns the same data as the chunks of each file
+  fs.walk([&](dir_entry_view e) {
+    if (!S_ISREG(e.inode().mode())) {
+      return;
+    }
+
+    auto chunks = fs.get_chunks(fs.open(e.inode()));
+    ASSERT_TRUE(chunks) << e.path();
+
+    auto const& contents = expected[e.path()];
+    size_t offset = 0;
+
+    for (auto const& chunk : *chunks) {
+      auto br =
+          fs.read_block(chunk.block(), chunk.offset(), chunk.size()).get();
+      EXPECT_EQ(contents.substr(offset, chunk.size()),
+                std::string(reinterpret_cast<char const*>(br.data()),
+                            br.size()))
+          << e.path() << " @ " << offset;
+      offset += chunk.size();
+    }
+
+    EXPECT_EQ(contents.size(), offset) << e.path();
+  });
+
+  auto const dir =
+      std::filesystem::path(testing::TempDir()) / "dwarfs_block_order";
+
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  filesystem_v2 fs2(lgr, mm, opts);
+  extract_to_disk(lgr, fs2, dir, 4);
+
+  EXPECT_EQ(expected, disk_contents(dir));
+  EXPECT_EQ(fs2.num_blocks(), fs2.cache_stats().blocks_created);
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST(filesystem_extractor, filters) {
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 12;
+
+  auto input = extract_test_input();
+  auto mm =
+      std::make_shared<test::mmap_mock>(build_dwarfs(lgr, input, "null", cfg));
+
+  filesystem_v2 fs(lgr, mm);
+
+  auto all = image_contents(fs);
+  std::map<std::string, std::set<size_t>> file_blocks;
+
+  fs.walk([&](dir_entry_view e) {
+    if (S_ISREG(e.inode().mode())) {
+      for (auto const& chunk : *fs.get_chunks(fs.open(e.inode()))) {
+        file_blocks[e.path()].insert(chunk.block());
+      }
+    }
+  });
+
+  struct filter_case {
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::set<std::string> expected;
+  };
+
+  std::vector<filter_case> cases{
+      {{"dir"},
+       {"dir/*.bin"},
+       {"dir", "dir/a.txt", "dir/link", "dir/sub", "dir/sub/c.txt",
+        "dir/sub/d.bin", "dir/sub/e"}},
+      {{"dir/sub/*.txt"}, {}, {"dir", "dir/sub", "dir/sub/c.txt"}},
+      {{}, {"dir"}, {"empty", "f", "large"}},
+      // only one of the hardlinks
+      {{"/f/"}, {}, {"f"}},
+      {{}, {"*"}, {}},
+  };
+
+  auto const dir = std::filesystem::path(testing::TempDir()) / "dwarfs_filters";
+
+  for (auto const& [include, exclude, expected] : cases) {
+    auto const what = folly::join(",", include) + " / " +
+                      folly::join(",", exclude);
+
+    // native disk writer, which only decompresses the blocks it needs
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    filesystem_v2 fs2(lgr, mm);
+    extract_to_disk(lgr, fs2, dir, 2, include, exclude);
+
+    std::set<std::string> names;
+    std::set<size_t> blocks;
+
+    for (auto const& [path, data] : disk_contents(dir)) {
+      names.insert(path);
+      EXPECT_EQ(all[path], data) << what << ": " << path;
+      blocks.insert(file_blocks[path].begin(), file_blocks[path].end());
+    }
+
+    EXPECT_EQ(expected, names) << what;
+    EXPECT_EQ(blocks.size(), fs2.cache_stats().blocks_created) << what;
+
+    // libarchive
+    filesystem_extractor ext(lgr);
+    std::ostringstream oss;
+
+    ext.set_filter(include, exclude);
+    ext.open_stream(oss, "mtree");
+    ext.extract(fs, 1 << 20);
+    ext.close();
+
+    std::istringstream iss(oss.str());
+    std::string line;
+    names.clear();
+
+    while (std::getline(iss, line)) {
+      if (!line.empty() && line != "#mtree") {
+        names.insert(line.substr(2, line.find(' ') - 2));
+      }
+    }
+
+    EXPECT_EQ(expected, names) << what;
+  }
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST(worker_group, work_stealing) {
+  worker_group wg(worker_group::work_stealing, "steal", 4, 64);
+  std::atomic<size_t> count{0};
+
+  std::vector<worker_group::job_t> jobs;
+  for (size_t i = 0; i < 1000; ++i) {
+    jobs.emplace_back([&] {
+      // jobs added from a worker end up in its own queue
+      wg.add_job([&] { ++count; });
+      ++count;
+    });
+  }
+
+  wg.add_jobs(std::move(jobs));
+
+  for (size_t i = 0; i < 1000; ++i) {
+    wg.add_job([&] { ++count; });
+  }
+
+  wg.wait();
+
+  EXPECT_EQ(3000, count.load());
+  EXPECT_EQ(0, wg.queue_size());
+}
+
+TEST(worker_group, priorities) {
+  for (bool stealing : {false, true}) {
+    auto wg = stealing ? worker_group(worker_group::work_stealing, "prio", 1)
+                       : worker_group("prio", 1);
+    std::promise<void> blocker;
+    std::mutex mx;
+    std::vector<int> order;
+
+    wg.add_job([f = blocker.get_future()] { f.wait(); });
+
+    auto record = [&](int v) {
+      return [&, v] {
+        std::lock_guard lock(mx);
+        order.push_back(v);
+      };
+    };
+
+    wg.add_job(record(3), job_priority::BACKGROUND);
+    wg.add_job(record(2), job_priority::READAHEAD);
+    wg.add_job(record(1));
+
+    blocker.set_value();
+    wg.wait();
+
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), order) << stealing;
+  }
+}
+
+TEST(util, parse_cpu_list) {
+  EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 8}), parse_cpu_list("0-3,8"));
+  EXPECT_EQ((std::vector<int>{1, 2, 5}), parse_cpu_list("5, 1-2,2"));
+  EXPECT_THROW(parse_cpu_list(""), runtime_error);
+  EXPECT_THROW(parse_cpu_list("3-1"), runtime_error);
+  EXPECT_THROW(parse_cpu_list("a"), runtime_error);
+  EXPECT_GE(available_cpus(), 1u);
+}
+
+TEST(memory_accountant, budget) {
+  memory_accountant ma;
+  ma.set_limit(100);
+
+  // nothing held by the writer, so this must not block
+  ma.reserve(memory_stage::SEGMENTER, 150);
+  EXPECT_TRUE(ma.over_limit());
+  ma.release(memory_stage::SEGMENTER, 150);
+
+  ma.charge(memory_stage::WRITER, 80);
+
+  auto fut = std::async(std::launch::async, [&] {
+    ma.reserve(memory_stage::SEGMENTER, 40);
+  });
+
+  EXPECT_EQ(std::future_status::timeout,
+            fut.wait_for(std::chrono::milliseconds(50)));
+
+  ma.release(memory_stage::WRITER, 30);
+  fut.get();
+
+  EXPECT_EQ(90u, ma.used());
+  EXPECT_EQ(40u, ma.used(memory_stage::SEGMENTER));
+  EXPECT_EQ(150u, ma.peak(memory_stage::SEGMENTER));
+  EXPECT_EQ(150u, ma.peak());
+  EXPECT_FALSE(ma.over_limit());
+}
+
+TEST(async_logger, background_writes) {
+  std::ostringstream logss;
+  stream_logger slgr(logss, logger::INFO);
+  async_logger lgr(slgr);
+
+  lgr.start();
+
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&lgr, t] {
+      LOG_PROXY(prod_logger_policy, lgr);
+      for (int i = 0; i < 100; ++i) {
+        LOG_INFO << "thread " << t << " message " << i;
+      }
+      LOG_DEBUG << "filtered";
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  lgr.stop();
+
+  auto log = logss.str();
+  size_t lines = std::count(log.begin(), log.end(), '\n');
+
+  // each thread has its own ring, which is large enough for all messages
+  EXPECT_EQ(0u, lgr.dropped());
+  EXPECT_EQ(400u, lines);
+  EXPECT_EQ(std::string::npos, log.find("filtered"));
+  EXPECT_NE(std::string::npos, log.find("thread 3 message "));
+}
+
+TEST(async_logger, no_messages_lost_on_stop) {
+  std::ostringstream logss;
+  stream_logger slgr(logss, logger::INFO);
+  async_logger lgr(slgr);
+
+  lgr.start();
+
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&lgr, &go, t] {
+      LOG_PROXY(prod_logger_policy, lgr);
+      while (!go) {
+        std::this_thread::yield();
+      }
+      for (int i = 0; i < 1000; ++i) {
+        LOG_INFO << "thread " << t << " message " << i;
+      }
+    });
+  }
+
+  // stop while the threads are still logging
+  go = true;
+  lgr.stop();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  auto log = logss.str();
+  size_t lines = std::count(log.begin(), log.end(), '\n');
+
+  EXPECT_EQ(4000u, lines + lgr.dropped());
+}
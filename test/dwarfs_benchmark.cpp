@@ -19,7 +19,17 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
@@ -29,15 +39,19 @@
 
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_manager.h"
+#include "dwarfs/block_manager_detail.h"
+#include "dwarfs/cyclic_hash.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/nilsimsa.h"
 #include "dwarfs/options.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
 #include "dwarfs/string_table.h"
 #include "dwarfs/worker_group.h"
+#include "loremipsum.h"
 #include "mmap_mock.h"
 #include "test_helpers.h"
 #include "test_strings.h"
@@ -175,6 +189,311 @@ void frozen_string_table_lookup(::benchmark::State& state) {
   }
 }
 
+std::vector<uint8_t> make_hash_input(size_t size) {
+  std::vector<uint8_t> data(size);
+  uint32_t x = 42;
+  for (auto& c : data) {
+    x = x * 1664525 + 1013904223;
+    c = x >> 24;
+  }
+  return data;
+}
+
+void rsync_hash_bytewise(::benchmark::State& state) {
+  constexpr size_t window = 4096;
+  auto data = make_hash_input(1 << 20);
+
+  for (auto _ : state) {
+    rsync_hash h;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < window; ++i) {
+      h.update(data[i]);
+    }
+    for (size_t i = window; i < data.size(); ++i) {
+      sum += h();
+      h.update(data[i - window], data[i]);
+    }
+    ::benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetBytesProcessed(state.iterations() * (data.size() - window));
+}
+
+void rsync_hash_batch(::benchmark::State& state) {
+  constexpr size_t window = 4096;
+  auto data = make_hash_input(1 << 20);
+  std::vector<uint32_t> hashes(state.range(0));
+
+  for (auto _ : state) {
+    rsync_hash h;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < window; ++i) {
+      h.update(data[i]);
+    }
+    for (size_t i = window; i < data.size(); i += hashes.size()) {
+      auto n = std::min(hashes.size(), data.size() - i);
+      h.update(data.data() + i, n, hashes.data());
+      for (size_t k = 0; k < n; ++k) {
+        sum += hashes[k];
+      }
+    }
+    ::benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetBytesProcessed(state.iterations() * (data.size() - window));
+}
+
+std::vector<std::string> const codec_specs{
+    "null",
+#ifdef DWARFS_HAVE_LIBLZ4
+    "lz4",
+    "lz4hc:level=4",
+    "lz4hc:level=9",
+#endif
+#ifdef DWARFS_HAVE_LIBZSTD
+    "zstd:level=1",
+    "zstd:level=3",
+    "zstd:level=9",
+    "zstd:level=19",
+#endif
+#ifdef DWARFS_HAVE_LIBLZMA
+    "lzma:level=1",
+    "lzma:level=6",
+    "lzma:level=9",
+#endif
+};
+
+// 0: text, 1: half text / half random, 2: random
+std::vector<uint8_t> make_codec_input(int kind) {
+  constexpr size_t size = 1 << 20;
+  auto text = loremipsum(size);
+  auto rnd = make_hash_input(size);
+  std::vector<uint8_t> data(text.begin(), text.end());
+
+  if (kind > 0) {
+    auto const split = kind == 1 ? size / 2 : 0;
+    std::copy(rnd.begin() + split, rnd.end(), data.begin() + split);
+  }
+
+  return data;
+}
+
+void CodecParams(::benchmark::internal::Benchmark* b) {
+  for (size_t spec = 0; spec < codec_specs.size(); ++spec) {
+    for (auto kind : {0, 1, 2}) {
+      b->Args({static_cast<int64_t>(spec), kind});
+    }
+  }
+}
+
+void block_compress(::benchmark::State& state) {
+  auto const& spec = codec_specs[state.range(0)];
+  block_compressor bc(spec);
+  auto data = make_codec_input(state.range(1));
+  size_t compressed = 0;
+
+  state.SetLabel(spec);
+
+  for (auto _ : state) {
+    try {
+      compressed = bc.compress(data).size();
+    } catch (bad_compression_ratio_error const&) {
+      compressed = data.size();
+    }
+    ::benchmark::DoNotOptimize(compressed);
+  }
+
+  state.counters["ratio"] = static_cast<double>(compressed) / data.size();
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+void block_decompress(::benchmark::State& state) {
+  auto const& spec = codec_specs[state.range(0)];
+  block_compressor bc(spec);
+  auto data = make_codec_input(state.range(1));
+  std::vector<uint8_t> compressed;
+
+  state.SetLabel(spec);
+
+  try {
+    compressed = bc.compress(data);
+  } catch (bad_compression_ratio_error const&) {
+    state.SkipWithError("incompressible input");
+    return;
+  }
+
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(block_decompressor::decompress(
+        bc.type(), compressed.data(), compressed.size()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+// Probes a bloom filter sized at 2^range(0) bits per value, half of the
+// probes are for values in the filter
+void bloom_filter_probe(::benchmark::State& state) {
+  constexpr size_t num_values = 1 << 16;
+  bloom_filter filter(num_values << state.range(0));
+  auto values = make_hash_input(2 * num_values * sizeof(uint32_t));
+  auto const* v = reinterpret_cast<uint32_t const*>(values.data());
+
+  for (size_t i = 0; i < num_values; ++i) {
+    filter.add(v[2 * i]);
+  }
+
+  size_t i = 0;
+
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(filter.test(v[i++ % (2 * num_values)]));
+  }
+}
+
+void offset_table_lookup(::benchmark::State& state) {
+  size_t const num_values = state.range(0);
+  offset_table<uint32_t, uint32_t> table(num_values);
+  auto values = make_hash_input(2 * num_values * sizeof(uint32_t));
+  auto const* v = reinterpret_cast<uint32_t const*>(values.data());
+
+  for (size_t i = 0; i < num_values; ++i) {
+    table.insert(v[2 * i], i);
+  }
+
+  size_t i = 0;
+
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    table.for_each_value(v[i++ % (2 * num_values)],
+                         [&](uint32_t off) { sum += off; });
+    ::benchmark::DoNotOptimize(sum);
+  }
+}
+
+// Verifies and extends a match of range(0) bytes within a 4 KiB window
+void extend_match_bench(::benchmark::State& state) {
+  constexpr size_t window = 4096;
+  size_t const match_size = state.range(0);
+  auto block = make_hash_input(1 << 20);
+  std::vector<uint8_t> input(block.begin(), block.begin() + match_size);
+  input.resize(match_size + window, 0);
+  size_t const block_offset = 1 << 19;
+  std::copy(input.begin(), input.begin() + match_size,
+            block.begin() + block_offset);
+
+  for (auto _ : state) {
+    size_t offset = block_offset + match_size / 2 - window / 2;
+    uint8_t const* pos = input.data() + match_size / 2 - window / 2;
+    ::benchmark::DoNotOptimize(
+        extend_match(block.data(), block.size(), offset, pos, window,
+                     input.data(), input.data() + input.size()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * match_size);
+}
+
+void nilsimsa_update(::benchmark::State& state) {
+  auto data = make_hash_input(1 << 20);
+
+  for (auto _ : state) {
+    nilsimsa n;
+    nilsimsa::hash_type h;
+    n.update(data.data(), data.size());
+    n.finalize(h);
+    ::benchmark::DoNotOptimize(h);
+  }
+
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+void nilsimsa_similarity(::benchmark::State& state) {
+  auto data = make_hash_input(4096 * sizeof(nilsimsa::hash_type));
+  auto const* hashes = reinterpret_cast<uint64_t const*>(data.data());
+  constexpr size_t num_hashes = 4096;
+
+  for (auto _ : state) {
+    int sum = 0;
+    for (size_t i = 1; i < num_hashes; ++i) {
+      sum += nilsimsa::similarity(hashes, hashes + 4 * i);
+    }
+    ::benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetItemsProcessed(state.iterations() * (num_hashes - 1));
+}
+
+// Builds an image from a synthetic corpus of state.range(0) MiB, reporting
+// the wall and CPU time of each pipeline stage as counters (use
+// --benchmark_format=json for machine-readable output)
+void mkdwarfs_pipeline(::benchmark::State& state) {
+  auto const total_size = static_cast<size_t>(state.range(0)) << 20;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<size_t> size_dist(1, 256 << 10);
+  size_t size = 0;
+
+  for (size_t i = 0; size < total_size; ++i) {
+    auto dir = "dir" + std::to_string(i % 32);
+    if (i < 32) {
+      input->add_dir(dir);
+    }
+    auto fsize = size_dist(rng);
+    input->add_file(dir + "/file" + std::to_string(i), fsize);
+    size += fsize;
+  }
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 20;
+
+  scanner_options options;
+  options.file_order.mode = file_order_mode::NILSIMSA;
+  options.inode.with_nilsimsa = true;
+
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+  lgr.set_policy<prod_logger_policy>();
+
+  std::map<std::string, std::pair<double, double>> stages;
+
+  for (auto _ : state) {
+    worker_group wg("writer", 4);
+
+    scanner s(lgr, wg, cfg, entry_factory::create(), input,
+              std::make_shared<test::script_mock>(), options);
+
+    std::ostringstream oss;
+    progress prog([](const progress&, bool) {}, 1000);
+
+#ifdef DWARFS_HAVE_LIBZSTD
+    block_compressor bc("zstd:level=3");
+#else
+    block_compressor bc("null");
+#endif
+    filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+    s.scan(fsw, "", prog);
+
+    for (auto const& st : prog.stages()) {
+      auto& t = stages[st.name];
+      t.first += st.wall_time;
+      t.second += st.cpu_time;
+    }
+
+    ::benchmark::DoNotOptimize(oss.str());
+  }
+
+  for (auto const& [name, t] : stages) {
+    state.counters[name + "_wall"] =
+        ::benchmark::Counter(t.first, ::benchmark::Counter::kAvgIterations);
+    state.counters[name + "_cpu"] =
+        ::benchmark::Counter(t.second, ::benchmark::Counter::kAvgIterations);
+  }
+
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
 void dwarfs_initialize(::benchmark::State& state) {
   auto image = make_filesystem(state);
   stream_logger lgr;
@@ -439,6 +758,157 @@ BENCHMARK_DEFINE_F(filesystem, readv_future_large)(::benchmark::State& state) {
   readv_future_bench(state, "/ipsum.txt");
 }
 
+std::array<char const*, 3> const concurrent_compressions{{
+    "null",
+#ifdef DWARFS_HAVE_LIBLZ4
+    "lz4",
+#else
+    "null",
+#endif
+#ifdef DWARFS_HAVE_LIBZSTD
+    "zstd:level=3",
+#else
+    "null",
+#endif
+}};
+
+// Arguments: block size bits, compression index, cache size as a percentage
+// of the file system data (i.e. roughly the hit ratio for random reads),
+// decompress ratio in percent
+void ConcurrentReadParams(::benchmark::internal::Benchmark* b) {
+  for (auto block_size_bits : {16, 20}) {
+    for (size_t compression = 0; compression < concurrent_compressions.size();
+         ++compression) {
+      for (auto hit_ratio : {10, 50, 100}) {
+        for (auto decompress_ratio : {80, 100}) {
+          b->Args({block_size_bits, static_cast<int64_t>(compression),
+                   hit_ratio, decompress_ratio});
+        }
+      }
+    }
+  }
+  b->ThreadRange(1, 8)->UseRealTime();
+}
+
+class concurrent_filesystem {
+ public:
+  static constexpr size_t NUM_FILES = 16;
+  static constexpr size_t FILE_SIZE = 1 << 20;
+
+  explicit concurrent_filesystem(::benchmark::State const& state) {
+    block_manager::config cfg;
+    cfg.blockhash_window_size = 0;
+    cfg.block_size_bits = state.range(0);
+
+    auto input = std::make_shared<test::os_access_mock>();
+    input->add_dir("");
+    for (size_t i = 0; i < NUM_FILES; ++i) {
+      input->add_file(std::to_string(i), FILE_SIZE);
+    }
+
+    worker_group wg("writer", 4);
+    std::ostringstream logss;
+    stream_logger lgr(logss);
+    lgr.set_policy<prod_logger_policy>();
+
+    scanner s(lgr, wg, cfg, entry_factory::create(), input,
+              std::make_shared<test::script_mock>(), scanner_options());
+
+    std::ostringstream oss;
+    progress prog([](const progress&, bool) {}, 1000);
+    block_compressor bc(concurrent_compressions[state.range(1)]);
+    filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+    s.scan(fsw, "", prog);
+
+    image_ = oss.str();
+
+    filesystem_options opts;
+    opts.block_cache.max_bytes = NUM_FILES * FILE_SIZE * state.range(2) / 100;
+    opts.block_cache.num_workers = 4;
+    opts.block_cache.decompress_ratio = state.range(3) / 100.0;
+
+    fs_ = std::make_unique<filesystem_v2>(
+        lgr_, std::make_shared<test::mmap_mock>(image_), opts);
+
+    for (size_t i = 0; i < NUM_FILES; ++i) {
+      auto path = "/" + std::to_string(i);
+      inodes_.push_back(fs_->open(*fs_->find(path.c_str())));
+    }
+  }
+
+  // All threads of a benchmark run share one file system instance and
+  // thus one block cache, which is the whole point of these benchmarks.
+  static concurrent_filesystem& get(::benchmark::State const& state) {
+    using key_type = std::tuple<int64_t, int64_t, int64_t, int64_t>;
+    static std::mutex mx;
+    static std::map<key_type, std::unique_ptr<concurrent_filesystem>> cache;
+
+    std::lock_guard lock(mx);
+    auto& fs = cache[{state.range(0), state.range(1), state.range(2),
+                      state.range(3)}];
+    if (!fs) {
+      fs = std::make_unique<concurrent_filesystem>(state);
+    }
+    return *fs;
+  }
+
+  filesystem_v2 const& fs() const { return *fs_; }
+  std::vector<int> const& inodes() const { return inodes_; }
+
+ private:
+  stream_logger lgr_;
+  std::string image_;
+  std::unique_ptr<filesystem_v2> fs_;
+  std::vector<int> inodes_;
+};
+
+template <typename ReadFn>
+void concurrent_read_bench(::benchmark::State& state, size_t read_size,
+                           ReadFn&& read) {
+  auto& cfs = concurrent_filesystem::get(state);
+  auto const& inodes = cfs.inodes();
+  std::mt19937_64 rng(
+      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::uniform_int_distribution<size_t> file_dist(0, inodes.size() - 1);
+  std::uniform_int_distribution<off_t> off_dist(
+      0, concurrent_filesystem::FILE_SIZE - read_size);
+
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(
+        read(cfs.fs(), inodes[file_dist(rng)], off_dist(rng)));
+  }
+
+  state.SetBytesProcessed(state.iterations() * read_size);
+}
+
+void concurrent_read(::benchmark::State& state) {
+  constexpr size_t read_size = 4096;
+  std::vector<char> buf(read_size);
+  concurrent_read_bench(state, read_size,
+                        [&](filesystem_v2 const& fs, int inode, off_t off) {
+                          return fs.read(inode, buf.data(), read_size, off);
+                        });
+}
+
+void concurrent_readv(::benchmark::State& state) {
+  constexpr size_t read_size = 4096;
+  concurrent_read_bench(state, read_size,
+                        [&](filesystem_v2 const& fs, int inode, off_t off) {
+                          iovec_read_buf buf;
+                          return fs.readv(inode, buf, read_size, off);
+                        });
+}
+
+void concurrent_read_large(::benchmark::State& state) {
+  constexpr size_t read_size = 256 << 10;
+  std::vector<char> buf(read_size);
+  concurrent_read_bench(state, read_size,
+                        [&](filesystem_v2 const& fs, int inode, off_t off) {
+                          return fs.read(inode, buf.data(), read_size, off);
+                        });
+}
+
 } // namespace
 
 BENCHMARK(frozen_legacy_string_table_lookup);
@@ -449,6 +919,33 @@ BENCHMARK(frozen_string_table_lookup)
     ->Args({true, false})
     ->Args({true, true});
 
+BENCHMARK(rsync_hash_bytewise);
+
+BENCHMARK(rsync_hash_batch)->Arg(16)->Arg(64)->Arg(256);
+
+BENCHMARK(block_compress)->Apply(CodecParams)->Unit(::benchmark::kMillisecond);
+
+BENCHMARK(block_decompress)
+    ->Apply(CodecParams)
+    ->Unit(::benchmark::kMillisecond);
+
+BENCHMARK(bloom_filter_probe)->DenseRange(2, 6, 2);
+
+BENCHMARK(offset_table_lookup)->Range(1 << 8, 1 << 16);
+
+BENCHMARK(extend_match_bench)->Range(1 << 13, 1 << 18);
+
+BENCHMARK(nilsimsa_update);
+
+BENCHMARK(nilsimsa_similarity);
+
+BENCHMARK(mkdwarfs_pipeline)
+    ->Arg(4)
+    ->Arg(16)
+    ->Arg(64)
+    ->Unit(::benchmark::kMillisecond)
+    ->UseRealTime();
+
 BENCHMARK(dwarfs_initialize)->Apply(PackParams);
 
 BENCHMARK_REGISTER_F(filesystem, find_inode)->Apply(PackParams);
@@ -474,4 +971,8 @@ BENCHMARK_REGISTER_F(filesystem, readv_large)->Apply(PackParamsNone);
 BENCHMARK_REGISTER_F(filesystem, readv_future_small)->Apply(PackParamsNone);
 BENCHMARK_REGISTER_F(filesystem, readv_future_large)->Apply(PackParamsNone);
 
+BENCHMARK(concurrent_read)->Apply(ConcurrentReadParams);
+BENCHMARK(concurrent_readv)->Apply(ConcurrentReadParams);
+BENCHMARK(concurrent_read_large)->Apply(ConcurrentReadParams);
+
 BENCHMARK_MAIN();
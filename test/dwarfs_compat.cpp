@@ -38,6 +38,7 @@
 #include <folly/json.h>
 
 #include "dwarfs/block_compressor.h"
+#include "dwarfs/error.h"
 #include "dwarfs/filesystem_extractor.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
@@ -1031,6 +1032,10 @@ void check_dynamic(std::string const& version, filesystem_v2 const& fs) {
     ref = folly::parseJson(reference);
   }
   EXPECT_EQ(ref, meta);
+
+  std::ostringstream oss;
+  fs.write_metadata_as_json(oss);
+  EXPECT_EQ(ref, folly::parseJson(oss.str()));
 }
 
 TEST_P(compat_metadata, backwards_compat) {
@@ -1101,6 +1106,7 @@ TEST_P(rewrite, filesystem_rewrite) {
   rewrite_options opts;
   opts.recompress_block = recompress_block;
   opts.recompress_metadata = recompress_metadata;
+  opts.num_workers = 2;
 
   worker_group wg("rewriter", 2);
   block_compressor bc("null");
@@ -1206,6 +1212,69 @@ TEST_P(rewrite, filesystem_rewrite) {
     filesystem_v2 fs(lgr, mm);
     check_dynamic(version, fs);
   }
+
+  if (recompress_block) {
+    std::ostringstream rewritten5;
+
+    {
+      auto partial = opts;
+      partial.recompress_block_ranges = {{1, 2}};
+      filesystem_writer fsw(rewritten5, lgr, wg, prog, bc);
+      filesystem_v2::rewrite(lgr, prog, std::make_shared<mmap>(filename), fsw,
+                             partial);
+    }
+
+    {
+      auto mm = std::make_shared<test::mmap_mock>(rewritten5.str());
+      EXPECT_NO_THROW(filesystem_v2::identify(lgr, mm, idss));
+      filesystem_v2 fs(lgr, mm);
+      check_dynamic(version, fs);
+    }
+  }
+
+  if (!recompress_block && !recompress_metadata) {
+    std::ostringstream rewritten6;
+    auto rebuild = opts;
+    metadata_rebuild_options mro;
+    mro.uid = 0;
+    mro.gid = 0;
+    mro.timestamp = 4711;
+    mro.pack_chunk_table = true;
+    mro.pack_directories = true;
+    mro.pack_shared_files_table = true;
+    mro.pack_names = true;
+    mro.pack_symlinks = true;
+    rebuild.rebuild_metadata = mro;
+
+    filesystem_writer fsw(rewritten6, lgr, wg, prog, bc);
+
+    if (version == "0.2.0" or version == "0.2.3") {
+      EXPECT_THROW(filesystem_v2::rewrite(lgr, prog,
+                                          std::make_shared<mmap>(filename),
+                                          fsw, rebuild),
+                   runtime_error);
+    } else {
+      filesystem_v2::rewrite(lgr, prog, std::make_shared<mmap>(filename), fsw,
+                             rebuild);
+
+      filesystem_v2 orig(lgr, std::make_shared<mmap>(filename));
+      filesystem_v2 fs(lgr,
+                       std::make_shared<test::mmap_mock>(rewritten6.str()));
+      std::vector<std::string> orig_paths, paths;
+
+      orig.walk([&](auto e) { orig_paths.push_back(e.path()); });
+      fs.walk([&](auto e) {
+        struct ::stat st;
+        ASSERT_EQ(0, fs.getattr(e.inode(), &st));
+        EXPECT_EQ(0, st.st_uid);
+        EXPECT_EQ(0, st.st_gid);
+        EXPECT_EQ(4711, st.st_mtime);
+        paths.push_back(e.path());
+      });
+
+      EXPECT_EQ(orig_paths, paths);
+    }
+  }
 }
 
 INSTANTIATE_TEST_SUITE_P(dwarfs, rewrite,
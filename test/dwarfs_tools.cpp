@@ -347,4 +347,24 @@ TEST(tools, everything) {
   ASSERT_TRUE(std::filesystem::create_directory(untared));
   ASSERT_TRUE(check_run(tar_bin, "xf", tarfile, "-C", untared));
   ASSERT_TRUE(check_run(diff_bin, "-qruN", data_dir, untared));
+
+  auto image_arch = td / "test_arch.dwarfs";
+  auto extracted_arch = td / "extracted_arch";
+
+  ASSERT_TRUE(check_run(mkdwarfs_bin, "-i", data_archive, "--input-archive",
+                        "-o", image_arch, "--no-progress"));
+  ASSERT_TRUE(std::filesystem::create_directory(extracted_arch));
+  ASSERT_TRUE(
+      check_run(dwarfsextract_bin, "-i", image_arch, "-o", extracted_arch));
+  ASSERT_TRUE(check_run(diff_bin, "-qruN", data_dir, extracted_arch / "data"));
+
+  auto image_repack = td / "test_repack.dwarfs";
+  auto extracted_repack = td / "extracted_repack";
+
+  ASSERT_TRUE(check_run(mkdwarfs_bin, "-i", image, "-o", image_repack,
+                        "--no-progress", "--order=path", "-S", "16"));
+  ASSERT_TRUE(std::filesystem::create_directory(extracted_repack));
+  ASSERT_TRUE(
+      check_run(dwarfsextract_bin, "-i", image_repack, "-o", extracted_repack));
+  ASSERT_TRUE(check_run(diff_bin, "-qruN", data_dir, extracted_repack));
 }
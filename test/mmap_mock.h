@@ -42,6 +42,12 @@ class mmap_mock : public mmif {
   boost::system::error_code release_until(off_t) override {
     return boost::system::error_code();
   }
+  boost::system::error_code advise_sequential(off_t, size_t) override {
+    return boost::system::error_code();
+  }
+  boost::system::error_code advise_willneed(off_t, size_t) override {
+    return boost::system::error_code();
+  }
 
  private:
   const std::string m_data;
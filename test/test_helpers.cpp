@@ -19,6 +19,7 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
@@ -364,6 +365,32 @@ os_access_mock::map_file(const std::string& path, size_t size) const {
   throw std::runtime_error("oops");
 }
 
+std::vector<std::pair<size_t, size_t>>
+os_access_mock::data_extents(const std::string& path, size_t size) const {
+  // all-zero pages are treated like holes
+  static constexpr size_t kPageSize = 4096;
+  std::vector<std::pair<size_t, size_t>> extents;
+  auto mm = map_file(path, size);
+  auto p = mm->as<char>();
+
+  for (size_t off = 0; off < size; off += kPageSize) {
+    auto len = std::min(kPageSize, size - off);
+
+    if (std::all_of(p + off, p + off + len, [](char c) { return c == 0; })) {
+      continue;
+    }
+
+    if (!extents.empty() &&
+        extents.back().first + extents.back().second == off) {
+      extents.back().second += len;
+    } else {
+      extents.emplace_back(off, len);
+    }
+  }
+
+  return extents;
+}
+
 int os_access_mock::access(const std::string&, int) const { return 0; }
 
 std::optional<std::filesystem::path> find_binary(std::string_view name) {
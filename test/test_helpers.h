@@ -67,6 +67,9 @@ class os_access_mock : public os_access {
   std::shared_ptr<mmif>
   map_file(const std::string& path, size_t size) const override;
 
+  std::vector<std::pair<size_t, size_t>>
+  data_extents(const std::string& path, size_t size) const override;
+
   int access(const std::string&, int) const override;
 
  private:
@@ -92,6 +95,7 @@ class script_mock : public script {
   bool has_filter() const override { return true; }
   bool has_transform() const override { return true; }
   bool has_order() const override { return true; }
+  bool has_categorize() const override { return false; }
 
   void configure(options_interface const& /*oi*/) override {}
 
@@ -104,6 +108,8 @@ class script_mock : public script {
   void order(inode_vector& /*iv*/) override {
     // do nothing
   }
+
+  std::string categorize(entry_interface const& /*ei*/) override { return {}; }
 };
 
 struct simplestat {
@@ -36,7 +36,8 @@ typedef i64 (cpp2.type = "uint64_t") UInt64
  * block.
  */
 struct chunk {
-   1: required UInt32 block,       // file system block number
+   1: required UInt32 block,       // file system block number, or
+                                   // 0xFFFFFFFF for a hole
    2: required UInt32 offset,      // offset from start of block, in bytes
    3: required UInt32 size,        // size of chunk, in bytes
 }
@@ -140,6 +141,11 @@ struct fs_options {
    3: required bool   packed_chunk_table,
    4: required bool   packed_directories,
    5: required bool   packed_shared_files_table,
+
+   // names and symlinks are stored in separate METADATA_V2_NAMES and
+   // METADATA_V2_SYMLINKS sections instead of `compact_names` and
+   // `compact_symlinks`
+   6: optional bool   separate_string_tables,
 }
 
 /**
@@ -344,4 +350,12 @@ struct metadata {
   24: optional string_table     compact_names,
 
   25: optional string_table     compact_symlinks,
+
+   // number of blocks stored in an external reference image; the first
+   // `reference_block_count` block numbers refer to blocks of that image
+  26: optional UInt32           reference_block_count,
+
+   // digest over the checksums of all reference image blocks, used to
+   // make sure the image is used with the right reference image
+  27: optional UInt64           reference_block_digest,
 }